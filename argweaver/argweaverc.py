@@ -116,6 +116,17 @@ if argweaverclib:
          C.c_char_p_p, "seqs", C.c_int, "nseqs", C.c_int, "seqlen",
          C.c_bool, "prior_given", C.c_double_list, "prior",
          C.c_bool, "internal", C.c_bool, "slow"])
+    argweaver_forward_alg_buffer = export(
+        argweaverclib, "arghmm_forward_alg_buffer", C.c_double_p,
+        [C.c_void_p, "trees", C.c_double_list, "times", C.c_int, "ntimes",
+         C.c_double_matrix, "popsizes", C.c_double, "rho", C.c_double, "mu",
+         C.c_char_p_p, "seqs", C.c_int, "nseqs", C.c_int, "seqlen",
+         C.c_bool, "prior_given", C.c_double_list, "prior",
+         C.c_bool, "internal", C.c_bool, "slow",
+         C.c_out(C.c_int_list), "stride"])
+    delete_double_buffer = export(
+        argweaverclib, "delete_double_buffer", None,
+        [C.c_double_p, "buffer"])
     delete_double_matrix = export(
         argweaverclib, "delete_double_matrix", C.c_int,
         [C.c_double_p_p, "mat", C.c_int, "nrows"])
@@ -138,6 +149,21 @@ if argweaverclib:
         [C.c_void_p, "trees", C.c_double_list, "times", C.c_int, "ntimes",
          C.c_double_list, "popsizes", C.c_double, "rho", C.c_double, "mu",
          C.c_char_p_p, "seqs", C.c_int, "nseqs", C.c_int, "seqlen"])
+    argweaver_sample_thread_paths = export(
+        argweaverclib, "arghmm_sample_thread_paths", C.c_int,
+        [C.c_void_p, "trees", C.c_double_list, "times", C.c_int, "ntimes",
+         C.c_double_matrix, "popsizes", C.c_double, "rho", C.c_double, "mu",
+         C.c_char_p_p, "seqs", C.c_int, "nseqs", C.c_int, "seqlen",
+         C.c_int, "npaths",
+         C.c_out(C.c_int_matrix), "path_nodes",
+         C.c_out(C.c_int_matrix), "path_times"])
+    argweaver_sample_thread_paths_buffer = export(
+        argweaverclib, "arghmm_sample_thread_paths_buffer", None,
+        [C.c_void_p, "trees", C.c_double_list, "times", C.c_int, "ntimes",
+         C.c_double_matrix, "popsizes", C.c_double, "rho", C.c_double, "mu",
+         C.c_char_p_p, "seqs", C.c_int, "nseqs", C.c_int, "seqlen",
+         C.c_int, "npaths",
+         C.c_int_buffer, "path_nodes", C.c_int_buffer, "path_times"])
     argweaver_sample_arg_thread_internal = export(
         argweaverclib, "arghmm_sample_arg_thread_internal", C.c_int,
         [C.c_void_p, "trees", C.c_double_list, "times", C.c_int, "ntimes",
@@ -260,6 +286,11 @@ if argweaverclib:
         [C.c_int_matrix, "ptrees", C.c_int_matrix, "ages",
          C.c_int_matrix, "sprs", C.c_int_list, "blocklens",
          C.c_int, "ntrees", C.c_int, "nnodes", C.c_int, "start_coord"])
+    argweaver_new_trees_buffer = export(
+        argweaverclib, "arghmm_new_trees_buffer", C.c_void_p,
+        [C.c_int_buffer, "ptrees", C.c_int_buffer, "ages",
+         C.c_int_buffer, "sprs", C.c_int_buffer, "blocklens",
+         C.c_int, "ntrees", C.c_int, "nnodes", C.c_int, "start_coord"])
     argweaver_copy_trees = export(
         argweaverclib, "arghmm_copy_trees", C.c_void_p,
         [C.c_void_p, "trees"])
@@ -545,6 +576,42 @@ def argweaver_forward_algorithm(arg, seqs, rho=1.5e-8,
     return probs
 
 
+def argweaver_forward_algorithm_array(arg, seqs, rho=1.5e-8,
+                                      mu=2.5e-8, popsize=1e4, times=None,
+                                      ntimes=20, maxtime=180000,
+                                      prior=[], internal=False, slow=False):
+    """
+    Run the forward algorithm, returning its table as a NumPy array
+
+    The array (seqlen x stride) is a view of the table computed by the C
+    library, which is freed with the array.  Row i holds the forward
+    probabilities of the states of position i, padded with zeros to the
+    number of states of the largest local tree.
+    """
+    if times is None:
+        times = argweaver.get_time_points(
+            ntimes=ntimes, maxtime=maxtime, delta=.01)
+    popsizes = [[popsize] * len(times)]
+
+    if is_carg(arg):
+        trees, names = arg
+    else:
+        trees, names = arg2ctrees(arg, times)
+
+    seqs2 = [seqs[node] for node in names]
+    for name in list(seqs.keys()):
+        if name not in names:
+            seqs2.append(seqs[name])
+    seqlen = len(seqs2[0])
+
+    stride = [0]
+    fw = argweaver_forward_alg_buffer(
+        trees, times, len(times), popsizes, rho, mu,
+        (C.c_char_p * len(seqs2))(*seqs2), len(seqs2), seqlen,
+        len(prior) > 0, prior, internal, slow, stride)
+    return C.numpy_view(fw, (seqlen, stride[0]), delete_double_buffer)
+
+
 #=============================================================================
 # sampling ARG threads
 
@@ -581,6 +648,83 @@ def sample_thread(arg, seqs, rho=1.5e-8, mu=2.5e-8, popsize=1e4,
     return arg
 
 
+def sample_thread_paths(arg, seqs, npaths, rho=1.5e-8, mu=2.5e-8,
+                        popsize=1e4, times=None, ntimes=20, maxtime=200000,
+                        verbose=False):
+    """
+    Sample several threads of the sequence missing from arg.
+
+    All threads are drawn from the same forward table, so sampling npaths
+    threads costs one forward pass.  Returns a list of npaths paths, where
+    each path gives a (node, time index) state for every position.  Nodes
+    are numbered as in the C local trees.
+    """
+    if times is None:
+        times = argweaver.get_time_points(
+            ntimes=ntimes, maxtime=maxtime, delta=.01)
+    popsizes = [[popsize] * len(times)]
+
+    if verbose:
+        util.tic("sample thread paths")
+
+    trees, names = arg2ctrees(arg, times)
+
+    seqs2 = [seqs[name] for name in names]
+    new_name = [x for x in list(seqs.keys()) if x not in names][0]
+    seqs2.append(seqs[new_name])
+    seqlen = len(seqs2[0])
+
+    path_nodes = [[0] * seqlen for k in range(npaths)]
+    path_times = [[0] * seqlen for k in range(npaths)]
+    argweaver_sample_thread_paths(
+        trees, times, len(times), popsizes, rho, mu,
+        (C.c_char_p * len(seqs2))(*seqs2), len(seqs2), seqlen, npaths,
+        path_nodes, path_times)
+    paths = [list(zip(path_nodes[k][:seqlen], path_times[k][:seqlen]))
+             for k in range(npaths)]
+    delete_local_trees(trees)
+
+    if verbose:
+        util.toc()
+
+    return paths
+
+
+def sample_thread_paths_array(arg, seqs, npaths, rho=1.5e-8, mu=2.5e-8,
+                              popsize=1e4, times=None, ntimes=20,
+                              maxtime=200000):
+    """
+    Sample several threads of the sequence missing from arg, as
+    sample_thread_paths().
+
+    Returns two NumPy arrays (npaths x seqlen) of the nodes and time
+    indices of the paths, which are written by the C library in place.
+    """
+    import numpy
+
+    if times is None:
+        times = argweaver.get_time_points(
+            ntimes=ntimes, maxtime=maxtime, delta=.01)
+    popsizes = [[popsize] * len(times)]
+
+    trees, names = arg2ctrees(arg, times)
+
+    seqs2 = [seqs[name] for name in names]
+    new_name = [x for x in list(seqs.keys()) if x not in names][0]
+    seqs2.append(seqs[new_name])
+    seqlen = len(seqs2[0])
+
+    path_nodes = numpy.zeros((npaths, seqlen), dtype=numpy.intc)
+    path_times = numpy.zeros((npaths, seqlen), dtype=numpy.intc)
+    argweaver_sample_thread_paths_buffer(
+        trees, times, len(times), popsizes, rho, mu,
+        (C.c_char_p * len(seqs2))(*seqs2), len(seqs2), seqlen, npaths,
+        path_nodes, path_times)
+    delete_local_trees(trees)
+
+    return path_nodes, path_times
+
+
 '''
 def sample_posterior(model, n, verbose=False):
 
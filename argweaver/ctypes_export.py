@@ -16,6 +16,7 @@ from ctypes import c_float
 from ctypes import c_int
 from ctypes import cast
 from ctypes import cdll
+from ctypes import sizeof
 from ctypes import POINTER
 c_void_p  # pyflaskes ignore
 
@@ -35,6 +36,45 @@ def c_matrix(c_type, mat):
     return cast(mat, POINTER(POINTER(c_type)))
 
 
+def c_buffer(c_type, values):
+    """
+    Make a C array from a NumPy array without copying it
+
+    The array must be C contiguous and of the same type as c_type, so
+    that the C function reads and writes its memory directly.  Other
+    sequences, including nested lists, are flattened and copied.
+    """
+    if hasattr(values, "ctypes"):
+        if (not values.flags["C_CONTIGUOUS"] or
+                values.dtype.itemsize != sizeof(c_type) or
+                values.dtype.kind != _buffer_kinds[c_type]):
+            raise ValueError("array must be C contiguous and of type %s" %
+                             c_type.__name__)
+        return values.ctypes.data_as(POINTER(c_type))
+
+    flat = []
+    for row in values:
+        if isinstance(row, (list, tuple)):
+            flat.extend(row)
+        else:
+            flat.append(row)
+    return c_list(c_type, flat)
+
+
+def numpy_view(ptr, shape, free):
+    """
+    Make a NumPy array of the memory of a C array
+
+    free(ptr) is called once the array is no longer referenced.
+    """
+    import numpy
+    import weakref
+
+    array = numpy.ctypeslib.as_array(ptr, shape=shape)
+    weakref.finalize(array, free, ptr)
+    return array
+
+
 class c_out (object):
     """
     This wrapper object specifies that an argument should be used for output
@@ -67,6 +107,11 @@ c_double_list = (c_double_p, lambda x: c_list(c_double, x))
 c_double_matrix = (c_double_p_p, lambda x: c_matrix(c_double, x))
 c_char_p_list = (c_char_p_p, lambda x: c_list(c_char_p, x))
 
+# zero-copy buffer types for NumPy arrays
+_buffer_kinds = {c_int: "i", c_double: "f"}
+c_int_buffer = (c_int_p, lambda x: c_buffer(c_int, x))
+c_double_buffer = (c_double_p, lambda x: c_buffer(c_double, x))
+
 
 class Exporter (object):
 
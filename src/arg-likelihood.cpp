@@ -2,7 +2,10 @@
 #ifdef ARGWEAVER_MPI
 #include "mpi.h"
 #endif
+#include <glob.h>
 #include <time.h>
+#include <algorithm>
+#include <map>
 #include <memory>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -25,6 +28,7 @@
 #include "argweaver/recomb.h"
 #include "argweaver/model.h"
 #include "argweaver/local_tree.h"
+#include "argweaver/thread_pool.h"
 
 using namespace argweaver;
 
@@ -97,6 +101,16 @@ public:
         config.add(new ConfigParam<string>
                    ("-a", "--arg", "<SMC file>", &arg_file, "",
                     "initial ARG file (*.smc) for resampling"));
+        config.add(new ConfigParam<string>
+                   ("", "--arg-glob", "<pattern>", &arg_glob, "",
+                    "compute likelihoods of all SMC files matching a glob"
+                    " pattern (quote it), such as 'out.*.smc.gz'. The MCMC"
+                    " rep of each file is read from its name"
+                    " (<base>.<rep>.smc.gz)"));
+        config.add(new ConfigParam<string>
+                   ("", "--arg-list", "<file>", &arg_list, "",
+                    "like --arg-glob, for the SMC files listed in a file,"
+                    " one per line"));
         config.add(new ConfigParam<string>
                    ("", "--region", "<start>-<end>",
                     &region, "",
@@ -155,6 +169,11 @@ public:
         config.add(new ConfigSwitch
                    ("", "--overwrite", &overwrite,
                     "overwrite output file (default: append)"));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<# of threads>", &nthreads, 1,
+                    "number of threads: SMC files evaluated at once with"
+                    " --arg-glob or --arg-list, or else threads computing"
+                    " the trees of the ARG"));
 
         // help information
         config.add(new ConfigParamComment("Information"));
@@ -202,6 +221,8 @@ public:
     string subsites_file;
     string outfile_name;
     string arg_file;
+    string arg_glob;
+    string arg_list;
     string region;
     string log_file;
     string regions_bed_file;
@@ -219,6 +240,7 @@ public:
 
     // misc
     int randseed;
+    int nthreads;
 
     // help/information
     bool quiet;
@@ -327,7 +349,7 @@ bool read_init_arg(const char *arg_file, const ArgModel *model,
 void print_arg_likelihood(const ArgModel *model,
                           const Sequences *sequences,
                           const LocalTrees *trees,
-                          const Config *c,
+                          FILE *out, int mcmc_rep,
                           const Region *region,
                           const vector<int> &invisible_recomb_pos,
                           const vector<Spr> &invisible_recombs,
@@ -358,8 +380,8 @@ void print_arg_likelihood(const ArgModel *model,
         if (curr_start >= end) break;
         if (curr_end != end) nrecomb++;
     }
-    fprintf(c->outfile, "%s\t%i\t%i\t%i\t%f\t%f\t%f\t%i\t%i", region->chrom.c_str(),
-            region->start, region->end, c->mcmc_rep, prior, prior2, like,
+    fprintf(out, "%s\t%i\t%i\t%i\t%f\t%f\t%f\t%i\t%i", region->chrom.c_str(),
+            region->start, region->end, mcmc_rep, prior, prior2, like,
             nrecomb, noncompat);
 
     for (unsigned int i=0; i < migevents.size(); i++) {
@@ -401,14 +423,22 @@ void print_arg_likelihood(const ArgModel *model,
                 else count[0]++;
             }
         }
-        fprintf(c->outfile, "\t%i\t%i", count[1], count[0]);
+        fprintf(out, "\t%i\t%i", count[1], count[0]);
 
     }
-    fprintf(c->outfile, "\n");
+    fprintf(out, "\n");
 
 }
 
-void parse_status_file(string log_file, int mcmc_rep, ArgModel *model) {
+// The resample lines of an arg-sample stats file, by MCMC iteration
+class StatusFile {
+public:
+    vector<string> header;
+    map<int, string> lines;
+};
+
+
+void read_status_file(string log_file, StatusFile *status) {
     char stat_filename[log_file.length()+3];
     strcpy(stat_filename, log_file.c_str());
     assert(strcmp(&stat_filename[strlen(stat_filename)-4], ".log")==0);
@@ -425,26 +455,207 @@ void parse_status_file(string log_file, int mcmc_rep, ArgModel *model) {
         exit(0);
     }
     chomp(line);
-    vector<string> header;
-    split(line, "\t", header);
+    split(line, "\t", status->header);
     delete [] line;
     while ((line = fgetline(stats_file))) {
         vector<string> tokens;
         split(line, "\t", tokens);
-        assert(tokens.size() == header.size());
-        if (tokens[0] != "resample") continue;
-        int iter;
-        if (sscanf(tokens[1].c_str(), "%d", &iter) != 1) {
-            printError("Error getting iter from stat file\n");
-            assert(0);
+        assert(tokens.size() == status->header.size());
+        if (tokens[0] == "resample") {
+            int iter;
+            if (sscanf(tokens[1].c_str(), "%d", &iter) != 1) {
+                printError("Error getting iter from stat file\n");
+                assert(0);
+            }
+            // the first line of an iteration is used
+            if (status->lines.find(iter) == status->lines.end())
+                status->lines[iter] = line;
         }
-        if (iter != mcmc_rep) continue;
-        model->init_params_from_statfile(header, line);
-        fclose(stats_file);
-        return;
+        delete [] line;
+    }
+    fclose(stats_file);
+}
+
+
+void set_status_params(const StatusFile &status, int mcmc_rep,
+                       ArgModel *model) {
+    map<int, string>::const_iterator it = status.lines.find(mcmc_rep);
+    if (it == status.lines.end()) {
+        printError("Did not find rep %i in stats file\n", mcmc_rep);
+        exit(0);
+    }
+    model->init_params_from_statfile(status.header, it->second.c_str());
+}
+
+
+void set_panmictic_popsize(ArgModel *model, double popsize) {
+    if (model->pop_tree != NULL) {
+        delete(model->pop_tree);
+        model->pop_tree = NULL;
     }
-    printError("Did not find rep %i in stats file\n", mcmc_rep);
-    exit(0);
+    model->free_popsizes();
+    model->set_popsizes(popsize);
+}
+
+
+// Writes the likelihood of an ARG file within each region, or within the
+// whole ARG on chrom if regions is empty
+bool write_arg_likelihoods(FILE *out, const char *arg_file, int mcmc_rep,
+                           const ArgModel *model, const Sequences *sequences,
+                           const string &chrom, const vector<Region> &regions,
+                           const SitesMapping *sites_mapping,
+                           double panmictic_popsize,
+                           const vector<class MigEvent> &migevents)
+{
+    LocalTrees trees;
+    vector<string> seqnames;
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    if (!read_init_arg(arg_file, model, &trees, seqnames,
+                       &invisible_recomb_pos, &invisible_recombs)) {
+        printError("could not read ARG %s", arg_file);
+        return false;
+    }
+    if (!trees.set_seqids(seqnames, sequences->names)) {
+        printError("input ARG's sequence names do not match input"
+                   " sequences");
+        return false;
+    }
+    if (panmictic_popsize > 0)
+        remove_population_paths(&trees);
+    vector<Region> arg_regions = regions;
+    if (arg_regions.empty())
+        arg_regions.push_back(Region(chrom, trees.start_coord,
+                                     trees.end_coord));
+    if (sites_mapping) {
+        compress_local_trees(&trees, sites_mapping);
+        for (unsigned int i=0; i < invisible_recomb_pos.size(); i++)
+            invisible_recomb_pos[i] = sites_mapping->compress(invisible_recomb_pos[i], 0,
+                                                              i==0 ? 0 : invisible_recomb_pos[i-1]);
+    }
+
+    printLog(LOG_LOW, "read input ARG %s (chrom=%s, start=%d, end=%d,"
+             " nseqs=%d)\n", arg_file,
+             trees.chrom.c_str(), trees.start_coord, trees.end_coord,
+             trees.get_num_leaves());
+
+    for (unsigned int i=0; i < arg_regions.size(); i++)
+        print_arg_likelihood(model, sequences, &trees, out, mcmc_rep,
+                             &arg_regions[i],
+                             invisible_recomb_pos, invisible_recombs,
+                             sites_mapping, migevents);
+    return true;
+}
+
+
+// Returns the MCMC rep of an arg-sample output file (<base>.<rep>.smc.gz)
+// or -1 if the name has no rep
+int guess_mcmc_rep(const string &arg_file) {
+    size_t suffix = arg_file.rfind(SMC_SUFFIX);
+    if (suffix == string::npos || suffix == 0)
+        return -1;
+    size_t dot = arg_file.rfind('.', suffix - 1);
+    if (dot == string::npos || dot + 1 == suffix)
+        return -1;
+    for (size_t i=dot+1; i < suffix; i++)
+        if (!isdigit(arg_file[i]))
+            return -1;
+    return atoi(arg_file.c_str() + dot + 1);
+}
+
+
+// Returns the SMC files of --arg-glob or --arg-list, sorted by MCMC rep
+bool get_batch_args(const Config &c, vector<pair<int, string> > *args)
+{
+    vector<string> files;
+    if (c.arg_glob != "") {
+        glob_t matches;
+        if (glob(c.arg_glob.c_str(), 0, NULL, &matches) != 0) {
+            printError("no SMC files match '%s'", c.arg_glob.c_str());
+            return false;
+        }
+        for (size_t i=0; i < matches.gl_pathc; i++)
+            files.push_back(matches.gl_pathv[i]);
+        globfree(&matches);
+    }
+    if (c.arg_list != "") {
+        FILE *infile = fopen(c.arg_list.c_str(), "r");
+        if (infile == NULL) {
+            printError("Could not open %s", c.arg_list.c_str());
+            return false;
+        }
+        char *line;
+        while (NULL != (line = fgetline(infile))) {
+            chomp(line);
+            if (line[0] != '\0')
+                files.push_back(line);
+            delete [] line;
+        }
+        fclose(infile);
+    }
+
+    for (unsigned int i=0; i < files.size(); i++) {
+        int rep = guess_mcmc_rep(files[i]);
+        if (rep == -1) {
+            printError("Could not get MCMC rep from file name %s",
+                       files[i].c_str());
+            return false;
+        }
+        args->push_back(make_pair(rep, files[i]));
+    }
+    sort(args->begin(), args->end());
+    return true;
+}
+
+
+// Writes the likelihoods of many SMC files, computed in parallel with a
+// copy of the model for the parameters of each MCMC rep.  Lines are
+// written in the order of the files.
+bool write_batch_likelihoods(const Config &c, const StatusFile &status,
+                             const vector<pair<int, string> > &args,
+                             const Sequences *sequences,
+                             const string &chrom,
+                             const vector<Region> &regions,
+                             const SitesMapping *sites_mapping,
+                             const vector<class MigEvent> &migevents)
+{
+    const int nargs = args.size();
+    vector<char*> texts(nargs, NULL);
+    vector<size_t> sizes(nargs, 0);
+    vector<int> ok(nargs, 0);
+
+    auto evaluate = [&](int i) {
+        ArgModel model(*c.model);
+        set_status_params(status, args[i].first, &model);
+        if (c.panmictic_popsize > 0)
+            set_panmictic_popsize(&model, c.panmictic_popsize);
+        FILE *out = open_memstream(&texts[i], &sizes[i]);
+        if (out == NULL)
+            return;
+        ok[i] = write_arg_likelihoods(out, args[i].second.c_str(),
+                                      args[i].first, &model, sequences,
+                                      chrom, regions, sites_mapping,
+                                      c.panmictic_popsize, migevents);
+        fclose(out);
+    };
+    ThreadPool *pool = get_thread_pool(c.nthreads);
+    if (pool)
+        pool->run(nargs, evaluate);
+    else {
+        for (int i=0; i<nargs; i++)
+            evaluate(i);
+    }
+
+    bool all_ok = true;
+    for (int i=0; i<nargs; i++) {
+        if (ok[i])
+            fwrite(texts[i], 1, sizes[i], c.outfile);
+        else
+            all_ok = false;
+        free(texts[i]);
+    }
+    printLog(LOG_LOW, "computed likelihoods of %d ARGs\n", nargs);
+    return all_ok;
 }
 
 
@@ -592,6 +803,7 @@ int main(int argc, char **argv)
         printLog(LOG_LOW, "masked %d (%.1f%%) sites\n", nmasked,
                  100.0 * nmasked / double(sequences.length()));
     }
+    sequences.pack();
 
 
     // setup model parameters
@@ -599,15 +811,17 @@ int main(int argc, char **argv)
         printError("--log-file is required\n");
         return EXIT_ERROR;
     }
+    // in batch mode, the parameters of each rep are set on a copy of the
+    // model for each SMC file
+    const bool batch = (c.arg_glob != "" || c.arg_list != "");
+    StatusFile status;
+    read_status_file(c.log_file, &status);
     c.model = new ArgModel(c.log_file.c_str());
-    parse_status_file(c.log_file, c.mcmc_rep, c.model);
-    if (c.panmictic_popsize > 0) {
-        if (c.model->pop_tree != NULL) {
-            delete(c.model->pop_tree);
-            c.model->pop_tree = NULL;
-        }
-        c.model->free_popsizes();
-        c.model->set_popsizes(c.panmictic_popsize);
+    if (!batch) {
+        c.model->nthreads = c.nthreads;
+        set_status_params(status, c.mcmc_rep, c.model);
+        if (c.panmictic_popsize > 0)
+            set_panmictic_popsize(c.model, c.panmictic_popsize);
     }
     // log model has compressed rates so un-compress them; they
     // will later be re-compressed
@@ -648,89 +862,29 @@ int main(int argc, char **argv)
 
     c.model->log_model();
 
-    // setup init ARG
-    LocalTrees *trees = NULL;
-    unique_ptr<LocalTrees> trees_ptr;
-    if (c.arg_file == "") {
+    vector<pair<int, string> > batch_args;
+    if (batch) {
+        if (c.arg_file != "") {
+            printError("--arg cannot be used with --arg-glob or --arg-list");
+            return EXIT_ERROR;
+        }
+        if (!get_batch_args(c, &batch_args))
+            return EXIT_ERROR;
+    } else if (c.arg_file == "") {
         printError("Error: --arg-file required\n");
         return EXIT_ERROR;
     }
-    // init ARG from file
-    trees = new LocalTrees();
-    trees_ptr = unique_ptr<LocalTrees>(trees);
-    vector<string> seqnames;
-    vector<int> invisible_recomb_pos;
-    vector<Spr> invisible_recombs;
-    if (!read_init_arg(c.arg_file.c_str(), c.model, trees, seqnames,
-                       &invisible_recomb_pos, &invisible_recombs)) {
-        printError("could not read ARG");
-        return EXIT_ERROR;
-    }
-    if (!trees->set_seqids(seqnames, sequences.names)) {
-        printError("input ARG's sequence names do not match input"
-                   " sequences");
-        return EXIT_ERROR;
-    }
-    if (c.panmictic_popsize > 0)
-        remove_population_paths(trees);
-    if (c.region == "" && c.regions_bed_file == "") {
-        char tmp[1000];
-        sprintf(tmp, "%i-%i", trees->start_coord+1, trees->end_coord);
-        c.region = string(tmp);
-    }
-    if (sites_mapping) {
-        compress_local_trees(trees, sites_mapping);
-        for (unsigned int i=0; i < invisible_recomb_pos.size(); i++)
-            invisible_recomb_pos[i] = sites_mapping->compress(invisible_recomb_pos[i], 0,
-                                                              i==0 ? 0 : invisible_recomb_pos[i-1]);
-    }
-
-    printLog(LOG_LOW, "read input ARG (chrom=%s, start=%d, end=%d,"
-             " nseqs=%d)\n",
-             trees->chrom.c_str(), trees->start_coord, trees->end_coord,
-             trees->get_num_leaves());
-
-    // get memory usage in MB
-    double maxrss = get_max_memory_usage() / 1000.0;
-    printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
-
-
-    if (!(c.outfile = fopen(c.outfile_name.c_str(),
-                            c.overwrite ? "w" : "a"))) {
-        printError("Could not open out file %s for writing\n",
-                   c.outfile_name.c_str());
-        return EXIT_ERROR;
-    }
-
-    if (c.overwrite) {
-        fprintf(c.outfile, "#chrom\tstart\tend\trep\tprior\tprior2\tlikelihood\tnrecomb\tncompat");
-        for (unsigned int i=0; i < migevents.size(); i++)
-            fprintf(c.outfile, "\t%s_1\t%s_0", migevents[i].name.c_str(),
-                    migevents[i].name.c_str());
-        fprintf(c.outfile, "\n");
-    }
-
-    // get likelihod
-    printLog(LOG_LOW, "\n");
 
+    // regions to compute the likelihood of; the whole ARG if empty
+    vector<Region> regions;
     if (c.region != "") {
         int start, end;
         if (!parse_region(c.region.c_str(), &start, &end)) {
             printError("Error parsing region string %s\n", c.region.c_str());
             return EXIT_ERROR;
         }
-        seq_region.start = start-1;
-        seq_region.end = end;
-
-        print_arg_likelihood(c.model, &sequences, trees, &c,
-                             &seq_region,
-                             invisible_recomb_pos, invisible_recombs,
-                             sites_mapping, migevents);
-    } else {
-        if (c.regions_bed_file == "") {
-            printError("Need to supply --region or --region-bed");
-            return EXIT_ERROR;
-        }
+        regions.push_back(Region(sites.chrom, start-1, end));
+    } else if (c.regions_bed_file != "") {
         FILE *bedfile;
         if (!(bedfile = fopen(c.regions_bed_file.c_str(), "r"))) {
             printError("Error opening bed file %s\n", c.regions_bed_file.c_str());
@@ -748,22 +902,50 @@ int main(int argc, char **argv)
                 printError("Should have at least three entries in each line of bed file");
                 return EXIT_ERROR;
             }
-            if (tokens[0] == sites.chrom) {
-                seq_region.start = atoi(tokens[1].c_str());
-                seq_region.end = atoi(tokens[2].c_str());
-                print_arg_likelihood(c.model, &sequences, trees, &c,
-                                     &seq_region,
-                                     invisible_recomb_pos, invisible_recombs,
-                                     sites_mapping, migevents);
-            }
+            if (tokens[0] == sites.chrom)
+                regions.push_back(Region(sites.chrom,
+                                         atoi(tokens[1].c_str()),
+                                         atoi(tokens[2].c_str())));
             delete [] line;
         }
         fclose(bedfile);
     }
-    // TODO: call in loop for bed file
+
+    if (!(c.outfile = fopen(c.outfile_name.c_str(),
+                            c.overwrite ? "w" : "a"))) {
+        printError("Could not open out file %s for writing\n",
+                   c.outfile_name.c_str());
+        return EXIT_ERROR;
+    }
+
+    if (c.overwrite) {
+        fprintf(c.outfile, "#chrom\tstart\tend\trep\tprior\tprior2\tlikelihood\tnrecomb\tncompat");
+        for (unsigned int i=0; i < migevents.size(); i++)
+            fprintf(c.outfile, "\t%s_1\t%s_0", migevents[i].name.c_str(),
+                    migevents[i].name.c_str());
+        fprintf(c.outfile, "\n");
+    }
+
+    // get likelihod
+    printLog(LOG_LOW, "\n");
+
+    bool ok;
+    if (batch)
+        ok = write_batch_likelihoods(c, status, batch_args, &sequences,
+                                     sites.chrom, regions, sites_mapping,
+                                     migevents);
+    else
+        ok = write_arg_likelihoods(c.outfile, c.arg_file.c_str(),
+                                   c.mcmc_rep, c.model, &sequences,
+                                   sites.chrom, regions, sites_mapping,
+                                   c.panmictic_popsize, migevents);
+    if (!ok) {
+        fclose(c.outfile);
+        return EXIT_ERROR;
+    }
 
     // final log message
-    maxrss = get_max_memory_usage() / 1000.0;
+    double maxrss = get_max_memory_usage() / 1000.0;
     printTimerLog(timer, LOG_LOW, "sampling time: ");
     printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
     printLog(LOG_LOW, "FINISH\n");
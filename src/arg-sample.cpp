@@ -4,19 +4,27 @@
 #endif
 #include <time.h>
 #include <memory>
+#include <thread>
 #include <sys/stat.h>
 #include <unistd.h>
 
 // arghmm includes
+#include "argweaver/checkpoint.h"
 #include "argweaver/compress.h"
+#include "argweaver/domains.h"
 #include "argweaver/ConfigParam.h"
 #include "argweaver/emit.h"
 #include "argweaver/fs.h"
+#include "argweaver/input_bundle.h"
 #include "argweaver/logging.h"
 #include "argweaver/mem.h"
 #include "argweaver/parsing.h"
+#include "argweaver/profile.h"
 #include "argweaver/sample_arg.h"
+#include "argweaver/sample_thread.h"
 #include "argweaver/sequences.h"
+#include "argweaver/simd.h"
+#include "argweaver/thread_pool.h"
 #include "argweaver/total_prob.h"
 #include "argweaver/track.h"
 #include "argweaver/est_popsize.h"
@@ -37,10 +45,14 @@ Sampler for large ancestral recombination graphs\n\
 
 // file extensions
 const char *SMC_SUFFIX = ".smc";
+const char *BINARY_SMC_SUFFIX = ".smcb";
 const char *SITES_SUFFIX = ".sites";
+const char *BINARY_SITES_SUFFIX = ".sites.bin";
 const char *STATS_SUFFIX = ".stats";
+const char *STATES_SUFFIX = ".states";
 const char *LOG_SUFFIX = ".log";
 const char *COAL_RECORDS_SUFFIX = ".cr";
+const char *CHECKPOINT_SUFFIX = ".checkpoint";
 
 // help categories
 const int ADVANCED_OPT = 1;
@@ -56,7 +68,9 @@ class Config
 {
 public:
 
-    Config()
+    Config() :
+        mc3_threads(NULL),
+        states_file(NULL)
     {
         make_parser();
 
@@ -96,6 +110,17 @@ public:
                     " The argument should be a file containing list of files to read"
                     " (one per line). All files should be aligned to same reference"
                     " genome"));
+        config.add(new ConfigParam<string>
+                   ("", "--bundle", "<bundle file>", &bundle_file,
+                    "read sites, masks and rate maps from a bundle written by"
+                    " --write-bundle instead of the original input files. Use"
+                    " the same --compress-seq and --compress-seq-max as when"
+                    " the bundle was written"));
+        config.add(new ConfigParam<string>
+                   ("", "--write-bundle", "<bundle file>", &write_bundle_file,
+                    "write the sites, masks and rate maps after all masking"
+                    " and compression to a binary bundle for --bundle, and"
+                    " exit"));
         config.add(new ConfigParam<string>
                    ("", "--rename-seqs", "<name_map_file.txt>", &rename_file,
                     "Used to rename sequences (usually from cryptic names in VCF"
@@ -229,6 +254,10 @@ public:
                    ("", "--mpi", &mpi, "this is an mpi run, add <rank>.sites"
                     " to sites file name and <rank>. to out root, and"
                     " <rank>.smc.gz to --arg option (if given)"));
+        config.add(new ConfigSwitch
+                   ("", "--domains", &domains, "this is an mpi run of one"
+                    " chain: each rank resamples a block of the genome, and"
+                    " rank 0 writes the outputs"));
 #endif
 
         // model parameters
@@ -246,6 +275,14 @@ public:
                    ("-R", "--recombmap", "<recombination rate map file>",
                     &recombmap, "",
                     "recombination map file (optional)"));
+        config.add(new ConfigParam<double>
+                   ("", "--map-tolerance", "<relative difference>",
+                    &map_tolerance, 0.0,
+                    "merge adjacent regions of the mutation and"
+                    " recombination maps whose rates differ by at most this"
+                    " fraction into one region of their mean rate, giving"
+                    " fewer HMM blocks (default=0, no merging)",
+                    ADVANCED_OPT));
 
         config.add(new ConfigParam<int>
                    ("-t", "--ntimes", "<ntimes>", &ntimes, 20,
@@ -375,16 +412,17 @@ public:
 		   ("", "--pseudocount", "<val>", &pseudocount,
 		    1.0, "(for use with --sample-popsize) gives weight to prior",
 		    EXPERIMENTAL_OPT));
-#ifdef ARGWEAVER_MPI
         config.add(new ConfigParam<int>
                    ("", "--mcmcmc", "<int>", &mcmcmc_numgroup,
-                    1, "number of mcmcmc threads",
+                    1, "number of mcmcmc threads.  The chain of heat group"
+                    " i writes its output to <output prefix>.i (group 0 to"
+                    " <output prefix>).  Without MPI, the chains run on"
+                    " threads of this process",
                     EXPERIMENTAL_OPT));
         config.add(new ConfigParam<double>
                    ("", "--mcmcmc-heat", "<val>", &mcmcmc_heat,
                     0.05, "heat interval for each thread in (MC)^3 group",
                     EXPERIMENTAL_OPT));
-#endif
         config.add(new ConfigSwitch
                    ("", "--init-popsize-random", &init_popsize_random,
                     "(for use with --sample-popsize). Initialize each"
@@ -403,6 +441,11 @@ public:
                     "region to resample of input ARG (optional)"));
         config.add(new ConfigSwitch
                    ("", "--resume", &resume, "resume a previous run"));
+        config.add(new ConfigSwitch
+                   ("", "--no-checkpoint", &no_checkpoint,
+                    "do not write a checkpoint with each sampled ARG. "
+                    "Without one, --resume restarts from the last ARG file"
+                    " and does not continue the run exactly"));
         config.add(new ConfigSwitch
                    ("", "--overwrite", &overwrite,
                     "force an overwrite of a previous run"));
@@ -418,18 +461,71 @@ public:
                    ("-c", "--compress-seq", "<compression factor>",
                     &compress_seq, 1,
                     "alignment compression factor (default=1)"));
+        config.add(new ConfigParam<int>
+                   ("", "--compress-seq-max", "<compression factor>",
+                    &compress_max, 0,
+                    "compress each segment of the alignment by a factor"
+                    " between --compress-seq and this one, chosen from its"
+                    " density of variant sites: segments with fewer variant"
+                    " sites than average, or masked, are compressed more."
+                    " Window and shard sizes are converted with"
+                    " --compress-seq (default=0, off)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<# of threads>", &model.nthreads, 1,
+                    "number of threads used for computing emissions of"
+                    " large blocks (default=1)"));
         config.add(new ConfigParam<int>
                    ("", "--climb", "<# of climb iterations>", &nclimb, 0,
                     "(default=0)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--climb-tries", "<# of tries>", &climb_tries, 1,
+                    "resample the ARG this many times at once on the threads"
+                    " of --threads in each climb iteration and keep the most"
+                    " probable (default=1)", ADVANCED_OPT));
         config.add(new ConfigParam<int>
 		   ("", "--num-buildup", "<# of buildup iterations>", &num_buildup,
                     1, "(default=0)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--shard-size", "<bases>", &shard_size, 0,
+                    "sample the initial ARG in shards of about <bases> bases"
+                    " on the threads of --threads and stitch them together"
+                    " (default=0, off)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--shard-overlap", "<bases>", &shard_overlap, 100000,
+                    "overlap of neighboring shards (default=100000)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--shard-iters", "<iterations>", &shard_iters, 10,
+                    "resampling iterations of each shard before stitching"
+                    " (default=10)", ADVANCED_OPT));
         config.add(new ConfigParam<int>
                    ("", "--sample-step", "<sample step size>", &sample_step,
                     10, "number of iterations between steps (default=10)"));
         config.add(new ConfigSwitch
                    ("", "--no-compress-output", &no_compress_output,
                     "do not gzip output files"));
+        config.add(new ConfigSwitch
+                   ("", "--stats-perf", &stats_perf,
+                    "add columns to the stats file for the wall time of each"
+                    " iteration and of its forward passes, the mean number"
+                    " of states and the number of blocks of the forward"
+                    " passes, and the peak and current memory use (MB)"));
+        config.add(new ConfigSwitch
+                   ("", "--stats-states", &stats_states,
+                    "write histograms of the state spaces of the forward"
+                    " passes of each iteration to <out>.states: blocks by"
+                    " number of states and of sites (bins of doubling"
+                    " width), switches between blocks by fraction of"
+                    " deterministic transitions, and the number of"
+                    " switches"));
+        config.add(new ConfigSwitch
+                   ("", "--binary-arg", &binary_arg,
+                    "write sampled ARGs in binary SMC format"
+                    " (<outroot>.<iter>.smcb), which loads faster"));
+        config.add(new ConfigSwitch
+                   ("", "--binary-sites", &binary_sites,
+                    "write sites in binary format (<outroot>.sites.bin),"
+                    " which loads faster"));
         config.add(new ConfigParam<int>
                    ("-x", "--randseed", "<random seed>", &randseed, 0,
                     "seed for random number generator (default=current time)"));
@@ -469,6 +565,56 @@ public:
                     &resample_window_iters, 10,
                     "number of iterations per sliding window for resampling"
                     " (default=10)", ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--parallel-windows", &model.parallel_windows,
+                    "resample non-overlapping sliding windows at the same"
+                    " time on the threads of --threads", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--fw-checkpoint", "<bases>",
+                    &model.fw_checkpoint, 0,
+                    "only store the forward table every <bases> bases and"
+                    " recompute it during traceback. Reduces memory for long"
+                    " sequences (a value near sqrt(seqlen) is best) at the"
+                    " cost of extra computation (default=0, off)",
+                    ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--fw-float", &model.fw_float,
+                    "store the forward table in single precision, halving"
+                    " its memory (ignored with --fw-checkpoint)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--fw-runs", "<sites>",
+                    &model.fw_runs, 0,
+                    "collapse runs of at least <sites> invariant sites into a"
+                    " single forward step using powers of the transition"
+                    " matrix. Useful with --compress-seq 1 (ignored with"
+                    " --fw-checkpoint or --fw-float; default=0, off)",
+                    ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--fw-skip-masked", &model.fw_skip_masked,
+                    "cross masked regions of the forward algorithm in a"
+                    " single step per region instead of site by site"
+                    " (ignored with --fw-checkpoint or --fw-float)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<double>
+                   ("", "--fw-prune", "<mass>", &model.fw_prune, 0.0,
+                    "approximate the forward algorithm by dropping the"
+                    " states of each column whose normalized probability is"
+                    " below <mass>.  The states dropped and their mass are"
+                    " added to the stats file (default=0, exact)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<double>
+                   ("", "--matrix-cache-mb", "<MB>", &model.matrix_cache_mb,
+                    0.0,
+                    "memory budget for keeping the matrices of the traceback"
+                    " for sampling recombinations (default=0, recompute)",
+                    ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--fast-exp", &fast_exp,
+                    "evaluate exp() and log() in transition and emission"
+                    " probabilities with faster polynomial approximations"
+                    " (within a few ulp of the exact values)",
+                    ADVANCED_OPT));
 
 
         // help information
@@ -536,14 +682,43 @@ public:
         mcmcmc_group = 0;
         int groupsize = MPI::COMM_WORLD.Get_size() / mcmcmc_numgroup;
         mcmcmc_group = MPI::COMM_WORLD.Get_rank() / groupsize;
-        if (mcmcmc_group != 0) {
+        if (domains && MPI::COMM_WORLD.Get_rank() != 0) {
+            // ranks other than 0 only write their logs
+            char tmp[1000];
+            sprintf(tmp, ".domain%i", MPI::COMM_WORLD.Get_rank());
+            mcmcmc_prefix = string(tmp);
+        } else if (mcmcmc_group != 0) {
             char tmp[1000];
             sprintf(tmp, ".%i", mcmcmc_group);
             mcmcmc_prefix = string(tmp);
         }
         printLog(LOG_LOW, "mcmcmc_prefix = %s\n", mcmcmc_prefix.c_str());
         printLog(LOG_LOW, "mcmcmc_group=%i\n", mcmcmc_group);
+#else
+        mcmcmc_group = 0;
+        if (mcmcmc_numgroup < 1) {
+            printError("--mcmcmc must be at least 1");
+            return EXIT_ERROR;
+        }
+        if (mcmcmc_heat * (mcmcmc_numgroup - 1) >= 1.0) {
+            printError("--mcmcmc-heat is too large for %d chains",
+                       mcmcmc_numgroup);
+            return EXIT_ERROR;
+        }
 #endif
+        if (model.fw_prune < 0.0 || model.fw_prune >= 1.0) {
+            printError("--fw-prune must be at least 0 and less than 1");
+            return EXIT_ERROR;
+        }
+        if (map_tolerance < 0.0) {
+            printError("--map-tolerance must be at least 0");
+            return EXIT_ERROR;
+        }
+        if (compress_max != 0 && compress_max <= compress_seq) {
+            printError("--compress-seq-max must be larger than"
+                       " --compress-seq");
+            return EXIT_ERROR;
+        }
 
         return 0;
     }
@@ -555,6 +730,8 @@ public:
     string sites_file;
     string vcf_file;
     string vcf_list_file;
+    string bundle_file;
+    string write_bundle_file;
     string rename_file;
     string vcf_filter;
     double vcf_min_qual;
@@ -590,6 +767,7 @@ public:
     string times_file;
     string mutmap;
     string recombmap;
+    double map_tolerance;
     ArgModel model;
     int popsize_em;
     double popsize_em_min_event;
@@ -603,20 +781,26 @@ public:
     double epsilon;
     double pseudocount;
 
-#ifdef ARGWEAVER_MPI
     double mcmcmc_heat;
     int mcmcmc_group;
     int mcmcmc_numgroup;
+#ifdef ARGWEAVER_MPI
     bool mpi;
+    bool domains;
 #endif
     string mcmcmc_prefix;
+    Mc3Threads *mc3_threads;  // chains of a threaded (MC)^3 run, or NULL
     bool no_sample_arg;
     bool no_resample_mig;
     int start_mig_iter;
 
     // search
     int nclimb;
+    int climb_tries;
     int num_buildup;
+    int shard_size;
+    int shard_overlap;
+    int shard_iters;
     int niters;
     string resample_region_str;
     int resample_region[2];
@@ -624,14 +808,21 @@ public:
     bool overwrite;
     string resume_stage;
     int resume_iter;
+    bool no_checkpoint;
+    shared_ptr<Checkpoint> checkpoint;  // checkpoint to resume from
     int resample_window;
     int resample_window_iters;
     bool gibbs;
 
     // misc
     int compress_seq;
+    int compress_max;
     int sample_step;
     bool no_compress_output;
+    bool stats_perf;
+    bool stats_states;
+    bool binary_arg;
+    bool binary_sites;
     int randseed;
     double prob_path_switch;
     bool infsites;
@@ -645,6 +836,7 @@ public:
     bool write_sites;
     bool write_sites_only;
     bool write_masked_sites;
+    bool fast_exp;
 
     // help/information
     bool quiet;
@@ -658,6 +850,7 @@ public:
 
     // logging
     FILE *stats_file;
+    FILE *states_file;
 };
 
 
@@ -747,10 +940,45 @@ void print_stats_header(Config *config) {
         for (unsigned int i=0; i < config->model.pop_tree->mig_params.size(); i++)
             fprintf(config->stats_file, "\t%s", config->model.pop_tree->mig_params[i].name.c_str());
     }
+    if (config->stats_perf)
+        fprintf(config->stats_file, "\titer_time\tforward_time\tstates\t"
+                "blocks\tmax_rss\trss");
+    if (config->model.fw_prune > 0.0)
+        fprintf(config->stats_file, "\tpruned_states\tpruned_mass");
     fprintf(config->stats_file, "\n");
 }
 
 
+// Opens the file of state space histograms if requested, writing its
+// header if the file is new
+bool open_states_file(Config *config, const char *mode)
+{
+    if (!config->stats_states)
+        return true;
+    string states_filename = config->out_prefix + config->mcmcmc_prefix
+        + STATES_SUFFIX;
+    if (!(config->states_file = fopen(states_filename.c_str(), mode))) {
+        printError("could not open state histogram file '%s'",
+                   states_filename.c_str());
+        return false;
+    }
+    fseek(config->states_file, 0, SEEK_END);
+    if (ftell(config->states_file) == 0)
+        fprintf(config->states_file,
+                "stage\titer\tmeasure\tbin_start\tbin_end\tcount\n");
+    return true;
+}
+
+
+void close_states_file(Config *config)
+{
+    if (config->states_file) {
+        fclose(config->states_file);
+        config->states_file = NULL;
+    }
+}
+
+
 void print_stats(FILE *stats_file, const char *stage, int iter,
                  ArgModel *model,
                  const Sequences *sequences, LocalTrees *trees,
@@ -760,15 +988,14 @@ void print_stats(FILE *stats_file, const char *stage, int iter,
                  const vector<Spr> &invisible_recombs=vector<Spr>())
 {
 
+    // wall time of the iteration
+    double iter_time = get_forward_stats().timer.time();
+
     // calculate number of recombinations
     int nrecombs = trees->get_num_trees() - 1;
 
     // calculate number of non-compatiable sites
-    int nseqs = trees->get_num_leaves();
-    char *seqs[nseqs];
-    for (int i=0; i<nseqs; i++)
-        seqs[i] = sequences->seqs[trees->seqids[i]];
-    int noncompats = count_noncompat(trees, seqs, nseqs, sequences->length());
+    int noncompats = count_noncompat(trees, sequences);
 
     // get memory usage in MB
     double maxrss = get_max_memory_usage() / 1000.0;
@@ -832,8 +1059,28 @@ void print_stats(FILE *stats_file, const char *stage, int iter,
                     model->pop_tree->mig_matrix[mp.time_idx].get(mp.from_pop, mp.to_pop));
         }
     }
+    // work since the last line, not counting the time spent on stats
+    ForwardStats &forward = get_forward_stats();
+    if (config->stats_perf) {
+        long long nblocks = forward.nblocks;
+        fprintf(stats_file, "\t%.3f\t%.3f\t%.1f\t%lld\t%.1f\t%.1f",
+                iter_time, forward.usecs / 1e6,
+                nblocks > 0 ? forward.nstates / double(nblocks) : 0.0,
+                nblocks, maxrss, get_memory_usage() / 1000.0);
+    }
+    if (model->fw_prune > 0.0)
+        fprintf(stats_file, "\t%lld\t%g", forward.npruned,
+                forward.pruned_mass);
     fprintf(stats_file, "\n");
     fflush(stats_file);
+    if (config->states_file) {
+        char prefix[100];
+        snprintf(prefix, sizeof(prefix), "%s\t%d", stage, iter);
+        forward.hist.write(config->states_file, prefix);
+        fflush(config->states_file);
+    }
+    if (config->stats_perf || config->states_file || model->fw_prune > 0.0)
+        forward.clear();
 
     printLog(LOG_LOW, "\n"
              "prior:      %f\n"
@@ -856,7 +1103,8 @@ string get_out_arg_file(const Config &config, int iter)
 {
     char iterstr[10];
     snprintf(iterstr, 10, ".%d", iter);
-    return config.out_prefix + config.mcmcmc_prefix + iterstr + SMC_SUFFIX;
+    return config.out_prefix + config.mcmcmc_prefix + iterstr +
+        (config.binary_arg ? BINARY_SMC_SUFFIX : SMC_SUFFIX);
 }
 
 /*string get_out_cr_file(const Config &config, int iter)
@@ -874,26 +1122,52 @@ string get_out_sites_file(const Config &config, int iter)
     } else {
         snprintf(iterstr, 10, ".%d", iter);
     }
-    string sitesfile = config.out_prefix + config.mcmcmc_prefix + iterstr + SITES_SUFFIX;
+    string sitesfile = config.out_prefix + config.mcmcmc_prefix + iterstr +
+        (config.binary_sites ? BINARY_SITES_SUFFIX : SITES_SUFFIX);
     if (!config.no_compress_output)
         sitesfile = sitesfile + ".gz";
     return sitesfile;
 }
 
+string get_checkpoint_file(const Config &config)
+{
+    return config.out_prefix + config.mcmcmc_prefix + CHECKPOINT_SUFFIX;
+}
+
+// ARGs and sequences are written by a background thread while sampling
+// continues.  Each output works on its own snapshot, taken when the output
+// is queued, and at most one more output waits while another is written.
+static TaskQueue output_queue(1);
+
+// Waits until all sampled ARGs and sequences are written
+void finish_output()
+{
+    output_queue.wait();
+}
+
+
 bool log_sequences(string chrom, const Sequences *sequences,
                    const Config *config,
                    const SitesMapping *sites_mapping, int iter) {
-    Sites sites(chrom);
+    shared_ptr<Sites> sites(new Sites(chrom));
     string out_sites_file = get_out_sites_file(*config, iter);
-    make_sites_from_sequences(sequences, &sites);
-    if (sites_mapping)
-        uncompress_sites(&sites, sites_mapping);
-    CompressStream stream(out_sites_file.c_str(), "w");
-    if (!stream.stream) {
-        printError("cannot write '%s'", out_sites_file.c_str());
-        return false;
-    }
-    write_sites(stream.stream, &sites, config->write_masked_sites);
+    make_sites_from_sequences(sequences, sites.get());
+
+    output_queue.post([=]() {
+            if (sites_mapping)
+                uncompress_sites(sites.get(), sites_mapping);
+            CompressStream stream(out_sites_file.c_str(), "w");
+            if (!stream.stream) {
+                printError("cannot write '%s'", out_sites_file.c_str());
+                return;
+            }
+            if (config->binary_sites)
+                write_sites_binary(stream.stream, sites.get(),
+                                   config->write_masked_sites);
+            else
+                write_sites(stream.stream, sites.get(),
+                            config->write_masked_sites);
+        });
     return true;
 }
 
@@ -903,30 +1177,41 @@ bool log_local_trees(const ArgModel *model, const Sequences *sequences,
                      const vector<int> &self_recomb_pos0=vector<int>(),
                      const vector<Spr> &self_recombs=vector<Spr>())
 {
+    PROFILE_SCOPE(PROFILE_IO);
     string out_arg_file = get_out_arg_file(*config, iter);
-    const vector<int> *self_recomb_ptr;
     if (!config->no_compress_output)
         out_arg_file += ".gz";
 
-    // write local trees uncompressed
-    vector<int> self_recomb_pos1;
-    if (sites_mapping) {
-        uncompress_local_trees(trees, sites_mapping);
-        sites_mapping->uncompress(self_recomb_pos0, self_recomb_pos1);
-        self_recomb_ptr = &self_recomb_pos1;
-    } else self_recomb_ptr = &self_recomb_pos0;
-
-    // setup output stream
-    CompressStream stream(out_arg_file.c_str(), "w");
-    if (!stream.stream) {
-        printError("cannot write '%s'", out_arg_file.c_str());
-        return false;
-    }
-
+    // snapshot of the ARG for the writer
+    shared_ptr<LocalTrees> trees2(new LocalTrees());
+    trees2->copy(*trees);
+    vector<double> times(model->times, model->times + model->ntimes);
+    const bool pop_model = model->pop_tree != NULL;
+
+    output_queue.post([=]() {
+            // write local trees uncompressed
+            vector<int> self_recomb_pos1;
+            if (sites_mapping) {
+                uncompress_local_trees(trees2.get(), sites_mapping);
+                sites_mapping->uncompress(self_recomb_pos0, self_recomb_pos1);
+            } else self_recomb_pos1 = self_recomb_pos0;
+
+            // setup output stream
+            CompressStream stream(out_arg_file.c_str(), "w");
+            if (!stream.stream) {
+                printError("cannot write '%s'", out_arg_file.c_str());
+                return;
+            }
 
-    write_local_trees(stream.stream, trees, sequences, model->times,
-                      model->pop_tree != NULL,
-                      *self_recomb_ptr, self_recombs);
+            if (config->binary_arg)
+                write_local_trees_binary(stream.stream, trees2.get(),
+                                         *sequences, &times[0], times.size(),
+                                         self_recomb_pos1, self_recombs);
+            else
+                write_local_trees(stream.stream, trees2.get(), *sequences,
+                                  &times[0], pop_model,
+                                  self_recomb_pos1, self_recombs);
+        });
 
     // testing for now; output coal records version
     /*    string out_cr_file = get_out_cr_file(*config, iter);
@@ -940,9 +1225,25 @@ bool log_local_trees(const ArgModel *model, const Sequences *sequences,
 
     write_coal_records(stream2.stream, model, trees, sequences); */
 
-    if (sites_mapping)
-        compress_local_trees(trees, sites_mapping);
+    return true;
+}
 
+
+// Queues a checkpoint of the sampler state after iteration 'iter'.  It is
+// written after the outputs queued before it, so a checkpoint never refers
+// to an iteration whose ARG and sequences are missing.
+bool log_checkpoint(const ArgModel *model, const Sequences *sequences,
+                    const LocalTrees *trees, const Config *config, int iter)
+{
+    PROFILE_SCOPE(PROFILE_IO);
+    shared_ptr<Checkpoint> checkpoint(new Checkpoint());
+    make_checkpoint(checkpoint.get(), iter, model, sequences, trees,
+                    model->unphased);
+    string filename = get_checkpoint_file(*config);
+
+    output_queue.post([=]() {
+            write_checkpoint(filename.c_str(), checkpoint.get());
+        });
     return true;
 }
 
@@ -1005,7 +1306,13 @@ bool seq_sample_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
         printLog(LOG_LOW, "Sequentially Sample Initial ARG (%d sequences)\n",
                  sequences->get_num_seqs());
         printLog(LOG_LOW, "------------------------------------------------\n");
-        sample_arg_seq(model, sequences, trees, true, config->num_buildup);
+        if (config->shard_size > 0 && trees->get_num_leaves() == 0)
+            sample_arg_seq_shards(model, sequences, trees,
+                                  config->shard_size / config->compress_seq,
+                                  config->shard_overlap / config->compress_seq,
+                                  config->shard_iters, config->num_buildup);
+        else
+            sample_arg_seq(model, sequences, trees, true, config->num_buildup);
         print_stats(config->stats_file, "seq", trees->get_num_leaves(),
                     model, sequences, trees, sites_mapping, config,
                     maskmap_orig);
@@ -1027,113 +1334,201 @@ void climb_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     double recomb_preference = .9;
     for (int i=0; i<config->nclimb; i++) {
         printLog(LOG_LOW, "climb %d\n", i+1);
-        resample_arg_climb(model, sequences, trees, recomb_preference);
+        resample_arg_climb(model, sequences, trees, recomb_preference,
+                           config->climb_tries);
         print_stats(config->stats_file, "climb", i, model, sequences, trees,
                     sites_mapping, config, maskmap_orig);
     }
     printLog(LOG_LOW, "\n");
 }
 
+// Returns the logger writing the log file of the calling thread
+Logger *get_log_file_logger()
+{
+    Logger *logger = &getLogger();
+    return logger->getChain() ? logger->getChain() : logger;
+}
+
+
+// Moves a chain to another heat group.  Its output files are closed, to be
+// reopened by reopen_mcmcmc_files() once the chain it swapped with is done
+// writing to them.
+void set_mcmcmc_group(Config *config, Mc3Config *mc3, int group)
+{
+    mc3->group = group;
+    mc3->heat = 1.0 - mc3->heat_interval * mc3->group;
+    //need to switch output files as well, including stats_file, arg output,
+    //phase output, log files.  First close all the files.
+    fclose(config->stats_file);
+    close_states_file(config);
+    if (config->verbose)
+        get_log_file_logger()->closeLogFile();
+    if (mc3->group == 0) config->mcmcmc_prefix = "";
+    else {
+        char tmp[1000];
+        sprintf(tmp, ".%i", mc3->group);
+        config->mcmcmc_prefix = string(tmp);
+    }
+}
+
+
+// Reopens the output files of a chain in append mode
+void reopen_mcmcmc_files(Config *config)
+{
+    string stats_filename = config->out_prefix + config->mcmcmc_prefix
+        + STATS_SUFFIX;
+    if (!(config->stats_file = fopen(stats_filename.c_str(), "a"))) {
+        printError("Error reopening stats file %s in mcmcmc_swap\n",
+                   stats_filename.c_str());
+        abort();
+    }
+    if (!open_states_file(config, "a"))
+        abort();
+    if (config->verbose) {
+        string log_filename = config->out_prefix + config->mcmcmc_prefix
+            + LOG_SUFFIX;
+        if (!get_log_file_logger()->openLogFile(log_filename.c_str(), "a")) {
+            fprintf(stderr, "Error opening %s\n", log_filename.c_str());
+            abort();
+        }
+    }
+}
+
+
 void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
                  const LocalTrees *trees, const SitesMapping *sites_mapping) {
 #ifdef ARGWEAVER_MPI
-    printLog(LOG_LOW, "mcmcmc_swap model->mc3.max_group=%i\n", model->mc3.max_group);
-    if (model->mc3.max_group == 0) return;
+    // finish the swap started after the last iteration.  The other chain
+    // of the pair wrote its outputs for that iteration before starting
+    // it, so the files of the two chains can be switched right away.
     Mc3Config *mc3 = &(model->mc3);
+    if (mc3->max_group == 0 || !mc3->swap_pending()) return;
+    int groups[2];
+    double swapstats[4];
+    const bool accept = mc3->finish_swap(groups, swapstats);
+    printLog(LOG_LOW, "swap\t%i\t%i\t%f\t%f\t%f\t%s\n",
+             groups[0], groups[1], swapstats[1], swapstats[2], swapstats[3],
+             accept ? "accept" : "reject");
+    if (accept) {
+        set_mcmcmc_group(config, mc3, groups[mc3->group == groups[1] ? 0 : 1]);
+        reopen_mcmcmc_files(config);
+    }
+#else
+    Mc3Threads *threads = config->mc3_threads;
+    if (!threads) return;
+    Mc3Config *mc3 = &(model->mc3);
+
     int swap[2];
-    int rank = MPI::COMM_WORLD.Get_rank();
-    bool accept;
+    threads->choose_swap(swap);
+    const bool swapped = (mc3->group == swap[0] || mc3->group == swap[1]);
+
+    // trees and sequences are both compressed here
+    double logprob = 0.0;
+    if (swapped)
+        logprob = calc_arg_prior(model, trees) +
+            calc_arg_likelihood(model, sequences, trees);
     double swapstats[4];
-    //pick two groups to swap
-    if (rank == 0) {
-        swap[0] = irand(mc3->max_group + 1);
-        swap[1] = irand(mc3->max_group);
-        if (swap[1] >= swap[0]) swap[1]++;
-        assert(swap[0] >= 0 && swap[0] <= mc3->max_group);
-        assert(swap[1] >= 0 && swap[1] <= mc3->max_group);
-        assert(swap[0] != swap[1]);
-    }
-    MPI::COMM_WORLD.Bcast(swap, 2, MPI::INT, 0);
-    if (mc3->group == swap[0] || mc3->group == swap[1]) {
-        double vals[2];
-        vals[0] = calc_arg_prior(model, trees) +
-            calc_arg_likelihood(model, sequences, trees, sites_mapping);
-        vals[1] = mc3->heat;
-        if (mc3->group_comm->Get_rank()==0)
-            mc3->group_comm->Reduce(MPI_IN_PLACE, vals, 1, MPI::DOUBLE, MPI_SUM,
-                                   0);
-        else mc3->group_comm->Reduce(vals, vals, 1, MPI::DOUBLE, MPI_SUM, 0);
-        if (mc3->group_comm->Get_rank()==0)
-            MPI::COMM_WORLD.Isend(vals, 2, MPI::DOUBLE, 0, 301);
-    }
-    if (rank == 0) {
-        double like[2];
-        double heat[2];
-        for (int i=0; i < 2; i++) {
-            double vals[2];
-            MPI::COMM_WORLD.Recv(vals, 2, MPI::DOUBLE, MPI_ANY_SOURCE, 301);
-            like[i] = vals[0];
-            heat[i] = vals[1];
-        }
-        double accept_ratio = (heat[0]-heat[1])*like[1] +
-            (heat[1] - heat[0])*like[0];
-        accept = (accept_ratio >= 0.0 ||
-                  frand() < exp(accept_ratio));
-        //Note heat[0] may correspond to swap[0] or swap[1]
-        swapstats[0] = accept ? 1.0 : 0.0;
-        swapstats[1] = heat[0];
-        swapstats[2] = heat[1];
-        swapstats[3] = accept_ratio;
-    }
-    MPI::COMM_WORLD.Bcast(swapstats, 4, MPI::DOUBLE, 0);
-    accept = ( swapstats[0] > 0.5);
+    const bool accept = threads->decide_swap(*mc3, swap, logprob, swapstats);
     printLog(LOG_LOW, "swap\t%i\t%i\t%f\t%f\t%f\t%s\n",
              swap[0], swap[1], swapstats[1], swapstats[2], swapstats[3],
              accept ? "accept" : "reject");
 
-    // now all processes know accept. Do the switch
-    if (accept && (mc3->group == swap[0] || mc3->group == swap[1])) {
-        int other = (mc3->group == swap[1] ? 0 : 1);
-        mc3->group = swap[other];
-        mc3->heat = 1.0 - mc3->heat_interval * mc3->group;
-        //need to switch output files as well, including stats_file, arg output,
-        //phase output, log files.  First close all the files.
-        fclose(config->stats_file);
-        if (config->verbose) {
-            Logger *chain = g_logger.getChain();
-            chain->closeLogFile();
-        }
-        if (mc3->group == 0) config->mcmcmc_prefix = "";
-        else {
-            char tmp[1000];
-            sprintf(tmp, ".%i", mc3->group);
-            config->mcmcmc_prefix = string(tmp);
-        }
-    }
-    MPI::COMM_WORLD.Barrier();
-    //Now reopen in append mode
-    if (accept && (mc3->group == swap[0] || mc3->group == swap[1])) {
-        string stats_filename = config->out_prefix + config->mcmcmc_prefix
-            + STATS_SUFFIX;
-        if (!(config->stats_file = fopen(stats_filename.c_str(), "a"))) {
-            printError("Error reopening stats file %s in mcmcmc_swap\n",
-                    stats_filename.c_str());
-            abort();
-        }
-        if (config->verbose) {
-            string log_filename = config->out_prefix + config->mcmcmc_prefix
-                + LOG_SUFFIX;
-            Logger *chain = g_logger.getChain();
-            if (!chain->openLogFile(log_filename.c_str(), "a")) {
-                fprintf(stderr, "Error opening %s\n", log_filename.c_str());
-                abort();
-            }
-        }
-    }
+    if (accept && swapped)
+        set_mcmcmc_group(config, mc3, swap[mc3->group == swap[1] ? 0 : 1]);
+    threads->barrier();
+    if (accept && swapped)
+        reopen_mcmcmc_files(config);
+#endif
+}
+
+
+// Starts a swap of an MPI run after the outputs of an iteration are
+// written.  Chains keep sampling the next iteration while the values of
+// the pair are reduced, and the swap is finished by mcmcmc_swap().
+void mcmcmc_start_swap(ArgModel *model, const Sequences *sequences,
+                       const LocalTrees *trees) {
+#ifdef ARGWEAVER_MPI
+    Mc3Config *mc3 = &(model->mc3);
+    if (mc3->max_group == 0) return;
+    // trees and sequences are both compressed here
+    if (mc3->choose_swap())
+        mc3->start_swap(calc_arg_prior(model, trees) +
+                        calc_arg_likelihood(model, sequences, trees));
 #endif
 }
 
 
+#ifdef ARGWEAVER_MPI
+// Resamples one ARG split into a block of the genome for each MPI rank
+// (--domains).  Rank 0 holds the whole ARG in 'trees' between iterations
+// and the other ranks hold nothing.  The first and last trees of each
+// block are kept, and the bounds shift by half a block on alternate
+// iterations, so that the ends of the blocks are resampled in the next
+// iteration.  Leaf threads span the whole ARG and are resampled by rank 0
+// alone.  Population sizes are sampled while the blocks are spread out,
+// since the ranks already combine the counts of their ARGs.
+void resample_arg_domains(ArgModel *model, Sequences *sequences,
+                          LocalTrees *trees, const Config *config, int iter,
+                          bool do_leaf, int window, int niters, double heat)
+{
+    MPI::Intracomm *comm = &MPI::COMM_WORLD;
+    const int rank = comm->Get_rank();
+    const int nranks = comm->Get_size();
+    const bool sample_popsizes = model->popsize_config.sample > 0 &&
+        iter % model->popsize_config.sample == 0;
+
+    if (do_leaf && rank == 0)
+        resample_arg_mcmc_all(model, sequences, trees, true, window, niters,
+                              heat, config->no_resample_mig);
+    if (do_leaf && !sample_popsizes)
+        return;
+
+    vector<int> bounds;
+    if (rank == 0)
+        get_domain_bounds(trees->start_coord, trees->end_coord, nranks,
+                          iter % 2 == 1, &bounds);
+    if (!scatter_local_trees(comm, trees, bounds, model->ntimes))
+        comm->Abort(EXIT_ERROR);
+
+    if (!do_leaf) {
+        double accept_rate = resample_arg_regions(
+            model, sequences, trees, window, niters, heat,
+            rank == 0, rank == nranks - 1);
+        printLog(LOG_LOW, "resample_arg_domains: block=(%d, %d),"
+                 " accept=%f\n", trees->start_coord, trees->end_coord,
+                 accept_rate);
+    }
+    if (sample_popsizes)
+        resample_popsizes_mh(model, trees, true, heat);
+
+    if (!gather_local_trees(comm, trees, model->ntimes, model->pop_tree))
+        comm->Abort(EXIT_ERROR);
+}
+
+
+// Takes part in the iterations of resample_arg_all() of rank 0 on the
+// other ranks of a --domains run
+void serve_arg_domains(ArgModel *model, Sequences *sequences, Config *config)
+{
+    bool do_leaf[config->niters+1];
+    int window = config->resample_window / config->compress_seq;
+    int niters = config->resample_window_iters;
+
+    MPI::COMM_WORLD.Bcast(do_leaf, config->niters+1, MPI::BOOL, 0);
+
+    LocalTrees block;
+    for (int i=1; i<=config->niters; i++) {
+        printLog(LOG_LOW, "sample %d\n", i);
+        Timer timer;
+        resample_arg_domains(model, sequences, &block, config, i, do_leaf[i],
+                             window, niters, model->mc3.heat);
+        printTimerLog(timer, LOG_LOW, "sample time:");
+    }
+    printLog(LOG_LOW, "\n");
+}
+#endif
+
+
 void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
                       SitesMapping* sites_mapping, Config *config,
                       const TrackNullValue *maskmap_orig)
@@ -1150,6 +1545,13 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     vector<Spr> invisible_recombs;
     assert_trees(trees, model->pop_tree);
 
+    // blocks sampled on the ranks of a --domains run
+#ifdef ARGWEAVER_MPI
+    const bool domains = config->domains;
+#else
+    const bool domains = false;
+#endif
+
     // set iteration counter
     int iter = 1;
     if (config->resume)
@@ -1190,6 +1592,12 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
         do_leaf[i] = ( frand() < frac_leaf );
 #endif
 
+#ifdef ARGWEAVER_MPI
+        if (domains)
+            resample_arg_domains(model, sequences, trees, config, i,
+                                 do_leaf[i], window, niters, heat);
+        else
+#endif
 	if ( ! config->no_sample_arg) {
 	    if (config->gibbs)
 		resample_arg(model, sequences, trees);
@@ -1205,7 +1613,8 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
             /*	if (config->popsize_em > 0 && i % config->popsize_em == 0)
 	    mle_popsize(model, trees, config->popsize_em_min_event);
             else */
-        if (model->popsize_config.sample > 0 && i % model->popsize_config.sample == 0) {
+        if (model->popsize_config.sample > 0 && i % model->popsize_config.sample == 0
+            && !domains) {
             resample_popsizes_mh(model, trees, true, heat);
             //	    update_popsize_hmc(model, trees);
         } /*else {
@@ -1214,6 +1623,7 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
             }*/
 
         printTimerLog(timer, LOG_LOW, "sample time:");
+        log_tag_memory(LOG_MEDIUM);
 
         mcmcmc_swap(config, model, sequences, trees, sites_mapping);
 
@@ -1241,6 +1651,12 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 
         if (config->sample_phase_step > 0 && i%config->sample_phase_step == 0)
             log_sequences(trees->chrom, sequences, config, sites_mapping, i);
+
+        if (i % config->sample_step == 0 && !config->no_checkpoint)
+            log_checkpoint(model, sequences, trees, config, i);
+
+        if (i < config->niters)
+            mcmcmc_start_swap(model, sequences, trees);
     }
     printLog(LOG_LOW, "\n");
 }
@@ -1364,6 +1780,51 @@ bool parse_status_line(const char* line, Config &config,
 }
 
 
+// Drops the lines of the stats file for iterations after a checkpoint,
+// including a last line cut short by an interrupted run, so that the
+// resumed run continues the file where the checkpoint was taken.
+bool truncate_stats_file(const string &stats_filename, int iter)
+{
+    FILE *stats_file = fopen(stats_filename.c_str(), "r");
+    if (!stats_file)
+        return true;
+
+    string text;
+    char *line;
+    int ncols = -1;
+    while ((line = fgetline(stats_file))) {
+        vector<string> tokens;
+        const int len = strlen(line);
+        bool keep = len > 0 && line[len-1] == '\n';
+        chomp(line);
+        split(line, "\t", tokens);
+        if (ncols == -1) {
+            ncols = tokens.size();
+        } else {
+            int iter2;
+            keep = keep && (int) tokens.size() == ncols &&
+                !(tokens[0] == "resample" &&
+                  (sscanf(tokens[1].c_str(), "%d", &iter2) != 1 ||
+                   iter2 > iter));
+        }
+        if (keep)
+            text.append(line).append("\n");
+        delete [] line;
+    }
+    fclose(stats_file);
+
+    string tmpfile = stats_filename + ".tmp";
+    FILE *out = fopen(tmpfile.c_str(), "w");
+    if (!out || fwrite(text.data(), 1, text.size(), out) != text.size() ||
+        fclose(out) != 0 || rename(tmpfile.c_str(), stats_filename.c_str())) {
+        printError("could not rewrite stats file '%s'",
+                   stats_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+
 bool setup_resume(Config &config)
 {
     if (!config.resume)
@@ -1371,9 +1832,29 @@ bool setup_resume(Config &config)
 
     printLog(LOG_LOW, "Resuming previous run\n");
 
-    // open stats file
     string stats_filename = config.out_prefix + config.mcmcmc_prefix
         + STATS_SUFFIX;
+
+    // a checkpoint holds the whole sampler state, so previous ARG files
+    // are not needed
+    string checkpoint_file = get_checkpoint_file(config);
+    if (!config.no_checkpoint && access(checkpoint_file.c_str(), F_OK) == 0) {
+        unique_ptr<Checkpoint> checkpoint(new Checkpoint());
+        if (read_checkpoint(checkpoint_file.c_str(), checkpoint.get())) {
+            config.resume_stage = "resample";
+            config.resume_iter = checkpoint->iter;
+            config.checkpoint = move(checkpoint);
+            printLog(LOG_LOW, "resuming at stage=%s, iter=%d, checkpoint=%s\n",
+                     config.resume_stage.c_str(), config.resume_iter,
+                     checkpoint_file.c_str());
+            return truncate_stats_file(stats_filename, config.resume_iter) &&
+                truncate_stats_file(config.out_prefix + config.mcmcmc_prefix
+                                    + STATES_SUFFIX, config.resume_iter);
+        }
+        printLog(LOG_LOW, "Resuming from the last ARG file instead\n");
+    }
+
+    // open stats file
     printLog(LOG_LOW, "Checking previous run from stats file: %s\n",
              stats_filename.c_str());
 
@@ -1422,6 +1903,7 @@ bool setup_resume(Config &config)
         printLog(LOG_LOW, "Detected phased output sites file. Using %s as input"
                  " and assuming data is unphased\n", sites_file.c_str());
         config.sites_file = sites_file;
+        config.bundle_file = "";
         config.unphased=1;
         config.vcf_file = "";
         config.vcf_list_file = "";
@@ -1483,156 +1965,75 @@ bool ensure_output_dir(const char *outdir)
 }
 
 
-//=============================================================================
+// Reads the input sites, masks and rate maps, and masks and compresses
+// the sites
+bool read_inputs(Config &c, InputBundle *inputs)
+{
+    PROFILE_SCOPE(PROFILE_IO);
+    Sites &sites = inputs->sites;
+    Sequences sequences;
+    SitesMapping *sites_mapping = &inputs->sites_mapping;
+    Region &seq_region = inputs->seq_region;
+    TrackNullValue &maskmap = inputs->maskmap;
+    vector<TrackNullValue> &ind_maskmap = inputs->ind_maskmap;
+    inputs->compress_seq = c.compress_seq;
+    inputs->compress_max = c.compress_max;
+    inputs->unphased = c.vcf_file != "" || c.vcf_list_file != "";
 
+    set<string> keep_inds;
+    bool subset_read = false;
 
-int main(int argc, char **argv)
-{
+    if (c.subsites_file != "") {
+        FILE *infile;
+        if (!(infile = fopen(c.subsites_file.c_str(), "r"))) {
+            printError("Could not open subsites file %s",
+                       c.subsites_file.c_str());
+            return false;
+        }
+        char name[10000];
+        while (EOF != fscanf(infile, "%s", name))
+            keep_inds.insert(string(name));
+        fclose(infile);
+    }
 
-#ifdef ARGWEAVER_MPI
-    MPI::Init(argc, argv);
-#endif
+    if (c.fasta_file != "") {
+        // read FASTA file
 
-    // parse command line arguments
-    Config c;
-    int ret = c.parse_args(argc, argv);
-    if (ret)
-        return ret;
+        if (!read_fasta(c.fasta_file.c_str(), &sequences)) {
+            printError("could not read fasta file");
+            return false;
+        }
+        seq_region.set("chr", 0, sequences.length());
 
-    // ensure output dir
-    if (!ensure_output_dir(c.out_prefix.c_str()))
-        return EXIT_ERROR;
+        printLog(LOG_LOW, "read input sequences (nseqs=%d, length=%d)\n",
+                 sequences.get_num_seqs(), sequences.length());
 
-    // check overwriting
-    if (!check_overwrite(c))
-        return EXIT_ERROR;
+        make_sites_from_sequences(&sequences, &sites);
+    } else if (c.sites_file != "") {
+        // read sites file
 
-    // setup logging
-    set_up_logging(c, c.verbose, (c.resume ? "a" : "w"));
+        // parse subregion if given
+        int subregion[2] = {-1, -1};
+        if (c.subregion_str != "") {
+            if (!parse_region(c.subregion_str.c_str(),
+                              &subregion[0], &subregion[1])) {
+                printError("subregion is not specified as 'start-end'");
+                return false;
+            }
+            subregion[0] -= 1; // convert to 0-index
+        }
 
-    // try to resume a previous run
-    if (!setup_resume(c)) {
-        printError("resume failed.");
-        if (c.overwrite) {
-            c.resume = false;
-            printLog(LOG_LOW, "Resume failed.  Sampling will start from scratch"
-                     " since overwrite is enabled.\n");
-        } else {
-            return EXIT_ERROR;
+        // read sites.  Unless they are renamed first, only the sequences
+        // of --subsites are read.
+        subset_read = keep_inds.size() > 0 && c.rename_file == "";
+        if (!(subset_read ?
+              read_sites_subset(c.sites_file.c_str(), &sites, keep_inds,
+                                subregion[0], subregion[1]) :
+              read_sites(c.sites_file.c_str(), &sites,
+                         subregion[0], subregion[1]))) {
+            printError("could not read sites file");
+            return false;
         }
-    }
-
-#ifdef ARGWEAVER_MPI
-    if (c.mpi) {
-        int numcore = MPI::COMM_WORLD.Get_size();
-        if (numcore % c.mcmcmc_numgroup != 0) {
-            fprintf(stderr, "Error: number of cores should be evenly divisible"
-                    " by number of mcmcmc threads");
-        }
-        int groupsize = numcore / c.mcmcmc_numgroup;
-        int sites_num = MPI::COMM_WORLD.Get_rank() % groupsize;
-        char tmp[10000];
-        sprintf(tmp, "%s%i.sites", c.sites_file.c_str(),
-                sites_num);
-        c.sites_file = (string)tmp;
-        sprintf(tmp, "%s%i", c.out_prefix.c_str(),
-                sites_num);
-        c.out_prefix = (string)tmp;
-        /*        if (c.cr_file != "") {
-            sprintf(tmp, "%s%i.cr.gz", c.cr_file.c_str(), sites_num);
-            c.cr_file = (string)tmp;
-            }*/
-	if (c.arg_file != "") {
-	    sprintf(tmp, "%s%i.smc.gz", c.arg_file.c_str(), sites_num);
-	    c.arg_file = (string)tmp;
-	}
-    }
-#endif
-
-
-
-    // log intro
-    if (c.resume)
-        printLog(LOG_LOW, "RESUME\n");
-    log_intro(LOG_LOW);
-    log_prog_commands(LOG_LOW, argc, argv);
-    Timer timer;
-
-
-    // init random number generator
-    if (c.randseed == 0)
-        c.randseed = time(NULL);
-#ifdef ARGWEAVER_MPI
-    if (MPI::COMM_WORLD.Get_rank()==0) {
-        for (int i=1; i < MPI::COMM_WORLD.Get_size(); i++) {
-            int seed = irand(12581020);
-            MPI::COMM_WORLD.Send(&seed, 1, MPI::INT, i, 13);
-        }
-    } else {
-        MPI::COMM_WORLD.Recv(&c.randseed, 1, MPI::INT, 0, 13);
-    }
-#endif
-    srand(c.randseed);
-    printLog(LOG_LOW, "random seed: %d\n", c.randseed);
-
-    // read sequences
-    Sites sites;
-    Sequences sequences;
-    SitesMapping *sites_mapping = NULL;
-    unique_ptr<SitesMapping> sites_mapping_ptr;
-    Region seq_region;
-    Region seq_region_compress;
-
-    set<string> keep_inds;
-
-    if (c.subsites_file != "") {
-        FILE *infile;
-        if (!(infile = fopen(c.subsites_file.c_str(), "r"))) {
-            printError("Could not open subsites file %s",
-                       c.subsites_file.c_str());
-            return false;
-        }
-        char name[10000];
-        while (EOF != fscanf(infile, "%s", name))
-            keep_inds.insert(string(name));
-        fclose(infile);
-    }
-
-    if (c.fasta_file != "") {
-        // read FASTA file
-
-        if (!read_fasta(c.fasta_file.c_str(), &sequences)) {
-            printError("could not read fasta file");
-            return EXIT_ERROR;
-        }
-        seq_region.set("chr", 0, sequences.length());
-
-        printLog(LOG_LOW, "read input sequences (nseqs=%d, length=%d)\n",
-                 sequences.get_num_seqs(), sequences.length());
-
-        make_sites_from_sequences(&sequences, &sites);
-    } else if (c.sites_file != "") {
-        // read sites file
-
-        // parse subregion if given
-        int subregion[2] = {-1, -1};
-        if (c.subregion_str != "") {
-            if (!parse_region(c.subregion_str.c_str(),
-                              &subregion[0], &subregion[1])) {
-                printError("subregion is not specified as 'start-end'");
-                return EXIT_ERROR;
-            }
-            subregion[0] -= 1; // convert to 0-index
-        }
-
-        // read sites
-        CompressStream stream(c.sites_file.c_str());
-        if (!stream.stream ||
-            !read_sites(stream.stream, &sites, subregion[0], subregion[1])) {
-            printError("could not read sites file");
-            return EXIT_ERROR;
-        }
-        stream.close();
 
         printLog(LOG_LOW, "read input sites (chrom=%s, start=%d, end=%d, "
                  "length=%d, nseqs=%d, nsites=%d)\n",
@@ -1643,19 +2044,20 @@ int main(int argc, char **argv)
         // sanity check for sites
         if (sites.get_num_sites() == 0) {
             printLog(LOG_LOW, "no sites given.  terminating.\n");
-            return EXIT_ERROR;
+            return false;
         }
         seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
     } else if (c.vcf_file != "") {
         if (c.vcf_list_file != "") {
             printLog(LOG_LOW, "Cannot use both --vcf-file and --vcf-list-file. Terminating\n");
-            return EXIT_ERROR;
+            return false;
         }
         if (!read_vcf(c.vcf_file, &sites, c.subregion_str,
                       c.vcf_min_qual, c.vcf_filter, c.use_genotype_probs,
-                      c.mask_uncertain, false, c.tabix_dir, keep_inds)) {
+                      c.mask_uncertain, false, c.tabix_dir, keep_inds,
+                      c.model.nthreads)) {
             printError("Could not read VCF file");
-            return EXIT_ERROR;
+            return false;
         }
         printLog(LOG_LOW, "read input sites from VCF (chrom=%s, start=%d, end=%d, length=%d, nseqs=%d, nsites=%d)\n",
                  sites.chrom.c_str(), sites.start_coord, sites.end_coord,
@@ -1663,7 +2065,7 @@ int main(int argc, char **argv)
                  sites.get_num_sites());
         if (sites.get_num_sites() == 0) {
             printLog(LOG_LOW, "no sites given.  terminating.\n");
-            return EXIT_ERROR;
+            return false;
         }
         seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
     } else if (c.vcf_list_file != "") {
@@ -1683,21 +2085,22 @@ int main(int argc, char **argv)
         }
         if (!read_vcfs(vcf_files, &sites, c.subregion_str,
                        c.vcf_min_qual, c.vcf_filter, c.use_genotype_probs,
-                       c.mask_uncertain, c.tabix_dir, keep_inds)) {
+                       c.mask_uncertain, c.tabix_dir, keep_inds,
+                       c.model.nthreads)) {
             printError("Error reading VCF files\n");
-            return EXIT_ERROR;
+            return false;
         }
         seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
     } else {
         // no input sequence specified
         printError("must specify sequences (use --fasta or --sites)");
-        return EXIT_ERROR;
+        return false;
     }
 
     if (c.rename_file != "")
         sites.rename(c.rename_file);
 
-    if (keep_inds.size() > 0) {
+    if (keep_inds.size() > 0 && !subset_read) {
         if (sites.subset(keep_inds)) {
             printError("Error subsetting sites\n");
             return false;
@@ -1705,14 +2108,14 @@ int main(int argc, char **argv)
     }
 
     //read in masks
-    vector<TrackNullValue> ind_maskmap;
+    ind_maskmap.clear();
     for (int i=0; i < sites.get_num_seqs(); i++)
         ind_maskmap.push_back(TrackNullValue());
     if (c.ind_maskmap != "") {
         FILE *infile = fopen(c.ind_maskmap.c_str(), "r");
         if (infile == NULL) {
             fprintf(stderr, "Error opening ind_maskmap %s\n", c.ind_maskmap.c_str());
-            return EXIT_ERROR;
+            return false;
         }
         char ind[10000], maskfile[100000];
         while (EOF != fscanf(infile, "%s %s", ind, maskfile)) {
@@ -1721,15 +2124,14 @@ int main(int argc, char **argv)
             if (!stream.stream ||
                 !read_track_filter(stream.stream, &indmask, seq_region)) {
                 printError("cannot read mask %s for ind %s\n", maskfile, ind);
-                return EXIT_ERROR;
+                return false;
             }
             apply_mask_sites(&sites, indmask, ind, &ind_maskmap);
         }
         fclose(infile);
     }
 
-    TrackNullValue maskmap_orig;
-    TrackNullValue maskmap = sites.remove_masked();
+    maskmap = sites.remove_masked();
     if (c.maskmap != "") {
         //read mask
         printLog(LOG_LOW, "Reading %s\n", c.maskmap.c_str());
@@ -1739,11 +2141,10 @@ int main(int argc, char **argv)
             !read_track_filter(stream.stream, &curr_maskmap, seq_region)) {
             printError("cannot read mask map '%s'",
                        c.maskmap.c_str());
-            return EXIT_ERROR;
+            return false;
         }
         maskmap.merge_tracks(curr_maskmap);
     }
-    c.all_masked=false;
 
     if (c.maskN >= 0) {
         TrackNullValue maskNmap = get_n_regions(sites, c.maskN);
@@ -1754,7 +2155,7 @@ int main(int argc, char **argv)
         int numsnp, window;
         if (2 != sscanf(c.mask_cluster.c_str(), "%i,%i", &numsnp, &window)) {
             printError("Bad format in mask_cluster agument; expect numsnp,windowSize");
-            return EXIT_ERROR;
+            return false;
         }
         TrackNullValue cluster_mask = get_snp_clusters(sites, numsnp, window);
         maskmap.merge_tracks(cluster_mask);
@@ -1784,15 +2185,371 @@ int main(int argc, char **argv)
     // compress sequences
     // first remove any sites that fall under mask
 
-    sites_mapping = new SitesMapping();
-    sites_mapping_ptr = unique_ptr<SitesMapping>(sites_mapping);
-
-    if (!find_compress_cols(&sites, c.compress_seq, sites_mapping)) {
+    if (c.compress_max > 0) {
+        if (!find_compress_cols_adaptive(&sites, c.compress_seq,
+                                         c.compress_max, maskmap,
+                                         sites_mapping)) {
+            printError("unable to compress sequences at given compression"
+                       " levels (--compress-seq, --compress-seq-max)");
+            return false;
+        }
+        printLog(LOG_LOW, "adaptive compression: %d sites, %.2f sites per"
+                 " compressed site\n", sites_mapping->new_end,
+                 sites_mapping->get_mean_compress());
+    } else if (!find_compress_cols(&sites, c.compress_seq, sites_mapping)) {
         printError("unable to compress sequences at given compression level"
                    " (--compress-seq)");
-        return EXIT_ERROR;
+        return false;
     }
     compress_sites(&sites, sites_mapping);
+
+    // read model parameter maps if given
+    if (c.mutmap != "") {
+        CompressStream stream(c.mutmap.c_str(), "r");
+        if (!stream.stream ||
+            !read_track_filter(stream.stream, &inputs->mutmap, seq_region)) {
+            printError("cannot read mutation rate map '%s'", c.mutmap.c_str());
+            return false;
+        }
+    }
+    if (c.recombmap != "") {
+        CompressStream stream(c.recombmap.c_str(), "r");
+        if (!stream.stream ||
+            !read_track_filter(stream.stream, &inputs->recombmap,
+                               seq_region)) {
+            printError("cannot read recombination rate map '%s'",
+                       c.recombmap.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// Reads the preprocessed inputs from a bundle instead of the input files
+bool read_inputs_bundle(Config &c, InputBundle *inputs)
+{
+    if (c.sites_file != "" || c.fasta_file != "" || c.vcf_file != "" ||
+        c.vcf_list_file != "" || c.maskmap != "" || c.ind_maskmap != "" ||
+        c.mutmap != "" || c.recombmap != "" || c.subsites_file != "") {
+        printError("input files cannot be given with --bundle");
+        return false;
+    }
+
+    if (!read_input_bundle(c.bundle_file.c_str(), inputs))
+        return false;
+    if (inputs->compress_seq != c.compress_seq ||
+        inputs->compress_max != c.compress_max) {
+        printError("bundle '%s' was written with --compress-seq %d"
+                   " --compress-seq-max %d", c.bundle_file.c_str(),
+                   inputs->compress_seq, inputs->compress_max);
+        return false;
+    }
+    if (inputs->unphased)
+        c.unphased = true;
+
+    const Sites &sites = inputs->sites;
+    printLog(LOG_LOW, "read input bundle (chrom=%s, start=%d, end=%d, "
+             "nseqs=%d, nsites=%d) [compressed coordinates]\n",
+             sites.chrom.c_str(), sites.start_coord, sites.end_coord,
+             sites.get_num_seqs(), sites.get_num_sites());
+    return true;
+}
+
+
+//=============================================================================
+// threaded (MC)^3
+
+#ifndef ARGWEAVER_MPI
+
+// A heated chain of a threaded (MC)^3 run.  Chain 0 is the one set up by
+// main(), which it runs on the main thread.
+class Mc3Chain
+{
+public:
+    Mc3Chain(const Config &config, const ArgModel &model) :
+        config(config),
+        model(model),
+        logger(NULL, config.verbose)
+    {}
+
+    Config config;
+    ArgModel model;
+    Sequences sequences;
+    LocalTrees trees;
+    RandState rand;
+    Logger logger;
+    ForwardStats forward_stats;
+};
+
+
+// Sets up chain 'group' like main() sets up chain 0, using the generator
+// and log of the chain.  The chain starts from the initial ARG of chain 0,
+// or from its own checkpoint when resuming.
+bool setup_mcmcmc_chain(Mc3Chain *chain, int group,
+                        const Sequences *sequences, const LocalTrees *trees,
+                        const Config *config0, int argc, char **argv)
+{
+    Config &c = chain->config;
+    char tmp[100];
+    snprintf(tmp, sizeof(tmp), ".%d", group);
+    c.mcmcmc_prefix = tmp;
+    c.mcmcmc_group = group;
+    c.stats_file = NULL;
+    c.states_file = NULL;
+    c.checkpoint.reset();
+    chain->model.mc3 = Mc3Config(group, c.mcmcmc_heat);
+    chain->model.mc3.max_group = c.mcmcmc_numgroup - 1;
+
+    if (!check_overwrite(c))
+        return false;
+    string log_filename = c.out_prefix + c.mcmcmc_prefix + LOG_SUFFIX;
+    if (!chain->logger.openLogFile(log_filename.c_str(),
+                                   c.resume ? "a" : "w")) {
+        printError("could not open log file '%s'", log_filename.c_str());
+        return false;
+    }
+    if (c.resume)
+        printLog(LOG_LOW, "RESUME\n");
+    log_intro(LOG_LOW);
+    log_prog_commands(LOG_LOW, argc, argv);
+    printLog(LOG_LOW, "mcmcmc group %d (heat %f)\n", group,
+             chain->model.mc3.heat);
+
+    // chains of one run are resumed from checkpoints of the same iteration
+    if (c.resume) {
+        if (!setup_resume(c))
+            return false;
+        if (!c.checkpoint) {
+            printError("mcmcmc chains other than group 0 can only be"
+                       " resumed from a checkpoint");
+            return false;
+        }
+        if (c.resume_iter != config0->resume_iter) {
+            printError("checkpoint of mcmcmc group %d is at iteration %d,"
+                       " but the one of group 0 is at %d", group,
+                       c.resume_iter, config0->resume_iter);
+            return false;
+        }
+    } else {
+        remove(get_checkpoint_file(c).c_str());
+    }
+
+    chain->sequences.copy(*sequences);
+    if (c.checkpoint) {
+        if (!restore_checkpoint(c.checkpoint.get(), &chain->model,
+                                &chain->sequences, &chain->trees)) {
+            printError("could not resume from checkpoint");
+            return false;
+        }
+        c.checkpoint.reset();
+    } else {
+        chain->trees.copy(*trees);
+    }
+
+    string stats_filename = c.out_prefix + c.mcmcmc_prefix + STATS_SUFFIX;
+    if (!(c.stats_file = fopen(stats_filename.c_str(),
+                               c.resume ? "a" : "w"))) {
+        printError("could not open stats file '%s'", stats_filename.c_str());
+        return false;
+    }
+    return open_states_file(&c, c.resume ? "a" : "w");
+}
+
+
+// Runs the chains of an (MC)^3 run on threads.  Chain 0 runs on the calling
+// thread with the given model, sequences and ARG.
+bool sample_arg_mcmcmc(ArgModel *model, Sequences *sequences,
+                       LocalTrees *trees, SitesMapping* sites_mapping,
+                       Config *config, const TrackNullValue *maskmap_orig,
+                       int argc, char **argv)
+{
+    const int nchains = config->mcmcmc_numgroup;
+
+    // streams of the other chains and a seed for the swaps, drawn without
+    // using the generator of chain 0
+    RandState streams;
+    streams.seed(config->randseed);
+    Mc3Threads threads(nchains, streams.next());
+    config->mc3_threads = &threads;
+
+    vector<unique_ptr<Mc3Chain> > chains;
+    bool ok = true;
+    for (int group=1; group<nchains && ok; group++) {
+        Mc3Chain *chain = new Mc3Chain(*config, *model);
+        chains.push_back(unique_ptr<Mc3Chain>(chain));
+        streams.jump();
+        chain->rand = streams;
+
+        set_thread_rand(&chain->rand);
+        setThreadLogger(&chain->logger);
+        set_thread_forward_stats(&chain->forward_stats);
+        ok = setup_mcmcmc_chain(chain, group, sequences, trees, config,
+                                argc, argv);
+        set_thread_rand(NULL);
+        setThreadLogger(NULL);
+        set_thread_forward_stats(NULL);
+    }
+    if (!ok)
+        return false;
+
+    printLog(LOG_LOW, "running %d mcmcmc chains on threads\n", nchains);
+    vector<thread> workers;
+    for (unsigned int i=0; i<chains.size(); i++) {
+        Mc3Chain *chain = chains[i].get();
+        workers.push_back(thread([=]() {
+                    set_thread_rand(&chain->rand);
+                    setThreadLogger(&chain->logger);
+                    set_thread_forward_stats(&chain->forward_stats);
+                    sample_arg(&chain->model, &chain->sequences,
+                               &chain->trees, sites_mapping, &chain->config,
+                               maskmap_orig);
+                    finish_output();
+                    printLog(LOG_LOW, "FINISH\n");
+                    fclose(chain->config.stats_file);
+                    close_states_file(&chain->config);
+                    chain->logger.closeLogFile();
+                }));
+    }
+    sample_arg(model, sequences, trees, sites_mapping, config, maskmap_orig);
+    for (unsigned int i=0; i<workers.size(); i++)
+        workers[i].join();
+    config->mc3_threads = NULL;
+    return true;
+}
+
+#endif // ARGWEAVER_MPI
+
+
+//=============================================================================
+
+
+int main(int argc, char **argv)
+{
+
+#ifdef ARGWEAVER_MPI
+    MPI::Init(argc, argv);
+#endif
+
+    // parse command line arguments
+    Config c;
+    int ret = c.parse_args(argc, argv);
+    if (ret)
+        return ret;
+
+    // ensure output dir
+    if (!ensure_output_dir(c.out_prefix.c_str()))
+        return EXIT_ERROR;
+
+    // check overwriting
+    if (!check_overwrite(c))
+        return EXIT_ERROR;
+
+    // setup logging
+    set_up_logging(c, c.verbose, (c.resume ? "a" : "w"));
+
+    // try to resume a previous run
+    if (!setup_resume(c)) {
+        printError("resume failed.");
+        if (c.overwrite) {
+            c.resume = false;
+            printLog(LOG_LOW, "Resume failed.  Sampling will start from scratch"
+                     " since overwrite is enabled.\n");
+        } else {
+            return EXIT_ERROR;
+        }
+    }
+
+    // a new run must not be resumed from the checkpoint of an older one
+    if (!c.resume)
+        remove(get_checkpoint_file(c).c_str());
+
+#ifdef ARGWEAVER_MPI
+    if (c.mpi) {
+        int numcore = MPI::COMM_WORLD.Get_size();
+        if (numcore % c.mcmcmc_numgroup != 0) {
+            fprintf(stderr, "Error: number of cores should be evenly divisible"
+                    " by number of mcmcmc threads");
+        }
+        int groupsize = numcore / c.mcmcmc_numgroup;
+        int sites_num = MPI::COMM_WORLD.Get_rank() % groupsize;
+        char tmp[10000];
+        sprintf(tmp, "%s%i.sites", c.sites_file.c_str(),
+                sites_num);
+        c.sites_file = (string)tmp;
+        sprintf(tmp, "%s%i", c.out_prefix.c_str(),
+                sites_num);
+        c.out_prefix = (string)tmp;
+        /*        if (c.cr_file != "") {
+            sprintf(tmp, "%s%i.cr.gz", c.cr_file.c_str(), sites_num);
+            c.cr_file = (string)tmp;
+            }*/
+	if (c.arg_file != "") {
+	    sprintf(tmp, "%s%i.smc.gz", c.arg_file.c_str(), sites_num);
+	    c.arg_file = (string)tmp;
+	}
+    }
+#endif
+
+
+
+    // log intro
+    if (c.resume)
+        printLog(LOG_LOW, "RESUME\n");
+    log_intro(LOG_LOW);
+    log_prog_commands(LOG_LOW, argc, argv);
+    Timer timer;
+
+
+    // init random number generator
+    if (c.randseed == 0)
+        c.randseed = time(NULL);
+#ifdef ARGWEAVER_MPI
+    if (MPI::COMM_WORLD.Get_rank()==0) {
+        for (int i=1; i < MPI::COMM_WORLD.Get_size(); i++) {
+            int seed = irand(12581020);
+            MPI::COMM_WORLD.Send(&seed, 1, MPI::INT, i, 13);
+        }
+    } else {
+        MPI::COMM_WORLD.Recv(&c.randseed, 1, MPI::INT, 0, 13);
+    }
+#endif
+    seed_rand(c.randseed);
+    printLog(LOG_LOW, "random seed: %d\n", c.randseed);
+    printLog(LOG_MEDIUM, "simd kernels: %s\n",
+             get_simd_name(get_simd_level()));
+    set_math_accuracy(c.fast_exp ? MATH_FAST : MATH_EXACT);
+    set_compress_threads(c.model.nthreads);
+    printLog(LOG_MEDIUM, "exp/log accuracy: %s\n",
+             get_math_accuracy_name(get_math_accuracy()));
+
+    // read sequences
+    InputBundle inputs;
+    if (c.bundle_file != "") {
+        if (!read_inputs_bundle(c, &inputs))
+            return EXIT_ERROR;
+    } else if (!read_inputs(c, &inputs)) {
+        return EXIT_ERROR;
+    }
+    if (c.write_bundle_file != "") {
+        if (!write_input_bundle(c.write_bundle_file.c_str(), &inputs))
+            return EXIT_ERROR;
+        printLog(LOG_LOW, "Wrote input bundle %s\n",
+                 c.write_bundle_file.c_str());
+        return 0;
+    }
+
+    Sites &sites = inputs.sites;
+    Sequences sequences;
+    SitesMapping *sites_mapping = &inputs.sites_mapping;
+    Region &seq_region = inputs.seq_region;
+    Region seq_region_compress;
+    TrackNullValue &maskmap = inputs.maskmap;
+    vector<TrackNullValue> &ind_maskmap = inputs.ind_maskmap;
+    TrackNullValue maskmap_orig;
+    c.all_masked=false;
+
     make_sequences_from_sites(&sites, &sequences);
     seq_region_compress.set(seq_region.chrom, 0, sequences.length());
 
@@ -1850,10 +2607,14 @@ int main(int argc, char **argv)
 
     if (c.write_sites || c.write_sites_only) {
         log_sequences(sites.chrom, &sequences, &c, sites_mapping, -1);
+        finish_output();
         printLog(LOG_LOW, "Wrote sites\n");
         if (c.write_sites_only) return(0);
     }
 
+    // packed alignment for site compatibility statistics
+    sequences.pack();
+
 
     // setup model parameters
     if (c.times_file != "")
@@ -1902,6 +2663,7 @@ int main(int argc, char **argv)
             c.model.popsize_config =
                 PopsizeConfig(c.popsize_config_file, c.model.ntimes,
                               c.model.num_pops(), c.model.popsizes);
+            c.model.update_interval_tables();
         } else if (c.popsize_config == 0) {
             c.model.popsize_config =
                 PopsizeConfig(c.ntimes, c.model.num_pops(), true, true);
@@ -1919,50 +2681,89 @@ int main(int argc, char **argv)
 	c.model.popsize_config.epsilon = c.epsilon;
 	c.model.popsize_config.pseudocount = c.pseudocount;
     }
-#ifdef ARGWEAVER_MPI
     c.model.mc3 = Mc3Config(c.mcmcmc_group, c.mcmcmc_heat);
-
+#ifdef ARGWEAVER_MPI
     printf("MPI rank=%i size=%i\n",
            MPI::COMM_WORLD.Get_rank(),
            MPI::COMM_WORLD.Get_size());
     MPI::COMM_WORLD.Barrier();
-    #endif
+#else
+    c.model.mc3.max_group = c.mcmcmc_numgroup - 1;
+#endif
     if (c.init_popsize_random)
         c.model.set_popsizes_random();
 
-    // read model parameter maps if given
-    if (c.mutmap != "") {
-        CompressStream stream(c.mutmap.c_str(), "r");
-        if (!stream.stream ||
-            !read_track_filter(stream.stream, &c.model.mutmap, seq_region)) {
-            printError("cannot read mutation rate map '%s'", c.mutmap.c_str());
-            return EXIT_ERROR;
-        }
-    }
-    if (c.recombmap != "") {
-        CompressStream stream(c.recombmap.c_str(), "r");
-        if (!stream.stream ||
-            !read_track_filter(stream.stream, &c.model.recombmap, seq_region)) {
-            printError("cannot read recombination rate map '%s'",
-                       c.recombmap.c_str());
-            return EXIT_ERROR;
-        }
-    }
+    // model parameter maps
+    c.model.mutmap = inputs.mutmap;
+    c.model.recombmap = inputs.recombmap;
 
 
     // make compressed model
     ArgModel model(c.model);
-    if (!model.setup_maps(seq_region.chrom, seq_region.start, seq_region.end))
+    if (!model.setup_maps(seq_region.chrom, seq_region.start, seq_region.end,
+                          c.map_tolerance))
         return EXIT_ERROR;
     compress_model(&model, sites_mapping, c.compress_seq);
 
+    // sharded sampling stitches trees without population paths or phasing
+    if (c.shard_size > 0) {
+        if (model.pop_tree != NULL || model.unphased) {
+            printError("--shard-size cannot be used with population models"
+                       " or unphased data");
+            return EXIT_ERROR;
+        }
+        if (c.shard_overlap / c.compress_seq < 4 * sequences.get_num_seqs() + 2
+            || c.shard_size < c.shard_overlap) {
+            printError("--shard-overlap must be at least %d bases and at"
+                       " most --shard-size",
+                       (4 * sequences.get_num_seqs() + 2) * c.compress_seq);
+            return EXIT_ERROR;
+        }
+    }
+
+#ifdef ARGWEAVER_MPI
+    // a --domains run samples one chain of the whole genome from scratch
+    if (c.domains) {
+        if (c.mpi || c.mcmcmc_numgroup > 1 || c.resume || c.gibbs ||
+            c.no_sample_arg || c.resample_region_str != "" ||
+            model.pop_tree != NULL || model.unphased) {
+            printError("--domains cannot be used with --mpi, --mcmcmc,"
+                       " --resume, --gibbs, --no-sample-arg,"
+                       " --resample-region, population models or unphased"
+                       " data");
+            return EXIT_ERROR;
+        }
+        if (sequences.length() < 2 * MPI::COMM_WORLD.Get_size()) {
+            printError("too many MPI ranks for --domains");
+            return EXIT_ERROR;
+        }
+        c.no_checkpoint = true;
+    }
+#endif
+
     // log original model
     model.log_model();
 
     // setup init ARG
     LocalTrees *trees = NULL;
     unique_ptr<LocalTrees> trees_ptr;
-    if (c.arg_file != "") { // || c.cr_file != "") {
+    if (c.resume && c.checkpoint) {
+        // restore ARG and sampler state from checkpoint
+        trees = new LocalTrees();
+        trees_ptr = unique_ptr<LocalTrees>(trees);
+        if (!restore_checkpoint(c.checkpoint.get(), &model, &sequences,
+                                trees)) {
+            printError("could not resume from checkpoint");
+            return EXIT_ERROR;
+        }
+        c.checkpoint.reset();
+
+        printLog(LOG_LOW, "read checkpoint ARG (chrom=%s, start=%d, end=%d,"
+                 " nseqs=%d) [compressed coordinates]\n",
+                 trees->chrom.c_str(), trees->start_coord, trees->end_coord,
+                 trees->get_num_leaves());
+
+    } else if (c.arg_file != "") { // || c.cr_file != "") {
         // init ARG from file
 
         trees = new LocalTrees();
@@ -2043,6 +2844,8 @@ int main(int argc, char **argv)
         printError("could not open stats file '%s'", stats_filename.c_str());
         return EXIT_ERROR;
     }
+    if (!open_states_file(&c, stats_mode))
+        return EXIT_ERROR;
 
     // get memory usage in MB
     double maxrss = get_max_memory_usage() / 1000.0;
@@ -2050,16 +2853,31 @@ int main(int argc, char **argv)
 
     // sample ARG
     printLog(LOG_LOW, "\n");
+#ifndef ARGWEAVER_MPI
+    if (c.mcmcmc_numgroup > 1) {
+        if (!sample_arg_mcmcmc(&model, &sequences, trees, sites_mapping, &c,
+                               &maskmap_orig, argc, argv))
+            return EXIT_ERROR;
+    } else
+#else
+    if (c.domains && MPI::COMM_WORLD.Get_rank() != 0)
+        serve_arg_domains(&model, &sequences, &c);
+    else
+#endif
     sample_arg(&model, &sequences, trees, sites_mapping, &c, &maskmap_orig);
+    finish_output();
 
     // final log message
     maxrss = get_max_memory_usage() / 1000.0;
     printTimerLog(timer, LOG_LOW, "sampling time: ");
     printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
+    log_tag_memory(LOG_MEDIUM);
+    write_profile(get_log_file_logger()->getLogFile());
     printLog(LOG_LOW, "FINISH\n");
 
     // clean up
     fclose(c.stats_file);
+    close_states_file(&c);
 
 #ifdef ARGWEAVER_MPI
     MPI_Finalize();
@@ -15,15 +15,20 @@
 
 // argweaver includes
 #include "argweaver/ConfigParam.h"
+#include "argweaver/arg_archive.h"
 #include "argweaver/logging.h"
 #include "argweaver/parsing.h"
+#include "argweaver/profile.h"
 #include "argweaver/track.h"
 #include "argweaver/Tree.h"
 #include "argweaver/tabix.h"
 #include "argweaver/compress.h"
 #include "argweaver/IntervalIterator.h"
+#include "argweaver/local_tree.h"
 #include "argweaver/model.h"
+#include "argweaver/query_server.h"
 #include "argweaver/seq.h"
+#include "argweaver/thread_pool.h"
 //#include "allele_age.h"
 
 
@@ -35,12 +40,14 @@ using namespace spidir;
 */
 
 #define VERSION_INFO "arg-summarize 0.3"
+FILE *outstream = stdout;   // results are written here (see --output)
 bool html;
 int summarize=0;
 int getNumSample=0;
 int getMean=0;
 int getStdev=0;
 int getQuantiles=0;
+int sketchSize=0;
 vector <double> quantiles;
 vector<string> node_dist_leaf1;
 vector<string> node_dist_leaf2;
@@ -60,21 +67,17 @@ class MigStat {
 public:
     MigStat(string name, int p0[2], double dt, const ArgModel *model,
             const string hap="") : name(name),hap(hap){
-        bool found=false;
-        // ensure that t[0] < t[1]
+        // ensure that t[0] < t[1]; both are -1 if no interval spans dt
         p[0] = p0[0];
         p[1] = p0[1];
+        t[0] = t[1] = -1;
         for (int i=0; i < model->ntimes-1; i++)
             if (model->times[i] < dt && model->times[i+1] > dt) {
                 t[0] = i;
                 t[1] = i+1;
-                found=true;
             }
-        if (!found) {
-            fprintf(stderr, "Error finding time intervals spanning mig time %f\n", dt);
-            exit(1);
-        }
     }
+    bool found() const { return t[0] != -1; }
     string name;
     int p[2];
     int t[2];
@@ -111,6 +114,8 @@ public:
     Config()
     {
         sample_num=0;
+        serve_port=0;
+        archive=NULL;
         make_parser();
     }
     void make_parser() {
@@ -122,7 +127,9 @@ public:
                     "Bed file containing args sampled by ARGweaver. Should"
                     " be created with smc2bed and sorted with sort-bed. If"
                     " using --region or --bedfile, also needs to be gzipped"
-                    " and tabix'd"));
+                    " and tabix'd. May also be an archive made with"
+                    " bed2archive, which reads only the trees of the samples"
+                    " used (see --sample and --burnin)"));
         config.add(new ConfigParam<string>
                    ("-r", "--region", "<chr:start-end>", &region,
                     "region to retrieve statistics from (1-based coords)"));
@@ -334,13 +341,41 @@ public:
         config.add(new ConfigParam<string>
                    ("-Q", "--quantile", "<q1,q2,q3,...>", &quantile,
                     "return the requested quantiles for each samples"));
+        config.add(new ConfigSwitch
+                   ("", "--sketch", &sketch,
+                    "summarize in bounded memory: the mean and stdev are"
+                    " updated as samples are read, and quantiles are estimated"
+                    " with a t-digest (exact for up to 100 samples). Useful"
+                    " with --quantile over many samples"));
 
         config.add(new ConfigParamComment("Misceallaneous"));
         config.add(new ConfigParam<int>
                    ("-u", "--burnin", "<num>", &burnin, 0,
                     "Discard results from iterations < burnin before computing statistics"));
+        config.add(new ConfigParam<int>
+                   ("", "--serve", "<port>", &serve_port,
+                    "run as a server answering queries on this port of the"
+                    " local host. Each query is a line of arguments (words,"
+                    " or a JSON array of strings) added to the other"
+                    " arguments, and is answered with the output of"
+                    " arg-summarize. Log files, indexes and decoded regions"
+                    " of the argfile are kept between queries"));
+        config.add(new ConfigParam<int>
+                   ("", "--cache-size", "<MB>", &cache_size, 256,
+                    "memory for decoded argfile regions kept by --serve"
+                    " (default=256)"));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<# of threads>", &nthreads, 1,
+                    "number of threads used for parsing and scoring the trees"
+                    " of different MCMC samples (default=1; not used with"
+                    " --snp-file)"));
         config.add(new ConfigSwitch
                    ("-n", "--no-header", &noheader, "Do not output header"));
+        config.add(new ConfigParam<string>
+                   ("-o", "--output", "<file>", &outfile,
+                    "file to write results to (default=stdout). A file"
+                    " ending in .gz is written bgzipped as the results are"
+                    " made, and indexed for tabix"));
         config.add(new ConfigParam<string>
                    ("-t", "--tabix-dir", "<tabix dir>", &tabix_dir,
                     "Specify the directory of the tabix executable"));
@@ -432,31 +467,40 @@ public:
     bool mean;
     bool stdev;
     string quantile;
+    bool sketch;
 
     int burnin;
+    int serve_port;
+    int cache_size;
+    int nthreads;
     bool noheader;
+    string outfile;
     string tabix_dir;
     bool quiet;
     bool version;
     bool help;
     bool help_popmodel;
     bool help_advanced;
+
+    ArgArchive *archive;          // argfile, if it is an ARG archive
+    vector<int> archive_samples;  // samples to read from archive
 };
 
 void checkResults(IntervalIterator<vector<double> > *results) {
     Interval<vector<double> > summary=results->next();
-    vector<vector <double> > scores;
     while (summary.start != summary.end) {
-        scores = summary.get_scores();
-        if (scores.size() > 0) {
-            if (html) printf("<tr><td>\n");
-            printf("%s\t", summary.chrom.c_str());
-            if (html) printf("</td><td>");
-            printf("%i\t", summary.start);
-            if (html) printf("</td><td>");
-            printf("%i", summary.end);
+        vector<vector <double> > &scores = summary.get_scores();
+        vector<ScoreSketch> &sketches = summary.get_sketches();
+        const bool sketched = summary.is_sketched();
+        if (summary.num_score() > 0) {
+            if (html) fprintf(outstream, "<tr><td>\n");
+            fprintf(outstream, "%s\t", summary.chrom.c_str());
+            if (html) fprintf(outstream, "</td><td>");
+            fprintf(outstream, "%i\t", summary.start);
+            if (html) fprintf(outstream, "</td><td>");
+            fprintf(outstream, "%i", summary.end);
             vector<double> tmpScore(scores.size());
-            int numscore = scores[0].size();
+            int numscore = sketched ? sketches.size() : scores[0].size();
             assert(numscore > 0);
             for (int i=0; i < numscore; i++) {
                 int have_mean = 0;
@@ -464,32 +508,40 @@ void checkResults(IntervalIterator<vector<double> > *results) {
                 for (unsigned int j=0; j < scores.size(); j++)
                     tmpScore[j] = scores[j][i];
                 if (i==0 && getNumSample > 0) {
-                    if (html) printf("</td><td>");
-                    printf("\t%i", (int)scores.size());
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "\t%i", summary.num_score());
                 }
                 for (int j=1; j <= summarize; j++) {
                     if (getMean==j) {
-                        meanval = compute_mean(tmpScore);
+                        meanval = (sketched ? sketches[i].mean() :
+                                   compute_mean(tmpScore));
                         have_mean=1;
-                        if (html) printf("</td><td>");
-                        printf("\t%g", meanval);
+                        if (html) fprintf(outstream, "</td><td>");
+                        fprintf(outstream, "\t%g", meanval);
                     } else if (getStdev==j) {
-                        if (!have_mean)
-                            meanval = compute_mean(tmpScore);
-                        if (html) printf("</td><td>");
-                        printf("\t%g", compute_stdev(tmpScore, meanval));
+                        double stdev;
+                        if (sketched) {
+                            stdev = sketches[i].stdev();
+                        } else {
+                            if (!have_mean)
+                                meanval = compute_mean(tmpScore);
+                            stdev = compute_stdev(tmpScore, meanval);
+                        }
+                        if (html) fprintf(outstream, "</td><td>");
+                        fprintf(outstream, "\t%g", stdev);
                     } else if (getQuantiles==j) {
-                        vector<double> q =
-                            compute_quantiles(tmpScore, quantiles);
+                        vector<double> q = (sketched ?
+                            sketches[i].quantiles(quantiles) :
+                            compute_quantiles(tmpScore, quantiles));
                         for (unsigned int k=0; k < quantiles.size(); k++) {
-                        if (html) printf("</td><td>");
-                            printf("\t%g", q[k]);
+                        if (html) fprintf(outstream, "</td><td>");
+                            fprintf(outstream, "\t%g", q[k]);
                         }
                     }
                 }
             }
-            printf("\n");
-            if (html) printf("</td></tr>\n");
+            fprintf(outstream, "\n");
+            if (html) fprintf(outstream, "</td></tr>\n");
         }
         summary = results->next();
     }
@@ -497,7 +549,7 @@ void checkResults(IntervalIterator<vector<double> > *results) {
 
 class BedLine {
 public:
-    BedLine(char *chr, int start, int end, int sample, char *nwk,
+    BedLine(const char *chr, int start, int end, int sample, const char *nwk,
             SprPruned *trees=NULL) :
         start(start), end(end), sample(sample),
         trees(trees) {
@@ -533,6 +585,7 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
                   ArgSummarizeData &data,
                   double allele_age=-1, double min_allele_age = -1,
                   int infsites=-1) {
+    PROFILE_SCOPE(PROFILE_SUMMARIZE);
     Tree * tree = (line->trees->pruned_tree != NULL ?
                    line->trees->pruned_tree :
                    line->trees->orig_tree);
@@ -543,32 +596,41 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
     int ind_dist_idx=0;
     if (line->stats.size() == statname.size()) return;
     line->stats.resize(statname.size());
+
+    // the statistics of the whole tree share one traversal
+    unique_ptr<TreeStats> tree_stats;
+    auto get_tree_stats = [&]() -> TreeStats & {
+        if (!tree_stats)
+            tree_stats.reset(new TreeStats(tree));
+        return *tree_stats;
+    };
+
     for (unsigned int i=0; i < statname.size(); i++) {
         if (statname[i] == "tmrca")
-            line->stats[i] = tree->tmrca();
+            line->stats[i] = get_tree_stats().tmrca();
         else if (statname[i]=="tmrca_half")
-            line->stats[i] = tree->tmrca_half();
+            line->stats[i] = get_tree_stats().tmrca_half();
         else if (statname[i]=="pi")
-            line->stats[i] = tree->avg_pairwise_distance();
+            line->stats[i] = get_tree_stats().avg_pairwise_distance();
         else if (statname[i]=="branchlen") {
             if (bl < 0) {
-                line->stats[i] = tree->total_branchlength();
+                line->stats[i] = get_tree_stats().total_branchlength();
                 bl=line->stats[i];
             }
         }
         else if (statname[i]=="rth")
-            line->stats[i] = tree->rth();
+            line->stats[i] = get_tree_stats().rth();
         else if (statname[i]=="popsize")
-            line->stats[i] = tree->popsize();
+            line->stats[i] = get_tree_stats().popsize();
         else if (statname[i]=="recomb") {
-            if (bl < 0) bl = tree->total_branchlength();
+            if (bl < 0) bl = get_tree_stats().total_branchlength();
             line->stats[i] = 1.0/(bl*(double)(line->end - line->start));
         }
         else if (statname[i]=="breaks") {
             line->stats[i] = 1.0/((double)(line->end - line->start));
         }
         else if (statname[i]=="zero_len") {
-            line->stats[i] = tree->num_zero_branches();
+            line->stats[i] = get_tree_stats().num_zero_branches();
         }
         else if (statname[i]=="max_coal_rate") {
             line->stats[i] = tree->maxCoalRate(model);
@@ -580,6 +642,13 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
                                                      &line->trees->pruned_spr);
                 //pruned tree will be fewer characters than whole tree
                 sprintf(line->newick, "%s", tmp.c_str());
+            } else if (is_bed_spr_record(line->newick)) {
+                string tmp =
+                    line->trees->orig_tree->format_newick(false, true, 1,
+                                                     &line->trees->orig_spr);
+                free(line->newick);
+                line->newick = (char*)malloc((tmp.size()+1)*sizeof(char));
+                strcpy(line->newick, tmp.c_str());
             }
         }
         else if (statname[i]=="allele_age")
@@ -634,18 +703,11 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
             i += model->ntimes - 1;
         }
         else if (statname[i].substr(0, 10)=="branchlen.") {
+            vector<double> lens = get_tree_stats().branchlen_per_time(model);
             for (int j=0; j < model->ntimes; j++) {
                 assert(i+j < statname.size() &&
                        statname[i+j].substr(0, 10)=="branchlen.");
-                line->stats[i+j] = 0;
-            }
-            for (int j=0; j < tree->nnodes; j++) {
-                if (tree->nodes[j] == tree->root) continue;
-                int age1 = model->discretize_time(tree->nodes[j]->age);
-                int age2 = model->discretize_time(tree->nodes[j]->parent->age);
-                for (int k=age1; k < age2; k++) {
-                    line->stats[i + k] += (model->times[k + 1] - model->times[k]);
-                }
+                line->stats[i+j] = lens[j];
             }
             i += model->ntimes - 1;
         }
@@ -667,7 +729,8 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
 	    ind_dist_idx++;
 	}
         else if (statname[i].substr(0, 11)=="coalcounts.") {
-            vector<double>coal_counts = tree->coalCounts(model->times, model->ntimes);
+            vector<double>coal_counts =
+                get_tree_stats().coalCounts(model->times, model->ntimes);
             for (unsigned int j=0; j < coal_counts.size(); j++) {
                 assert(i+j < statname.size() &&
                        statname[i+j].substr(0,11)=="coalcounts.");
@@ -742,10 +805,41 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
             i++;
         }
         else {
+            // names are checked by checkStatNames before any line is scored
+            assert(false);
+        }
+    }
+}
+
+
+// Returns true if scoreBedLine knows every statistic in 'statname'
+bool checkStatNames(const vector<string> &statname,
+                    const ArgSummarizeData &data)
+{
+    const char *names[] = {
+        "tmrca", "tmrca_half", "pi", "branchlen", "rth", "popsize", "recomb",
+        "breaks", "zero_len", "max_coal_rate", "tree", "allele_age",
+        "min_allele_age", "inf_sites", "cluster_stat", "cluster_time", NULL};
+    const char *prefixes[] = {
+        "node_dist", "min_coal_time", "recombs.", "invis-recombs.",
+        "branchlen.", "ind_dist", "coalcounts.", "coalcounts-cluster.",
+        "group", "spr_leaf-", "coal-", NULL};
+
+    for (unsigned int i=0; i < statname.size(); i++) {
+        bool known = false;
+        for (int j=0; names[j] && !known; j++)
+            known = (statname[i] == names[j]);
+        for (int j=0; prefixes[j] && !known; j++)
+            known = (statname[i].compare(0, strlen(prefixes[j]),
+                                         prefixes[j]) == 0);
+        for (unsigned int j=0; j < data.migstat.size() && !known; j++)
+            known = (statname[i] == data.migstat[j].name);
+        if (!known) {
             fprintf(stderr, "Error: unknown stat %s\n", statname[i].c_str());
-            exit(1);
+            return false;
         }
     }
+    return true;
 }
 
 
@@ -776,7 +870,6 @@ void processNextBedLine(BedLine *line,
                         vector<string> &statname,
                         char *region_chrom, int region_start, int region_end,
                         ArgSummarizeData &data) {
-    static int counter=0;
     static list<BedLine*> bedlist;
 
     if (line != NULL) {
@@ -784,6 +877,12 @@ void processNextBedLine(BedLine *line,
             scoreBedLine(line, statname, data);
         if (region_chrom != NULL) {
             assert(strcmp(region_chrom, line->chrom)==0);
+            // lines before the region are only read to build the trees
+            // (see openArgfile)
+            if (line->end <= region_start) {
+                delete line;
+                return;
+            }
             if (line->end > region_end) line->end = region_end;
             if (line->start < region_start) line->start = region_start;
             assert(line->start < line->end);
@@ -804,49 +903,49 @@ void processNextBedLine(BedLine *line,
             for (list<BedLine*>::iterator it=bedlist.begin();
                  it != bedlist.end(); ++it) {
                 BedLine *l = *it;
-                if (html) printf("<tr><td>");
-                printf("%s\t", l->chrom);
-                if (html) printf("</td><td>");
-                printf("%i\t", l->start);
-                if (html) printf("</td><td>");
-                printf("%i\t", l->end);
-                if (html) printf("</td><td>");
-                printf("%i", l->sample);
+                if (html) fprintf(outstream, "<tr><td>");
+                fprintf(outstream, "%s\t", l->chrom);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i\t", l->start);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i\t", l->end);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i", l->sample);
                 for (unsigned int i=0; i < statname.size(); i++) {
                     if (statname[i]=="tree") {
                         if (!html) {
-                            printf("\t%s", l->newick);
+                            fprintf(outstream, "\t%s", l->newick);
                         } else {
-                            printf("</td><td nowrap>");
-                            printf("\t<a href=\"http://mhubisz.genome-mirror.cshl.edu/cgi-bin/phyloGif?phyloGif_width=240&phyloGif_height=512&phyloGif_branchLengths=on&phyloGif_underscores=on&phyloGif_tree=");
+                            fprintf(outstream, "</td><td nowrap>");
+                            fprintf(outstream, "\t<a href=\"http://mhubisz.genome-mirror.cshl.edu/cgi-bin/phyloGif?phyloGif_width=240&phyloGif_height=512&phyloGif_branchLengths=on&phyloGif_underscores=on&phyloGif_tree=");
                            for (unsigned int i=0; i < strlen(l->newick); i++) {
                               if (l->newick[i]=='(') {
-                                printf("%%28");
+                                fprintf(outstream, "%%28");
                               } else if (l->newick[i]==':') {
-                                printf("%%3A");
+                                fprintf(outstream, "%%3A");
                               } else if (l->newick[i]==',') {
-                                printf("%%2C");
+                                fprintf(outstream, "%%2C");
                               } else if (l->newick[i]==')') {
-                                printf("%%29");
+                                fprintf(outstream, "%%29");
                               } else if (l->newick[i]==';') {
-                                printf("%%3B");
+                                fprintf(outstream, "%%3B");
                               } else if (l->newick[i]=='&') {
-                                printf("%%26");
+                                fprintf(outstream, "%%26");
                               } else if (l->newick[i]=='[') {
-                                printf("%%5B");
+                                fprintf(outstream, "%%5B");
                               } else if (l->newick[i]==']') {
-                                printf("%%5D");
-                              } else printf("%c", l->newick[i]);
+                                fprintf(outstream, "%%5D");
+                              } else fprintf(outstream, "%c", l->newick[i]);
                            }
-                           printf("%%0D%%0A\">%s</a>", l->newick);
+                           fprintf(outstream, "%%0D%%0A\">%s</a>", l->newick);
                         }
                     } else {
-                        if (html) printf("</td><td>");
-                        printf("\t%g", l->stats[i]);
+                        if (html) fprintf(outstream, "</td><td>");
+                        fprintf(outstream, "\t%g", l->stats[i]);
                     }
                 }
-                printf("\n");
-                if (html) printf("</td></tr>\n");
+                fprintf(outstream, "\n");
+                if (html) fprintf(outstream, "</td></tr>\n");
                 delete l;
             }
             bedlist.clear();
@@ -854,11 +953,10 @@ void processNextBedLine(BedLine *line,
         if (line != NULL) bedlist.push_back(line);
     } else {
         if (line != NULL) {
+            // intervals before the start of the line are final, so they
+            // are written now rather than kept
             results->append(line->chrom, line->start, line->end, line->stats);
-            counter++;
-            if (counter%100==0) {
-                checkResults(results);
-            }
+            checkResults(results);
             delete line;
         }
     }
@@ -1062,30 +1160,30 @@ void print_summaries(vector<double> &stat) {
     int have_mean=0;
     for (int j=1; j <= summarize; j++) {
         if (getMean==j) {
-            if (html) printf("</td><td>");
+            if (html) fprintf(outstream, "</td><td>");
             if (stat.size() > 0) {
                 meanval = compute_mean(stat);
                 have_mean=1;
-                printf("\t%g", meanval);
-            } else printf("\tNA");
+                fprintf(outstream, "\t%g", meanval);
+            } else fprintf(outstream, "\tNA");
         } else if (getStdev==j) {
-            if (html) printf("</td><td>");
+            if (html) fprintf(outstream, "</td><td>");
             if (stat.size() > 1) {
                 if (!have_mean)
                     meanval = compute_mean(stat);
-                printf("\t%g", compute_stdev(stat, meanval));
-            } else printf("\tNA");
+                fprintf(outstream, "\t%g", compute_stdev(stat, meanval));
+            } else fprintf(outstream, "\tNA");
         } else if (getQuantiles==j) {
-            if (html) printf("</td><td>");
+            if (html) fprintf(outstream, "</td><td>");
             if (stat.size() > 0) {
                 vector<double> q = compute_quantiles(stat, quantiles);
                 for (unsigned int k=0; k < quantiles.size(); k++) {
-                    printf("\t%g", q[k]);
+                    fprintf(outstream, "\t%g", q[k]);
                 }
             } else {
                 for (unsigned int k=0; k < quantiles.size(); k++) {
-                    if (html) printf("</td><td>");
-                    printf("\tNA");
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "\tNA");
                 }
             }
         }
@@ -1093,28 +1191,191 @@ void print_summaries(vector<double> &stat) {
 }
 
 
+// Skips the header of an argfile.  Returns the keyframe spacing if the
+// file has SPR records (see BED_SPR_HEADER), 0 otherwise.
+int skipArgfileHeader(FILE *stream) {
+    int keyframe = 0;
+    int c;
+    while ((c = fgetc(stream)) == '#') {
+        ungetc(c, stream);
+        char *line = fgetline(stream);
+        if (line == NULL) return keyframe;
+        if (str_starts_with(line, BED_SPR_HEADER))
+            keyframe = atoi(line + strlen(BED_SPR_HEADER));
+        delete [] line;
+    }
+    if (c != EOF) ungetc(c, stream);
+    return keyframe;
+}
+
+
+// Names a file together with its modification time, so that cached
+// contents of the file are not used after it changes
+string fileKey(const string &filename) {
+    struct stat st;
+    char mtime[30] = "";
+    if (stat(filename.c_str(), &st) == 0)
+        snprintf(mtime, sizeof(mtime), "@%lld", (long long) st.st_mtime);
+    return filename + mtime;
+}
+
+
+// State kept between the queries of a server (see --serve)
+class ServerCache {
+public:
+    ServerCache(size_t cache_size) : regions(cache_size) {}
+
+    ArgModel *getModel(const string &logfile) {
+        ArgModel *&model = models[fileKey(logfile)];
+        if (model == NULL)
+            model = new ArgModel(logfile.c_str());
+        return model;
+    }
+
+    // returns NULL if the archive cannot be read
+    ArgArchive *getArchive(const string &argfile) {
+        const string key = fileKey(argfile);
+        map<string, ArgArchive*>::iterator it = archives.find(key);
+        if (it != archives.end())
+            return it->second;
+        ArgArchive *archive = new ArgArchive();
+        if (!archive->open(argfile.c_str())) {
+            delete archive;
+            return NULL;
+        }
+        archives[key] = archive;
+        return archive;
+    }
+
+    TextCache regions;   // decoded regions of argfiles
+    map<string, ArgModel*> models;
+    map<string, ArgArchive*> archives;
+};
+
+ServerCache *serverCache = NULL;
+
+
+// The argfile opened at a region: a tabix query, or a query of the samples
+// used from an ARG archive.  A server reads regions from its cache.
+class ArgfileStream {
+public:
+    ArgfileStream(Config *config, const char *region) :
+        archive(config->archive != NULL) {
+        if (serverCache != NULL)
+            openCached(config, region);
+        else
+            stream = openQuery(config, region);
+        if (stream == NULL) {
+            printError("Error opening %s, region=%s\n",
+                       config->argfile.c_str(),
+                       region == NULL ? "NULL" : region);
+        }
+    }
+    ~ArgfileStream() {
+        close();
+    }
+    void close() {
+        if (stream) {
+            if (archive || text) fclose(stream);
+            else close_tabix(stream);
+            stream = NULL;
+        }
+        text.reset();
+    }
+    bool archive;
+    FILE *stream;
+    shared_ptr<string> text;   // cached region read by stream
+
+protected:
+    FILE *openQuery(Config *config, const char *region) {
+        if (archive)
+            return config->archive->query(region, config->archive_samples);
+        return read_tabix(config->argfile.c_str(), region,
+                          config->tabix_dir.empty() ? NULL :
+                          config->tabix_dir.c_str());
+    }
+
+    // decodes the region on first use
+    void openCached(Config *config, const char *region) {
+        string key = fileKey(config->argfile) + "\t" +
+            (region == NULL ? "" : region);
+        if (archive) {
+            char samples[100];
+            snprintf(samples, sizeof(samples), "\t%i\t%i",
+                     config->sample_num, config->burnin);
+            key += samples;
+        }
+        text = serverCache->regions.get(key);
+        if (!text) {
+            FILE *query = openQuery(config, region);
+            if (query == NULL) {
+                stream = NULL;
+                return;
+            }
+            text.reset(new string());
+            char buf[1 << 16];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), query)) > 0)
+                text->append(buf, n);
+            if (archive) fclose(query);
+            else close_tabix(query);
+            serverCache->regions.put(key, text);
+        }
+        if (text->empty())
+            stream = fopen("/dev/null", "r");
+        else
+            stream = fmemopen(&(*text)[0], text->size(), "r");
+    }
+};
+
+
+// Opens the argfile at a region and skips its header.  Files with SPR
+// records only give newick trees at keyframes, so for these the region is
+// extended back to the keyframe before it.  The lines read before the
+// region only serve to build the trees of each sample.
+ArgfileStream *openArgfile(Config *config, const char *region) {
+    PROFILE_SCOPE(PROFILE_IO);
+    ArgfileStream *infile = new ArgfileStream(config, region);
+    if (infile->stream == NULL) return infile;
+    int keyframe = skipArgfileHeader(infile->stream);
+    if (keyframe <= 0 || region == NULL) return infile;
+
+    vector<string> token;
+    split(region, "[:-]", token);
+    if (token.size() != 3) return infile;
+    token[1].erase(std::remove(token[1].begin(), token[1].end(), ','),
+                   token[1].end());
+    int start = atoi(token[1].c_str())-1;
+    if (start % keyframe == 0) return infile;
+
+    char *region2 = new char[token[0].size() + token[2].size() + 30];
+    sprintf(region2, "%s:%i-%s", token[0].c_str(),
+            start / keyframe * keyframe + 1, token[2].c_str());
+    delete infile;
+    infile = new ArgfileStream(config, region2);
+    delete [] region2;
+    if (infile->stream != NULL)
+        skipArgfileHeader(infile->stream);
+    return infile;
+}
+
+
 int summarizeRegionBySnp(Config *config, const char *region,
                          set<string> inds, vector<string> statname,
                          ArgSummarizeData &data) {
     TabixStream snp_infile(config->snpfile, region, config->tabix_dir);
-    TabixStream infile(config->argfile, region, config->tabix_dir);
+    unique_ptr<ArgfileStream> argfile(openArgfile(config, region));
+    ArgfileStream &infile = *argfile;
     vector<string> token;
     map<int,BedLine*> last_entry;
     map<int,BedLine*>::iterator it;
-    char chrom[1000], c;
+    char chrom[1000];
     int start, end, sample;
     BedLine *l=NULL;
     const ArgModel *model = data.model;
 
     if (snp_infile.stream == NULL) return 1;
     if (infile.stream == NULL) return 1;
-    while (EOF != (c=fgetc(infile.stream))) {
-        ungetc(c, infile.stream);
-        if (c != '#') break;
-        while ('\n' != (c=fgetc(infile.stream))) {
-            if (c==EOF) return 0;
-        }
-    }
     SnpStream snpStream = SnpStream(&snp_infile);
     char *newick;
     while (1) {
@@ -1148,6 +1409,12 @@ int summarizeRegionBySnp(Config *config, const char *region,
             if (it == last_entry.end() ||
                 it->second->trees->orig_spr.recomb_node == NULL) {
                 SprPruned *trees;
+                if (is_bed_spr_record(newick)) {
+                    printError("SPR record at %s:%i of sample %i does not"
+                               " follow a tree", chrom, start, sample);
+                    delete [] newick;
+                    return 1;
+                }
                 if (it != last_entry.end()) {
                     l = it->second;
                     delete l->trees;
@@ -1190,36 +1457,36 @@ int summarizeRegionBySnp(Config *config, const char *region,
                 for (list<BedLine*>::iterator it=bedlist.begin();
                      it != bedlist.end(); ++it) {
                     BedLine *l = *it;
-                    if (html) printf("<tr><td>");
-                    printf("%s\t", l->chrom);
-                    if (html) printf("</td><td>");
-                    printf("%i\t", snpStream.coord-1);
-                    if (html) printf("</td><td>");
-                    printf("%i\t", snpStream.coord);
-                    if (html) printf("</td><td>");
-                    printf("%i\t", l->sample);
-                    if (html) printf("</td><td>");
-                    printf("%c\t", l->derAllele);
-                    if (html) printf("</td><td>");
-                    printf("%c\t", l->otherAllele);
-                    if (html) printf("</td><td>");
-                    printf("%i\t", l->derFreq);
-                    if (html) printf("</td><td>");
-                    printf("%i", l->otherFreq);
+                    if (html) fprintf(outstream, "<tr><td>");
+                    fprintf(outstream, "%s\t", l->chrom);
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "%i\t", snpStream.coord-1);
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "%i\t", snpStream.coord);
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "%i\t", l->sample);
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "%c\t", l->derAllele);
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "%c\t", l->otherAllele);
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "%i\t", l->derFreq);
+                    if (html) fprintf(outstream, "</td><td>");
+                    fprintf(outstream, "%i", l->otherFreq);
                     for (unsigned int i=0; i < statname.size(); i++) {
                         if (statname[i]=="tree") {
-                            if (html) printf("</td><td>");
-                            printf("\t%s", l->newick);
+                            if (html) fprintf(outstream, "</td><td>");
+                            fprintf(outstream, "\t%s", l->newick);
                         } else if (statname[i]=="infSites") {
-                            if (html) printf("</td><td>");
-                            printf("\t%i", (int)(l->stats[i]==1));
+                            if (html) fprintf(outstream, "</td><td>");
+                            fprintf(outstream, "\t%i", (int)(l->stats[i]==1));
                         } else {
-                            if (html) printf("</td><td>");
-                            printf("\t%g", l->stats[i]);
+                            if (html) fprintf(outstream, "</td><td>");
+                            fprintf(outstream, "\t%g", l->stats[i]);
                         }
                     }
-                    if (html) printf("</td></tr>");
-                    printf("\n");
+                    if (html) fprintf(outstream, "</td></tr>");
+                    fprintf(outstream, "\n");
                     l->stats.clear();
                 }
             } else {
@@ -1246,25 +1513,25 @@ int summarizeRegionBySnp(Config *config, const char *region,
                     derFreq = first->otherFreq;
                     otherFreq = first->derFreq;
                 }
-                if (html) printf("<tr><td>");
-                printf("%s\t", l->chrom);
-                if (html) printf("</td><td>");
-                printf("%i\t", snpStream.coord-1);
-                if (html) printf("</td><td>");
-                printf("%i\t", snpStream.coord);
-                if (html) printf("</td><td>");
-                printf("%c\t", derAllele);
-                if (html) printf("</td><td>");
-                printf("%c\t", otherAllele);
-                if (html) printf("</td><td>");
-                printf("%i\t", derFreq);
-                if (html) printf("</td><td>");
-                printf("%i\t", otherFreq);
-                if (html) printf("</td><td>");
-                printf("%i\t", (int)bedlist.size());
-                if (html) printf("</td><td>");
-                printf("%i", infsites);
-                if (html) printf("</td><td>");
+                if (html) fprintf(outstream, "<tr><td>");
+                fprintf(outstream, "%s\t", l->chrom);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i\t", snpStream.coord-1);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i\t", snpStream.coord);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%c\t", derAllele);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%c\t", otherAllele);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i\t", derFreq);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i\t", otherFreq);
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i\t", (int)bedlist.size());
+                if (html) fprintf(outstream, "</td><td>");
+                fprintf(outstream, "%i", infsites);
+                if (html) fprintf(outstream, "</td><td>");
                 for (unsigned int i=0; i < statname.size(); i++) {
                     if (statname[i] != "inf_sites") {
                         // first compute stats across all
@@ -1288,8 +1555,8 @@ int summarizeRegionBySnp(Config *config, const char *region,
                         print_summaries(stat);
                     }
                 }
-                printf("\n");
-                if (html) printf("</td></tr>\n");
+                fprintf(outstream, "\n");
+                if (html) fprintf(outstream, "</td></tr>\n");
             }
         }
     }
@@ -1305,21 +1572,90 @@ int summarizeRegionBySnp(Config *config, const char *region,
 }
 
 
+// A line of the argfile read by summarizeRegionNoSnp
+class SummarizeLine {
+public:
+    SummarizeLine(const char *chrom, int start, int end, int sample,
+                  char *newick) :
+        chrom(chrom), start(start), end(end), sample(sample),
+        newick(newick) {}
+    string chrom;
+    int start;
+    int end;
+    int sample;
+    char *newick;
+};
+
+
+// The current tree of an MCMC sample, and the BedLine it is extending
+// (NULL if the last tree ended in a recombination)
+class SummarizeSample {
+public:
+    SummarizeSample() : trees(NULL), line(NULL) {}
+    SprPruned *trees;
+    BedLine *line;
+};
+
+
+// Applies the next line of an MCMC sample to its tree.  Scores the sample's
+// BedLine once its tree ends in a recombination.  Sets 'newline' to the new
+// BedLine if the line starts one, NULL if it extends the previous one.
+// Returns false if the line is an SPR record without a tree to apply to.
+bool updateSampleTrees(SummarizeSample *state, const SummarizeLine &line,
+                       const set<string> &inds, vector<string> &statname,
+                       ArgSummarizeData &data, BedLine **newline) {
+    const ArgModel *model = data.model;
+    *newline = NULL;
+    if (is_bed_spr_record(line.newick) &&
+        (state->trees == NULL ||
+         state->trees->orig_spr.recomb_node == NULL)) {
+        printError("SPR record at %s:%i of sample %i does not follow a tree",
+                   line.chrom.c_str(), line.start, line.sample);
+        return false;
+    }
+    if (state->trees == NULL)   //first tree from this sample
+        state->trees = new SprPruned(line.newick, inds, model);
+    else state->trees->update(line.newick, model);
+
+    if (state->line == NULL) {
+        // the line waits in the queue until it can be output, so it keeps
+        // the text of its tree only if the tree is output
+        const bool keep_newick = (find(statname.begin(), statname.end(),
+                                       "tree") != statname.end());
+        *newline = state->line = new BedLine(line.chrom.c_str(), line.start,
+                                             line.end, line.sample,
+                                             keep_newick ? line.newick : NULL,
+                                             state->trees);
+    } else {
+        assert(strcmp(state->line->chrom, line.chrom.c_str())==0);
+        assert(state->line->end == line.start);
+        state->line->end = line.end;
+    }
+
+    //assume orig_spr.recomb_node == NULL is a rare occurrence that happens
+    // at the boundaries of regions analyzed by arg-sample; treat these as
+    // recombination events
+    if (state->trees->orig_spr.recomb_node == NULL ||
+        state->trees->pruned_tree == NULL ||
+        state->trees->pruned_spr.recomb_node != NULL) {
+        scoreBedLine(state->line, statname, data);
+        state->line = NULL;
+    }
+    return true;
+}
+
+
 int summarizeRegionNoSnp(Config *config, const char *region,
                          set<string> inds, vector<string>statname,
                          ArgSummarizeData &data) {
-    TabixStream *infile;
-    char c;
+    ArgfileStream *infile;
     char *region_chrom = NULL;
     char chrom[1000];
     vector<string> token;
     int region_start=-1, region_end=-1, start, end, sample;
-    IntervalIterator<vector<double> > results;
+    IntervalIterator<vector<double> > results(sketchSize);
     queue<BedLine*> bedlineQueue;
-    map<int,BedLine*> bedlineMap;
-    map<int,SprPruned*> trees;
-    map<int,SprPruned*>::iterator it;
-    const ArgModel *model = data.model;
+    map<int,SummarizeSample> samples;
     /*
       Class BedLine contains chr,start,end, newick tree, parsed tree.
       parsed tree may be NULL if not parsing trees but otherwise will
@@ -1365,9 +1701,6 @@ int summarizeRegionNoSnp(Config *config, const char *region,
 
     */
 
-    infile = new TabixStream(config->argfile, region, config->tabix_dir);
-    if (infile->stream == NULL) return 1;
-
     //parse region to get region_chrom, region_start, region_end.
     // these are only needed to truncate results which fall outside
     // of the boundaries (tabix returns anything that overlaps)
@@ -1390,56 +1723,89 @@ int summarizeRegionNoSnp(Config *config, const char *region,
         region_start = atoi(token[1].c_str())-1;
         region_end = atoi(token[2].c_str());
     }
-    while (EOF != (c=fgetc(infile->stream))) {
-        ungetc(c, infile->stream);
-        if (c!='#') break;
-        while ('\n' != (c=fgetc(infile->stream))) {
-            if (c==EOF) return 0;
-        }
-    }
-
-    while (EOF != fscanf(infile->stream, "%s %i %i %i",
-                         chrom, &start, &end, &sample)) {
-        assert('\t'==fgetc(infile->stream));
-        char* newick = fgetline(infile->stream);
-        if (config->sample_num != 0 && sample != config->sample_num) {
-            delete [] newick;
-            continue;
-        }
-        chomp(newick);
-        if (sample < config->burnin) {
-            delete [] newick;
-            continue;
-        }
-        it = trees.find(sample);
-        if (it == trees.end())   //first tree from this sample
-            trees[sample] = new SprPruned(newick, inds, model);
-        else trees[sample]->update(newick, model);
-
-        map<int,BedLine*>::iterator it3 = bedlineMap.find(sample);
-        BedLine *currline;
-        if (it3 == bedlineMap.end()) {
-            currline = new BedLine(chrom, start, end, sample, newick,
-                                   trees[sample]);
-            bedlineMap[sample] = currline;
-            bedlineQueue.push(currline);
-        } else {
-            currline = it3->second;
-            assert(strcmp(currline->chrom, chrom)==0);
-            assert(currline->end == start);
-            currline->end = end;
+    infile = openArgfile(config, region);
+    if (infile->stream == NULL) return 1;
+
+    // Lines are read in batches.  The trees of each MCMC sample are updated
+    // and scored in file order, but samples are independent, so with
+    // --threads each sample of a batch is handled by a different task.
+    // New BedLines enter the queue in file order, keeping the output the
+    // same as with one thread.
+    ThreadPool *pool = get_thread_pool(config->nthreads);
+    const unsigned int batch_size = pool ? 1000 * config->nthreads : 1;
+    vector<SummarizeLine> batch;
+    bool eof = false;
+    while (!eof) {
+        batch.clear();
+        while (batch.size() < batch_size) {
+            const int nread = fscanf(infile->stream, "%s %i %i %i",
+                                     chrom, &start, &end, &sample);
+            if (nread == EOF) {
+                eof = true;
+                break;
+            }
+            if (nread != 4 || fgetc(infile->stream) != '\t') {
+                fprintf(stderr, "Error: bad line in %s\n",
+                        config->argfile.c_str());
+                for (unsigned int i=0; i < batch.size(); i++)
+                    delete [] batch[i].newick;
+                infile->close();
+                delete infile;
+                return 1;
+            }
+            char* newick = fgetline(infile->stream);
+            if ((config->sample_num != 0 && sample != config->sample_num) ||
+                sample < config->burnin) {
+                delete [] newick;
+                continue;
+            }
+            chomp(newick);
+            batch.push_back(SummarizeLine(chrom, start, end, sample, newick));
+        }
+
+        // group lines by sample
+        vector<vector<int> > groups;
+        vector<SummarizeSample*> group_state;
+        map<int,int> group_index;
+        for (unsigned int i=0; i < batch.size(); i++) {
+            map<int,int>::iterator it2 = group_index.find(batch[i].sample);
+            if (it2 == group_index.end()) {
+                group_index[batch[i].sample] = groups.size();
+                groups.push_back(vector<int>());
+                group_state.push_back(&samples[batch[i].sample]);
+                groups.back().push_back(i);
+            } else {
+                groups[it2->second].push_back(i);
+            }
         }
 
-        //assume orig_spr.recomb_node == NULL is a rare occurrence that happens
-        // at the boundaries of regions analyzed by arg-sample; treat these as
-        // recombination events
-        if (trees[sample]->orig_spr.recomb_node == NULL ||
-            trees[sample]->pruned_tree == NULL ||
-            trees[sample]->pruned_spr.recomb_node != NULL) {
-            scoreBedLine(currline, statname, data);
-            bedlineMap.erase(sample);
+        vector<BedLine*> newlines(batch.size(), NULL);
+        vector<int> group_ok(groups.size(), 1);
+        auto process_group = [&](int g) {
+            for (unsigned int j=0; j < groups[g].size(); j++) {
+                const int i = groups[g][j];
+                if (!updateSampleTrees(group_state[g], batch[i], inds,
+                                       statname, data, &newlines[i])) {
+                    group_ok[g] = 0;
+                    break;
+                }
+            }
+        };
+        if (pool && groups.size() > 1)
+            pool->run(groups.size(), process_group);
+        else {
+            for (unsigned int g=0; g < groups.size(); g++)
+                process_group(g);
         }
 
+        for (unsigned int i=0; i < batch.size(); i++) {
+            if (newlines[i] != NULL)
+                bedlineQueue.push(newlines[i]);
+            delete [] batch[i].newick;
+        }
+        if (find(group_ok.begin(), group_ok.end(), 0) != group_ok.end())
+            return 1;
+
         while (bedlineQueue.size() > 0) {
             BedLine *firstline = bedlineQueue.front();
             if (firstline->stats.size() == statname.size()) {
@@ -1449,7 +1815,6 @@ int summarizeRegionNoSnp(Config *config, const char *region,
                 bedlineQueue.pop();
             } else break;
         }
-        delete [] newick;
     }
     infile->close();
     delete infile;
@@ -1471,11 +1836,9 @@ int summarizeRegionNoSnp(Config *config, const char *region,
                            region_start, region_end, data);
     }
 
-    it = trees.begin();
-    while (it != trees.end()) {
-        delete it->second;
-        advance(it, 1);
-    }
+    for (map<int,SummarizeSample>::iterator it=samples.begin();
+         it != samples.end(); ++it)
+        delete it->second.trees;
     if (region_chrom != NULL) delete[] region_chrom;
     return 0;
 }
@@ -1490,7 +1853,28 @@ int summarizeRegion(Config *config, const char *region,
 }
 
 
-int main(int argc, char *argv[]) {
+// Resets the options kept in globals, before the queries of a server
+void resetOptions() {
+    outstream = stdout;
+    html = false;
+    summarize = 0;
+    getNumSample = 0;
+    getMean = 0;
+    getStdev = 0;
+    getQuantiles = 0;
+    sketchSize = 0;
+    quantiles.clear();
+    node_dist_leaf1.clear();
+    node_dist_leaf2.clear();
+    min_coal_time_ind1.clear();
+    min_coal_time_ind2.clear();
+    ind_dist_leaf1.clear();
+    ind_dist_leaf2.clear();
+    cluster_group.clear();
+}
+
+
+int summarizeMain(int argc, char *argv[]) {
     Config c;
     int ret = c.parse_args(argc, argv);
     ArgSummarizeData data;
@@ -1502,15 +1886,49 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: must specify argfile\n");
         return 1;
     }
+    if (c.serve_port != 0 && serverCache != NULL) {
+        fprintf(stderr, "Error: --serve cannot be used in a query\n");
+        return 1;
+    }
+    if (is_arg_archive(c.argfile.c_str())) {
+        if (serverCache != NULL) {
+            c.archive = serverCache->getArchive(c.argfile);
+            if (c.archive == NULL)
+                return 1;
+        } else {
+            c.archive = new ArgArchive();
+            if (!c.archive->open(c.argfile.c_str()))
+                return 1;
+        }
+        const vector<int> &samples = c.archive->get_samples();
+        for (unsigned int i=0; i < samples.size(); i++) {
+            if (samples[i] >= c.burnin &&
+                (c.sample_num == 0 || samples[i] == c.sample_num))
+                c.archive_samples.push_back(samples[i]);
+        }
+    }
     if (!c.logfile.empty()) {
-        data.model = new ArgModel(c.logfile.c_str());
+        data.model = serverCache ? serverCache->getModel(c.logfile) :
+            new ArgModel(c.logfile.c_str());
     } else data.model = NULL;
+
+    // results are written to the output as they are made
+    unique_ptr<CompressStream> output;
+    if (!c.outfile.empty()) {
+        set_compress_threads(c.nthreads);
+        output.reset(new CompressStream(c.outfile.c_str(), "w"));
+        if (output->stream == NULL) {
+            fprintf(stderr, "Error opening %s\n", c.outfile.c_str());
+            return 1;
+        }
+        outstream = output->stream;
+    }
     if (c.html) {
         html=true;
-        printf("<html>\n");
+        fprintf(outstream, "<html>\n");
         //printf("<link rel=\"stylesheet\" type=\"text/css\" href=\"ARGweaver.css\" />\n");
         if (c.rawtrees) {
-            printf("<frameset cols=\"66%%,*\">\n");
+            fprintf(outstream, "<frameset cols=\"66%%,*\">\n");
         }
     }
     set<string> haps;
@@ -1826,19 +2244,25 @@ int main(int argc, char *argv[]) {
     if (!c.migfile.empty()) {
         if (data.model == NULL) {
             fprintf(stderr, "--log-file required with --mig-file\n");
-            exit(1);
+            return 1;
         }
         FILE *infile = fopen(c.migfile.c_str(), "r");
         if (infile == NULL) {
             fprintf(stderr, "Error opening %s\n", c.migfile.c_str());
-            exit(1);
+            return 1;
         }
         char migname[1000];
         int p[2];
         double dt;
         while (EOF != fscanf(infile, "%s %i %i %lf", migname, &p[0], &p[1],
                              &dt)) {
-            data.migstat.push_back(MigStat(string(migname), p, dt, data.model));
+            MigStat migstat(string(migname), p, dt, data.model);
+            if (!migstat.found()) {
+                fprintf(stderr, "Error finding time intervals spanning mig time %f\n", dt);
+                fclose(infile);
+                return 1;
+            }
+            data.migstat.push_back(migstat);
             statname.push_back(string(migname));
         }
         fclose(infile);
@@ -1846,19 +2270,25 @@ int main(int argc, char *argv[]) {
     if (!c.hapmigfile.empty()) {
         if (data.model == NULL) {
             fprintf(stderr, "--log-file required with --hap-mig-file\n");
-            exit(1);
+            return 1;
         }
         FILE *infile = fopen(c.hapmigfile.c_str(), "r");
         if (infile == NULL) {
             fprintf(stderr, "Error opening %s\n", c.migfile.c_str());
-            exit(1);
+            return 1;
         }
         char migname[1000], hap[1000];
         int p[2];
         double dt;
         while (EOF != fscanf(infile, "%s %i %i %lf %s", migname, &p[0], &p[1],
                              &dt, hap)) {
-            data.migstat.push_back(MigStat(string(migname), p, dt, data.model, string(hap)));
+            MigStat migstat(string(migname), p, dt, data.model, string(hap));
+            if (!migstat.found()) {
+                fprintf(stderr, "Error finding time intervals spanning mig time %f\n", dt);
+                fclose(infile);
+                return 1;
+            }
+            data.migstat.push_back(migstat);
             statname.push_back(string(migname));
         }
         fclose(infile);
@@ -1866,6 +2296,8 @@ int main(int argc, char *argv[]) {
     }
     if (c.rawtrees)
         statname.push_back(string("tree"));
+    if (!checkStatNames(statname, data))
+        return 1;
 
     if (c.numsample)
         getNumSample=++summarize;
@@ -1884,6 +2316,9 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (c.sketch)
+        sketchSize = 100;
+
     if ((!c.region.empty()) && (!c.bedfile.empty())) {
         fprintf(stderr, "Error: --bed and --region cannot be used together.\n");
         return 1;
@@ -1916,40 +2351,40 @@ int main(int argc, char *argv[]) {
     }
 
     if (!c.noheader) {
-        printf("## %s\n", VERSION_INFO);
-        if (html) printf("<br>\n");
-        printf("##");
-        for (int i=0; i < argc; i++) printf(" %s", argv[i]);
-        printf("\n");
-        if (html) printf("<br><table><tr><td>\n");
-        printf("##chrom\t");
-        if (html) printf("</td><td>\n");
-        printf("chromStart\t");
-        if (html) printf("</td><td>\n");
-        printf("chromEnd");
+        fprintf(outstream, "## %s\n", VERSION_INFO);
+        if (html) fprintf(outstream, "<br>\n");
+        fprintf(outstream, "##");
+        for (int i=0; i < argc; i++) fprintf(outstream, " %s", argv[i]);
+        fprintf(outstream, "\n");
+        if (html) fprintf(outstream, "<br><table><tr><td>\n");
+        fprintf(outstream, "##chrom\t");
+        if (html) fprintf(outstream, "</td><td>\n");
+        fprintf(outstream, "chromStart\t");
+        if (html) fprintf(outstream, "</td><td>\n");
+        fprintf(outstream, "chromEnd");
         if (summarize==0) {
-            if (html) printf("</td><td>\n");
-            printf("\tMCMC_sample");
+            if (html) fprintf(outstream, "</td><td>\n");
+            fprintf(outstream, "\tMCMC_sample");
         }
         if (!c.snpfile.empty()) {
-            if (html) printf("</td><td>\n");
-            printf("\tderAllele");
-            if (html) printf("</td><td>\n");
-            printf("\tancAllele");
-            if (html) printf("</td><td>\n");
-            printf("\tderFreq");
-            if (html) printf("</td><td>\n");
-            printf("\tancFreq");
+            if (html) fprintf(outstream, "</td><td>\n");
+            fprintf(outstream, "\tderAllele");
+            if (html) fprintf(outstream, "</td><td>\n");
+            fprintf(outstream, "\tancAllele");
+            if (html) fprintf(outstream, "</td><td>\n");
+            fprintf(outstream, "\tderFreq");
+            if (html) fprintf(outstream, "</td><td>\n");
+            fprintf(outstream, "\tancFreq");
         }
         if (c.snpfile.empty() && getNumSample > 0) {
-            if (html) printf("</td><td>\n");
-            printf("\tnumsample");
+            if (html) fprintf(outstream, "</td><td>\n");
+            fprintf(outstream, "\tnumsample");
         }
         if (summarize && !c.snpfile.empty()) {
-            if (html) printf("</td><td>\n");
-            printf("\tnumsample-all");
-            if (html) printf("</td><td>\n");
-            printf("\tnumsample-infsites");
+            if (html) fprintf(outstream, "</td><td>\n");
+            fprintf(outstream, "\tnumsample-all");
+            if (html) fprintf(outstream, "</td><td>\n");
+            fprintf(outstream, "\tnumsample-infsites");
         }
         vector<string> stattype;
         if (c.snpfile.empty()) {
@@ -1962,36 +2397,36 @@ int main(int argc, char *argv[]) {
 
         for (unsigned int j=0; j < statname.size(); j++) {
             if (summarize==0) {
-                if (html) printf("</td><td>\n");
-                printf("\t%s", statname[j].c_str());
+                if (html) fprintf(outstream, "</td><td>\n");
+                fprintf(outstream, "\t%s", statname[j].c_str());
             }
             if (statname[j] != "inf_sites") {
                 for (unsigned int k=0; k < stattype.size(); k++) {
                     for (int i=1; i <= summarize; i++) {
                         if (getMean==i) {
-                            if (html) printf("</td><td>\n");
-                            printf("\t%s%s_mean",
-                                   statname[j].c_str(), stattype[k].c_str());
+                            if (html) fprintf(outstream, "</td><td>\n");
+                            fprintf(outstream, "\t%s%s_mean",
+                                    statname[j].c_str(), stattype[k].c_str());
                         } else if (getStdev==i) {
-                            if (html) printf("</td><td>\n");
-                            printf("\t%s%s_stdev",
-                                   statname[j].c_str(), stattype[k].c_str());
+                            if (html) fprintf(outstream, "</td><td>\n");
+                            fprintf(outstream, "\t%s%s_stdev",
+                                    statname[j].c_str(), stattype[k].c_str());
                         } else if (getQuantiles==i) {
                             for (unsigned int l=0; l < quantiles.size(); l++) {
-                                if (html) printf("</td><td>\n");
-                                printf("\t%s%s_quantile_%.3f",
-                                       statname[j].c_str(),
-                                       stattype[k].c_str(),
-                                       quantiles[l]);
+                                if (html) fprintf(outstream, "</td><td>\n");
+                                fprintf(outstream, "\t%s%s_quantile_%.3f",
+                                        statname[j].c_str(),
+                                        stattype[k].c_str(),
+                                        quantiles[l]);
                             }
                         }
                     }
                 }
             }
         }
-        printf("\n");
-        if (html) printf("</td></tr>\n");
-    } else if (html) printf("<table valing=\"top\">\n");
+        fprintf(outstream, "\n");
+        if (html) fprintf(outstream, "</td></tr>\n");
+    } else if (html) fprintf(outstream, "<table valing=\"top\">\n");
 
 
 
@@ -2053,7 +2488,77 @@ int main(int argc, char *argv[]) {
         }
         bedstream.close();
     }
-    if (html) printf("</table>\n</html>\n");
-
+    if (html) fprintf(outstream, "</table>\n</html>\n");
+    if (serverCache == NULL)
+        delete c.archive;
+
+    if (output) {
+        outstream = stdout;
+        output->close();
+        if (output->compress && !html &&
+            !write_tabix_index(c.outfile.c_str())) {
+            fprintf(stderr, "Error indexing %s\n", c.outfile.c_str());
+            return 1;
+        }
+    }
     return 0;
 }
+
+
+// Answers queries on a port (see --serve).  The arguments of each query
+// are added to the arguments of the server, and the output of the query
+// is written to the connection.
+int serveQueries(const Config &c, int argc, char *argv[]) {
+    vector<string> server_args;
+    for (int i=1; i < argc; i++) {
+        const string arg = argv[i];
+        if ((arg == "--serve" || arg == "--cache-size") && i+1 < argc)
+            i++;
+        else
+            server_args.push_back(arg);
+    }
+
+    serverCache = new ServerCache(size_t(c.cache_size) << 20);
+    fprintf(stderr, "serving queries on port %i\n", c.serve_port);
+    bool ok = serve_queries(c.serve_port, [&](const vector<string> &args,
+                                              int fd) {
+        vector<string> query_args(1, argv[0]);
+        query_args.insert(query_args.end(), server_args.begin(),
+                          server_args.end());
+        query_args.insert(query_args.end(), args.begin(), args.end());
+        vector<char*> query_argv;
+        for (unsigned int i=0; i < query_args.size(); i++)
+            query_argv.push_back((char*) query_args[i].c_str());
+        query_argv.push_back(NULL);
+
+        // the output of arg-summarize goes to the connection
+        fflush(stdout);
+        fflush(stderr);
+        const int saved_stdout = dup(STDOUT_FILENO);
+        const int saved_stderr = dup(STDERR_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        resetOptions();
+        summarizeMain(query_argv.size() - 1, &query_argv[0]);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_stdout, STDOUT_FILENO);
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stdout);
+        close(saved_stderr);
+    });
+    return ok ? 0 : 1;
+}
+
+
+int main(int argc, char *argv[]) {
+    Config c;
+    int ret = c.parse_args(argc, argv);
+    if (ret)
+        return ret;
+    if (c.serve_port != 0)
+        return serveQueries(c, argc, argv);
+    ret = summarizeMain(argc, argv);
+    write_profile(stderr);
+    return ret;
+}
@@ -200,6 +200,13 @@ public:
     ConfigParser()
     {}
 
+    // A copy keeps what was parsed but not the rules, which point to the
+    // options of the original
+    ConfigParser(const ConfigParser &other) :
+        prog(other.prog),
+        rest(other.rest)
+    {}
+
     ~ConfigParser()
     {
         clear();
@@ -304,6 +311,10 @@ public:
     string prog;
     vector<ConfigParamBase*> rules;
     vector<string> rest;
+
+protected:
+    // not assignable, since rules are owned
+    ConfigParser &operator=(const ConfigParser &other);
 };
 
 
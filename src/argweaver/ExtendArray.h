@@ -13,6 +13,7 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <vector>
 
 
 namespace spidir {
@@ -41,6 +42,86 @@ T *resize(T *array, size_t oldsize, size_t newsize)
 }
 
 
+/*=============================================================================
+    per-thread cache of freed arrays whose sizes are powers of two
+
+    Short-lived ExtendArrays (e.g. tree traversals) reuse these arrays
+    instead of calling new/delete.  Cached arrays were allocated with new[]
+    so they may still be detached and deleted by their new owner.
+*/
+template <class ValueType>
+class ArrayPool
+{
+public:
+    // largest pooled array and number of cached arrays per size
+    enum { MAX_BIN = 20, MAX_CACHED = 8 };
+
+    // returns the smallest pooled size that holds 'size' values
+    static int round_size(int size)
+    {
+        int rounded = 1;
+        while (rounded < size)
+            rounded *= 2;
+        return rounded;
+    }
+
+    static ValueType *alloc(int size)
+    {
+        int bin = get_bin(size);
+        if (bin != -1) {
+            std::vector<ValueType*> &arrays = get_bins().arrays[bin];
+            if (!arrays.empty()) {
+                ValueType *array = arrays.back();
+                arrays.pop_back();
+                return array;
+            }
+        }
+        return new ValueType [size];
+    }
+
+    static void free(ValueType *array, int size)
+    {
+        int bin = get_bin(size);
+        if (bin != -1) {
+            std::vector<ValueType*> &arrays = get_bins().arrays[bin];
+            if (arrays.size() < MAX_CACHED) {
+                arrays.push_back(array);
+                return;
+            }
+        }
+        delete [] array;
+    }
+
+protected:
+    struct Bins
+    {
+        ~Bins()
+        {
+            for (int i=0; i<=MAX_BIN; i++)
+                for (unsigned int j=0; j<arrays[i].size(); j++)
+                    delete [] arrays[i][j];
+        }
+
+        std::vector<ValueType*> arrays[MAX_BIN+1];
+    };
+
+    // returns log2(size) for pooled sizes and -1 otherwise
+    static int get_bin(int size)
+    {
+        for (int bin=0; bin<=MAX_BIN; bin++)
+            if (size == (1 << bin))
+                return bin;
+        return -1;
+    }
+
+    static Bins &get_bins()
+    {
+        static thread_local Bins bins;
+        return bins;
+    }
+};
+
+
 /*=============================================================================
     easy, detachable wrapper for arrays
 
@@ -72,17 +153,18 @@ public:
 
         // if no pointer is given to manage, allocate our own
         if (data == NULL && capacity != 0) {
-            data = new ValueType [capacity];
+            capacity = ArrayPool<ValueType>::round_size(capacity);
+            data = ArrayPool<ValueType>::alloc(capacity);
         }
     }
 
     ExtendArray(const ExtendArray &other) :
         len(other.len),
-        capacity(other.capacity),
+        capacity(ArrayPool<ValueType>::round_size(other.capacity)),
         minsize(other.minsize)
     {
         // allocate new memory
-        data = new ValueType [capacity];
+        data = ArrayPool<ValueType>::alloc(capacity);
 
         // copy over data
         for (int i=0; i<len; i++)
@@ -92,7 +174,7 @@ public:
     ~ExtendArray()
     {
         if (data)
-            delete [] data;
+            ArrayPool<ValueType>::free(data, capacity);
     }
 
     ExtendArray &operator=(const ExtendArray &other)
@@ -144,13 +226,17 @@ public:
 
     bool setCapacity(int newsize)
     {
-        int oldsize = capacity;
-        ValueType *ret = resize(data, oldsize, newsize);
+        newsize = ArrayPool<ValueType>::round_size(newsize);
+        ValueType *ret = ArrayPool<ValueType>::alloc(newsize);
 
         // failed to alloc memory
         if (!ret)
             return false;
 
+        if (data) {
+            std::copy(data, data + std::min(capacity, newsize), ret);
+            ArrayPool<ValueType>::free(data, capacity);
+        }
         data = ret;
         capacity = newsize;
         return true;
@@ -173,9 +259,8 @@ public:
         int newsize = needed;
         if (newsize < minsize)
             newsize = minsize;
-        while (newsize < needed)
-            newsize *= 2;
 
+        // setCapacity() rounds up to a power of two
         return setCapacity(newsize);
     }
 
@@ -59,4 +59,132 @@ vector<double> compute_quantiles(vector<double> &scores,
     return result;
 }
 
+
+//=============================================================================
+// ScoreSketch
+
+void ScoreSketch::add(double score) {
+    n++;
+    double delta = score - meanval;
+    meanval += delta / n;
+    m2 += delta * (score - meanval);
+    if (n == 1 || score < minval) minval = score;
+    if (n == 1 || score > maxval) maxval = score;
+
+    buffer.push_back(score);
+    if ((int) buffer.size() > compression)
+        compress();
+}
+
+
+double ScoreSketch::mean() const {
+    if (n == 0)
+        printError("Error: trying to get mean with no scores\n");
+    return meanval;
+}
+
+
+double ScoreSketch::stdev() const {
+    if (n <= 1)
+        printError("Error: trying to get stdev with %i scores\n", n);
+    return sqrt(m2 / ((double) (n - 1)));
+}
+
+
+// scale function k1 of the t-digest and its inverse
+static double tdigest_scale(double q, int compression) {
+    return compression / (2.0 * M_PI) * asin(2.0 * q - 1.0);
+}
+
+static double tdigest_scale_inv(double k, int compression) {
+    if (k >= compression / 4.0) return 1.0;
+    return (sin(k * 2.0 * M_PI / compression) + 1.0) / 2.0;
+}
+
+
+// merges the buffered scores into the centroids
+void ScoreSketch::compress() {
+    if (buffer.empty())
+        return;
+    vector<pair<double,double> > points;
+    points.reserve(buffer.size() + centroid_mean.size());
+    for (unsigned int i=0; i < buffer.size(); i++)
+        points.push_back(make_pair(buffer[i], 1.0));
+    for (unsigned int i=0; i < centroid_mean.size(); i++)
+        points.push_back(make_pair(centroid_mean[i], centroid_weight[i]));
+    std::sort(points.begin(), points.end());
+    buffer.clear();
+    centroid_mean.clear();
+    centroid_weight.clear();
+
+    // greedily merge neighbours while the centroid stays within one unit
+    // of the scale function
+    const double total = n;
+    double cur_mean = points[0].first, cur_weight = points[0].second;
+    double before = 0.0;
+    double limit = total * tdigest_scale_inv(
+        tdigest_scale(0.0, compression) + 1.0, compression);
+    for (unsigned int i=1; i < points.size(); i++) {
+        if (before + cur_weight + points[i].second <= limit) {
+            cur_weight += points[i].second;
+            cur_mean += (points[i].first - cur_mean) * points[i].second /
+                cur_weight;
+        } else {
+            centroid_mean.push_back(cur_mean);
+            centroid_weight.push_back(cur_weight);
+            before += cur_weight;
+            limit = total * tdigest_scale_inv(
+                tdigest_scale(before / total, compression) + 1.0,
+                compression);
+            cur_mean = points[i].first;
+            cur_weight = points[i].second;
+        }
+    }
+    centroid_mean.push_back(cur_mean);
+    centroid_weight.push_back(cur_weight);
+}
+
+
+// interpolates a quantile between the centres of the centroids
+double ScoreSketch::quantile(double q) const {
+    const int ncentroids = centroid_mean.size();
+    const double target = q * n;
+    double cum = 0.0;
+    double prev_center = 0.0, prev_mean = minval;
+    for (int i=0; i < ncentroids; i++) {
+        double center = cum + centroid_weight[i] / 2.0;
+        if (target < center) {
+            double frac = (center > prev_center ?
+                           (target - prev_center) / (center - prev_center) :
+                           0.0);
+            return prev_mean + frac * (centroid_mean[i] - prev_mean);
+        }
+        cum += centroid_weight[i];
+        prev_center = center;
+        prev_mean = centroid_mean[i];
+    }
+    double frac = (n > prev_center ?
+                   (target - prev_center) / (n - prev_center) : 1.0);
+    return prev_mean + frac * (maxval - prev_mean);
+}
+
+
+vector<double> ScoreSketch::quantiles(const vector<double> &q) {
+    // exact until the first compression
+    if (centroid_mean.empty()) {
+        vector<double> scores = buffer;
+        return compute_quantiles(scores, q);
+    }
+    compress();
+    vector<double> result(q.size());
+    for (unsigned int i=0; i < q.size(); i++) {
+        if (q[i] < 0 || q[i] > 1) {
+            printError("Error: quantiles expects values between 0 and 1\n");
+            abort();
+        }
+        result[i] = quantile(q[i]);
+    }
+    return result;
+}
+
 }
@@ -22,26 +22,91 @@ vector<double> compute_quantiles(vector<double> &scores,
                                  const vector <double> &q);
 
 
+// Streaming summary of a set of scores in bounded memory.  The mean and
+// variance are updated with Welford's method, and quantiles are estimated
+// with a merging t-digest of about 'compression' centroids.  Quantiles
+// are exact (as compute_quantiles) until more than 'compression' scores
+// have been added.
+class ScoreSketch {
+public:
+    ScoreSketch(int compression=100) :
+        compression(compression), n(0), meanval(0.0), m2(0.0),
+        minval(0.0), maxval(0.0) {}
+
+    void add(double score);
+    int count() const {
+        return n;
+    }
+    double mean() const;
+    double stdev() const;
+    vector<double> quantiles(const vector<double> &q);
+
+protected:
+    void compress();
+    double quantile(double q) const;
+
+    int compression;
+    int n;
+    double meanval;
+    double m2;
+    double minval;
+    double maxval;
+    vector<double> buffer;           // scores not yet merged
+    vector<double> centroid_mean;    // t-digest, sorted by mean
+    vector<double> centroid_weight;
+};
+
+
+// Adds a score to the sketches of an interval, one sketch per element
+inline void add_sketch_scores(vector<ScoreSketch> &sketches, double score,
+                              int compression) {
+    if (sketches.empty())
+        sketches.push_back(ScoreSketch(compression));
+    sketches[0].add(score);
+}
+
+inline void add_sketch_scores(vector<ScoreSketch> &sketches,
+                              const vector<double> &score, int compression) {
+    if (sketches.empty())
+        sketches.resize(score.size(), ScoreSketch(compression));
+    assert(sketches.size() == score.size());
+    for (unsigned int i=0; i < score.size(); i++)
+        sketches[i].add(score[i]);
+}
+
+
 template <class scoreT>
 class Interval {
 public:
     Interval(string chrom, int start, int end):
-        chrom(chrom), start(start), end(end), have_mean(false)
+        chrom(chrom), start(start), end(end), have_mean(false),
+        sketch_size(0), nsketched(0)
     {
         scores.clear();
     }
     Interval(string chrom, int start, int end, scoreT score):
-        chrom(chrom), start(start), end(end), have_mean(true), meanval(score)
+        chrom(chrom), start(start), end(end), have_mean(true), meanval(score),
+        sketch_size(0), nsketched(0)
     {
         scores.clear();
         scores.push_back(score);
     }
-    void add_score(scoreT score) {
+    // Summarizes the scores added from now on into sketches of the given
+    // size instead of storing them (see get_sketches())
+    void use_sketches(int size) {
+        sketch_size = size;
+    }
+    void add_score(const scoreT &score) {
+        if (sketch_size > 0) {
+            add_sketch_scores(sketches, score, sketch_size);
+            nsketched++;
+            return;
+        }
         scores.push_back(score);
         have_mean = false;
     }
     int num_score() {
-        return scores.size();
+        return sketch_size > 0 ? nsketched : scores.size();
     }
     scoreT get_score(int i) {
         if (i < 0 || i >= (int)scores.size()) {
@@ -53,6 +118,12 @@ public:
     vector<scoreT> &get_scores() {
         return scores;
     }
+    vector<ScoreSketch> &get_sketches() {
+        return sketches;
+    }
+    bool is_sketched() const {
+        return sketch_size > 0;
+    }
     scoreT mean() {
         meanval = compute_mean(scores);
         have_mean = true;
@@ -75,6 +146,9 @@ protected:
     bool have_mean;
     scoreT meanval;
     vector<scoreT> scores;
+    int sketch_size;
+    int nsketched;
+    vector<ScoreSketch> sketches;
 };
 
 
@@ -83,12 +157,15 @@ protected:
    The segments should be input using the append() function in sorted bed
    order. The finish() function should be used at end to signal that there
    are no more incoming segments.
+   If sketch_size > 0, the output segments hold sketches of their scores
+   (see ScoreSketch) rather than the scores themselves.
  */
 template <class scoreT>
 class IntervalIterator
 {
 public:
-    IntervalIterator()
+    IntervalIterator(int sketch_size=0) :
+        sketch_size(sketch_size)
     {
         intervals.clear();
         combined.clear();
@@ -167,6 +244,8 @@ public:
 protected:
     void pushNext(string chr, int start, int end) {
         Interval<scoreT> newCombined(chr, start, end);
+        if (sketch_size > 0)
+            newCombined.use_sketches(sketch_size);
         typename std::list<Interval<scoreT> >::iterator curr_it, next_it;
         curr_it = intervals.begin();
         next_it = intervals.begin();
@@ -194,6 +273,7 @@ protected:
     list<Interval<scoreT> > combined;
     set<int> bounds;
     string chrom;
+    int sketch_size;
 };
 
 } // namespace argweaver
@@ -21,6 +21,7 @@
 #include "parsing.h"
 #include "logging.h"
 #include "model.h"
+#include "local_tree.h"
 
 namespace spidir {
 
@@ -32,6 +33,51 @@ bool isNewickChar(char c) {
             c==vals[4] || c==vals[5] || c==vals[6] || c==vals[7]);
 }
 
+//=============================================================================
+// node allocation
+//
+// arg-summarize rebuilds trees for every MCMC sample, so nodes are taken
+// from per-thread free lists carved out of slabs instead of being
+// allocated one at a time.  Slabs are kept for reuse and never released.
+
+namespace {
+const int NODE_SLAB_SIZE = 256;
+
+struct FreeNode {
+    FreeNode *next;
+};
+
+thread_local FreeNode *free_nodes = NULL;
+}
+
+
+void *Node::operator new(size_t size)
+{
+    assert(size == sizeof(Node));
+    if (!free_nodes) {
+        char *slab = (char*) ::operator new(sizeof(Node) * NODE_SLAB_SIZE);
+        for (int i=NODE_SLAB_SIZE-1; i>=0; i--) {
+            FreeNode *node = (FreeNode*) (slab + i * sizeof(Node));
+            node->next = free_nodes;
+            free_nodes = node;
+        }
+    }
+    FreeNode *node = free_nodes;
+    free_nodes = node->next;
+    return node;
+}
+
+
+void Node::operator delete(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+    FreeNode *node = (FreeNode*) ptr;
+    node->next = free_nodes;
+    free_nodes = node;
+}
+
+
 //create a tree from a newick string
 Tree::Tree(string newick, const ArgModel *model)
 {
@@ -631,6 +677,10 @@ void NodeSpr::correct_recomb_times(const double *times, int ntimes) {
 /* get new SPR from newick string */
 void NodeSpr::update_spr_from_newick(Tree *tree, char *newick,
                                      const ArgModel *model) {
+    if (is_bed_spr_record(newick)) {
+        update_spr_from_record(tree, newick, model);
+        return;
+    }
     char search1[100]="recomb_time=";
     char search2[100]="coal_time=";
     char search3[100]="spr_pop_path=";
@@ -656,6 +706,48 @@ void NodeSpr::update_spr_from_newick(Tree *tree, char *newick,
     if (model != NULL) correct_recomb_times(model->times, model->ntimes);
 }
 
+bool is_bed_spr_record(const char *str) {
+    return str_starts_with(str, BED_SPR_RECORD) &&
+        (str[strlen(BED_SPR_RECORD)] == '\0' ||
+         str[strlen(BED_SPR_RECORD)] == '\t');
+}
+
+
+//find the node named by a leaf and the number of steps up from it
+static Node *get_bed_spr_node(Tree *tree, const char *leaf, int up) {
+    map<string,int>::iterator it = tree->nodename_map.find(string(leaf));
+    assert(it != tree->nodename_map.end());
+    Node *node = tree->nodes[it->second];
+    for (int i=0; i < up; i++) {
+        assert(node->parent != NULL);
+        node = node->parent;
+    }
+    return node;
+}
+
+
+/* get new SPR from an SPR record */
+void NodeSpr::update_spr_from_record(Tree *tree, const char *record,
+                                     const ArgModel *model) {
+    char recomb_leaf[1000], coal_leaf[1000];
+    int recomb_up, coal_up;
+    int n = sscanf(record + strlen(BED_SPR_RECORD),
+                   "%999s %d %lg %999s %d %lg %d",
+                   recomb_leaf, &recomb_up, &recomb_time,
+                   coal_leaf, &coal_up, &coal_time, &pop_path);
+    if (n <= 0) {
+        recomb_node = NULL;
+        coal_node = NULL;
+        return;
+    }
+    assert(n == 7);
+    recomb_node = get_bed_spr_node(tree, recomb_leaf, recomb_up);
+    coal_node = get_bed_spr_node(tree, coal_leaf, coal_up);
+
+    if (model != NULL) correct_recomb_times(model->times, model->ntimes);
+}
+
+
 //update the SPR on pruned tree based on node_map in big tree
 void SprPruned::update_spr_pruned(const ArgModel *model) {
     if (orig_spr.recomb_node == NULL) {
@@ -1579,6 +1671,132 @@ double Tree::rth() {
     return this->tmrca_half()/this->tmrca();
 }
 
+//=============================================================================
+// Tree statistics in one pass
+
+TreeStats::TreeStats(const Tree *tree) :
+    nnodes(0), nleaves(0), branchlen(0.0), pi(0.0), nzero(0)
+{
+    ExtendArray<Node*> postnodes;
+    getTreePostOrder(tree, &postnodes);
+    nnodes = postnodes.size();
+    age.resize(nnodes);
+    parent.resize(nnodes);
+    size.resize(nnodes);
+    child_start.resize(nnodes + 1);
+
+    // postorder position of each node, by name
+    vector<int> index(tree->nnodes, -1);
+    vector<int> ndesc(nnodes);
+    const int num_leaf = (tree->nnodes+1)/2;
+    nleaves = num_leaf;
+    child_start[0] = 0;
+    for (int i=0; i < nnodes; i++) {
+        const Node *node = postnodes[i];
+        index[node->name] = i;
+        age[i] = node->age;
+        parent[i] = -1;
+        size[i] = 1;
+        ndesc[i] = (node->nchildren == 0);
+        for (int j=0; j < node->nchildren; j++) {
+            const int c = index[node->children[j]->name];
+            children.push_back(c);
+            parent[c] = i;
+            size[i] += size[c];
+            ndesc[i] += ndesc[c];
+        }
+        child_start[i+1] = children.size();
+
+        if (node != tree->root) {
+            branchlen += node->dist;
+            if (fabs(node->dist) < 0.0001)
+                nzero++;
+        }
+        if (node->parent != NULL)
+            pi += node->dist * (double)(num_leaf - ndesc[i]) * ndesc[i];
+    }
+    pi = pi*2.0/(num_leaf * (num_leaf-1));
+}
+
+
+double TreeStats::tmrca_half() const {
+    const int numnode = (nnodes-1)/2;
+    int node = nnodes-1;
+    while (true) {
+        if (size[node] == numnode) return age[node];
+        if (child_start[node+1] - child_start[node] != 2) {
+            fprintf(stderr,
+                    "Error: tmrca_half only works for bifurcating trees\n");
+            return age[node];
+        }
+        const int c0 = children[child_start[node]];
+        const int c1 = children[child_start[node]+1];
+        if (size[c0] == numnode && size[c1] == numnode)
+            return min(age[c0], age[c1]);
+        if (size[c0] >= numnode) {
+            assert(size[c1] < numnode);
+            node = c0;
+        } else if (size[c1] >= numnode) {
+            node = c1;
+        } else {
+            return age[node];
+        }
+    }
+}
+
+
+const vector<double> &TreeStats::sorted_coal_ages() {
+    if (coal_ages.empty()) {
+        for (int i=0; i < nnodes; i++)
+            if (child_start[i+1] > child_start[i])
+                coal_ages.push_back(age[i]);
+        std::sort(coal_ages.begin(), coal_ages.end());
+    }
+    return coal_ages;
+}
+
+
+double TreeStats::popsize() {
+    const vector<double> &ages = sorted_coal_ages();
+    double lasttime=0, popsize=0;
+    int k=nleaves;
+    for (unsigned int i=0; i < ages.size(); i++) {
+        popsize += (double)k*(k-1)*(ages[i]-lasttime);
+        lasttime = ages[i];
+        k--;
+    }
+    return popsize/(4.0*nleaves-4);
+}
+
+
+vector<double> TreeStats::coalCounts(const double *times, int ntimes) {
+    const vector<double> &ages = sorted_coal_ages();
+    vector<double> counts(ntimes, 0.0);
+    int idx=0;
+    for (unsigned int i=0; i < ages.size(); i++) {
+        while (fabs(ages[i]-times[idx]) >= 0.00001) {
+            idx++;
+            assert(idx < ntimes);
+        }
+        counts[idx]++;
+    }
+    return counts;
+}
+
+
+vector<double> TreeStats::branchlen_per_time(const ArgModel *model) const {
+    vector<double> lens(model->ntimes, 0.0);
+    for (int i=0; i < nnodes; i++) {
+        if (parent[i] == -1) continue;
+        int age1 = model->discretize_time(age[i]);
+        int age2 = model->discretize_time(age[parent[i]]);
+        for (int k=age1; k < age2; k++)
+            lens[k] += (model->times[k + 1] - model->times[k]);
+    }
+    return lens;
+}
+
+
 double Tree::distBetweenLeaves(Node *n1, Node *n2) {
     if (n1 == n2) return 0.0;
     ExtendArray<Node*> postnodes;
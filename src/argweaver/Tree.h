@@ -73,21 +73,32 @@ public:
 
     ~Node()
     {
-        if (children)
-            delete [] children;
+        freeChildren(children);
     }
 
+    // Nodes are recycled through a per-thread free list (see Tree.cpp)
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
+
     // Sets and allocates the number of children '_nchildren'
     void setChildren(int _nchildren)
     {
-        children = resize(children, nchildren, _nchildren);
+        Node **old = children;
+        children = newChildren(_nchildren);
+        if (old) {
+            if (old != children)
+                std::copy(old, old + std::min(nchildren, _nchildren),
+                          children);
+            freeChildren(old);
+        }
         nchildren = _nchildren;
     }
 
     // Allocates the number of children '_nchildren'
     void allocChildren(int _nchildren)
     {
-        children = new Node* [_nchildren];
+        freeChildren(children);
+        children = newChildren(_nchildren);
     }
 
     // Returns whether the node is a leaf
@@ -114,6 +125,30 @@ public:
     double age;
     string longname;    // node name (used mainly for leaves only)
     int pop_path;
+
+protected:
+    // up to two children are stored in the node itself
+    enum { MAX_INLINE_CHILDREN = 2 };
+
+    Node **newChildren(int n)
+    {
+        if (n <= MAX_INLINE_CHILDREN)
+            return inline_children;
+        return new Node* [n];
+    }
+
+    void freeChildren(Node **array)
+    {
+        if (array && array != inline_children)
+            delete [] array;
+    }
+
+    Node *inline_children[MAX_INLINE_CHILDREN];
+
+private:
+    // copies would share inline_children
+    Node(const Node &other);
+    Node &operator=(const Node &other);
 };
 
 
@@ -370,6 +405,53 @@ public:
 };
 
 
+// Statistics of one tree computed together.  A single postorder traversal
+// gathers the nodes into flat arrays (indexed by postorder position, so
+// children come before their parent), from which each statistic is a loop
+// over the arrays.  Values are the same as those of the Tree methods of
+// the same name.
+class TreeStats {
+public:
+    TreeStats(const Tree *tree);
+
+    double tmrca() const {
+        return age[nnodes-1];
+    }
+    double total_branchlength() const {
+        return branchlen;
+    }
+    double avg_pairwise_distance() const {
+        return pi;
+    }
+    double tmrca_half() const;
+    double rth() const {
+        return tmrca_half() / tmrca();
+    }
+    double popsize();
+    vector<double> coalCounts(const double *times, int ntimes);
+    double num_zero_branches() const {
+        return nzero;
+    }
+    // branch length in each time interval of the model
+    vector<double> branchlen_per_time(const ArgModel *model) const;
+
+protected:
+    const vector<double> &sorted_coal_ages();
+
+    int nnodes;
+    int nleaves;
+    vector<double> age;
+    vector<int> parent;          // -1 for the root
+    vector<int> child_start;     // children of i are children[child_start[i],
+    vector<int> children;        //  child_start[i+1])
+    vector<int> size;            // number of nodes in subtree
+    double branchlen;
+    double pi;
+    int nzero;
+    vector<double> coal_ages;    // sorted on first use
+};
+
+
 //like Spr in local_tree.h, but with Node pointers and real times
 class NodeSpr {
 public:
@@ -381,6 +463,9 @@ public:
     void correct_recomb_times(const double *times, int ntimes);
     void update_spr_from_newick(Tree *tree, char *newick_str,
                                 const ArgModel *model);
+    // get SPR from a bed file SPR record (see BED_SPR_RECORD)
+    void update_spr_from_record(Tree *tree, const char *record,
+                                const ArgModel *model);
     bool is_invisible() const;
     Node *recomb_node;
     Node *coal_node;
@@ -390,6 +475,11 @@ public:
 };
 
 
+// Returns true if a bed file tree column is an SPR record rather than a
+// newick tree
+bool is_bed_spr_record(const char *str);
+
+
 // Efficient SPR operation on a tree and its pruned version
 class SprPruned {
 private:
@@ -425,8 +515,9 @@ public:
                                         &orig_spr, oneline);
     }
 
-    //apply spr on both trees and get next SPR from newick string. Don't
-    //parse the newick string unless previous SPR not set
+    //apply spr on both trees and get next SPR from newick string or SPR
+    //record. Don't parse the newick string unless previous SPR not set
+    //(an SPR record cannot be used then)
     void update(char *newick, const ArgModel *model);
 
     Tree *orig_tree;
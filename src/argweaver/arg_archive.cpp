@@ -0,0 +1,613 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <zlib.h>
+
+#include "arg_archive.h"
+#include "logging.h"
+#include "parsing.h"
+
+namespace argweaver {
+
+
+// Archive file format
+//
+//   char    magic[4] = "\x89" "ARA"
+//   int     version
+//   blocks             (zlib streams of the line numbers of a block,
+//                       relative to its first line, as uint32, followed
+//                       by its lines)
+//   index:
+//     string  header
+//     int     nchroms
+//     string  chroms[nchroms]
+//     int     nsamples
+//     per sample: int sample, int nblocks,
+//                 per block: int chrom, start, end, nlines, size, data_size
+//                            int64 ordinal, offset
+//   int64   index offset
+//   char    end[4] = "ARAE"
+//
+// Strings are prefixed by their length.  Values are in host byte order.
+
+static const char *ARCHIVE_MAGIC = "\x89" "ARA";
+static const char *ARCHIVE_END = "ARAE";
+static const int ARCHIVE_VERSION = 1;
+
+// lines of a sample are compressed in blocks of about this many bytes
+static const unsigned int ARCHIVE_BLOCK_SIZE = 1 << 16;
+
+
+//=============================================================================
+// writing
+
+static bool write_ints(FILE *out, const int *values, int n)
+{
+    return fwrite(values, sizeof(int), n, out) == (size_t) n;
+}
+
+static bool write_int64s(FILE *out, const int64_t *values, int n)
+{
+    return fwrite(values, sizeof(int64_t), n, out) == (size_t) n;
+}
+
+static bool write_string(FILE *out, const string &str)
+{
+    int len = str.size();
+    return write_ints(out, &len, 1) &&
+        fwrite(str.data(), 1, len, out) == (size_t) len;
+}
+
+
+// The block of a sample being filled
+class ArchiveBlockBuilder
+{
+public:
+    ArchiveBlockBuilder() : last_start(-1) {}
+
+    ArgArchiveBlock block;
+    vector<uint32_t> ordinals;
+    string lines;
+    int last_start;
+};
+
+
+static bool flush_archive_block(FILE *out, ArchiveBlockBuilder *builder,
+                                vector<ArgArchiveBlock> *blocks)
+{
+    if (builder->ordinals.empty())
+        return true;
+
+    string data((const char*) &builder->ordinals[0],
+                builder->ordinals.size() * sizeof(uint32_t));
+    data += builder->lines;
+    uLongf size = compressBound(data.size());
+    vector<Bytef> compressed(size);
+    if (compress2(&compressed[0], &size, (const Bytef*) data.data(),
+                  data.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+        return false;
+
+    ArgArchiveBlock &block = builder->block;
+    block.nlines = builder->ordinals.size();
+    block.offset = ftello(out);
+    block.size = size;
+    block.data_size = data.size();
+    if (fwrite(&compressed[0], 1, size, out) != size)
+        return false;
+    blocks->push_back(block);
+
+    builder->ordinals.clear();
+    builder->lines.clear();
+    return true;
+}
+
+
+static bool write_archive_index(FILE *out, const ArgArchive &archive)
+{
+    bool ok = write_string(out, archive.header);
+    int nchroms = archive.chroms.size();
+    ok = ok && write_ints(out, &nchroms, 1);
+    for (int i=0; i<nchroms; i++)
+        ok = ok && write_string(out, archive.chroms[i]);
+
+    int nsamples = archive.samples.size();
+    ok = ok && write_ints(out, &nsamples, 1);
+    for (int i=0; i<nsamples && ok; i++) {
+        const vector<ArgArchiveBlock> &blocks = archive.blocks[i];
+        int header[] = {archive.samples[i], (int) blocks.size()};
+        ok = write_ints(out, header, 2);
+        for (unsigned int j=0; j<blocks.size() && ok; j++) {
+            const ArgArchiveBlock &block = blocks[j];
+            int values[] = {block.chrom, block.start, block.end,
+                            block.nlines, block.size, block.data_size};
+            int64_t values64[] = {block.ordinal, block.offset};
+            ok = write_ints(out, values, 6) && write_int64s(out, values64, 2);
+        }
+    }
+    return ok;
+}
+
+
+// Parses chrom, start, end and sample of a bed line.  Returns the length
+// of the chrom name.
+static int parse_archive_line(const char *line, int *start, int *end,
+                              int *sample)
+{
+    const char *tab = strchr(line, '\t');
+    if (!tab || tab == line)
+        return 0;
+    char *p;
+    *start = strtol(tab + 1, &p, 10);
+    if (*p != '\t')
+        return 0;
+    *end = strtol(p + 1, &p, 10);
+    if (*p != '\t')
+        return 0;
+    *sample = strtol(p + 1, &p, 10);
+    if (*p != '\t' && *p != '\n' && *p != '\0')
+        return 0;
+    return tab - line;
+}
+
+
+bool write_arg_archive(FILE *bedfile, const char *filename)
+{
+    FILE *out = fopen(filename, "wb");
+    if (!out) {
+        printError("cannot write '%s'", filename);
+        return false;
+    }
+
+    bool ok = fwrite(ARCHIVE_MAGIC, 1, 4, out) == 4 &&
+        write_ints(out, &ARCHIVE_VERSION, 1);
+
+    ArgArchive archive;
+    map<string, int> chrom_index;
+    map<int, ArchiveBlockBuilder> builders;
+    map<int, vector<ArgArchiveBlock> > sample_blocks;
+    int64_t ordinal = 0;
+    int lineno = 0;
+    int linesize = 10000;
+    char *line = new char [linesize];
+    while (ok) {
+        const int len = fgetline(&line, &linesize, bedfile);
+        if (len <= 0)
+            break;
+        lineno++;
+        if (line[0] == '#') {
+            if (ordinal == 0) {
+                archive.header += line;
+                if (line[len-1] != '\n')
+                    archive.header += '\n';
+            }
+            continue;
+        }
+
+        int start, end, sample;
+        const int chrom_len = parse_archive_line(line, &start, &end, &sample);
+        if (chrom_len == 0) {
+            printError("bad line %d in bed file", lineno);
+            ok = false;
+            break;
+        }
+        const string chrom(line, chrom_len);
+        map<string, int>::iterator it = chrom_index.find(chrom);
+        if (it == chrom_index.end()) {
+            const int index = archive.chroms.size();
+            it = chrom_index.insert(make_pair(chrom, index)).first;
+            archive.chroms.push_back(chrom);
+        }
+
+        ArchiveBlockBuilder &builder = builders[sample];
+        ArgArchiveBlock &block = builder.block;
+        if (!builder.ordinals.empty() && block.chrom == it->second &&
+            start < builder.last_start) {
+            printError("bed file is not sorted at line %d", lineno);
+            ok = false;
+            break;
+        }
+        if (!builder.ordinals.empty() &&
+            (block.chrom != it->second ||
+             builder.lines.size() >= ARCHIVE_BLOCK_SIZE)) {
+            if (!flush_archive_block(out, &builder, &sample_blocks[sample])) {
+                ok = false;
+                break;
+            }
+        }
+        if (builder.ordinals.empty()) {
+            block.chrom = it->second;
+            block.start = start;
+            block.end = end;
+            block.ordinal = ordinal;
+        }
+        block.end = max(block.end, end);
+        builder.ordinals.push_back(ordinal - block.ordinal);
+        builder.lines.append(line, len);
+        if (line[len-1] != '\n')
+            builder.lines += '\n';
+        builder.last_start = start;
+        ordinal++;
+    }
+    delete [] line;
+
+    for (map<int, ArchiveBlockBuilder>::iterator it=builders.begin();
+         it != builders.end() && ok; ++it) {
+        vector<ArgArchiveBlock> &blocks = sample_blocks[it->first];
+        ok = flush_archive_block(out, &it->second, &blocks);
+        archive.samples.push_back(it->first);
+        archive.blocks.push_back(blocks);
+    }
+
+    int64_t index_offset = ftello(out);
+    ok = ok && write_archive_index(out, archive) &&
+        write_int64s(out, &index_offset, 1) &&
+        fwrite(ARCHIVE_END, 1, 4, out) == 4;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok)
+        printError("error writing archive '%s'", filename);
+    return ok;
+}
+
+
+//=============================================================================
+// reading
+
+static bool read_ints(FILE *infile, int *values, int n)
+{
+    return fread(values, sizeof(int), n, infile) == (size_t) n;
+}
+
+static bool read_int64s(FILE *infile, int64_t *values, int n)
+{
+    return fread(values, sizeof(int64_t), n, infile) == (size_t) n;
+}
+
+static bool read_string(FILE *infile, string *str)
+{
+    int len;
+    if (!read_ints(infile, &len, 1) || len < 0 || len > (1 << 30))
+        return false;
+    str->resize(len);
+    return len == 0 || fread(&(*str)[0], 1, len, infile) == (size_t) len;
+}
+
+
+static bool read_archive_index(FILE *infile, ArgArchive *archive,
+                               int64_t index_offset)
+{
+    int nchroms, nsamples;
+    if (!read_string(infile, &archive->header) ||
+        !read_ints(infile, &nchroms, 1) || nchroms < 0)
+        return false;
+    archive->chroms.resize(nchroms);
+    for (int i=0; i<nchroms; i++)
+        if (!read_string(infile, &archive->chroms[i]))
+            return false;
+
+    if (!read_ints(infile, &nsamples, 1) || nsamples < 0)
+        return false;
+    archive->samples.resize(nsamples);
+    archive->blocks.resize(nsamples);
+    for (int i=0; i<nsamples; i++) {
+        int header[2];
+        if (!read_ints(infile, header, 2) || header[1] < 0 ||
+            (i > 0 && header[0] <= archive->samples[i-1]))
+            return false;
+        archive->samples[i] = header[0];
+        vector<ArgArchiveBlock> &blocks = archive->blocks[i];
+        blocks.resize(header[1]);
+        for (int j=0; j<header[1]; j++) {
+            int values[6];
+            int64_t values64[2];
+            if (!read_ints(infile, values, 6) ||
+                !read_int64s(infile, values64, 2))
+                return false;
+            ArgArchiveBlock &block = blocks[j];
+            block.chrom = values[0];
+            block.start = values[1];
+            block.end = values[2];
+            block.nlines = values[3];
+            block.size = values[4];
+            block.data_size = values[5];
+            block.ordinal = values64[0];
+            block.offset = values64[1];
+            if (block.chrom < 0 || block.chrom >= nchroms ||
+                block.nlines <= 0 || block.size <= 0 ||
+                block.data_size / sizeof(uint32_t) < (size_t) block.nlines ||
+                block.offset < 8 || block.offset + block.size > index_offset)
+                return false;
+        }
+    }
+    return true;
+}
+
+
+bool ArgArchive::open(const char *filename)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+
+    char magic[4];
+    int version;
+    int64_t index_offset;
+    bool ok = fread(magic, 1, 4, infile) == 4 &&
+        memcmp(magic, ARCHIVE_MAGIC, 4) == 0 &&
+        read_ints(infile, &version, 1) && version == ARCHIVE_VERSION &&
+        fseeko(infile, -12, SEEK_END) == 0 &&
+        read_int64s(infile, &index_offset, 1) &&
+        fread(magic, 1, 4, infile) == 4 &&
+        memcmp(magic, ARCHIVE_END, 4) == 0 &&
+        fseeko(infile, index_offset, SEEK_SET) == 0 &&
+        read_archive_index(infile, this, index_offset);
+    fclose(infile);
+    if (!ok) {
+        printError("bad ARG archive '%s'", filename);
+        return false;
+    }
+    this->filename = filename;
+    return true;
+}
+
+
+bool is_arg_archive(const char *filename)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+    char magic[4];
+    bool ok = fread(magic, 1, 4, infile) == 4 &&
+        memcmp(magic, ARCHIVE_MAGIC, 4) == 0;
+    fclose(infile);
+    return ok;
+}
+
+
+//=============================================================================
+// queries
+
+// Parses a region "chr", "chr:start" or "chr:start-end" (1-based,
+// inclusive) into a half-open, 0-based interval
+static bool parse_archive_region(const char *region, string *chrom,
+                                 int64_t *beg, int64_t *end)
+{
+    string str;
+    for (const char *c=region; *c; c++)
+        if (*c != ',')
+            str += *c;
+
+    *beg = 0;
+    *end = INT64_MAX;
+    const size_t colon = str.rfind(':');
+    if (colon == string::npos) {
+        *chrom = str;
+        return !chrom->empty();
+    }
+    *chrom = str.substr(0, colon);
+
+    long long start, stop;
+    const int n = sscanf(str.c_str() + colon + 1, "%lld-%lld", &start, &stop);
+    if (n < 1)
+        return false;
+    *beg = max(start - 1, 0LL);
+    if (n == 2)
+        *end = stop;
+    return !chrom->empty() && *beg < *end;
+}
+
+
+// Reads the lines of one sample that overlap a region, one block at a
+// time
+class ArchiveCursor
+{
+public:
+    ArchiveCursor(FILE *file, int64_t beg, int64_t end) :
+        file(file),
+        beg(beg),
+        end(end),
+        next_block(0),
+        line_index(0),
+        nlines(0),
+        pos(0)
+    {}
+
+    // moves to the next line.  Returns false at the end of the sample.
+    bool next()
+    {
+        while (true) {
+            while (line_index >= nlines) {
+                if (next_block >= blocks.size() || !load_block())
+                    return false;
+            }
+
+            const uint32_t *ordinals = (const uint32_t*) data.data();
+            ordinal = block->ordinal + ordinals[line_index++];
+            const size_t stop = data.find('\n', pos);
+            line.assign(data, pos, stop - pos);
+            pos = stop + 1;
+
+            int start, line_end, sample;
+            if (!parse_archive_line(line.c_str(), &start, &line_end, &sample))
+                continue;
+            if (start >= end) {
+                // lines of a sample are sorted
+                next_block = blocks.size();
+                nlines = 0;
+                return false;
+            }
+            if (line_end > beg)
+                return true;
+        }
+    }
+
+    FILE *file;
+    int64_t beg;
+    int64_t end;
+    vector<const ArgArchiveBlock*> blocks;   // blocks that overlap region
+    int64_t ordinal;                         // of the current line
+    string line;                             // current line
+
+protected:
+    bool load_block()
+    {
+        block = blocks[next_block++];
+        nlines = 0;
+        vector<Bytef> compressed(block->size);
+        data.resize(block->data_size);
+        uLongf size = block->data_size;
+        if (fseeko(file, block->offset, SEEK_SET) != 0 ||
+            fread(&compressed[0], 1, block->size, file) !=
+            (size_t) block->size ||
+            uncompress((Bytef*) &data[0], &size, &compressed[0],
+                       block->size) != Z_OK ||
+            size != (uLongf) block->data_size) {
+            printError("error reading ARG archive block");
+            next_block = blocks.size();
+            return false;
+        }
+        nlines = block->nlines;
+        line_index = 0;
+        pos = nlines * sizeof(uint32_t);
+        return true;
+    }
+
+    const ArgArchiveBlock *block;
+    unsigned int next_block;
+    int line_index;
+    int nlines;
+    string data;
+    size_t pos;
+};
+
+
+// Streams the header and lines of a query in bed file order, merging the
+// lines of the queried samples by line number.
+class ArchiveQuery
+{
+public:
+    typedef pair<int64_t, int> QueueItem;
+
+    ArchiveQuery(FILE *file, const string &header) :
+        file(file),
+        pending(header),
+        pending_offset(0)
+    {}
+
+    ~ArchiveQuery()
+    {
+        for (unsigned int i=0; i<cursors.size(); i++)
+            delete cursors[i];
+        fclose(file);
+    }
+
+    void start()
+    {
+        for (unsigned int i=0; i<cursors.size(); i++)
+            if (cursors[i]->next())
+                queue.push(QueueItem(cursors[i]->ordinal, i));
+    }
+
+    ssize_t read(char *buf, size_t size)
+    {
+        size_t written = 0;
+        while (written < size) {
+            if (pending_offset == pending.size()) {
+                pending_offset = 0;
+                pending.clear();
+                if (queue.empty())
+                    break;
+                const int i = queue.top().second;
+                queue.pop();
+                pending = cursors[i]->line;
+                pending += '\n';
+                if (cursors[i]->next())
+                    queue.push(QueueItem(cursors[i]->ordinal, i));
+            }
+            const size_t n = min(size - written,
+                                 pending.size() - pending_offset);
+            memcpy(buf + written, pending.data() + pending_offset, n);
+            written += n;
+            pending_offset += n;
+        }
+        return written;
+    }
+
+    FILE *file;
+    vector<ArchiveCursor*> cursors;
+
+protected:
+    priority_queue<QueueItem, vector<QueueItem>, greater<QueueItem> > queue;
+    string pending;
+    size_t pending_offset;
+};
+
+
+static ssize_t archive_cookie_read(void *cookie, char *buf, size_t size)
+{
+    return ((ArchiveQuery*) cookie)->read(buf, size);
+}
+
+static int archive_cookie_close(void *cookie)
+{
+    delete (ArchiveQuery*) cookie;
+    return 0;
+}
+
+
+FILE *ArgArchive::query(const char *region,
+                        const vector<int> &query_samples) const
+{
+    int chrom = -1;
+    int64_t beg = 0, end = INT64_MAX;
+    if (region != NULL) {
+        string chrom_name;
+        if (!parse_archive_region(region, &chrom_name, &beg, &end)) {
+            printError("Error parsing region string %s\n", region);
+            return NULL;
+        }
+        // an unknown sequence gives the header only
+        chrom = find(chroms.begin(), chroms.end(), chrom_name) -
+            chroms.begin();
+        if (chrom == (int) chroms.size())
+            chrom = -2;
+    }
+
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        printError("cannot read '%s'", filename.c_str());
+        return NULL;
+    }
+    ArchiveQuery *query = new ArchiveQuery(file, header);
+    for (unsigned int i=0; i<query_samples.size() && chrom != -2; i++) {
+        vector<int>::const_iterator it = lower_bound(
+            samples.begin(), samples.end(), query_samples[i]);
+        if (it == samples.end() || *it != query_samples[i])
+            continue;
+        const vector<ArgArchiveBlock> &sample_blocks =
+            blocks[it - samples.begin()];
+        ArchiveCursor *cursor = new ArchiveCursor(file, beg, end);
+        for (unsigned int j=0; j<sample_blocks.size(); j++) {
+            const ArgArchiveBlock &block = sample_blocks[j];
+            if ((chrom == -1 || block.chrom == chrom) &&
+                block.start < end && block.end > beg)
+                cursor->blocks.push_back(&block);
+        }
+        query->cursors.push_back(cursor);
+    }
+    query->start();
+
+    cookie_io_functions_t funcs = {archive_cookie_read, NULL, NULL,
+                                   archive_cookie_close};
+    FILE *stream = fopencookie(query, "r", funcs);
+    if (!stream)
+        delete query;
+    return stream;
+}
+
+
+} // namespace argweaver
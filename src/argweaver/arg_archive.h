@@ -0,0 +1,74 @@
+//=============================================================================
+// Archives of sampled ARGs indexed by MCMC sample and coordinate
+
+
+#ifndef ARGWEAVER_ARG_ARCHIVE_H
+#define ARGWEAVER_ARG_ARCHIVE_H
+
+// c/c++ includes
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace argweaver {
+
+using namespace std;
+
+
+// A compressed run of consecutive lines of one MCMC sample
+class ArgArchiveBlock
+{
+public:
+    int chrom;          // index into ArgArchive::chroms
+    int start;          // start of the first line
+    int end;            // end of the last line
+    int64_t ordinal;    // line number of the first line in the bed file
+    int nlines;
+    int64_t offset;     // file offset of the compressed data
+    int size;           // compressed size
+    int data_size;      // uncompressed size
+};
+
+
+// An archive holds the lines of a bed file of ARG samples (as written by
+// smc2bed and sorted) grouped by MCMC sample.  Each sample has its own
+// index of blocks by coordinate, so queries for a few samples only read
+// their blocks, instead of reading the lines of all samples in a region
+// like a tabix query.
+class ArgArchive
+{
+public:
+    ArgArchive() {}
+
+    // Reads the index of an archive
+    bool open(const char *filename);
+
+    // Returns the MCMC samples in the archive, in increasing order
+    const vector<int> &get_samples() const { return samples; }
+
+    // Opens a stream of the lines of some samples that overlap a region
+    // ("chr:start-end", 1-based, or NULL for the whole archive).  The
+    // stream starts with the header of the bed file, and lines are in the
+    // same order as in the bed file.  Returns NULL on error.
+    FILE *query(const char *region, const vector<int> &query_samples) const;
+
+    string filename;
+    string header;                   // header lines of the bed file
+    vector<string> chroms;
+    vector<int> samples;
+    vector<vector<ArgArchiveBlock> > blocks;  // blocks of each sample
+};
+
+
+// Returns true if a file is an ARG archive
+bool is_arg_archive(const char *filename);
+
+// Writes an archive from a bed file of ARG samples.  The lines of each
+// sample must be sorted by coordinate.
+bool write_arg_archive(FILE *bedfile, const char *filename);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_ARG_ARCHIVE_H
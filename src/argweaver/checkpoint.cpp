@@ -0,0 +1,352 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "logging.h"
+
+namespace argweaver {
+
+
+static const char *CHECKPOINT_MAGIC = "\x89" "CKP";
+static const char *CHECKPOINT_END = "CKPE";
+static const int CHECKPOINT_VERSION = 2;  // 2: xoshiro256** thread generators
+
+
+void make_checkpoint(Checkpoint *checkpoint, int iter, const ArgModel *model,
+                     const Sequences *sequences, const LocalTrees *trees,
+                     bool save_seqs)
+{
+    checkpoint->iter = iter;
+    checkpoint->heat = model->mc3.heat;
+    checkpoint->rand_state = get_rand_state();
+    checkpoint->times.assign(model->times, model->times + model->ntimes);
+
+    const int npop = model->num_pops();
+    checkpoint->popsizes.resize(npop);
+    for (int pop=0; pop<npop; pop++)
+        checkpoint->popsizes[pop].assign(
+            model->popsizes[pop], model->popsizes[pop] + 2*model->ntimes-1);
+
+    checkpoint->seqs.clear();
+    checkpoint->base_probs.clear();
+    if (save_seqs) {
+        const int nseqs = sequences->get_num_seqs();
+        const int seqlen = sequences->length();
+        const char * const *seqs = sequences->get_seqs();
+        for (int i=0; i<nseqs; i++)
+            checkpoint->seqs.push_back(string(seqs[i], seqlen));
+        checkpoint->base_probs = sequences->base_probs;
+    }
+
+    checkpoint->trees.copy(*trees);
+}
+
+
+//=============================================================================
+// writing
+
+static bool write_ints(FILE *out, const int *values, int n)
+{
+    return (int) fwrite(values, sizeof(int), n, out) == n;
+}
+
+static bool write_doubles(FILE *out, const double *values, int n)
+{
+    return (int) fwrite(values, sizeof(double), n, out) == n;
+}
+
+static bool write_string(FILE *out, const string &str)
+{
+    const int len = str.size();
+    return write_ints(out, &len, 1) &&
+        fwrite(str.data(), 1, len, out) == str.size();
+}
+
+
+bool write_checkpoint_trees(FILE *out, const LocalTrees *trees)
+{
+    const int nnodes = trees->nnodes;
+    const int header[] = {trees->start_coord, trees->end_coord, nnodes,
+                          trees->get_num_trees(), (int) trees->seqids.size()};
+    bool ok = write_string(out, trees->chrom) &&
+        write_ints(out, header, sizeof(header) / sizeof(int)) &&
+        write_ints(out, &trees->seqids[0], trees->seqids.size());
+
+    for (LocalTrees::const_iterator it=trees->begin();
+         ok && it != trees->end(); ++it) {
+        const Spr &spr = it->spr;
+        const int record[] = {it->blocklen, spr.recomb_node, spr.recomb_time,
+                              spr.coal_node, spr.coal_time, spr.pop_path,
+                              it->tree->root, it->mapping != NULL};
+        ok = write_ints(out, record, sizeof(record) / sizeof(int)) &&
+            (int) fwrite(it->tree->nodes, sizeof(LocalNode), nnodes, out) ==
+            nnodes;
+        if (ok && it->mapping)
+            ok = write_ints(out, it->mapping, nnodes);
+    }
+    return ok;
+}
+
+
+static bool write_checkpoint(FILE *out, const Checkpoint *checkpoint)
+{
+    const int ntimes = checkpoint->times.size();
+    const int npop = checkpoint->popsizes.size();
+    const int nseqs = checkpoint->seqs.size();
+    const int seqlen = nseqs > 0 ? checkpoint->seqs[0].size() : 0;
+    const bool has_probs = !checkpoint->base_probs.empty();
+    const int header[] = {CHECKPOINT_VERSION, checkpoint->iter, ntimes, npop,
+                          nseqs, seqlen, has_probs};
+
+    bool ok = fwrite(CHECKPOINT_MAGIC, 1, 4, out) == 4 &&
+        write_ints(out, header, sizeof(header) / sizeof(int)) &&
+        write_doubles(out, &checkpoint->heat, 1) &&
+        write_string(out, checkpoint->rand_state) &&
+        write_doubles(out, &checkpoint->times[0], ntimes);
+    for (int pop=0; ok && pop<npop; pop++)
+        ok = write_doubles(out, &checkpoint->popsizes[pop][0], 2*ntimes-1);
+
+    for (int i=0; ok && i<nseqs; i++) {
+        ok = fwrite(checkpoint->seqs[i].data(), 1, seqlen, out) ==
+            (size_t) seqlen;
+        if (ok && has_probs)
+            ok = (int) fwrite(&checkpoint->base_probs[i][0],
+                              sizeof(BaseProbs), seqlen, out) == seqlen;
+    }
+
+    return ok && write_checkpoint_trees(out, &checkpoint->trees) &&
+        fwrite(CHECKPOINT_END, 1, 4, out) == 4;
+}
+
+
+bool write_checkpoint(const char *filename, const Checkpoint *checkpoint)
+{
+    string tmpfile = string(filename) + ".tmp";
+    FILE *out = fopen(tmpfile.c_str(), "wb");
+    if (!out) {
+        printError("cannot write '%s'", tmpfile.c_str());
+        return false;
+    }
+
+    bool ok = write_checkpoint(out, checkpoint) && fflush(out) == 0 &&
+        fsync(fileno(out)) == 0;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmpfile.c_str(), filename) != 0) {
+        printError("cannot write checkpoint '%s'", filename);
+        remove(tmpfile.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+//=============================================================================
+// reading
+
+static bool read_ints(FILE *infile, int *values, int n)
+{
+    return (int) fread(values, sizeof(int), n, infile) == n;
+}
+
+static bool read_doubles(FILE *infile, double *values, int n)
+{
+    return (int) fread(values, sizeof(double), n, infile) == n;
+}
+
+static bool read_string(FILE *infile, string *str)
+{
+    int len;
+    if (!read_ints(infile, &len, 1) || len < 0)
+        return false;
+    str->resize(len);
+    return len == 0 || (int) fread(&(*str)[0], 1, len, infile) == len;
+}
+
+
+bool read_checkpoint_trees(FILE *infile, LocalTrees *trees, int ntimes)
+{
+    static_assert(sizeof(LocalNode) == 5 * sizeof(int),
+                  "LocalNode must be five ints");
+
+    int header[5];
+    trees->clear();
+    if (!read_string(infile, &trees->chrom) || !read_ints(infile, header, 5))
+        return false;
+    const int nnodes = header[2];
+    const int ntrees = header[3];
+    const int nseqids = header[4];
+    if (nnodes <= 0 || ntrees <= 0 || nseqids < 0 || nseqids > nnodes)
+        return false;
+    trees->start_coord = header[0];
+    trees->end_coord = header[1];
+    trees->nnodes = nnodes;
+    trees->seqids.resize(nseqids);
+    if (!read_ints(infile, &trees->seqids[0], nseqids))
+        return false;
+
+    for (int k=0; k<ntrees; k++) {
+        int record[8];
+        if (!read_ints(infile, record, 8) || record[0] < 0)
+            return false;
+
+        LocalTree *tree = new LocalTree(nnodes);
+        int *mapping = record[7] ? new int [nnodes] : NULL;
+        trees->trees.push_back(LocalTreeSpr(
+            tree, Spr(record[1], record[2], record[3], record[4], record[5]),
+            record[0], mapping));
+        tree->root = record[6];
+        if ((int) fread(tree->nodes, sizeof(LocalNode), nnodes, infile) !=
+            nnodes || (mapping && !read_ints(infile, mapping, nnodes)))
+            return false;
+
+        for (int i=0; i<nnodes; i++) {
+            if (tree->nodes[i].age < 0 || tree->nodes[i].age >= ntimes)
+                return false;
+        }
+        if (tree->root < 0 || tree->root >= nnodes || !assert_tree(tree))
+            return false;
+    }
+    return true;
+}
+
+
+bool read_checkpoint(const char *filename, Checkpoint *checkpoint)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+
+    char magic[4];
+    int header[7] = {0};
+    bool ok = fread(magic, 1, 4, infile) == 4 &&
+        memcmp(magic, CHECKPOINT_MAGIC, 4) == 0 &&
+        read_ints(infile, header, 7) && header[0] == CHECKPOINT_VERSION;
+    const int ntimes = header[2];
+    const int npop = header[3];
+    const int nseqs = header[4];
+    const int seqlen = header[5];
+    const bool has_probs = header[6];
+    ok = ok && ntimes > 0 && npop > 0 && nseqs >= 0 && seqlen >= 0;
+
+    if (ok) {
+        checkpoint->iter = header[1];
+        checkpoint->times.resize(ntimes);
+        ok = read_doubles(infile, &checkpoint->heat, 1) &&
+            read_string(infile, &checkpoint->rand_state) &&
+            read_doubles(infile, &checkpoint->times[0], ntimes);
+    }
+    if (ok) {
+        checkpoint->popsizes.assign(npop, vector<double>(2*ntimes-1));
+        for (int pop=0; ok && pop<npop; pop++)
+            ok = read_doubles(infile, &checkpoint->popsizes[pop][0],
+                              2*ntimes-1);
+    }
+    if (ok) {
+        checkpoint->seqs.assign(nseqs, string(seqlen, '\0'));
+        checkpoint->base_probs.assign(has_probs ? nseqs : 0,
+                                      vector<BaseProbs>(seqlen));
+        for (int i=0; ok && i<nseqs; i++) {
+            ok = (int) fread(&checkpoint->seqs[i][0], 1, seqlen, infile) ==
+                seqlen;
+            if (ok && has_probs)
+                ok = (int) fread(&checkpoint->base_probs[i][0],
+                                 sizeof(BaseProbs), seqlen, infile) == seqlen;
+        }
+    }
+
+    // the end marker catches truncated files
+    ok = ok && read_checkpoint_trees(infile, &checkpoint->trees, ntimes) &&
+        fread(magic, 1, 4, infile) == 4 &&
+        memcmp(magic, CHECKPOINT_END, 4) == 0;
+    fclose(infile);
+
+    if (!ok)
+        printError("bad checkpoint file '%s'", filename);
+    return ok;
+}
+
+
+//=============================================================================
+// restoring
+
+bool restore_checkpoint(Checkpoint *checkpoint, ArgModel *model,
+                        Sequences *sequences, LocalTrees *trees)
+{
+    const int ntimes = model->ntimes;
+    const int npop = model->num_pops();
+    const int nseqs = sequences->get_num_seqs();
+    const int seqlen = sequences->length();
+    const LocalTrees &trees2 = checkpoint->trees;
+
+    if ((int) checkpoint->times.size() != ntimes ||
+        !equal(model->times, model->times + ntimes,
+               checkpoint->times.begin())) {
+        printError("checkpoint times do not match model times");
+        return false;
+    }
+    if ((int) checkpoint->popsizes.size() != npop) {
+        printError("checkpoint has %d populations, but model has %d",
+                   (int) checkpoint->popsizes.size(), npop);
+        return false;
+    }
+    if (trees2.get_num_leaves() != nseqs ||
+        trees2.end_coord - trees2.start_coord != seqlen) {
+        printError("checkpoint ARG does not match sequences: ARG(nseqs=%d,"
+                   " length=%d), sequences(nseqs=%d, length=%d)"
+                   " [compressed coordinates]",
+                   trees2.get_num_leaves(),
+                   trees2.end_coord - trees2.start_coord, nseqs, seqlen);
+        return false;
+    }
+    for (unsigned int i=0; i<trees2.seqids.size(); i++) {
+        if (trees2.seqids[i] < 0 || trees2.seqids[i] >= nseqs) {
+            printError("bad sequence id in checkpoint ARG");
+            return false;
+        }
+    }
+    if (!checkpoint->seqs.empty() &&
+        ((int) checkpoint->seqs.size() != nseqs ||
+         (int) checkpoint->seqs[0].size() != seqlen)) {
+        printError("checkpoint sequences do not match input sequences");
+        return false;
+    }
+    if (!set_rand_state(checkpoint->rand_state)) {
+        printError("bad random number generator state in checkpoint");
+        return false;
+    }
+
+    // model
+    vector<double*> popsizes(npop);
+    for (int pop=0; pop<npop; pop++)
+        popsizes[pop] = &checkpoint->popsizes[pop][0];
+    model->set_popsizes(&popsizes[0]);
+    model->mc3.heat = checkpoint->heat;
+
+    // sequences
+    if (!checkpoint->seqs.empty()) {
+        char **seqs = sequences->get_seqs();
+        for (int i=0; i<nseqs; i++)
+            memcpy(seqs[i], checkpoint->seqs[i].data(), seqlen);
+        if (!checkpoint->base_probs.empty())
+            sequences->base_probs = checkpoint->base_probs;
+        if (sequences->get_packed())
+            sequences->pack();
+    }
+
+    // ARG
+    trees->clear();
+    trees->chrom = trees2.chrom;
+    trees->start_coord = trees2.start_coord;
+    trees->end_coord = trees2.end_coord;
+    trees->nnodes = trees2.nnodes;
+    trees->seqids = trees2.seqids;
+    trees->trees.swap(checkpoint->trees.trees);
+    return true;
+}
+
+
+} // namespace argweaver
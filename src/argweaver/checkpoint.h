@@ -0,0 +1,72 @@
+//=============================================================================
+// Binary checkpoints of the sampler state for resuming arg-sample
+
+
+#ifndef ARGWEAVER_CHECKPOINT_H
+#define ARGWEAVER_CHECKPOINT_H
+
+// c/c++ includes
+#include <string>
+#include <vector>
+
+// arghmm includes
+#include "common.h"
+#include "local_tree.h"
+#include "model.h"
+#include "sequences.h"
+
+namespace argweaver {
+
+using namespace std;
+
+
+// Everything the resample loop carries from one iteration to the next.
+// The ARG is stored as it is laid out in memory (compressed coordinates,
+// node numbering and mappings included), so that sampling continues
+// exactly as if it had not been interrupted.
+class Checkpoint
+{
+public:
+    Checkpoint() :
+        iter(0),
+        heat(1.0)
+    {}
+
+    int iter;                      // last finished iteration
+    double heat;                   // MC3 heat of this chain
+    string rand_state;             // see get_rand_state()
+    vector<double> times;          // model times, to check the model
+    vector<vector<double> > popsizes;
+    vector<string> seqs;           // phased sequences, if phase is sampled
+    vector<vector<BaseProbs> > base_probs;
+    LocalTrees trees;
+};
+
+
+// Takes a snapshot of the sampler state after iteration 'iter'.  The
+// sequences are only saved when 'save_seqs' is set, i.e. when sampling
+// changes them.
+void make_checkpoint(Checkpoint *checkpoint, int iter, const ArgModel *model,
+                     const Sequences *sequences, const LocalTrees *trees,
+                     bool save_seqs);
+
+// Writes a checkpoint.  The file is written under a temporary name and
+// then renamed, so an interrupted write leaves the previous one usable.
+bool write_checkpoint(const char *filename, const Checkpoint *checkpoint);
+bool read_checkpoint(const char *filename, Checkpoint *checkpoint);
+
+// Writes and reads local trees as they are laid out in memory, as in
+// checkpoints.  'ntimes' bounds the node ages read.
+bool write_checkpoint_trees(FILE *out, const LocalTrees *trees);
+bool read_checkpoint_trees(FILE *infile, LocalTrees *trees, int ntimes);
+
+// Restores the model, sequences, ARG and random number generator from a
+// checkpoint.  The ARG is moved out of the checkpoint.  Returns false if
+// the checkpoint does not match the model or sequences.
+bool restore_checkpoint(Checkpoint *checkpoint, ArgModel *model,
+                        Sequences *sequences, LocalTrees *trees);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_CHECKPOINT_H
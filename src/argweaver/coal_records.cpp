@@ -1,3 +1,4 @@
+#include <memory>
 #include <utility>
 #include "coal_records.h"
 #include "local_tree.h"
@@ -109,7 +110,10 @@ void CoalRecords::writeAndPopCompleteRecords(FILE *file) {
             for (unsigned int i=0; i < end_pos.size(); i++) {
                 assert(end_pos[i].second >=0 && end_pos[i].second < (int)end_pos.size());
                 idx = indexes[end_pos[i].second];
-                records[idx].write(chrom, file);
+                if (binary_writer)
+                    binary_writer->write(records[idx]);
+                else
+                    records[idx].write(chrom, file);
                 // NOTE: inefficient. could fix...
                 for (int j=0; j < nnodes; j++) {
                     if (branch_created[j] == idx) branch_created[j]=-1;
@@ -197,7 +201,7 @@ void CoalRecords::addRecord(const Spr &spr, int pos, const LocalTree *last_tree,
 
 CoalRecords::CoalRecords(const ArgModel *model, const LocalTree *first_tree,
                          int start_pos, const char *chrom) :
-    model(model), chrom(chrom)
+    model(model), chrom(chrom), binary_writer(NULL)
 {
     nnodes = first_tree->nnodes;
     int nbranch = (nnodes+1)/2;
@@ -235,13 +239,16 @@ CoalRecords::~CoalRecords() {
 }
 
 
-void write_coal_records(FILE *file, const ArgModel *model,
-                        const LocalTrees *local_trees,
-                        const Sequences *sequences, bool header) {
-
+// Writes the records of local_trees as they are completed, as text or
+// with 'writer'
+static void write_coal_records_stream(FILE *file, const ArgModel *model,
+                                      const LocalTrees *local_trees,
+                                      CoalRecordWriter *writer)
+{
     LocalTrees::const_iterator it=local_trees->begin();
     int pos=local_trees->start_coord;
     CoalRecords cr(model, it->tree, pos, local_trees->chrom.c_str());
+    cr.setBinaryWriter(writer);
     int nnodes = it->tree->nnodes;
     int *total_mapping = new int[nnodes];
     int *tmp_mapping = new int[nnodes];
@@ -250,8 +257,6 @@ void write_coal_records(FILE *file, const ArgModel *model,
     pos += it->blocklen;
     const LocalTree *last_tree = it->tree;
     it++;
-    if (header) write_coal_record_header(file, model, local_trees,
-                                         sequences);
     while (it != local_trees->end()) {
         cr.addRecord(it->spr, pos, last_tree, total_mapping, file);
         pos += it->blocklen;
@@ -275,23 +280,480 @@ void write_coal_records(FILE *file, const ArgModel *model,
 }
 
 
+void write_coal_records(FILE *file, const ArgModel *model,
+                        const LocalTrees *local_trees,
+                        const Sequences *sequences, bool header) {
+    if (header) write_coal_record_header(file, model, local_trees,
+                                         *sequences);
+    write_coal_records_stream(file, model, local_trees, NULL);
+}
+
+
+void write_coal_records_binary(FILE *file, const ArgModel *model,
+                               const LocalTrees *local_trees,
+                               const Sequences *sequences) {
+    CoalRecordWriter writer(file);
+    writer.writeHeader(model, local_trees, sequences);
+    write_coal_records_stream(file, model, local_trees, &writer);
+    writer.close();
+}
+
+
+//=============================================================================
+// binary coal records
+
+static const char BINARY_CR_MAGIC[] = "\x89" "CRB";
+static const char BINARY_CR_INDEX_MAGIC[] = "CRBI";
+static const int BINARY_CR_VERSION = 1;
+
+
+static void append_varint(string *buf, int value)
+{
+    // zigzag encoding keeps small negative values short
+    unsigned int u = ((unsigned int) value << 1) ^ (unsigned int) (value >> 31);
+    while (u >= 0x80) {
+        buf->push_back((char) (u | 0x80));
+        u >>= 7;
+    }
+    buf->push_back((char) u);
+}
+
+
+static bool read_varint(FILE *file, int *value)
+{
+    unsigned int u = 0;
+    for (int shift=0; shift < 35; shift += 7) {
+        int c = getc(file);
+        if (c == EOF)
+            return false;
+        u |= (unsigned int) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *value = (int) (u >> 1) ^ -(int) (u & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void append_int(string *buf, int value)
+{
+    buf->append((const char*) &value, sizeof(int));
+}
+
+static void append_string(string *buf, const string &str)
+{
+    append_int(buf, str.size());
+    buf->append(str);
+}
+
+static bool read_int(FILE *file, int *value)
+{
+    return fread(value, sizeof(int), 1, file) == 1;
+}
+
+static bool read_string(FILE *file, string *str)
+{
+    int len;
+    if (!read_int(file, &len) || len < 0)
+        return false;
+    str->resize(len);
+    return len == 0 || fread(&(*str)[0], 1, len, file) == (size_t) len;
+}
+
+
+void CoalRecordWriter::writeBytes(const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, file) != size)
+        error = true;
+    offset += size;
+}
+
+
+void CoalRecordWriter::writeHeader(const ArgModel *model,
+                                   const LocalTrees *trees,
+                                   const Sequences *seqs)
+{
+    const int numleaf = trees->get_num_leaves();
+    const int npaths = (model->pop_tree != NULL ? model->num_pop_paths() : 0);
+    string header(BINARY_CR_MAGIC, 4);
+    append_int(&header, BINARY_CR_VERSION);
+    append_int(&header, model->ntimes);
+    append_int(&header, numleaf);
+    append_int(&header, npaths);
+    header.append((const char*) model->times, model->ntimes * sizeof(double));
+    append_string(&header, trees->chrom);
+    for (int i=0; i < numleaf; i++) {
+        if (seqs && i < (int)seqs->names.size()) {
+            append_string(&header, seqs->names[trees->seqids[i]]);
+        } else {
+            char name[20];
+            snprintf(name, sizeof(name), "%d", trees->seqids[i]);
+            append_string(&header, name);
+        }
+    }
+    for (int i=0; i < npaths; i++)
+        for (int j=0; j < model->ntimes; j++)
+            append_int(&header, model->get_pop(i, j));
+    writeBytes(header.data(), header.size());
+}
+
+
+void CoalRecordWriter::write(const CoalRecord &record)
+{
+    if (nrecords == 0) {
+        CoalRecordBlock info = {record.start, record.end, offset};
+        index.push_back(info);
+        prev_start = 0;
+    }
+    CoalRecordBlock &info = index.back();
+    info.end = max(info.end, record.end);
+
+    append_varint(&block, record.start - prev_start);
+    append_varint(&block, record.end - record.start);
+    append_varint(&block, record.recomb_node + 1);
+    append_varint(&block, record.recomb_time + 1);
+    append_varint(&block, record.coal_node + 1);
+    append_varint(&block, record.coal_time + 1);
+    append_varint(&block, record.pop_path + 1);
+    prev_start = record.start;
+
+    if (++nrecords == BLOCK_RECORDS)
+        flushBlock();
+}
+
+
+void CoalRecordWriter::flushBlock()
+{
+    if (nrecords == 0)
+        return;
+    string count;
+    append_varint(&count, nrecords);
+    writeBytes(count.data(), count.size());
+    writeBytes(block.data(), block.size());
+    block.clear();
+    nrecords = 0;
+}
+
+
+bool CoalRecordWriter::close()
+{
+    flushBlock();
+
+    // end of records, then the index and its offset
+    string end;
+    append_varint(&end, 0);
+    writeBytes(end.data(), end.size());
+
+    const long long index_offset = offset;
+    const int nblocks = index.size();
+    writeBytes(&nblocks, sizeof(int));
+    for (int i=0; i<nblocks; i++) {
+        writeBytes(&index[i].start, sizeof(int));
+        writeBytes(&index[i].end, sizeof(int));
+        writeBytes(&index[i].offset, sizeof(long long));
+    }
+    writeBytes(&index_offset, sizeof(long long));
+    writeBytes(BINARY_CR_INDEX_MAGIC, 4);
+    return !error;
+}
+
+
+bool CoalRecordReader::readHeader()
+{
+    char magic[4];
+    int version, ntimes, nsamples, npaths;
+    if (fread(magic, 1, 4, file) != 4 ||
+        memcmp(magic, BINARY_CR_MAGIC, 4) != 0 ||
+        !read_int(file, &version) || version != BINARY_CR_VERSION ||
+        !read_int(file, &ntimes) || !read_int(file, &nsamples) ||
+        !read_int(file, &npaths) || ntimes < 0 || nsamples < 0 || npaths < 0)
+        return false;
+
+    times.resize(ntimes);
+    if (fread(&times[0], sizeof(double), ntimes, file) != (size_t) ntimes ||
+        !read_string(file, &chrom))
+        return false;
+    samples.resize(nsamples);
+    for (int i=0; i<nsamples; i++)
+        if (!read_string(file, &samples[i]))
+            return false;
+    paths.assign(npaths, vector<int>(ntimes));
+    for (int i=0; i<npaths; i++)
+        for (int j=0; j<ntimes; j++)
+            if (!read_int(file, &paths[i][j]))
+                return false;
+    return true;
+}
+
+
+bool CoalRecordReader::setRegion(int start, int end)
+{
+    long long index_offset;
+    char magic[4];
+    int nblocks;
+    if (fseek(file, -(long) (sizeof(long long) + 4), SEEK_END) != 0 ||
+        fread(&index_offset, sizeof(long long), 1, file) != 1 ||
+        fread(magic, 1, 4, file) != 4 ||
+        memcmp(magic, BINARY_CR_INDEX_MAGIC, 4) != 0 ||
+        fseek(file, index_offset, SEEK_SET) != 0 ||
+        !read_int(file, &nblocks) || nblocks < 0)
+        return false;
+
+    index.resize(nblocks);
+    for (int i=0; i<nblocks; i++) {
+        if (!read_int(file, &index[i].start) ||
+            !read_int(file, &index[i].end) ||
+            fread(&index[i].offset, sizeof(long long), 1, file) != 1)
+            return false;
+    }
+    region_start = start;
+    region_end = end;
+    next_block = 0;
+    block_records = 0;
+    done = false;
+    return true;
+}
+
+
+bool CoalRecordReader::startBlock()
+{
+    if (done)
+        return false;
+
+    if (region_start != -1) {
+        // skip to the next block that overlaps the region; blocks are
+        // sorted by start
+        while (next_block < index.size() &&
+               index[next_block].end <= region_start)
+            next_block++;
+        if (next_block == index.size() ||
+            index[next_block].start >= region_end ||
+            fseek(file, index[next_block].offset, SEEK_SET) != 0) {
+            done = true;
+            return false;
+        }
+        next_block++;
+    }
+
+    if (!read_varint(file, &block_records) || block_records <= 0) {
+        done = true;
+        return false;
+    }
+    prev_start = 0;
+    return true;
+}
+
+
+bool CoalRecordReader::next(CoalRecord *record)
+{
+    while (true) {
+        if (block_records == 0 && !startBlock())
+            return false;
+
+        int fields[7];
+        for (int i=0; i<7; i++) {
+            if (!read_varint(file, &fields[i])) {
+                done = true;
+                return false;
+            }
+        }
+        block_records--;
+        record->start = prev_start + fields[0];
+        record->end = record->start + fields[1];
+        record->recomb_node = fields[2] - 1;
+        record->recomb_time = fields[3] - 1;
+        record->coal_node = fields[4] - 1;
+        record->coal_time = fields[5] - 1;
+        record->pop_path = fields[6] - 1;
+        prev_start = record->start;
+
+        if (region_start == -1 ||
+            (record->start < region_end && record->end > region_start))
+            return true;
+        if (record->start >= region_end) {
+            done = true;
+            return false;
+        }
+    }
+}
+
+
+//=============================================================================
+// read coal records
+
+
+// Builds local trees from coal records in the order they were written.
+// The first nnodes records give the first tree and each later record an
+// SPR.
+class CoalRecordTrees {
+public:
+    CoalRecordTrees(const ArgModel *model, LocalTrees *trees, int nnodes) :
+        model(model), trees(trees), nnodes(nnodes), nfirst(0),
+        ptree(nnodes, -1), ages(nnodes), paths(nnodes),
+        last_tree(NULL), pos(-1), biggest_pos(-1)
+    {
+        spr.set_null();
+    }
+
+    void add(const CoalRecord &record)
+    {
+        if (record.end > biggest_pos)
+            biggest_pos = record.end;
+
+        if (nfirst < nnodes) {
+            // record of the first tree
+            if (nfirst == 0)
+                trees->start_coord = record.start;
+            assert(record.start == trees->start_coord);
+            assert(record.recomb_time == -1);
+            int node = record.recomb_node;
+            assert(node >= 0 && node < nnodes);
+            ptree[node] = record.coal_node;
+            ages[node] = record.coal_time;
+            paths[node] = record.pop_path;
+            if (++nfirst == nnodes) {
+                last_tree = new LocalTree(&ptree[0], nnodes, &ages[0],
+                                          record.pop_path != -1 ?
+                                          &paths[0] : NULL);
+                pos = trees->start_coord;
+            }
+            return;
+        }
+
+        int *mapping = NULL;
+        if (!spr.is_null()) {
+            mapping = new int [nnodes];
+            for (int i=0; i < nnodes; i++)
+                mapping[i] = i;
+            mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
+        }
+        trees->trees.push_back(LocalTreeSpr(last_tree, spr,
+                                            record.start - pos, mapping));
+        pos = record.start;
+        spr.recomb_node = record.recomb_node;
+        spr.recomb_time = record.recomb_time;
+        spr.coal_node = record.coal_node;
+        spr.coal_time = record.coal_time;
+        spr.pop_path = (record.pop_path != -1 ? record.pop_path : 0);
+        LocalTree *tree = new LocalTree(nnodes);
+        tree->copy(*last_tree);
+        apply_spr(tree, spr, model->pop_tree);
+        last_tree = tree;
+    }
+
+    void finish()
+    {
+        if (last_tree) {
+            int *mapping = NULL;
+            if (!spr.is_null()) {
+                mapping = new int[nnodes];
+                for (int i=0; i < nnodes; i++)
+                    mapping[i] = i;
+                mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
+            }
+            trees->trees.push_back(LocalTreeSpr(last_tree, spr,
+                                                biggest_pos - pos, mapping));
+        }
+        trees->end_coord = biggest_pos;
+        //coords are 0-based in structure and file; no need to adjust
+
+        trees->nnodes = nnodes;
+        trees->set_default_seqids();
+        assert_trees(trees, model->pop_tree);
+    }
+
+    bool has_first_tree() const {
+        return nfirst > 0;
+    }
+
+private:
+    const ArgModel *model;
+    LocalTrees *trees;
+    int nnodes;
+    int nfirst;      // records read of the first tree
+    vector<int> ptree;
+    vector<int> ages;
+    vector<int> paths;
+    LocalTree *last_tree;
+    Spr spr;
+    int pos;
+    int biggest_pos;
+};
+
+
+// check that the times and population paths of a file match the model
+static void check_coal_record_model(const ArgModel *model,
+                                    const CoalRecordReader &reader)
+{
+    if ((int) reader.times.size() != model->ntimes) {
+        exitError("number of times in ARG file (%i) does not match ntimes in the model (%i)\n",
+                  (int) reader.times.size(), model->ntimes);
+    }
+    for (int i=0; i < model->ntimes; i++) {
+        if (fabs(reader.times[i] - model->times[i]) > 0.001) {
+            exitError("time %i in ARG file (%f) does not match time in model (%f)\n",
+                      i, reader.times[i], model->times[i]);
+        }
+    }
+    if (model->pop_tree == NULL ? reader.paths.size() > 0 :
+        (int) reader.paths.size() != model->num_pop_paths()) {
+        exitError("Number of population paths in ARG file (%i) does not match number in model (%i)\n",
+                  (int) reader.paths.size(),
+                  model->pop_tree ? model->num_pop_paths() : 0);
+    }
+    for (unsigned int i=0; i < reader.paths.size(); i++)
+        for (int j=0; j < model->ntimes; j++)
+            if (reader.paths[i][j] != model->get_pop(i, j)) {
+                exitError("Population paths in ARG file do not match paths in model\n");
+            }
+}
+
+
+static bool read_coal_records_binary(FILE *file, const ArgModel *model,
+                                     LocalTrees *trees,
+                                     vector<string> &seqnames)
+{
+    CoalRecordReader reader(file);
+    if (!reader.readHeader()) {
+        printError("bad binary coal records header");
+        return false;
+    }
+    check_coal_record_model(model, reader);
+    seqnames = reader.samples;
+    trees->chrom = reader.chrom;
+
+    CoalRecordTrees builder(model, trees, 2 * reader.samples.size() - 1);
+    CoalRecord record(0, 0, 0, 0, 0);
+    while (reader.next(&record))
+        builder.add(record);
+    builder.finish();
+    return true;
+}
+
+
 // read coal records and fill in trees and seqnames
 // check that times match the ones in the model
 bool read_coal_records(FILE *file, const ArgModel *model,
                         LocalTrees *trees, vector<string> &seqnames) {
-    char *line = NULL;
     trees->clear();
-    LocalTree *last_tree = NULL;
-    Spr spr;
-    spr.set_null();
+
+    // detect binary coal records by their first byte
+    int c = getc(file);
+    if (c == EOF)
+        return false;
+    ungetc(c, file);
+    if (c == (unsigned char) BINARY_CR_MAGIC[0])
+        return read_coal_records_binary(file, model, trees, seqnames);
+
+    char *line = NULL;
+    unique_ptr<CoalRecordTrees> builder;
     int numleaf=0;
     int nnodes = 0;
     int lineno = 0;
-    int biggest_pos = -1;
     bool error=false;
     //    bool times_verified=false;
     bool ntimes_verified=false;
-    int pos = -1;
     while ((line = fgetline(file))) {
         lineno++;
         chomp(line);
@@ -371,95 +833,36 @@ bool read_coal_records(FILE *file, const ArgModel *model,
         } else if (strcmp(line, "# ARGweaver coal_record")==0) {
         } else if (strncmp(line, "#", 1)==0) {
             fprintf(stderr, "Unrecognized header line in ARG file '%s'\n", line);
-        } else if (last_tree == NULL) {
-            // first step is to read the first nnodes entries to form the first tree
-            vector<string> fields;
-            split(line, "\t", fields);
-            assert((fields.size()==7 && model->pop_tree==NULL) ||
-                   fields.size()==8);
-            trees->start_coord = atoi(fields[1].c_str());
-            biggest_pos = atoi(fields[2].c_str());
-            int *ptree = new int[nnodes];
-            int *ages = new int[nnodes];
-            int *paths=NULL;
-            for (int i=0; i < nnodes; i++) ptree[i]=-1;
-            if (fields.size() == 8) paths = new int[nnodes];
-            trees->chrom = fields[0].c_str();
-            int node = atoi(fields[3].c_str());
-            assert(node >= 0 && node < nnodes);
-            assert(atoi(fields[4].c_str()) == -1);
-            ptree[node] = atoi(fields[5].c_str());
-            ages[node] = atoi(fields[6].c_str());
-            if (fields.size()==8)
-                paths[node] = atoi(fields[7].c_str());
-            for (int i=1; i < nnodes; i++) {
-                assert(line=fgetline(file));
-                lineno++;
-                split(line, "\t", fields);
-                assert(strcmp(fields[0].c_str(), trees->chrom.c_str())==0);
-                assert(atoi(fields[1].c_str())==trees->start_coord);
-                if (atoi(fields[2].c_str()) > biggest_pos)
-                    biggest_pos = atoi(fields[2].c_str());
-                node = atoi(fields[3].c_str());
-                assert(atoi(fields[4].c_str())==-1);
-                ptree[node] = atoi(fields[5].c_str());
-                ages[node] = atoi(fields[6].c_str());
-                if (fields.size() == 8)
-                    paths[node] = atoi(fields[7].c_str());
-            }
-            last_tree = new LocalTree(ptree, nnodes, ages, paths);
-            spr.set_null();
-            pos = trees->start_coord;
         } else {
+            // record: chr, start, end, recomb node, recomb time, coal node,
+            // coal time, optional pop path
             vector<string> fields;
             split(line, "\t", fields);
             assert((fields.size()==7 && model->pop_tree==NULL) ||
                    fields.size()==8);
-            assert(strcmp(fields[0].c_str(), trees->chrom.c_str()) == 0);
-            int new_pos = atoi(fields[1].c_str());
-            int *mapping = NULL;
-            if (!spr.is_null()) {
-                mapping = new int [nnodes];
-                for (int i=0; i < nnodes; i++)
-                    mapping[i] = i;
-                mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
+            if (!builder) {
+                trees->chrom = fields[0].c_str();
+                builder.reset(new CoalRecordTrees(model, trees, nnodes));
             }
-            trees->trees.push_back(LocalTreeSpr(last_tree, spr, new_pos - pos,
-                                                mapping));
-            pos = new_pos;
-            if (atoi(fields[2].c_str()) > biggest_pos)
-                biggest_pos = atoi(fields[2].c_str());
-            spr.recomb_node = atoi(fields[3].c_str());
-            spr.recomb_time = atoi(fields[4].c_str());
-            spr.coal_node = atoi(fields[5].c_str());
-            spr.coal_time = atoi(fields[6].c_str());
-            if (fields.size() == 8) {
-                spr.pop_path = atoi(fields[7].c_str());
-            } else spr.pop_path = 0;
-            LocalTree *tree = new LocalTree(nnodes);
-            tree->copy(*last_tree);
-            apply_spr(tree, spr, model->pop_tree);
-            last_tree = tree;
+            assert(strcmp(fields[0].c_str(), trees->chrom.c_str()) == 0);
+            CoalRecord record(atoi(fields[1].c_str()),
+                              atoi(fields[3].c_str()),
+                              atoi(fields[4].c_str()),
+                              atoi(fields[5].c_str()),
+                              atoi(fields[6].c_str()),
+                              fields.size() == 8 ?
+                              atoi(fields[7].c_str()) : -1);
+            record.end = atoi(fields[2].c_str());
+            builder->add(record);
         }
         if (error) {
             exitError("Error reading ARG file on line %i\n", lineno);
         }
     }
-    if (last_tree) {
-        int *mapping = NULL;
-        mapping = new int[nnodes];
-        for (int i=0; i < nnodes; i++)
-            mapping[i] = i;
-        mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
-        trees->trees.push_back(LocalTreeSpr(last_tree, spr, biggest_pos - pos,
-                                            mapping));
-    }
-    trees->end_coord = biggest_pos;
-    //coords are 0-based in structure and file; no need to adjust
-
-    trees->nnodes = nnodes;
-    trees->set_default_seqids();
-    assert_trees(trees, model->pop_tree);
+    delete [] line;
+    if (!builder)
+        builder.reset(new CoalRecordTrees(model, trees, nnodes));
+    builder->finish();
     return true;
 }
 
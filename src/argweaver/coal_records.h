@@ -42,6 +42,8 @@ class CoalRecord {
     int pop_path;
 };
 
+class CoalRecordWriter;
+
 class CoalRecords {
  public:
     vector<CoalRecord> records;
@@ -58,6 +60,11 @@ class CoalRecords {
     void lastRecord(int end_pos, FILE *outfile=NULL);
     void writeAndPopCompleteRecords(FILE *file);
 
+    // write completed records in the binary format instead of text
+    void setBinaryWriter(CoalRecordWriter *writer) {
+        binary_writer = writer;
+    }
+
  private:
     queue<int> empty_records;  //indices in records vector which are free
     queue<int> order;       // order of indexes in records vector
@@ -66,6 +73,89 @@ class CoalRecords {
     const ArgModel *model;
     const char *chrom;
     int nnodes;
+    CoalRecordWriter *binary_writer;
+};
+
+
+/* Binary coal records
+
+   A header with the time points, samples and population paths is
+   followed by blocks of up to BLOCK_RECORDS records.  Each block starts
+   with its number of records (0 ends the records), and each record is a
+   series of zigzag varints: start (as a delta from the previous record of
+   the block), end - start, recomb_node + 1, recomb_time + 1, coal_node + 1,
+   coal_time + 1 and pop_path + 1.  An index giving the first start, the
+   largest end and the file offset of each block comes after the records,
+   so a region can be read without decoding the records before it.
+ */
+// entry of the block index
+struct CoalRecordBlock {
+    int start;          // start of the first record
+    int end;            // largest end of the records
+    long long offset;   // file offset of the block
+};
+
+class CoalRecordWriter {
+ public:
+    enum { BLOCK_RECORDS = 1024 };
+
+    CoalRecordWriter(FILE *file) :
+        file(file), offset(0), error(false), nrecords(0), prev_start(0) {}
+
+    void writeHeader(const ArgModel *model, const LocalTrees *trees,
+                     const Sequences *seqs);
+    void write(const CoalRecord &record);
+
+    // writes the last block and the index.  Returns false on write error.
+    bool close();
+
+ private:
+    void writeBytes(const void *data, size_t size);
+    void flushBlock();
+
+    FILE *file;
+    long long offset;   // bytes written so far
+    bool error;
+    string block;       // encoded records of the current block
+    int nrecords;
+    int prev_start;
+    vector<CoalRecordBlock> index;
+};
+
+
+// Reads coal records from a binary coal records file one at a time
+class CoalRecordReader {
+ public:
+    CoalRecordReader(FILE *file) :
+        file(file), block_records(0), prev_start(0), next_block(0),
+        region_start(-1), region_end(-1), done(false) {}
+
+    // reads the header fields below
+    bool readHeader();
+
+    // restricts reading to the records that overlap [start, end) using
+    // the block index.  The file must be seekable.
+    bool setRegion(int start, int end);
+
+    // reads the next record.  Returns false after the last record.
+    bool next(CoalRecord *record);
+
+    string chrom;
+    vector<double> times;
+    vector<string> samples;
+    vector<vector<int> > paths;   // population of each path and time
+
+ private:
+    bool startBlock();
+
+    FILE *file;
+    int block_records;  // records left in the current block
+    int prev_start;
+    vector<CoalRecordBlock> index;
+    unsigned int next_block;
+    int region_start;
+    int region_end;
+    bool done;
 };
 
 
@@ -79,6 +169,11 @@ void write_coal_records(FILE *file, const ArgModel *model,
                         const Sequences *sequences,
                         bool header=true);
 
+void write_coal_records_binary(FILE *file, const ArgModel *model,
+                               const LocalTrees *local_trees,
+                               const Sequences *sequences);
+
+// reads text or binary coal records
 bool read_coal_records(FILE *file, const ArgModel *model,
                        LocalTrees *trees, vector<string> &seqnames);
 
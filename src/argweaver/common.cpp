@@ -1,9 +1,124 @@
 // headers c++
+#include <stdlib.h>
+#include <string.h>
+
 #include "common.h"
 
 
 namespace argweaver {
 
+// state of the generator behind rand() and random().  128 bytes selects
+// the same generator that srand() seeds by default.
+static char rand_state[128];
+static bool rand_state_seeded = false;
+
+// generator of the calling thread, if not the one behind rand()
+static thread_local RandState *thread_rand = NULL;
+
+void seed_rand(unsigned int seed)
+{
+    initstate(seed, rand_state, sizeof(rand_state));
+    rand_state_seeded = true;
+}
+
+string get_rand_state()
+{
+    if (thread_rand)
+        return thread_rand->get_state();
+    assert(rand_state_seeded);
+    // setstate() stores the current position into the buffer it leaves
+    setstate(rand_state);
+    return string(rand_state, sizeof(rand_state));
+}
+
+RandState *set_thread_rand(RandState *state)
+{
+    RandState *prev = thread_rand;
+    thread_rand = state;
+    return prev;
+}
+
+int rand_next()
+{
+    return thread_rand ? thread_rand->next() : rand();
+}
+
+bool set_rand_state(const string &state)
+{
+    if (thread_rand)
+        return thread_rand->set_state(state);
+    if (!rand_state_seeded || state.size() != sizeof(rand_state))
+        return false;
+
+    // switch to a copy first, so that leaving rand_state does not
+    // overwrite the restored position
+    static char tmp[sizeof(rand_state)];
+    memcpy(tmp, state.data(), sizeof(tmp));
+    setstate(tmp);
+    memcpy(rand_state, tmp, sizeof(rand_state));
+    setstate(rand_state);
+    return true;
+}
+
+
+void RandState::seed(uint64_t seed)
+{
+    for (int i=0; i<4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        s[i] = z ^ (z >> 31);
+    }
+    seeded = true;
+}
+
+void RandState::jump()
+{
+    static const uint64_t JUMP[] = {
+        0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+        0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+
+    uint64_t s2[4] = {0, 0, 0, 0};
+    for (int i=0; i<4; i++) {
+        for (int b=0; b<64; b++) {
+            if (JUMP[i] & (uint64_t(1) << b)) {
+                for (int k=0; k<4; k++)
+                    s2[k] ^= s[k];
+            }
+            next64();
+        }
+    }
+    memcpy(s, s2, sizeof(s));
+}
+
+string RandState::get_state()
+{
+    assert(seeded);
+    return string((const char*) s, sizeof(s));
+}
+
+bool RandState::set_state(const string &state)
+{
+    if (!seeded || state.size() != sizeof(s))
+        return false;
+    memcpy(s, state.data(), sizeof(s));
+    return true;
+}
+
+void make_rand_streams(int n, vector<RandState> *streams)
+{
+    // draw 62 bits, since rand() gives 31 at a time
+    const uint64_t high = rand_next();
+    RandState stream;
+    stream.seed((high << 31) | uint64_t(rand_next()));
+    streams->clear();
+    for (int i=0; i<n; i++) {
+        streams->push_back(stream);
+        stream.jump();
+    }
+}
+
+
 /* make a draw from a gamma distribution with parameters 'a' and
  * 'b'. Be sure to call srandom externally.  If a == 1, exp_draw is
  * called.  If a > 1, Best's (1978) rejection algorithm is used, and
@@ -6,7 +6,10 @@
 #include <math.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <algorithm>
+#include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <vector>
@@ -101,30 +104,97 @@ void permute(T* array, int *perm, int size)
 //=============================================================================
 // Math
 
+// Seeds rand() like srand(), but keeps the generator state in a buffer
+// that get_rand_state() and set_rand_state() can save and restore
+void seed_rand(unsigned int seed);
+string get_rand_state();
+bool set_rand_state(const string &state);
+
+// A xoshiro256** generator with a state of its own.  Its draws lie in
+// [0, RAND_MAX] like those of rand().  Unlike rand() it takes no lock, and
+// jump() splits it into streams that never overlap, for tasks that sample
+// at the same time.
+class RandState
+{
+public:
+    RandState() : seeded(false) {}
+
+    // the seed is expanded into a state with splitmix64
+    void seed(uint64_t seed);
+
+    uint64_t next64() {
+        const uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    int next() {
+        return int(next64() >> 33);
+    }
+
+    // Advances the generator by 2^128 draws
+    void jump();
+
+    string get_state();
+    bool set_state(const string &state);
+
+protected:
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t s[4];
+    bool seeded;
+};
+
+// Sets up the generators of 'n' tasks run at the same time.  They are
+// streams of one seed drawn from the generator of the calling thread,
+// 2^128 draws apart, so that the draws of each task only depend on
+// --randseed and the order of the draws made before, and not on how the
+// tasks are scheduled.
+void make_rand_streams(int n, vector<RandState> *streams);
+
+// Makes the random draws of the calling thread (frand(), irand() and the
+// functions below, get_rand_state() and set_rand_state()) use 'state'
+// instead of the generator behind rand(), so that threads sample
+// reproducibly regardless of scheduling.  NULL restores rand(), which
+// stays the generator of the main sampling loop.
+// Returns the previous generator of the thread.
+RandState *set_thread_rand(RandState *state);
+
+// Returns the next number of the generator of the calling thread
+int rand_next();
+
 inline double frand()
-{ return rand() / double(RAND_MAX); }
+{ return rand_next() / double(RAND_MAX); }
 
 inline double frand(double max)
-{ return rand() / double(RAND_MAX) * max; }
+{ return rand_next() / double(RAND_MAX) * max; }
 
 inline double frand(double min, double max)
-{ return min + (rand() / double(RAND_MAX) * (max-min)); }
+{ return min + (rand_next() / double(RAND_MAX) * (max-min)); }
 
 inline int irand(int max)
 {
-    const int i = int(rand() / float(RAND_MAX) * max);
+    const int i = int(rand_next() / float(RAND_MAX) * max);
     return (i == max) ? max - 1 : i;
 }
 
 inline int irand(int min, int max)
 {
-    const int i = min + int(rand() / float(RAND_MAX) * (max - min));
+    const int i = min + int(rand_next() / float(RAND_MAX) * (max - min));
     return (i == max) ? max - 1 : i;
 }
 
 inline double rand_norm(const double mean=0, const double sd=1) {
-  static bool gen_new=true;
-  static double y=0;
+  static thread_local bool gen_new=true;
+  static thread_local double y=0;
   double x;
   double pi = 3.1415926535897;
   if (gen_new) {
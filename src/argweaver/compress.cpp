@@ -1,19 +1,303 @@
 
+#include <assert.h>
 #include <unistd.h>
 #include <string>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <zlib.h>
 
 #include "compress.h"
 #include "parsing.h"
+#include "thread_pool.h"
 
 namespace argweaver {
 
 using namespace std;
 
+
+//=============================================================================
+// in-process gzip streams
+//
+// Files using the default zip/unzip commands are read with zlib and
+// written as BGZF (blocked gzip, readable by gunzip and indexable by
+// tabix) without starting a gzip process.  The streams are exposed as
+// FILE pointers through fopencookie().
+
+#ifdef __GLIBC__
+#define ARGWEAVER_NATIVE_GZIP
+#endif
+
+
+static int compress_threads = 1;
+
+void set_compress_threads(int nthreads)
+{
+    compress_threads = max(nthreads, 1);
+}
+
+int get_compress_threads()
+{
+    return compress_threads;
+}
+
+
+#ifdef ARGWEAVER_NATIVE_GZIP
+
+// FILE streams opened through fopencookie(), which close_compress()
+// must fclose() rather than pclose()
+static set<FILE*> native_streams;
+static mutex native_streams_lock;
+
+static FILE *add_native_stream(FILE *stream)
+{
+    if (stream) {
+        lock_guard<mutex> guard(native_streams_lock);
+        native_streams.insert(stream);
+    }
+    return stream;
+}
+
+static bool remove_native_stream(FILE *stream)
+{
+    lock_guard<mutex> guard(native_streams_lock);
+    return native_streams.erase(stream) > 0;
+}
+
+
+static ssize_t gz_cookie_read(void *cookie, char *buf, size_t size)
+{
+    return gzread((gzFile) cookie, buf, size);
+}
+
+static int gz_cookie_close(void *cookie)
+{
+    return gzclose((gzFile) cookie) == Z_OK ? 0 : EOF;
+}
+
+
+// Writes a BGZF file.  Input is cut into blocks of at most BLOCK_SIZE
+// bytes, each compressed into its own gzip member.  With several
+// compression threads, up to one block per thread is compressed at once.
+class BgzfWriter
+{
+public:
+    enum {
+        BLOCK_SIZE = 0xff00,         // uncompressed bytes per block
+        MAX_BLOCK_SIZE = 0x10000,    // compressed bytes per block
+        HEADER_SIZE = 18,
+        FOOTER_SIZE = 8
+    };
+
+    BgzfWriter(FILE *out) :
+        out(out),
+        error(false)
+    {
+        blocks.push_back(string());
+        blocks.back().reserve(BLOCK_SIZE);
+    }
+
+    ssize_t write(const char *buf, size_t size)
+    {
+        size_t written = 0;
+        while (written < size) {
+            string &block = blocks.back();
+            size_t n = min(size - written, BLOCK_SIZE - block.size());
+            block.append(buf + written, n);
+            written += n;
+            if (block.size() == BLOCK_SIZE) {
+                if ((int) blocks.size() >= compress_threads)
+                    flush();
+                blocks.push_back(string());
+                blocks.back().reserve(BLOCK_SIZE);
+            }
+        }
+        return error ? -1 : written;
+    }
+
+    int close()
+    {
+        flush();
+
+        // empty block marking the end of file
+        static const unsigned char eof_block[28] = {
+            0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43,
+            0x02, 0, 0x1b, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+        if (fwrite(eof_block, 1, sizeof(eof_block), out) != sizeof(eof_block))
+            error = true;
+        if (fclose(out) != 0)
+            error = true;
+        return error ? EOF : 0;
+    }
+
+protected:
+    // compresses all pending non-empty blocks and writes them in order
+    void flush()
+    {
+        while (!blocks.empty() && blocks.back().empty())
+            blocks.pop_back();
+        const int nblocks = blocks.size();
+        if (nblocks == 0)
+            return;
+
+        output.resize(nblocks);
+        ThreadPool *pool = get_thread_pool(compress_threads);
+        if (pool && nblocks > 1) {
+            pool->run(nblocks, [this](int i) {
+                    compress_block(blocks[i], &output[i]); });
+        } else {
+            for (int i=0; i<nblocks; i++)
+                compress_block(blocks[i], &output[i]);
+        }
+
+        for (int i=0; i<nblocks; i++) {
+            if (fwrite(output[i].data(), 1, output[i].size(), out) !=
+                output[i].size())
+                error = true;
+        }
+        blocks.clear();
+    }
+
+    static void compress_block(const string &input, string *output)
+    {
+        output->resize(MAX_BLOCK_SIZE);
+        unsigned char *data = (unsigned char*) &(*output)[0];
+        const int max_deflate = MAX_BLOCK_SIZE - HEADER_SIZE - FOOTER_SIZE;
+
+        // incompressible input falls back on stored deflate blocks, which
+        // always fit
+        int deflate_size = deflate_block(input, data + HEADER_SIZE,
+                                         max_deflate, Z_DEFAULT_COMPRESSION);
+        if (deflate_size < 0)
+            deflate_size = deflate_block(input, data + HEADER_SIZE,
+                                         max_deflate, Z_NO_COMPRESSION);
+        assert(deflate_size >= 0);
+        const int block_size = HEADER_SIZE + deflate_size + FOOTER_SIZE;
+
+        static const unsigned char header[HEADER_SIZE - 2] = {
+            0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43,
+            0x02, 0};
+        memcpy(data, header, sizeof(header));
+        put_uint16(data + 16, block_size - 1);
+
+        unsigned char *footer = data + HEADER_SIZE + deflate_size;
+        put_uint32(footer, crc32(crc32(0L, Z_NULL, 0),
+                                 (const Bytef*) input.data(), input.size()));
+        put_uint32(footer + 4, input.size());
+        output->resize(block_size);
+    }
+
+    // returns the size of the raw deflate stream or -1 if it does not fit
+    static int deflate_block(const string &input, unsigned char *dest,
+                             int max_size, int level)
+    {
+        z_stream zs;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        zs.next_in = (Bytef*) input.data();
+        zs.avail_in = input.size();
+        zs.next_out = dest;
+        zs.avail_out = max_size;
+        int status = deflate(&zs, Z_FINISH);
+        int size = max_size - zs.avail_out;
+        deflateEnd(&zs);
+        return status == Z_STREAM_END ? size : -1;
+    }
+
+    static void put_uint16(unsigned char *buf, unsigned int value)
+    {
+        buf[0] = value & 0xff;
+        buf[1] = (value >> 8) & 0xff;
+    }
+
+    static void put_uint32(unsigned char *buf, unsigned long value)
+    {
+        for (int i=0; i<4; i++)
+            buf[i] = (value >> (8*i)) & 0xff;
+    }
+
+    FILE *out;
+    bool error;
+    vector<string> blocks;   // pending uncompressed blocks
+    vector<string> output;   // compressed blocks
+};
+
+
+static ssize_t bgzf_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    return ((BgzfWriter*) cookie)->write(buf, size);
+}
+
+static int bgzf_cookie_close(void *cookie)
+{
+    BgzfWriter *writer = (BgzfWriter*) cookie;
+    int status = writer->close();
+    delete writer;
+    return status;
+}
+
+
+static FILE *read_gzip(const char *filename)
+{
+    gzFile gz = gzopen(filename, "rb");
+    if (!gz)
+        return NULL;
+    gzbuffer(gz, 1 << 17);
+
+    cookie_io_functions_t funcs = {gz_cookie_read, NULL, NULL,
+                                   gz_cookie_close};
+    FILE *stream = fopencookie(gz, "r", funcs);
+    if (!stream)
+        gzclose(gz);
+    return add_native_stream(stream);
+}
+
+
+static FILE *write_bgzf(const char *filename)
+{
+    FILE *out = fopen(filename, "wb");
+    if (!out)
+        return NULL;
+
+    BgzfWriter *writer = new BgzfWriter(out);
+    cookie_io_functions_t funcs = {NULL, bgzf_cookie_write, NULL,
+                                   bgzf_cookie_close};
+    FILE *stream = fopencookie(writer, "w", funcs);
+    if (!stream) {
+        delete writer;
+        fclose(out);
+    }
+    return add_native_stream(stream);
+}
+
+#endif // ARGWEAVER_NATIVE_GZIP
+
+
+// Returns true if 'command' is one of the default gzip commands
+static bool is_default_command(const char *command)
+{
+#ifdef ARGWEAVER_NATIVE_GZIP
+    return !command || strcmp(command, ZIP_COMMAND) == 0 ||
+        strcmp(command, UNZIP_COMMAND) == 0;
+#else
+    return false;
+#endif
+}
+
+
 FILE *read_compress(const char *filename, const char *command)
 {
     bool exists = !access(filename, F_OK);
     if (!exists)
         return NULL;
+#ifdef ARGWEAVER_NATIVE_GZIP
+    if (is_default_command(command))
+        return read_gzip(filename);
+#endif
     const char *command2 = (command ? command : UNZIP_COMMAND);
     string cmd = string(command2) + " < " + quote_arg(filename);
     return popen(cmd.c_str(), "r");
@@ -22,6 +306,10 @@ FILE *read_compress(const char *filename, const char *command)
 
 FILE *write_compress(const char *filename, const char *command)
 {
+#ifdef ARGWEAVER_NATIVE_GZIP
+    if (is_default_command(command))
+        return write_bgzf(filename);
+#endif
     // TODO: add check to prevent write error
     const char *command2 = (command ? command : ZIP_COMMAND);
     string cmd = string(command2) + " > " + quote_arg(filename);
@@ -32,6 +320,13 @@ FILE *write_compress(const char *filename, const char *command)
 FILE *open_compress(const char *filename, const char *mode,
                     const char *command)
 {
+    if (is_default_command(command)) {
+        if (mode[0] == 'w')
+            return write_compress(filename, NULL);
+        else if (mode[0] == 'r')
+            return read_compress(filename, NULL);
+    }
+
     string cmd;
     if (mode[0] == 'w')
         cmd = string(command) + " > " + quote_arg(filename);
@@ -44,10 +339,12 @@ FILE *open_compress(const char *filename, const char *mode,
 
 int close_compress(FILE *stream)
 {
+#ifdef ARGWEAVER_NATIVE_GZIP
+    if (remove_native_stream(stream))
+        return fclose(stream);
+#endif
     return pclose(stream);
 }
 
 
 } // namespace argweaver
-
-
@@ -21,6 +21,11 @@ FILE *open_compress(const char *filename, const char *mode,
 
 int close_compress(FILE *stream);
 
+// Number of threads used to compress blocks of files written with the
+// default zip command
+void set_compress_threads(int nthreads);
+int get_compress_threads();
+
 
 class CompressStream
 {
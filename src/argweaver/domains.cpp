@@ -0,0 +1,143 @@
+#ifdef ARGWEAVER_MPI
+#include "mpi.h"
+#endif
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "checkpoint.h"
+#include "domains.h"
+#include "logging.h"
+
+namespace argweaver {
+
+
+void get_domain_bounds(int start, int end, int nblocks, bool shift,
+                       vector<int> *bounds)
+{
+    const double len = double(end - start) / nblocks;
+    bounds->clear();
+    bounds->push_back(start);
+    for (int i=1; i<nblocks; i++)
+        bounds->push_back(start + int((i + (shift ? .5 : 0.0)) * len));
+    bounds->push_back(end);
+}
+
+
+void split_local_trees(LocalTrees *trees, const vector<int> &bounds,
+                       vector<LocalTrees*> *blocks)
+{
+    assert(bounds.front() == trees->start_coord);
+    assert(bounds.back() == trees->end_coord);
+
+    // cut from the end, so that each cut leaves the earlier blocks in trees
+    const int first = blocks->size();
+    for (int i=bounds.size()-2; i>0; i--)
+        blocks->push_back(partition_local_trees(trees, bounds[i]));
+    reverse(blocks->begin() + first, blocks->end());
+}
+
+
+void join_local_trees(LocalTrees *trees, vector<LocalTrees*> *blocks,
+                      const PopulationTree *pop_tree)
+{
+    for (unsigned int i=0; i<blocks->size(); i++) {
+        append_local_trees(trees, (*blocks)[i], true, pop_tree);
+        delete (*blocks)[i];
+    }
+    blocks->clear();
+}
+
+
+#ifdef ARGWEAVER_MPI
+
+static const int TREES_SIZE_TAG = 1001;
+static const int TREES_DATA_TAG = 1002;
+
+
+void send_local_trees(MPI::Intracomm *comm, const LocalTrees *trees,
+                      int dest)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    if (!out || !write_checkpoint_trees(out, trees)) {
+        printError("cannot write local trees");
+        abort();
+    }
+    fclose(out);
+
+    const long len = size;
+    comm->Send(&len, 1, MPI::LONG, dest, TREES_SIZE_TAG);
+    comm->Send(buf, len, MPI::CHAR, dest, TREES_DATA_TAG);
+    free(buf);
+}
+
+
+bool recv_local_trees(MPI::Intracomm *comm, LocalTrees *trees, int source,
+                      int ntimes)
+{
+    long len;
+    comm->Recv(&len, 1, MPI::LONG, source, TREES_SIZE_TAG);
+    char *buf = (char*) malloc(len);
+    comm->Recv(buf, len, MPI::CHAR, source, TREES_DATA_TAG);
+
+    FILE *infile = fmemopen(buf, len, "rb");
+    bool ok = infile && read_checkpoint_trees(infile, trees, ntimes);
+    if (infile)
+        fclose(infile);
+    free(buf);
+    if (!ok)
+        printError("cannot read local trees from rank %d", source);
+    return ok;
+}
+
+
+bool scatter_local_trees(MPI::Intracomm *comm, LocalTrees *trees,
+                         const vector<int> &bounds, int ntimes)
+{
+    const int rank = comm->Get_rank();
+    const int nranks = comm->Get_size();
+    if (rank > 0)
+        return recv_local_trees(comm, trees, 0, ntimes);
+
+    assert((int) bounds.size() == nranks + 1);
+    vector<LocalTrees*> blocks;
+    split_local_trees(trees, bounds, &blocks);
+    for (int i=1; i<nranks; i++) {
+        send_local_trees(comm, blocks[i-1], i);
+        delete blocks[i-1];
+    }
+    return true;
+}
+
+
+bool gather_local_trees(MPI::Intracomm *comm, LocalTrees *trees, int ntimes,
+                        const PopulationTree *pop_tree)
+{
+    const int rank = comm->Get_rank();
+    const int nranks = comm->Get_size();
+    if (rank > 0) {
+        send_local_trees(comm, trees, 0);
+        trees->clear();
+        return true;
+    }
+
+    bool ok = true;
+    for (int i=1; i<nranks; i++) {
+        LocalTrees block;
+        if (!recv_local_trees(comm, &block, i, ntimes)) {
+            ok = false;
+            continue;
+        }
+        if (ok)
+            append_local_trees(trees, &block, true, pop_tree);
+    }
+    return ok;
+}
+
+#endif // ARGWEAVER_MPI
+
+
+} // namespace argweaver
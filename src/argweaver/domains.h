@@ -0,0 +1,71 @@
+//=============================================================================
+// Blocks of the genome of one ARG, sampled by the ranks of an MPI run
+
+
+#ifndef ARGWEAVER_DOMAINS_H
+#define ARGWEAVER_DOMAINS_H
+
+// c/c++ includes
+#include <vector>
+
+// arghmm includes
+#include "local_tree.h"
+#include "pop_model.h"
+
+#ifdef ARGWEAVER_MPI
+namespace MPI {
+    class Intracomm;
+}
+#endif
+
+namespace argweaver {
+
+using namespace std;
+
+
+// Sets 'bounds' to the nblocks+1 bounds of blocks of equal length that
+// cover [start, end).  If 'shift' is set, the inner bounds move forward by
+// half a block, so that they fall inside the blocks of the unshifted
+// bounds.
+void get_domain_bounds(int start, int end, int nblocks, bool shift,
+                       vector<int> *bounds);
+
+// Cuts local trees at the inner bounds.  'trees' keeps the first block and
+// the other blocks are added to 'blocks', which the caller deletes.
+void split_local_trees(LocalTrees *trees, const vector<int> &bounds,
+                       vector<LocalTrees*> *blocks);
+
+// Joins blocks made by split_local_trees() back onto 'trees', whose last
+// tree must be congruent to the first tree of each next block.  The blocks
+// are deleted.
+void join_local_trees(LocalTrees *trees, vector<LocalTrees*> *blocks,
+                      const PopulationTree *pop_tree=NULL);
+
+
+#ifdef ARGWEAVER_MPI
+
+// Sends local trees to rank 'dest' of 'comm'
+void send_local_trees(MPI::Intracomm *comm, const LocalTrees *trees,
+                      int dest);
+
+// Receives local trees sent by send_local_trees().  Returns false if they
+// cannot be read.
+bool recv_local_trees(MPI::Intracomm *comm, LocalTrees *trees, int source,
+                      int ntimes);
+
+// Splits the local trees of rank 0 at 'bounds', which has one block for
+// each rank of 'comm', and sends each rank its block.  Rank 0 keeps the
+// first block in 'trees' and the other ranks receive theirs into 'trees'.
+bool scatter_local_trees(MPI::Intracomm *comm, LocalTrees *trees,
+                         const vector<int> &bounds, int ntimes);
+
+// Collects the blocks of all ranks back into the local trees of rank 0
+bool gather_local_trees(MPI::Intracomm *comm, LocalTrees *trees, int ntimes,
+                        const PopulationTree *pop_tree=NULL);
+
+#endif // ARGWEAVER_MPI
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_DOMAINS_H
@@ -1,8 +1,11 @@
 
 #include "common.h"
 #include "emit.h"
+#include "profile.h"
 #include "seq.h"
+#include "simd.h"
 #include "thread.h"
+#include "thread_pool.h"
 
 namespace argweaver {
 
@@ -109,14 +112,20 @@ int count_alleles(const char *const *seqs,
 
 
 // Juke-Cantor
-// probability of mutation over time 't' with mutation rate 'mu'
-static inline double prob_branch(double t, double mu, bool mut)
+// probabilities of mutation (muts) and no mutation (nomuts) over times
+// 'dists' with mutation rate 'mu', stored at the indexes 'branches'
+// NOTE: 'dists' is overwritten
+static void prob_branches(const int *branches, double *dists, int n,
+                          double mu, double *muts, double *nomuts)
 {
     const double f = 4. / 3.;
-    if (!mut)
-        return .25 * (1.0 + 3. * exp(-f*mu*t));
-    else
-        return .25 * (1.0 - exp(-f*mu*t));
+    for (int i=0; i<n; i++)
+        dists[i] = -f*mu*dists[i];
+    simd_exp(dists, n);
+    for (int i=0; i<n; i++) {
+        muts[branches[i]] = .25 * (1.0 - dists[i]);
+        nomuts[branches[i]] = .25 * (1.0 + 3. * dists[i]);
+    }
 }
 
 
@@ -128,6 +137,9 @@ void prob_tree_mutation(const LocalTree *tree, const ArgModel *model,
     const int nnodes = tree->nnodes;
     const LocalNode *nodes = tree->nodes;
 
+    int branches[nnodes];
+    double dists[nnodes];
+    int nbranches = 0;
     for (int i=0; i<nnodes; i++) {
         if (i == tree->root)
             continue;
@@ -137,18 +149,16 @@ void prob_tree_mutation(const LocalTree *tree, const ArgModel *model,
 
         double t = ( parent_age == nodes[i].age ? model->get_mintime(parent_age)
                      : times[parent_age] - times[nodes[i].age] );
-        muts[i] = prob_branch(t, model->mu, true);
-        nomuts[i] = prob_branch(t, model->mu, false);
+        branches[nbranches] = i;
+        dists[nbranches++] = t;
     }
+    prob_branches(branches, dists, nbranches, model->mu, muts, nomuts);
 }
 
 
 //============================================================================
 // emissions
 
-// table of partial likelihood values
-typedef double lk_row[4];
-
 class LikelihoodTable
 {
 public:
@@ -174,6 +184,58 @@ public:
 };
 
 
+// calculate inner partial likelihood for one leaf and site
+static inline void likelihood_site_leaf(
+    const int leaf, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const int pos, double *row)
+{
+    const char c = seqs[leaf][pos];
+    if (c == 'N') {
+        row[0] = 1.0;
+        row[1] = 1.0;
+        row[2] = 1.0;
+        row[3] = 1.0;
+    } else if (base_probs.size() > 0) {
+        for (int k=0; k < 4; k++)
+            row[k] = base_probs[leaf][pos].prob[k];
+    } else {
+        row[0] = 0.0;
+        row[1] = 0.0;
+        row[2] = 0.0;
+        row[3] = 0.0;
+        row[dna2int[(int) c]] = 1.0;
+    }
+}
+
+
+// calculate inner partial likelihood of an internal node from its children
+static inline void likelihood_site_internal(
+    const LocalNode *nodes, const int j,
+    const double *muts, const double *nomuts, lk_row* inner)
+{
+    int c1 = nodes[j].child[0];
+    int c2 = nodes[j].child[1];
+
+    for (int a=0; a<4; a++) {
+        double p1 = 0.0;
+        double p2 = 0.0;
+
+        for (int b=0; b<4; b++) {
+            if (a == b) {
+                p1 += inner[c1][b] * nomuts[c1];
+                p2 += inner[c2][b] * nomuts[c2];
+            } else {
+                p1 += inner[c1][b] * muts[c1];
+                p2 += inner[c2][b] * muts[c2];
+            }
+        }
+
+        inner[j][a] = p1 * p2;
+    }
+}
+
+
 // calculate inner partial likelihood for one node and site
 inline void likelihood_site_node_inner(
     const LocalTree *tree, const int node,
@@ -182,49 +244,10 @@ inline void likelihood_site_node_inner(
     const int pos,
     const double *muts, const double *nomuts, lk_row* inner)
 {
-    const LocalNode* nodes = tree->nodes;
-    const int j = node;
-
-    if (nodes[j].is_leaf()) {
-        // leaf case
-        const char c = seqs[j][pos];
-        if (c == 'N') {
-            inner[j][0] = 1.0;
-            inner[j][1] = 1.0;
-            inner[j][2] = 1.0;
-            inner[j][3] = 1.0;
-        } else if (base_probs.size() > 0) {
-            for (int k=0; k < 4; k++)
-                inner[j][k] = base_probs[j][pos].prob[k];
-        } else {
-            inner[j][0] = 0.0;
-            inner[j][1] = 0.0;
-            inner[j][2] = 0.0;
-            inner[j][3] = 0.0;
-            inner[j][dna2int[(int) c]] = 1.0;
-        }
-    } else {
-        // internal node case
-        int c1 = nodes[j].child[0];
-        int c2 = nodes[j].child[1];
-
-        for (int a=0; a<4; a++) {
-            double p1 = 0.0;
-            double p2 = 0.0;
-
-            for (int b=0; b<4; b++) {
-                if (a == b) {
-                    p1 += inner[c1][b] * nomuts[c1];
-                    p2 += inner[c2][b] * nomuts[c2];
-                } else {
-                    p1 += inner[c1][b] * muts[c1];
-                    p2 += inner[c2][b] * muts[c2];
-                }
-            }
-
-            inner[j][a] = p1 * p2;
-        }
-    }
+    if (tree->nodes[node].is_leaf())
+        likelihood_site_leaf(node, seqs, base_probs, pos, inner[node]);
+    else
+        likelihood_site_internal(tree->nodes, node, muts, nomuts, inner);
 }
 
 
@@ -301,6 +324,44 @@ double likelihood_site_inner(
 }
 
 
+// Updates an inner partial likelihood table that holds the table of
+// another site of the same tree to site 'pos'.  Only the leaves whose
+// rows change and their ancestors are recomputed, which gives the same
+// table as likelihood_site_inner().  Changed nodes are marked in 'dirty'.
+static double likelihood_site_inner_update(
+    const LocalTree *tree, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const int pos, const int *order, const int norder,
+    const double *muts, const double *nomuts, lk_row* inner, bool *dirty)
+{
+    const LocalNode *nodes = tree->nodes;
+
+    // iterate postorder through nodes
+    for (int i=0; i<norder; i++) {
+        const int j = order[i];
+        if (nodes[j].is_leaf()) {
+            lk_row row;
+            likelihood_site_leaf(j, seqs, base_probs, pos, row);
+            dirty[j] = (memcmp(row, inner[j], sizeof(row)) != 0);
+            if (dirty[j])
+                memcpy(inner[j], row, sizeof(row));
+        } else {
+            dirty[j] = dirty[nodes[j].child[0]] || dirty[nodes[j].child[1]];
+            if (dirty[j])
+                likelihood_site_internal(nodes, j, muts, nomuts, inner);
+        }
+    }
+
+    // sum over root node
+    double p = 0.0;
+    int root = tree->root;
+    for (int a=0; a<4; a++)
+        p += inner[root][a]  * .25;
+
+    return p;
+}
+
+
 // calculate eniter outer partial likelihood table
 void likelihood_site_outer(
     const LocalTree *tree,
@@ -328,37 +389,42 @@ void likelihood_site_outer(
 }
 
 
-void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
-                      const char *const *seqs,
-                      const vector<vector<BaseProbs> > &base_probs,
-                      const int seqlen,
-                      const bool *variant, bool internal,
-                      lk_row **inner, lk_row **outer)
+// Updates an outer partial likelihood table after the inner rows marked in
+// 'dirty' have changed.  A node's outer row changes if its parent's outer
+// row or its sibling's inner row does.
+static void likelihood_site_outer_update(
+    const LocalTree *tree,
+    const double *muts, const double *nomuts, bool internal,
+    lk_row *inner, lk_row *outer, const bool *dirty)
 {
-    // get postorder
-    int norder = tree->nnodes;
-    int order[tree->nnodes];
-    tree->get_postorder(order);
-
+    int queue[tree->nnodes];
+    bool outer_dirty[tree->nnodes];
+    int top = 0;
 
-    // get mutation probabilities and treelen
-    double muts[tree->nnodes];
-    double nomuts[tree->nnodes];
-    prob_tree_mutation(tree, model, muts, nomuts);
+    // process in preorder
+    int maintree_root = internal ? tree->nodes[tree->root].child[1] :
+        tree->root;
+    outer_dirty[maintree_root] = false;
+    queue[top++] = maintree_root;
+    while (top > 0) {
+        int node = queue[--top];
+        if (node != maintree_root) {
+            outer_dirty[node] = (outer_dirty[tree->nodes[node].parent] ||
+                                 dirty[tree->get_sibling(node)]);
+            if (outer_dirty[node])
+                likelihood_site_node_outer(tree, maintree_root, node,
+                                           muts, nomuts, outer, inner);
+        }
 
-    // calculate emissions for tree at each site
-    for (int i=0; i<seqlen; i++) {
-        if (variant[i]) {
-            likelihood_site_inner(tree, seqs, base_probs, i, order, norder,
-                                  muts, nomuts, inner[i]);
-            likelihood_site_outer(tree, muts, nomuts, internal,
-                                  inner[i], outer[i]);
+        // recurse
+        if (!tree->nodes[node].is_leaf()) {
+            queue[top++] = tree->nodes[node].child[0];
+            queue[top++] = tree->nodes[node].child[1];
         }
     }
 }
 
 
-
 void likelihood_sites(const LocalTree *tree, const ArgModel *model,
                       const char *const *seqs,
                       const vector<vector<BaseProbs> > &base_probs,
@@ -399,21 +465,25 @@ void likelihood_sites(const LocalTree *tree, const ArgModel *model,
     // get mutation probabilities and treelen
     double muts[tree->nnodes];
     double nomuts[tree->nnodes];
+    int branches[tree->nnodes];
+    double dists[tree->nnodes];
+    int nbranches = 0;
     double treelen = 0.0;
     for (int i=0; i<tree->nnodes; i++) {
         if (i != tree->root) {
             double t = ( nodes[nodes[i].parent].age == nodes[i].age ?
                          model->get_mintime(nodes[i].age) :
                          times[nodes[nodes[i].parent].age] - times[nodes[i].age]);
-            muts[i] = prob_branch(t, model->mu, true);
-            nomuts[i] = prob_branch(t, model->mu, false);
+            branches[nbranches] = i;
+            dists[nbranches++] = t;
             treelen += t;
         }
     }
+    prob_branches(branches, dists, nbranches, model->mu, muts, nomuts);
 
 
     // calculate invariant_lk
-    double invariant_lk = .25 * exp(- model->mu * max(treelen, mintime));
+    double invariant_lk = .25 * math_exp(- model->mu * max(treelen, mintime));
 
     // calculate emissions for tree at each site
     for (int i=0; i<seqlen; i++) {
@@ -436,7 +506,8 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const char *const *seqs,
                        const vector<vector<BaseProbs> > &base_probs,
                        const int nseqs,
-                       const int start, const int end)
+                       const int start, const int end,
+                       const int *order)
 {
     const double *times = model->times;
     const int nnodes = tree->nnodes;
@@ -445,25 +516,35 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
     lk_row table[nnodes];
 
     // get postorder
-    int order[tree->nnodes];
-    tree->get_postorder(order);
+    int order2[tree->nnodes];
+    if (!order) {
+        tree->get_postorder(order2);
+        order = order2;
+    }
 
     // get mutation probabilities
     double muts[tree->nnodes];
     double nomuts[tree->nnodes];
+    int branches[tree->nnodes];
+    double dists[tree->nnodes];
+    int nbranches = 0;
     for (int i=0; i<tree->nnodes; i++) {
         if (i != tree->root) {
             double t = ( nodes[nodes[i].parent].age == nodes[i].age ?
                   model->get_mintime(nodes[i].age) :
                   times[nodes[nodes[i].parent].age] - times[nodes[i].age] );
-            muts[i] = prob_branch(t, model->mu, true);
-            nomuts[i] = prob_branch(t, model->mu, false);
+            branches[nbranches] = i;
+            dists[nbranches++] = t;
         }
     }
+    prob_branches(branches, dists, nbranches, model->mu, muts, nomuts);
 
 
-    // calculate emissions for tree at each site
+    // calculate emissions for tree at each site; after the first site
+    // computed, the table is updated from the last one
     double lnl = 0.0;
+    bool table_set = false;
+    bool dirty[nnodes];
     for (int i=start; i<end; i++) {
         double lk;
         bool invariant = is_invariant_site(seqs, nseqs, i, base_probs);
@@ -474,8 +555,14 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
             // use precommuted invariant site likelihood
             lk = invariant_lk;
         else {
-            lk = likelihood_site_inner(tree, seqs, base_probs, i, order,
-                                       tree->nnodes, muts, nomuts, table);
+            if (table_set)
+                lk = likelihood_site_inner_update(
+                    tree, seqs, base_probs, i, order, nnodes,
+                    muts, nomuts, table, dirty);
+            else
+                lk = likelihood_site_inner(tree, seqs, base_probs, i, order,
+                                           nnodes, muts, nomuts, table);
+            table_set = true;
 
             // save invariant likelihood
             if (invariant)
@@ -657,9 +744,9 @@ void get_infinite_sites_states(const States &states, const LocalTree *tree,
 
 
 
-double calc_emit(lk_row *in, lk_row *out, lk_row *in2,
+double calc_emit(const lk_row *in, const lk_row *out, const lk_row *in2,
 		 int i, int node1, int node2, int maintree_root,
-		 double *nomut, double *mut) {
+		 const double *nomut, const double *mut) {
     double emit=0.0;
     for (int a=0; a<4; a++) {
 	double p1 = 0.0, p2 = 0.0, p3 = 0.0;
@@ -685,79 +772,94 @@ double calc_emit(lk_row *in, lk_row *out, lk_row *in2,
 }
 
 
-
-// calculate emissions for external branch resampling
-void calc_emissions(const States &states, const LocalTree *tree,
-                    const char *const *seqs,
-                    const vector<vector<BaseProbs> > &base_probs,
-                    int nseqs, int seqlen,
-                    const ArgModel *model, bool internal, double **emit,
-		    PhaseProbs *phase_pr)
+// set inner partial likelihood of the new leaf
+static inline void likelihood_new_leaf(
+    const char c, const vector<vector<BaseProbs> > &base_probs,
+    int newleaf, int i, lk_row *inner)
 {
-    const int nstates = states.size();
-    const int newleaf = tree->get_num_leaves();
-    const int maintree_root = internal ? tree->nodes[tree->root].child[1] :
-        tree->root;
-    const int subtree_root = internal ? tree->nodes[tree->root].child[0] :
-        tree->root;
+    if (c == 'N') {
+        inner[0][0] = 1.0;
+        inner[0][1] = 1.0;
+        inner[0][2] = 1.0;
+        inner[0][3] = 1.0;
+    } else if (base_probs.size() > 0) {
+        for (int j=0; j < 4; j++)
+            inner[0][j] = base_probs[newleaf][i].prob[j];
+    } else {
+        inner[0][0] = 0.0;
+        inner[0][1] = 0.0;
+        inner[0][2] = 0.0;
+        inner[0][3] = 0.0;
+        inner[0][dna2int[(int) c]] = 1.0;
+    }
+}
 
 
+SiteEmissions::SiteEmissions(
+    const States &states, const LocalTree *tree,
+    const char *const *seqs, const vector<vector<BaseProbs> > &base_probs,
+    int nseqs, int seqlen, const ArgModel *model, bool internal,
+    PhaseProbs *phase_pr) :
+    seqlen(seqlen),
+    tree(tree),
+    states(states),
+    nstates(states.size()),
+    nseqs(nseqs),
+    internal(internal),
+    newleaf(tree->get_num_leaves()),
+    maintree_root(internal ? tree->nodes[tree->root].child[1] : tree->root),
+    subtree_root(internal ? tree->nodes[tree->root].child[0] : tree->root),
+    infsites_penalty(model->infsites_penalty),
+    phase_pr(NULL),
+    infsites_phase_pr(model->unphased ? phase_pr : NULL),
+    seqs(seqs, seqs + nseqs),
+    base_probs(base_probs),
+    variant(NULL),
+    masked(NULL),
+    het(NULL),
+    norder(tree->nnodes),
+    order(NULL),
+    muts(NULL),
+    nomuts(NULL),
+    inner(NULL),
+    outer(NULL),
+    inner2(NULL),
+    outer2(NULL),
+    tables_set(false),
+    dirty(NULL),
+    pattern_hits(0)
+{
     // special case: ignore fully specified local tree
-    if (internal && nstates == 0) {
-        for (int i=0; i<seqlen; i++)
-            emit[i][0] = 1.0;
+    if (internal && nstates == 0)
         return;
-    }
-
 
     // find invariant sites
-    bool *variant = new bool [seqlen];
-    bool *masked = new bool [seqlen];
+    variant = new bool [seqlen];
+    masked = new bool [seqlen];
     find_variant_sites(seqs, nseqs, seqlen, variant, base_probs);
     find_masked_sites(seqs, nseqs, seqlen, masked, variant);
 
+    // get postorder
+    order = new int [tree->nnodes];
+    tree->get_postorder(order);
 
-    // compute inner and outer likelihood tables
-    LikelihoodTable inner(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree(seqlen, 1);
-    LikelihoodTable outer(seqlen, tree->nnodes);
-    calc_inner_outer(tree, model, seqs, base_probs, seqlen, variant, internal,
-                     inner.data, outer.data);
+    // get mutation probabilities
+    muts = new double [tree->nnodes];
+    nomuts = new double [tree->nnodes];
+    prob_tree_mutation(tree, model, muts, nomuts);
 
-    if (!internal) {
-        // compute inner table for new leaf
-        for (int i=0; i<seqlen; i++) {
-            const char c = seqs[newleaf][i];
-            if (c == 'N') {
-                inner_subtree.data[i][0][0] = 1.0;
-                inner_subtree.data[i][0][1] = 1.0;
-                inner_subtree.data[i][0][2] = 1.0;
-                inner_subtree.data[i][0][3] = 1.0;
-            } else if (base_probs.size() > 0) {
-                for (int j=0; j < 4; j++)
-                    inner_subtree.data[i][0][j] = base_probs[newleaf][i].prob[j];
-            } else {
-                inner_subtree.data[i][0][0] = 0.0;
-                inner_subtree.data[i][0][1] = 0.0;
-                inner_subtree.data[i][0][2] = 0.0;
-                inner_subtree.data[i][0][3] = 0.0;
-                inner_subtree.data[i][0][dna2int[(int) c]] = 1.0;
-            }
-        }
-    }
+    inner = new lk_row [tree->nnodes];
+    outer = new lk_row [tree->nnodes];
+    dirty = new bool [tree->nnodes];
 
-    LikelihoodTable inner2(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree2(seqlen, 1);
-    LikelihoodTable outer2(seqlen, tree->nnodes);
-    bool *het = NULL;
+    // find heterozygous sites of the pair of haplotypes being phased
     if (model->unphased && phase_pr != NULL &&
 	phase_pr->treemap1 >= 0 && phase_pr->treemap1 < nseqs &&
 	phase_pr->treemap2 >= 0 && phase_pr->treemap2 < nseqs) {
-	const char *subseqs[nseqs];
-	for (int i=0; i < nseqs; i++)
-	    subseqs[i] = seqs[i];
-	subseqs[phase_pr->treemap1] = seqs[phase_pr->treemap2];
-	subseqs[phase_pr->treemap2] = seqs[phase_pr->treemap1];
+        this->phase_pr = phase_pr;
+        seqs2 = this->seqs;
+	seqs2[phase_pr->treemap1] = seqs[phase_pr->treemap2];
+	seqs2[phase_pr->treemap2] = seqs[phase_pr->treemap1];
 	het = new bool[seqlen];
 	for (int i=0; i < seqlen; i++) {
 	    het[i] = (seqs[phase_pr->treemap1][i] != seqs[phase_pr->treemap2][i]);
@@ -765,7 +867,6 @@ void calc_emissions(const States &states, const LocalTree *tree,
                 het[i] = ! (base_probs[phase_pr->treemap1][i].is_equal(
                             base_probs[phase_pr->treemap2][i]));
         }
-        vector<vector<BaseProbs> > base_probs2;
         if (base_probs.size() > 0) {
             for (int i=0; i < nseqs; i++) {
                 if (i == phase_pr->treemap1)
@@ -775,31 +876,8 @@ void calc_emissions(const States &states, const LocalTree *tree,
                 else base_probs2.push_back(base_probs[i]);
             }
         }
-
-	calc_inner_outer(tree, model, subseqs, base_probs2, seqlen, het,
-			 internal, inner2.data, outer2.data);
-
-	if (!internal) {
-	    // compute inner table for new leaf
-	    for (int i=0; i<seqlen; i++) {
-		const char c = subseqs[newleaf][i];
-		if (c == 'N') {
-		    inner_subtree2.data[i][0][0] = 1.0;
-		    inner_subtree2.data[i][0][1] = 1.0;
-		    inner_subtree2.data[i][0][2] = 1.0;
-		    inner_subtree2.data[i][0][3] = 1.0;
-                } else if (base_probs2.size() > 0) {
-                    for (int j=0; j < 4; j++)
-                        inner_subtree2.data[i][0][j] = base_probs2[newleaf][i].prob[j];
-		} else {
-		    inner_subtree2.data[i][0][0] = 0.0;
-		    inner_subtree2.data[i][0][1] = 0.0;
-		    inner_subtree2.data[i][0][2] = 0.0;
-		    inner_subtree2.data[i][0][3] = 0.0;
-		    inner_subtree2.data[i][0][dna2int[(int) c]] = 1.0;
-		}
-	    }
-	}
+        inner2 = new lk_row [tree->nnodes];
+        outer2 = new lk_row [tree->nnodes];
     }
 
     // calc tree lengths
@@ -837,14 +915,18 @@ void calc_emissions(const States &states, const LocalTree *tree,
     }
 
 
-    // populate emission table
+    // compute per state constants
+    state_emits.resize(nstates);
     for (int j=0; j<nstates; j++) {
         State state = states[j];
+        StateEmit &s = state_emits[j];
 
         // get nodes
         int node1 = internal ? subtree_root : 0;
         int node2 = state.node;
         int parent = tree->nodes[node2].parent;
+        s.node1 = node1;
+        s.node2 = node2;
 
         // get times
         double time1 = internal ? model->times[tree->nodes[node1].age] : 0.0;
@@ -854,19 +936,15 @@ void calc_emissions(const States &states, const LocalTree *tree,
         double coal_time = model->times[state.time];
 
         // get distances
-	double dist[3], mut[3], nomut[3];
+	double dist[3];
         double curr_mintime = model->get_mintime(state.time);
         dist[0] = max(coal_time - time1, curr_mintime);
         dist[1] = max(coal_time - time2, curr_mintime);
         dist[2] = max(parent_time - coal_time, curr_mintime);
 
         // get mutation probabilities
-        mut[0] = prob_branch(dist[0], model->mu, true);
-        mut[1] = prob_branch(dist[1], model->mu, true);
-        mut[2] = prob_branch(dist[2], model->mu, true);
-        nomut[0] = prob_branch(dist[0], model->mu, false);
-        nomut[1] = prob_branch(dist[1], model->mu, false);
-        nomut[2] = prob_branch(dist[2], model->mu, false);
+        const int branches[3] = {0, 1, 2};
+        prob_branches(branches, dist, 3, model->mu, s.mut, s.nomut);
 
         // get tree length
         double treelen;
@@ -880,58 +958,308 @@ void calc_emissions(const States &states, const LocalTree *tree,
                 + max(coal_time - time1, curr_mintime);
 
         // calculate invariant_lk
-        double invariant_lk = .25 * exp(- model->mu * treelen);
+        s.invariant_lk = .25 * math_exp(- model->mu * treelen);
+    }
+}
 
-        // fill in row of emission table
-        for (int i=0; i<seqlen; i++) {
-            if (masked[i]) {
-                // masked site
-                emit[i][j] = 1.0;
-            } else if (!variant[i]) {
-                // invariant site
-                emit[i][j] = invariant_lk;
-            } else {
-		emit[i][j] = calc_emit(inner.data[i], outer.data[i],
-				       internal ? inner.data[i] : inner_subtree.data[i],
-				       i, node1, node2, maintree_root,
-				       nomut, mut);
-                assert(!isnan(emit[i][j]));
-		if (het != NULL && het[i]) {
-		    double emit2 = calc_emit(inner2.data[i], outer2.data[i],
-					    internal ? inner2.data[i] : inner_subtree2.data[i],
-					    i, node1, node2, maintree_root,
-					    nomut, mut);
-		    phase_pr->add(i, j, emit[i][j]/(emit[i][j] + emit2), nstates);
-		    emit[i][j] += emit2;
-		    emit[i][j] *= 0.5;
-                    assert(!isnan(emit[i][j]));
-		}
-            }
+
+SiteEmissions::~SiteEmissions()
+{
+    delete [] variant;
+    delete [] masked;
+    delete [] het;
+    delete [] order;
+    delete [] muts;
+    delete [] nomuts;
+    delete [] inner;
+    delete [] outer;
+    delete [] inner2;
+    delete [] outer2;
+    delete [] dirty;
+}
+
+
+long SiteEmissions::get_memory() const
+{
+    const int nnodes = tree->nnodes;
+    long size = sizeof(SiteEmissions);
+    size += seqlen * (het ? 3 : 2) * sizeof(bool);
+    size += nnodes * (sizeof(int) + 2 * sizeof(double) + sizeof(bool));
+    size += nnodes * (inner2 ? 4 : 2) * sizeof(lk_row);
+    size += state_emits.size() * sizeof(StateEmit);
+    size += pattern_rows.size() * sizeof(double);
+    size += patterns.size() * (nseqs + 64);
+    for (unsigned int i=0; i<base_probs.size(); i++)
+        size += base_probs[i].size() * sizeof(BaseProbs);
+    for (unsigned int i=0; i<base_probs2.size(); i++)
+        size += base_probs2[i].size() * sizeof(BaseProbs);
+    return size;
+}
+
+
+// compute inner and outer partial likelihood tables for site i.  Once
+// the tables hold an earlier site, only the rows that change are updated.
+void SiteEmissions::likelihood_site(
+    int i, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs, const bool *sites,
+    lk_row *inner, lk_row *outer, lk_row *inner_subtree, bool *tables_set)
+{
+    if (sites[i]) {
+        if (*tables_set) {
+            likelihood_site_inner_update(tree, seqs, base_probs, i, order,
+                                         norder, muts, nomuts, inner, dirty);
+            likelihood_site_outer_update(tree, muts, nomuts, internal,
+                                         inner, outer, dirty);
+        } else {
+            likelihood_site_inner(tree, seqs, base_probs, i, order, norder,
+                                  muts, nomuts, inner);
+            likelihood_site_outer(tree, muts, nomuts, internal, inner, outer);
+            *tables_set = true;
         }
     }
 
-    // optionally enforce infinite sites model
-    if (model->infsites_penalty < 1.0) {
+    // compute inner table for new leaf
+    if (!internal)
+        likelihood_new_leaf(seqs[newleaf][i], base_probs, newleaf, i,
+                            inner_subtree);
+}
 
-        bool **valid_states = new_matrix<bool>(seqlen, nstates);
-        get_infinite_sites_states(states, tree, seqs, nseqs, seqlen,
-                                  variant, internal, valid_states,
-                                  model->unphased ? phase_pr : NULL);
-        for (int i=0; i<seqlen; i++) {
-            if (variant[i]) {
-                for (int j=0; j<nstates; j++)
-                    if (!valid_states[i][j])
-                        emit[i][j] *= model->infsites_penalty;
-            }
+
+void SiteEmissions::get(int i, double *emit)
+{
+    // special case: ignore fully specified local tree
+    if (internal && nstates == 0) {
+        emit[0] = 1.0;
+        return;
+    }
+
+    if (masked[i]) {
+        // masked site
+        for (int j=0; j<nstates; j++)
+            emit[j] = 1.0;
+        return;
+    } else if (!variant[i]) {
+        // invariant site
+        for (int j=0; j<nstates; j++)
+            emit[j] = state_emits[j].invariant_lk;
+        return;
+    }
+
+    // Variant sites with the same column of alleles have the same
+    // emissions under this tree, so each distinct pattern is only computed
+    // once.  Sites with base probabilities or that are being phased are
+    // always computed directly.
+    if (base_probs.size() > 0 || (het != NULL && het[i])) {
+        calc_variant_site(i, emit);
+        return;
+    }
+
+    string key(nseqs, '\0');
+    for (int k=0; k<nseqs; k++)
+        key[k] = seqs[k][i];
+
+    map<string, int>::iterator it = patterns.find(key);
+    if (it != patterns.end()) {
+        const double *row = &pattern_rows[it->second];
+        for (int j=0; j<nstates; j++)
+            emit[j] = row[j];
+        pattern_hits++;
+        return;
+    }
+
+    calc_variant_site(i, emit);
+    if (patterns.size() < MAX_PATTERNS) {
+        patterns[key] = pattern_rows.size();
+        pattern_rows.insert(pattern_rows.end(), emit, emit + nstates);
+    }
+}
+
+
+// Compute the tables of site i with the phase of the pair flipped from the
+// tables of the site as given.  Only the rows of the two haplotypes, their
+// ancestors and the outer rows that depend on them differ, so the other
+// rows are shared.
+void SiteEmissions::likelihood_flipped_site(int i)
+{
+    const LocalNode *nodes = tree->nodes;
+    const int nnodes = tree->nnodes;
+    memcpy(inner2, inner, nnodes * sizeof(lk_row));
+    memcpy(outer2, outer, nnodes * sizeof(lk_row));
+
+    // leaves of the tree are numbered as the sequences, and the new leaf
+    // of external branch resampling (number newleaf) is not in the tree
+    for (int j=0; j<nnodes; j++)
+        dirty[j] = false;
+    const int haps[2] = {phase_pr->treemap1, phase_pr->treemap2};
+    for (int k=0; k<2; k++) {
+        if (haps[k] < newleaf) {
+            likelihood_site_leaf(haps[k], &seqs2[0], base_probs2, i,
+                                 inner2[haps[k]]);
+            dirty[haps[k]] = true;
         }
-        delete_matrix<bool>(valid_states, seqlen);
     }
 
+    // recompute ancestors of the haplotypes in postorder
+    for (int k=0; k<norder; k++) {
+        const int j = order[k];
+        if (!nodes[j].is_leaf()) {
+            dirty[j] = dirty[nodes[j].child[0]] || dirty[nodes[j].child[1]];
+            if (dirty[j])
+                likelihood_site_internal(nodes, j, muts, nomuts, inner2);
+        }
+    }
+    likelihood_site_outer_update(tree, muts, nomuts, internal,
+                                 inner2, outer2, dirty);
 
-    // clean up
-    delete [] variant;
-    delete [] masked;
-    if (het != NULL) delete [] het;
+    if (!internal)
+        likelihood_new_leaf(seqs2[newleaf][i], base_probs2, newleaf, i,
+                            inner_subtree2);
+}
+
+
+// Emissions of one state under both phasings of a site, computed in one
+// pass over the two sets of tables.  Gives the same values as calling
+// calc_emit() for each phasing.
+static inline void calc_emit_pair(
+    const lk_row *in, const lk_row *out, const lk_row *in2,
+    const lk_row *flip_in, const lk_row *flip_out, const lk_row *flip_in2,
+    int node1, int node2, int maintree_root,
+    const double *nomut, const double *mut, double *emit, double *flip_emit)
+{
+    double e = 0.0, f = 0.0;
+    for (int a=0; a<4; a++) {
+        double p1 = 0.0, p2 = 0.0, p3 = 0.0;
+        double q1 = 0.0, q2 = 0.0, q3 = 0.0;
+        for (int b=0; b<4; b++) {
+            const double *m = (a == b) ? nomut : mut;
+            p1 += in2[node1][b] * m[0];
+            p2 += in[node2][b] * m[1];
+            p3 += out[node2][b] * m[2];
+            q1 += flip_in2[node1][b] * m[0];
+            q2 += flip_in[node2][b] * m[1];
+            q3 += flip_out[node2][b] * m[2];
+        }
+
+        if (node2 != maintree_root) {
+            e += p1 * p2 * p3 * .25;
+            f += q1 * q2 * q3 * .25;
+        } else {
+            e += p1 * p2 * .25;
+            f += q1 * q2 * .25;
+        }
+    }
+    *emit = e;
+    *flip_emit = f;
+}
+
+
+// Compute emissions of all states at heterozygous site i, which are the
+// average over the two phasings of the pair, and record the probability
+// of the current phasing of each state in phase_pr.  The tables of the
+// site must be up to date.
+void SiteEmissions::calc_phased_site(int i, double *emit)
+{
+    likelihood_flipped_site(i);
+
+    double phase_row[nstates];
+    const lk_row *in2 = internal ? inner : inner_subtree;
+    const lk_row *flip_in2 = internal ? inner2 : inner_subtree2;
+    for (int j=0; j<nstates; j++) {
+        const StateEmit &s = state_emits[j];
+        double emit2;
+        calc_emit_pair(inner, outer, in2, inner2, outer2, flip_in2,
+                       s.node1, s.node2, maintree_root, s.nomut, s.mut,
+                       &emit[j], &emit2);
+        assert(!isnan(emit[j]));
+        phase_row[j] = emit[j] / (emit[j] + emit2);
+        emit[j] = (emit[j] + emit2) * 0.5;
+        assert(!isnan(emit[j]));
+    }
+    phase_pr->add_site(i, phase_row, nstates);
+}
+
+
+// compute emissions of all states at variant site i
+void SiteEmissions::calc_variant_site(int i, double *emit)
+{
+    likelihood_site(i, &seqs[0], base_probs, variant,
+                    inner, outer, inner_subtree, &tables_set);
+    if (het != NULL && het[i]) {
+        calc_phased_site(i, emit);
+    } else {
+        for (int j=0; j<nstates; j++) {
+            const StateEmit &s = state_emits[j];
+            emit[j] = calc_emit(inner, outer,
+                                internal ? inner : inner_subtree,
+                                i, s.node1, s.node2, maintree_root,
+                                s.nomut, s.mut);
+            assert(!isnan(emit[j]));
+        }
+    }
+
+    // optionally enforce infinite sites model
+    if (infsites_penalty < 1.0) {
+        const char *site_seqs[nseqs];
+        for (int k=0; k<nseqs; k++)
+            site_seqs[k] = seqs[k] + i;
+        bool valid_row[max(nstates, 1)];
+        bool *valid_states = valid_row;
+        get_infinite_sites_states(states, tree, site_seqs, nseqs, 1,
+                                  &variant[i], internal, &valid_states,
+                                  infsites_phase_pr);
+        for (int j=0; j<nstates; j++)
+            if (!valid_row[j])
+                emit[j] *= infsites_penalty;
+    }
+}
+
+
+// calculate emissions for external branch resampling
+void calc_emissions(const States &states, const LocalTree *tree,
+                    const char *const *seqs,
+                    const vector<vector<BaseProbs> > &base_probs,
+                    int nseqs, int seqlen,
+                    const ArgModel *model, bool internal, double **emit,
+		    PhaseProbs *phase_pr)
+{
+    PROFILE_SCOPE(PROFILE_EMISSIONS);
+    if (!use_threaded_emissions(model, seqlen, phase_pr)) {
+        SiteEmissions site_emit(states, tree, seqs, base_probs, nseqs, seqlen,
+                                model, internal, phase_pr);
+        for (int i=0; i<seqlen; i++)
+            site_emit.get(i, emit[i]);
+        return;
+    }
+
+    // split sites into one chunk per thread, each with its own SiteEmissions
+    ThreadPool *pool = get_thread_pool(model->nthreads);
+    const int nchunks = min(pool->get_num_threads(),
+                            seqlen / MIN_THREAD_SITES);
+    pool->run(nchunks, [&](int chunk) {
+        const int start = long(seqlen) * chunk / nchunks;
+        const int end = long(seqlen) * (chunk + 1) / nchunks;
+
+        const char *chunk_seqs[nseqs];
+        vector<vector<BaseProbs> > chunk_base_probs;
+        for (int k=0; k<nseqs; k++)
+            chunk_seqs[k] = seqs[k] + start;
+        for (unsigned int k=0; k<base_probs.size(); k++)
+            chunk_base_probs.push_back(vector<BaseProbs>(
+                base_probs[k].begin() + start, base_probs[k].begin() + end));
+
+        SiteEmissions site_emit(states, tree, chunk_seqs, chunk_base_probs,
+                                nseqs, end - start, model, internal, NULL);
+        for (int i=start; i<end; i++)
+            site_emit.get(i - start, emit[i]);
+    });
+}
+
+
+bool use_threaded_emissions(const ArgModel *model, int seqlen,
+                            const PhaseProbs *phase_pr)
+{
+    return model->nthreads > 1 && seqlen >= 2 * MIN_THREAD_SITES &&
+        !(model->unphased && phase_pr != NULL);
 }
 
 // calculate emissions for external branch resampling
@@ -965,9 +1293,43 @@ void calc_emissions_internal(const States &states, const LocalTree *tree,
 // counting non-compatiable sites
 
 
-void parsimony_ancestral_set(const LocalTree *tree, const char * const *seqs,
-                             int pos, int *postorder, int npostorder,
-                             char *ancestral)
+// Base sets of leaves read from rows of characters: 0 if unknown and
+// 1 << base otherwise
+struct CharLeafSets
+{
+    CharLeafSets(const char *const *seqs) : seqs(seqs) {}
+
+    inline int operator()(int node, int pos) const
+    {
+        const char c = seqs[node][pos];
+        return c == 'N' ? 0 : 1 << dna2int[(int) c];
+    }
+
+    const char *const *seqs;
+};
+
+
+// Base sets of leaves read from a packed alignment, where leaf i is
+// sequence seqids[i]
+struct PackedLeafSets
+{
+    PackedLeafSets(const PackedSeqs *seqs, const int *seqids) :
+        seqs(seqs), seqids(seqids) {}
+
+    inline int operator()(int node, int pos) const
+    {
+        return seqs->get_base_set(seqids[node], pos);
+    }
+
+    const PackedSeqs *seqs;
+    const int *seqids;
+};
+
+
+template <class LeafSets>
+static void parsimony_ancestral_set_leaves(
+    const LocalTree *tree, const LeafSets &leaf_sets,
+    int pos, int *postorder, int npostorder, char *ancestral)
 {
     const int nnodes = tree->nnodes;
     const LocalNode *nodes = tree->nodes;
@@ -987,11 +1349,7 @@ void parsimony_ancestral_set(const LocalTree *tree, const char * const *seqs,
     for (int i=0; i<npostorder; i++) {
         int node = postorder[i];
         if (nodes[node].is_leaf()) {
-            char c = seqs[node][pos];
-            if (c == 'N')
-                sets[node] = 0;
-            else
-                sets[node] = 1 << dna2int[(int) c];
+            sets[node] = leaf_sets(node, pos);
         } else {
             char lset = sets[nodes[node].child[0]];
             char rset = sets[nodes[node].child[1]];
@@ -1023,6 +1381,24 @@ void parsimony_ancestral_set(const LocalTree *tree, const char * const *seqs,
 }
 
 
+void parsimony_ancestral_set(const LocalTree *tree, const char * const *seqs,
+                             int pos, int *postorder, int npostorder,
+                             char *ancestral)
+{
+    parsimony_ancestral_set_leaves(tree, CharLeafSets(seqs), pos,
+                                   postorder, npostorder, ancestral);
+}
+
+
+void parsimony_ancestral_set(const LocalTree *tree, const PackedSeqs *seqs,
+                             const int *seqids, int pos, int *postorder,
+                             int npostorder, char *ancestral)
+{
+    parsimony_ancestral_set_leaves(tree, PackedLeafSets(seqs, seqids), pos,
+                                   postorder, npostorder, ancestral);
+}
+
+
 void parsimony_ancestral_seq(const LocalTree *tree, const char * const *seqs,
                              int nseqs, int pos, char *ancestral,
                              int *postorder)
@@ -1103,8 +1479,10 @@ void parsimony_ancestral_seq(const LocalTree *tree, const char * const *seqs,
 }
 
 
-int parsimony_cost_seq(const LocalTree *tree, const char * const *seqs,
-                        int nseqs, int pos, int *postorder)
+template <class LeafSets>
+static int parsimony_cost_leaves(const LocalTree *tree,
+                                 const LeafSets &leaf_sets,
+                                 int pos, int *postorder)
 {
     const int nnodes = tree->nnodes;
     const LocalNode *nodes = tree->nodes;
@@ -1120,15 +1498,9 @@ int parsimony_cost_seq(const LocalTree *tree, const char * const *seqs,
     for (int i=0; i<nnodes; i++) {
         int node = postorder[i];
         if (tree->nodes[node].is_leaf()) {
-            char c = seqs[node][pos];
-            if (c == 'N') {
-                for (int a=0; a<4; a++)
-                    costs[node][a] = 0;
-            } else {
-                for (int a=0; a<4; a++)
-                    costs[node][a] = maxcost;
-                costs[node][dna2int[(int)c]] = 0;
-            }
+            const int set = leaf_sets(node, pos);
+            for (int a=0; a<4; a++)
+                costs[node][a] = (set == 0 || (set & (1 << a))) ? 0 : maxcost;
         } else {
             int *left_costs = costs[nodes[node].child[0]];
             int *right_costs = costs[nodes[node].child[1]];
@@ -1153,6 +1525,13 @@ int parsimony_cost_seq(const LocalTree *tree, const char * const *seqs,
 }
 
 
+int parsimony_cost_seq(const LocalTree *tree, const char * const *seqs,
+                        int nseqs, int pos, int *postorder)
+{
+    return parsimony_cost_leaves(tree, CharLeafSets(seqs), pos, postorder);
+}
+
+
 int count_noncompat(const LocalTree *tree, const char * const *seqs,
                     int nseqs, int block_start, int block_len, int *postorder)
 {
@@ -1214,9 +1593,133 @@ int count_noncompat(const LocalTrees *trees, const char * const *seqs,
 }
 
 
+// Leaf sets of the clades of a local tree as bitsets over the sequences of
+// a packed alignment.  A biallelic site without unknown bases is
+// compatible with the tree iff the carriers of one of its bases, or of the
+// other base, form a clade.
+class CladeSets
+{
+public:
+    CladeSets(const LocalTree *tree, const int *postorder,
+              const int *seqids, int nwords) :
+        nwords(nwords),
+        sets(tree->nnodes * nwords, 0),
+        by_size(tree->get_num_leaves() + 1)
+    {
+        const LocalNode *nodes = tree->nodes;
+        for (int i=0; i<tree->nnodes; i++) {
+            const int node = postorder[i];
+            uint64_t *set = &sets[node * nwords];
+            if (nodes[node].is_leaf()) {
+                set[seqids[node] >> 6] |= uint64_t(1) << (seqids[node] & 63);
+            } else {
+                const uint64_t *left = &sets[nodes[node].child[0] * nwords];
+                const uint64_t *right = &sets[nodes[node].child[1] * nwords];
+                for (int w=0; w<nwords; w++)
+                    set[w] = left[w] | right[w];
+            }
+            by_size[PackedSeqs::count_bits(set, nwords)].push_back(node);
+        }
+    }
+
+    // Returns true if the sequences in 'bits' form a clade
+    bool is_clade(const uint64_t *bits) const
+    {
+        const int size = PackedSeqs::count_bits(bits, nwords);
+        const vector<int> &nodes = by_size[size];
+        for (unsigned int i=0; i<nodes.size(); i++) {
+            const uint64_t *set = &sets[nodes[i] * nwords];
+            int w = 0;
+            while (w < nwords && set[w] == bits[w])
+                w++;
+            if (w == nwords)
+                return true;
+        }
+        return false;
+    }
+
+protected:
+    int nwords;
+    vector<uint64_t> sets;
+    vector<vector<int> > by_size;   // nodes by number of leaves
+};
+
+
+// Counts non-compatible sites of a packed alignment in the block
+// [block_start, block_end) of a local tree that starts at alignment
+// position 'start'
+static int count_noncompat(const LocalTree *tree, const PackedSeqs *seqs,
+                           const int *seqids, const uint64_t *rows,
+                           int start, int block_start, int block_end)
+{
+    int postorder[tree->nnodes];
+    tree->get_postorder(postorder);
+    PackedLeafSets leaf_sets(seqs, seqids);
+    const int nwords = seqs->get_num_words();
+    CladeSets clades(tree, postorder, seqids, nwords);
+    uint64_t bits[nwords], other_bits[nwords];
+
+    int noncompat = 0;
+    for (int i=start+block_start; i<start+block_end; i++)
+        if (!seqs->is_invariant_site(i, rows)) {
+            int a = seqs->count_alleles(i, rows);
+            if (a <= 1)
+                continue;
+
+            if (a == 2 && !seqs->has_unknown(i, rows)) {
+                // fast path: compare the split of the site to the clades
+                const int set0 = leaf_sets(0, i);
+                int base = 0;
+                while (!(set0 & (1 << base)))
+                    base++;
+                seqs->get_base_bits(i, base, bits, rows);
+                for (int w=0; w<nwords; w++)
+                    other_bits[w] = rows[w] & ~bits[w];
+                noncompat += int(!clades.is_clade(bits) &&
+                                 !clades.is_clade(other_bits));
+                continue;
+            }
+
+            int c = parsimony_cost_leaves(tree, leaf_sets, i, postorder);
+            noncompat += int(c > a - 1);
+        }
+
+    return noncompat;
+}
+
+
 int count_noncompat(const LocalTrees *trees, const Sequences *sequences,
                         int start_coord, int end_coord) {
     int nseqs = trees->get_num_leaves();
+
+    const PackedSeqs *packed = sequences->get_packed();
+    if (packed) {
+        // restrict column queries to the leaves of the trees
+        uint64_t rows[packed->get_num_words()];
+        packed->get_rows(&trees->seqids[0], nseqs, rows);
+        if (start_coord == -1) start_coord = trees->start_coord;
+        if (end_coord == -1) end_coord = trees->end_coord;
+
+        int noncompat = 0;
+        int end = trees->start_coord;
+        for (LocalTrees::const_iterator it=trees->begin();
+             it != trees->end(); ++it)
+        {
+            int start = end;
+            end += it->blocklen;
+            if (end <= start_coord) continue;
+            if (start >= end_coord) break;
+            int block_start = 0;
+            if (start_coord > start) block_start = start_coord - start;
+            int block_end = it->blocklen;
+            if (end_coord < end) block_end = end_coord - start;
+
+            noncompat += count_noncompat(it->tree, packed, &trees->seqids[0],
+                                         rows, start, block_start, block_end);
+        }
+        return noncompat;
+    }
+
     char *seqs[nseqs];
     for (int i=0; i < nseqs; i++)
         seqs[i] = sequences->seqs[trees->seqids[i]];
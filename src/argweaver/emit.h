@@ -6,8 +6,125 @@
 #include "states.h"
 #include "sequences.h"
 
+#include <map>
+#include <string>
+
 namespace argweaver {
 
+// table of partial likelihood values
+typedef double lk_row[4];
+
+
+// Emissions of the thread HMM for one block, computed one site at a time.
+//
+// All per-block quantities (variant and masked sites, branch mutation
+// probabilities and per-state constants) are computed up front, so that
+// the emissions of a site can be produced on demand by the forward
+// algorithm without storing a blocklen x nstates matrix.
+class SiteEmissions
+{
+public:
+    SiteEmissions(const States &states, const LocalTree *tree,
+                  const char *const *seqs,
+                  const vector<vector<BaseProbs> > &base_probs,
+                  int nseqs, int seqlen, const ArgModel *model,
+                  bool internal, PhaseProbs *phase_pr=NULL);
+    ~SiteEmissions();
+
+    // compute emissions of all states at site i
+    void get(int i, double *emit);
+
+    // number of variant sites whose emissions were copied from an
+    // earlier site with the same allele pattern
+    int get_pattern_hits() const {
+        return pattern_hits;
+    }
+
+    // maximum number of distinct patterns cached per local tree
+    enum { MAX_PATTERNS = 4096 };
+
+    // returns true if site i is invariant (neither variant nor masked)
+    bool is_invariant(int i) const {
+        return variant && !variant[i] && !masked[i];
+    }
+
+    // returns true if site i is masked
+    bool is_masked(int i) const {
+        return masked && masked[i];
+    }
+
+    // number of values written by get()
+    int get_nstates() const {
+        return max(nstates, 1);
+    }
+
+    // approximate number of bytes used
+    long get_memory() const;
+
+    int seqlen;
+
+protected:
+    // per state constants
+    struct StateEmit {
+        int node1;
+        int node2;
+        double mut[3];
+        double nomut[3];
+        double invariant_lk;
+    };
+
+    void calc_variant_site(int i, double *emit);
+    void calc_phased_site(int i, double *emit);
+    void likelihood_flipped_site(int i);
+    void likelihood_site(int i, const char *const *seqs,
+                         const vector<vector<BaseProbs> > &base_probs,
+                         const bool *sites,
+                         lk_row *inner, lk_row *outer, lk_row *inner_subtree,
+                         bool *tables_set);
+
+    const LocalTree *tree;
+    States states;
+    int nstates;
+    int nseqs;
+    bool internal;
+    int newleaf;
+    int maintree_root;
+    int subtree_root;
+    double infsites_penalty;
+    PhaseProbs *phase_pr;
+    PhaseProbs *infsites_phase_pr;
+
+    vector<const char*> seqs;
+    vector<const char*> seqs2;    // sequences with phase flipped
+    vector<vector<BaseProbs> > base_probs;
+    vector<vector<BaseProbs> > base_probs2;
+
+    bool *variant;
+    bool *masked;
+    bool *het;                    // heterozygous sites (if phasing)
+    int norder;
+    int *order;
+    double *muts;
+    double *nomuts;
+    vector<StateEmit> state_emits;
+
+    // partial likelihood tables for the current site
+    lk_row *inner;
+    lk_row *outer;
+    lk_row *inner2;               // tables with phase flipped
+    lk_row *outer2;
+    lk_row inner_subtree[1];
+    lk_row inner_subtree2[1];
+    bool tables_set;              // inner/outer hold an earlier site
+    bool *dirty;                  // inner rows changed for the current site
+
+    // emissions of variant sites keyed by their column of alleles
+    map<string, int> patterns;
+    vector<double> pattern_rows;
+    int pattern_hits;
+};
+
+
 void find_masked_sites(const char *const *seqs, int nseqs, int seqlen,
                        bool *masked, bool *invariant=NULL);
 
@@ -17,8 +134,21 @@ void parsimony_ancestral_seq(const LocalTree *tree, const char *const *seqs,
 void parsimony_ancestral_set(const LocalTree *tree, const char * const *seqs,
                              int pos, int *postorder, int npostorder,
                              char *ancestral);
+// same as above, where leaf i is sequence seqids[i] of a packed alignment
+void parsimony_ancestral_set(const LocalTree *tree, const PackedSeqs *seqs,
+                             const int *seqids, int pos, int *postorder,
+                             int npostorder, char *ancestral);
 int parsimony_cost_seq(const LocalTree *tree, const char * const *seqs,
                        int nseqs, int pos, int *postorder);
+// Minimum number of sites per thread when computing emissions with
+// model->nthreads > 1
+const int MIN_THREAD_SITES = 1000;
+
+// Returns true if emissions of a block of seqlen sites are split across
+// threads.  Phasing is always done by a single thread.
+bool use_threaded_emissions(const ArgModel *model, int seqlen,
+                            const PhaseProbs *phase_pr);
+
 void calc_emissions_external(const States &states, const LocalTree *tree,
                              const char * const *seqs,
                              const vector<vector<BaseProbs> > &base_probs,
@@ -36,7 +166,8 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const char *const *seqs,
                        const vector<vector<BaseProbs> > &base_probs,
                        const int nseqs,
-                       const int start, const int end);
+                       const int start, const int end,
+                       const int *order=NULL);
 
 int count_noncompat(const LocalTrees *trees, const char * const *seqs,
                     int nseqs, int seqlen, int start_coord=-1, int end_coord=-1);
@@ -10,6 +10,7 @@
 #include "total_prob.h"
 #include "logging.h"
 #include "model.h"
+#include "profile.h"
 
 #define POPSIZE_UPPER_BOUND 1e10
 
@@ -18,10 +19,13 @@ namespace argweaver {
 using namespace std;
 
 
+// 'stats', if not NULL, holds the prior terms of the trees, so that they
+// need not be visited for each proposal
 double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
                                   bool sample_popsize_recomb, double heat,
                                   const list<PopsizeConfigParam>::iterator &it,
-                                  double curr_like, int index) {
+                                  double curr_like, int index,
+                                  const ArgPriorStats *stats) {
     list<PopsizeConfigParam> &l = model->popsize_config.params;
     double new_popsize, curr_popsize;
     bool accept;
@@ -49,6 +53,7 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
         return curr_like;
     for ( ; it2 != it->intervals.end(); it2++)
         model->popsizes[it2->pop][it2->time] = new_popsize;
+    model->update_interval_tables();
 
     const int npop = model->num_pops();
     int ntimes = model->ntimes;
@@ -62,9 +67,17 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
         num_nocoal[i] = &num_nocoal_alloc[i*ntimes];
     }
 
-    double new_like = sample_popsize_recomb ?
-        calc_arg_prior(model, trees, num_coal, num_nocoal) :
-        calc_arg_prior_recomb_integrate(model, trees, num_coal, num_nocoal);
+    double new_like;
+    if (stats) {
+        // coalescence counts are only kept for monitoring
+        fill(num_coal_alloc, num_coal_alloc + vec_size, 0.0);
+        fill(num_nocoal_alloc, num_nocoal_alloc + vec_size, 0.0);
+        new_like = stats->prior(model);
+    } else {
+        new_like = sample_popsize_recomb ?
+            calc_arg_prior(model, trees, num_coal, num_nocoal) :
+            calc_arg_prior_recomb_integrate(model, trees, num_coal, num_nocoal);
+    }
 
 #ifdef ARGWEAVER_MPI
     comm->Reduce(rank == 0 ? MPI_IN_PLACE : &new_like,
@@ -99,6 +112,7 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
              it2 != it->intervals.end(); it2++) {
             model->popsizes[it2->pop][it2->time] = curr_popsize;
         }
+        model->update_interval_tables();
     } else {
         curr_like = new_like;
     }
@@ -109,8 +123,17 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
 // Metropolis-Hastings population size resampling; not used anymore
 void resample_popsizes_mh(ArgModel *model, const LocalTrees *trees,
                        bool sample_popsize_recomb, double heat) {
+    PROFILE_SCOPE(PROFILE_POPSIZE);
     list<PopsizeConfigParam> &l = model->popsize_config.params;
-    double curr_like = sample_popsize_recomb ? calc_arg_prior(model, trees) :
+
+    // the trees do not change between proposals, so the prior of models of
+    // one population is counted once
+    ArgPriorStats stats;
+    const bool use_stats = sample_popsize_recomb && model->pop_tree == NULL;
+    if (use_stats)
+        stats.count(model, trees);
+    double curr_like = use_stats ? stats.prior(model) :
+        sample_popsize_recomb ? calc_arg_prior(model, trees) :
         calc_arg_prior_recomb_integrate(model, trees, NULL, NULL, NULL);
 #ifdef ARGWEAVER_MPI
     MPI::Intracomm *comm = model->mc3.group_comm;
@@ -124,7 +147,8 @@ void resample_popsizes_mh(ArgModel *model, const LocalTrees *trees,
              it != l.end(); it++) {
             curr_like =
                 resample_single_popsize_mh(model, trees, sample_popsize_recomb,
-                                           heat, it, curr_like, idx++);
+                                           heat, it, curr_like, idx++,
+                                           use_stats ? &stats : NULL);
         }
     }
 
@@ -746,6 +770,143 @@ void popsize_sufficient_stats(struct popsize_data *data, ArgModel *model,
     }
     } */
 
+// Counts the SPRs of 'trees' for the estimation of a single population
+// size per time interval.  coal_counts[i][j][k] gives the number of SPRs
+// which coalesce at time i, with j lineages in the tree interval before
+// time i and k lineages in the interval after it.  If the coalescence
+// happens at the time of the recombination, j is always 0.  nocoal_counts
+// is the same for each interval a branch passes through from the
+// recombination up until the coalescence.  Population structure is
+// ignored.  If 'add' is true, the counts are added to those already in
+// 'data'.
+void popsize_sufficient_stats(struct popsize_data *data, ArgModel *model,
+                              const LocalTrees *trees, bool add) {
+    int end = trees->start_coord;
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    int numleaf = trees->get_num_leaves();
+    double ***coal_counts;
+    double ***nocoal_counts;
+    double *coal_totals;
+    double *nocoal_totals;
+
+    if (!add) {
+	int arr_size = 2*(model->ntimes * numleaf * numleaf + model->ntimes);
+	double *arr_alloc = new double[arr_size]();
+	double pseudocount = model->popsize_config.pseudocount;
+#ifdef ARGWEAVER_MPI
+	//Set pseudocount to zero for all but one MPI, since it will all get combined
+	MPI::Intracomm *comm = model->mc3.group_comm;
+	if (comm && comm->Get_rank() > 0) pseudocount = 0;
+#endif
+
+	int pos=model->ntimes * 2;
+	coal_totals = &arr_alloc[0];
+	nocoal_totals = &arr_alloc[model->ntimes];
+	coal_counts = new double**[model->ntimes];
+	nocoal_counts = new double**[model->ntimes];
+	for (int i=0; i < model->ntimes; i++) {
+	    coal_counts[i] = new double*[numleaf];
+	    nocoal_counts[i] = new double*[numleaf];
+	    for (int j=0; j < numleaf; j++) {
+		coal_counts[i][j] = &(arr_alloc[pos]);
+		pos += numleaf;
+		nocoal_counts[i][j] = &(arr_alloc[pos]);
+		pos += numleaf;
+	    }
+	    if (pseudocount > 0) {
+		double pr_nocoal;
+		if (i==0) {
+		    pr_nocoal = exp(-model->coal_time_steps[0] / 20000.0);
+		    coal_counts[i][0][1] = (1.0 - pr_nocoal) * pseudocount;
+		    nocoal_counts[i][0][1] = pr_nocoal * pseudocount;
+		} else {
+		    pr_nocoal = exp(-(model->coal_time_steps[2*i-1] +
+				      model->coal_time_steps[2*i]) / 20000.0);
+		    coal_counts[i][1][1] = (1.0 - pr_nocoal) * pseudocount;
+		    nocoal_counts[i][1][1] = pr_nocoal * pseudocount;
+		}
+		coal_totals[i] += (1.0 - pr_nocoal) * pseudocount;
+		nocoal_totals[i] += pr_nocoal * pseudocount;
+	    }
+	}
+	assert(pos == arr_size);
+	data->arr_alloc = arr_alloc;
+	data->arr_size = arr_size;
+	data->coal_counts = coal_counts;
+	data->nocoal_counts = nocoal_counts;
+	data->coal_totals = coal_totals;
+	data->nocoal_totals = nocoal_totals;
+	data->numleaf = numleaf;
+	data->model = model;
+	data->popsize_idx = -1;
+	data->t1 = -1;
+	data->t2 = -1;
+    } else {  // add counts to already initialized structure
+	assert(data->numleaf == numleaf);
+	coal_counts = data->coal_counts;
+	nocoal_counts = data->nocoal_counts;
+	coal_totals = data->coal_totals;
+	nocoal_totals = data->nocoal_totals;
+    }
+
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
+	end += it->blocklen;
+	LocalTree *tree = it->tree;
+	if (end >= trees->end_coord) break;
+	++it;
+	assert(it != trees->end());
+	const Spr *spr = &it->spr;
+	lineages.count(tree, model->pop_tree);
+	int broken_age = tree->nodes[tree->nodes[spr->recomb_node].parent].age;
+	int nlineage1=0;
+	int nlineage2=lineages.nbranches[spr->recomb_time] - int(spr->recomb_time < broken_age);
+
+	if (spr->recomb_time == spr->coal_time) {
+	    coal_counts[spr->coal_time][0][nlineage2]++;
+	    coal_totals[spr->coal_time]++;
+	} else {
+	    nocoal_counts[spr->recomb_time][0][nlineage2]++;
+	    nocoal_totals[spr->recomb_time]++;
+	}
+	for (int i=spr->recomb_time + 1; i < spr->coal_time; i++) {
+	    nlineage1 = nlineage2;
+	    nlineage2 = lineages.nbranches[i] - int(i < broken_age);
+	    nocoal_counts[i][nlineage1][nlineage2]++;
+	    nocoal_totals[i]++;
+	}
+	if (spr->recomb_time != spr->coal_time) {
+	    nlineage1 = nlineage2;
+	    nlineage2 = lineages.nbranches[spr->coal_time] - int(spr->coal_time < broken_age);
+	    coal_counts[spr->coal_time][nlineage1][nlineage2]++;
+	    coal_totals[spr->coal_time]++;
+	}
+    }
+}
+
+
+// Sets the population sizes of population 0 to their maximum likelihood
+// values given the counts of 'data'.  Consecutive time intervals are
+// pooled until they hold at least 'min_total' counts.
+void mle_popsize(ArgModel *model, const struct popsize_data *data,
+                 double min_total) {
+    double *popsizes = model->popsizes[0];
+    int start_time = 0;
+    double curr_total = 0.0;
+    for (int i=0; i < model->ntimes-1; i++) {
+	curr_total += data->coal_totals[i] + data->nocoal_totals[i];
+	if (curr_total < min_total && i < model->ntimes - 2) continue;
+	double popsize = mle_one_popsize(start_time, i, popsizes[2*i],
+					 (void*)data);
+	for (int j = start_time; j <= i; j++) {
+	    popsizes[2*j] = popsize;
+	    if (j > 0) popsizes[2*j-1] = popsize;
+	}
+	start_time = i+1;
+	curr_total = 0.0;
+    }
+}
+
+
 void delete_popsize_data(struct popsize_data *data) {
     int ntimes = data->model->ntimes;
     for (int i=0; i < ntimes; i++) {
@@ -1037,6 +1198,7 @@ void mle_popsize(ArgModel *model, const struct popsize_data *data, double min_to
 
 
 void mle_popsize(ArgModel *model, const LocalTrees *trees, double min_total) {
+    PROFILE_SCOPE(PROFILE_POPSIZE);
     struct popsize_data data;
     popsize_sufficient_stats(&data, model, trees);
 #ifdef ARGWEAVER_MPI
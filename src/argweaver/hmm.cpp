@@ -1,5 +1,6 @@
 
 #include "common.h"
+#include "simd.h"
 
 namespace argweaver {
 
@@ -18,7 +19,7 @@ void forward_step(double *col1, double* col2,
     for (int k=0; k<nstates2; k++) {
         for (int j=0; j<nstates1; j++)
             tmp[j] = col1[j] + trans[j][k];
-        col2[k] = logsum(tmp, nstates1) + emit[k];
+        col2[k] = simd_logsum(tmp, nstates1) + emit[k];
     }
 }
 
@@ -29,17 +30,27 @@ void forward_alg(int n, int nstates, double **trans, double **emit,
 {
     double vec[nstates];
 
+    // transpose transition matrix so that incoming transitions to a state
+    // are contiguous
+    double **trans2 = new_matrix<double>(nstates, nstates);
+    for (int j=0; j<nstates; j++)
+        for (int k=0; k<nstates; k++)
+            trans2[k][j] = trans[j][k];
+
     for (int i=1; i<n; i++) {
         double *col1 = fw[i-1];
         double *col2 = fw[i];
         double *emit2 = emit[i];
 
         for (int k=0; k<nstates; k++) {
+            const double *trans_k = trans2[k];
             for (int j=0; j<nstates; j++)
-                vec[j] = col1[j] + trans[j][k];
-            col2[k] = logsum(vec, nstates) + emit2[k];
+                vec[j] = col1[j] + trans_k[j];
+            col2[k] = simd_logsum(vec, nstates) + emit2[k];
         }
     }
+
+    delete_matrix<double>(trans2, nstates);
 }
 
 
@@ -49,16 +60,21 @@ void backward_alg(int n, int nstates, double **trans, double **emit,
                   double **bw)
 {
     double vec[nstates];
+    double col2_emit[nstates];
 
     for (int i=n-2; i>-1; i--) {
         double *col1 = bw[i];
         double *col2 = bw[i+1];
         double *emit2 = emit[i+1];
 
+        for (int k=0; k<nstates; k++)
+            col2_emit[k] = col2[k] + emit2[k];
+
         for (int j=0; j<nstates; j++) {
+            const double *trans_j = trans[j];
             for (int k=0; k<nstates; k++)
-                vec[k] = trans[j][k] + col2[k] + emit2[k];
-            col1[j] = logsum(vec, nstates);
+                vec[k] = trans_j[k] + col2_emit[k];
+            col1[j] = simd_logsum(vec, nstates);
         }
     }
 }
@@ -76,9 +92,8 @@ void sample_hmm_posterior(int n, int nstates, double **trans,
         int k = path[i+1];
         for (int j=0; j<nstates; j++)
             A[j] = fw[i][j] + trans[j][k];
-        double total = logsum(A, nstates);
-        for (int j=0; j<nstates; j++)
-            A[j] = exp(A[j] - total);
+        double total = simd_logsum(A, nstates);
+        simd_exp_shift(A, nstates, total);
         path[i] = sample(A, nstates);
     }
 }
@@ -87,13 +102,14 @@ void sample_hmm_posterior(int n, int nstates, double **trans,
 int sample_hmm_posterior_step(int nstates1, double **trans, double *col1,
                               int state2)
 {
+    if (nstates1 <= 0)
+        return -1;
     double A[nstates1];
 
     for (int j=0; j<nstates1; j++)
         A[j] = col1[j] + trans[j][state2];
-    double total = logsum(A, nstates1);
-    for (int j=0; j<nstates1; j++)
-        A[j] = exp(A[j] - total);
+    double total = simd_logsum(A, nstates1);
+    simd_exp_shift(A, nstates1, total);
     return sample(A, nstates1);
 }
 
@@ -0,0 +1,361 @@
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input_bundle.h"
+#include "logging.h"
+
+namespace argweaver {
+
+
+// Bundle file format
+//
+//   char    magic[4] = "\x89" "BDL"
+//   int     version, compress_seq, compress_max, unphased
+//   region  seq_region         (chrom, start, end)
+//   sites   sites              (chrom, start, end, names, pops,
+//                               positions, columns, base probabilities)
+//   mapping sites_mapping      (coordinates, site position arrays and
+//                               adaptive compression factors)
+//   track   maskmap
+//   int     nind
+//   track   ind_maskmap[nind]
+//   track   mutmap, recombmap
+//   char    end[4] = "BDLE"
+//
+// Strings and arrays are prefixed by their length.  Values are in host
+// byte order.
+
+static const char *BUNDLE_MAGIC = "\x89" "BDL";
+static const char *BUNDLE_END = "BDLE";
+static const int BUNDLE_VERSION = 2;
+
+
+//=============================================================================
+// writing
+
+class BundleWriter
+{
+public:
+    BundleWriter(FILE *out) :
+        out(out),
+        ok(true)
+    {}
+
+    void write(const void *data, size_t size)
+    {
+        if (ok && size > 0)
+            ok = fwrite(data, 1, size, out) == size;
+    }
+
+    void write_int(int value)
+    {
+        write(&value, sizeof(int));
+    }
+
+    void write_string(const string &str)
+    {
+        write_int(str.size());
+        write(str.data(), str.size());
+    }
+
+    template <class T>
+    void write_vector(const vector<T> &values)
+    {
+        write_int(values.size());
+        write(values.data(), values.size() * sizeof(T));
+    }
+
+    template <class T>
+    void write_track(const Track<T> &track)
+    {
+        write_int(track.size());
+        for (unsigned int i=0; i<track.size(); i++) {
+            write_string(track[i].chrom);
+            write_int(track[i].start);
+            write_int(track[i].end);
+            write(&track[i].value, sizeof(T));
+        }
+    }
+
+    FILE *out;
+    bool ok;
+};
+
+
+static void write_bundle_sites(BundleWriter &writer, const Sites &sites)
+{
+    const int nseqs = sites.get_num_seqs();
+    const int nsites = sites.get_num_sites();
+    writer.write_string(sites.chrom);
+    writer.write_int(sites.start_coord);
+    writer.write_int(sites.end_coord);
+    writer.write_int(nseqs);
+    for (int i=0; i<nseqs; i++)
+        writer.write_string(sites.names[i]);
+    writer.write_vector(sites.pops);
+    writer.write_vector(sites.positions);
+    for (int i=0; i<nsites; i++)
+        writer.write(sites.cols[i], nseqs);
+    writer.write_int(sites.base_probs.size() > 0);
+    for (unsigned int i=0; i<sites.base_probs.size(); i++)
+        writer.write(&sites.base_probs[i][0], nseqs * sizeof(BaseProbs));
+}
+
+
+static void write_bundle_mapping(BundleWriter &writer,
+                                 const SitesMapping &mapping)
+{
+    const int header[] = {mapping.old_start, mapping.old_end,
+                          mapping.new_start, mapping.new_end,
+                          mapping.nsites, mapping.seqlen};
+    writer.write(header, sizeof(header));
+    writer.write_vector(mapping.old_sites);
+    writer.write_vector(mapping.new_sites);
+    writer.write_vector(mapping.all_sites);
+    writer.write_vector(mapping.all_sites_start);
+    writer.write_vector(mapping.all_sites_end);
+    writer.write_vector(mapping.site_compress);
+}
+
+
+bool write_input_bundle(const char *filename, const InputBundle *bundle)
+{
+    FILE *out = fopen(filename, "wb");
+    if (!out) {
+        printError("cannot write '%s'", filename);
+        return false;
+    }
+
+    BundleWriter writer(out);
+    writer.write(BUNDLE_MAGIC, 4);
+    writer.write_int(BUNDLE_VERSION);
+    writer.write_int(bundle->compress_seq);
+    writer.write_int(bundle->compress_max);
+    writer.write_int(bundle->unphased);
+    writer.write_string(bundle->seq_region.chrom);
+    writer.write_int(bundle->seq_region.start);
+    writer.write_int(bundle->seq_region.end);
+    write_bundle_sites(writer, bundle->sites);
+    write_bundle_mapping(writer, bundle->sites_mapping);
+    writer.write_track(bundle->maskmap);
+    writer.write_int(bundle->ind_maskmap.size());
+    for (unsigned int i=0; i<bundle->ind_maskmap.size(); i++)
+        writer.write_track(bundle->ind_maskmap[i]);
+    writer.write_track(bundle->mutmap);
+    writer.write_track(bundle->recombmap);
+    writer.write(BUNDLE_END, 4);
+
+    bool ok = (fclose(out) == 0) && writer.ok;
+    if (!ok)
+        printError("error writing bundle '%s'", filename);
+    return ok;
+}
+
+
+//=============================================================================
+// reading
+
+// Reads values from a bundle held in memory.  Any read past the end
+// clears 'ok' and returns zeroed values.
+class BundleReader
+{
+public:
+    BundleReader(const char *data, size_t size) :
+        p(data),
+        end(data + size),
+        ok(true)
+    {}
+
+    const char *read(size_t size)
+    {
+        if (!ok || (size_t) (end - p) < size) {
+            ok = false;
+            return NULL;
+        }
+        const char *data = p;
+        p += size;
+        return data;
+    }
+
+    void read(void *dest, size_t size)
+    {
+        const char *data = read(size);
+        if (data)
+            memcpy(dest, data, size);
+        else
+            memset(dest, 0, size);
+    }
+
+    int read_int()
+    {
+        int value;
+        read(&value, sizeof(int));
+        return value;
+    }
+
+    // reads a length, checking that at least 'size' bytes per item
+    // remain
+    int read_count(size_t size)
+    {
+        const int n = read_int();
+        if (n < 0 || (size > 0 && (size_t) (end - p) / size < (size_t) n))
+            ok = false;
+        return ok ? n : 0;
+    }
+
+    void read_string(string *str)
+    {
+        const int len = read_count(1);
+        const char *data = read(len);
+        if (data)
+            str->assign(data, len);
+    }
+
+    template <class T>
+    void read_vector(vector<T> *values)
+    {
+        const int n = read_count(sizeof(T));
+        values->resize(n);
+        read(values->data(), n * sizeof(T));
+    }
+
+    template <class T>
+    void read_track(Track<T> *track)
+    {
+        track->clear();
+        const int n = read_count(3 * sizeof(int) + sizeof(T));
+        for (int i=0; i<n && ok; i++) {
+            RegionValue<T> region;
+            read_string(&region.chrom);
+            region.start = read_int();
+            region.end = read_int();
+            read(&region.value, sizeof(T));
+            track->push_back(region);
+        }
+    }
+
+    const char *p;
+    const char *end;
+    bool ok;
+};
+
+
+static void read_bundle_sites(BundleReader &reader, Sites *sites)
+{
+    sites->clear();
+    reader.read_string(&sites->chrom);
+    sites->start_coord = reader.read_int();
+    sites->end_coord = reader.read_int();
+    const int nseqs = reader.read_count(sizeof(int));
+    sites->names.resize(nseqs);
+    for (int i=0; i<nseqs; i++)
+        reader.read_string(&sites->names[i]);
+    reader.read_vector(&sites->pops);
+
+    vector<int> positions;
+    reader.read_vector(&positions);
+    const int nsites = positions.size();
+    for (int i=0; i<nsites && reader.ok; i++) {
+        const char *data = reader.read(nseqs);
+        if (!data)
+            break;
+        char *col = new char [nseqs + 1];
+        memcpy(col, data, nseqs);
+        col[nseqs] = '\0';
+        sites->append(positions[i], col);
+    }
+
+    if (reader.read_int()) {
+        sites->base_probs.resize(nsites);
+        for (int i=0; i<nsites && reader.ok; i++) {
+            sites->base_probs[i].resize(nseqs);
+            reader.read(&sites->base_probs[i][0], nseqs * sizeof(BaseProbs));
+        }
+    }
+}
+
+
+static void read_bundle_mapping(BundleReader &reader, SitesMapping *mapping)
+{
+    int header[6];
+    reader.read(header, sizeof(header));
+    mapping->old_start = header[0];
+    mapping->old_end = header[1];
+    mapping->new_start = header[2];
+    mapping->new_end = header[3];
+    mapping->nsites = header[4];
+    mapping->seqlen = header[5];
+    reader.read_vector(&mapping->old_sites);
+    reader.read_vector(&mapping->new_sites);
+    reader.read_vector(&mapping->all_sites);
+    reader.read_vector(&mapping->all_sites_start);
+    reader.read_vector(&mapping->all_sites_end);
+    reader.read_vector(&mapping->site_compress);
+}
+
+
+static bool read_input_bundle(const char *data, size_t size,
+                              InputBundle *bundle)
+{
+    BundleReader reader(data, size);
+    const char *magic = reader.read(4);
+    if (!magic || memcmp(magic, BUNDLE_MAGIC, 4) != 0)
+        return false;
+    if (reader.read_int() != BUNDLE_VERSION)
+        return false;
+
+    bundle->compress_seq = reader.read_int();
+    bundle->compress_max = reader.read_int();
+    bundle->unphased = reader.read_int();
+    string chrom;
+    reader.read_string(&chrom);
+    const int start = reader.read_int();
+    const int end = reader.read_int();
+    bundle->seq_region.set(chrom, start, end);
+    read_bundle_sites(reader, &bundle->sites);
+    read_bundle_mapping(reader, &bundle->sites_mapping);
+    reader.read_track(&bundle->maskmap);
+    bundle->ind_maskmap.resize(reader.read_count(sizeof(int)));
+    for (unsigned int i=0; i<bundle->ind_maskmap.size(); i++)
+        reader.read_track(&bundle->ind_maskmap[i]);
+    reader.read_track(&bundle->mutmap);
+    reader.read_track(&bundle->recombmap);
+
+    magic = reader.read(4);
+    return reader.ok && memcmp(magic, BUNDLE_END, 4) == 0;
+}
+
+
+bool read_input_bundle(const char *filename, InputBundle *bundle)
+{
+    const int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    bool ok = read_input_bundle((const char*) data, st.st_size, bundle);
+    munmap(data, st.st_size);
+    if (!ok)
+        printError("bad input bundle '%s'", filename);
+    return ok;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,54 @@
+//=============================================================================
+// Binary bundle of preprocessed arg-sample inputs
+
+
+#ifndef ARGWEAVER_INPUT_BUNDLE_H
+#define ARGWEAVER_INPUT_BUNDLE_H
+
+// c/c++ includes
+#include <string>
+#include <vector>
+
+// arghmm includes
+#include "sequences.h"
+#include "track.h"
+
+namespace argweaver {
+
+using namespace std;
+
+
+// The inputs of arg-sample after reading, masking and compressing the
+// sites.  A bundle holds them in one file that loads without parsing, for
+// repeated runs on the same data.
+class InputBundle
+{
+public:
+    InputBundle() :
+        compress_seq(1),
+        compress_max(0),
+        unphased(false)
+    {}
+
+    int compress_seq;                  // compression the sites were made with
+    int compress_max;                  // largest adaptive compression, or 0
+    bool unphased;                     // sites are unphased (read from VCF)
+    Region seq_region;                 // region of the original sites
+    Sites sites;                       // compressed sites
+    SitesMapping sites_mapping;
+    TrackNullValue maskmap;            // mask, in original coordinates
+    vector<TrackNullValue> ind_maskmap; // per-sequence masks
+    Track<double> mutmap;              // mutation rate map, if any
+    Track<double> recombmap;           // recombination rate map, if any
+};
+
+
+bool write_input_bundle(const char *filename, const InputBundle *bundle);
+
+// Reads a bundle.  The file is mapped into memory and read in place.
+bool read_input_bundle(const char *filename, InputBundle *bundle);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_INPUT_BUNDLE_H
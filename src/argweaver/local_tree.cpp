@@ -2,12 +2,14 @@
 // C/C++ includes
 #include "math.h"
 #include "stdio.h"
+#include <pthread.h>
 
 // argweaver includes
 #include "compress.h"
 #include "common.h"
 #include "local_tree.h"
 #include "logging.h"
+#include "mem.h"
 #include "parsing.h"
 #include "pop_model.h"
 
@@ -22,6 +24,124 @@ namespace argweaver {
 LocalNode null_node;
 
 
+//=============================================================================
+// node array pool
+
+// number of nodes in each slab of the pool
+const int NODE_SLAB_SIZE = 1 << 16;
+
+// node arrays larger than this are allocated directly
+const int NODE_POOL_MAX_CAPACITY = 1 << 12;
+
+static pthread_mutex_t node_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<vector<LocalNode*> > node_pool_free;  // free arrays by capacity
+static LocalNode *node_pool_slab = NULL;            // current slab
+static int node_pool_slab_used = 0;                 // nodes used in slab
+
+
+LocalNode *alloc_local_nodes(int capacity)
+{
+    if (capacity <= 0)
+        return NULL;
+    add_tag_memory(MEM_TREES, capacity * sizeof(LocalNode));
+    if (capacity > NODE_POOL_MAX_CAPACITY)
+        return new LocalNode [capacity];
+
+    pthread_mutex_lock(&node_pool_lock);
+    LocalNode *nodes;
+    if ((int) node_pool_free.size() > capacity &&
+        node_pool_free[capacity].size() > 0) {
+        // reuse a freed array of the same capacity
+        nodes = node_pool_free[capacity].back();
+        node_pool_free[capacity].pop_back();
+    } else {
+        // carve a new array from the current slab
+        if (!node_pool_slab ||
+            node_pool_slab_used + capacity > NODE_SLAB_SIZE) {
+            node_pool_slab = new LocalNode [NODE_SLAB_SIZE];
+            node_pool_slab_used = 0;
+        }
+        nodes = node_pool_slab + node_pool_slab_used;
+        node_pool_slab_used += capacity;
+    }
+    pthread_mutex_unlock(&node_pool_lock);
+
+    return nodes;
+}
+
+
+void free_local_nodes(LocalNode *nodes, int capacity)
+{
+    if (!nodes)
+        return;
+    add_tag_memory(MEM_TREES, -long(capacity * sizeof(LocalNode)));
+    if (capacity > NODE_POOL_MAX_CAPACITY) {
+        delete [] nodes;
+        return;
+    }
+
+    pthread_mutex_lock(&node_pool_lock);
+    if ((int) node_pool_free.size() <= capacity)
+        node_pool_free.resize(capacity + 1);
+    node_pool_free[capacity].push_back(nodes);
+    pthread_mutex_unlock(&node_pool_lock);
+}
+
+
+// Counts lineages for a tree without a population tree.
+//
+// The node ages and parent ages are first gathered into separate arrays,
+// then every branch adds +1/-1 at its endpoints and a prefix sum gives
+// the number of branches spanning each time, so the cost is
+// O(nnodes + ntimes) instead of O(nnodes * ntimes).
+static void count_lineages_single_pop(const LocalTree *tree, int ntimes,
+                                      int *nbranches, int *nrecombs,
+                                      int *nbranches_pop, int *ncoals_pop)
+{
+    const LocalNode *nodes = tree->nodes;
+    const int nnodes = tree->nnodes;
+    int ages[nnodes];
+    int parent_ages[nnodes];
+    int delta[ntimes];  // change in number of spanning branches at time i
+    int tops[ntimes];   // number of branches ending at time i
+    int roots[ntimes];  // number of root branches ending at time i
+
+    for (int i=0; i<nnodes; i++) {
+        const int parent = nodes[i].parent;
+        ages[i] = nodes[i].age;
+        parent_ages[i] = (parent == -1) ? ntimes - 2 : nodes[parent].age;
+    }
+
+    for (int i=0; i<ntimes; i++)
+        delta[i] = tops[i] = roots[i] = 0;
+    for (int i=0; i<nnodes; i++) {
+        assert(ages[i] < ntimes - 1);
+        if (ages[i] < parent_ages[i]) {
+            delta[ages[i]]++;
+            delta[parent_ages[i]]--;
+        }
+        tops[parent_ages[i]]++;
+        if (nodes[i].parent == -1)
+            roots[parent_ages[i]]++;
+    }
+
+    int cover = 0;
+    for (int j=0; j<ntimes - 1; j++) {
+        cover += delta[j];
+        nbranches[j] = cover + roots[j];
+        nrecombs[j] = cover + tops[j];
+        nbranches_pop[2*j] = nbranches_pop[2*j+1] = cover + roots[j];
+        ncoals_pop[j] = cover + tops[j];
+    }
+
+    // ensure last time segment always has one branch
+    nbranches[ntimes - 1] = 1;
+    nrecombs[ntimes - 1] = 0;
+    nbranches_pop[2*(ntimes - 1)] = nbranches_pop[2*ntimes - 1] = 1;
+    ncoals_pop[ntimes - 1] = 1;
+}
+
+
 // Counts the number of lineages in a tree for each time segment
 //
 // NOTE: Nodes in the tree are not allowed to exist at the top time point
@@ -37,6 +157,12 @@ void count_lineages(const LocalTree *tree, int ntimes,
                     int **nbranches_pop, int **ncoals_pop,
                     const PopulationTree *pop_tree)
 {
+    if (pop_tree == NULL) {
+        count_lineages_single_pop(tree, ntimes, nbranches, nrecombs,
+                                  nbranches_pop[0], ncoals_pop[0]);
+        return;
+    }
+
     const LocalNode *nodes = tree->nodes;
     int npop = ( pop_tree == NULL ? 1 : pop_tree->npop );
 
@@ -178,6 +304,125 @@ void count_lineages_internal(const LocalTree *tree, int ntimes,
 
 
 
+// Branch of a node as counted by count_lineages (internal=false) or
+// count_lineages_internal (internal=true).  Returns false if the node's
+// branch is not counted.
+static inline bool get_lineage_branch(const LocalTree *tree, int node,
+                                      int ntimes, bool internal,
+                                      int *age, int *parent_age, bool *top)
+{
+    const LocalNode *nodes = tree->nodes;
+    const int parent = nodes[node].parent;
+    int top_parent = -1;
+    if (internal) {
+        // skip virtual branches
+        if (node == nodes[tree->root].child[0] || node == tree->root)
+            return false;
+        top_parent = tree->root;
+    }
+    *age = nodes[node].age;
+    *top = (parent == top_parent);
+    *parent_age = *top ? ntimes - 2 : nodes[parent].age;
+    return true;
+}
+
+
+// Adds (sign=1) or removes (sign=-1) the counts of one branch
+static inline void add_lineage_branch(const LocalNode &node, int age,
+                                      int parent_age, bool top, int sign,
+                                      int *nbranches, int *nrecombs,
+                                      int **nbranches_pop, int **ncoals_pop,
+                                      const PopulationTree *pop_tree)
+{
+    for (int j=age; j<parent_age; j++) {
+        int pop = node.get_pop(j, pop_tree);
+        nbranches[j] += sign;
+        nrecombs[j] += sign;
+        nbranches_pop[pop][2*j] += sign;
+        ncoals_pop[pop][j] += sign;
+        pop = node.get_pop(j+1, pop_tree);
+        nbranches_pop[pop][2*j+1] += sign;
+    }
+
+    int pop = node.get_pop(parent_age, pop_tree);
+    nrecombs[parent_age] += sign;
+    ncoals_pop[pop][parent_age] += sign;
+    if (top) {
+        nbranches[parent_age] += sign;
+        nbranches_pop[pop][2*parent_age] += sign;
+        pop = node.get_pop(parent_age+1, pop_tree);
+        nbranches_pop[pop][2*parent_age+1] += sign;
+    }
+}
+
+
+// Updates lineage counts of last_tree to those of tree
+//
+// The counts are a sum over branches, so only the branches whose node
+// ages, parent ages or population paths differ between the two trees are
+// removed and re-added.  An SPR changes at most a few branches.
+//
+// mapping -- maps nodes of last_tree to nodes of tree (-1 if removed)
+void update_lineages(const LocalTree *last_tree, const LocalTree *tree,
+                     const int *mapping, int ntimes,
+                     int *nbranches, int *nrecombs,
+                     int **nbranches_pop, int **ncoals_pop,
+                     const PopulationTree *pop_tree, bool internal)
+{
+    const LocalNode *last_nodes = last_tree->nodes;
+    const LocalNode *nodes = tree->nodes;
+    bool mapped[tree->nnodes];
+    for (int i=0; i<tree->nnodes; i++)
+        mapped[i] = false;
+
+    for (int i=0; i<last_tree->nnodes; i++) {
+        int age1, parent_age1, age2, parent_age2;
+        bool top1, top2;
+        const bool counted1 = get_lineage_branch(
+            last_tree, i, ntimes, internal, &age1, &parent_age1, &top1);
+        const int k = mapping[i];
+        bool counted2 = false;
+        if (k != -1) {
+            mapped[k] = true;
+            counted2 = get_lineage_branch(
+                tree, k, ntimes, internal, &age2, &parent_age2, &top2);
+
+            // skip unchanged branches
+            if (counted1 == counted2 &&
+                (!counted1 ||
+                 (age1 == age2 && parent_age1 == parent_age2 &&
+                  top1 == top2 &&
+                  (pop_tree == NULL ||
+                   last_nodes[i].pop_path == nodes[k].pop_path))))
+                continue;
+        }
+
+        if (counted1)
+            add_lineage_branch(last_nodes[i], age1, parent_age1, top1, -1,
+                               nbranches, nrecombs, nbranches_pop,
+                               ncoals_pop, pop_tree);
+        if (counted2)
+            add_lineage_branch(nodes[k], age2, parent_age2, top2, 1,
+                               nbranches, nrecombs, nbranches_pop,
+                               ncoals_pop, pop_tree);
+    }
+
+    // add branches new to tree
+    for (int k=0; k<tree->nnodes; k++) {
+        int age, parent_age;
+        bool top;
+        if (!mapped[k] &&
+            get_lineage_branch(tree, k, ntimes, internal,
+                               &age, &parent_age, &top)) {
+            assert(age < ntimes - 1);
+            add_lineage_branch(nodes[k], age, parent_age, top, 1,
+                               nbranches, nrecombs, nbranches_pop,
+                               ncoals_pop, pop_tree);
+        }
+    }
+}
+
+
 // Calculate tree length according to ArgHmm rules
 double get_treelen(const LocalTree *tree, const double *times, int ntimes,
                    bool use_basal)
@@ -450,6 +695,53 @@ void apply_spr(LocalTree *tree, const Spr &spr,
 }
 
 
+// Repairs a postorder after an SPR
+//
+// 'order' must be a postorder of the tree before apply_spr(tree, spr).
+// Only the recoal node and its new ancestors can come before one of their
+// children, so they are moved, in order, to the end.  Every other node
+// keeps its relative position.
+void update_postorder(const LocalTree *tree, const Spr &spr, int *order)
+{
+    if (spr.is_null() || spr.recomb_node == spr.coal_node)
+        return;
+
+    const LocalNode *nodes = tree->nodes;
+    const int nnodes = tree->nnodes;
+    int path[nnodes];
+    int npath = 0;
+    bool moved[nnodes];
+    fill(moved, moved + nnodes, false);
+    for (int node=nodes[spr.recomb_node].parent; node != -1;
+         node=nodes[node].parent) {
+        path[npath++] = node;
+        moved[node] = true;
+    }
+
+    int j = 0;
+    for (int i=0; i<nnodes; i++)
+        if (!moved[order[i]])
+            order[j++] = order[i];
+    for (int i=0; i<npath; i++)
+        order[j++] = path[i];
+}
+
+
+// Returns true if mapping has the form produced by apply_spr(): every
+// node of last_tree keeps its name except the broken node.
+bool is_spr_mapping(const LocalTree *last_tree, const Spr &spr,
+                    const int *mapping)
+{
+    if (!mapping || spr.is_null())
+        return false;
+    const int broken = last_tree->nodes[spr.recomb_node].parent;
+    for (int i=0; i<last_tree->nnodes; i++)
+        if (mapping[i] != i && !(i == broken && mapping[i] == -1))
+            return false;
+    return true;
+}
+
+
 //=============================================================================
 // local trees methods
 
@@ -541,6 +833,35 @@ double get_arglen(const LocalTrees *trees, const double *times)
 }
 
 
+// Asserts that the tree of 'block2', reached from the tree of 'block' by a
+// null SPR, has the same topology, ages and paths under its mapping
+static void assert_null_spr(const LocalTreeSpr &block,
+                            const LocalTreeSpr &block2,
+                            const PopulationTree *pop_tree)
+{
+#ifndef NDEBUG
+    const LocalTree *tree = block.tree;
+    const LocalTree *tree2 = block2.tree;
+    const int *mapping = block2.mapping;
+    int subtree_root = tree->nodes[tree->root].child[0];
+    for (int i=0; i < tree2->nnodes; i++) {
+        assert(tree->nodes[i].age == tree2->nodes[mapping[i]].age);
+        if (i != tree->root) {
+            assert(tree->nodes[tree->nodes[i].parent].age ==
+                   tree2->nodes[tree2->nodes[mapping[i]].parent].age);
+        }
+        assert(i==subtree_root ||
+               ( pop_tree == NULL ||
+                 pop_tree->paths_equal(tree->nodes[i].pop_path,
+                                       tree2->nodes[mapping[i]].pop_path,
+                                       tree->nodes[i].age,
+                                       i == tree->root ? -1 :
+                                       tree->nodes[tree->nodes[i].parent].age)));
+    }
+#endif
+}
+
+
 // removes a null SPR from one local tree
 bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
                      const PopulationTree *pop_tree)
@@ -557,23 +878,7 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
         return false;
 
     int nnodes = it2->tree->nnodes;
-
-    int subtree_root = it->tree->nodes[it->tree->root].child[0];
-    for (int i=0; i < it2->tree->nnodes; i++) {
-        assert(it->tree->nodes[i].age == it2->tree->nodes[it2->mapping[i]].age);
-        if (i != it->tree->root) {
-            assert(it->tree->nodes[it->tree->nodes[i].parent].age ==
-                   it2->tree->nodes[it2->tree->nodes[it2->mapping[i]].parent].age);
-        }
-        assert(i==subtree_root ||
-               ( pop_tree == NULL ||
-                 pop_tree->paths_equal(it->tree->nodes[i].pop_path,
-                                       it2->tree->nodes[it2->mapping[i]].pop_path,
-                                       it->tree->nodes[i].age,
-                                       i == it->tree->root ? -1 :
-                                       it->tree->nodes[it->tree->nodes[i].parent].age)));
-    }
-
+    assert_null_spr(*it, *it2, pop_tree);
 
     if (it->mapping == NULL) {
         // it2 will become first tree and therefore does not need a mapping
@@ -611,15 +916,61 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
 
 
 
-// Removes trees with null SPRs from the local trees
-void remove_null_sprs(LocalTrees *trees, const PopulationTree *pop_tree)
+// Merges the run of trees following 'it' that are reached by null SPRs
+// into the last tree of the run, as remove_null_spr() would one tree at a
+// time.  The last tree takes the SPR of 'it', the composition of the
+// mappings and the total length of the run.  The mapping of 'it' is
+// composed in place and handed over, so nothing is allocated.  Returns the
+// tree the run was merged into, which is 'it' if the next SPR is not null.
+LocalTrees::iterator remove_null_spr_run(LocalTrees *trees,
+                                         LocalTrees::iterator it,
+                                         const PopulationTree *pop_tree)
 {
-    for (LocalTrees::iterator it=trees->begin(); it != trees->end();) {
-        LocalTrees::iterator it2 = it;
-        ++it2;
-        remove_null_spr(trees, it, pop_tree);
-        it = it2;
+    LocalTrees::iterator last = it;
+    LocalTrees::iterator next = it;
+    ++next;
+    int *mapping = it->mapping;
+    const int nnodes = it->tree->nnodes;
+    int blocklen = it->blocklen;
+
+    for (; next != trees->end() && next->spr.is_null(); ++next) {
+        assert_null_spr(*last, *next, pop_tree);
+        if (mapping) {
+            const int *M2 = next->mapping;
+            for (int i=0; i<nnodes; i++) {
+                if (mapping[i] != -1)
+                    mapping[i] = M2[mapping[i]];
+            }
+        }
+        blocklen += next->blocklen;
+        last = next;
+    }
+    if (last == it)
+        return it;
+
+    // the first tree of the ARG keeps no mapping
+    if (mapping) {
+        swap(last->mapping, it->mapping);
+        last->spr = it->spr;
+        assert(!last->spr.is_null());
+    } else {
+        delete [] last->mapping;
+        last->mapping = NULL;
     }
+    last->blocklen = blocklen;
+
+    for (LocalTrees::iterator it2=it; it2 != last; ++it2)
+        it2->clear();
+    trees->trees.erase(it, last);
+    return last;
+}
+
+
+// Removes trees with null SPRs from the local trees in one pass
+void remove_null_sprs(LocalTrees *trees, const PopulationTree *pop_tree)
+{
+    for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it)
+        it = remove_null_spr_run(trees, it, pop_tree);
 }
 
 
@@ -935,7 +1286,7 @@ void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge,
                 it2->mapping = new int [trees2->nnodes];
             map_congruent_trees(it->tree, &trees->seqids[0],
                                 it2->tree, &trees2->seqids[0], it2->mapping);
-            remove_null_spr(trees, it, pop_tree);
+            remove_null_spr_run(trees, it, pop_tree);
         } else {
             // there should be an SPR between these trees, repair it.
             repair_spr(it->tree, it2->tree, it2->spr, it2->mapping);
@@ -946,6 +1297,127 @@ void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge,
     //assert_trees(trees2);
 }
 
+// Returns the SPR that prunes a leaf and regrafts it above the root at
+// 'maxtime', or a null SPR if the leaf is already there
+static Spr get_root_leaf_spr(const LocalTree *tree, int leaf, int maxtime)
+{
+    const LocalNode *nodes = tree->nodes;
+    if (nodes[leaf].parent == tree->root && nodes[tree->root].age == maxtime)
+        return Spr(-1, -1, -1, -1);
+    return Spr(leaf, nodes[leaf].age, tree->root, maxtime, 0);
+}
+
+
+// Applies an SPR to a copy of a tree and returns the copy with the
+// mapping from the nodes of the tree to those of the copy
+static LocalTree *apply_spr_copy(const LocalTree *tree, const Spr &spr,
+                                 int **mapping)
+{
+    LocalTree *tree2 = new LocalTree(*tree);
+    *mapping = new int [tree->nnodes];
+    for (int i=0; i<tree->nnodes; i++)
+        (*mapping)[i] = i;
+    (*mapping)[tree->nodes[spr.recomb_node].parent] = -1;
+    apply_spr(tree2, spr);
+    return tree2;
+}
+
+
+// Joins 'trees2' onto 'trees' where the two overlap, although their trees
+// differ there.  'trees' is cut before 'pos' and 'trees2' is cut at 'pos'.
+// The last tree of 'trees' is turned into the first tree of 'trees2' by
+// SPRs over the bases just before 'pos': every leaf in turn is regrafted
+// above the root at the oldest age of both trees, which gives the same
+// comb whatever the tree, and the moves that give this comb from the tree
+// of 'trees2' are then undone.  The ARG is valid but unlikely around
+// 'pos', and is meant to be resampled.  Requires 'trees' to start before
+// and 'trees2' to start at least 2 * nleaves + 1 bases before 'pos'.
+// trees2 is then empty.
+void stitch_local_trees(LocalTrees *trees, LocalTrees *trees2, int pos)
+{
+    const int nleaves = trees->get_num_leaves();
+    const int path_start = pos - 2 * nleaves - 1;
+    assert(trees->nnodes == trees2->nnodes);
+    assert(trees->start_coord < path_start && pos <= trees->end_coord);
+    assert(trees2->start_coord <= path_start && pos < trees2->end_coord);
+
+    // cut trees before the path and trees2 at pos
+    delete partition_local_trees(trees, path_start);
+    if (trees->back().blocklen == 0) {
+        // extend stub (zero length block)
+        trees->back().blocklen++;
+        trees->end_coord++;
+    }
+    LocalTrees *trees3 = partition_local_trees(trees2, pos);
+    trees2->clear();
+    trees2->end_coord = trees2->start_coord;
+
+    const LocalTree *first_tree = trees->back().tree;
+    const LocalTree *last_tree = trees3->front().tree;
+    const int maxtime = max(first_tree->nodes[first_tree->root].age,
+                            last_tree->nodes[last_tree->root].age);
+
+    // moves from the first tree to the comb
+    vector<LocalTreeSpr> path;
+    const LocalTree *tree = first_tree;
+    for (int i=0; i<nleaves; i++) {
+        Spr spr = get_root_leaf_spr(tree, i, maxtime);
+        if (spr.is_null())
+            continue;
+        int *mapping;
+        LocalTree *tree2 = apply_spr_copy(tree, spr, &mapping);
+        path.push_back(LocalTreeSpr(tree2, spr, 1, mapping));
+        tree = tree2;
+    }
+
+    // moves from the last tree to the comb, undone in reverse order as
+    // moves of the leaf back above its former sibling
+    vector<LocalTree*> last_path(1, new LocalTree(*last_tree));
+    vector<Spr> undo;
+    for (int i=0; i<nleaves; i++) {
+        const LocalTree *tree2 = last_path.back();
+        Spr spr = get_root_leaf_spr(tree2, i, maxtime);
+        if (spr.is_null())
+            continue;
+        const int parent = tree2->nodes[i].parent;
+        undo.push_back(Spr(i, tree2->nodes[i].age, tree2->get_sibling(i),
+                           tree2->nodes[parent].age, 0));
+        int *mapping;
+        last_path.push_back(apply_spr_copy(tree2, spr, &mapping));
+        delete [] mapping;
+    }
+    for (int k=undo.size() - 1; k>=0; k--) {
+        // the sibling is named after the current tree, which has the
+        // shape of last_path[k+1]
+        int mapping2[trees->nnodes];
+        map_congruent_trees(last_path[k+1], &trees->seqids[0],
+                            tree, &trees->seqids[0], mapping2);
+        Spr spr = undo[k];
+        spr.coal_node = mapping2[spr.coal_node];
+        int *mapping;
+        LocalTree *tree2 = apply_spr_copy(tree, spr, &mapping);
+        path.push_back(LocalTreeSpr(tree2, spr, 1, mapping));
+        tree = tree2;
+    }
+    for (unsigned int i=0; i<last_path.size(); i++)
+        delete last_path[i];
+
+    if (path.empty()) {
+        // the trees are already the same
+        trees->back().blocklen += pos - trees->end_coord;
+        trees->end_coord = pos;
+    } else {
+        path.back().blocklen += pos - trees->end_coord - path.size();
+        for (unsigned int i=0; i<path.size(); i++)
+            trees->trees.push_back(path[i]);
+        trees->end_coord = pos;
+    }
+
+    append_local_trees(trees, trees3, true);
+    delete trees3;
+}
+
+
 void remove_population_paths(LocalTrees *trees) {
     for (LocalTrees::iterator it=trees->begin();
          it != trees->end(); ++it)
@@ -1238,204 +1710,158 @@ bool write_newick_tree_for_bedfile(FILE *out,
 //=============================================================================
 // read local tree
 
-// find closest time in times array
+// find closest time in times array, which must be increasing like the
+// model time points
 int find_time(double time, const double *times, int ntimes)
 {
-    double mindiff = INFINITY;
-    int mini = -1;
-
-    for (int i=0; i<ntimes; i++) {
-        double diff = fabs(times[i] - time);
-        if (diff < mindiff) {
-            mindiff = diff;
-            mini = i;
-        }
-    }
-    assert(mini != -1);
-
-    return mini;
-}
-
-
-// Iterates through the key-value pairs of a NHX comment
-// NOTE: end is exclusive
-// Example: "key1=value2:key2=value2"
-bool iter_nhx_key_values(char *text, char *end,
-                         char **key, char **key_end,
-                         char **value, char **value_end)
-{
-    if (*key >= end)
-        return false;
-
-    // parse key
-    *key_end = *key;
-    while (**key_end != '=') {
-        if (*key_end == end)
-            return false;
-        (*key_end)++;
-    }
-
-    // parse value
-    *value = *key_end + 1;
-    *value_end = *value;
-    while (*value_end < end && **value_end != ':') (*value_end)++;
-
-    return true;
-}
-
-
-// Parse the node age from a string 'text'
-// NOTE: end is exclusive
-// Example: "&&NHX:age=20"
-bool parse_node_age(char* text, char *end, double *age)
-{
-    // ensure comment begins with "&&NHX:"
-    if (strncmp(text, "&&NHX:", 6) != 0) {
-        return false;
-    }
+    assert(ntimes > 0);
 
-    text += 6;
+    // closest of the first time point >= time and the one before it; ties
+    // go to the earlier time point
+    int i = lower_bound(times, times + ntimes, time) - times;
+    if (i == ntimes || (i > 0 && time - times[i-1] <= times[i] - time))
+        i--;
+    while (i > 0 && times[i-1] == times[i])
+        i--;
 
-    char *key = text;
-    char *key_end, *value, *value_end;
-    while (iter_nhx_key_values(text, end, &key, &key_end, &value, &value_end)){
-        if (strncmp(key, "age", 3) == 0 && key_end - key == 3) {
-            if (sscanf(value, "%lf", age) != 1)
-                return false;
-            else {
-                return true;
-            }
-        }
-
-        key = value_end + 1;
-    }
-
-    return false;
+    return i;
 }
 
 
-// Parse the node age from a string 'text'
+// Parses the age and pop_path of a NHX comment in 'text'
 // NOTE: end is exclusive
-// Example: "&&NHX:pop_path=1"
-bool parse_node_pop_path(char* text, char *end, int *pop_path)
+// Example: "&&NHX:age=20:pop_path=1"
+//
+// A key extends to the next '=' and its value to the next ':'.  Only the
+// first age and pop_path keys are used.
+static void parse_nhx_comment(const char *text, const char *end,
+                              double *age, bool *has_age, int *pop_path)
 {
+    *has_age = false;
     *pop_path = 0; // default pop_path
-    // ensure comment begins with "&&NHX:"
-    if (strncmp(text, "&&NHX:", 6) != 0) {
-        return false;
-    }
-
-    text += 6;
+    if (end - text < 6 || strncmp(text, "&&NHX:", 6) != 0)
+        return;
 
-    char *key = text;
-    char *key_end, *value, *value_end;
-    while (iter_nhx_key_values(text, end, &key, &key_end, &value, &value_end)){
-        if (strncmp(key, "pop_path", 8) == 0 && key_end - key == 8) {
-            if (sscanf(value, "%d", pop_path) != 1)
-                return false;
-            else {
-                return true;
-            }
+    bool found_age = false, found_pop_path = false;
+    const char *key = text + 6;
+    while (key < end && !(found_age && found_pop_path)) {
+        const char *key_end = (const char*) memchr(key, '=', end - key);
+        if (!key_end)
+            return;
+        const char *value = key_end + 1;
+        const char *value_end = value;
+        while (value_end < end && *value_end != ':')
+            value_end++;
+
+        const int key_len = key_end - key;
+        if (!found_age && key_len == 3 && strncmp(key, "age", 3) == 0) {
+            found_age = true;
+            char *num_end;
+            *age = strtod(value, &num_end);
+            *has_age = (num_end != value);
+        } else if (!found_pop_path && key_len == 8 &&
+                   strncmp(key, "pop_path", 8) == 0) {
+            found_pop_path = true;
+            char *num_end;
+            long val = strtol(value, &num_end, 10);
+            if (num_end != value)
+                *pop_path = val;
         }
 
         key = value_end + 1;
     }
-    return false;
 }
 
 
-// Parses a local tree from a newick string
+// Parses a local tree from a newick string in a single pass.  Node ages
+// and populations are read from NHX comments, e.g. "0[&&NHX:age=20]".
 bool parse_local_tree(const char* newick, LocalTree *tree,
                       const double *times, int ntimes)
 {
-    const int len = strlen(newick);
-    vector<int> ptree;
-    vector<int> ages;
+    // nodes in the order of the newick string
+    struct ParsedNode {
+        int parent;
+        int age;
+        int name;
+        int pop_path;
+    };
+    const ParsedNode new_node = {-1, -1, -1, 0};
+    vector<ParsedNode> nodes;
     vector<int> stack;
-    vector<int> names;
-    vector<int> pop_paths;
+    nodes.reserve(max(tree->capacity, 1));
 
     // create root node
-    ptree.push_back(-1);
-    ages.push_back(-1);
-    names.push_back(-1);
-    pop_paths.push_back(0);
+    nodes.push_back(new_node);
     int node = 0;
+    char last = '(';
 
-    for (int i=0; i<len; i++) {
-        switch (newick[i]) {
+    for (const char *p = newick; *p; p++) {
+        switch (*p) {
         case '(': // new branchset
-            ptree.push_back(node);
-            ages.push_back(-1);
-            pop_paths.push_back(0);
-            names.push_back(-1);
+            nodes.push_back(new_node);
+            nodes.back().parent = node;
             stack.push_back(node);
-            node = ptree.size() - 1;
+            node = nodes.size() - 1;
             break;
 
         case ',': // another branch
-            ptree.push_back(stack.back());
-            ages.push_back(-1);
-            pop_paths.push_back(0);
-            names.push_back(-1);
-            node = ptree.size() - 1;
+            if (stack.empty())
+                return false;
+            nodes.push_back(new_node);
+            nodes.back().parent = stack.back();
+            node = nodes.size() - 1;
             break;
 
         case ')': // optional name next
+            if (stack.empty())
+                return false;
             node = stack.back();
             stack.pop_back();
             break;
 
         case ':': // optional dist next
+        case ';':
             break;
 
         case '[': { // comment next
-            int j = i + 1;
-            while (j<len && newick[j] != ']') j++;
-
-            double age;
-            if (newick[j] == ']') {
-                // parse age field
-                if (parse_node_age((char*) &newick[i+1],
-                                   (char*) &newick[j], &age))
-                    ages[node] = find_time(age, times, ntimes);
-                parse_node_pop_path((char*) &newick[i+1],
-                                    (char*) &newick[j], &(pop_paths[node]));
-                i = j;
-            } else {
-                // error, quit early
+            const char *end = strchr(p + 1, ']');
+            if (!end) {
                 printError("bad newick: malformed NHX comment");
-                i = len;
+                return false;
             }
+            double age;
+            bool has_age;
+            parse_nhx_comment(p + 1, end, &age, &has_age,
+                              &nodes[node].pop_path);
+            if (has_age)
+                nodes[node].age = find_time(age, times, ntimes);
+            p = end;
             } break;
 
-
-        case ';':
-            break;
-
         default: {
-            char last = newick[i-1];
-
             // skip leading whitespace
-            while (newick[i] == ' ') i++;
-            int j = i;
-            // find end of token
-            while (j < len && !inChars(newick[j], ")(,:;[")) j++;
+            while (*p == ' ') p++;
 
             if (last == ')' || last == '(' || last == ',') {
                 // name
-                if (sscanf(&newick[i], "%d", &names[node]) != 1) {
-                    // error, quit early
+                char *end;
+                long name = strtol(p, &end, 10);
+                if (end == p) {
                     printError("bad newick: node name is not an integer");
-                    i = len;
+                    return false;
                 }
+                nodes[node].name = name;
             } else if (last == ':') {
                 // ignore distance
             }
 
-            i = j - 1;
+            // find end of token
+            while (*p && !inChars(*p, ")(,:;["))
+                p++;
+            p--;
         }
         }
+        last = *p;
     }
 
     if (stack.size() != 0)
@@ -1443,37 +1869,35 @@ bool parse_local_tree(const char* newick, LocalTree *tree,
 
 
     // fill in local tree data structure
-    int nnodes = ptree.size();
+    int nnodes = nodes.size();
     tree->clear();
 
-    // add nodes to tree
-    int *order = &names[0];
-
     tree->ensure_capacity(nnodes);
     tree->nnodes = nnodes;
 
     for (int i=0; i<nnodes; i++) {
-        int j = order[i];
-        if (j == -1) {
+        int j = nodes[i].name;
+        if (j < 0 || j >= nnodes) {
             printError("unexpected error (%d)", i);
             return false;
         }
-        if (ptree[i] != -1)
-            tree->nodes[j].parent = order[ptree[i]];
+        if (nodes[i].parent != -1)
+            tree->nodes[j].parent = nodes[nodes[i].parent].name;
         else {
             tree->nodes[j].parent = -1;
             tree->root = j;
         }
-        tree->nodes[j].age = ages[i];
+        tree->nodes[j].age = nodes[i].age;
         tree->nodes[j].child[0] = -1;
         tree->nodes[j].child[1] = -1;
-        tree->nodes[j].pop_path = pop_paths[i];
+        tree->nodes[j].pop_path = nodes[i].pop_path;
     }
 
     // set children
     for (int i=0; i<nnodes; i++) {
-        if (ptree[i] != -1) {
-            if (tree->add_child(order[ptree[i]], order[i]) == -1) {
+        if (nodes[i].parent != -1) {
+            if (tree->add_child(nodes[nodes[i].parent].name,
+                                nodes[i].name) == -1) {
                 printError("local tree is not binary");
                 return false;
             }
@@ -1506,9 +1930,39 @@ void write_local_tree(const LocalTree *tree) {
 }
 
 
+// Writes a node of an SPR record as a leaf below it and the number of
+// steps up from that leaf
+static void write_bed_spr_node(FILE *out, const LocalTree *tree,
+                               const char *const *names, int node)
+{
+    int up = 0;
+    while (!tree->nodes[node].is_leaf()) {
+        node = tree->nodes[node].child[0];
+        up++;
+    }
+    fprintf(out, "\t%s\t%d", names[node], up);
+}
+
+
+static void write_bed_spr_record(FILE *out, const LocalTree *tree,
+                                 const char *const *names,
+                                 const ArgModel *model, const Spr &spr)
+{
+    fprintf(out, "%s", BED_SPR_RECORD);
+    if (spr.is_null())
+        return;
+    write_bed_spr_node(out, tree, names, spr.recomb_node);
+    fprintf(out, "\t%.1f", model->times[spr.recomb_time]);
+    write_bed_spr_node(out, tree, names, spr.coal_node);
+    fprintf(out, "\t%.1f", model->times[spr.coal_time]);
+    fprintf(out, "\t%d", model->pop_tree != NULL ? spr.pop_path : 0);
+}
+
+
 void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
                               const vector<string> seqnames,
-                              const ArgModel *model, int sample) {
+                              const ArgModel *model, int sample,
+                              int spr_keyframe) {
     const int nnodes = trees->nnodes;
     char **nodeids = new char* [nnodes];
     int i = 0;
@@ -1523,6 +1977,9 @@ void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
         nodeids[i][0]='\0';
     }
 
+    if (spr_keyframe > 0)
+        fprintf(out, BED_SPR_HEADER "%d\n", spr_keyframe);
+
     int end = trees->start_coord;
     for (LocalTrees::const_iterator it=trees->begin();
          it != trees->end(); ++it)
@@ -1532,6 +1989,13 @@ void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
         assert(it->blocklen > 0);
         LocalTree *tree = it->tree;
 
+        // write a newick tree unless this tree follows from the previous
+        // one by an SPR, and does not overlap a keyframe position
+        bool keyframe = (spr_keyframe <= 0 || it == trees->begin() ||
+                         it->spr.is_null() ||
+                         (start + spr_keyframe - 1) / spr_keyframe *
+                         spr_keyframe < end);
+
         if (end - start > 0) {
             fprintf(out, "%s\t%i\t%i\t%i\t",
                     trees->chrom.c_str(), start, end, sample);
@@ -1544,7 +2008,10 @@ void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
                 spr.set_null();
             }
 
-            write_newick_tree_for_bedfile(out, tree, nodeids, model, spr);
+            if (keyframe)
+                write_newick_tree_for_bedfile(out, tree, nodeids, model, spr);
+            else
+                write_bed_spr_record(out, tree, nodeids, model, spr);
             fprintf(out, "\n");
         }
     }
@@ -1556,6 +2023,24 @@ void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
 }
 
 
+// Carries the output node numbering of a tree over to the next tree
+static void update_total_mapping(const LocalTree *tree, const Spr &spr,
+                                 const int *mapping, int nnodes,
+                                 int *total_mapping, int *tmp_mapping)
+{
+    for (int i=0; i<nnodes; i++)
+        tmp_mapping[i] = total_mapping[i];
+    for (int i=0; i<nnodes; i++) {
+        if (mapping[i] != -1)
+            total_mapping[mapping[i]] = tmp_mapping[i];
+        else {
+            int recoal = get_recoal_node(tree, spr, mapping);
+            total_mapping[recoal] = tmp_mapping[i];
+        }
+    }
+}
+
+
 void write_local_trees(FILE *out, const LocalTrees *trees,
                        const char *const *names, const double *times,
                        bool pop_model, const vector<int> &self_recomb_pos,
@@ -1638,18 +2123,8 @@ void write_local_trees(FILE *out, const LocalTrees *trees,
                 fprintf(out, "\t%i", spr.pop_path);
             fprintf(out, "\n");
 
-            // update total mapping
-            int *mapping = it2->mapping;
-            for (int i=0; i<nnodes; i++)
-                tmp_mapping[i] = total_mapping[i];
-            for (int i=0; i<nnodes; i++) {
-                if (mapping[i] != -1)
-                    total_mapping[mapping[i]] = tmp_mapping[i];
-                else {
-                    int recoal = get_recoal_node(tree, spr, mapping);
-                    total_mapping[recoal] = tmp_mapping[i];
-                }
-            }
+            update_total_mapping(tree, spr, it2->mapping, nnodes,
+                                 total_mapping, tmp_mapping);
         }
     }
 
@@ -1729,10 +2204,340 @@ bool write_local_trees(const char *filename, const LocalTrees *trees,
 }
 
 
+//=============================================================================
+// binary local trees
+//
+// The binary SMC format stores the same information as the text format
+// without newick strings:
+//
+//   magic "\x89SMC"
+//   int     version, nnodes, nnames, ntrees, start_coord, end_coord,
+//           ntimes, ninvisible
+//   string  chrom, names[nnames]     (int length followed by characters)
+//   double  times[ntimes]
+//   int     tree_starts[ntrees]      (0-based start of each tree)
+//   ntrees x tree records:
+//     int   spr[5]                   (recomb_node, recomb_time, coal_node,
+//                                     coal_time, pop_path)
+//     int   nodes[nnodes][5]         (parent, child[0], child[1], age,
+//                                     pop_path)
+//   int     invisible[ninvisible][6] (pos, followed by an spr)
+//
+// Values are in host byte order and ages are indices into 'times'.  Node
+// ids are renumbered as in the text format, so the node arrays of a tree
+// can be read as is.
+
+static const char BINARY_SMC_MAGIC[] = "\x89SMC";
+static const int BINARY_SMC_VERSION = 1;
+
+
+static bool write_ints(FILE *out, const int *values, int n)
+{
+    return (int) fwrite(values, sizeof(int), n, out) == n;
+}
+
+static bool write_string(FILE *out, const string &str)
+{
+    const int len = str.size();
+    return write_ints(out, &len, 1) &&
+        (int) fwrite(str.data(), 1, len, out) == len;
+}
+
+static void get_spr_record(const Spr &spr, const int *total_mapping,
+                           int *record)
+{
+    record[0] = spr.recomb_node == -1 ? -1 : total_mapping[spr.recomb_node];
+    record[1] = spr.recomb_time;
+    record[2] = spr.coal_node == -1 ? -1 : total_mapping[spr.coal_node];
+    record[3] = spr.coal_time;
+    record[4] = spr.pop_path;
+}
+
+
+bool write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs)
+{
+    const int nnodes = trees->nnodes;
+    const int nnames = names ? trees->get_num_leaves() : 0;
+    assert(self_recomb_pos.size() == self_recombs.size());
+
+    const int header[] = {BINARY_SMC_VERSION, nnodes, nnames,
+                          trees->get_num_trees(),
+                          trees->start_coord, trees->end_coord, ntimes,
+                          (int) self_recombs.size()};
+    bool ok = fwrite(BINARY_SMC_MAGIC, 1, 4, out) == 4 &&
+        write_ints(out, header, sizeof(header) / sizeof(int)) &&
+        write_string(out, trees->chrom);
+    for (int i=0; i<nnames; i++)
+        ok = ok && write_string(out, names[trees->seqids[i]]);
+    ok = ok && (int) fwrite(times, sizeof(double), ntimes, out) == ntimes;
+
+    // coordinate index
+    vector<int> starts;
+    int end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it) {
+        starts.push_back(end);
+        end += it->blocklen;
+    }
+    ok = ok && write_ints(out, &starts[0], starts.size());
+
+    // trees
+    int *total_mapping = new int [nnodes];
+    int *tmp_mapping = new int [nnodes];
+    for (int i=0; i<nnodes; i++)
+        total_mapping[i] = i;
+    vector<int> record(5 + 5 * nnodes);
+    vector<int> invisible;
+    unsigned int self_idx = 0;
+
+    Spr spr;
+    spr.set_null();
+    get_spr_record(spr, total_mapping, &record[0]);
+    end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it)
+    {
+        end += it->blocklen;
+        const LocalTree *tree = it->tree;
+        const LocalNode *nodes = tree->nodes;
+
+        for (int i=0; i<nnodes; i++) {
+            int *node = &record[5 + 5 * total_mapping[i]];
+            const int *c = nodes[i].child;
+            node[0] = nodes[i].parent == -1 ? -1 :
+                total_mapping[nodes[i].parent];
+            node[1] = c[0] == -1 ? -1 : total_mapping[c[0]];
+            node[2] = c[1] == -1 ? -1 : total_mapping[c[1]];
+            node[3] = nodes[i].age;
+            node[4] = nodes[i].pop_path;
+        }
+        ok = ok && write_ints(out, &record[0], record.size());
+
+        while (self_idx < self_recomb_pos.size() &&
+               self_recomb_pos[self_idx] < end) {
+            invisible.push_back(self_recomb_pos[self_idx] + 1);
+            invisible.resize(invisible.size() + 5);
+            get_spr_record(self_recombs[self_idx], total_mapping,
+                           &invisible[invisible.size() - 5]);
+            self_idx++;
+        }
+
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        if (it2 != trees->end()) {
+            // SPR into the next tree, in the numbering of this tree
+            get_spr_record(it2->spr, total_mapping, &record[0]);
+            update_total_mapping(tree, it2->spr, it2->mapping, nnodes,
+                                 total_mapping, tmp_mapping);
+        }
+    }
+    assert(invisible.size() == 6 * self_recombs.size());
+    ok = ok && write_ints(out, &invisible[0], invisible.size());
+
+    delete [] tmp_mapping;
+    delete [] total_mapping;
+    return ok;
+}
+
+
+bool write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const Sequences &seqs,
+                              const double *times, int ntimes,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs)
+{
+    // setup names, using ids for unnamed sequences
+    const unsigned int nleaves = trees->get_num_leaves();
+    vector<string> ids(nleaves);
+    vector<const char*> names(nleaves);
+    for (unsigned int i=0; i<nleaves; i++) {
+        if (i < seqs.names.size()) {
+            names[i] = seqs.names[i].c_str();
+        } else {
+            char id[11];
+            snprintf(id, sizeof(id), "%d", i);
+            ids[i] = id;
+            names[i] = ids[i].c_str();
+        }
+    }
+
+    return write_local_trees_binary(out, trees, &names[0], times, ntimes,
+                                    self_recomb_pos, self_recombs);
+}
+
+
 //=============================================================================
 // read local trees
 
 
+static bool read_ints(FILE *infile, int *values, int n)
+{
+    return (int) fread(values, sizeof(int), n, infile) == n;
+}
+
+static bool read_string(FILE *infile, string *str)
+{
+    int len;
+    if (!read_ints(infile, &len, 1) || len < 0)
+        return false;
+    str->resize(len);
+    return len == 0 || (int) fread(&(*str)[0], 1, len, infile) == len;
+}
+
+// Converts a stored spr record, mapping its times onto the model times.
+static bool read_spr_record(const int *record, const vector<int> &time_map,
+                            int nnodes, Spr *spr)
+{
+    spr->recomb_node = record[0];
+    spr->coal_node = record[2];
+    spr->pop_path = record[4];
+    if (spr->recomb_node == -1) {
+        spr->set_null();
+        return true;
+    }
+    if (record[1] < 0 || record[1] >= (int) time_map.size() ||
+        record[3] < 0 || record[3] >= (int) time_map.size() ||
+        spr->recomb_node < 0 || spr->recomb_node >= nnodes ||
+        spr->coal_node < 0 || spr->coal_node >= nnodes)
+        return false;
+    spr->recomb_time = time_map[record[1]];
+    spr->coal_time = time_map[record[3]];
+    return true;
+}
+
+
+// Reads local trees in the binary SMC format
+static bool read_local_trees_binary(FILE *infile, const double *times,
+                                    int ntimes, LocalTrees *trees,
+                                    vector<string> &seqnames,
+                                    vector<int> *invisible_recomb_pos,
+                                    vector<Spr> *invisible_recombs)
+{
+    // node arrays are read directly into LocalNode arrays
+    static_assert(sizeof(LocalNode) == 5 * sizeof(int),
+                  "LocalNode must be five ints");
+
+    char magic[4];
+    int header[8];
+    if (fread(magic, 1, 4, infile) != 4 ||
+        memcmp(magic, BINARY_SMC_MAGIC, 4) != 0 ||
+        !read_ints(infile, header, 8)) {
+        printError("bad binary SMC header");
+        return false;
+    }
+    if (header[0] != BINARY_SMC_VERSION) {
+        printError("unsupported binary SMC version %d", header[0]);
+        return false;
+    }
+    const int nnodes = header[1];
+    const int nnames = header[2];
+    const int ntrees = header[3];
+    const int ntimes2 = header[6];
+    const int ninvisible = header[7];
+    trees->start_coord = header[4];
+    trees->end_coord = header[5];
+    if (nnodes <= 0 || nnames < 0 || ntrees < 0 || ntimes2 <= 0 ||
+        ninvisible < 0 || !read_string(infile, &trees->chrom)) {
+        printError("bad binary SMC header");
+        return false;
+    }
+
+    seqnames.resize(nnames);
+    for (int i=0; i<nnames; i++) {
+        if (!read_string(infile, &seqnames[i])) {
+            printError("bad binary SMC names");
+            return false;
+        }
+    }
+
+    // map stored time indices onto the model times
+    vector<double> times2(ntimes2);
+    vector<int> starts(ntrees);
+    if ((int) fread(&times2[0], sizeof(double), ntimes2, infile) != ntimes2 ||
+        !read_ints(infile, &starts[0], ntrees)) {
+        printError("bad binary SMC header");
+        return false;
+    }
+    vector<int> time_map(ntimes2);
+    for (int i=0; i<ntimes2; i++)
+        time_map[i] = find_time(times2[i], times, ntimes);
+
+    LocalTree *last_tree = NULL;
+    for (int k=0; k<ntrees; k++) {
+        int record[5];
+        Spr spr;
+        if (!read_ints(infile, record, 5) ||
+            !read_spr_record(record, time_map, nnodes, &spr) ||
+            (k == 0) != spr.is_null()) {
+            printError("bad SPR in binary SMC (tree %d)", k);
+            return false;
+        }
+
+        LocalTree *tree = new LocalTree(nnodes);
+        LocalNode *nodes = tree->nodes;
+        if ((int) fread(nodes, sizeof(LocalNode), nnodes, infile) != nnodes) {
+            printError("bad binary SMC tree (tree %d)", k);
+            delete tree;
+            return false;
+        }
+        bool ok = true;
+        for (int i=0; i<nnodes; i++) {
+            if (nodes[i].age < 0 || nodes[i].age >= ntimes2) {
+                ok = false;
+                break;
+            }
+            nodes[i].age = time_map[nodes[i].age];
+            if (nodes[i].parent == -1)
+                tree->root = i;
+        }
+        if (!ok || !assert_tree(tree)) {
+            printError("bad binary SMC tree (tree %d)", k);
+            delete tree;
+            return false;
+        }
+
+        // setup mapping
+        int *mapping = NULL;
+        if (!spr.is_null()) {
+            mapping = new int [nnodes];
+            for (int i=0; i<nnodes; i++)
+                mapping[i] = i;
+            if (spr.recomb_node != spr.coal_node)
+                mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
+        }
+
+        const int end = (k + 1 < ntrees ? starts[k+1] : trees->end_coord);
+        trees->trees.push_back(LocalTreeSpr(tree, spr, end - starts[k],
+                                            mapping));
+        last_tree = tree;
+    }
+
+    for (int i=0; i<ninvisible; i++) {
+        int record[6];
+        Spr ispr;
+        if (!read_ints(infile, record, 6) ||
+            !read_spr_record(record + 1, time_map, nnodes, &ispr)) {
+            printError("bad invisible recombination in binary SMC");
+            return false;
+        }
+        if (invisible_recombs != NULL) {
+            invisible_recombs->push_back(ispr);
+            invisible_recomb_pos->push_back(record[0]);
+        }
+    }
+
+    if (trees->get_num_trees() > 0) {
+        trees->nnodes = nnodes;
+        trees->set_default_seqids();
+    }
+    return true;
+}
+
+
 bool read_local_trees(FILE *infile, const double *times, int ntimes,
                       LocalTrees *trees, vector<string> &seqnames,
                       vector<int> *invisible_recomb_pos,
@@ -1747,6 +2552,16 @@ bool read_local_trees(FILE *infile, const double *times, int ntimes,
     // init tree
     seqnames.clear();
     trees->clear();
+
+    // detect binary format
+    const int c = getc(infile);
+    if (c != EOF)
+        ungetc(c, infile);
+    if (c == (unsigned char) BINARY_SMC_MAGIC[0])
+        return read_local_trees_binary(infile, times, ntimes, trees,
+                                       seqnames, invisible_recomb_pos,
+                                       invisible_recombs);
+
     LocalTree *last_tree = NULL;
 
     int nnodes = 0;
@@ -2328,6 +3143,23 @@ LocalTrees *arghmm_new_trees(
 }
 
 
+// Same as arghmm_new_trees(), with trees given by contiguous arrays of
+// ntrees rows: ptrees and ages of nnodes values and sprs of 4 values
+LocalTrees *arghmm_new_trees_buffer(
+    int *ptrees, int *ages, int *sprs, int *blocklens,
+    int ntrees, int nnodes, int start_coord)
+{
+    vector<int*> ptree_rows(ntrees), age_rows(ntrees), spr_rows(ntrees);
+    for (int i=0; i<ntrees; i++) {
+        ptree_rows[i] = &ptrees[long(i) * nnodes];
+        age_rows[i] = &ages[long(i) * nnodes];
+        spr_rows[i] = &sprs[long(i) * 4];
+    }
+    return arghmm_new_trees(&ptree_rows[0], &age_rows[0], &spr_rows[0],
+                            blocklens, ntrees, nnodes, start_coord);
+}
+
+
 LocalTrees *arghmm_copy_trees(LocalTrees *trees)
 {
     LocalTrees *trees2 = new LocalTrees();
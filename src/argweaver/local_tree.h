@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <list>
 #include <vector>
+#include <string>
 #include <string.h>
 #include <stdio.h>
 
@@ -157,6 +158,16 @@ public:
 extern LocalNode null_node;
 
 
+// Node arrays of local trees are allocated from a shared pool.  Arrays
+// are carved out of large contiguous slabs and recycled through
+// per-capacity free lists, so the trees of an ARG built together lie
+// next to each other in memory and copying or clearing a LocalTrees does
+// not call malloc/free for every block.  Slabs are kept for the lifetime
+// of the process.
+LocalNode *alloc_local_nodes(int capacity);
+void free_local_nodes(LocalNode *nodes, int capacity);
+
+
 // A local tree in a set of local trees
 //
 //   Leaves are always listed first in nodes array
@@ -176,9 +187,9 @@ public:
         capacity(capacity),
         root(-1)
     {
-        if (capacity < nnodes)
-            capacity = nnodes;
-        nodes = new LocalNode [capacity];
+        if (this->capacity < nnodes)
+            this->capacity = nnodes;
+        nodes = alloc_local_nodes(this->capacity);
     }
 
 
@@ -204,7 +215,7 @@ public:
 
     ~LocalTree() {
         if (nodes) {
-            delete [] nodes;
+            free_local_nodes(nodes, capacity);
             nodes = NULL;
         }
     }
@@ -214,9 +225,8 @@ public:
                    int _capacity=-1)
     {
         // delete existing nodes if they exist
-        if (nodes) {
-	    delete [] nodes;
-	}
+        if (nodes)
+            free_local_nodes(nodes, capacity);
 
         nnodes = _nnodes;
         if (_capacity >= 0)
@@ -224,7 +234,7 @@ public:
         if (capacity < nnodes)
             capacity = nnodes;
 
-        nodes = new LocalNode [capacity];
+        nodes = alloc_local_nodes(capacity);
 
         // populate parent pointers
         for (int i=0; i<nnodes; i++) {
@@ -277,11 +287,13 @@ public:
         if (_capacity == capacity)
             return;
 
-        LocalNode *tmp = new LocalNode[_capacity];
+        LocalNode *tmp = alloc_local_nodes(_capacity);
 	assert(tmp);
 
-        std::copy(nodes, nodes + capacity, tmp);
-        delete [] nodes;
+        if (nodes) {
+            std::copy(nodes, nodes + std::min(capacity, _capacity), tmp);
+            free_local_nodes(nodes, capacity);
+        }
 
         nodes = tmp;
         capacity = _capacity;
@@ -466,14 +478,18 @@ public:
         spr(ispr[0], ispr[1], ispr[2], ispr[3]),
         mapping(mapping),
         blocklen(blocklen)
-    {}
+    {
+        prior_terms[0] = prior_terms[1] = 0.0;
+    }
 
      LocalTreeSpr(LocalTree *tree, Spr spr, int blocklen, int *mapping=NULL) :
         tree(tree),
         spr(spr),
         mapping(mapping),
         blocklen(blocklen)
-    {}
+    {
+        prior_terms[0] = prior_terms[1] = 0.0;
+    }
 
     // deallocate associated data
     void clear() {
@@ -520,6 +536,12 @@ public:
     Spr spr;          // SPR operation to the left of local tree
     int *mapping;     // node mapping between previous tree and this tree
     int blocklen;     // length of sequence block
+
+    // prior terms of the block and of the SPR after it, kept by
+    // calc_arg_prior() with a key of everything they depend on, so that
+    // changing the tree, its neighbours or the model discards them
+    mutable string prior_key;
+    mutable double prior_terms[2];
 };
 
 
@@ -592,6 +614,17 @@ public:
     // Copy trees from another set of local trees
     void copy(const LocalTrees &other);
 
+    // Exchange trees with another set of local trees without copying
+    void swap(LocalTrees &other)
+    {
+        chrom.swap(other.chrom);
+        std::swap(start_coord, other.start_coord);
+        std::swap(end_coord, other.end_coord);
+        std::swap(nnodes, other.nnodes);
+        trees.swap(other.trees);
+        seqids.swap(other.seqids);
+    }
+
     // deallocate local trees
     void clear()
     {
@@ -715,6 +748,11 @@ void count_lineages_internal(const LocalTree *tree, int ntimes,
                              int *nbranches, int *nrecombs,
                              int **nbranches_pop, int **ncoals_pop,
                              const PopulationTree *pop_tree);
+void update_lineages(const LocalTree *last_tree, const LocalTree *tree,
+                     const int *mapping, int ntimes,
+                     int *nbranches, int *nrecombs,
+                     int **nbranches_pop, int **ncoals_pop,
+                     const PopulationTree *pop_tree, bool internal);
  void remove_population_paths(LocalTrees *trees);
 
 
@@ -759,6 +797,17 @@ public:
                            nbranches_pop, ncoals_pop, pop_tree);
     }
 
+    // Updates the counts of last_tree to those of tree, where mapping
+    // maps the nodes of last_tree to tree (as for an SPR).  Only branches
+    // that changed are recounted.
+    inline void update(const LocalTree *last_tree, const LocalTree *tree,
+                       const int *mapping, const PopulationTree *pop_tree,
+                       bool internal=false) {
+        update_lineages(last_tree, tree, mapping, ntimes, nbranches,
+                        nrecombs, nbranches_pop, ncoals_pop, pop_tree,
+                        internal);
+    }
+
     int ntimes;       // number of time points
     int npops;        // number of populations
     int *nbranches;  // number of branches per time slice
@@ -779,6 +828,9 @@ void count_mig_events(int from_pop, int to_pop, int time_idx2,
 
 void apply_spr(LocalTree *tree, const Spr &spr,
                const PopulationTree *pop_tree=NULL);
+void update_postorder(const LocalTree *tree, const Spr &spr, int *order);
+bool is_spr_mapping(const LocalTree *last_tree, const Spr &spr,
+                    const int *mapping);
 double get_treelen(const LocalTree *tree, const double *times, int ntimes,
                     bool use_basal=true);
 double get_treelen_internal(const LocalTree *tree, const double *times,
@@ -804,6 +856,9 @@ void repair_spr(const LocalTree *last_tree, const LocalTree *tree, Spr &spr,
 
 bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
                      const PopulationTree *pop_tree);
+LocalTrees::iterator remove_null_spr_run(LocalTrees *trees,
+                                         LocalTrees::iterator it,
+                                         const PopulationTree *pop_tree);
 void remove_null_sprs(LocalTrees *trees, const PopulationTree *pop_tree);
 void get_inverse_mapping(const int *mapping, int size, int *inv_mapping);
 
@@ -813,6 +868,7 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos,
 LocalTrees *partition_local_trees(LocalTrees *trees, int pos, bool trim=true);
 void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge=true,
                         const PopulationTree *pop_tree=NULL);
+void stitch_local_trees(LocalTrees *trees, LocalTrees *trees2, int pos);
 
 void uncompress_local_trees(LocalTrees *trees,
                             const SitesMapping *sites_mapping);
@@ -854,7 +910,9 @@ bool write_newick_tree(const char *filename, const LocalTree *tree,
                        bool oneline, bool pop_model=false);
 void write_local_trees(FILE *out, const LocalTrees *trees,
                        const char *const *names, const double *times,
-                       bool pop_model=false);
+                       bool pop_model=false,
+                       const vector<int> &self_recomb_pos=vector<int>(),
+                       const vector<Spr> &self_recombs=vector<Spr>());
 bool write_local_trees(const char *filename, const LocalTrees *trees,
                        const char *const *names, const double *times,
                        bool pop_model=false,
@@ -870,6 +928,19 @@ bool write_local_trees(const char *filename, const LocalTrees *trees,
                        bool pop_model=false,
                        const vector<int> &self_recomb_pos=vector<int>(),
                        const vector<Spr> &self_recombs=vector<Spr>());
+// Writes local trees in the binary SMC format, which read_local_trees()
+// detects and loads without parsing newick strings
+bool write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>());
+bool write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const Sequences &seqs,
+                              const double *times, int ntimes,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>());
+int find_time(double time, const double *times, int ntimes);
 bool parse_local_tree(const char* newick, LocalTree *tree,
                       const double *times, int ntimes);
 bool read_local_trees(FILE *infile, const double *times, int ntimes,
@@ -883,9 +954,30 @@ void write_newick_Tree_for_bedfile(FILE *out, const LocalTree *tree,
                                    const char *const *names,
                                    const ArgModel *model,
                                    const Spr &spr);
+
+// Bed files can give a local tree as the SPR that leads from it to the
+// next tree, instead of as a newick string.  Such files start with the
+// header BED_SPR_HEADER followed by the keyframe spacing, and the tree
+// column of a line is either a newick tree or
+//
+//   SPR <recomb_leaf> <recomb_up> <recomb_time> <coal_leaf> <coal_up>
+//       <coal_time> <pop_path>
+//
+// (tab separated) which applies to the tree obtained by the previous SPR
+// of the same sample.  A node is named by a leaf below it and the number
+// of steps up from that leaf.  A line with only "SPR" has no next SPR.
+// Newick trees are written at the start of each sample, after a missing
+// SPR, and for each tree that overlaps a multiple of the keyframe
+// spacing, so that a region can be read from the keyframe before it.
+#define BED_SPR_HEADER "##spr-keyframe="
+#define BED_SPR_RECORD "SPR"
+
+// Writes an ARG as a bed file.  If spr_keyframe > 0, the trees between
+// keyframes are written as SPR records.
 void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
                               const vector<string> seqnames,
-                              const ArgModel *model, int sample);
+                              const ArgModel *model, int sample,
+                              int spr_keyframe=0);
 
 
 //=============================================================================
@@ -901,6 +993,20 @@ bool assert_spr(const LocalTree *last_tree, const LocalTree *tree,
                    bool pruned_internal=false);
 
 
+//=============================================================================
+// C interface
+extern "C" {
+
+LocalTrees *arghmm_new_trees(
+    int **ptrees, int **ages, int **sprs, int *blocklens,
+    int ntrees, int nnodes, int start_coord);
+LocalTrees *arghmm_new_trees_buffer(
+    int *ptrees, int *ages, int *sprs, int *blocklens,
+    int ntrees, int nnodes, int start_coord);
+
+} // extern "C"
+
+
 
 
 } // namespace argweaver
@@ -16,6 +16,21 @@ namespace argweaver {
 
 Logger g_logger(stderr, LOG_QUIET);
 
+// logger of the calling thread, if not g_logger
+static thread_local Logger *thread_logger = NULL;
+
+Logger *setThreadLogger(Logger *logger)
+{
+    Logger *prev = thread_logger;
+    thread_logger = logger;
+    return prev;
+}
+
+Logger &getLogger()
+{
+    return thread_logger ? *thread_logger : g_logger;
+}
+
 
 void Logger::printTimerLog(const Timer &timer, int level, const char *fmt, ...)
 {
@@ -64,14 +79,15 @@ void Logger::printTimerLog(const Timer &timer, int level, const char *fmt,
 void printLog(int level, const char *fmt, ...)
 {
     va_list ap;
+    Logger &root = getLogger();
 
-    if (g_logger.isLogLevel(level)) {
+    if (root.isLogLevel(level)) {
         va_start(ap, fmt);
-        g_logger.printLog(level, fmt, ap);
+        root.printLog(level, fmt, ap);
         va_end(ap);
     }
 
-    Logger *logger = g_logger.getChain();
+    Logger *logger = root.getChain();
     if (logger && logger->isLogLevel(level)) {
         va_start(ap, fmt);
         logger->printLog(level, fmt, ap);
@@ -83,14 +99,15 @@ void printLog(int level, const char *fmt, ...)
 void printTimerLog(const Timer &timer, int level, const char *fmt, ...)
 {
     va_list ap;
+    Logger &root = getLogger();
 
-    if (g_logger.isLogLevel(level)) {
+    if (root.isLogLevel(level)) {
         va_start(ap, fmt);
-        g_logger.printTimerLog(timer, level, fmt, ap);
+        root.printTimerLog(timer, level, fmt, ap);
         va_end(ap);
     }
 
-    Logger *logger = g_logger.getChain();
+    Logger *logger = root.getChain();
     if (logger && logger->isLogLevel(level)) {
         va_start(ap, fmt);
         logger->printTimerLog(timer, level, fmt, ap);
@@ -105,7 +122,7 @@ void printError(const char *fmt, va_list ap)
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
 
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
 }
 
 void printWarning(const char *fmt, va_list ap)
@@ -114,7 +131,7 @@ void printWarning(const char *fmt, va_list ap)
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
 
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
 }
 
 
@@ -128,7 +145,7 @@ void printError(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
 }
 
@@ -142,7 +159,7 @@ void printWarning(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
 }
 
@@ -164,7 +181,7 @@ void exitError(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
     exit(1);
 }
@@ -224,26 +224,35 @@ protected:
 
 extern Logger g_logger;
 
+// Makes the global logging functions below log the messages of the
+// calling thread to 'logger' instead of g_logger, so that threads can
+// keep logs of their own.  NULL restores g_logger.  Returns the previous
+// logger of the thread.
+Logger *setThreadLogger(Logger *logger);
+
+// Returns the logger of the calling thread
+Logger &getLogger();
+
 inline bool openLogFile(const char *filename, const char* mode="w")
-{ return g_logger.openLogFile(filename, mode); }
+{ return getLogger().openLogFile(filename, mode); }
 
 inline void openLogFile(FILE *stream)
-{ return g_logger.openLogFile(stream); }
+{ return getLogger().openLogFile(stream); }
 
 inline void closeLogFile()
-{ g_logger.closeLogFile(); }
+{ getLogger().closeLogFile(); }
 
 inline FILE *getLogFile()
-{ return g_logger.getLogFile(); }
+{ return getLogger().getLogFile(); }
 
 inline bool isLogLevel(int level)
-{ return g_logger.isLogLevel(level); }
+{ return getLogger().isLogLevel(level); }
 
 inline int incLogLevel()
-{ return g_logger.incLogLevel(); }
+{ return getLogger().incLogLevel(); }
 
 inline int decLogLevel()
-{ return g_logger.decLogLevel(); }
+{ return getLogger().decLogLevel(); }
 
 
 // global function API
@@ -1,15 +1,30 @@
 
 
 #include "matrices.h"
+#include "profile.h"
 
 namespace argweaver {
 
+// Sets 'states' to the states of the tree of a block, taken from the cache
+// if it is given
+static void get_block_states(const StatesModel &states_model,
+                             const LocalTreeSpr *tree_spr,
+                             StatesCache *states_cache, States &states)
+{
+    if (states_cache)
+        states = states_cache->get_coal_states(states_model, tree_spr);
+    else
+        states_model.get_coal_states(tree_spr->tree, states);
+}
+
+
 // calculate transition and emission matrices for current block
 void calc_arghmm_matrices_internal(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, int minage,
-    ArgHmmMatrices *matrices, PhaseProbs *phase_pr)
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, bool stream_emit,
+    StatesCache *states_cache)
 {
     const bool internal = true;
 
@@ -20,9 +35,9 @@ void calc_arghmm_matrices_internal(
 
     LineageCounts lineages(model->ntimes, model->num_pops());  // only allocates
     States last_states;
-    States states;
+    States &states = matrices->states;
     matrices->states_model.set(model->ntimes, internal, minage, model->pop_tree);
-    matrices->states_model.get_coal_states(tree, states);
+    get_block_states(matrices->states_model, tree_spr, states_cache, states);
     const int nstates = states.size();
 
     // calculate emissions
@@ -32,12 +47,13 @@ void calc_arghmm_matrices_internal(
 	//	int phase_nodes[2]={-1,-1};
         for (int i=0; i<nleaves; i++)
             subseqs[i] = &seqs->seqs[trees->seqids[i]][start];
-        matrices->emit = new_matrix<double>(blocklen, max(nstates, 1));
         if (model->unphased && phase_pr != NULL)
             phase_pr->offset = start;
         vector<vector<BaseProbs> > sub_base_probs;
         sub_base_probs.clear();
-        if (seqs->base_probs.size() > 0) {
+        // the emissions of a fully determined subtree (no states) do not
+        // depend on the sequences
+        if (seqs->base_probs.size() > 0 && nstates > 0) {
             for (int i=0; i < nleaves; i++) {
                 vector<BaseProbs>::const_iterator first =
                     seqs->base_probs[trees->seqids[i]].begin() + start;
@@ -46,8 +62,18 @@ void calc_arghmm_matrices_internal(
                 sub_base_probs.push_back(vector<BaseProbs>(first,last));
             }
         }
-	calc_emissions_internal(states, tree, subseqs, sub_base_probs, nleaves,
-                                blocklen, model, matrices->emit, phase_pr);
+        // large blocks are computed up front if several threads are used
+        if (stream_emit &&
+            !use_threaded_emissions(model, blocklen, phase_pr)) {
+            matrices->site_emit = new SiteEmissions(
+                states, tree, subseqs, sub_base_probs, nleaves, blocklen,
+                model, true, phase_pr);
+        } else {
+            matrices->emit = new_matrix<double>(blocklen, max(nstates, 1));
+            calc_emissions_internal(states, tree, subseqs, sub_base_probs,
+                                    nleaves, blocklen, model, matrices->emit,
+                                    phase_pr);
+        }
     } else {
         matrices->emit = NULL;
     }
@@ -61,7 +87,8 @@ void calc_arghmm_matrices_internal(
 
     } else {
         const LocalTree *last_tree = last_tree_spr->tree;
-        matrices->states_model.get_coal_states(last_tree, last_states);
+        get_block_states(matrices->states_model, last_tree_spr, states_cache,
+                         last_states);
         matrices->nstates1 = last_states.size();
         matrices->nstates2 = nstates;
         lineages.count(last_tree, model->pop_tree, internal);
@@ -70,19 +97,24 @@ void calc_arghmm_matrices_internal(
         matrices->transmat_switch = new TransMatrixSwitch(
                       matrices->nstates1, matrices->nstates2,
                       model->num_pop_paths());
-        calc_transition_probs_switch_internal(tree, last_tree,
+        get_trans_matrix_switch_cache().calc_transition_probs_switch(
+            matrices->transmat_switch, tree, last_tree,
             tree_spr->spr, tree_spr->mapping,
-            last_states, states, model, &lineages,
-            matrices->transmat_switch);
+            last_states, states, model, &lineages, internal);
     }
 
     // update lineages to current tree
-    lineages.count(tree, model->pop_tree, internal);
+    if (matrices->transmat_switch && tree_spr->mapping)
+        lineages.update(last_tree_spr->tree, tree, tree_spr->mapping,
+                        model->pop_tree, internal);
+    else
+        lineages.count(tree, model->pop_tree, internal);
 
     // calculate transmat and use it for rest of block
     matrices->transmat = new TransMatrix(model, nstates);
-    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
-                          internal, matrices->states_model.minage);
+    get_trans_matrix_cache().calc_transition_probs(
+        matrices->transmat, tree, model, states, &lineages,
+        internal, matrices->states_model.minage);
 }
 
 
@@ -92,7 +124,8 @@ void calc_arghmm_matrices_external(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
-    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, int start_pop)
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, int start_pop,
+    bool stream_emit, StatesCache *states_cache)
 {
     // get block information
     const int blocklen = end - start;
@@ -101,10 +134,10 @@ void calc_arghmm_matrices_external(
 
     LineageCounts lineages(model->ntimes, model->num_pops());
     States last_states;
-    States states;
+    States &states = matrices->states;
     matrices->states_model.set(model->ntimes, false, 0, model->pop_tree,
                                start_pop);
-    matrices->states_model.get_coal_states(tree, states);
+    get_block_states(matrices->states_model, tree_spr, states_cache, states);
     const int nstates = states.size();
 
     // calculate emissions
@@ -114,7 +147,6 @@ void calc_arghmm_matrices_external(
         for (int i=0; i<nleaves; i++)
             subseqs[i] = &seqs->seqs[trees->seqids[i]][start];
         subseqs[nleaves] = &seqs->seqs[new_chrom][start];
-        matrices->emit = new_matrix<double>(blocklen, nstates);
 	if (model->unphased)
 	    phase_pr->offset = start;
         vector<vector<BaseProbs> > sub_base_probs;
@@ -127,9 +159,18 @@ void calc_arghmm_matrices_external(
                 sub_base_probs.push_back(vector<BaseProbs>(first,last));
             }
         }
-        calc_emissions_external(states, tree, subseqs, sub_base_probs,
-                                nleaves + 1, blocklen,
-                                model, matrices->emit, phase_pr);
+        // large blocks are computed up front if several threads are used
+        if (stream_emit &&
+            !use_threaded_emissions(model, blocklen, phase_pr)) {
+            matrices->site_emit = new SiteEmissions(
+                states, tree, subseqs, sub_base_probs, nleaves + 1, blocklen,
+                model, false, phase_pr);
+        } else {
+            matrices->emit = new_matrix<double>(blocklen, nstates);
+            calc_emissions_external(states, tree, subseqs, sub_base_probs,
+                                    nleaves + 1, blocklen,
+                                    model, matrices->emit, phase_pr);
+        }
     } else {
         matrices->emit = NULL;
     }
@@ -143,7 +184,8 @@ void calc_arghmm_matrices_external(
 
     } else {
         LocalTree *last_tree = last_tree_spr->tree;
-        matrices->states_model.get_coal_states(last_tree, last_states);
+        get_block_states(matrices->states_model, last_tree_spr, states_cache,
+                         last_states);
         matrices->nstates1 = last_states.size();
         matrices->nstates2 = nstates;
         lineages.count(last_tree, model->pop_tree);
@@ -152,20 +194,24 @@ void calc_arghmm_matrices_external(
         matrices->transmat_switch = new TransMatrixSwitch(
             matrices->nstates1, matrices->nstates2,
             model->num_pop_paths());
-        calc_transition_probs_switch(tree, last_tree,
-                                     tree_spr->spr, tree_spr->mapping,
-                                     last_states, states, model,
-                                     &lineages, matrices->transmat_switch);
+        get_trans_matrix_switch_cache().calc_transition_probs_switch(
+            matrices->transmat_switch, tree, last_tree,
+            tree_spr->spr, tree_spr->mapping,
+            last_states, states, model, &lineages);
     }
 
     // update lineages to current tree
-    lineages.count(tree, model->pop_tree);
+    if (matrices->transmat_switch && tree_spr->mapping)
+        lineages.update(last_tree_spr->tree, tree, tree_spr->mapping,
+                        model->pop_tree);
+    else
+        lineages.count(tree, model->pop_tree);
 
     // calculate transmat and use it for rest of block
     matrices->transmat = new TransMatrix(model, nstates);
-    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
-                                              false,
-                                              matrices->states_model.minage);
+    get_trans_matrix_cache().calc_transition_probs(
+        matrices->transmat, tree, model, states, &lineages,
+        false, matrices->states_model.minage);
 }
 
 
@@ -175,17 +221,21 @@ void calc_arghmm_matrices(
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
     const StatesModel &states_model, ArgHmmMatrices *matrices,
-    PhaseProbs *phase_pr, int start_pop)
+    PhaseProbs *phase_pr, int start_pop, bool stream_emit,
+    StatesCache *states_cache)
 {
+    PROFILE_SCOPE(PROFILE_MATRICES);
     if (states_model.internal)
         calc_arghmm_matrices_internal(
             model, seqs, trees, last_tree_spr, tree_spr,
             start, end, states_model.minage, matrices,
-            phase_pr);
+            phase_pr, stream_emit, states_cache);
     else
         calc_arghmm_matrices_external(
             model, seqs, trees, last_tree_spr,  tree_spr,
-            start, end, new_chrom, matrices, phase_pr, start_pop);
+            start, end, new_chrom, matrices, phase_pr, start_pop,
+            stream_emit, states_cache);
+    matrices->track_memory();
 }
 
 
@@ -15,6 +15,7 @@
 #include "emit.h"
 #include "local_tree.h"
 #include "logging.h"
+#include "mem.h"
 #include "model.h"
 #include "sequences.h"
 #include "states.h"
@@ -37,7 +38,10 @@ public:
         blocklen(0),
         transmat(NULL),
         transmat_switch(NULL),
-        emit(NULL)
+        emit(NULL),
+        site_emit(NULL),
+        matrix_bytes(0),
+        emit_bytes(0)
     {}
 
     ArgHmmMatrices(int nstates1, int nstates2, int blocklen,
@@ -49,7 +53,10 @@ public:
         blocklen(blocklen),
         transmat(transmat),
         transmat_switch(transmat_switch),
-        emit(emit)
+        emit(emit),
+        site_emit(NULL),
+        matrix_bytes(0),
+        emit_bytes(0)
     {}
 
     ~ArgHmmMatrices()
@@ -60,6 +67,8 @@ public:
     // delete all matrices
     void clear()
     {
+        untrack_memory();
+        states.clear();
         if (transmat) {
             delete transmat;
             transmat = NULL;
@@ -72,14 +81,20 @@ public:
             delete_matrix<double>(emit, blocklen);
             emit = NULL;
         }
+        if (site_emit) {
+            delete site_emit;
+            site_emit = NULL;
+        }
     }
 
     // release ownership of underlying data
     void detach()
     {
+        untrack_memory();
         transmat = NULL;
         transmat_switch = NULL;
         emit = NULL;
+        site_emit = NULL;
     }
 
     void set_states(int ntimes, bool internal, int minage=0)
@@ -87,14 +102,65 @@ public:
         states_model.set(ntimes, internal, minage);
     }
 
+    // approximate number of bytes used
+    long get_memory() const
+    {
+        return sizeof(ArgHmmMatrices) + get_matrix_memory() +
+            get_emit_memory();
+    }
+
+    long get_matrix_memory() const
+    {
+        long size = 0;
+        if (transmat)
+            size += transmat->get_memory();
+        if (transmat_switch)
+            size += transmat_switch->get_memory();
+        return size;
+    }
+
+    long get_emit_memory() const
+    {
+        long size = 0;
+        if (emit)
+            size += long(blocklen) * max(nstates2, 1) * sizeof(double);
+        if (site_emit)
+            size += site_emit->get_memory();
+        return size;
+    }
+
+    // accounts the memory of the computed matrices until they are
+    // cleared or detached, see mem.h
+    void track_memory()
+    {
+        untrack_memory();
+        matrix_bytes = get_matrix_memory();
+        emit_bytes = get_emit_memory();
+        add_tag_memory(MEM_MATRICES, matrix_bytes);
+        add_tag_memory(MEM_EMISSIONS, emit_bytes);
+    }
+
+    void untrack_memory()
+    {
+        add_tag_memory(MEM_MATRICES, -matrix_bytes);
+        add_tag_memory(MEM_EMISSIONS, -emit_bytes);
+        matrix_bytes = emit_bytes = 0;
+    }
+
 
     int nstates1; // number of states in previous block
     int nstates2; // number of states in this block
     int blocklen; // block length
     StatesModel states_model;
+    States states;          // states of this block
     TransMatrix* transmat; // transition matrix within this block
     TransMatrixSwitch* transmat_switch; // transition matrix from previous block
     double **emit; // emission matrix
+    SiteEmissions *site_emit; // emissions computed on demand (instead of emit)
+
+protected:
+    long matrix_bytes;  // accounted bytes of transition matrices
+    long emit_bytes;    // accounted bytes of emissions
 };
 
 
@@ -104,7 +170,8 @@ void calc_arghmm_matrices(
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
     const StatesModel &states_model, ArgHmmMatrices *matrices,
-    PhaseProbs *phase_pr, int start_pop);
+    PhaseProbs *phase_pr, int start_pop, bool stream_emit=false,
+    StatesCache *states_cache=NULL);
 
 
 
@@ -151,7 +218,7 @@ public:
         int model_index = -1;
         int model_end = trees->end_coord;
         if (model->has_mutmap()) {
-            model_index = model->mutmap.index(start);
+            model_index = model->mutmap.index_sorted(start);
             model_end = model->mutmap[model_index].end;
         }
 
@@ -223,12 +290,16 @@ public:
         seqs(seqs),
         trees(trees),
         new_chrom(_new_chrom),
+        stream_emit(false),
         blocks(model, trees)
     {
         if (new_chrom == -1)
             new_chrom = trees->get_num_leaves();
         start_pop = -1;
         states_model.set_pop_tree(model->pop_tree);
+
+        // popsizes must not have changed without update_interval_tables()
+        assert(model->interval_tables_current());
     }
 
     virtual ~ArgHmmMatrixIter()
@@ -255,6 +326,12 @@ public:
         states_model.set_start_pop(start_pop, model->pop_tree);
     }
 
+    // compute emissions site by site during the forward algorithm
+    // (ArgHmmMatrices::site_emit) instead of storing an emission matrix
+    void set_stream_emissions(bool stream) {
+        stream_emit = stream;
+    }
+
     //==================================================
     // iteration methods
 
@@ -291,6 +368,18 @@ public:
         return block_index >= 0 && block_index < blocks.size();
     }
 
+    // moves iterator to an arbitrary block
+    virtual void seek(int index)
+    {
+        if (blocks.size() == 0)
+            setup();
+        block_index = index;
+    }
+
+    int get_block_index() const {
+        return block_index;
+    }
+
     //==================================================
     // accessors
 
@@ -362,7 +451,7 @@ protected:
         argweaver::calc_arghmm_matrices(
             &local_model, seqs, trees, last_tree_spr, block.tree_spr,
             block.start, block.end, new_chrom, states_model, matrices,
-	    phase_pr, start_pop);
+	    phase_pr, start_pop, stream_emit, &states_cache);
     }
 
 
@@ -372,8 +461,10 @@ protected:
     const LocalTrees *trees;
     int new_chrom;
     int start_pop;
+    bool stream_emit;
 
     ArgHmmMatrices mat;
+    StatesCache states_cache;   // states of recently computed blocks
 
     // record of common blocks
     ArgModelBlocks blocks;
@@ -445,6 +536,12 @@ public:
         return ArgHmmMatrixIter::prev();
     }
 
+    virtual void seek(int index)
+    {
+        ArgHmmMatrixIter::seek(index);
+        matrix_index = index;
+    }
+
     //==================================================
     // accessors
 
@@ -460,6 +557,107 @@ protected:
 };
 
 
+
+// keep the matrices of recently used blocks within a memory budget
+//
+// Blocks are computed on first use and evicted least recently used first.
+// Evicted blocks are recomputed on demand, so the traceback and the sampling
+// of recombinations can revisit blocks without holding the matrices of the
+// entire region.
+class ArgHmmMatrixLruList : public ArgHmmMatrixIter
+{
+public:
+    ArgHmmMatrixLruList(const ArgModel *model, const Sequences *seqs,
+                        const LocalTrees *trees, int new_chrom=-1,
+                        double max_mb=0.0) :
+        ArgHmmMatrixIter(model, seqs, trees, new_chrom),
+        max_bytes(long(max_mb * 1024 * 1024)),
+        bytes(0),
+        hits(0),
+        misses(0)
+    {}
+
+    virtual ~ArgHmmMatrixLruList()
+    {
+        clear();
+    }
+
+    virtual void setup()
+    {
+        ArgHmmMatrixIter::setup();
+        clear();
+        slots.assign(blocks.size(), Slot());
+    }
+
+    // free all computed matrices
+    virtual void clear()
+    {
+        for (unsigned int i=0; i<slots.size(); i++) {
+            delete slots[i].matrices;
+            slots[i].matrices = NULL;
+        }
+        order.clear();
+        bytes = 0;
+    }
+
+    virtual ArgHmmMatrices &ref_matrices(PhaseProbs *phase_pr=NULL)
+    {
+        Slot &slot = slots[block_index];
+        if (slot.matrices) {
+            hits++;
+            order.splice(order.begin(), order, slot.order);
+            return *slot.matrices;
+        }
+
+        misses++;
+        slot.matrices = new ArgHmmMatrices();
+        calc_matrices(slot.matrices, phase_pr);
+        slot.bytes = slot.matrices->get_memory();
+        bytes += slot.bytes;
+        order.push_front(block_index);
+        slot.order = order.begin();
+
+        // evict least recently used blocks, but keep the current one
+        while (bytes > max_bytes && order.size() > 1) {
+            Slot &last = slots[order.back()];
+            bytes -= last.bytes;
+            delete last.matrices;
+            last.matrices = NULL;
+            order.pop_back();
+        }
+
+        return *slot.matrices;
+    }
+
+    // number of bytes used by stored matrices
+    long get_memory() const {
+        return bytes;
+    }
+
+    // number of blocks with stored matrices
+    int get_num_stored() const {
+        return order.size();
+    }
+
+    long max_bytes;
+    long bytes;
+    int hits;
+    int misses;
+
+protected:
+    struct Slot {
+        Slot() : matrices(NULL), bytes(0) {}
+
+        ArgHmmMatrices *matrices;
+        long bytes;
+        list<int>::iterator order;
+    };
+
+    vector<Slot> slots;
+    list<int> order;  // stored blocks from most to least recently used
+};
+
+
 } // namespace argweaver
 
 
@@ -1,18 +1,37 @@
 #ifdef ARGWEAVER_MPI
 #include "mpi.h"
+#include <vector>
 #endif
 
 #include "mcmcmc.h"
 
 namespace argweaver {
 
+#ifdef ARGWEAVER_MPI
+// State of the non-blocking swaps of an MPI rank
+class Mc3MpiSwaps
+{
+public:
+    int nchains;
+    std::vector<MPI_Comm> pair_comms;  // comm of chains a < b at a*nchains+b
+    RandState rand;                    // same seed on all ranks
+
+    int pair[2];         // chains of the last chosen swap
+    double uniform;      // draw that decides it
+    bool pending;        // a swap of this rank's chain was started
+    double sendvals[4];  // log probs and groups of the pair, in pair order
+    double vals[4];
+    MPI_Request request;
+};
+#endif
+
  Mc3Config::Mc3Config(int group, double heat_interval) :
-        group(group), heat_interval(heat_interval) {
+        group(group), max_group(0), heat_interval(heat_interval) {
+    heat = 1.0 - heat_interval * group;
 #ifdef ARGWEAVER_MPI
     int numthread=MPI::COMM_WORLD.Get_size();
     int *groups = (int*)malloc(numthread*sizeof(int));
     MPI::COMM_WORLD.Allgather(&group, 1, MPI::INT, groups, 1, MPI::INT);
-    heat = 1.0 - heat_interval * group;
     group_comm = new MPI::Intracomm(MPI::COMM_WORLD.Split(group, 0));
 
     //check that configuration makes sense.
@@ -41,6 +60,180 @@ namespace argweaver {
         }
     }
     free(groups);
+
+    // every rank takes part in the comm of each pair with its chain
+    chain = group;
+    swaps = new Mc3MpiSwaps();
+    swaps->nchains = max_group + 1;
+    swaps->pending = false;
+    int rank = MPI::COMM_WORLD.Get_rank();
+    swaps->pair_comms.resize(swaps->nchains * swaps->nchains, MPI_COMM_NULL);
+    for (int a=0; a < swaps->nchains; a++) {
+        for (int b=a+1; b < swaps->nchains; b++) {
+            int color = (chain == a || chain == b) ? 0 : MPI_UNDEFINED;
+            MPI_Comm_split(MPI_COMM_WORLD, color, rank,
+                           &swaps->pair_comms[a*swaps->nchains + b]);
+        }
+    }
+
+    int seed = 0;
+    if (rank == 0)
+        seed = irand(12581020);
+    MPI::COMM_WORLD.Bcast(&seed, 1, MPI::INT, 0);
+    swaps->rand.seed(seed);
 #endif
 }
+
+
+#ifdef ARGWEAVER_MPI
+bool Mc3Config::choose_swap()
+{
+    const int nchains = swaps->nchains;
+    int *pair = swaps->pair;
+    assert(!swaps->pending);
+    pair[0] = int(swaps->rand.next() / float(RAND_MAX) * nchains);
+    if (pair[0] == nchains)
+        pair[0] = nchains - 1;
+    pair[1] = int(swaps->rand.next() / float(RAND_MAX) * (nchains - 1));
+    if (pair[1] == nchains - 1)
+        pair[1] = nchains - 2;
+    if (pair[1] >= pair[0]) pair[1]++;
+    swaps->uniform = swaps->rand.next() / double(RAND_MAX);
+    return chain == pair[0] || chain == pair[1];
+}
+
+
+void Mc3Config::start_swap(double logprob)
+{
+    const int *pair = swaps->pair;
+    const int i = (chain == pair[0] ? 0 : 1);
+
+    // values are summed over the ranks of each chain, and the groups
+    // are only given by their first ranks
+    for (int j=0; j<4; j++)
+        swaps->sendvals[j] = 0.0;
+    swaps->sendvals[i] = logprob;
+    if (group_comm->Get_rank() == 0)
+        swaps->sendvals[2+i] = group;
+
+    const int a = std::min(pair[0], pair[1]);
+    const int b = std::max(pair[0], pair[1]);
+    MPI_Iallreduce(swaps->sendvals, swaps->vals, 4, MPI_DOUBLE, MPI_SUM,
+                   swaps->pair_comms[a*swaps->nchains + b], &swaps->request);
+    swaps->pending = true;
+}
+
+
+bool Mc3Config::swap_pending() const
+{
+    return swaps->pending;
+}
+
+
+bool Mc3Config::finish_swap(int groups[2], double swapstats[4])
+{
+    assert(swaps->pending);
+    MPI_Wait(&swaps->request, MPI_STATUS_IGNORE);
+    swaps->pending = false;
+
+    const double *vals = swaps->vals;
+    groups[0] = int(vals[2] + 0.5);
+    groups[1] = int(vals[3] + 0.5);
+    double heat0 = 1.0 - heat_interval * groups[0];
+    double heat1 = 1.0 - heat_interval * groups[1];
+    double accept_ratio = (heat0 - heat1) * vals[1] +
+        (heat1 - heat0) * vals[0];
+    bool accept = (accept_ratio >= 0.0 ||
+                   swaps->uniform < exp(accept_ratio));
+    swapstats[0] = accept ? 1.0 : 0.0;
+    swapstats[1] = heat0;
+    swapstats[2] = heat1;
+    swapstats[3] = accept_ratio;
+    return accept;
+}
+#endif
+
+
+//=============================================================================
+// threaded (MC)^3
+
+Mc3Threads::Mc3Threads(int nchains, unsigned int seed) :
+    nchains(nchains),
+    nwaiting(0),
+    generation(0)
+{
+    rand.seed(seed);
+}
+
+
+void Mc3Threads::wait_all(const std::function<void()> &last)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    const unsigned int gen = generation;
+    if (++nwaiting == nchains) {
+        if (last)
+            last();
+        nwaiting = 0;
+        generation++;
+        cond.notify_all();
+    } else {
+        cond.wait(guard, [&]() { return generation != gen; });
+    }
+}
+
+
+void Mc3Threads::choose_swap(int swap2[2])
+{
+    wait_all([&]() {
+            const int max_group = nchains - 1;
+            swap[0] = int(rand.next() / float(RAND_MAX) * (max_group + 1));
+            if (swap[0] > max_group)
+                swap[0] = max_group;
+            swap[1] = int(rand.next() / float(RAND_MAX) * max_group);
+            if (swap[1] >= max_group)
+                swap[1] = max_group - 1;
+            if (swap[1] >= swap[0]) swap[1]++;
+        });
+
+    // the pair is only drawn again once all chains are past decide_swap()
+    swap2[0] = swap[0];
+    swap2[1] = swap[1];
+}
+
+
+bool Mc3Threads::decide_swap(const Mc3Config &mc3, const int swap2[2],
+                             double logprob, double swapstats2[4])
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (mc3.group == swap2[0] || mc3.group == swap2[1]) {
+            const int i = (mc3.group == swap2[0] ? 0 : 1);
+            logprobs[i] = logprob;
+            heats[i] = mc3.heat;
+        }
+    }
+
+    wait_all([&]() {
+            double accept_ratio = (heats[0] - heats[1]) * logprobs[1] +
+                (heats[1] - heats[0]) * logprobs[0];
+            bool accept = (accept_ratio >= 0.0 ||
+                           rand.next() / double(RAND_MAX) < exp(accept_ratio));
+            swapstats[0] = accept ? 1.0 : 0.0;
+            swapstats[1] = heats[0];
+            swapstats[2] = heats[1];
+            swapstats[3] = accept_ratio;
+        });
+
+    for (int i=0; i<4; i++)
+        swapstats2[i] = swapstats[i];
+    return swapstats2[0] > 0.5;
+}
+
+
+void Mc3Threads::barrier()
+{
+    wait_all(std::function<void()>());
+}
+
+
 }
@@ -1,6 +1,11 @@
 #ifndef ARGWEAVER_MCMCMC_H
 #define ARGWEAVER_MCMCMC_H
 
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+#include "common.h"
 #include "logging.h"
 
 #ifdef ARGWEAVER_MPI
@@ -12,6 +17,10 @@ namespace MPI {
 
 namespace argweaver {
 
+#ifdef ARGWEAVER_MPI
+class Mc3MpiSwaps;
+#endif
+
 class Mc3Config
 {
  public:
@@ -21,6 +30,11 @@ class Mc3Config
         max_group=0;
         heat_interval=0.05;
         heat=1.0;
+#ifdef ARGWEAVER_MPI
+        chain=0;
+        group_comm=NULL;
+        swaps=NULL;
+#endif
     }
 
     Mc3Config(int group, double heat_interval);
@@ -30,10 +44,76 @@ class Mc3Config
     double heat_interval;
     double heat;
 #ifdef ARGWEAVER_MPI
+    // Swaps between MPI ranks do not block the ranks outside the pair.  A
+    // swap is started by the ranks of the two chosen chains, which keep
+    // sampling while their values are reduced, and is decided once they
+    // are needed.  All ranks draw the pairs from generators with the same
+    // seed, so that no rank has to coordinate the swaps.
+
+    // Chooses the chains of the next swap, on every rank.  Returns whether
+    // the chain of the calling rank takes part.
+    bool choose_swap();
+
+    // Starts the chosen swap with the log probability of the ARG of the
+    // calling rank
+    void start_swap(double logprob);
+
+    // Returns true if a started swap is not finished yet
+    bool swap_pending() const;
+
+    // Waits for a started swap and returns whether it is accepted.
+    // 'groups' is set to the groups of the two chains and 'swapstats' to
+    // the decision, both heats and the log acceptance ratio.
+    bool finish_swap(int groups[2], double swapstats[4]);
+
+    int chain;    // group the rank started in, which names its chain
     MPI::Intracomm *group_comm;
+    Mc3MpiSwaps *swaps;
 #endif
 };
 
+
+// Chains of an (MC)^3 run on threads of one process.  Chain i starts in
+// group i, and the chains meet at each swap like the ranks of an MPI run.
+// Swaps are drawn from a generator of their own, so that a run only
+// depends on its seed.
+class Mc3Threads
+{
+ public:
+    Mc3Threads(int nchains, unsigned int seed);
+
+    // Waits for all chains and gives each the same two groups to swap
+    void choose_swap(int swap[2]);
+
+    // Waits for all chains and returns whether the heats of the groups in
+    // 'swap' are swapped.  The chains of these groups give the log
+    // probability of their ARG in 'logprob'.  'swapstats' is set to the
+    // decision, both heats and the log acceptance ratio.
+    bool decide_swap(const Mc3Config &mc3, const int swap[2],
+                     double logprob, double swapstats[4]);
+
+    // Waits for all chains
+    void barrier();
+
+    int get_num_chains() const { return nchains; }
+
+ protected:
+    // waits for all chains; the last chain to arrive calls 'last' first
+    void wait_all(const std::function<void()> &last);
+
+    int nchains;
+    int nwaiting;
+    unsigned int generation;
+    std::mutex lock;
+    std::condition_variable cond;
+    RandState rand;
+
+    int swap[2];
+    double logprobs[2];
+    double heats[2];
+    double swapstats[4];
+};
+
 } //namespace argweaver
 
 #endif
@@ -1,8 +1,14 @@
 
 
 
+#include <atomic>
+#include <stdio.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mem.h"
 
 
 /* maximum resident set size */
@@ -14,6 +20,91 @@ long get_max_memory_usage()
 }
 
 
+/* current resident set size, from the second field of /proc/self/statm */
+long get_memory_usage()
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    long size, resident;
+    int n = fscanf(statm, "%ld %ld", &size, &resident);
+    fclose(statm);
+    if (n != 2)
+        return 0;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+namespace argweaver {
+
+
+static const char *memory_tag_names[MEM_NTAGS] = {
+    "forward tables",
+    "matrices",
+    "emissions",
+    "local trees",
+    "sequences"
+};
+
+static std::atomic<long> tag_memory[MEM_NTAGS];
+static std::atomic<long> tag_max_memory[MEM_NTAGS];
+
+
+void add_tag_memory(MemoryTag tag, long bytes)
+{
+    const long total = (tag_memory[tag] += bytes);
+    long peak = tag_max_memory[tag];
+    while (total > peak &&
+           !tag_max_memory[tag].compare_exchange_weak(peak, total)) {}
+}
+
+
+long get_tag_memory(MemoryTag tag)
+{
+    return tag_memory[tag];
+}
+
+
+long get_tag_max_memory(MemoryTag tag)
+{
+    return tag_max_memory[tag];
+}
+
+
+const char *get_memory_tag_name(MemoryTag tag)
+{
+    return memory_tag_names[tag];
+}
+
+
+void log_tag_memory(int loglevel)
+{
+    if (!isLogLevel(loglevel))
+        return;
+    for (int i=0; i<MEM_NTAGS; i++) {
+        MemoryTag tag = MemoryTag(i);
+        printLog(loglevel, "memory of %s: %.1f MB (peak %.1f MB)\n",
+                 memory_tag_names[i], get_tag_memory(tag) / 1e6,
+                 get_tag_max_memory(tag) / 1e6);
+    }
+}
+
+
+void write_tag_memory(FILE *stream)
+{
+    fprintf(stream, "%-24s %12s %12s\n", "memory", "current (MB)",
+            "peak (MB)");
+    for (int i=0; i<MEM_NTAGS; i++) {
+        MemoryTag tag = MemoryTag(i);
+        fprintf(stream, "%-24s %12.1f %12.1f\n", memory_tag_names[i],
+                get_tag_memory(tag) / 1e6, get_tag_max_memory(tag) / 1e6);
+    }
+}
+
+
+} // namespace argweaver
+
+
 /*
 #include <unistd.h>
 #include <ios>
@@ -9,6 +9,39 @@
 #ifndef ARGWEAVER_MEM_H
 #define ARGWEAVER_MEM_H
 
+#include <stdio.h>
+
 long get_max_memory_usage();
 
+// current resident set size in KB, or 0 if unknown
+long get_memory_usage();
+
+
+namespace argweaver {
+
+// Subsystems whose allocations are accounted.  Each keeps the bytes it
+// currently holds and the most it has held at once, so that the part of
+// a run using the most memory can be found.
+enum MemoryTag {
+    MEM_FORWARD,      // forward tables, including pools and checkpoints
+    MEM_MATRICES,     // transition matrices of blocks (ArgHmmMatrixList...)
+    MEM_EMISSIONS,    // emission matrices of blocks
+    MEM_TREES,        // node arrays of local trees
+    MEM_SEQUENCES,    // sequences and base probabilities
+    MEM_NTAGS
+};
+
+// Records an allocation of 'bytes', or a release if negative
+void add_tag_memory(MemoryTag tag, long bytes);
+
+long get_tag_memory(MemoryTag tag);
+long get_tag_max_memory(MemoryTag tag);
+const char *get_memory_tag_name(MemoryTag tag);
+
+// Writes the current and peak MB of each subsystem
+void log_tag_memory(int loglevel);
+void write_tag_memory(FILE *stream);
+
+} // namespace argweaver
+
 #endif
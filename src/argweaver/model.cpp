@@ -172,6 +172,8 @@ int ArgModel::consistent_path(int path1, int path2,
 }
 
 void ArgModel::copy(const ArgModel &other) {
+    if (!owned)
+        interval_tables = NULL;
     owned = true;
     rho = other.rho;
     mu = other.mu;
@@ -181,6 +183,14 @@ void ArgModel::copy(const ArgModel &other) {
     popsize_config = other.popsize_config;
     mc3 = other.mc3;
     smc_prime = other.smc_prime;
+    fw_checkpoint = other.fw_checkpoint;
+    fw_float = other.fw_float;
+    fw_runs = other.fw_runs;
+    fw_skip_masked = other.fw_skip_masked;
+    fw_prune = other.fw_prune;
+    nthreads = other.nthreads;
+    parallel_windows = other.parallel_windows;
+    matrix_cache_mb = other.matrix_cache_mb;
 
     if (other.pop_tree)
         pop_tree = new PopulationTree(*other.pop_tree);
@@ -213,12 +223,134 @@ void ArgModel::clear() {
         }
         if (pop_tree)
             delete pop_tree;
+        if (interval_tables)
+            delete interval_tables;
     }
 }
 
 
+void IntervalTables::update(int _npop, int _nhalf,
+                            const double *coal_time_steps,
+                            double *const *popsizes)
+{
+    npop = _npop;
+    nhalf = _nhalf;
+    coal_rates.resize(npop * nhalf);
+    popsizes_used.resize(npop * nhalf);
+    coal_time_steps_used.assign(coal_time_steps, coal_time_steps + nhalf);
+
+    for (int pop=0; pop<npop; pop++) {
+        for (int i=0; i<nhalf; i++) {
+            coal_rates[pop * nhalf + i] =
+                coal_time_steps[i] / (2.0 * popsizes[pop][i]);
+            popsizes_used[pop * nhalf + i] = popsizes[pop][i];
+        }
+    }
+}
+
+
+bool IntervalTables::is_current(int _npop, int _nhalf,
+                                const double *coal_time_steps,
+                                double *const *popsizes) const
+{
+    if (npop != _npop || nhalf != _nhalf)
+        return false;
+    for (int i=0; i<nhalf; i++)
+        if (coal_time_steps_used[i] != coal_time_steps[i])
+            return false;
+    for (int pop=0; pop<npop; pop++)
+        for (int i=0; i<nhalf; i++)
+            if (popsizes_used[pop * nhalf + i] != popsizes[pop][i])
+                return false;
+    return true;
+}
+
+
+void ArgModel::update_interval_tables()
+{
+    if (!popsizes || !coal_time_steps)
+        return;
+    if (!interval_tables) {
+        // models sharing another model's arrays also share its tables
+        if (!owned)
+            return;
+        interval_tables = new IntervalTables();
+    }
+    interval_tables->update(num_pops(), 2*ntimes-1, coal_time_steps,
+                            popsizes);
+}
+
+
+bool ArgModel::interval_tables_current() const
+{
+    return interval_tables && popsizes &&
+        interval_tables->is_current(num_pops(), 2*ntimes-1,
+                                    coal_time_steps, popsizes);
+}
+
+
+// Merges runs of adjacent regions of two maps with common boundaries while
+// the rates of each map in a run differ by at most 'tolerance' relative to
+// the smallest one.  A merged region has the mean rates of its run
+// weighted by length, so the total rates over the run are kept.  Returns
+// the largest relative difference between a rate and its merged rate.
+static double merge_map_regions(Track<double> &mutmap,
+                                Track<double> &recombmap, double tolerance)
+{
+    Track<double> mutmap2;
+    Track<double> recombmap2;
+    double max_error = 0.0;
+
+    for (unsigned int i=0; i<mutmap.size(); ) {
+        double mu_min = mutmap[i].value, mu_max = mu_min;
+        double rho_min = recombmap[i].value, rho_max = rho_min;
+        unsigned int j = i + 1;
+        for (; j<mutmap.size(); j++) {
+            const double mu = mutmap[j].value, rho = recombmap[j].value;
+            if (mutmap[j].start != mutmap[j-1].end ||
+                max(mu_max, mu) - min(mu_min, mu) >
+                tolerance * min(mu_min, mu) ||
+                max(rho_max, rho) - min(rho_min, rho) >
+                tolerance * min(rho_min, rho))
+                break;
+            mu_min = min(mu_min, mu);
+            mu_max = max(mu_max, mu);
+            rho_min = min(rho_min, rho);
+            rho_max = max(rho_max, rho);
+        }
+
+        // mean rates of the run
+        double mu_sum = 0.0, rho_sum = 0.0;
+        for (unsigned int k=i; k<j; k++) {
+            mu_sum += mutmap[k].value * mutmap[k].length();
+            rho_sum += recombmap[k].value * recombmap[k].length();
+        }
+        const int start = mutmap[i].start, end = mutmap[j-1].end;
+        const double mu = mu_sum / (end - start);
+        const double rho = rho_sum / (end - start);
+        for (unsigned int k=i; k<j; k++) {
+            if (mu > 0.0)
+                max_error = max(max_error,
+                                fabs(mutmap[k].value - mu) / mu);
+            if (rho > 0.0)
+                max_error = max(max_error,
+                                fabs(recombmap[k].value - rho) / rho);
+        }
+
+        mutmap2.append(mutmap[i].chrom, start, end, mu);
+        recombmap2.append(recombmap[i].chrom, start, end, rho);
+        i = j;
+    }
+
+    mutmap.swap(mutmap2);
+    recombmap.swap(recombmap2);
+    return max_error;
+}
+
+
 // Initializes mutation and recombination maps for use
-bool ArgModel::setup_maps(string chrom, int start, int end) {
+bool ArgModel::setup_maps(string chrom, int start, int end,
+                          double rate_tolerance) {
 
     // check maps
     if (!complete_map(mutmap, chrom, start, end, mu)) {
@@ -290,6 +422,16 @@ bool ArgModel::setup_maps(string chrom, int start, int end) {
     mutmap.insert(mutmap.begin(), mutmap2.begin(), mutmap2.end());
     recombmap.insert(recombmap.begin(), recombmap2.begin(), recombmap2.end());
 
+    // merge regions of similar rates
+    if (rate_tolerance > 0.0) {
+        const int nregions = mutmap.size();
+        double max_error = merge_map_regions(mutmap, recombmap,
+                                             rate_tolerance);
+        printLog(LOG_LOW, "merged rate map regions from %d to %d"
+                 " (max relative rate error %g)\n", nregions,
+                 (int) mutmap.size(), max_error);
+    }
+
     return true;
 }
 
@@ -308,6 +450,7 @@ void ArgModel::set_popsizes_random(double popsize_min,
                     popsizes[pop][i] = frand(popsize_min, popsize_max);
                 }
             }
+            update_interval_tables();
             return;
         }
         list<PopsizeConfigParam> l = popsize_config.params;
@@ -324,6 +467,7 @@ void ArgModel::set_popsizes_random(double popsize_min,
         mc3.group_comm->Bcast(popsizes[pop], 2*ntimes-1, MPI::DOUBLE, 0);
     }
 #endif
+    update_interval_tables();
 }
 
 
@@ -560,6 +704,7 @@ void ArgModel::read_population_sizes(string popsize_file) {
             if (popsizes[pop][i] == 0.0)
                 exitError("Error in read_population_sizes: some population sizes are zero or not set");
         }
+    update_interval_tables();
 }
 
 
@@ -598,12 +743,6 @@ double ArgModel::path_prob(int path, int t1, int t2) const {
     return pop_tree->path_prob(path, t1, t2);
 }
 
-bool ArgModel::paths_equal(int path1, int path2, int t1, int t2) const {
-    if (pop_tree == NULL || path1==path2) return true;
-    return pop_tree->paths_equal(path1, path2, t1, t2);
-}
-
-
 bool ArgModel::paths_equal(int path1, int path2, double t1, double t2) const {
     if (pop_tree == NULL || path1==path2) return true;
     int t1d = discretize_time(t1);
@@ -636,6 +775,21 @@ ArgModel::ArgModel(const char *logfilename) {
     bool read_pop_file = false;
     pop_tree = NULL;
     smc_prime=true;
+    fw_checkpoint=0;
+    fw_float=false;
+    fw_runs=0;
+    fw_skip_masked=false;
+    fw_prune=0.0;
+    nthreads=1;
+    parallel_windows=false;
+    matrix_cache_mb=0;
+    owned=true;
+    time_steps=NULL;
+    coal_time_steps=NULL;
+    popsizes=NULL;
+    infsites_penalty=1.0;
+    unphased=0;
+    interval_tables=NULL;
     if (logfile == NULL) {
         printError("Could not open log file %s\n", logfilename);
         abort();
@@ -684,8 +838,7 @@ ArgModel::ArgModel(const char *logfilename) {
                     times[i] = atof(splitStr[i].c_str());
                 double delta = get_delta(times, ntimes, times[ntimes-1]);
                 // if delta < 0 then using linear steps
-                coal_time_steps = new double[2*ntimes];
-                get_coal_time_steps(times, ntimes, coal_time_steps, delta < 0, delta);
+                setup_time_steps(delta < 0, delta);
             }
             if (str_starts_with(line, "  npop = ")) {
                 if (pop_file != NULL) {
@@ -812,6 +965,7 @@ ArgModel::ArgModel(const char *logfilename) {
         }
     }
     if (pop_file != NULL) delete[] pop_file;
+    update_interval_tables();
 }
 
 
@@ -995,15 +1149,27 @@ int ArgModel::init_params_from_statfile(vector<string> header, const char *line,
             }
         }
     }
+    update_interval_tables();
     return iter;
 }
 
 
+// Under adaptive compression the rate maps are scaled site by site and
+// the rates of the model by the average compression
+static double get_model_compress(const SitesMapping *sites_mapping,
+                                 double compress_seq)
+{
+    if (sites_mapping && sites_mapping->is_adaptive())
+        return sites_mapping->get_mean_compress();
+    return compress_seq;
+}
+
+
 void uncompress_model(ArgModel *model, const SitesMapping *sites_mapping,
 		      double compress_seq)
 {
-    model->rho /= compress_seq;
-    model->mu /= compress_seq;
+    model->rho /= get_model_compress(sites_mapping, compress_seq);
+    model->mu /= get_model_compress(sites_mapping, compress_seq);
 
     uncompress_track(model->mutmap, sites_mapping, compress_seq, true);
     uncompress_track(model->recombmap, sites_mapping, compress_seq, true);
@@ -1013,8 +1179,8 @@ void uncompress_model(ArgModel *model, const SitesMapping *sites_mapping,
 void compress_model(ArgModel *model, const SitesMapping *sites_mapping,
                     double compress_seq)
 {
-    model->rho *= compress_seq;
-    model->mu *= compress_seq;
+    model->rho *= get_model_compress(sites_mapping, compress_seq);
+    model->mu *= get_model_compress(sites_mapping, compress_seq);
 
     compress_track(model->mutmap, sites_mapping, compress_seq, true);
     compress_track(model->recombmap, sites_mapping, compress_seq, true);
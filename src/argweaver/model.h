@@ -142,6 +142,37 @@ class PopsizeConfig
 };
 
 
+// Per-time-interval quantities derived from the time points and population
+// sizes of an ArgModel, so that inner loops do not recompute them.
+// ArgModel::update_interval_tables() rebuilds them and must be called
+// whenever the population sizes or time points change.
+class IntervalTables
+{
+ public:
+    IntervalTables() : npop(0), nhalf(0) {}
+
+    // rebuild all tables
+    void update(int npop, int nhalf, const double *coal_time_steps,
+                double *const *popsizes);
+
+    // returns true if the tables were built from these values
+    bool is_current(int npop, int nhalf, const double *coal_time_steps,
+                    double *const *popsizes) const;
+
+    // coalescence rate of a pair of lineages in population 'pop' over half
+    // time interval i: coal_time_steps[i] / (2 popsizes[pop][i])
+    double coal_rate(int pop, int i) const {
+        return coal_rates[pop * nhalf + i];
+    }
+
+    int npop;
+    int nhalf;  // number of half time intervals (2*ntimes-1)
+    vector<double> coal_rates;
+    vector<double> coal_time_steps_used;
+    vector<double> popsizes_used;
+};
+
+
 // The model parameters and time discretization scheme
 class ArgModel
 {
@@ -160,7 +191,16 @@ class ArgModel
     unphased(0),
     unphased_file(""),
     pop_tree(NULL),
-    smc_prime(true) {}
+    smc_prime(true),
+    fw_checkpoint(0),
+    fw_float(false),
+    fw_runs(0),
+    fw_skip_masked(false),
+    fw_prune(0.0),
+    nthreads(1),
+    parallel_windows(false),
+    matrix_cache_mb(0),
+    interval_tables(NULL) {}
 
  // Model with constant population sizes and log-spaced time points
  ArgModel(int ntimes, double maxtime, double popsize,
@@ -176,7 +216,16 @@ class ArgModel
     infsites_penalty(1.0),
     unphased(0),
     pop_tree(NULL),
-    smc_prime(true)
+    smc_prime(true),
+    fw_checkpoint(0),
+    fw_float(false),
+    fw_runs(0),
+    fw_skip_masked(false),
+    fw_prune(0.0),
+    nthreads(1),
+    parallel_windows(false),
+    matrix_cache_mb(0),
+    interval_tables(NULL)
         {
             set_log_times(maxtime, ntimes);
             set_popsizes(popsize);
@@ -198,7 +247,16 @@ class ArgModel
     infsites_penalty(1.0),
     unphased(0),
     pop_tree(NULL),
-    smc_prime(true)
+    smc_prime(true),
+    fw_checkpoint(0),
+    fw_float(false),
+    fw_runs(0),
+    fw_skip_masked(false),
+    fw_prune(0.0),
+    nthreads(1),
+    parallel_windows(false),
+    matrix_cache_mb(0),
+    interval_tables(NULL)
         {
             set_log_times(maxtime, ntimes);
             if (_popsizes)
@@ -220,7 +278,16 @@ class ArgModel
     infsites_penalty(1.0),
     unphased(0),
     pop_tree(NULL),
-    smc_prime(true)
+    smc_prime(true),
+    fw_checkpoint(0),
+    fw_float(false),
+    fw_runs(0),
+    fw_skip_masked(false),
+    fw_prune(0.0),
+    nthreads(1),
+    parallel_windows(false),
+    matrix_cache_mb(0),
+    interval_tables(NULL)
         {
             set_times(_times, ntimes);
             if (_popsizes)
@@ -244,7 +311,16 @@ class ArgModel
     popsize_config(other.popsize_config),
     mc3(other.mc3),
     pop_tree(other.pop_tree),
-    smc_prime(other.smc_prime) {}
+    smc_prime(other.smc_prime),
+    fw_checkpoint(other.fw_checkpoint),
+    fw_float(other.fw_float),
+    fw_runs(other.fw_runs),
+    fw_skip_masked(other.fw_skip_masked),
+    fw_prune(other.fw_prune),
+    nthreads(other.nthreads),
+    parallel_windows(other.parallel_windows),
+    matrix_cache_mb(other.matrix_cache_mb),
+    interval_tables(other.interval_tables) {}
 
     // Copy constructor
     ArgModel(const ArgModel &other) :
@@ -260,7 +336,16 @@ class ArgModel
         unphased_file(other.unphased_file),
         popsize_config(other.popsize_config),
         mc3(other.mc3),
-        smc_prime(other.smc_prime)
+        smc_prime(other.smc_prime),
+        fw_checkpoint(other.fw_checkpoint),
+        fw_float(other.fw_float),
+        fw_runs(other.fw_runs),
+        fw_skip_masked(other.fw_skip_masked),
+        fw_prune(other.fw_prune),
+        nthreads(other.nthreads),
+        parallel_windows(other.parallel_windows),
+        matrix_cache_mb(other.matrix_cache_mb),
+        interval_tables(NULL)
     {
         copy(other);
     }
@@ -387,6 +472,7 @@ class ArgModel
         int npop = this->num_pops();
         for (int i=0; i < npop; i++)
             std::copy(_popsizes, _popsizes + 2*ntimes-1, popsizes[i]);
+        update_interval_tables();
     }
 
     void set_popsizes(double **_popsizes) {
@@ -395,6 +481,7 @@ class ArgModel
         int npop = this->num_pops();
         for (int i=0; i < npop; i++)
             std::copy(_popsizes[i], _popsizes[i] + 2*ntimes-1, popsizes[i]);
+        update_interval_tables();
     }
 
     void set_popsizes(string popsize_str) {
@@ -431,6 +518,7 @@ class ArgModel
                 }
             }
         }
+        update_interval_tables();
     }
 
     // Sets the model populations to be constant over all time points
@@ -440,6 +528,7 @@ class ArgModel
         int npop = this->num_pops();
         for (int i=0; i < npop; i++)
             fill(popsizes[i], popsizes[i] + 2*ntimes-1, popsize);
+        update_interval_tables();
     }
 
     void set_popsize_by_pop(double *popsize) {
@@ -448,12 +537,26 @@ class ArgModel
         int npop = this->num_pops();
         for (int i=0; i < npop; i++)
             fill(popsizes[i], popsizes[i] + 2*ntimes-1, popsize[i]);
+        update_interval_tables();
     }
 
 
     void set_popsizes_random(double popsize_min=5000.0,
                              double popsize_max=50000.0);
 
+    // Rebuilds the per-time-interval tables.  Must be called after
+    // changing popsizes directly.
+    void update_interval_tables();
+
+    // Returns true if the per-time-interval tables match popsizes
+    bool interval_tables_current() const;
+
+    // coalescence rate of a pair of lineages in population 'pop' over half
+    // time interval i: coal_time_steps[i] / (2 popsizes[pop][i])
+    double coal_rate(int pop, int i) const {
+        return interval_tables->coal_rate(pop, i);
+    }
+
     //====================================================================
     // maps
 
@@ -467,20 +570,23 @@ class ArgModel
         return recombmap.size() > 0;
     }
 
-    // Initializes mutation and recombination maps for use
-    bool setup_maps(string chrom, int start, int end);
+    // Initializes mutation and recombination maps for use.  Adjacent
+    // regions whose rates differ by at most 'rate_tolerance' relative to
+    // the smaller rate are merged into one with their mean rate.
+    bool setup_maps(string chrom, int start, int end,
+                    double rate_tolerance=0.0);
 
     // set model parameters from map position
     void set_map_pos(int pos) {
-        mu = mutmap.find(pos, mu);
-        rho = recombmap.find(pos, rho);
+        mu = mutmap.find_sorted(pos, mu);
+        rho = recombmap.find_sorted(pos, rho);
     }
 
     // Returns a model customized for the local position
     void get_local_model(int pos, ArgModel &model,
                          int *mu_idx=NULL, int *rho_idx=NULL) const {
-        model.mu = mutmap.find(pos, mu, mu_idx);
-        model.rho = recombmap.find(pos, rho, rho_idx);
+        model.mu = mutmap.find_sorted(pos, mu, mu_idx);
+        model.rho = recombmap.find_sorted(pos, rho, rho_idx);
         model.infsites_penalty = infsites_penalty;
 
         model.owned = false;
@@ -489,13 +595,14 @@ class ArgModel
         model.time_steps = time_steps;
         model.coal_time_steps = coal_time_steps;
         model.popsizes = popsizes;
+        model.interval_tables = interval_tables;
         model.popsize_config = popsize_config;
         model.pop_tree = pop_tree;
         model.smc_prime = smc_prime;
     }
 
     double get_local_rho(int pos, int *rho_idx=NULL) const {
-        return recombmap.find(pos, rho, rho_idx);
+        return recombmap.find_sorted(pos, rho, rho_idx);
     }
 
     void get_local_model_index(int index, ArgModel &model) const {
@@ -516,6 +623,7 @@ class ArgModel
         model.time_steps = time_steps;
         model.coal_time_steps = coal_time_steps;
         model.popsizes = popsizes;
+        model.interval_tables = interval_tables;
         model.pop_tree = pop_tree;
         model.smc_prime = smc_prime;
     }
@@ -542,8 +650,30 @@ class ArgModel
     int num_pops() const;
     int num_pop_paths() const;
     double path_prob(int path, int t1, int t2) const;
-    bool paths_equal(int path1, int path2, int t1, int t2) const;
     bool paths_equal(int path1, int path2, double t1, double t2) const;
+
+    // Returns true if the two paths are equal from time t1 to t2
+    // (t2 == -1 means the last time point)
+    inline bool paths_equal(int path1, int path2, int t1, int t2) const
+    {
+        if (pop_tree == NULL || path1 == path2) return true;
+        if (t1 > ntimes - 1) t1 = ntimes - 1;
+        if (t2 == -1 || t2 > ntimes - 1) t2 = ntimes - 1;
+        assert(t1 <= t2);
+        return pop_tree->path_class(path1, t1, t2) ==
+            pop_tree->path_class(path2, t1, t2);
+    }
+
+    // Returns an index identifying the set of paths equal to 'path' from
+    // time t1 to t2 (0 without a population tree)
+    inline int path_class(int path, int t1, int t2) const
+    {
+        if (pop_tree == NULL) return 0;
+        if (t1 > ntimes - 1) t1 = ntimes - 1;
+        if (t2 == -1 || t2 > ntimes - 1) t2 = ntimes - 1;
+        assert(t1 <= t2);
+        return pop_tree->path_class(path, t1, t2);
+    }
     int max_matching_path(int path1, int path2, int t) const;
     int path_to_root(const LocalNode *nodes, int node, int time) const;
     int path_to_root(const spidir::Node *node, double time) const;
@@ -570,6 +700,8 @@ protected:
 	if (_coal_time_steps == NULL)
 	    get_coal_time_steps(times, ntimes, coal_time_steps, linear, delta);
 	else std::copy(_coal_time_steps, _coal_time_steps + 2*ntimes, coal_time_steps);
+        if (popsizes)
+            update_interval_tables();
     }
 
  public:
@@ -594,6 +726,15 @@ protected:
     Track<double> recombmap; // recombination map
     PopulationTree *pop_tree;
     bool smc_prime;
+    int fw_checkpoint;       // forward table checkpoint interval (0: off)
+    bool fw_float;           // store forward table in single precision
+    int fw_runs;             // min length of collapsed invariant runs (0: off)
+    bool fw_skip_masked;     // collapse masked runs in the forward algorithm
+    double fw_prune;         // min forward mass of a kept state (0: off)
+    int nthreads;            // number of threads for emissions
+    bool parallel_windows;   // resample disjoint windows concurrently
+    double matrix_cache_mb;  // memory budget of traceback matrices (0: off)
+    IntervalTables *interval_tables;  // tables derived from popsizes
 };
 
 void compress_model(ArgModel *model, const SitesMapping *sites_mapping,
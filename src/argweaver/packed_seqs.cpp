@@ -0,0 +1,163 @@
+
+
+#include "packed_seqs.h"
+#include "seq.h"
+
+
+namespace argweaver {
+
+
+void PackedSeqs::set(const char *const *seqs, int _nseqs, int _seqlen)
+{
+    nseqs = _nseqs;
+    seqlen = _seqlen;
+    nwords = (nseqs + 63) / 64;
+
+    all_rows.assign(nwords, 0);
+    for (int j=0; j<nseqs; j++)
+        all_rows[j >> 6] |= uint64_t(1) << (j & 63);
+
+    bits.assign(3 * long(nwords) * seqlen, 0);
+    for (int i=0; i<seqlen; i++) {
+        uint64_t *col = get_column(i);
+        for (int j=0; j<nseqs; j++) {
+            const int c = dna2int[(int) (unsigned char) seqs[j][i]];
+            const uint64_t bit = uint64_t(1) << (j & 63);
+            const int w = j >> 6;
+            if (c == -1) {
+                col[2*nwords + w] |= bit;
+            } else {
+                if (c & 1)
+                    col[w] |= bit;
+                if (c & 2)
+                    col[nwords + w] |= bit;
+            }
+        }
+    }
+}
+
+
+void PackedSeqs::set_base(int seq, int pos, char c)
+{
+    uint64_t *col = get_column(pos);
+    const int b = dna2int[(int) (unsigned char) c];
+    const int w = seq >> 6;
+    const uint64_t bit = uint64_t(1) << (seq & 63);
+
+    col[w] &= ~bit;
+    col[nwords + w] &= ~bit;
+    col[2*nwords + w] &= ~bit;
+    if (b == -1) {
+        col[2*nwords + w] |= bit;
+    } else {
+        if (b & 1)
+            col[w] |= bit;
+        if (b & 2)
+            col[nwords + w] |= bit;
+    }
+}
+
+
+char PackedSeqs::get_base(int seq, int pos) const
+{
+    const int set = get_base_set(seq, pos);
+    switch (set) {
+    case 1: return int2dna[0];
+    case 2: return int2dna[1];
+    case 4: return int2dna[2];
+    case 8: return int2dna[3];
+    default: return 'N';
+    }
+}
+
+
+bool PackedSeqs::is_invariant_site(int pos, const uint64_t *rows) const
+{
+    if (!rows)
+        rows = all_rows.data();
+    const uint64_t *lo = get_column(pos);
+    const uint64_t *hi = lo + nwords;
+    const uint64_t *unknown = hi + nwords;
+
+    // find the first selected sequence
+    int w0 = 0;
+    while (w0 < nwords && !rows[w0])
+        w0++;
+    if (w0 == nwords)
+        return true;
+    const uint64_t first = rows[w0] & -rows[w0];
+    const uint64_t lo0 = (lo[w0] & first) ? ~uint64_t(0) : 0;
+    const uint64_t hi0 = (hi[w0] & first) ? ~uint64_t(0) : 0;
+    const uint64_t unknown0 = (unknown[w0] & first) ? ~uint64_t(0) : 0;
+
+    for (int w=w0; w<nwords; w++) {
+        if (((unknown[w] ^ unknown0) & rows[w]) != 0)
+            return false;
+        if (!unknown0 && (((lo[w] ^ lo0) | (hi[w] ^ hi0)) & rows[w]) != 0)
+            return false;
+    }
+    return true;
+}
+
+
+bool PackedSeqs::has_unknown(int pos, const uint64_t *rows) const
+{
+    if (!rows)
+        rows = all_rows.data();
+    const uint64_t *unknown = get_column(pos) + 2*nwords;
+
+    for (int w=0; w<nwords; w++)
+        if (unknown[w] & rows[w])
+            return true;
+    return false;
+}
+
+
+int PackedSeqs::count_alleles(int pos, const uint64_t *rows) const
+{
+    if (!rows)
+        rows = all_rows.data();
+    const uint64_t *lo = get_column(pos);
+    const uint64_t *hi = lo + nwords;
+    const uint64_t *unknown = hi + nwords;
+
+    uint64_t present[4] = {0, 0, 0, 0};
+    for (int w=0; w<nwords; w++) {
+        const uint64_t known = rows[w] & ~unknown[w];
+        present[0] |= known & ~lo[w] & ~hi[w];
+        present[1] |= known & lo[w] & ~hi[w];
+        present[2] |= known & ~lo[w] & hi[w];
+        present[3] |= known & lo[w] & hi[w];
+    }
+    return int(present[0] != 0) + int(present[1] != 0) +
+        int(present[2] != 0) + int(present[3] != 0);
+}
+
+
+void PackedSeqs::get_base_bits(int pos, int base, uint64_t *out,
+                               const uint64_t *rows) const
+{
+    if (!rows)
+        rows = all_rows.data();
+    const uint64_t *lo = get_column(pos);
+    const uint64_t *hi = lo + nwords;
+    const uint64_t *unknown = hi + nwords;
+
+    for (int w=0; w<nwords; w++) {
+        out[w] = rows[w] & ~unknown[w] &
+            ((base & 1) ? lo[w] : ~lo[w]) &
+            ((base & 2) ? hi[w] : ~hi[w]);
+    }
+}
+
+
+void PackedSeqs::get_rows(const int *seqids, int n, uint64_t *rows) const
+{
+    for (int w=0; w<nwords; w++)
+        rows[w] = 0;
+    for (int i=0; i<n; i++)
+        rows[seqids[i] >> 6] |= uint64_t(1) << (seqids[i] & 63);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,126 @@
+//=============================================================================
+// Bit-packed alignment columns
+//
+// Each site is stored as three bit-planes over the sequences: the low and
+// high bits of the base number (see dna2int) and a mask of unknown bases.
+// Column queries then become a few bitwise operations per 64 sequences.
+
+#ifndef ARGWEAVER_PACKED_SEQS_H
+#define ARGWEAVER_PACKED_SEQS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+class PackedSeqs
+{
+public:
+    PackedSeqs() :
+        nseqs(0), seqlen(0), nwords(0)
+    {}
+
+    PackedSeqs(const char *const *seqs, int nseqs, int seqlen)
+    {
+        set(seqs, nseqs, seqlen);
+    }
+
+    // pack an alignment.  Bases other than A, C, G, T are stored as 'N'.
+    void set(const char *const *seqs, int nseqs, int seqlen);
+
+    void set_base(int seq, int pos, char c);
+
+    // returns the base of sequence 'seq' at 'pos' ('N' if unknown)
+    char get_base(int seq, int pos) const;
+
+    // returns 0 for unknown bases and 1 << base otherwise
+    int get_base_set(int seq, int pos) const
+    {
+        const uint64_t *col = get_column(pos);
+        const int w = seq >> 6;
+        const uint64_t bit = uint64_t(1) << (seq & 63);
+        if (col[2*nwords + w] & bit)
+            return 0;
+        return 1 << ((col[w] & bit ? 1 : 0) | (col[nwords + w] & bit ? 2 : 0));
+    }
+
+    // The column queries below only consider the sequences set in 'rows'
+    // (a bitset of get_num_words() words), or all sequences if rows is NULL.
+
+    // Returns true if all bases at 'pos' are equal (all unknown counts
+    // as invariant)
+    bool is_invariant_site(int pos, const uint64_t *rows=NULL) const;
+
+    // Returns true if some base at 'pos' is unknown
+    bool has_unknown(int pos, const uint64_t *rows=NULL) const;
+
+    // Returns the number of distinct known bases at 'pos'
+    int count_alleles(int pos, const uint64_t *rows=NULL) const;
+
+    // Sets 'bits' to the sequences carrying 'base' at 'pos'
+    void get_base_bits(int pos, int base, uint64_t *bits,
+                       const uint64_t *rows=NULL) const;
+
+    // Sets 'rows' to the bitset of the given sequences
+    void get_rows(const int *seqids, int n, uint64_t *rows) const;
+
+    inline int get_num_seqs() const
+    {
+        return nseqs;
+    }
+
+    inline int length() const
+    {
+        return seqlen;
+    }
+
+    // number of 64-bit words per bit-plane
+    inline int get_num_words() const
+    {
+        return nwords;
+    }
+
+    // approximate number of bytes used
+    long get_memory() const
+    {
+        return sizeof(uint64_t) * (bits.size() + all_rows.size());
+    }
+
+    // Returns the number of set bits in a bitset of n words
+    static inline int count_bits(const uint64_t *bits, int n)
+    {
+        int count = 0;
+        for (int w=0; w<n; w++)
+            count += __builtin_popcountll(bits[w]);
+        return count;
+    }
+
+protected:
+    inline const uint64_t *get_column(int pos) const
+    {
+        return &bits[3 * long(nwords) * pos];
+    }
+
+    inline uint64_t *get_column(int pos)
+    {
+        return &bits[3 * long(nwords) * pos];
+    }
+
+    int nseqs;
+    int seqlen;
+    int nwords;
+
+    // for each site: low bits, high bits and unknown bases
+    vector<uint64_t> bits;
+    vector<uint64_t> all_rows;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_PACKED_SEQS_H
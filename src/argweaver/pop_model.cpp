@@ -74,6 +74,7 @@ PopulationTree::PopulationTree(int npop, const ArgModel *model) :
     num_sub_path = NULL;
     max_matching_path_arr = NULL;
     min_matching_path_arr = NULL;
+    path_class_arr = NULL;
     max_migrations = -1;
 }
 
@@ -89,6 +90,7 @@ PopulationTree::PopulationTree(const PopulationTree &other) {
     num_sub_path = NULL;
     max_matching_path_arr = NULL;
     min_matching_path_arr = NULL;
+    path_class_arr = NULL;
     if (npop > 0) set_up_population_paths();
     update_population_probs();
     max_migrations = other.max_migrations;
@@ -135,6 +137,14 @@ PopulationTree::~PopulationTree() {
         }
         delete [] min_matching_path_arr;
     }
+    if (path_class_arr != NULL) {
+        for (int i=0; i < model->ntimes; i++) {
+            for (int j=i; j < model->ntimes; j++)
+                delete [] path_class_arr[i][j];
+            delete [] path_class_arr[i];
+        }
+        delete [] path_class_arr;
+    }
 }
 
 void PopulationTree::update_npop(int new_npop) {
@@ -198,8 +208,7 @@ bool PopulationTree::paths_equal(int path1, int path2, int t1, int t2) const {
     if (t1 > model->ntimes - 1) t1 = model->ntimes - 1;
     if (t2 == -1 || t2 > model->ntimes - 1) t2 = model->ntimes - 1;
     assert(t1 <= t2);
-    return ( max_matching_path(path1, path2, t1) >= t2 );
-    //    return max_matching_path[path1][path2][t1] >= t2;
+    return path_class(path1, t1, t2) == path_class(path2, t1, t2);
 }
 
 
@@ -222,15 +231,38 @@ void UniquePath::update_prob(const vector<PopulationPath> &all_paths,
 
 void PopulationTree::update_population_probs() {
     int ntime = model->ntimes;
+    const int npaths = all_paths.size();
     //    printf("update_population_probs\n");
 
-    // update sub_paths probs
+    // update sub_paths probs.  The probability and number of migrations
+    // of each path from t1 are extended one interval at a time, in the
+    // order UniquePath::update_prob() multiplies them, instead of walking
+    // the path again for every t2.
+    vector<double> probs(npaths);
+    vector<int> nmigs(npaths);
     for (int t1=0; t1 < ntime; t1++) {
+        fill(probs.begin(), probs.end(), 1.0);
+        fill(nmigs.begin(), nmigs.end(), 0);
         for (int t2=t1; t2 < ntime; t2++) {
+            if (t2 > t1) {
+                for (int p=0; p < npaths; p++) {
+                    double thisprob = mig_matrix[2*t2-1].get(
+                        all_paths[p].pop[t2-1], all_paths[p].pop[t2]);
+                    if (thisprob > 0 && thisprob < 0.5)
+                        nmigs[p]++;
+                    probs[p] *= thisprob;
+                }
+            }
             for (int p1=0; p1 < npop; p1++) {
                 for (int p2=0; p2 < npop; p2++) {
-                    sub_paths[t1][t2][p1][p2].update_probs(all_paths,
-                                                           mig_matrix);
+                    vector<UniquePath> &subs =
+                        sub_paths[t1][t2][p1][p2].unique_subs;
+                    for (unsigned int i=0; i < subs.size(); i++) {
+                        int p = subs[i].first_path();
+                        subs[i].prob = probs[p];
+                        subs[i].num_mig = nmigs[p];
+                        assert(probs[p] >= 0 && probs[p] <= 1.0);
+                    }
                 }
             }
         }
@@ -262,7 +294,7 @@ int PopulationTree::subpath_num_mig(int path, int t1, int t2) const {
     if (t2 < 0 || t2 >= model->ntimes) t2 = model->ntimes - 1;
     int pop1 = get_pop(path, t1);
     int pop2 = get_pop(path, t2);
-    int subpath = find_sub_path(path, sub_paths[t1][t2][pop1][pop2], t1, t2);
+    int subpath = sub_paths[t1][t2][pop1][pop2].path_map[path];
     return subpath_num_mig(t1, pop1, t2, pop2, subpath);
 }
 
@@ -365,6 +397,26 @@ void PopulationTree::set_up_population_paths() {
         }
     }
 
+    // each path's class is the first path that is equal to it over [t1, t2]
+    const int npaths = all_paths.size();
+    path_class_arr = new int **[ntime];
+    for (int t1=0; t1 < ntime; t1++) {
+        path_class_arr[t1] = new int *[ntime];
+        for (int t2=t1; t2 < ntime; t2++) {
+            int *path_class = path_class_arr[t1][t2] = new int [npaths];
+            for (int p=0; p < npaths; p++) {
+                path_class[p] = p;
+                for (int q=0; q < p; q++) {
+                    if (path_class[q] == q &&
+                        max_matching_path_arr[p][q][t1] >= t2) {
+                        path_class[p] = q;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
     // now get all possible paths for each possible start/end time start/end pop
     sub_paths = new SubPath ***[ntime];
     for (int t1=0; t1 < ntime; t1++) {
@@ -425,7 +477,6 @@ void PopulationTree::set_up_population_paths() {
  }
 
 
-// This could be made more efficient if necessary
 int PopulationTree::consistent_path(int path1, int path2,
                                     int t1, int t2, int t3,
                                     bool require_exists) const {
@@ -444,19 +495,17 @@ int PopulationTree::consistent_path(int path1, int path2,
             exitError("No consistent path found\n");
         return -1;
     }
+    // the paths equal to path1 from t1 to t2 are those of its sub-path
     SubPath *possible_paths = &sub_paths[t1][t2][p1][p2];
-    for (unsigned int i=0; i < possible_paths->size(); i++) {
-        int path = possible_paths->first_path(i);
-        if (paths_equal(path, path1, t1, t2)) {
-            UniquePath *u = &possible_paths->unique_subs[i];
-            for (set<int>::iterator it=u->path.begin(); it != u->path.end(); it++) {
-                path = *it;
-                assert(paths_equal(path, path1, t1, t2));
-                if (paths_equal(path, path2, t2, t3))
-                    return path;
-            }
-            break;
-        }
+    const int idx = possible_paths->path_map[path1];
+    assert(idx >= 0);
+    const int class2 = path_class(path2, t2, t3);
+    UniquePath *u = &possible_paths->unique_subs[idx];
+    for (set<int>::iterator it=u->path.begin(); it != u->path.end(); it++) {
+        int path = *it;
+        assert(paths_equal(path, path1, t1, t2));
+        if (path_class(path, t2, t3) == class2)
+            return path;
     }
     if (require_exists) {
         assert(0);
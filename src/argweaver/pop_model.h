@@ -16,7 +16,6 @@
 
 // arghmm includes
 #include "common.h"
-#include "model.h"
 
 namespace spidir {
     class Node;
@@ -389,6 +388,15 @@ class PopulationTree {
   int min_matching_path(int p1, int p2, int t) const;
   int ***min_matching_path_arr;
 
+  // path_class(p, t1, t2) is the smallest path index that is equal to path
+  // p from time t1 to t2 (t1 <= t2 < ntimes).  Two paths are equal over
+  // [t1, t2] iff they have the same class.  It is set in
+  // set_up_population_paths
+  int path_class(int p, int t1, int t2) const {
+      return path_class_arr[t1][t2][p];
+  }
+  int ***path_class_arr;
+
   // if this is >= 0, then do not allow threading into paths
   // which allow more than this many migrations
   int max_migrations;
@@ -0,0 +1,152 @@
+
+#include <atomic>
+#include <mutex>
+#include <sys/time.h>
+
+#include "mem.h"
+#include "profile.h"
+
+namespace argweaver {
+
+using namespace std;
+
+
+static const char *profile_phase_names[PROFILE_NPHASES] = {
+    "matrices",
+    "emissions",
+    "forward",
+    "traceback",
+    "add thread",
+    "remove thread",
+    "popsize",
+    "io",
+    "summarize"
+};
+
+
+// A phase reached through the phases of its ancestors
+class ProfileNode
+{
+public:
+    ProfileNode(int phase) :
+        phase(phase),
+        usecs(0),
+        ncalls(0)
+    {
+        for (int i=0; i<PROFILE_NPHASES; i++)
+            children[i] = NULL;
+    }
+
+    ~ProfileNode()
+    {
+        for (int i=0; i<PROFILE_NPHASES; i++)
+            delete children[i];
+    }
+
+    ProfileNode *get_child(int child_phase);
+    void clear();
+    void write(FILE *stream, int depth) const;
+
+    int phase;
+    atomic<long long> usecs;
+    atomic<long long> ncalls;
+    atomic<ProfileNode*> children[PROFILE_NPHASES];
+};
+
+
+static ProfileNode profile_root(-1);
+static mutex profile_lock;           // held while adding nodes
+static thread_local ProfileNode *profile_current = &profile_root;
+
+
+ProfileNode *ProfileNode::get_child(int child_phase)
+{
+    ProfileNode *child = children[child_phase];
+    if (child)
+        return child;
+
+    lock_guard<mutex> guard(profile_lock);
+    child = children[child_phase];
+    if (!child) {
+        child = new ProfileNode(child_phase);
+        children[child_phase] = child;
+    }
+    return child;
+}
+
+
+void ProfileNode::clear()
+{
+    usecs = 0;
+    ncalls = 0;
+    for (int i=0; i<PROFILE_NPHASES; i++)
+        if (children[i])
+            children[i].load()->clear();
+}
+
+
+void ProfileNode::write(FILE *stream, int depth) const
+{
+    long long child_usecs = 0;
+    for (int i=0; i<PROFILE_NPHASES; i++)
+        if (children[i])
+            child_usecs += children[i].load()->usecs;
+
+    if (phase >= 0 && ncalls > 0) {
+        fprintf(stream, "%*s%-*s %12lld %12.3f %12.3f\n",
+                2 * depth, "", 24 - 2 * depth, profile_phase_names[phase],
+                ncalls.load(), usecs / 1e6, (usecs - child_usecs) / 1e6);
+    }
+    for (int i=0; i<PROFILE_NPHASES; i++)
+        if (children[i])
+            children[i].load()->write(stream, depth + (phase >= 0));
+}
+
+
+ProfileScope::ProfileScope(ProfilePhase phase) :
+    parent(profile_current),
+    node(NULL)
+{
+    if (parent->phase != phase) {
+        node = parent->get_child(phase);
+        profile_current = node;
+    }
+}
+
+
+ProfileScope::~ProfileScope()
+{
+    if (!node)
+        return;
+    timeval stop, elapsed;
+    gettimeofday(&stop, NULL);
+    timersub(&stop, &timer.start_time, &elapsed);
+    node->usecs += elapsed.tv_sec * 1000000LL + elapsed.tv_usec;
+    node->ncalls++;
+    profile_current = parent;
+}
+
+
+void write_profile(FILE *stream)
+{
+    bool timed = false;
+    for (int i=0; i<PROFILE_NPHASES; i++)
+        if (profile_root.children[i] && profile_root.children[i].load()->ncalls)
+            timed = true;
+    if (!timed)
+        return;
+
+    fprintf(stream, "%-24s %12s %12s %12s\n",
+            "phase", "calls", "total (s)", "self (s)");
+    profile_root.write(stream, 0);
+    write_tag_memory(stream);
+}
+
+
+void clear_profile()
+{
+    profile_root.clear();
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,76 @@
+//=============================================================================
+// Time and calls of the phases of a run
+//
+// A ProfileScope times one phase of a run from its construction to its
+// destruction.  Phases started within another phase are kept as its
+// children, so that the profile splits the time of each phase between its
+// subphases and itself.  PROFILE_SCOPE() only creates a scope in builds
+// with -DARGWEAVER_PROFILE (make PHASES=1) and is empty otherwise.
+
+
+#ifndef ARGWEAVER_PROFILE_H
+#define ARGWEAVER_PROFILE_H
+
+// c/c++ includes
+#include <stdio.h>
+
+// arghmm includes
+#include "logging.h"
+
+namespace argweaver {
+
+
+enum ProfilePhase {
+    PROFILE_MATRICES,       // transition and emission matrices of blocks
+    PROFILE_EMISSIONS,
+    PROFILE_FORWARD,
+    PROFILE_TRACEBACK,      // including sampling recombinations
+    PROFILE_ADD_THREAD,
+    PROFILE_REMOVE_THREAD,
+    PROFILE_POPSIZE,
+    PROFILE_IO,
+    PROFILE_SUMMARIZE,      // statistics of arg-summarize
+    PROFILE_NPHASES
+};
+
+
+class ProfileNode;
+
+// Times a phase until destroyed.  A phase started within itself is
+// counted as part of the outer call.  Scopes of each thread nest on their
+// own; those of worker threads start at the top of the profile.
+class ProfileScope
+{
+public:
+    explicit ProfileScope(ProfilePhase phase);
+    ~ProfileScope();
+
+protected:
+    ProfileNode *parent;
+    ProfileNode *node;     // NULL if nested within the same phase
+    Timer timer;
+};
+
+
+// Writes the time and number of calls of each phase, indented by
+// nesting, and the memory of each subsystem (see mem.h).  Nothing is
+// written if no phase was timed.
+void write_profile(FILE *stream);
+
+// Clears the times of all phases.  No scope may be open.
+void clear_profile();
+
+
+#ifdef ARGWEAVER_PROFILE
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(phase) \
+    ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(phase)
+#else
+#define PROFILE_SCOPE(phase)
+#endif
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_PROFILE_H
@@ -0,0 +1,232 @@
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "query_server.h"
+#include "logging.h"
+
+namespace argweaver {
+
+
+//=============================================================================
+// cache
+
+shared_ptr<string> TextCache::get(const string &key)
+{
+    map<string, Entries::iterator>::iterator it = index.find(key);
+    if (it == index.end())
+        return shared_ptr<string>();
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+
+void TextCache::put(const string &key, const shared_ptr<string> &text)
+{
+    map<string, Entries::iterator>::iterator it = index.find(key);
+    if (it != index.end()) {
+        total_size -= it->second->second->size();
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    if (text->size() > max_size)
+        return;
+
+    entries.push_front(make_pair(key, text));
+    index[key] = entries.begin();
+    total_size += text->size();
+    while (total_size > max_size) {
+        total_size -= entries.back().second->size();
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+
+//=============================================================================
+// queries
+
+// Parses a JSON string starting at query[*pos] == '"'
+static bool parse_json_string(const string &query, size_t *pos, string *str)
+{
+    str->clear();
+    for (size_t i=*pos+1; i<query.size(); i++) {
+        char c = query[i];
+        if (c == '"') {
+            *pos = i + 1;
+            return true;
+        }
+        if (c == '\\') {
+            if (++i == query.size())
+                return false;
+            switch (query[i]) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case '"': case '\\': case '/': c = query[i]; break;
+            default: return false;
+            }
+        }
+        str->push_back(c);
+    }
+    return false;
+}
+
+
+bool parse_query_args(const string &query, vector<string> *args)
+{
+    args->clear();
+    size_t pos = query.find_first_not_of(" \t\r\n");
+    if (pos == string::npos)
+        return true;
+
+    if (query[pos] != '[') {
+        while (pos != string::npos) {
+            size_t end = query.find_first_of(" \t\r\n", pos);
+            args->push_back(query.substr(pos, end - pos));
+            pos = query.find_first_not_of(" \t\r\n", end);
+        }
+        return true;
+    }
+
+    // JSON array of strings
+    pos++;
+    bool expect_item = true;
+    while (true) {
+        pos = query.find_first_not_of(" \t\r\n", pos);
+        if (pos == string::npos)
+            return false;
+        if (query[pos] == ']') {
+            if (expect_item && !args->empty())
+                return false;
+            pos++;
+            break;
+        }
+        if (expect_item) {
+            if (query[pos] != '"')
+                return false;
+            string arg;
+            if (!parse_json_string(query, &pos, &arg))
+                return false;
+            args->push_back(arg);
+            expect_item = false;
+        } else {
+            if (query[pos] != ',')
+                return false;
+            pos++;
+            expect_item = true;
+        }
+    }
+    return query.find_first_not_of(" \t\r\n", pos) == string::npos;
+}
+
+
+// Returns the time in milliseconds of a monotonic clock
+static long long get_msecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+
+// Reads one line from a socket.  Returns false if the line is not
+// received within 'timeout' seconds.
+static bool read_query(int fd, string *query, int timeout)
+{
+    const size_t MAX_QUERY = 1 << 20;
+    const long long deadline = get_msecs() + timeout * 1000LL;
+    query->clear();
+    char buf[4096];
+    while (query->size() < MAX_QUERY) {
+        const long long wait = deadline - get_msecs();
+        if (wait <= 0)
+            return false;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        const int ready = poll(&pfd, 1, (int) wait);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            return false;
+
+        const ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            return !query->empty();
+        query->append(buf, n);
+        const size_t newline = query->find('\n');
+        if (newline != string::npos) {
+            query->resize(newline);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool serve_queries(int port,
+                   function<void(const vector<string> &args, int fd)> handler)
+{
+    const int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server == -1) {
+        printError("cannot open socket");
+        return false;
+    }
+    const int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(server, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(server, 16) != 0) {
+        printError("cannot listen on port %d", port);
+        close(server);
+        return false;
+    }
+
+    // clients that disconnect early must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    while (true) {
+        const int fd = accept(server, NULL, NULL);
+        if (fd == -1)
+            continue;
+
+        // answers to clients that do not read them are dropped
+        struct timeval send_timeout;
+        send_timeout.tv_sec = QUERY_TIMEOUT;
+        send_timeout.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+                   sizeof(send_timeout));
+
+        string query;
+        vector<string> args;
+        if (!read_query(fd, &query, QUERY_TIMEOUT)) {
+            // connection closed or timed out without a query
+        } else if (!parse_query_args(query, &args)) {
+            const char *msg = "Error: bad query\n";
+            if (write(fd, msg, strlen(msg)) == -1)
+                printError("cannot answer query");
+        } else {
+            handler(args, fd);
+        }
+        close(fd);
+    }
+    return true;
+}
+
+
+} // namespace argweaver
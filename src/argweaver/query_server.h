@@ -0,0 +1,70 @@
+//=============================================================================
+// A local server answering queries of a resident program
+
+
+#ifndef ARGWEAVER_QUERY_SERVER_H
+#define ARGWEAVER_QUERY_SERVER_H
+
+// c/c++ includes
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace argweaver {
+
+using namespace std;
+
+
+// Strings kept by key, up to a total size.  The least recently used
+// strings are dropped first.
+class TextCache
+{
+public:
+    TextCache(size_t max_size) :
+        max_size(max_size),
+        total_size(0)
+    {}
+
+    // returns NULL if key is not cached
+    shared_ptr<string> get(const string &key);
+    void put(const string &key, const shared_ptr<string> &text);
+
+    size_t size() const { return total_size; }
+
+protected:
+    typedef list<pair<string, shared_ptr<string> > > Entries;
+
+    size_t max_size;
+    size_t total_size;
+    Entries entries;     // most recently used first
+    map<string, Entries::iterator> index;
+};
+
+
+// Splits a query into arguments.  A query is either a JSON array of
+// strings or arguments separated by whitespace.  Returns false if the
+// query is badly formed.
+bool parse_query_args(const string &query, vector<string> *args);
+
+
+// Seconds a connection has to send its query, and to take each part of
+// its answer, before it is closed
+const int QUERY_TIMEOUT = 10;
+
+
+// Answers queries on a TCP port of the local host.  Each connection sends
+// one query line; 'handler' is called with its arguments and the socket,
+// to which it writes the answer, and the connection is then closed.
+// Queries are answered one at a time, so connections that are idle for
+// QUERY_TIMEOUT seconds are closed.  Returns false if the port cannot be
+// opened.
+bool serve_queries(int port,
+                   function<void(const vector<string> &args, int fd)> handler);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_QUERY_SERVER_H
@@ -1,6 +1,7 @@
 #include <algorithm>
 #include "local_tree.h"
 #include "matrices.h"
+#include "profile.h"
 
 namespace argweaver {
 
@@ -34,8 +35,7 @@ double recomb_prob_smcPrime_unnormalized_fullTree(const ArgModel *model,
     int pop = -1;
     for (int i=recomb_time*2; i <= 2*coal_time; i++) {
         pop = model->get_pop(recomb_path, (i+1)/2);
-        double rate = model->coal_time_steps[i] * lineages.nbranches_pop[pop][i]
-            / (2.0 * model->popsizes[pop][i]);
+        double rate = model->coal_rate(pop, i) * lineages.nbranches_pop[pop][i];
         if (i < 2*coal_time - 1)
             nocoal_rate += rate;
         else coal_rate += rate;
@@ -159,8 +159,7 @@ double recomb_prob_unnormalized(const ArgModel *model, const LocalTree *tree,
             - int( (! model->smc_prime) &&
                    coal_t < recomb_parent_age &&
                    model->get_pop(recomb_node_path, pop_t)==pop);
-        double rate = (model->coal_time_steps[m] * nbranches_m
-                       / (2.0 * model->popsizes[pop][m]));
+        double rate = model->coal_rate(pop, m) * nbranches_m;
         if (m >= 2*j-1)
             coal_sum += rate;
         else nocoal_sum += rate;
@@ -244,6 +243,7 @@ void sample_recombinations(
     int *thread_path, vector<int> &recomb_pos, vector<Spr> &recombs,
     bool internal)
 {
+    PROFILE_SCOPE(PROFILE_TRACEBACK);
     States states;
     LineageCounts lineages(model->ntimes, model->num_pops());
     vector <Spr> candidates;
@@ -256,7 +256,7 @@ void sample_recombinations(
         ArgHmmMatrices &matrices = matrix_iter->ref_matrices();
         LocalTree *tree = matrix_iter->get_tree_spr()->tree;
         lineages.count(tree, model->pop_tree, internal);
-        matrices.states_model.get_coal_states(tree, states);
+        states = matrices.states;
         int next_recomb = -1;
 
         // don't sample recombination if there is no state space
@@ -3,6 +3,7 @@
 //
 
 // c++ includes
+#include <functional>
 #include <vector>
 
 // arghmm includes
@@ -13,6 +14,7 @@
 #include "sample_arg.h"
 #include "sample_thread.h"
 #include "sequences.h"
+#include "thread_pool.h"
 #include "total_prob.h"
 
 
@@ -76,6 +78,136 @@ void sample_arg_seq(const ArgModel *model, Sequences *sequences,
 }
 
 
+// Returns the number of sites in [start, end) where sequences differ
+static int count_variant_sites(const Sequences *sequences, int start, int end)
+{
+    const int nseqs = sequences->get_num_seqs();
+    const char *const *seqs = sequences->get_seqs();
+    int nvariants = 0;
+    for (int i=start; i<end; i++) {
+        for (int j=1; j<nseqs; j++) {
+            if (seqs[j][i] != seqs[0][i]) {
+                nvariants++;
+                break;
+            }
+        }
+    }
+    return nvariants;
+}
+
+
+// Returns a logger writing where 'logger' and its chain write
+static Logger *copy_logger_chain(Logger *logger)
+{
+    Logger *copy = new Logger(logger->getLogFile(), logger->getLogLevel());
+    if (logger->getChain())
+        copy->setChain(copy_logger_chain(logger->getChain()));
+    return copy;
+}
+
+
+// sequentially sample an ARG in shards of about 'shard_size' bases that
+// overlap by 'overlap' bases.  Shards are sampled at the same time on the
+// threads of model->nthreads, those with the most variant sites first,
+// and refined by 'niters' resampling iterations before they are stitched
+// together in the middle of their overlaps.  Each shard draws from a
+// stream of make_rand_streams(), so that the ARG does not depend on
+// scheduling.
+void sample_arg_seq_shards(const ArgModel *model, Sequences *sequences,
+                           LocalTrees *trees, int shard_size, int overlap,
+                           int niters, int num_buildup)
+{
+    const int nseqs = sequences->get_num_seqs();
+    const int seqlen = sequences->length();
+    assert(trees->get_num_leaves() == 0 && model->pop_tree == NULL);
+
+    int start = trees->start_coord;
+    int end = trees->end_coord;
+    if (end != seqlen) {
+        start = 0;
+        end = seqlen;
+    }
+    const int nshards = max((end - start + shard_size - 1) / shard_size, 1);
+    if (nshards == 1) {
+        sample_arg_seq(model, sequences, trees, true, num_buildup);
+        return;
+    }
+
+    // every shard threads the sequences in the same order, so that the
+    // shards have the same leaves
+    vector<int> seqids;
+    for (int i=0; i<nseqs; i++)
+        seqids.push_back(i);
+    shuffle(&seqids[0], seqids.size());
+
+    // shard i covers the bases between bounds[i] and bounds[i+1] and
+    // half of the overlap on each side
+    vector<int> bounds;
+    for (int i=0; i<=nshards; i++)
+        bounds.push_back(start + int((end - start) * double(i) / nshards));
+    vector<LocalTrees*> shards;
+    vector<pair<int, int> > order;
+    for (int i=0; i<nshards; i++) {
+        const int shard_start = max(bounds[i] - overlap / 2, start);
+        const int shard_end = min(bounds[i+1] + overlap / 2, end);
+        shards.push_back(new LocalTrees(shard_start, shard_end));
+        shards[i]->chrom = trees->chrom;
+        order.push_back(make_pair(
+            -count_variant_sites(sequences, shard_start, shard_end), i));
+    }
+    sort(order.begin(), order.end());
+    vector<RandState> rands;
+    make_rand_streams(nshards, &rands);
+
+    printLog(LOG_LOW, "sample %d shards of %d bases\n", nshards,
+             (end - start) / nshards);
+    Logger *logger = &getLogger();
+    ForwardStats *forward_stats = &get_forward_stats();
+    ThreadPool *pool = get_thread_pool(model->nthreads);
+    auto sample_shard = [&](int k) {
+        const int i = order[k].second;
+        Logger *shard_logger = copy_logger_chain(logger);
+        RandState *prev_rand = set_thread_rand(&rands[i]);
+        Logger *prev_logger = setThreadLogger(shard_logger);
+        ForwardStats *prev_stats = set_thread_forward_stats(forward_stats);
+
+        LocalTrees *shard = shards[i];
+        shard->make_trunk(shard->start_coord, shard->end_coord, seqids[0], 0,
+                          2 * nseqs - 1);
+        for (int j=1; j<nseqs; j++) {
+            sample_arg_thread(model, sequences, shard, seqids[j]);
+            for (int buildup=1; buildup < num_buildup; buildup++)
+                resample_arg_random_leaf(model, sequences, shard);
+        }
+        for (int j=0; j<niters; j++)
+            resample_arg_all(model, sequences, shard, .1);
+        assert_trees(shard, model->pop_tree);
+        printLog(LOG_LOW, "shard %d-%d: %d trees\n", shard->start_coord,
+                 shard->end_coord, shard->get_num_trees());
+
+        set_thread_rand(prev_rand);
+        setThreadLogger(prev_logger);
+        set_thread_forward_stats(prev_stats);
+        delete shard_logger;
+    };
+    if (pool)
+        pool->run(nshards, sample_shard);
+    else
+        for (int k=0; k<nshards; k++)
+            sample_shard(k);
+
+    // stitch the shards
+    for (int i=1; i<nshards; i++) {
+        stitch_local_trees(shards[0], shards[i], bounds[i]);
+        delete shards[i];
+    }
+    assert_trees(shards[0], model->pop_tree);
+    trees->swap(*shards[0]);
+    delete shards[0];
+}
+
+
+
 // resample the threading of all the chromosomes
 void resample_arg(const ArgModel *model, Sequences *sequences,
                   LocalTrees *trees)
@@ -151,36 +283,158 @@ void resample_arg_random_leaf(const ArgModel *model, Sequences *sequences,
 
 
 
-// resample the threading of an internal branch using MCMC
-bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
-                       LocalTrees *trees)
+// Calls task(i) for i in [0, ntasks) on the threads of model->nthreads.
+// Each task draws from a stream of make_rand_streams(), so that results
+// do not depend on scheduling.
+static void run_rand_tasks(const ArgModel *model, int ntasks,
+                           const function<void(int)> &task)
+{
+    vector<RandState> rands;
+    make_rand_streams(ntasks, &rands);
+
+    Logger *logger = &getLogger();
+    ForwardStats *forward_stats = &get_forward_stats();
+    auto run_task = [&](int i) {
+        Logger *task_logger = copy_logger_chain(logger);
+        RandState *prev_rand = set_thread_rand(&rands[i]);
+        Logger *prev_logger = setThreadLogger(task_logger);
+        ForwardStats *prev_stats = set_thread_forward_stats(forward_stats);
+        task(i);
+        set_thread_rand(prev_rand);
+        setThreadLogger(prev_logger);
+        set_thread_forward_stats(prev_stats);
+        delete task_logger;
+    };
+    ThreadPool *pool = get_thread_pool(model->nthreads);
+    if (pool)
+        pool->run(ntasks, run_task);
+    else
+        for (int i=0; i<ntasks; i++)
+            run_task(i);
+}
+
+
+// Draws proposals of resample_arg_mcmc() from 'trees' into each of
+// 'proposals' at the same time: the thread of a removal path chosen
+// uniformly is sampled again.  lnpaths[i] is set to the log number of
+// removal paths of proposals[i], and the log number of removal paths of
+// 'trees' is returned.
+static double propose_arg_mcmc(const ArgModel *model,
+                               const Sequences *sequences,
+                               const LocalTrees *trees,
+                               vector<LocalTrees*> &proposals,
+                               vector<double> &lnpaths)
 {
     const int maxtime = model->get_removed_root_time();
-    int *removal_path = new int [trees->get_num_trees()];
+    const int nproposals = proposals.size();
+    vector<double> lnpaths0(nproposals);
+    lnpaths.resize(nproposals);
+
+    run_rand_tasks(model, nproposals, [&](int i) {
+            LocalTrees *proposal = proposals[i];
+            int *removal_path = new int [trees->get_num_trees()];
+            proposal->copy(*trees);
+            lnpaths0[i] = sample_arg_removal_path_uniform(
+                proposal, removal_path);
+            remove_arg_thread_path(proposal, removal_path, maxtime,
+                                   model->pop_tree);
+            sample_arg_thread_internal(model, sequences, proposal);
+            lnpaths[i] = count_total_arg_removal_paths(proposal);
+            delete [] removal_path;
+        });
+
+    return lnpaths0[0];
+}
 
-    // save a copy of the local trees
-    LocalTrees trees2;
-    trees2.copy(*trees);
 
-    // ramdomly choose a removal path
-    double npaths = sample_arg_removal_path_uniform(trees, removal_path);
-    remove_arg_thread_path(trees, removal_path, maxtime, model->pop_tree);
-    sample_arg_thread_internal(model, sequences, trees);
-    double npaths2 = count_total_arg_removal_paths(trees);
+// Weight w(y|x) of proposal y from x in multiple-try Metropolis, with
+// lambda(x, y) = 1 / (pi(x) T(x, y) + pi(y) T(y, x)).  The thread of y is
+// drawn from its conditional distribution, so that only the numbers of
+// removal paths of x and y remain.
+static inline double mcmc_try_weight(double lnpaths_from, double lnpaths_to)
+{
+    return 1.0 / (1.0 + exp(lnpaths_to - lnpaths_from));
+}
+
+
+// resample the threading of an internal branch using MCMC.  With ntries >
+// 1, a multiple-try Metropolis step draws ntries proposals at once on the
+// threads of model->nthreads and moves to at most one of them.
+bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
+                       LocalTrees *trees, int ntries)
+{
+    ntries = max(ntries, 1);
+
+    if (ntries == 1) {
+        const int maxtime = model->get_removed_root_time();
+        int *removal_path = new int [trees->get_num_trees()];
+
+        // save a copy of the local trees
+        LocalTrees trees2;
+        trees2.copy(*trees);
+
+        // ramdomly choose a removal path
+        double npaths = sample_arg_removal_path_uniform(trees, removal_path);
+        remove_arg_thread_path(trees, removal_path, maxtime, model->pop_tree);
+        sample_arg_thread_internal(model, sequences, trees);
+        double npaths2 = count_total_arg_removal_paths(trees);
+
+        // perform reject if needed
+        double accept_prob = exp(npaths - npaths2);
+        bool accept = (frand() < accept_prob);
+        if (!accept)
+            trees->swap(trees2);
+
+        // logging
+        printLog(LOG_LOW, "accept_prob = exp(%lf - %lf) = %f, accept = %d\n",
+                 npaths, npaths2, accept_prob, (int) accept);
+
+        // clean up
+        delete [] removal_path;
+
+        return accept;
+    }
 
-    // perform reject if needed
-    double accept_prob = exp(npaths - npaths2);
+    // choose one of the tries by its weight
+    vector<LocalTrees*> proposals(ntries);
+    for (int i=0; i<ntries; i++)
+        proposals[i] = new LocalTrees();
+    vector<double> lnpaths;
+    const double npaths = propose_arg_mcmc(model, sequences, trees,
+                                           proposals, lnpaths);
+    vector<double> weights(ntries);
+    double total = 0.0;
+    for (int i=0; i<ntries; i++) {
+        weights[i] = mcmc_try_weight(npaths, lnpaths[i]);
+        total += weights[i];
+    }
+    const int choice = sample(&weights[0], ntries);
+    LocalTrees *proposal = proposals[choice];
+    proposals[choice] = proposals.back();
+    proposals.pop_back();
+
+    // reference points drawn from the chosen try, with the current ARG as
+    // the last one
+    vector<double> lnpaths_ref;
+    propose_arg_mcmc(model, sequences, proposal, proposals, lnpaths_ref);
+    double total_ref = mcmc_try_weight(lnpaths[choice], npaths);
+    for (int i=0; i<ntries-1; i++)
+        total_ref += mcmc_try_weight(lnpaths[choice], lnpaths_ref[i]);
+
+    double accept_prob = total / total_ref;
     bool accept = (frand() < accept_prob);
-    if (!accept)
-        trees->copy(trees2);
+    if (accept)
+        trees->swap(*proposal);
 
     // logging
-    printLog(LOG_LOW, "accept_prob = exp(%lf - %lf) = %f, accept = %d\n",
-             npaths, npaths2, accept_prob, (int) accept);
-
+    printLog(LOG_LOW, "accept_prob = %f / %f = %f (try %d of %d), "
+             "accept = %d\n", total, total_ref, accept_prob, choice + 1,
+             ntries, (int) accept);
 
     // clean up
-    delete [] removal_path;
+    delete proposal;
+    for (unsigned int i=0; i<proposals.size(); i++)
+        delete proposals[i];
 
     return accept;
 }
@@ -256,11 +510,38 @@ void resample_arg_recomb(const ArgModel *model, Sequences *sequences,
 
 
 
-// resample an ARG heuristically and aggressively to high joint probability
+// resample an ARG heuristically and aggressively to high joint probability.
+// With ntries > 1, ntries resamplings are drawn at once on the threads of
+// model->nthreads and the one of highest joint probability is kept.
 void resample_arg_climb(const ArgModel *model, Sequences *sequences,
-                        LocalTrees *trees, double recomb_preference)
+                        LocalTrees *trees, double recomb_preference,
+                        int ntries)
 {
-    resample_arg_recomb(model, sequences, trees, recomb_preference);
+    if (ntries <= 1) {
+        resample_arg_recomb(model, sequences, trees, recomb_preference);
+        return;
+    }
+
+    vector<LocalTrees*> tries(ntries);
+    vector<double> lnls(ntries);
+    run_rand_tasks(model, ntries, [&](int i) {
+            tries[i] = new LocalTrees();
+            tries[i]->copy(*trees);
+            resample_arg_recomb(model, sequences, tries[i],
+                                recomb_preference);
+            lnls[i] = calc_arg_joint_prob(model, sequences, tries[i]);
+        });
+
+    int best = 0;
+    for (int i=1; i<ntries; i++)
+        if (lnls[i] > lnls[best])
+            best = i;
+    trees->swap(*tries[best]);
+    printLog(LOG_LOW, "climb: try %d of %d, joint prob = %f\n",
+             best + 1, ntries, lnls[best]);
+
+    for (int i=0; i<ntries; i++)
+        delete tries[i];
 }
 
 
@@ -499,13 +780,8 @@ int resample_arg_by_time_and_hap(
             region_end = trees->end_coord;
         } else region_end = break_coords[i]+1;
 
-        LocalTrees otrees;
-        otrees.copy(*trees);
-
         // partion trees into three segments
         LocalTrees *trees2 = partition_local_trees(trees, region_start, true);
-        LocalTrees otrees2;
-        otrees2.copy(*trees2);
         LocalTrees *trees3 = partition_local_trees(trees2, region_end, true);
         Spr stub_spr;
         int *stub_mapping=NULL;
@@ -620,31 +896,16 @@ int resample_arg_by_time_and_hap(
 }
 
 
-// resample an ARG only for a given region
-// all branches are possible to resample
-// open_ended -- If true and region touches start or end of local trees do not
-//               conditioned on state.
-double resample_arg_region(
-    const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int region_start, int region_end, int niters,
-    bool open_ended, double heat)
+// resample the ARG of a window cut out of the local trees by
+// partition_local_trees().  Start and end states are not conditioned on
+// if open_start and open_end are set.  Returns the number of accepts.
+static int resample_arg_window(
+    const ArgModel *model, const Sequences *sequences, LocalTrees *trees2,
+    int niters, bool open_start, bool open_end, double heat)
 {
     const int maxtime = model->get_removed_root_time();
-    static int count=0;
-
-    // special case: zero length region
-    if (region_start == region_end)
-        return 1.0;
-
-    // assert region is within trees
-    assert(region_start >= trees->start_coord);
-    assert(region_end <= trees->end_coord);
-    assert(region_start < region_end);
-
-    // partion trees into three segments
-    LocalTrees *trees2 = partition_local_trees(trees, region_start);
-    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
-    assert(trees2->length() == region_end - region_start);
+    const int region_start = trees2->start_coord;
+    const int region_end = trees2->end_coord;
 
     // TODO: refactor
     // extend stub (zero length block) if it happens to exist
@@ -655,10 +916,15 @@ double resample_arg_region(
     }
 
 
+    // the path counts of the current ARG are kept across iterations: those
+    // of an accepted proposal become current, and a rejected proposal
+    // leaves them unchanged
+    RemovalPaths removal_paths(trees2), removal_paths2(trees2);
+    count_arg_removal_paths(trees2, removal_paths);
+
     // perform several iterations of resampling
     int accepts = 0;
     for (int i=0; i<niters; i++) {
-        count++;
         printLog(LOG_LOW, "region sample: iter=%d, region=(%d, %d)\n",
                  i, region_start, region_end);
 
@@ -673,7 +939,8 @@ double resample_arg_region(
         // remove internal branch from trees2
         int *removal_path = new int [trees2->get_num_trees()];
         double npaths;
-        npaths = sample_arg_removal_path_uniform(trees2, removal_path);
+        npaths = sample_arg_removal_path_uniform(removal_paths,
+                                                 removal_path);
         remove_arg_thread_path(trees2, removal_path, maxtime, model->pop_tree);
         delete [] removal_path;
         assert_trees(trees2, model->pop_tree, true);
@@ -687,12 +954,11 @@ double resample_arg_region(
             &end_tree, end_tree_partial, maxtime);
 
         // set start/end state to null if open ended is requested
-        if (open_ended) {
-            if (region_start == trees->start_coord)
-                start_state.set_null();
-            if (region_end == trees3->end_coord)
-                end_state.set_null();
-        }
+        if (open_start)
+            start_state.set_null();
+        if (open_end)
+            end_state.set_null();
+
         // sample new ARG conditional on start and end states
         decLogLevel();
         cond_sample_arg_thread_internal(model, sequences, trees2,
@@ -700,15 +966,18 @@ double resample_arg_region(
         incLogLevel();
         assert_trees(trees2, model->pop_tree);
 
-        double npaths2 = count_total_arg_removal_paths(trees2);
+        count_arg_removal_paths(trees2, removal_paths2);
+        double npaths2 = count_total_arg_removal_paths(removal_paths2);
 
             // perform reject if needed
         double accept_prob = exp(heat*(npaths - npaths2));
         bool accept = (frand() < accept_prob);
 
         if (!accept) {
-            trees2->copy(old_trees2);
+            // restore saved trees; rejected trees are freed with old_trees2
+            trees2->swap(old_trees2);
         } else {
+            removal_paths.swap(removal_paths2);
             accepts++;
         }
 
@@ -725,6 +994,37 @@ double resample_arg_region(
         trees2->end_coord--;
     }
 
+    return accepts;
+}
+
+
+// resample the region [region_start, region_end) of an ARG.  The ends of
+// the region are free if they are the ends of the local trees and
+// open_start or open_end is set.
+static double resample_arg_subregion(
+    const ArgModel *model, Sequences *sequences,
+    LocalTrees *trees, int region_start, int region_end, int niters,
+    bool open_start, bool open_end, double heat)
+{
+    // special case: zero length region
+    if (region_start == region_end)
+        return 1.0;
+
+    // assert region is within trees
+    assert(region_start >= trees->start_coord);
+    assert(region_end <= trees->end_coord);
+    assert(region_start < region_end);
+
+    // partion trees into three segments
+    LocalTrees *trees2 = partition_local_trees(trees, region_start);
+    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
+    assert(trees2->length() == region_end - region_start);
+
+    int accepts = resample_arg_window(
+        model, sequences, trees2, niters,
+        open_start && region_start == trees->start_coord,
+        open_end && region_end == trees3->end_coord, heat);
+
     // rejoin trees
     append_local_trees(trees, trees2, true, model->pop_tree);
     append_local_trees(trees, trees3, true, model->pop_tree);
@@ -737,30 +1037,131 @@ double resample_arg_region(
 }
 
 
+// resample an ARG only for a given region
+// all branches are possible to resample
+// open_ended -- If true and region touches start or end of local trees do not
+//               conditioned on state.
+double resample_arg_region(
+    const ArgModel *model, Sequences *sequences,
+    LocalTrees *trees, int region_start, int region_end, int niters,
+    bool open_ended, double heat)
+{
+    return resample_arg_subregion(model, sequences, trees,
+                                  region_start, region_end, niters,
+                                  open_ended, open_ended, heat);
+}
+
+
+// resample the windows [starts[i], starts[i] + window) for every other i
+// starting at 'first'.  These windows do not overlap, so they are cut out
+// of the local trees and resampled at the same time on the threads of
+// 'pool'.  Each window draws from a stream of make_rand_streams(), so
+// that results do not depend on scheduling.  Returns the sum of the accept
+// rates.
+static double resample_arg_windows_parallel(
+    const ArgModel *model, const Sequences *sequences,
+    LocalTrees *trees, const vector<int> &starts, int first, int window,
+    int niters, double heat, bool open_start, bool open_end,
+    ThreadPool *pool)
+{
+    const int start_coord = trees->start_coord;
+    const int end_coord = trees->end_coord;
+    double accept_rate = 0.0;
+
+    // cut the windows and the gaps after them out of the local trees
+    vector<LocalTrees*> windows;
+    vector<LocalTrees*> gaps;
+    LocalTrees *rest = trees;
+    for (unsigned int i=first; i<starts.size(); i+=2) {
+        int start = starts[i];
+        int end = min(start + window, end_coord);
+        if (start == end) {
+            // special case: zero length region
+            accept_rate += 1.0;
+            continue;
+        }
+        LocalTrees *trees2 = partition_local_trees(rest, start);
+        LocalTrees *trees3 = partition_local_trees(trees2, end);
+        assert(trees2->length() == end - start);
+        windows.push_back(trees2);
+        gaps.push_back(trees3);
+        rest = trees3;
+    }
+    vector<RandState> rands;
+    make_rand_streams(windows.size(), &rands);
+
+    Logger *logger = &getLogger();
+    ForwardStats *forward_stats = &get_forward_stats();
+    vector<int> accepts(windows.size());
+    pool->run(windows.size(), [&](int i) {
+            Logger *window_logger = copy_logger_chain(logger);
+            RandState *prev_rand = set_thread_rand(&rands[i]);
+            Logger *prev_logger = setThreadLogger(window_logger);
+            ForwardStats *prev_stats =
+                set_thread_forward_stats(forward_stats);
+
+            LocalTrees *trees2 = windows[i];
+            accepts[i] = resample_arg_window(
+                model, sequences, trees2, niters,
+                open_start && trees2->start_coord == start_coord,
+                open_end && trees2->end_coord == end_coord, heat);
+
+            set_thread_rand(prev_rand);
+            setThreadLogger(prev_logger);
+            set_thread_forward_stats(prev_stats);
+            delete window_logger;
+        });
+
+    // rejoin trees
+    for (unsigned int i=0; i<windows.size(); i++) {
+        append_local_trees(trees, windows[i], true, model->pop_tree);
+        append_local_trees(trees, gaps[i], true, model->pop_tree);
+        delete windows[i];
+        delete gaps[i];
+        accept_rate += accepts[i] / double(niters);
+    }
+
+    return accept_rate;
+}
 
 
-// resample an ARG a region at a time in a sliding window
+// resample an ARG a region at a time in a sliding window.  Unless
+// open_start or open_end is set, the first or last local tree is kept.
 double resample_arg_regions(
     const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int window, int niters, double heat)
+    LocalTrees *trees, int window, int niters, double heat,
+    bool open_start, bool open_end)
 {
     decLogLevel();
     double accept_rate = 0.0;
-    int nwindows = 0;
     int currwindow = irand(window - window/4, window + window/4);
     int currstep = (int)currwindow/2+1;
+    vector<int> starts;
     for (int start=trees->start_coord;
          start == trees->start_coord || start+currwindow/2 <trees->end_coord;
          start+=currstep)
-    {
-        nwindows++;
-        int end = min(start + currwindow, trees->end_coord);
-        accept_rate += resample_arg_region(
-             model, sequences, trees, start, end, niters, true, heat);
+        starts.push_back(start);
+
+    ThreadPool *pool = (model->parallel_windows ?
+                        get_thread_pool(model->nthreads) : NULL);
+    if (pool) {
+        // windows two apart do not overlap: resample every other window
+        // at once, then the windows in between
+        for (int first=0; first<2; first++)
+            accept_rate += resample_arg_windows_parallel(
+                model, sequences, trees, starts, first, currwindow,
+                niters, heat, open_start, open_end, pool);
+    } else {
+        for (unsigned int i=0; i<starts.size(); i++) {
+            int end = min(starts[i] + currwindow, trees->end_coord);
+            accept_rate += resample_arg_subregion(
+                model, sequences, trees, starts[i], end, niters,
+                open_start, open_end, heat);
+        }
     }
     incLogLevel();
 
-    accept_rate /= nwindows;
+    accept_rate /= starts.size();
     return accept_rate;
 }
 
@@ -918,6 +1319,68 @@ LocalTrees *arghmm_sample_arg_seq(
 }
 
 
+// sample several threads of the first chromosome missing from the ARG,
+// all drawn from one forward table.  path_nodes[k][i] and path_times[k][i]
+// give the state of thread k at the i-th position of the local trees.
+void arghmm_sample_thread_paths(
+    LocalTrees *trees, double *times, int ntimes,
+    double **popsizes, double rho, double mu,
+    char **seqs, int nseqs, int seqlen, int npaths,
+    int **path_nodes, int **path_times)
+{
+    // setup model, local trees, sequences
+    ArgModel model(ntimes, times, popsizes, rho, mu);
+    Sequences sequences(seqs, nseqs, seqlen);
+    const int new_chrom = trees->get_num_leaves();
+
+    vector<int*> paths(npaths);
+    for (int k=0; k<npaths; k++)
+        paths[k] = new int [trees->length()] - trees->start_coord;
+    sample_arg_thread_paths(&model, &sequences, trees, new_chrom,
+                            &paths[0], npaths);
+
+    // convert state indices to nodes and times
+    States states;
+    int end = trees->start_coord;
+    for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it) {
+        int start = end;
+        end = start + it->blocklen;
+        get_coal_states(it->tree, ntimes, states);
+
+        for (int k=0; k<npaths; k++) {
+            for (int i=start; i<end; i++) {
+                const State &state = states[paths[k][i]];
+                path_nodes[k][i - trees->start_coord] = state.node;
+                path_times[k][i - trees->start_coord] = state.time;
+            }
+        }
+    }
+
+    for (int k=0; k<npaths; k++)
+        delete [] (paths[k] + trees->start_coord);
+}
+
+
+// Same as arghmm_sample_thread_paths(), with the paths written to
+// contiguous npaths x seqlen arrays.
+void arghmm_sample_thread_paths_buffer(
+    LocalTrees *trees, double *times, int ntimes,
+    double **popsizes, double rho, double mu,
+    char **seqs, int nseqs, int seqlen, int npaths,
+    int *path_nodes, int *path_times)
+{
+    const long stride = trees->length();
+    vector<int*> node_rows(npaths), time_rows(npaths);
+    for (int k=0; k<npaths; k++) {
+        node_rows[k] = &path_nodes[k * stride];
+        time_rows[k] = &path_times[k * stride];
+    }
+    arghmm_sample_thread_paths(trees, times, ntimes, popsizes, rho, mu,
+                               seqs, nseqs, seqlen, npaths,
+                               &node_rows[0], &time_rows[0]);
+}
+
+
 // resample an ARG with gibbs
 LocalTrees *arghmm_resample_arg(
     LocalTrees *trees, double *times, int ntimes,
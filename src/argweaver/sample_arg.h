@@ -21,6 +21,10 @@ using namespace std;
 void sample_arg_seq(const ArgModel *model, Sequences *sequences,
                     LocalTrees *trees, bool random=false, int num_buildup=1);
 
+void sample_arg_seq_shards(const ArgModel *model, Sequences *sequences,
+                           LocalTrees *trees, int shard_size, int overlap,
+                           int niters=0, int num_buildup=1);
+
 void resample_arg(const ArgModel *model, Sequences *sequences,
                   LocalTrees *trees);
 
@@ -33,16 +37,19 @@ void resample_arg_leaf(const ArgModel *model, Sequences *sequences,
 void resample_arg_random_leaf(const ArgModel *model, Sequences *sequences,
 			      LocalTrees *trees);
 
+// ntries > 1 makes a multiple-try Metropolis step from ntries proposals
 bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
-                       LocalTrees *trees, double heat=1.0);
+                       LocalTrees *trees, int ntries=1);
 
 void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                            LocalTrees *trees, bool do_leaf,
                            int window, int niters, double heat=1.0,
                            bool no_resample_mig=false);
 
+// ntries > 1 keeps the most probable of ntries resamplings
 void resample_arg_climb(const ArgModel *model, Sequences *sequences,
-                        LocalTrees *trees, double recomb_preference);
+                        LocalTrees *trees, double recomb_preference,
+                        int ntries=1);
 
 void remax_arg(const ArgModel *model, const Sequences *sequences,
                LocalTrees *trees, int nremove=1);
@@ -72,7 +79,7 @@ double resample_arg_cut(
 double resample_arg_regions(
     const ArgModel *model, Sequences *sequences,
     LocalTrees *trees, int window, int niters=1,
-    double heat=1.0);
+    double heat=1.0, bool open_start=true, bool open_end=true);
 
 int resample_arg_by_time_and_hap(
     const ArgModel *model, Sequences *sequences,
@@ -11,10 +11,12 @@
 #include "logging.h"
 #include "matrices.h"
 #include "model.h"
+#include "profile.h"
 #include "recomb.h"
 #include "sample_thread.h"
 #include "sequences.h"
 #include "sequences.h"
+#include "simd.h"
 #include "states.h"
 #include "thread.h"
 #include "trans.h"
@@ -29,18 +31,52 @@ using namespace std;
 //=============================================================================
 // Forward algorithm for thread path
 
+// number of time points for which a specialized forward kernel is compiled
+const int FORWARD_FIXED_NTIMES = 20;
+
+
+// Zeroes the states of a normalized forward column whose mass is below
+// 'threshold', keeping at least the largest one, and renormalizes the rest.
+// Returns the mass dropped and adds the states dropped to 'npruned'.
+double prune_forward_column(double *col, int nstates, double threshold,
+                            long long *npruned)
+{
+    threshold = min(threshold, max_array(col, nstates));
+    double dropped = 0.0;
+    for (int k=0; k<nstates; k++) {
+        if (col[k] > 0.0 && col[k] < threshold) {
+            dropped += col[k];
+            col[k] = 0.0;
+            (*npruned)++;
+        }
+    }
+    if (dropped > 0.0)
+        simd_div(col, nstates, 1.0 - dropped);
+    return dropped;
+}
+
+
 // compute one block of forward algorithm with compressed transition matrices
+// Emissions are read from 'emit' or, if it is NULL, computed for each column
+// i from site i + site_offset of 'site_emit'.
+// With model->fw_prune > 0, each column is pruned by prune_forward_column()
+// and the same branch sums of branches without mass in the previous column
+// are skipped.
+// NTIMES is the number of time points if known at compile time (0 reads it
+// from the model).  MULTIPOP must be true iff the model has several
+// population paths.
 // NOTE: first column of forward table should be pre-populated
-void arghmm_forward_block(const ArgModel *model,
-                          const LocalTree *tree,
-                          const int blocklen, const States &states,
-                          const LineageCounts &lineages,
-                          const TransMatrix *matrix,
-                          const double* const *emit, double **fw)
+template <int NTIMES, bool MULTIPOP>
+static void arghmm_forward_block_kernel(
+    const ArgModel *model, const LocalTree *tree,
+    const int blocklen, const States &states,
+    const LineageCounts &lineages, const TransMatrix *matrix,
+    const double* const *emit, SiteEmissions *site_emit, int site_offset,
+    double **fw)
 {
     const int nstates = states.size();
     const LocalNode *nodes = tree->nodes;
-    const int ntimes = model->ntimes;
+    const int ntimes = NTIMES > 0 ? NTIMES : model->ntimes;
 
     //  handle internal branch resampling special cases
     int minage = matrix->minage;
@@ -56,35 +92,42 @@ void arghmm_forward_block(const ArgModel *model,
         }
     }
 
-    // get max time
+    // get max time, and the min time, below which there are no states
+    // (for internal branches, none below minage and the subtree root)
     int maxtime = 0;
-    for (int k=0; k<nstates; k++)
+    int mintime = ntimes;
+    for (int k=0; k<nstates; k++) {
         if (maxtime < states[k].time)
             maxtime = states[k].time;
+        if (mintime > states[k].time)
+            mintime = states[k].time;
+    }
 
-    int numpath = model->num_pop_paths();
+    const int numpath = MULTIPOP ? model->num_pop_paths() : 1;
     int numpath_per_time[ntimes];
     int paths_per_time[ntimes][numpath];
     int path_map[states.size()];
     int max_numpath = 1;
-    if (numpath > 1) {
+    if (MULTIPOP) {
+        // class_slot[t][c] is the index within paths_per_time[t] of the
+        // paths of class c (equal from minage to t), or -1
+        int class_slot[ntimes][numpath];
         for (int i=0; i < ntimes; i++) {
             numpath_per_time[i]=0;
-            for (int j=0; j < numpath; j++)
+            for (int j=0; j < numpath; j++) {
                 paths_per_time[i][j]=0;
+                class_slot[i][j]=-1;
+            }
         }
         for (unsigned int i=0; i < states.size(); i++) {
             int t = states[i].time;
             int p = states[i].pop_path;
-            int j=0;
-            for ( ; j < numpath_per_time[t]; j++) {
-                if (model->paths_equal(p, paths_per_time[t][j],
-                                       minage, t))
-                    break;
+            int &j = class_slot[t][model->path_class(p, minage, t)];
+            if (j < 0) {
+                j = numpath_per_time[t]++;
+                paths_per_time[t][j] = p;
             }
             path_map[i] = j;
-            if (j == numpath_per_time[t])
-                paths_per_time[t][numpath_per_time[t]++] = p;
         }
         for (int i=0; i < ntimes; i++)
             if (numpath_per_time[i] > max_numpath)
@@ -115,19 +158,32 @@ void arghmm_forward_block(const ArgModel *model,
     }
 
     // compute ntimes*ntimes and ntime*nstates temp matrices
-    double tmatrix[ntimes-1][max_numpath][ntimes-1][max_numpath];
-    for (int b=0; b<ntimes-1; b++) {
-        for (int pb=0; pb < numpath_per_time[b]; pb++) {
+    // each row (b, pb) of tmatrix is stored contiguously over (a, pa)
+    // so that it can be folded with fgroups as a single dot product.
+    // Entries for unused paths are zero.  Rows and columns of times below
+    // mintime are never used: those rows are skipped and those columns are
+    // zero, and the dot products start at group0, the first group of
+    // mintime rounded down to a multiple of the widest SIMD width so that
+    // their sums are the same as over all groups.
+    const int ngroups = (ntimes-1) * max_numpath;
+    const int group0 = min(mintime, ntimes-1) * max_numpath / 8 * 8;
+    double tmatrix[ntimes-1][max_numpath][ngroups];
+    for (int b=mintime; b<ntimes-1; b++) {
+        for (int pb=0; pb < max_numpath; pb++) {
             for (int a=0; a<ntimes-1; a++) {
-                for (int pa=0; pa < numpath_per_time[a]; pa++) {
-                    tmatrix[b][pb][a][pa] =
-                        matrix->get_time(a, b, 0,
-                                         paths_per_time[a][pa],
-                                         paths_per_time[b][pb],
-                                         -1, minage, false);
-                    //                    printf("tmatrix %i %i = %e\n", a, b, tmatrix[pa][pb][a][b]);
-                    assert(!isnan(tmatrix[b][pb][a][pa]));
-                    assert(!isinf(tmatrix[b][pb][a][pa]));
+                for (int pa=0; pa < max_numpath; pa++) {
+                    double &val = tmatrix[b][pb][a*max_numpath + pa];
+                    if (a < mintime || pb >= numpath_per_time[b] ||
+                        pa >= numpath_per_time[a]) {
+                        val = 0.0;
+                        continue;
+                    }
+                    val = matrix->get_time(a, b, 0,
+                                           paths_per_time[a][pa],
+                                           paths_per_time[b][pb],
+                                           -1, minage, false);
+                    assert(!isnan(val));
+                    assert(!isinf(val));
                 }
             }
         }
@@ -161,7 +217,7 @@ void arghmm_forward_block(const ArgModel *model,
 
     // there is one more special case for different path, same time, same node
     double tmatrix3[nstates][max_numpath];
-    if (max_numpath > 1) {
+    if (MULTIPOP && max_numpath > 1) {
         for (int k=0; k < nstates; k++) {
             for (int i=0; i <max_numpath; i++) tmatrix3[k][i]=0.0;
             int b = states[k].time;
@@ -177,12 +233,19 @@ void arghmm_forward_block(const ArgModel *model,
         }
     }
 
+    // Build a gather list for each state k: the previous states j that
+    // reach k by a same-branch transition, together with the extra
+    // probability of that transition.  Impossible transitions are given
+    // probability zero (and a valid dummy index) so that the list can be
+    // evaluated with a single gather/dot product.
     NodeStateLookup state_lookup(states, minage, model->pop_tree);
     int max_idx = ntimes*nstates + max_numpath*nstates;
-    int nextState[max_idx];
+    int next_state[max_idx];
+    double next_prob[max_idx];
+    int state_start[nstates+1];
     int idx=0;
-    int age1_state[nstates];
     for (int k=0; k<nstates; k++) {
+        state_start[k] = idx;
         const int b = states[k].time;
         const int node2 = states[k].node;
         int age1 = ages1[node2];
@@ -194,57 +257,86 @@ void arghmm_forward_block(const ArgModel *model,
             age1++;
             j = state_lookup.lookup_idx(node2, age1, path2);
         }
-        age1_state[k] = age1;
         for (int a=age1; a <= age2; a++, j++) {
             int j_state = state_lookup.lookup_by_idx(j);
             if (j_state >= 0 &&
                 (model->pop_tree == NULL || a >= b ||
                  model->paths_equal(path1,
                                     path2, a, b))) {
-                nextState[idx++]=j_state;
-            } else nextState[idx++] = -1;
+                next_state[idx] = j_state;
+                next_prob[idx++] = tmatrix2[k][a];
+            } else {
+                next_state[idx] = 0;
+                next_prob[idx++] = 0.0;
+            }
         }
         // this setion accounts for self-recombinations that change paths
         // (same node, same time, different path)
-        if (max_numpath > 1) {
+        if (MULTIPOP && max_numpath > 1) {
             for (int pa=0; pa < numpath_per_time[b]; pa++) {
                 int path_a = paths_per_time[b][pa];
+                int j_state = -1;
                 if (!model->paths_equal(path_a, path2, minage, b))
-                    nextState[idx++] = state_lookup.lookup(node2, b, path_a);
-                else nextState[idx++] = -1;
+                    j_state = state_lookup.lookup(node2, b, path_a);
+                if (j_state >= 0) {
+                    next_state[idx] = j_state;
+                    next_prob[idx++] = tmatrix3[k][pa];
+                } else {
+                    next_state[idx] = 0;
+                    next_prob[idx++] = 0.0;
+                }
             }
         }
     }
+    state_start[nstates] = idx;
     assert(idx <= max_idx);
 
 
     double tmatrix_fgroups[max_numpath][ntimes];
-    double fgroups[max_numpath][ntimes];
+    double fgroups[ntimes * max_numpath];
+    double site_row[nstates];
+
+    // branches with mass in the previous column, when pruning
+    const double prune = model->fw_prune;
+    bool live[prune > 0.0 ? tree->nnodes : 1];
+    long long npruned = 0;
+    double pruned_mass = 0.0;
+
     for (int i=1; i<blocklen; i++) {
         const double *col1 = fw[i-1];
         double *col2 = fw[i];
-        const double *emit2 = emit[i];
-        idx = 0;
+        const double *emit2 = emit ? emit[i] : site_row;
+        if (!emit)
+            site_emit->get(i + site_offset, site_row);
 
         // precompute the fgroup sums
-        for (int p=0; p < max_numpath; p++)
-            fill(fgroups[p], fgroups[p]+ntimes, 0.0);
+        fill(fgroups, fgroups + ntimes * max_numpath, 0.0);
+        if (prune > 0.0) {
+            fill(live, live + tree->nnodes, false);
+            for (int j=0; j<nstates; j++)
+                if (col1[j] > 0.0)
+                    live[states[j].node] = true;
+        }
         for (int j=0; j<nstates; j++) {
             const int a = states[j].time;
-            fgroups[path_map[j]][a] += col1[j];
+            if (MULTIPOP)
+                fgroups[a*max_numpath + path_map[j]] += col1[j];
+            else
+                fgroups[a] += col1[j];
             assert(!isinf(col1[j]));
         }
 
         // multiply tmatrix and fgroups together
-        for (int b=0; b<ntimes-1; b++) {
-            for (int pb=0; pb < numpath_per_time[b]; pb++) {
-                double sum = 0.0;
-                for (int a=0; a<ntimes-1; a++) {
-                    for (int pa=0; pa < numpath_per_time[a]; pa++) {
-                        sum += tmatrix[b][pb][a][pa] * fgroups[pa][a];
-                    }
-                }
-                tmatrix_fgroups[pb][b] = sum;
+        for (int b=mintime; b<ntimes-1; b++) {
+            if (MULTIPOP) {
+                for (int pb=0; pb < numpath_per_time[b]; pb++)
+                    tmatrix_fgroups[pb][b] = simd_dot(
+                        &tmatrix[b][pb][group0], &fgroups[group0],
+                        ngroups - group0);
+            } else {
+                tmatrix_fgroups[0][b] = simd_dot(
+                    &tmatrix[b][0][group0], &fgroups[group0],
+                    ngroups - group0);
             }
         }
 
@@ -252,27 +344,15 @@ void arghmm_forward_block(const ArgModel *model,
         double norm = 0.0;
         for (int k=0; k<nstates; k++) {
             const int b = states[k].time;
-            const int node2 = states[k].node;
-            const int age2 = ages2[node2];
-            double sum = tmatrix_fgroups[path_map[k]][b];
-
-            // same branch case
-            for (int a=age1_state[k]; a <= age2; a++) {
-                int j_state = nextState[idx++];
-                if (j_state >= 0 && col1[j_state] > 0) {
-                    sum += tmatrix2[k][a] * col1[j_state];
-                }
-            }
-            // this setion accounts for self-recombinations that change paths
-            // (same node, same time, different path)
-            if (max_numpath > 1) {
-                for (int pa=0; pa < numpath_per_time[b]; pa++) {
-                    int j_state = nextState[idx++];
-                    if (j_state >= 0 && col1[j_state] > 0) {
-                        sum += tmatrix3[k][pa] * col1[j_state];
-                    }
-                }
-            }
+            const int start = state_start[k];
+
+            // same branch case and self-recombinations that change paths
+            double sum = tmatrix_fgroups[MULTIPOP ? path_map[k] : 0][b];
+            if (prune == 0.0 || live[states[k].node])
+                sum = simd_gather_dot(
+                    &next_prob[start], &next_state[start], col1,
+                    state_start[k+1] - start, sum);
+
             col2[k] = sum * emit2[k];
             norm += col2[k];
             if (isnan(col2[k]))
@@ -283,14 +363,81 @@ void arghmm_forward_block(const ArgModel *model,
         assert(!isinf(norm));
 
         // normalize column for numerical stability
-        for (int k=0; k<nstates; k++)
-            col2[k] /= norm;
+        simd_div(col2, nstates, norm);
+
+        if (prune > 0.0)
+            pruned_mass += prune_forward_column(col2, nstates, prune,
+                                                &npruned);
+    }
+
+    if (npruned > 0)
+        get_forward_stats().add_pruned(npruned, pruned_mass);
+}
+
 
+// dispatch to the forward kernel specialized for the model's number of
+// time points and population paths
+static void arghmm_forward_block_emit(
+    const ArgModel *model, const LocalTree *tree,
+    const int blocklen, const States &states,
+    const LineageCounts &lineages, const TransMatrix *matrix,
+    const double* const *emit, SiteEmissions *site_emit, int site_offset,
+    double **fw)
+{
+    const bool multipop = model->num_pop_paths() > 1;
+    if (model->ntimes == FORWARD_FIXED_NTIMES) {
+        if (multipop)
+            arghmm_forward_block_kernel<FORWARD_FIXED_NTIMES, true>(
+                model, tree, blocklen, states, lineages, matrix,
+                emit, site_emit, site_offset, fw);
+        else
+            arghmm_forward_block_kernel<FORWARD_FIXED_NTIMES, false>(
+                model, tree, blocklen, states, lineages, matrix,
+                emit, site_emit, site_offset, fw);
+    } else {
+        if (multipop)
+            arghmm_forward_block_kernel<0, true>(
+                model, tree, blocklen, states, lineages, matrix,
+                emit, site_emit, site_offset, fw);
+        else
+            arghmm_forward_block_kernel<0, false>(
+                model, tree, blocklen, states, lineages, matrix,
+                emit, site_emit, site_offset, fw);
     }
 }
 
 
 
+// compute one block of forward algorithm with compressed transition matrices
+// NOTE: first column of forward table should be pre-populated
+void arghmm_forward_block(const ArgModel *model,
+                          const LocalTree *tree,
+                          const int blocklen, const States &states,
+                          const LineageCounts &lineages,
+                          const TransMatrix *matrix,
+                          const double* const *emit, double **fw)
+{
+    arghmm_forward_block_emit(model, tree, blocklen, states, lineages,
+                              matrix, emit, NULL, 0, fw);
+}
+
+
+// compute one block of forward algorithm with emissions computed on demand
+// column i uses the emissions of site i + site_offset
+// NOTE: first column of forward table should be pre-populated
+void arghmm_forward_block(const ArgModel *model,
+                          const LocalTree *tree,
+                          const int blocklen, const States &states,
+                          const LineageCounts &lineages,
+                          const TransMatrix *matrix,
+                          SiteEmissions *site_emit, int site_offset,
+                          double **fw)
+{
+    arghmm_forward_block_emit(model, tree, blocklen, states, lineages,
+                              matrix, NULL, site_emit, site_offset, fw);
+}
+
+
 // compute one block of forward algorithm with compressed transition matrices
 // NOTE: first column of forward table should be pre-populated
 // This can be used for testing
@@ -363,9 +510,10 @@ void arghmm_forward_switch(const double *col1, double* col2,
         }
     }
 
-    // add recombination and recoalescing transitions
+    // add recombination and recoalescing transitions, skipping states
+    // without mass (e.g. pruned ones)
     for (int j=0; j < nstates1; j++) {
-        if (matrix->recombsrc[j] >= 0) {
+        if (matrix->recombsrc[j] >= 0 && col1[j] != 0.0) {
             assert(matrix->recoalsrc[j] < 0);
             for (int k=0; k<nstates2; k++) {
                 double val = matrix->get(j, k);
@@ -378,7 +526,7 @@ void arghmm_forward_switch(const double *col1, double* col2,
         }
     }
     for (int j=0; j < nstates1; j++) {
-        if (matrix->recoalsrc[j] >= 0) {
+        if (matrix->recoalsrc[j] >= 0 && col1[j] != 0.0) {
             assert(matrix->recombsrc[j] < 0);
             for (int k=0; k<nstates2; k++) {
                 double val = matrix->get(j, k);
@@ -418,6 +566,523 @@ void arghmm_forward_switch(const double *col1, double* col2,
 }
 
 
+// run forward algorithm for one column of the table
+// use sparse switch matrix
+void arghmm_forward_switch(const double *col1, double* col2,
+                           const TransMatrixSwitchSparse *matrix,
+                           const double *emit)
+{
+    const int nstates2 = matrix->nstates2;
+    const int *offsets = &matrix->offsets[0];
+    const int *sources = matrix->sources.empty() ? NULL : &matrix->sources[0];
+    const double *probs = matrix->probs.empty() ? NULL : &matrix->probs[0];
+
+    double norm = 0.0;
+    for (int k=0; k<nstates2; k++) {
+        const int start = offsets[k];
+        col2[k] = simd_gather_dot(probs + start, sources + start, col1,
+                                  offsets[k+1] - start) * emit[k];
+        norm += col2[k];
+    }
+    assert(norm != 0.0);
+    assert(!isnan(norm));
+    assert(!isinf(norm));
+
+    // normalize column for numerical stability
+    for (int k=0; k<nstates2; k++)
+        col2[k] /= norm;
+}
+
+
+
+//=============================================================================
+// Runs of sites with constant emissions
+
+
+TransMatrixPowers::TransMatrixPowers(int nstates, const double *const *base) :
+    nstates(nstates)
+{
+    init(base);
+}
+
+
+TransMatrixPowers::TransMatrixPowers(
+    const LocalTree *tree, const States &states, const TransMatrix *matrix,
+    const double *emit) :
+    nstates(states.size())
+{
+    double **base = new_matrix<double>(nstates, nstates);
+    for (int j=0; j<nstates; j++)
+        for (int k=0; k<nstates; k++)
+            base[j][k] = matrix->get(tree, states, j, k) *
+                (emit ? emit[k] : 1.0);
+    init(base);
+    delete_matrix<double>(base, nstates);
+}
+
+
+TransMatrixPowers::~TransMatrixPowers()
+{
+    for (unsigned int i=0; i<powers.size(); i++)
+        delete_matrix<double>(powers[i], nstates);
+}
+
+
+void TransMatrixPowers::init(const double *const *base)
+{
+    double **mat = new_matrix<double>(nstates, nstates);
+    double top = 0.0;
+    log_diag.resize(nstates);
+    for (int j=0; j<nstates; j++) {
+        log_diag[j] = log(base[j][j]);
+        for (int k=0; k<nstates; k++)
+            top = max(top, base[j][k]);
+    }
+    assert(top > 0.0);
+
+    for (int j=0; j<nstates; j++)
+        for (int k=0; k<nstates; k++)
+            mat[j][k] = base[j][k] / top;
+    powers.push_back(mat);
+    log_scales.push_back(log(top));
+}
+
+
+const double *const *TransMatrixPowers::get(int k)
+{
+    // square the largest power until M^(2^k) is reached
+    while (int(powers.size()) <= k) {
+        double **prev = powers.back();
+        double **trans = new_matrix<double>(nstates, nstates);
+        double **mat = new_matrix<double>(nstates, nstates);
+        for (int i=0; i<nstates; i++)
+            for (int j=0; j<nstates; j++)
+                trans[j][i] = prev[i][j];
+
+        double top = 0.0;
+        for (int i=0; i<nstates; i++) {
+            for (int j=0; j<nstates; j++) {
+                mat[i][j] = simd_dot(prev[i], trans[j], nstates);
+                top = max(top, mat[i][j]);
+            }
+        }
+        assert(top > 0.0);
+        for (int i=0; i<nstates; i++)
+            for (int j=0; j<nstates; j++)
+                mat[i][j] /= top;
+
+        delete_matrix<double>(trans, nstates);
+        powers.push_back(mat);
+        log_scales.push_back(2.0 * log_scales.back() + log(top));
+    }
+    return powers[k];
+}
+
+
+// log M[state][state]^(2^k), the weight of staying in 'state' for 2^k steps
+double TransMatrixPowers::log_stay(int state, int k)
+{
+    return double(1 << k) * log_diag[state];
+}
+
+
+void TransMatrixPowers::forward(double **fw, int start, int end)
+{
+    const int len = end - start;
+    int col = start - 1;
+
+    // apply one power of two step for each bit of len
+    for (int k=30; k>=0; k--) {
+        if (!(len & (1 << k)))
+            continue;
+        const double *const *mat = get(k);
+        const double *col1 = fw[col];
+        double *col2 = fw[col + (1 << k)];
+
+        fill(col2, col2 + nstates, 0.0);
+        for (int j=0; j<nstates; j++) {
+            const double w = col1[j];
+            if (w == 0.0)
+                continue;
+            const double *row = mat[j];
+            for (int i=0; i<nstates; i++)
+                col2[i] += w * row[i];
+        }
+
+        double norm = 0.0;
+        for (int i=0; i<nstates; i++)
+            norm += col2[i];
+        assert(norm > 0.0);
+        simd_div(col2, nstates, norm);
+        col += 1 << k;
+    }
+    assert(col == end - 1);
+}
+
+
+void TransMatrixPowers::traceback(double **fw, int start, int end, int *path)
+{
+    const int len = end - start;
+    int cols[32];
+    int steps[32];
+    int nsteps = 0;
+
+    // find the columns stored by forward()
+    int col = start - 1;
+    for (int k=30; k>=0; k--) {
+        if (len & (1 << k)) {
+            cols[nsteps] = col;
+            steps[nsteps++] = k;
+            col += 1 << k;
+        }
+    }
+
+    // sample the stored columns backwards and then the sites between them
+    double A[nstates];
+    for (int t=nsteps-1; t>=0; t--) {
+        const int a = cols[t];
+        const int k = steps[t];
+        const double *const *mat = get(k);
+        const int x = path[a + (1 << k)];
+        for (int j=0; j<nstates; j++)
+            A[j] = fw[a][j] * mat[j][x];
+        path[a] = sample(A, nstates);
+        sample_piece(a, k, path, false);
+    }
+}
+
+
+// Sample path[a+1 .. b-1] given path[a] and path[b] where b = a + 2^k.
+// If must_change is true, the path is conditioned on not staying in
+// path[a] == path[b] for the whole piece.
+//
+// Most pieces do stay in one state, so this first decides whether the
+// piece stays, and only bisects pieces that change state.
+void TransMatrixPowers::sample_piece(int a, int k, int *path, bool must_change)
+{
+    if (k == 0)
+        return;
+
+    const int b = a + (1 << k);
+    const int m = a + (1 << (k-1));
+    const int xa = path[a];
+    const int xb = path[b];
+
+    if (xa == xb && !must_change) {
+        double total = log(get(k)[xa][xb]) + log_scales[k];
+        double p = exp(log_stay(xa, k) - total);
+        if (frand() < p) {
+            for (int i=a+1; i<b; i++)
+                path[i] = xa;
+            return;
+        }
+        must_change = true;
+    }
+
+    // sample the middle site
+    const double *const *mat = get(k-1);
+    double A[nstates];
+    for (int j=0; j<nstates; j++)
+        A[j] = mat[xa][j] * mat[j][xb];
+
+    double stay = 0.0;
+    if (must_change) {
+        // weight of staying for one half, in the scale of mat
+        stay = (k == 1) ? mat[xa][xa] :
+            exp(log_stay(xa, k-1) - log_scales[k-1]);
+        A[xa] = max(A[xa] - stay * stay, 0.0);
+    }
+    path[m] = sample(A, nstates);
+
+    if (must_change && path[m] == xa) {
+        // at least one of the halves must change
+        double change = max(mat[xa][xa] - stay, 0.0);
+        double B[3] = {stay * change, change * stay, change * change};
+        int c = sample(B, 3);
+
+        if (c == 0) {
+            for (int i=a+1; i<m; i++)
+                path[i] = xa;
+        } else
+            sample_piece(a, k-1, path, true);
+        if (c == 1) {
+            for (int i=m+1; i<b; i++)
+                path[i] = xa;
+        } else
+            sample_piece(m, k-1, path, true);
+        return;
+    }
+
+    sample_piece(a, k-1, path, false);
+    sample_piece(m, k-1, path, false);
+}
+
+
+// Find the runs of at least 'minlen' invariant (or masked) sites among
+// sites [1, blocklen) of a block.  Returns false if collapsing the runs
+// would not be faster than computing them site by site.
+static bool find_site_runs(
+    const ArgModel *model, SiteEmissions *site_emit, int blocklen,
+    int nstates, bool masked, int minlen,
+    vector<int> &starts, vector<int> &ends)
+{
+    int total = 0, maxlen = 0;
+    for (int i=1; i<blocklen; i++) {
+        if (!(masked ? site_emit->is_masked(i) : site_emit->is_invariant(i)))
+            continue;
+        int j = i + 1;
+        while (j < blocklen && (masked ? site_emit->is_masked(j) :
+                                site_emit->is_invariant(j)))
+            j++;
+        if (j - i >= minlen) {
+            starts.push_back(i);
+            ends.push_back(j);
+            total += j - i;
+            maxlen = max(maxlen, j - i);
+        }
+        i = j;
+    }
+    if (starts.size() == 0)
+        return false;
+
+    // Stepping through a site costs about nstates * ntimes operations,
+    // whereas the powers cost nstates^3 per squaring in both the forward
+    // algorithm and the traceback.
+    int nsquare = 1;
+    while ((1 << nsquare) <= maxlen)
+        nsquare++;
+    return double(total) * model->ntimes >=
+        2.0 * double(nstates) * nstates * nsquare;
+}
+
+
+// Find the runs of the block at 'pos' that are worth collapsing and
+// record them in 'runs'.  Runs start after the first column of the block.
+// Returns NULL if the block is computed site by site.
+static const ForwardRuns::Block *find_block_runs(
+    const ArgModel *model, SiteEmissions *site_emit, int pos, int blocklen,
+    int nstates, ForwardRuns *runs)
+{
+    vector<int> starts[2], ends[2];
+    bool found[2] = {false, false};
+    if (runs->minlen > 0)
+        found[0] = find_site_runs(model, site_emit, blocklen, nstates, false,
+                                  runs->minlen, starts[0], ends[0]);
+    if (runs->skip_masked)
+        found[1] = find_site_runs(model, site_emit, blocklen, nstates, true,
+                                  1, starts[1], ends[1]);
+    if (!found[0] && !found[1])
+        return NULL;
+
+    ForwardRuns::Block &block = runs->add_block(pos);
+    if (found[0]) {
+        block.emit.resize(nstates);
+        site_emit->get(starts[0][0], &block.emit[0]);
+    }
+
+    // merge the invariant and masked runs in order
+    unsigned int i = 0, j = 0;
+    const unsigned int n0 = found[0] ? starts[0].size() : 0;
+    const unsigned int n1 = found[1] ? starts[1].size() : 0;
+    while (i < n0 || j < n1) {
+        bool masked = (i == n0 || (j < n1 && starts[1][j] < starts[0][i]));
+        unsigned int &k = masked ? j : i;
+        block.starts.push_back(pos + starts[masked][k]);
+        block.ends.push_back(pos + ends[masked][k]);
+        block.masked.push_back(masked);
+        k++;
+    }
+    return &block;
+}
+
+
+// Powers for the invariant and masked runs of a block, created on demand
+class BlockRunPowers
+{
+public:
+    BlockRunPowers(const LocalTree *tree, const States &states,
+                   const TransMatrix *matrix,
+                   const ForwardRuns::Block *block_runs) :
+        tree(tree),
+        states(states),
+        matrix(matrix),
+        block_runs(block_runs)
+    {
+        powers[0] = powers[1] = NULL;
+    }
+
+    ~BlockRunPowers()
+    {
+        delete powers[0];
+        delete powers[1];
+    }
+
+    // returns the powers for run r
+    TransMatrixPowers *get(int r)
+    {
+        const bool masked = block_runs->masked[r];
+        if (!powers[masked])
+            powers[masked] = new TransMatrixPowers(
+                tree, states, matrix, masked ? NULL : &block_runs->emit[0]);
+        return powers[masked];
+    }
+
+protected:
+    const LocalTree *tree;
+    const States &states;
+    const TransMatrix *matrix;
+    const ForwardRuns::Block *block_runs;
+    TransMatrixPowers *powers[2];
+};
+
+
+// Forward algorithm for a block whose runs of sites are collapsed.
+// Columns [col, pos+blocklen) are computed, fw[col] must already be set.
+static void arghmm_forward_block_runs(
+    const ArgModel *model, const LocalTree *tree, const States &states,
+    const LineageCounts &lineages, ArgHmmMatrices &matrices,
+    const ForwardRuns::Block *block_runs, int pos, int col, double **fw)
+{
+    BlockRunPowers powers(tree, states, matrices.transmat, block_runs);
+
+    for (unsigned int r=0; r<block_runs->starts.size(); r++) {
+        const int start = block_runs->starts[r];
+        const int end = block_runs->ends[r];
+        if (start - col > 1)
+            arghmm_forward_block(model, tree, start - col, states, lineages,
+                                 matrices.transmat, matrices.site_emit,
+                                 col - pos, &fw[col]);
+        powers.get(r)->forward(fw, start, end);
+        col = end - 1;
+    }
+
+    const int end = pos + matrices.blocklen;
+    if (end - col > 1)
+        arghmm_forward_block(model, tree, end - col, states, lineages,
+                             matrices.transmat, matrices.site_emit,
+                             col - pos, &fw[col]);
+}
+
+
+// Run forward algorithm for the block at the current matrix_iter position,
+// counting its state space in 'hist' if given
+static void arghmm_forward_iter_block(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    PhaseProbs *phase_pr, bool prior_given, bool internal, bool slow,
+    States &states, LineageCounts &lineages, StateHistograms *hist)
+{
+    ArgModel local_model;
+    int mu_idx=0, rho_idx=0;
+    double **fw = forward->get_table();
+
+    // get block information
+    LocalTree *tree = matrix_iter->get_tree_spr()->tree;
+    ArgHmmMatrices &matrices = matrix_iter->ref_matrices(phase_pr);
+    int pos = matrix_iter->get_block_start();
+    int blocklen = matrices.blocklen;
+    model->get_local_model(pos, local_model, &mu_idx, &rho_idx);
+    double **emit = matrices.emit;
+    int site_offset = 0;
+
+    // allocate the forward table
+    if (pos > trees->start_coord || !prior_given)
+        forward->new_block(pos, pos+matrices.blocklen, matrices.nstates2);
+    double **fw_block = &fw[pos];
+
+    states = matrices.states;
+    lineages.count(tree, model->pop_tree, internal);
+    if (hist)
+        hist->add_block(states.size(), matrices.blocklen);
+
+    // use switch matrix for first column of forward table
+    // if we have a previous state space (i.e. not first block)
+    if (pos == trees->start_coord) {
+        // calculate prior of first state
+        int minage = matrices.states_model.minage;
+        if (!prior_given) {
+            if (internal) {
+                int subtree_root = tree->nodes[tree->root].child[0];
+                if (subtree_root != -1)
+                    minage = max(minage, tree->nodes[subtree_root].age);
+            }
+            calc_state_priors(states, &lineages, &local_model,
+                              fw[pos], minage);
+        }
+    } else if (matrices.transmat_switch) {
+        // perform one column of forward algorithm with transmat_switch
+        if (hist)
+            hist->add_switch(matrices.transmat_switch);
+        if (matrices.site_emit) {
+            double emit0[matrices.site_emit->get_nstates()];
+            matrices.site_emit->get(0, emit0);
+            arghmm_forward_switch(fw[pos-1], fw[pos],
+                matrices.transmat_switch, emit0);
+        } else {
+            arghmm_forward_switch(fw[pos-1], fw[pos],
+                matrices.transmat_switch, matrices.emit[0]);
+        }
+        if (model->fw_prune > 0.0) {
+            long long npruned = 0;
+            double mass = prune_forward_column(
+                fw[pos], max(matrices.nstates2, 1), model->fw_prune,
+                &npruned);
+            if (npruned > 0)
+                get_forward_stats().add_pruned(npruned, mass);
+        }
+    } else {
+        // we are still inside the same ARG block, therefore the
+        // state-space does not change and no switch matrix is needed
+        fw_block = &fw[pos-1];
+        if (emit)
+            emit--;
+        site_offset = -1;
+        blocklen++;
+    }
+
+    int nstates = max(matrices.transmat->nstates, 1);
+    double top = max_array(fw_block[0], nstates);
+    for (int i=0; i < nstates; i++) assert(!isnan(fw_block[0][i]));
+    assert(!isnan(top));
+    assert(top > 0.0);
+
+    // find runs of invariant sites to collapse
+    const ForwardRuns::Block *block_runs = NULL;
+    if (forward->runs && matrices.site_emit && matrices.transmat->nstates > 0)
+        block_runs = find_block_runs(model, matrices.site_emit, pos,
+                                     matrices.blocklen,
+                                     matrices.transmat->nstates,
+                                     forward->runs);
+
+    // calculate rest of block.  If the subtree of an internal branch is
+    // fully determined, the block has a single state and no emissions.
+    const bool determined = matrices.transmat->nstates == 0;
+    if (determined) {
+        for (int i=1; i<blocklen; i++)
+            fw_block[i][0] = fw_block[0][0];
+    } else if (block_runs) {
+        assert(!slow);
+        arghmm_forward_block_runs(model, tree, states, lineages, matrices,
+                                  block_runs, pos, pos + site_offset, fw);
+    } else if (matrices.site_emit) {
+        assert(!slow);
+        arghmm_forward_block(model, tree, blocklen,
+                             states, lineages, matrices.transmat,
+                             matrices.site_emit, site_offset, fw_block);
+    } else if (slow)
+        arghmm_forward_block_slow(tree, model->ntimes, blocklen,
+                                  states, lineages, matrices.transmat,
+                                  emit, fw_block);
+    else
+        arghmm_forward_block(model, tree, blocklen,
+                             states, lineages, matrices.transmat,
+                             emit, fw_block);
+
+    // safety check
+    double top2 = max_array(fw[pos + matrices.blocklen - 1], nstates);
+    assert(top2 > 0.0);
+}
+
 
 // Run forward algorithm for all blocks
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
@@ -425,88 +1090,151 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     ArgHmmForwardTable *forward, PhaseProbs *phase_pr,
     bool prior_given, bool internal, bool slow)
 {
+    PROFILE_SCOPE(PROFILE_FORWARD);
     LineageCounts lineages(model->ntimes, model->num_pops());
     States states;
-    ArgModel local_model;
-    int mu_idx=0, rho_idx=0;
-    LocalTree *tree;
-#ifdef DEBUG
-    LocalTree *last_tree = NULL;
-#endif
+    Timer timer;
+    long long nblocks = 0, nstates = 0;
+    StateHistograms hist;
 
-    double **fw = forward->get_table();
     // forward algorithm over local trees
     for (matrix_iter->begin(); matrix_iter->more(); matrix_iter->next()) {
-        // get block information
-        tree = matrix_iter->get_tree_spr()->tree;
-        ArgHmmMatrices &matrices = matrix_iter->ref_matrices(phase_pr);
-        int pos = matrix_iter->get_block_start();
-        int blocklen = matrices.blocklen;
-        model->get_local_model(pos, local_model, &mu_idx, &rho_idx);
-        double **emit = matrices.emit;
-
-        // allocate the forward table
-        if (pos > trees->start_coord || !prior_given)
-            forward->new_block(pos, pos+matrices.blocklen, matrices.nstates2);
-        double **fw_block = &fw[pos];
-
-        matrices.states_model.get_coal_states(tree, states);
-        lineages.count(tree, model->pop_tree, internal);
-
-        // use switch matrix for first column of forward table
-        // if we have a previous state space (i.e. not first block)
-        if (pos == trees->start_coord) {
-            // calculate prior of first state
-            int minage = matrices.states_model.minage;
-            if (!prior_given) {
-                if (internal) {
-                    int subtree_root = tree->nodes[tree->root].child[0];
-                    if (subtree_root != -1)
-                        minage = max(minage, tree->nodes[subtree_root].age);
-                }
-                calc_state_priors(states, &lineages, &local_model,
-                                  fw[pos], minage);
-            }
-        } else if (matrices.transmat_switch) {
-            // perform one column of forward algorithm with transmat_switch
-            arghmm_forward_switch(fw[pos-1], fw[pos],
-                matrices.transmat_switch, matrices.emit[0]);
-        } else {
-            // we are still inside the same ARG block, therefore the
-            // state-space does not change and no switch matrix is needed
-            fw_block = &fw[pos-1];
-            emit--;
-            blocklen++;
-        }
+        arghmm_forward_iter_block(trees, model, matrix_iter, forward,
+                                  phase_pr, prior_given, internal, slow,
+                                  states, lineages, &hist);
+        forward->end_block(matrix_iter->get_block_start(),
+                           matrix_iter->get_block_end());
+        nblocks++;
+        nstates += states.size();
+    }
 
-        int nstates = max(matrices.transmat->nstates, 1);
-        double top = max_array(fw_block[0], nstates);
-        //        printf("%i %i top =%f nstates=%i\n", count, pos, top, nstates);
-        for (int i=0; i < nstates; i++) assert(!isnan(fw_block[0][i]));
-        assert(!isnan(top));
-        assert(top > 0.0);
+    ForwardStats &stats = get_forward_stats();
+    stats.usecs += (long long) (timer.time() * 1e6);
+    stats.nblocks += nblocks;
+    stats.nstates += nstates;
+    stats.add_histograms(hist);
+}
 
-        // calculate rest of block
-        if (slow)
-            arghmm_forward_block_slow(tree, model->ntimes, blocklen,
-                                      states, lineages, matrices.transmat,
-                                      emit, fw_block);
-        else
-            arghmm_forward_block(model, tree, blocklen,
-                                 states, lineages, matrices.transmat,
-                                 emit, fw_block);
-
-        // safety check
-        double top2 = max_array(fw[pos + matrices.blocklen - 1], nstates);
-        //        printf("%i %i top2=%f\n", count++, pos, top2);
-        assert(top2 > 0.0);
-#ifdef DEBUG
-        last_tree = tree;
-#endif
+
+void StateHistograms::clear()
+{
+    for (int i=0; i<NBINS; i++)
+        states[i] = blocklens[i] = 0;
+    for (int i=0; i<NFRAC_BINS; i++)
+        determ[i] = 0;
+    nswitches = 0;
+}
+
+
+void StateHistograms::add(const StateHistograms &other)
+{
+    for (int i=0; i<NBINS; i++) {
+        states[i] += other.states[i];
+        blocklens[i] += other.blocklens[i];
+    }
+    for (int i=0; i<NFRAC_BINS; i++)
+        determ[i] += other.determ[i];
+    nswitches += other.nswitches;
+}
+
+
+// A transition is deterministic if its source state has neither
+// recombined nor recoalesced, as in arghmm_forward_switch()
+void StateHistograms::add_switch(const TransMatrixSwitch *matrix)
+{
+    nswitches++;
+    if (matrix->nstates1 <= 0)
+        return;
+
+    int ndeterm = 0;
+    for (int j=0; j<matrix->nstates1; j++)
+        if (matrix->determ[j] != -1 && matrix->recombsrc[j] < 0 &&
+            matrix->recoalsrc[j] < 0)
+            ndeterm++;
+    const int bin = ndeterm * NFRAC_BINS / matrix->nstates1;
+    determ[min(bin, NFRAC_BINS - 1)]++;
+}
+
+
+int StateHistograms::get_bin(long long size)
+{
+    int bin = 0;
+    while (size > 0 && bin < NBINS - 1) {
+        size >>= 1;
+        bin++;
     }
+    return bin;
+}
+
+
+long long StateHistograms::get_bin_start(int bin)
+{
+    return bin > 0 ? 1LL << (bin - 1) : 0;
+}
+
+
+void StateHistograms::write(FILE *stream, const char *prefix) const
+{
+    for (int i=0; i<NBINS; i++)
+        if (states[i])
+            fprintf(stream, "%s\tstates\t%lld\t%lld\t%lld\n", prefix,
+                    get_bin_start(i), get_bin_end(i), states[i]);
+    for (int i=0; i<NBINS; i++)
+        if (blocklens[i])
+            fprintf(stream, "%s\tblocklen\t%lld\t%lld\t%lld\n", prefix,
+                    get_bin_start(i), get_bin_end(i), blocklens[i]);
+    for (int i=0; i<NFRAC_BINS; i++)
+        if (determ[i])
+            fprintf(stream, "%s\tdeterm\t%g\t%g\t%lld\n", prefix,
+                    i / double(NFRAC_BINS), (i + 1) / double(NFRAC_BINS),
+                    determ[i]);
+    fprintf(stream, "%s\tswitches\t0\t0\t%lld\n", prefix, nswitches);
+}
+
+
+static ForwardStats process_forward_stats;
+static thread_local ForwardStats *thread_forward_stats = NULL;
+
+
+ForwardStats &get_forward_stats()
+{
+    return thread_forward_stats ? *thread_forward_stats :
+        process_forward_stats;
+}
+
+
+ForwardStats *set_thread_forward_stats(ForwardStats *stats)
+{
+    ForwardStats *prev = thread_forward_stats;
+    thread_forward_stats = stats;
+    return prev;
 }
 
 
+// Recompute the forward table for the segment [start, end) of a
+// checkpointed table.  'block' is the index of the last block of the segment.
+static void arghmm_forward_segment(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTableCheckpoint *forward,
+    PhaseProbs *phase_pr, bool internal, int block, int start, int end)
+{
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    States states;
+
+    forward->delete_blocks();
+
+    // find first block of segment
+    matrix_iter->seek(block);
+    while (matrix_iter->get_block_start() > start)
+        matrix_iter->seek(--block);
+
+    for (; matrix_iter->more() && matrix_iter->get_block_start() < end;
+         matrix_iter->next())
+        arghmm_forward_iter_block(trees, model, matrix_iter, forward,
+                                  phase_pr, false, internal, false,
+                                  states, lineages, NULL);
+}
+
 
 
 //=============================================================================
@@ -514,6 +1242,11 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
 
 
 
+// Allowed excess of the sum of a forward column over one (e.g. due to
+// single precision storage), used when bounding traceback weights
+const double COL_SLACK = 1e-6;
+
+
 double sample_hmm_posterior(
     int blocklen, const LocalTree *tree, const States &states,
     const TransMatrix *matrix, const double *const *fw, int *path)
@@ -523,24 +1256,66 @@ double sample_hmm_posterior(
     const int nstates = max(states.size(), (size_t)1);
     double A[nstates];
     double trans[nstates];
+    double max_trans = 0.0;
     int last_k = -1;
     double lnl = 0.0;
 
     // recurse
     for (int i=blocklen-2; i>=0; i--) {
-        int k = path[i+1];
+        const int k = path[i+1];
+        const double *col = fw[i];
 
         // recompute transition probabilities if state (k) changes
         if (k != last_k) {
-            for (int j=0; j<nstates; j++)
+            max_trans = 0.0;
+            for (int j=0; j<nstates; j++) {
                 trans[j] = matrix->get(tree, states, j, k);
+                if (j != k)
+                    max_trans = max(max_trans, trans[j]);
+            }
             last_k = k;
         }
 
-        for (int j=0; j<nstates; j++)
-            A[j] = fw[i][j] * trans[j];
-        path[i] = sample(A, nstates);
-        //lnl += log(A[path[i]]);
+        // Staying in state k has weight 'stay'.  Since forward columns are
+        // normalized, the weight of all other states is at most
+        // max_trans * (1 - col[k]), which bounds the total weight from
+        // above.  Most steps stay, so test that first in O(1).
+        const double stay = col[k] * trans[k];
+        const double bound = stay + max_trans * (1.0 + COL_SLACK - col[k]);
+        const double u = frand();
+        if (u * bound < stay) {
+            path[i] = k;
+            continue;
+        }
+
+        // otherwise compute the exact total weight
+        double total = 0.0;
+        for (int j=0; j<nstates; j++) {
+            A[j] = col[j] * trans[j];
+            total += A[j];
+        }
+        if (u * total < stay) {
+            path[i] = k;
+            continue;
+        }
+
+        // u is uniform over the weight of the other states
+        double pick = u * total - stay;
+        int j = 0;
+        for (; j<nstates; j++) {
+            if (j == k || A[j] <= 0.0)
+                continue;
+            pick -= A[j];
+            if (pick < 0.0)
+                break;
+        }
+        if (j == nstates) {
+            // rounding: choose the last other state with weight
+            for (j=nstates-1; j >= 0 && (j == k || A[j] <= 0.0); j--);
+            if (j < 0)
+                j = k;
+        }
+        path[i] = j;
 
         // DEBUG
         assert(trans[path[i]] != 0.0);
@@ -566,36 +1341,40 @@ int sample_hmm_posterior_step(const TransMatrixSwitch *matrix,
 }
 
 
-double stochastic_traceback(
-    const LocalTrees *trees, const ArgModel *model,
-    ArgHmmMatrixIter *matrix_iter,
-    double **fw, int *path, bool last_state_given, bool internal)
+// Sample the path through one block given the next state path[pos+blocklen]
+// 'runs' gives the runs of sites collapsed by the forward algorithm, if any.
+static void traceback_block(
+    const LocalTrees *trees, ArgHmmMatrices &mat, const LocalTree *tree,
+    const States &states, int pos, double **fw, int **paths, int npaths,
+    double *lnls, const ForwardRuns *runs)
 {
-    States states;
-    double lnl = 0.0;
-    /*    printf("stochastic_traceback last_state_given=%i internal=%i\n",
-          (int)last_state_given, (int)internal);*/
-
-    // choose last column first
-    matrix_iter->rbegin();
-    int pos = trees->end_coord;
-
-    if (!last_state_given) {
-        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
-        const int nstates = max(mat.nstates2, 1);
-        path[pos-1] = sample(fw[pos-1], nstates);
-        lnl = fw[pos-1][path[pos-1]];
-    }
-
-    // iterate backward through blocks
-    for (; matrix_iter->more(); matrix_iter->prev()) {
-        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
-        LocalTree *tree = matrix_iter->get_tree_spr()->tree;
-        mat.states_model.get_coal_states(tree, states);
-        pos -= mat.blocklen;
-
-        lnl += sample_hmm_posterior(mat.blocklen, tree, states,
-                                    mat.transmat, &fw[pos], &path[pos]);
+    const ForwardRuns::Block *block_runs = runs ? runs->find_block(pos) : NULL;
+    BlockRunPowers powers(tree, states, mat.transmat, block_runs);
+
+    for (int k=0; k<npaths; k++) {
+        int *path = paths[k];
+        double lnl = 0.0;
+        if (states.size() == 0) {
+            // fully determined subtree of an internal branch: the only
+            // state is 0
+            fill(&path[pos], &path[pos + mat.blocklen - 1], 0);
+        } else if (block_runs) {
+            int end = pos + mat.blocklen;
+            for (int r=block_runs->starts.size()-1; r>=0; r--) {
+                const int start = block_runs->starts[r];
+                const int run_end = block_runs->ends[r];
+                lnl += sample_hmm_posterior(end - run_end + 1, tree, states,
+                                            mat.transmat, &fw[run_end-1],
+                                            &path[run_end-1]);
+                powers.get(r)->traceback(fw, start, run_end, path);
+                end = start;
+            }
+            lnl += sample_hmm_posterior(end - pos, tree, states,
+                                        mat.transmat, &fw[pos], &path[pos]);
+        } else {
+            lnl = sample_hmm_posterior(mat.blocklen, tree, states,
+                                       mat.transmat, &fw[pos], &path[pos]);
+        }
 
         // fill in last col of next block
         if (pos > trees->start_coord) {
@@ -612,23 +1391,206 @@ double stochastic_traceback(
                     mat.transmat, &fw[pos-1], &path[pos-1]);
             }
         }
+
+        lnls[k] += lnl;
+    }
+}
+
+
+// sample the last column of each path
+static void traceback_last_column(ArgHmmMatrixIter *matrix_iter, int pos,
+                                  double **fw, int **paths, int npaths,
+                                  double *lnls)
+{
+    ArgHmmMatrices &mat = matrix_iter->ref_matrices();
+    const int nstates = max(mat.nstates2, 1);
+    for (int k=0; k<npaths; k++) {
+        paths[k][pos-1] = sample(fw[pos-1], nstates);
+        lnls[k] = fw[pos-1][paths[k][pos-1]];
     }
+}
+
 
+// Stochastic traceback of several paths through the forward table.  If
+// 'forward' is given, it is asked to load each block before it is read.
+static void stochastic_traceback_table(
+    const LocalTrees *trees, ArgHmmMatrixIter *matrix_iter,
+    ArgHmmForwardTable *forward, double **fw, int **paths, int npaths,
+    double *lnls, bool last_state_given)
+{
+    PROFILE_SCOPE(PROFILE_TRACEBACK);
+    States states;
+
+    // choose last column first
+    matrix_iter->rbegin();
+    int pos = trees->end_coord;
+
+    if (forward)
+        forward->load_block(max(matrix_iter->get_block_start() - 1,
+                                trees->start_coord), pos);
+
+    if (!last_state_given)
+        traceback_last_column(matrix_iter, pos, fw, paths, npaths, lnls);
+    else
+        fill(lnls, lnls + npaths, 0.0);
+
+    // iterate backward through blocks
+    for (; matrix_iter->more(); matrix_iter->prev()) {
+        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
+        LocalTree *tree = matrix_iter->get_tree_spr()->tree;
+        states = mat.states;
+        pos -= mat.blocklen;
+
+        if (forward)
+            forward->load_block(max(pos - 1, trees->start_coord),
+                                pos + mat.blocklen);
+        traceback_block(trees, mat, tree, states, pos, fw, paths, npaths,
+                        lnls, forward ? forward->runs : NULL);
+    }
+}
+
+
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter,
+    double **fw, int *path, bool last_state_given, bool internal)
+{
+    double lnl;
+    stochastic_traceback_table(trees, matrix_iter, NULL, fw, &path, 1, &lnl,
+                               last_state_given);
+    return lnl;
+}
+
+
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    int *path, bool last_state_given, bool internal)
+{
+    double lnl;
+    stochastic_traceback_table(trees, matrix_iter, forward,
+                               forward->get_table(), &path, 1, &lnl,
+                               last_state_given);
     return lnl;
 }
 
 
+// Stochastic traceback of several paths through a checkpointed forward
+// table.  Segments are recomputed from their checkpoint column using
+// forward_iter, which must have the same sequences and settings used for
+// the forward algorithm.
+void stochastic_traceback_checkpoint_paths(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmMatrixIter *forward_iter,
+    ArgHmmForwardTableCheckpoint *forward, int **paths, int npaths,
+    double *lnls, PhaseProbs *phase_pr, bool internal)
+{
+    PROFILE_SCOPE(PROFILE_TRACEBACK);
+    vector<double> lnls2(npaths);
+    if (!lnls)
+        lnls = &lnls2[0];
+    States states;
+    double **fw = forward->get_table();
+
+    // choose last column first
+    // the last segment is still stored from the forward algorithm
+    matrix_iter->rbegin();
+    int pos = trees->end_coord;
+    int seg_start = forward->get_segment_start(pos - 1);
+    traceback_last_column(matrix_iter, pos, fw, paths, npaths, lnls);
+
+    // iterate backward through blocks
+    for (; matrix_iter->more(); matrix_iter->prev()) {
+        if (matrix_iter->get_block_start() < seg_start) {
+            // recompute previous segment
+            int seg_end = seg_start;
+            seg_start = forward->get_segment_start(seg_end - 1);
+            arghmm_forward_segment(trees, model, forward_iter, forward,
+                                   phase_pr, internal,
+                                   matrix_iter->get_block_index(),
+                                   seg_start, seg_end);
+        }
+
+        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
+        LocalTree *tree = matrix_iter->get_tree_spr()->tree;
+        states = mat.states;
+        pos -= mat.blocklen;
+
+        traceback_block(trees, mat, tree, states, pos, fw, paths, npaths,
+                        lnls, NULL);
+    }
+}
+
+
+double stochastic_traceback_checkpoint(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmMatrixIter *forward_iter,
+    ArgHmmForwardTableCheckpoint *forward, int *path,
+    PhaseProbs *phase_pr, bool internal)
+{
+    double lnl;
+    stochastic_traceback_checkpoint_paths(
+        trees, model, matrix_iter, forward_iter, forward, &path, 1, &lnl,
+        phase_pr, internal);
+    return lnl;
+}
+
+
+void stochastic_traceback_paths(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    int **paths, int npaths, double *lnls)
+{
+    vector<double> lnls2(npaths);
+    stochastic_traceback_table(trees, matrix_iter, forward,
+                               forward->get_table(), paths, npaths,
+                               lnls ? lnls : &lnls2[0], false);
+}
+
+
 
 //=============================================================================
 // ARG sampling
 
 
+// Forward table storage reused by all threading operations of a thread.
+static ForwardTablePool &get_forward_pool()
+{
+    static thread_local ForwardTablePool pool;
+    return pool;
+}
+
+
+// Allocate the forward table for threading a sequence.  If the model
+// requests checkpointing, *checkpoint is also set to the table.
+static ArgHmmForwardTable *new_forward_table(
+    const ArgModel *model, const LocalTrees *trees,
+    ArgHmmForwardTableCheckpoint **checkpoint)
+{
+    if (model->fw_checkpoint > 0) {
+        *checkpoint = new ArgHmmForwardTableCheckpoint(
+            trees->start_coord, trees->length(), model->fw_checkpoint,
+            &get_forward_pool());
+        return *checkpoint;
+    }
+    if (model->fw_float)
+        return new ArgHmmForwardTableFloat(trees->start_coord,
+                                           trees->length());
+    ArgHmmForwardTable *forward = new ArgHmmForwardTable(
+        trees->start_coord, trees->length(), &get_forward_pool());
+    if (model->fw_runs > 0 || model->fw_skip_masked)
+        forward->runs = new ForwardRuns(model->fw_runs, model->fw_skip_masked);
+    return forward;
+}
+
+
 // sample the thread of the last chromosome
 void sample_arg_thread(const ArgModel *model, Sequences *sequences,
                        LocalTrees *trees, int new_chrom)
 {
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    ArgHmmForwardTableCheckpoint *checkpoint = NULL;
+    ArgHmmForwardTable *forward = new_forward_table(model, trees, &checkpoint);
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
     int start_pop = sequences->get_pop(new_chrom);
@@ -645,10 +1607,11 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
     // build matrices
     ArgHmmMatrixIter matrix_iter(model, sequences, trees, new_chrom);
     matrix_iter.set_start_pop(start_pop);
+    matrix_iter.set_stream_emissions(true);
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
 		       model->unphased ? &phase_pr : NULL);
     int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
     printTimerLog(time, LOG_LOW,
@@ -657,10 +1620,17 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees, new_chrom);
+    ArgHmmMatrixLruList matrix_iter2(model, NULL, trees, new_chrom,
+                                     model->matrix_cache_mb);
     matrix_iter2.set_start_pop(start_pop);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path);
+    if (checkpoint)
+        stochastic_traceback_checkpoint(
+            trees, model, &matrix_iter2, &matrix_iter, checkpoint,
+            thread_path, model->unphased ? &phase_pr : NULL);
+    else
+        stochastic_traceback(trees, model, &matrix_iter2, forward,
+                             thread_path);
+    delete forward;
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
 
@@ -684,12 +1654,56 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
     assert_trees(trees, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    get_trans_matrix_cache().log_stats(LOG_LOW);
+    get_trans_matrix_switch_cache().log_stats(LOG_LOW);
 
     // clean up
     delete [] thread_path_alloc;
 }
 
 
+// sample several threading paths of a new chromosome from one forward
+// table, without adding the thread to the ARG
+void sample_arg_thread_paths(const ArgModel *model, Sequences *sequences,
+                             const LocalTrees *trees, int new_chrom,
+                             int **paths, int npaths, double *lnls)
+{
+    ArgHmmForwardTableCheckpoint *checkpoint = NULL;
+    ArgHmmForwardTable *forward = new_forward_table(model, trees, &checkpoint);
+    int start_pop = sequences->get_pop(new_chrom);
+    PhaseProbs phase_pr(new_chrom, trees->get_num_leaves(),
+                        sequences, trees, model);
+
+    // compute forward table once
+    ArgHmmMatrixIter matrix_iter(model, sequences, trees, new_chrom);
+    matrix_iter.set_start_pop(start_pop);
+    matrix_iter.set_stream_emissions(true);
+    Timer time;
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
+                       model->unphased ? &phase_pr : NULL);
+    printTimerLog(time, LOG_LOW,
+                  "forward (%3d states, %6d blocks):",
+                  get_num_coal_states(trees->front().tree, model->ntimes),
+                  trees->get_num_trees());
+
+    // draw all paths in one pass over the blocks
+    time.start();
+    ArgHmmMatrixLruList matrix_iter2(model, NULL, trees, new_chrom,
+                                     model->matrix_cache_mb);
+    matrix_iter2.set_start_pop(start_pop);
+    if (checkpoint)
+        stochastic_traceback_checkpoint_paths(
+            trees, model, &matrix_iter2, &matrix_iter, checkpoint,
+            paths, npaths, lnls, model->unphased ? &phase_pr : NULL);
+    else
+        stochastic_traceback_paths(trees, model, &matrix_iter2, forward,
+                                   paths, npaths, lnls);
+    printTimerLog(time, LOG_LOW,
+                  "trace (%3d paths):                  ", npaths);
+    delete forward;
+}
+
+
 // sample the thread of the internal branch
 void sample_arg_thread_internal(
     const ArgModel *model, const Sequences *sequences, LocalTrees *trees,
@@ -698,13 +1712,15 @@ void sample_arg_thread_internal(
     const bool internal = true;
 
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    ArgHmmForwardTableCheckpoint *checkpoint = NULL;
+    ArgHmmForwardTable *forward = new_forward_table(model, trees, &checkpoint);
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
 
     // build matrices
     ArgHmmMatrixIter matrix_iter(model, sequences, trees);
     matrix_iter.set_internal(internal, minage);
+    matrix_iter.set_stream_emissions(true);
 
     if (phase_pr != NULL)
         printLog(LOG_HIGH, "treemap = %i %i\n",
@@ -712,7 +1728,7 @@ void sample_arg_thread_internal(
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
                        phase_pr, false, internal);
     int nstates = get_num_coal_states_internal(
            trees->front().tree, model->ntimes, minage);
@@ -722,11 +1738,17 @@ void sample_arg_thread_internal(
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
+    ArgHmmMatrixLruList matrix_iter2(model, NULL, trees, -1,
+                                     model->matrix_cache_mb);
     matrix_iter2.set_internal(internal, minage);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
-                         false, internal);
+    if (checkpoint)
+        stochastic_traceback_checkpoint(
+            trees, model, &matrix_iter2, &matrix_iter, checkpoint,
+            thread_path, phase_pr, internal);
+    else
+        stochastic_traceback(trees, model, &matrix_iter2, forward,
+                             thread_path, false, internal);
+    delete forward;
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
 
@@ -746,6 +1768,8 @@ void sample_arg_thread_internal(
                         recomb_pos, recombs, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    get_trans_matrix_cache().log_stats(LOG_LOW);
+    get_trans_matrix_switch_cache().log_stats(LOG_LOW);
 
     // clean up
     delete [] thread_path_alloc;
@@ -911,7 +1935,8 @@ void cond_sample_arg_thread_internal(
 
     // traceback
     time.start();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
+    ArgHmmMatrixLruList matrix_iter2(model, NULL, trees, -1,
+                                     model->matrix_cache_mb);
     matrix_iter2.set_internal(internal);
     stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
                          last_state_given, internal);
@@ -935,6 +1960,8 @@ void cond_sample_arg_thread_internal(
     assert_trees(trees, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    get_trans_matrix_cache().log_stats(LOG_LOW);
+    get_trans_matrix_switch_cache().log_stats(LOG_LOW);
 
     // clean up
     delete [] thread_path_alloc;
@@ -1121,4 +2148,56 @@ void delete_forward_matrix(double **mat, int nrows)
 
 } // extern "C"
 */
+
+
+extern "C" {
+
+// Perform the forward algorithm into a single buffer of seqlen rows of
+// *stride values, the largest number of states of a block.  Row i holds
+// the states of its block followed by zeros.  The buffer is freed with
+// delete_double_buffer().
+double *arghmm_forward_alg_buffer(
+    LocalTrees *trees, double *times, int ntimes,
+    double **popsizes, double rho, double mu,
+    char **seqs, int nseqs, int seqlen, bool prior_given, double *prior,
+    bool internal, bool slow, int *stride)
+{
+    // setup model, sequences
+    ArgModel model(ntimes, times, popsizes, rho, mu);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    // rows are as wide as the largest state space
+    States states;
+    *stride = 1;
+    for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it) {
+        get_coal_states(it->tree, ntimes, states, internal);
+        *stride = max(*stride, int(states.size()));
+    }
+    ArgHmmForwardTableBuffer forward(trees->start_coord, trees->length(),
+                                     *stride);
+
+    // setup prior
+    if (prior_given) {
+        get_coal_states(trees->front().tree, ntimes, states, internal);
+        double **fw = forward.get_table();
+        for (unsigned int i=0; i<states.size(); i++)
+            fw[trees->start_coord][i] = prior[i];
+    }
+
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, trees);
+    matrix_iter.set_internal(internal);
+    arghmm_forward_alg(trees, &model, &sequences, &matrix_iter, &forward,
+                       NULL, prior_given, internal, slow);
+
+    return forward.detach_buffer();
+}
+
+
+void delete_double_buffer(double *buffer)
+{
+    delete [] buffer;
+}
+
+} // extern "C"
+
 } // namespace argweaver
@@ -2,7 +2,9 @@
 #define ARGWEAVER_SAMPLE_THREAD_H
 
 // c++ includes
+#include <atomic>
 #include <list>
+#include <mutex>
 #include <vector>
 #include <string.h>
 
@@ -13,6 +15,7 @@
 #include "local_tree.h"
 #include "logging.h"
 #include "matrices.h"
+#include "mem.h"
 #include "model.h"
 #include "recomb.h"
 #include "sequences.h"
@@ -32,21 +35,220 @@ using namespace std;
 // Forward tables
 
 
+// Arena for forward table storage that is reused across forward tables.
+//
+// Blocks are carved out of a few large chunks and returned all at once by
+// release().  Chunks are merged on release, so once the pool has grown to
+// the size of the largest table no further heap allocations are needed.
+// A pool serves one forward table at a time.
+class ForwardTablePool
+{
+public:
+    ForwardTablePool() :
+        chunk(0),
+        used(0)
+    {}
+
+    ~ForwardTablePool()
+    {
+        for (unsigned int i=0; i<chunks.size(); i++)
+            delete [] chunks[i];
+        add_tag_memory(MEM_FORWARD, -long(capacity() * sizeof(double)));
+    }
+
+    // returns pointer array for a table of length seqlen
+    double **get_pointers(int seqlen)
+    {
+        if (int(pointers.size()) < seqlen)
+            pointers.resize(seqlen);
+        return &pointers[0];
+    }
+
+    // allocate a block of 'size' doubles
+    double *alloc(size_t size)
+    {
+        for (; chunk < chunks.size(); chunk++, used=0) {
+            if (used + size <= chunk_sizes[chunk]) {
+                double *block = chunks[chunk] + used;
+                used += size;
+                return block;
+            }
+        }
+
+        // allocate new chunk
+        size_t chunk_size = max(size, size_t(MIN_CHUNK_SIZE));
+        chunks.push_back(new double [chunk_size]);
+        add_tag_memory(MEM_FORWARD, chunk_size * sizeof(double));
+        chunk_sizes.push_back(chunk_size);
+        used = size;
+        return chunks.back();
+    }
+
+    // return all blocks to the pool
+    void release()
+    {
+        if (chunks.size() > 1) {
+            // merge chunks, so that the next table fits in one chunk
+            size_t total = 0;
+            for (unsigned int i=0; i<chunks.size(); i++) {
+                total += chunk_sizes[i];
+                delete [] chunks[i];
+            }
+            chunks.assign(1, new double [total]);
+            chunk_sizes.assign(1, total);
+        }
+        chunk = 0;
+        used = 0;
+    }
+
+    // total number of doubles held by the pool
+    size_t capacity() const
+    {
+        size_t total = 0;
+        for (unsigned int i=0; i<chunk_sizes.size(); i++)
+            total += chunk_sizes[i];
+        return total;
+    }
+
+    enum { MIN_CHUNK_SIZE = 1 << 16 };
+
+protected:
+    vector<double*> chunks;
+    vector<size_t> chunk_sizes;
+    unsigned int chunk;  // current chunk
+    size_t used;         // number of doubles used in current chunk
+    vector<double*> pointers;
+};
+
+
+// Runs of consecutive sites within blocks that share the same emissions.
+//
+// Runs are either invariant sites or masked sites, whose emissions are
+// one for every state.  The forward algorithm only stores the last column
+// of a run (and a few intermediate columns, see TransMatrixPowers::forward),
+// so the runs are recorded here for the traceback.
+class ForwardRuns
+{
+public:
+    ForwardRuns(int minlen, bool skip_masked=false) :
+        minlen(minlen),
+        skip_masked(skip_masked)
+    {}
+
+    struct Block {
+        int start;             // start of the block
+        vector<double> emit;   // emissions shared by the invariant runs
+        vector<int> starts;    // runs cover columns [starts[i], ends[i])
+        vector<int> ends;
+        vector<bool> masked;   // true if run i is masked
+    };
+
+    // add a block, blocks must be added in increasing order
+    Block &add_block(int start)
+    {
+        assert(blocks.size() == 0 || blocks.back().start < start);
+        blocks.push_back(Block());
+        blocks.back().start = start;
+        return blocks.back();
+    }
+
+    // returns the runs of the block starting at 'start' or NULL
+    const Block *find_block(int start) const
+    {
+        int low = 0, high = blocks.size();
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (blocks[mid].start < start)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if (low < int(blocks.size()) && blocks[low].start == start)
+            return &blocks[low];
+        return NULL;
+    }
+
+    int minlen;        // minimum length of an invariant run (0: off)
+    bool skip_masked;  // also collapse masked runs
+    vector<Block> blocks;
+};
+
+
+// Powers of the forward update for a run of sites with constant emissions.
+//
+// For emissions e and transition matrix T, one step of the forward
+// algorithm is col2 = col1 * M with M[j][k] = T[j][k] * e[k].  The powers
+// M^(2^k) are computed by repeated squaring, so that a run of L sites
+// takes O(log L) vector-matrix products.  Each power is stored scaled so
+// that its largest entry is one.
+class TransMatrixPowers
+{
+public:
+    // 'base' is the one step matrix M
+    TransMatrixPowers(int nstates, const double *const *base);
+    // if 'emit' is NULL, all emissions are one (masked sites)
+    TransMatrixPowers(const LocalTree *tree, const States &states,
+                      const TransMatrix *matrix, const double *emit);
+    ~TransMatrixPowers();
+
+    // returns M^(2^k) divided by exp(get_log_scale(k))
+    const double *const *get(int k);
+    double get_log_scale(int k)
+    {
+        get(k);
+        return log_scales[k];
+    }
+
+    // Compute fw[end-1] from fw[start-1] for the run of columns
+    // [start, end).  The columns at the boundaries of the power of two
+    // steps are also computed and are needed by traceback().
+    void forward(double **fw, int start, int end);
+
+    // Sample path[start-1 .. end-2] given path[end-1] for a run of
+    // columns [start, end) computed by forward().
+    void traceback(double **fw, int start, int end, int *path);
+
+    int nstates;
+
+protected:
+    void init(const double *const *base);
+    void sample_piece(int a, int k, int *path, bool must_change);
+    double log_stay(int state, int k);
+
+    vector<double**> powers;
+    vector<double> log_scales;
+    vector<double> log_diag;  // log M[j][j]
+};
+
+
 class ArgHmmForwardTable
 {
 public:
-    ArgHmmForwardTable(int start_coord, int seqlen) :
+    ArgHmmForwardTable(int start_coord, int seqlen,
+                       ForwardTablePool *pool=NULL) :
         start_coord(start_coord),
-        seqlen(seqlen)
+        seqlen(seqlen),
+        runs(NULL),
+        block_bytes(0),
+        pool(pool)
     {
-        fw = new double *[seqlen];
+        if (pool) {
+            fw = pool->get_pointers(seqlen);
+        } else {
+            fw = new double *[seqlen];
+            add_tag_memory(MEM_FORWARD, seqlen * sizeof(double*));
+        }
     }
 
     virtual ~ArgHmmForwardTable()
     {
+        delete runs;
         delete_blocks();
         if (fw) {
-            delete [] fw;
+            if (!pool) {
+                delete [] fw;
+                add_tag_memory(MEM_FORWARD, -long(seqlen * sizeof(double*)));
+            }
             fw = NULL;
         }
     }
@@ -58,7 +260,13 @@ public:
         // allocate block
         nstates = max(nstates, 1);
         int blocklen = end - start;
-        double *block = new double [blocklen * nstates];
+        double *block;
+        if (pool) {
+            block = pool->alloc(blocklen * nstates);
+        } else {
+            block = new double [blocklen * nstates];
+            add_block_bytes(blocklen * nstates * sizeof(double));
+        }
         blocks.push_back(block);
 
         // link block to fw table
@@ -71,11 +279,23 @@ public:
     // delete all blocks
     virtual void delete_blocks()
     {
-        for (unsigned int i=0; i<blocks.size(); i++)
-            delete [] blocks[i];
+        if (pool) {
+            if (blocks.size() > 0)
+                pool->release();
+        } else {
+            for (unsigned int i=0; i<blocks.size(); i++)
+                delete [] blocks[i];
+        }
         blocks.clear();
+        add_block_bytes(-block_bytes);
     }
 
+    // called by the forward algorithm once block [start, end) is complete
+    virtual void end_block(int start, int end) {}
+
+    // called by the traceback before it reads columns [start, end)
+    virtual void load_block(int start, int end) {}
+
     virtual double **get_table()
     {
         return &fw[-start_coord];
@@ -83,6 +303,8 @@ public:
 
     virtual double **detach_table()
     {
+        if (fw && !pool)
+            add_tag_memory(MEM_FORWARD, -long(seqlen * sizeof(double*)));
         double **ptr = fw;
         fw = NULL;
         return ptr;
@@ -90,10 +312,20 @@ public:
 
     int start_coord;
     int seqlen;
+    ForwardRuns *runs;  // collapsed runs of sites (optional)
 
 protected:
+    // accounts bytes of blocks allocated by the table, see mem.h
+    void add_block_bytes(long bytes)
+    {
+        block_bytes += bytes;
+        add_tag_memory(MEM_FORWARD, bytes);
+    }
+
     double **fw;
     vector<double*> blocks;
+    long block_bytes;  // bytes of blocks not taken from the pool
+    ForwardTablePool *pool;
 };
 
 
@@ -110,6 +342,7 @@ public:
             for (int i=0; i<seqlen; i++)
                 delete [] fw[i];
             delete [] fw;
+            add_tag_memory(MEM_FORWARD, -long(seqlen * sizeof(double*)));
             fw = NULL;
         }
     }
@@ -124,19 +357,416 @@ public:
 };
 
 
+// Forward table held in a single allocation of seqlen rows of 'stride'
+// values, so that callers from python can view it without copying.  Row i
+// holds the states of its block followed by zeros.
+class ArgHmmForwardTableBuffer : public ArgHmmForwardTable
+{
+public:
+    ArgHmmForwardTableBuffer(int start_coord, int seqlen, int stride) :
+        ArgHmmForwardTable(start_coord, seqlen),
+        stride(max(stride, 1)),
+        buffer(new double [long(seqlen) * this->stride])
+    {
+        const long size = long(seqlen) * this->stride;
+        fill(buffer, buffer + size, 0.0);
+        add_block_bytes(size * sizeof(double));
+        for (int i=0; i<seqlen; i++)
+            fw[i] = &buffer[long(i) * this->stride];
+    }
+
+    virtual ~ArgHmmForwardTableBuffer()
+    {
+        delete [] buffer;
+    }
+
+    // rows are linked to the buffer up front
+    virtual void new_block(int start, int end, int nstates)
+    {
+        assert(nstates <= stride);
+    }
+
+    // Returns the buffer, which the caller then frees with delete []
+    double *detach_buffer()
+    {
+        add_block_bytes(-block_bytes);
+        double *ptr = buffer;
+        buffer = NULL;
+        return ptr;
+    }
+
+    const int stride;
+
+protected:
+    double *buffer;
+};
+
+
+// Forward table stored in single precision.
+//
+// Each block is computed in double precision in a scratch buffer and then
+// stored as floats, with every column divided by its maximum.  The scale
+// factors stay in double precision, so small columns do not underflow.
+// Columns are expanded back to double precision one block at a time
+// during traceback.
+class ArgHmmForwardTableFloat : public ArgHmmForwardTable
+{
+public:
+    ArgHmmForwardTableFloat(int start_coord, int seqlen) :
+        ArgHmmForwardTable(start_coord, seqlen)
+    {
+        scales = new double [seqlen];
+        add_tag_memory(MEM_FORWARD, seqlen * sizeof(double));
+    }
+
+    virtual ~ArgHmmForwardTableFloat()
+    {
+        delete_blocks();
+        delete [] scales;
+        add_tag_memory(MEM_FORWARD, -long(seqlen * sizeof(double)));
+    }
+
+    // allocate another block of the forward table
+    virtual void new_block(int start, int end, int nstates)
+    {
+        nstates = max(nstates, 1);
+        int blocklen = end - start;
+        fblocks.push_back(new float [blocklen * nstates]);
+        add_block_bytes(blocklen * nstates * sizeof(float));
+        block_starts.push_back(start);
+        block_nstates.push_back(nstates);
+
+        // compute block in double precision scratch space
+        if (int(work.size()) < blocklen * nstates)
+            work.resize(blocklen * nstates);
+        for (int i=start; i<end; i++) {
+            assert(i-start_coord >= 0 && i-start_coord < seqlen);
+            fw[i-start_coord] = &work[(i-start)*nstates];
+        }
+    }
+
+    // store block [start, end) in single precision
+    virtual void end_block(int start, int end)
+    {
+        assert(block_starts.back() == start);
+        const int nstates = block_nstates.back();
+        float *block = fblocks.back();
+
+        for (int i=start; i<end; i++) {
+            const double *col = fw[i-start_coord];
+            double scale = max_array(col, nstates);
+            if (scale <= 0.0)
+                scale = 1.0;
+            scales[i-start_coord] = scale;
+
+            float *fcol = &block[(i-start)*nstates];
+            for (int k=0; k<nstates; k++)
+                fcol[k] = float(col[k] / scale);
+        }
+
+        // the next block starts from the last column of this block
+        last_col.assign(fw[end-1-start_coord], fw[end-1-start_coord] + nstates);
+        fw[end-1-start_coord] = &last_col[0];
+    }
+
+    // expand columns [start, end) to double precision
+    virtual void load_block(int start, int end)
+    {
+        int size = 0;
+        for (int i=start; i<end; i++)
+            size += block_nstates[find_block(i)];
+        if (int(work.size()) < size)
+            work.resize(size);
+
+        double *col = &work[0];
+        for (int i=start; i<end; i++) {
+            const int j = find_block(i);
+            const int nstates = block_nstates[j];
+            const float *fcol = &fblocks[j][(i-block_starts[j])*nstates];
+            const double scale = scales[i-start_coord];
+            for (int k=0; k<nstates; k++)
+                col[k] = fcol[k] * scale;
+            fw[i-start_coord] = col;
+            col += nstates;
+        }
+    }
+
+    // delete all blocks
+    virtual void delete_blocks()
+    {
+        for (unsigned int i=0; i<fblocks.size(); i++)
+            delete [] fblocks[i];
+        fblocks.clear();
+        add_block_bytes(-block_bytes);
+        block_starts.clear();
+        block_nstates.clear();
+    }
+
+protected:
+    // returns the index of the block containing position pos
+    int find_block(int pos) const
+    {
+        return upper_bound(block_starts.begin(), block_starts.end(), pos)
+            - block_starts.begin() - 1;
+    }
+
+    vector<float*> fblocks;
+    vector<int> block_starts;
+    vector<int> block_nstates;
+    double *scales;           // scale factor of each column
+    vector<double> work;      // double precision scratch space
+    vector<double> last_col;  // last column of the previous block
+};
+
+
+// Forward table that only keeps one column every 'interval' bases.
+//
+// Blocks are freed once a checkpoint column has been saved and are
+// recomputed segment by segment during traceback (see
+// stochastic_traceback_checkpoint).  With interval ~ sqrt(seqlen) the
+// table needs O(sqrt(seqlen)) columns instead of O(seqlen), at the cost
+// of a second forward pass.
+class ArgHmmForwardTableCheckpoint : public ArgHmmForwardTable
+{
+public:
+    ArgHmmForwardTableCheckpoint(int start_coord, int seqlen, int interval,
+                                 ForwardTablePool *pool=NULL) :
+        ArgHmmForwardTable(start_coord, seqlen, pool),
+        interval(max(interval, 1)),
+        seglen(0),
+        nstates(1),
+        column_bytes(0)
+    {
+        segments.push_back(start_coord);
+    }
+
+    virtual ~ArgHmmForwardTableCheckpoint()
+    {
+        for (unsigned int i=0; i<columns.size(); i++)
+            delete [] columns[i];
+        add_tag_memory(MEM_FORWARD, -column_bytes);
+    }
+
+    virtual void new_block(int start, int end, int nstates)
+    {
+        ArgHmmForwardTable::new_block(start, end, nstates);
+        this->nstates = max(nstates, 1);
+    }
+
+    // save a checkpoint column once the current segment is long enough
+    // and free the rest of the segment
+    virtual void end_block(int start, int end)
+    {
+        seglen += end - start;
+        if (seglen < interval || end >= start_coord + seqlen)
+            return;
+
+        double *col = new double [nstates];
+        column_bytes += nstates * sizeof(double);
+        add_tag_memory(MEM_FORWARD, nstates * sizeof(double));
+        double *src = fw[end-1-start_coord];
+        std::copy(src, src + nstates, col);
+        columns.push_back(col);
+
+        delete_blocks();
+        fw[end-1-start_coord] = col;
+        segments.push_back(end);
+        seglen = 0;
+    }
+
+    // returns the start of the segment containing position pos
+    int get_segment_start(int pos) const
+    {
+        return *(upper_bound(segments.begin(), segments.end(), pos) - 1);
+    }
+
+    int get_num_segments() const {
+        return segments.size();
+    }
+
+    int interval;
+
+protected:
+    int seglen;          // length of current segment
+    int nstates;         // number of states in last allocated block
+    vector<int> segments;       // start position of each segment
+    vector<double*> columns;    // saved checkpoint columns
+    long column_bytes;          // bytes of saved columns
+};
+
+
 //=============================================================================
 // Forward algorithm for thread path
 
+void arghmm_forward_block(const ArgModel *model, const LocalTree *tree,
+                          const int blocklen, const States &states,
+                          const LineageCounts &lineages,
+                          const TransMatrix *matrix,
+                          const double* const *emit, double **fw);
+
+// Forward algorithm for the first column of a block, using the dense or
+// sparse switch matrix (both give the same column)
+void arghmm_forward_switch(const double *col1, double* col2,
+                           const TransMatrixSwitch *matrix,
+                           const double *emit);
+void arghmm_forward_switch(const double *col1, double* col2,
+                           const TransMatrixSwitchSparse *matrix,
+                           const double *emit);
+
+// Zeroes the states of a normalized forward column whose mass is below
+// 'threshold', keeping at least the largest one, and renormalizes the rest.
+// Returns the mass dropped and adds the states dropped to 'npruned'.
+// Forward passes prune their columns this way if ArgModel::fw_prune > 0.
+double prune_forward_column(double *col, int nstates, double threshold,
+                            long long *npruned);
+
+void arghmm_forward_block(const ArgModel *model, const LocalTree *tree,
+                          const int blocklen, const States &states,
+                          const LineageCounts &lineages,
+                          const TransMatrix *matrix,
+                          SiteEmissions *site_emit, int site_offset,
+                          double **fw);
+
+void arghmm_forward_block_slow(const LocalTree *tree, const int ntimes,
+                               const int blocklen, const States &states,
+                               const LineageCounts &lineages,
+                               const TransMatrix *matrix,
+                               const double* const *emit, double **fw);
+
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
     ArgHmmForwardTable *forward, PhaseProbs *phase_pr=NULL,
     bool prior_given=false, bool internal=false, bool slow=false);
 
+
+// Distributions of the state spaces met by forward passes.  Sizes are
+// counted in bins of doubling width: bin 0 holds 0 and bin b > 0 holds
+// [2^(b-1), 2^b).  The fractions of deterministic transitions of the
+// switches between blocks are counted in NFRAC_BINS bins of equal width.
+class StateHistograms
+{
+public:
+    static const int NBINS = 32;
+    static const int NFRAC_BINS = 10;
+
+    StateHistograms() { clear(); }
+
+    void clear();
+    void add(const StateHistograms &other);
+
+    // count a block of 'nstates' states over 'blocklen' sites
+    void add_block(int nstates, int blocklen)
+    {
+        states[get_bin(nstates)]++;
+        blocklens[get_bin(blocklen)]++;
+    }
+
+    // count a switch between the state spaces of two blocks
+    void add_switch(const TransMatrixSwitch *matrix);
+
+    // returns the bin of a size and the sizes [start, end) of a bin
+    static int get_bin(long long size);
+    static long long get_bin_start(int bin);
+    static long long get_bin_end(int bin) { return get_bin_start(bin + 1); }
+
+    // writes one line per nonempty bin, each starting with 'prefix'
+    void write(FILE *stream, const char *prefix) const;
+
+    long long states[NBINS];         // blocks by number of states
+    long long blocklens[NBINS];      // blocks by number of sites
+    long long determ[NFRAC_BINS];    // switches by deterministic fraction
+    long long nswitches;             // switches between blocks
+};
+
+
+// Work of the forward passes since clear(), for the stats of a sampling
+// iteration.  Passes on several threads may add to the same counts.
+class ForwardStats
+{
+public:
+    ForwardStats() { clear(); }
+
+    void clear()
+    {
+        usecs = 0;
+        nblocks = 0;
+        nstates = 0;
+        lock_guard<mutex> guard(hist_lock);
+        hist.clear();
+        npruned = 0;
+        pruned_mass = 0.0;
+        timer.start();
+    }
+
+    // adds the histograms of a forward pass
+    void add_histograms(const StateHistograms &pass_hist)
+    {
+        lock_guard<mutex> guard(hist_lock);
+        hist.add(pass_hist);
+    }
+
+    // adds states dropped by pruning forward columns and their mass
+    void add_pruned(long long nstates, double mass)
+    {
+        lock_guard<mutex> guard(hist_lock);
+        npruned += nstates;
+        pruned_mass += mass;
+    }
+
+    atomic<long long> usecs;    // wall time of the forward passes
+    atomic<long long> nblocks;  // blocks of the forward passes
+    atomic<long long> nstates;  // states summed over blocks
+    StateHistograms hist;       // state spaces of the blocks
+    long long npruned;          // states dropped by forward pruning
+    double pruned_mass;         // their mass summed over columns
+    mutex hist_lock;            // held while adding to hist or pruned counts
+    Timer timer;                // time since clear()
+};
+
+// Returns the counts that forward passes of the calling thread add to
+ForwardStats &get_forward_stats();
+
+// Makes the forward passes of the calling thread add to 'stats', or to
+// the counts of the process if NULL, and returns the previous counts
+ForwardStats *set_thread_forward_stats(ForwardStats *stats);
+
+// Sample path[0 .. blocklen-2] of a block given path[blocklen-1].
+// Each step first tests in O(1) whether the path stays in its state.
+double sample_hmm_posterior(
+    int blocklen, const LocalTree *tree, const States &states,
+    const TransMatrix *matrix, const double *const *fw, int *path);
+
 double stochastic_traceback(
     const LocalTrees *trees, const ArgModel *model,
     ArgHmmMatrixIter *matrix_iter,
     double **fw, int *path, bool last_state_given=false, bool internal=false);
 
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    int *path, bool last_state_given=false, bool internal=false);
+
+double stochastic_traceback_checkpoint(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmMatrixIter *forward_iter,
+    ArgHmmForwardTableCheckpoint *forward, int *path,
+    PhaseProbs *phase_pr=NULL, bool internal=false);
+
+// Draw 'npaths' independent paths from the same forward table.  The
+// matrices of each block are computed once and shared by all paths.
+// paths[k] is indexed by position like 'path' above; if 'lnls' is given,
+// lnls[k] is set to the log probability of path k.
+void stochastic_traceback_paths(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    int **paths, int npaths, double *lnls=NULL);
+
+void stochastic_traceback_checkpoint_paths(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmMatrixIter *forward_iter,
+    ArgHmmForwardTableCheckpoint *forward, int **paths, int npaths,
+    double *lnls=NULL, PhaseProbs *phase_pr=NULL, bool internal=false);
+
 //=============================================================================
 // ARG thread sampling
 
@@ -144,6 +774,12 @@ void sample_arg_thread(
     const ArgModel *model, Sequences *sequences, LocalTrees *trees,
     int new_chrom);
 
+// Sample 'npaths' threading paths of chromosome new_chrom from a single
+// forward pass without adding the thread to the ARG.
+void sample_arg_thread_paths(
+    const ArgModel *model, Sequences *sequences, const LocalTrees *trees,
+    int new_chrom, int **paths, int npaths, double *lnls=NULL);
+
 void sample_arg_thread_internal(
    const ArgModel *model, const Sequences *sequences, LocalTrees *trees,
    int minage=0, PhaseProbs *phase_pr=NULL);
@@ -160,6 +796,19 @@ void cond_sample_arg_thread_internal(
     LocalTrees *trees, State start_state, State end_state);
 
 
+//=============================================================================
+// C interface
+extern "C" {
+
+double *arghmm_forward_alg_buffer(
+    LocalTrees *trees, double *times, int ntimes,
+    double **popsizes, double rho, double mu,
+    char **seqs, int nseqs, int seqlen, bool prior_given, double *prior,
+    bool internal, bool slow, int *stride);
+void delete_double_buffer(double *buffer);
+
+} // extern "C"
+
 } // namespace argweaver
 
 #endif // ARGWEAVER_SAMPLE_THREAD_H
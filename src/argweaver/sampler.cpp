@@ -0,0 +1,157 @@
+
+#include "common.h"
+#include "logging.h"
+#include "sample_arg.h"
+#include "sampler.h"
+
+namespace argweaver {
+
+
+bool ArgSampler::load(const ArgModel &model0, const InputBundle &inputs,
+                      double map_tolerance)
+{
+    if (model0.ntimes == 0 || !model0.popsizes) {
+        printError("sampler model has no times or population sizes");
+        return false;
+    }
+
+    compress_seq = inputs.compress_seq;
+    seq_region = inputs.seq_region;
+    sites_mapping = inputs.sites_mapping;
+    sequences.clear();
+    make_sequences_from_sites(&inputs.sites, &sequences);
+
+    // compress and apply masks as arg-sample does
+    TrackNullValue maskmap = inputs.maskmap;
+    if (maskmap.size() > 0) {
+        compress_mask(maskmap, &sites_mapping);
+        apply_mask_sequences(&sequences, maskmap);
+    }
+    for (unsigned int i=0; i<inputs.ind_maskmap.size(); i++) {
+        TrackNullValue ind_maskmap = inputs.ind_maskmap[i];
+        compress_mask(ind_maskmap, &sites_mapping);
+        apply_mask_sequences(&sequences, ind_maskmap,
+                             inputs.sites.names[i].c_str());
+    }
+
+    // make compressed model
+    model.reset(new ArgModel(model0));
+    model->mutmap = inputs.mutmap;
+    model->recombmap = inputs.recombmap;
+    if (inputs.unphased)
+        model->unphased = true;
+    if (model->unphased)
+        sequences.set_pairs(model.get());
+    sequences.set_age();
+    sequences.pack();
+
+    if (!model->setup_maps(seq_region.chrom, seq_region.start,
+                           seq_region.end, map_tolerance)) {
+        model.reset();
+        return false;
+    }
+    compress_model(model.get(), &sites_mapping, compress_seq);
+    return true;
+}
+
+
+bool ArgSampler::load_bundle(const ArgModel &model, const char *filename,
+                             double map_tolerance)
+{
+    InputBundle inputs;
+    if (!read_input_bundle(filename, &inputs))
+        return false;
+    return load(model, inputs, map_tolerance);
+}
+
+
+bool ArgSampler::run(const SamplerRun &run,
+                     const SampleCallback &callback) const
+{
+    if (!model) {
+        printError("sampler has no inputs");
+        return false;
+    }
+    if (run.niters < 0 || run.sample_step < 1) {
+        printError("sampler run needs niters >= 0 and sample_step >= 1");
+        return false;
+    }
+
+    // region in compressed coordinates
+    int region_start = -1, region_end = -1;
+    if (run.region_start != -1) {
+        if (!run.init_trees) {
+            printError("resampling a region needs an initial ARG");
+            return false;
+        }
+        if (run.region_start < seq_region.start ||
+            run.region_end > seq_region.end ||
+            run.region_start >= run.region_end) {
+            printError("resample region %d-%d is outside of the sites",
+                       run.region_start, run.region_end);
+            return false;
+        }
+        region_start = sites_mapping.compress(run.region_start);
+        region_end = sites_mapping.compress(run.region_end - 1) + 1;
+    }
+
+    // each run samples from copies of the inputs with its own generator
+    ArgModel model2(*model);
+    Sequences sequences2;
+    sequences2.copy(sequences);
+    unique_ptr<LocalTrees> trees_ptr;
+    if (run.init_trees) {
+        trees_ptr.reset(new LocalTrees());
+        trees_ptr->copy(*run.init_trees);
+    } else {
+        trees_ptr.reset(new LocalTrees(0, sequences2.length()));
+        trees_ptr->chrom = seq_region.chrom;
+    }
+    LocalTrees &trees = *trees_ptr;
+    RandState rand;
+    rand.seed(run.randseed);
+    RandState *prev_rand = set_thread_rand(&rand);
+
+    if (trees.get_num_leaves() < sequences2.get_num_seqs())
+        sample_arg_seq(&model2, &sequences2, &trees, true, run.num_buildup);
+
+    bool ok = callback(0, &model2, &sequences2, &trees);
+    if (region_start != -1) {
+        for (int i=1; i<=run.niters && ok; i++) {
+            resample_arg_region(&model2, &sequences2, &trees,
+                                region_start, region_end, 1);
+            if (i % run.sample_step == 0)
+                ok = callback(i, &model2, &sequences2, &trees);
+        }
+    } else {
+        const double recomb_preference = .9;
+        for (int i=0; i<run.nclimb; i++)
+            resample_arg_climb(&model2, &sequences2, &trees,
+                               recomb_preference, run.climb_tries);
+
+        const double frac_leaf = 0.5;
+        const int window = run.resample_window / compress_seq;
+        for (int i=1; i<=run.niters && ok; i++) {
+            const bool do_leaf = frand() < frac_leaf;
+            if (run.gibbs)
+                resample_arg(&model2, &sequences2, &trees);
+            else
+                resample_arg_mcmc_all(&model2, &sequences2, &trees, do_leaf,
+                                      window, run.resample_window_iters);
+            if (i % run.sample_step == 0)
+                ok = callback(i, &model2, &sequences2, &trees);
+        }
+    }
+
+    set_thread_rand(prev_rand);
+    return true;
+}
+
+
+void ArgSampler::uncompress_trees(LocalTrees *trees) const
+{
+    uncompress_local_trees(trees, &sites_mapping);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,125 @@
+//=============================================================================
+// Sampler for running arg-sample chains from within a program
+
+
+#ifndef ARGWEAVER_SAMPLER_H
+#define ARGWEAVER_SAMPLER_H
+
+// c/c++ includes
+#include <functional>
+#include <memory>
+#include <string>
+
+// arghmm includes
+#include "input_bundle.h"
+#include "local_tree.h"
+#include "model.h"
+#include "sequences.h"
+
+namespace argweaver {
+
+using namespace std;
+
+
+// Options of one run of an ArgSampler.  The defaults are those of
+// arg-sample.
+class SamplerRun
+{
+public:
+    SamplerRun() :
+        randseed(1),
+        niters(1000),
+        sample_step(10),
+        nclimb(0),
+        climb_tries(1),
+        num_buildup(1),
+        resample_window(100000),
+        resample_window_iters(10),
+        gibbs(false),
+        region_start(-1),
+        region_end(-1),
+        init_trees(NULL)
+    {}
+
+    int randseed;
+    int niters;
+    int sample_step;            // iterations between samples
+    int nclimb;
+    int climb_tries;
+    int num_buildup;
+    int resample_window;        // in original coordinates
+    int resample_window_iters;
+    bool gibbs;
+
+    // If region_start != -1, only the region [region_start, region_end)
+    // (0-based, original coordinates) of init_trees is resampled, as
+    // arg-sample --resample-region does.
+    int region_start;
+    int region_end;
+
+    // ARG to start from, in the compressed coordinates of the sampler, or
+    // NULL to sample one sequentially.  It is copied.
+    const LocalTrees *init_trees;
+};
+
+
+// Called with the ARG after iteration 'iter' of a run, including the ARG
+// it starts from (iter=0).  The trees are in the compressed coordinates of
+// the sampler and are only valid during the call.  Returning false stops
+// the run.
+typedef function<bool(int iter, const ArgModel *model,
+                      const Sequences *sequences,
+                      const LocalTrees *trees)> SampleCallback;
+
+
+// Samples ARGs of one set of inputs many times in one process.  The
+// inputs are read and the model is compressed once, and each run samples
+// from copies of them with a generator of its own, so runs with the same
+// seed give the same samples, and runs may be made from several threads
+// at once.
+class ArgSampler
+{
+public:
+    ArgSampler() :
+        compress_seq(1)
+    {}
+
+    // Sets up the sampler from preprocessed inputs.  'model' gives the
+    // times, population sizes and rates in original coordinates; the maps
+    // of the inputs replace its own.
+    bool load(const ArgModel &model, const InputBundle &inputs,
+              double map_tolerance=0.0);
+
+    // Same as load() with the inputs of a bundle written by arg-sample
+    // --write-bundle
+    bool load_bundle(const ArgModel &model, const char *filename,
+                     double map_tolerance=0.0);
+
+    // Runs one chain, calling 'callback' every run.sample_step iterations.
+    // Returns false if the options are invalid.
+    bool run(const SamplerRun &run, const SampleCallback &callback) const;
+
+    // Converts trees given to a callback to original coordinates
+    void uncompress_trees(LocalTrees *trees) const;
+
+    // Returns the compressed model, once loaded
+    const ArgModel &get_model() const {
+        return *model;
+    }
+
+    const Sequences &get_sequences() const {
+        return sequences;
+    }
+
+protected:
+    unique_ptr<ArgModel> model;  // compressed model, NULL until loaded
+    Sequences sequences;         // masked, compressed alignment
+    SitesMapping sites_mapping;
+    Region seq_region;           // region of the sites, original coordinates
+    int compress_seq;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_SAMPLER_H
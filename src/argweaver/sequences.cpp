@@ -1,3 +1,8 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <atomic>
+
 #include "common.h"
 #include "logging.h"
 #include "parsing.h"
@@ -5,6 +10,7 @@
 #include "sequences.h"
 #include "local_tree.h"
 #include "model.h"
+#include "thread_pool.h"
 
 // TODO: add sites validation
 //       - positions should be sorted and unique
@@ -130,6 +136,23 @@ void write_fasta(FILE *stream, Sequences *seqs)
 //=============================================================================
 // input/output: sites file format
 
+// Returns true if site i is written to a sites file.  Invariant sites are
+// skipped unless they are masked and masked sites are requested.
+static bool is_written_site(const Sites *sites, int i, bool write_masked)
+{
+    const int nseq = sites->names.size();
+    int j;
+    for (j=1; j < nseq; j++)
+        if (sites->cols[i][j] != sites->cols[i][0]) break;
+    if (j == nseq) {
+        // this site is invariant though it may be masked
+        if (!write_masked) return false;
+        if (sites->cols[i][0] != 'N') return false;
+    }
+    return true;
+}
+
+
 void write_sites(FILE *stream, Sites *sites, bool write_masked) {
     bool have_base_probs = sites->base_probs.size() > 0;
     int nseq = (int)sites->names.size();
@@ -145,14 +168,8 @@ void write_sites(FILE *stream, Sites *sites, bool write_masked) {
         exit(-1);
     }
     for (unsigned int i=0; i < sites->positions.size(); i++) {
-        int j;
-        for (j=1; j < nseq; j++)
-            if (sites->cols[i][j] != sites->cols[i][0]) break;
-        if (j == nseq) {
-            // this site is invariant though it may be masked
-            if (!write_masked) continue;
-            if (sites->cols[i][0] != 'N') continue;
-        }
+        if (!is_written_site(sites, i, write_masked))
+            continue;
         fprintf(stream, "%i\t", sites->positions[i]+1);
         for (unsigned int k=0; k < sites->names.size(); k++)
             fprintf(stream, "%c", sites->cols[i][k]);
@@ -175,30 +192,419 @@ bool validate_site_column(char *col, int nseqs)
 }
 
 
-// Read a Sites stream
-bool read_sites(FILE *infile, Sites *sites,
-                int subregion_start, int subregion_end, bool quiet)
+//=============================================================================
+// binary sites format
+//
+// A binary copy of a sites file loads without any parsing, and regions and
+// subsets of the sequences are read without decoding the rest:
+//
+//   magic "\x89SIT"
+//   int     version, nseqs, nsites, start_coord, end_coord, npops,
+//           have_base_probs
+//   string  chrom, names[nseqs]    (int length followed by characters)
+//   int     pops[npops]
+//   int     positions[nsites]      (0-based, sorted)
+//   int64   col_offsets[nsites+1]  (offset of each column in the columns)
+//   double  base_probs[nsites][nseqs][4]   (if have_base_probs)
+//   columns, each one of
+//     char major, int -1, char bases[nseqs]
+//     char major, int nother, int seqs[nother], char bases[nother]
+//
+// where the second form gives the sequences whose base is not the most
+// common one, 'major'.  Version 1 files have no offsets and each column is
+// nseqs bases.  Values are in host byte order.
+
+static const char BINARY_SITES_MAGIC[] = "\x89SIT";
+static const int BINARY_SITES_VERSION = 2;
+
+
+static bool write_binary_string(FILE *stream, const string &str)
+{
+    const int len = str.size();
+    return fwrite(&len, sizeof(int), 1, stream) == 1 &&
+        (int) fwrite(str.data(), 1, len, stream) == len;
+}
+
+
+// Encodes a column of 'nseqs' bases, sparsely if few differ from the most
+// common base
+static void encode_site_column(const char *col, int nseqs, string *data)
+{
+    int counts[256] = {0};
+    for (int k=0; k<nseqs; k++)
+        counts[(unsigned char) col[k]]++;
+    unsigned char major = 'N';
+    for (int c=0; c<256; c++)
+        if (counts[c] > counts[major])
+            major = c;
+    const int nother = nseqs - counts[major];
+
+    data->push_back(major);
+    if (nother * int(sizeof(int) + 1) >= nseqs) {
+        const int dense = -1;
+        data->append((const char*) &dense, sizeof(int));
+        data->append(col, nseqs);
+        return;
+    }
+    data->append((const char*) &nother, sizeof(int));
+    for (int k=0; k<nseqs; k++)
+        if ((unsigned char) col[k] != major)
+            data->append((const char*) &k, sizeof(int));
+    for (int k=0; k<nseqs; k++)
+        if ((unsigned char) col[k] != major)
+            data->push_back(col[k]);
+}
+
+
+bool write_sites_binary(FILE *stream, Sites *sites, bool write_masked)
+{
+    const int nseqs = sites->names.size();
+    const bool have_base_probs = sites->base_probs.size() > 0;
+    vector<int> written;
+    for (int i=0; i < sites->get_num_sites(); i++)
+        if (is_written_site(sites, i, write_masked))
+            written.push_back(i);
+    const int nsites = written.size();
+
+    const int header[] = {BINARY_SITES_VERSION, nseqs, nsites,
+                          sites->start_coord, sites->end_coord,
+                          (int) sites->pops.size(), have_base_probs};
+    bool ok = fwrite(BINARY_SITES_MAGIC, 1, 4, stream) == 4 &&
+        fwrite(header, sizeof(header), 1, stream) == 1 &&
+        write_binary_string(stream, sites->chrom);
+    for (int i=0; i<nseqs; i++)
+        ok = ok && write_binary_string(stream, sites->names[i]);
+    ok = ok && fwrite(&sites->pops[0], sizeof(int), sites->pops.size(),
+                      stream) == sites->pops.size();
+
+    for (int i=0; i<nsites && ok; i++)
+        ok = fwrite(&sites->positions[written[i]], sizeof(int), 1,
+                    stream) == 1;
+
+    string columns;
+    vector<int64_t> offsets(nsites + 1, 0);
+    for (int i=0; i<nsites; i++) {
+        encode_site_column(sites->cols[written[i]], nseqs, &columns);
+        offsets[i + 1] = columns.size();
+    }
+    ok = ok && fwrite(&offsets[0], sizeof(int64_t), nsites + 1,
+                      stream) == (size_t) nsites + 1;
+    if (have_base_probs) {
+        for (int i=0; i<nsites && ok; i++)
+            for (int k=0; k<nseqs && ok; k++)
+                ok = fwrite(sites->base_probs[written[i]][k].prob,
+                            sizeof(double), 4, stream) == 4;
+    }
+    return ok && fwrite(columns.data(), 1, columns.size(), stream) ==
+        columns.size();
+}
+
+
+// Reads values from a buffer, advancing 'p'
+static bool read_binary(const char *&p, const char *end, void *dest,
+                        size_t size)
+{
+    if ((size_t) (end - p) < size)
+        return false;
+    memcpy(dest, p, size);
+    p += size;
+    return true;
+}
+
+static bool read_binary_string(const char *&p, const char *end, string *str)
+{
+    int len;
+    if (!read_binary(p, end, &len, sizeof(int)) || len < 0 ||
+        end - p < len)
+        return false;
+    str->assign(p, len);
+    p += len;
+    return true;
+}
+
+
+// Finds the sequences of 'names' to keep for Sites::subset().  The names
+// may be those of the haplotypes, or of individuals whose haplotypes are
+// <name>_1 and <name>_2.  Returns false if some are missing.
+static bool find_subset_seqs(const vector<string> &names,
+                             const set<string> &names_to_keep,
+                             vector<int> *keep)
+{
+    keep->clear();
+    for (unsigned int i=0; i < names.size(); i++) {
+        if (names_to_keep.find(names[i]) != names_to_keep.end())
+            keep->push_back(i);
+    }
+    if (keep->size() > 0) {
+        if (keep->size() != names_to_keep.size()) {
+            fprintf(stderr, "Error in subset: not all names found in sites\n");
+            return false;
+        }
+        return true;
+    }
+
+    // if nothing found, these may be individual names rather than haploid
+    // names
+    set<string> hapkeep;
+    for (set<string>::iterator it=names_to_keep.begin();
+         it != names_to_keep.end(); it++) {
+        hapkeep.insert((*it) + string("_1"));
+        hapkeep.insert((*it) + string("_2"));
+    }
+    for (unsigned int i=0; i < names.size(); i++) {
+        if (hapkeep.find(names[i]) != hapkeep.end())
+            keep->push_back(i);
+    }
+    if (keep->size() != hapkeep.size()) {
+        fprintf(stderr, "Error in subset: not all names found in sites\n");
+        return false;
+    }
+    return true;
+}
+
+
+// Decodes the bases of the sequences 'keep' of a version 2 column.
+// 'keep_index' gives the index in 'keep' of each sequence, or -1.
+static bool decode_site_column(const char *p, const char *end, int nseqs,
+                               const vector<int> &keep,
+                               const vector<int> &keep_index, char *col)
+{
+    char major;
+    int nother;
+    if (!read_binary(p, end, &major, 1) ||
+        !read_binary(p, end, &nother, sizeof(int)))
+        return false;
+    const int nkeep = keep.size();
+
+    if (nother == -1) {
+        if (end - p < nseqs)
+            return false;
+        for (int j=0; j<nkeep; j++)
+            col[j] = p[keep[j]];
+        return true;
+    }
+    if (nother < 0 || nother > nseqs ||
+        end - p < long(nother) * long(sizeof(int) + 1))
+        return false;
+    for (int j=0; j<nkeep; j++)
+        col[j] = major;
+    const char *bases = p + long(nother) * sizeof(int);
+    for (int k=0; k<nother; k++) {
+        int seq;
+        memcpy(&seq, p + long(k) * sizeof(int), sizeof(int));
+        if (seq < 0 || seq >= nseqs)
+            return false;
+        if (keep_index[seq] != -1)
+            col[keep_index[seq]] = bases[k];
+    }
+    return true;
+}
+
+
+// Reads a binary sites file.  If 'names_to_keep' is not NULL, only those
+// sequences are decoded and the sites still variable among them are kept,
+// as Sites::subset() does.
+static bool read_sites_binary(const char *data, size_t size, Sites *sites,
+                              int subregion_start, int subregion_end,
+                              bool quiet, const set<string> *names_to_keep)
+{
+    const char *p = data + 4;
+    const char *end = data + size;
+    int header[7];
+    if (!read_binary(p, end, header, sizeof(header)) ||
+        header[0] < 1 || header[0] > BINARY_SITES_VERSION) {
+        if (!quiet) printError("bad binary sites header");
+        return false;
+    }
+    const int version = header[0];
+    const int nseqs = header[1];
+    const int nsites = header[2];
+    const int npops = header[5];
+    const bool have_base_probs = header[6];
+    sites->start_coord = (subregion_start != -1 ? subregion_start : header[3]);
+    sites->end_coord = (subregion_end != -1 ? subregion_end : header[4]);
+
+    bool ok = nseqs >= 0 && nsites >= 0 && npops >= 0 &&
+        read_binary_string(p, end, &sites->chrom);
+    sites->names.resize(max(nseqs, 0));
+    for (int i=0; i<nseqs && ok; i++)
+        ok = read_binary_string(p, end, &sites->names[i]);
+    if (ok) {
+        sites->pops.resize(npops);
+        ok = read_binary(p, end, &sites->pops[0], npops * sizeof(int));
+    }
+
+    const char *positions = p;
+    const long offsets_size = version >= 2 ?
+        long(nsites + 1) * sizeof(int64_t) : 0;
+    const long bases_size = version >= 2 ? 0 : long(nsites) * nseqs;
+    const char *offsets = positions + long(nsites) * sizeof(int);
+    const char *bases = offsets + offsets_size;
+    const long probs_size = have_base_probs ?
+        long(nsites) * nseqs * 4 * sizeof(double) : 0;
+    const char *probs = bases + bases_size;
+    const char *columns = probs + probs_size;
+    if (!ok || end - p < long(nsites) * long(sizeof(int)) + offsets_size +
+        bases_size + probs_size) {
+        if (!quiet) printError("truncated binary sites file");
+        return false;
+    }
+
+    // sequences to decode
+    vector<int> keep;
+    if (names_to_keep) {
+        if (!find_subset_seqs(sites->names, *names_to_keep, &keep))
+            return false;
+        sort(keep.begin(), keep.end());
+        vector<string> names = sites->names;
+        sites->names.clear();
+        for (unsigned int j=0; j<keep.size(); j++)
+            sites->names.push_back(names[keep[j]]);
+        if (npops != 0) {
+            vector<int> pops = sites->pops;
+            sites->pops.clear();
+            for (unsigned int j=0; j<keep.size(); j++)
+                sites->pops.push_back(pops[keep[j]]);
+        }
+    } else {
+        for (int k=0; k<nseqs; k++)
+            keep.push_back(k);
+    }
+    const int nkeep = keep.size();
+    vector<int> keep_index(nseqs, -1);
+    for (int j=0; j<nkeep; j++)
+        keep_index[keep[j]] = j;
+
+    // find the first site of the region
+    int first = 0;
+    if (version >= 2) {
+        int lo = 0, hi = nsites;
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            int position;
+            memcpy(&position, positions + long(mid) * sizeof(int),
+                   sizeof(int));
+            if (position < sites->start_coord)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        first = lo;
+    }
+
+    // keep the sites within the region
+    int last = -1;
+    for (int i=first; i<nsites; i++) {
+        int position;
+        memcpy(&position, positions + long(i) * sizeof(int), sizeof(int));
+        if (position < sites->start_coord)
+            continue;
+        if (position >= sites->end_coord) {
+            if (version >= 2)
+                break;
+            continue;
+        }
+        if (position <= last) {
+            if (!quiet) printError("binary sites are not sorted");
+            return false;
+        }
+        last = position;
+
+        char *col = new char [nkeep + 1];
+        col[nkeep] = '\0';
+        if (version >= 2) {
+            int64_t offset[2];
+            memcpy(offset, offsets + long(i) * sizeof(int64_t),
+                   2 * sizeof(int64_t));
+            if (offset[0] < 0 || offset[1] < offset[0] ||
+                offset[1] > end - columns ||
+                !decode_site_column(columns + offset[0], columns + offset[1],
+                                    nseqs, keep, keep_index, col)) {
+                if (!quiet) printError("bad binary sites column (site %d)",
+                                       position + 1);
+                delete [] col;
+                return false;
+            }
+        } else {
+            for (int j=0; j<nkeep; j++)
+                col[j] = bases[long(i) * nseqs + keep[j]];
+        }
+        if (!validate_site_column(col, nkeep)) {
+            if (!quiet) printError("invalid sequence characters (site %d)",
+                                   position + 1);
+            delete [] col;
+            return false;
+        }
+
+        vector<BaseProbs> bp;
+        bool variant = !names_to_keep;
+        if (have_base_probs) {
+            bp.resize(nkeep);
+            for (int j=0; j<nkeep; j++) {
+                memcpy(bp[j].prob, probs + (long(i) * nseqs + keep[j]) *
+                       4 * sizeof(double), 4 * sizeof(double));
+                if (!bp[j].is_certain())
+                    variant = true;
+            }
+        }
+        for (int j=0; j<nkeep && !variant; j++)
+            if (col[j] == 'N' || col[j] != col[0])
+                variant = true;
+        if (!variant) {
+            delete [] col;
+            continue;
+        }
+        sites->append(position, col);
+        if (have_base_probs)
+            sites->base_probs.push_back(bp);
+    }
+    if (names_to_keep)
+        printLog(LOG_LOW, "subset sites (nseqs=%i, nsites=%i)\n",
+                 (int) sites->names.size(), (int) sites->positions.size());
+    return true;
+}
+
+
+//=============================================================================
+// sites text format
+
+// Parses a sites file held in memory.  Lines are parsed in place without
+// splitting them into strings.
+static bool read_sites_text(const char *data, size_t size, Sites *sites,
+                            int subregion_start, int subregion_end,
+                            bool quiet)
 {
     const char *delim = "\t";
-    char *line;
     int nseqs = 0;
 
-    sites->clear();
-    bool error = false;
     bool have_base_probs=false;
 
     // parse lines
     int lineno = 0;
     bool isHeader=false;
     char *line0;
-
-    while (!error && (line = fgetline(infile))) {
-        chomp(line);
+    vector<char> buf;
+    const char *p = data;
+    const char *data_end = data + size;
+
+    while (p < data_end) {
+        // copy the next line without its newline
+        const char *eol = (const char*) memchr(p, '\n', data_end - p);
+        const char *next = eol ? eol + 1 : data_end;
+        if (!eol)
+            eol = data_end;
+        else if (eol > p && eol[-1] == '\r')
+            eol--;
+        buf.assign(p, eol);
+        buf.push_back('\0');
+        char *line = &buf[0];
+        p = next;
         lineno++;
+
         if (line[0] == '#') {
             isHeader=true;
             unsigned int i=1;
-            for (; i < strlen(line); i++)
+            for (; line[i]; i++)
                 if (!(line[i] == '#' || isspace(line[i]))) break;
             line0 = &line[i];
         } else {
@@ -218,7 +624,6 @@ bool read_sites(FILE *infile, Sites *sites,
                         printError(
                            "name for sequence %d is zero length (line %d)",
                            i + 1, lineno);
-                    delete [] line;
                     return false;
                 }
             }
@@ -230,7 +635,6 @@ bool read_sites(FILE *infile, Sites *sites,
                        chrom,
                        &sites->start_coord, &sites->end_coord) != 3) {
                 if (!quiet) printError("bad REGION format");
-                delete [] line;
                 return false;
             }
             sites->chrom = chrom;
@@ -247,13 +651,11 @@ bool read_sites(FILE *infile, Sites *sites,
             // parse RANGE line
             if (!quiet)
                 printError("deprecated RANGE line detected (use REGION instead)");
-            delete [] line;
             return false;
         } else if (strncmp(line0, "POPS\t", 5) == 0) {
             if (nseqs == 0) {
                 if (!quiet)
                     printError("NAMES line should come before POP line");
-                delete [] line;
                 return false;
             }
             vector<string> popstr;
@@ -261,7 +663,6 @@ bool read_sites(FILE *infile, Sites *sites,
             if ((int)popstr.size() != nseqs) {
                 if (!quiet)
                     printError("number of entries in POPS line should match entries in NAMES line");
-                delete [] line;
                 return false;
             }
             for (int i=0; i < nseqs; i++)
@@ -269,31 +670,36 @@ bool read_sites(FILE *infile, Sites *sites,
 
         } else if (isHeader) {
             // no known tag; treat as comment
+        } else if (line[0] == '\0') {
+            // skip blank lines
         } else {
-            // parse a site line
-            vector<string> fields;
-            split(line, "\t", fields);
-            assert(fields.size() >= 2);
+            // parse a site line: position, bases and optional base probs
+            char *col = strchr(line, '\t');
+            if (!col) {
+                if (!quiet)
+                    printError("Error parsing line %d of sites file\n",
+                               lineno);
+                return false;
+            }
+            *col++ = '\0';
 
             // parse site
             int position;
-            if (sscanf(fields[0].c_str(), "%d", &position) != 1) {
+            if (sscanf(line, "%d", &position) != 1) {
                 if (!quiet)
                     printError("first column is not an integer (line %d)", lineno);
-                delete [] line;
                 return false;
             }
 
             // skip site if not in region
             position--; //convert to 0-index
-            if (position < sites->start_coord || position >= sites->end_coord) {
-                delete [] line;
+            if (position < sites->start_coord || position >= sites->end_coord)
                 continue;
-            }
 
             // parse bases
-            char col[fields[1].length()+1];
-            strcpy(col, fields[1].c_str());
+            char *probs = strchr(col, '\t');
+            if (probs)
+                *probs++ = '\0';
             unsigned int len = strlen(col);
             if (len != (unsigned int) nseqs) {
                 if (!quiet)
@@ -301,15 +707,13 @@ bool read_sites(FILE *infile, Sites *sites,
                       "the number bases given, %d, does not match the "
                       "number of sequences %d (line %d)",
                       len, nseqs, lineno);
-                delete [] line;
                 return false;
             }
             if (!validate_site_column(col, nseqs)) {
                 if (!quiet) {
                     printError("invalid sequence characters (line %d)", lineno);
-                    printError("%s\n", line);
+                    printError("%s\n", col);
                 }
-                delete [] line;
                 return false;
             }
 
@@ -321,7 +725,6 @@ bool read_sites(FILE *infile, Sites *sites,
                                sites->positions[npos-1], position, lineno);
                     printError("sites must be sorted and unique.");
                 }
-                delete [] line;
                 return false;
             }
 
@@ -329,7 +732,7 @@ bool read_sites(FILE *infile, Sites *sites,
             sites->append(position, col, true);
 
 
-            if (fields.size() == 2) {
+            if (!probs) {
                 if (npos == 0) {
                     have_base_probs = false;
                 } else if (have_base_probs) {
@@ -337,7 +740,6 @@ bool read_sites(FILE *infile, Sites *sites,
                         printError("Error parsing line %d of sites file\n",
                                    lineno);
                     }
-                    delete [] line;
                     return false;
                 }
             } else {
@@ -348,41 +750,81 @@ bool read_sites(FILE *infile, Sites *sites,
                         printError("Error parsing line %d of sites file\n",
                                    lineno);
                     }
-                    delete [] line;
                     return false;
                 }
-                if ((int)fields.size() != 4*nseqs + 2) {
+
+                // one field per base of each sequence
+                int nfields = 1;
+                for (const char *c=probs; *c; c++)
+                    nfields += (*c == '\t');
+                if (nfields != 4*nseqs) {
                     if (!quiet) {
                         printError("Error parsing base probs on line %i of sites file\n",
                                    lineno);
                     }
-                    delete [] line;
                     return false;
                 }
-                vector<BaseProbs> bp_vec;
-                bp_vec.clear();
-                int pos=2;
+                vector<BaseProbs> bp_vec(nseqs);
+                char *field = probs;
                 for (int i=0; i < nseqs; i++) {
-                    BaseProbs bp;
-                    for (int j=0; j < 4; j++)
-                        sscanf(fields[pos++].c_str(), "%lf", &bp.prob[j]);
-                    bp_vec.push_back(bp);
+                    for (int j=0; j < 4; j++) {
+                        bp_vec[i].prob[j] = strtod(field, NULL);
+                        field += strcspn(field, "\t") + 1;
+                    }
                 }
                 sites->base_probs.push_back(bp_vec);
             }
-
         }
-
-        delete [] line;
     }
 
     return true;
 }
 
 
-// Read a Sites alignment file
-bool read_sites(const char *filename, Sites *sites,
+// Parses a sites file in the text or binary format held in memory,
+// keeping the sequences 'names_to_keep' if it is not NULL
+static bool read_sites_buffer(const char *data, size_t size, Sites *sites,
+                              int subregion_start, int subregion_end,
+                              bool quiet,
+                              const set<string> *names_to_keep=NULL)
+{
+    sites->clear();
+    if (size >= 4 && memcmp(data, BINARY_SITES_MAGIC, 4) == 0)
+        return read_sites_binary(data, size, sites, subregion_start,
+                                 subregion_end, quiet, names_to_keep);
+    if (!read_sites_text(data, size, sites, subregion_start,
+                         subregion_end, quiet))
+        return false;
+    return !names_to_keep || sites->subset(*names_to_keep) == 0;
+}
+
+
+// Reads the rest of a stream into 'data'
+static void read_stream_data(FILE *infile, string *data)
+{
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), infile)) > 0)
+        data->append(buf, n);
+}
+
+
+// Read a Sites stream
+bool read_sites(FILE *infile, Sites *sites,
                 int subregion_start, int subregion_end, bool quiet)
+{
+    string data;
+    read_stream_data(infile, &data);
+    return read_sites_buffer(data.data(), data.size(), sites,
+                             subregion_start, subregion_end, quiet);
+}
+
+
+// Reads a sites file, keeping the sequences 'names_to_keep' if it is not
+// NULL.  Uncompressed files are mapped into memory and parsed in place.
+static bool read_sites_file(const char *filename, Sites *sites,
+                            int subregion_start, int subregion_end,
+                            bool quiet, const set<string> *names_to_keep)
 {
     CompressStream stream(filename);
     if (stream.stream == NULL) {
@@ -391,7 +833,46 @@ bool read_sites(const char *filename, Sites *sites,
         return false;
     }
 
-    return read_sites(stream.stream, sites, subregion_start, subregion_end, quiet);
+    if (!stream.compress) {
+        struct stat st;
+        const int fd = fileno(stream.stream);
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                              fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+                bool result = read_sites_buffer(
+                    (const char*) data, st.st_size, sites,
+                    subregion_start, subregion_end, quiet, names_to_keep);
+                munmap(data, st.st_size);
+                return result;
+            }
+        }
+    }
+
+    string data;
+    read_stream_data(stream.stream, &data);
+    return read_sites_buffer(data.data(), data.size(), sites,
+                             subregion_start, subregion_end, quiet,
+                             names_to_keep);
+}
+
+
+// Read a Sites alignment file
+bool read_sites(const char *filename, Sites *sites,
+                int subregion_start, int subregion_end, bool quiet)
+{
+    return read_sites_file(filename, sites, subregion_start, subregion_end,
+                           quiet, NULL);
+}
+
+
+bool read_sites_subset(const char *filename, Sites *sites,
+                       const set<string> &names_to_keep,
+                       int subregion_start, int subregion_end, bool quiet)
+{
+    return read_sites_file(filename, sites, subregion_start, subregion_end,
+                           quiet, &names_to_keep);
 }
 
 
@@ -423,54 +904,63 @@ public:
 };
 
 
-bool read_vcf(FILE *infile, Sites *sites, double min_qual,
-              const char *genotype_filter, bool parse_genotype_probs,
-              double min_base_prob, bool add_ref, const set<string> keep_inds) {
-    const char *delim = "\t";
-    char *line=NULL;
-    int nseqs = 0, nsample=0;
-    bool error = false;
-    const char *headerStart = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t";
-    string chrname = "";
-    vector<GenoFilter> gf;
-    int num_masked=0, total=0;
-    int numIndel=0;
-    static bool warnRefLen=false;
-    static bool warnProbs=false;
-    vector<bool> keep_ind;
-    vector<string> sample_names;
-    vector<int> ploidy;
-    ploidy.clear();
-
-    if (genotype_filter != NULL && strlen(genotype_filter) > 0) {
-        vector<string> tmp;
-        split(genotype_filter, ";", tmp);
-        for (int i=0; i < (int)tmp.size(); i++) {
-            gf.push_back(GenoFilter(tmp[i].c_str()));
-        }
-    }
+// warnings printed once per process
+static atomic<bool> warnRefLen(false);
+static atomic<bool> warnProbs(false);
+static atomic<bool> badAlleleWarn(false);
 
-    // note that this does not affect chrom, start_coord, end_coord
-    sites->clear();
 
-    int lineno = 1;
-    while (!error) {
-        if (line != NULL) delete [] line;
-        line = fgetline(infile);
-        if (line == NULL) break;
-        chomp(line);
-        lineno++;
-        if (strncmp(line, "##", 2) == 0) {
-            continue;
-        }
+// Parses the records of a VCF file.  Once the header and the first record
+// have given the samples and their ploidy, records are independent of one
+// another, so batches of records are parsed in parallel, each by its own
+// copy of the parser.
+class VcfParser
+{
+public:
+    VcfParser(double min_qual, const char *genotype_filter,
+              bool parse_genotype_probs, double min_base_prob, bool add_ref,
+              const set<string> &keep_inds) :
+        min_qual(min_qual),
+        parse_genotype_probs(parse_genotype_probs),
+        min_base_prob(min_base_prob),
+        add_ref(add_ref),
+        keep_inds(keep_inds),
+        nseqs(0),
+        nsample(0),
+        num_masked(0),
+        total(0),
+        numIndel(0)
+    {
+        if (genotype_filter != NULL && strlen(genotype_filter) > 0) {
+            vector<string> tmp;
+            split(genotype_filter, ";", tmp);
+            for (int i=0; i < (int)tmp.size(); i++) {
+                gf.push_back(GenoFilter(tmp[i].c_str()));
+            }
+        }
+    }
+
+    // true once the samples of the file are known
+    bool has_samples() const {
+        return ploidy.size() > 0;
+    }
+
+    // Parses a header line
+    void parse_header(const char *line)
+    {
+        const char *headerStart = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t";
         if (strncmp(line, headerStart, strlen(headerStart)) == 0) {
-            split(&line[strlen(headerStart)], delim, sample_names);
+            split(&line[strlen(headerStart)], "\t", sample_names);
             nsample = (int)sample_names.size();
-            continue;
         }
+    }
 
+    // Parses a record and appends its site, if any, to 'sites'.  Returns
+    // false on error.
+    bool parse_record(const char *line, int lineno, Sites *sites)
+    {
         vector<string> fields;
-        split(line, delim, fields);
+        split(line, "\t", fields);
         if ((int)fields.size() != 9 + nsample) {
             printError("Not enough fields in line %i of VCF file", lineno);
             return false;
@@ -491,43 +981,36 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
         char alleles[5];  // alleles can only be A,C,G,T,N
         int num_alleles=1;
         if (fields[3].length() != 1) {
-            if (!warnRefLen) {
+            if (!warnRefLen.exchange(true)) {
                 printWarning("Reference allele is not length one on line %i of VCF... skipping this and future similar lines",
                              lineno);
-                warnRefLen=true;
             }
             numIndel++;
-            continue;
+            return true;
         }
         alleles[0] = fields[3].c_str()[0];
         vector<string> alt;
         split(fields[4].c_str(), ",", alt);
-        static bool badAlleleWarn=false;
         if (alt.size() > 4) {
-            if (!badAlleleWarn) {
+            if (!badAlleleWarn.exchange(true)) {
                 printError("length of ALT allele should not be more than 4 on line %i of VCF\n",
                            lineno);
-                badAlleleWarn=true;
             }
-            continue;
+            return true;
         }
-        bool badAllele=false;
         for (int i=0; i < (int)alt.size(); i++) {
             if (alt[i].length() != 1) {
-                if (!badAlleleWarn) {
+                if (!badAlleleWarn.exchange(true)) {
                     printWarning("ReadVCF can only handle alleles A,C,G,T,N currently;"
                                  " got allele %s on line %i; skipping this line and"
                                  " other similar ones",
                                alt[i].c_str(), lineno);
-                    badAlleleWarn=true;
                 }
-                badAllele=true;
                 numIndel++;
-                break;
+                return true;
             }
             alleles[num_alleles++] = alt[i].c_str()[0];
         }
-        if (badAllele) continue;
         // next: parse FORMAT in fields[8] and figure out where to find
         // GT
         vector<string> format;
@@ -609,7 +1092,7 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
                 sites->names.push_back("REF");
                 nseqs++;
             }
-            printf("nseqs = %i\n", nseqs - add_ref);
+            printLog(LOG_MEDIUM, "nseqs = %i\n", nseqs - add_ref);
             // otherwise this line contains a variant
         }
         if (nseqs - add_ref  <= 0) {
@@ -660,10 +1143,9 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
             }
             if (parse_genotype_probs && pl_idx == -1 &&
                 gl_idx == -1 && pp_idx == -1) {
-                if (!warnProbs) {
+                if (!warnProbs.exchange(true)) {
                     printWarning("Did not find PL, GL, or PP in format field in VCF file line %i",
                                  lineno);
-                    warnProbs=true;
                 }
             }
             gtstr = seqfields[gt_idx];
@@ -728,12 +1210,136 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
         sites->append(position, col, true);
         if (parse_genotype_probs)
             sites->base_probs.push_back(base_probs);
+        return true;
+    }
+
+    // Parses a batch of records in parallel, appending their sites to
+    // 'sites' in order
+    bool parse_records(const vector<char*> &lines, int first_lineno,
+                       Sites *sites, ThreadPool *pool)
+    {
+        const int nlines = lines.size();
+        const int ntasks = min(nlines, pool->get_num_threads());
+        vector<VcfParser> parsers(ntasks, *this);
+        vector<Sites> batches(ntasks);
+        vector<char> ok(ntasks, true);
+        for (int i=0; i<ntasks; i++) {
+            parsers[i].num_masked = parsers[i].total = parsers[i].numIndel = 0;
+            batches[i].names = sites->names;
+        }
+
+        pool->run(ntasks, [&](int task) {
+                const int start = long(nlines) * task / ntasks;
+                const int end = long(nlines) * (task + 1) / ntasks;
+                for (int i=start; i<end && ok[task]; i++)
+                    ok[task] = parsers[task].parse_record(
+                        lines[i], first_lineno + i, &batches[task]);
+            });
+
+        bool result = true;
+        for (int i=0; i<ntasks; i++) {
+            num_masked += parsers[i].num_masked;
+            total += parsers[i].total;
+            numIndel += parsers[i].numIndel;
+            result = result && ok[i];
+
+            // move the columns of the batch into 'sites'
+            Sites &batch = batches[i];
+            sites->positions.insert(sites->positions.end(),
+                                    batch.positions.begin(),
+                                    batch.positions.end());
+            sites->cols.insert(sites->cols.end(),
+                               batch.cols.begin(), batch.cols.end());
+            sites->base_probs.insert(sites->base_probs.end(),
+                                     batch.base_probs.begin(),
+                                     batch.base_probs.end());
+            batch.cols.clear();
+        }
+        return result;
+    }
+
+    double min_qual;
+    bool parse_genotype_probs;
+    double min_base_prob;
+    bool add_ref;
+    set<string> keep_inds;
+    vector<GenoFilter> gf;
+
+    // samples of the file
+    string chrname;
+    int nseqs;
+    int nsample;
+    vector<bool> keep_ind;
+    vector<string> sample_names;
+    vector<int> ploidy;
+
+    // counts for the log
+    int num_masked;
+    int total;
+    int numIndel;
+};
+
+
+bool read_vcf(FILE *infile, Sites *sites, double min_qual,
+              const char *genotype_filter, bool parse_genotype_probs,
+              double min_base_prob, bool add_ref, const set<string> keep_inds,
+              int nthreads) {
+    // records are parsed in batches of this many lines per thread
+    const int BATCH_LINES = 1000;
+
+    VcfParser parser(min_qual, genotype_filter, parse_genotype_probs,
+                     min_base_prob, add_ref, keep_inds);
+    ThreadPool *pool = get_thread_pool(nthreads);
+    vector<char*> batch;
+    int batch_lineno = 0;
+    bool error = false;
+
+    // note that this does not affect chrom, start_coord, end_coord
+    sites->clear();
+
+    int lineno = 1;
+    while (!error) {
+        char *line = fgetline(infile);
+        if (line != NULL) {
+            chomp(line);
+            lineno++;
+        }
+
+        // header lines and the first record are parsed on their own
+        if (line == NULL || line[0] == '#' || !parser.has_samples() ||
+            (int) batch.size() == BATCH_LINES * nthreads) {
+            if (batch.size() > 0 &&
+                !parser.parse_records(batch, batch_lineno, sites, pool))
+                error = true;
+            for (unsigned int i=0; i<batch.size(); i++)
+                delete [] batch[i];
+            batch.clear();
+        }
+        if (line == NULL || error) {
+            delete [] line;
+            break;
+        }
+
+        if (line[0] == '#') {
+            parser.parse_header(line);
+        } else if (!pool || !parser.has_samples()) {
+            if (!parser.parse_record(line, lineno, sites))
+                error = true;
+        } else {
+            if (batch.size() == 0)
+                batch_lineno = lineno;
+            batch.push_back(line);
+            continue;
+        }
+        delete [] line;
     }
+    if (error)
+        return false;
 
     printLog(LOG_LOW, "Read %i sites from %i lines of VCF file (num skipped indels=%i)\n",
-             sites->get_num_sites(), lineno, numIndel);
-    if (gf.size() > 0) printLog(LOG_LOW, "Masked %.1f out of %i genotypes\n",
-                                (double)num_masked/2, total);
+             sites->get_num_sites(), lineno, parser.numIndel);
+    if (parser.gf.size() > 0) printLog(LOG_LOW, "Masked %.1f out of %i genotypes\n",
+                                (double)parser.num_masked/2, parser.total);
     return true;
 }
 
@@ -741,7 +1347,8 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
 bool read_vcf(const char *filename, Sites *sites, const char *region,
               double min_qual, const char *genotype_filter,
               bool parse_genotype_probs, double min_base_prob, bool add_ref,
-              const char *tabixdir, const set<string> keep_inds) {
+              const char *tabixdir, const set<string> keep_inds,
+              int nthreads) {
     TabixStream ts(filename, region, tabixdir);
     char chr[10000];
     int start_coord, end_coord;
@@ -768,7 +1375,8 @@ bool read_vcf(const char *filename, Sites *sites, const char *region,
     sites->end_coord = end_coord;
     sites->chrom = string(chr);
     if ( ! read_vcf(ts.stream, sites, min_qual, genotype_filter,
-                    parse_genotype_probs, min_base_prob, add_ref, keep_inds))
+                    parse_genotype_probs, min_base_prob, add_ref, keep_inds,
+                    nthreads))
         return false;
     return true;
 }
@@ -776,32 +1384,76 @@ bool read_vcf(const char *filename, Sites *sites, const char *region,
 bool read_vcf(const string filename, Sites *sites, const string region,
               double min_qual, const string genotype_filter,
               bool parse_genotype_probs, double min_base_prob, bool add_ref,
-              const string tabixdir, const set<string> keep_inds) {
+              const string tabixdir, const set<string> keep_inds,
+              int nthreads) {
     return read_vcf(filename.c_str(), sites, region.c_str(),
                     min_qual, genotype_filter.c_str(), parse_genotype_probs,
-                    min_base_prob, add_ref, tabixdir.c_str(), keep_inds);
+                    min_base_prob, add_ref, tabixdir.c_str(), keep_inds,
+                    nthreads);
 }
 
+// Reads several VCF files, each holding a subset of the samples.  With
+// several threads the files are read in parallel and then merged pairwise,
+// which gives the same sites as merging them one at a time in order.
 bool read_vcfs(const vector<string> filenames, Sites* sites, const string region,
                double min_qual, const string genotype_filter,
                bool parse_genotype_probs, double min_base_prob,
-               const string tabixdir, const set<string> keep_inds) {
-    if (filenames.size() == 0) {
+               const string tabixdir, const set<string> keep_inds,
+               int nthreads) {
+    const int nfiles = filenames.size();
+    if (nfiles == 0) {
         fprintf(stderr, "Read_vcfs expects at least one filename\n");
         return false;
     }
-    if (!read_vcf(filenames[0], sites, region, min_qual,
-                  genotype_filter, parse_genotype_probs, min_base_prob,
-                  true, tabixdir, keep_inds))
-        return false;
-    for (int i=1; i < (int)filenames.size(); i++) {
-        Sites s;
-        if (!read_vcf(filenames[i], &s, region, min_qual,
-                      genotype_filter, parse_genotype_probs, min_base_prob,
-                      true, tabixdir, keep_inds))
+    // a single file is parsed with all threads instead
+    ThreadPool *pool = (nfiles > 1 ? get_thread_pool(nthreads) : NULL);
+
+    vector<Sites> file_sites(nfiles);
+    vector<char> ok(nfiles, true);
+    auto read_file = [&](int i) {
+        ok[i] = read_vcf(filenames[i], &file_sites[i], region, min_qual,
+                         genotype_filter, parse_genotype_probs, min_base_prob,
+                         true, tabixdir, keep_inds, pool ? 1 : nthreads);
+    };
+    if (pool)
+        pool->run(nfiles, read_file);
+    else
+        for (int i=0; i<nfiles; i++)
+            read_file(i);
+    for (int i=0; i<nfiles; i++)
+        if (!ok[i])
             return false;
-        if (!sites->merge(s)) return false;
+
+    // merge neighbouring files until one remains
+    for (int step=1; step < nfiles; step *= 2) {
+        const int nmerges = (nfiles + 2*step - 1) / (2*step);
+        auto merge_files = [&](int k) {
+            const int i = 2*k*step;
+            if (i + step < nfiles) {
+                ok[i] = file_sites[i].merge(file_sites[i + step]);
+                file_sites[i + step].clear();
+            }
+        };
+        if (pool && nmerges > 1)
+            pool->run(nmerges, merge_files);
+        else
+            for (int k=0; k<nmerges; k++)
+                merge_files(k);
+        for (int k=0; k<nmerges; k++)
+            if (!ok[2*k*step])
+                return false;
     }
+    Sites &merged = file_sites[0];
+    sites->clear();
+    sites->chrom = merged.chrom;
+    sites->start_coord = merged.start_coord;
+    sites->end_coord = merged.end_coord;
+    sites->names.swap(merged.names);
+    sites->pops.swap(merged.pops);
+    sites->positions.swap(merged.positions);
+    sites->cols.swap(merged.cols);
+    sites->base_probs.swap(merged.base_probs);
+
     // need to remove REF
     vector<int> keep;
     for (int i=0; i < sites->get_num_seqs(); i++) {
@@ -990,34 +1642,8 @@ int Sites::subset(vector<int> keep) {
 
 int Sites::subset(set<string> names_to_keep) {
     vector<int> keep;
-    for (unsigned int i=0; i < names.size(); i++) {
-        if (names_to_keep.find(names[i]) != names_to_keep.end())
-            keep.push_back(i);
-    }
-    if (keep.size() > 0) {
-        if (keep.size() != names_to_keep.size()) {
-            fprintf(stderr, "Error in subset: not all names found in sites\n");
-            return 1;
-        }
-        return subset(keep);
-    }
-
-    // if nothing found, these may be individual names rather than haploid
-    // names
-    set<string> hapkeep;
-    for (set<string>::iterator it=names_to_keep.begin();
-         it != names_to_keep.end(); it++) {
-        hapkeep.insert((*it) + string("_1"));
-        hapkeep.insert((*it) + string("_2"));
-    }
-    for (unsigned int i=0; i < names.size(); i++) {
-        if (hapkeep.find(names[i]) != hapkeep.end())
-            keep.push_back(i);
-    }
-    if (keep.size() != hapkeep.size()) {
-        fprintf(stderr, "Error in subset: not all names found in sites\n");
+    if (!find_subset_seqs(names, names_to_keep, &keep))
         return 1;
-    }
     return subset(keep);
 }
 
@@ -1380,23 +2006,15 @@ void apply_mask_sites(Sites *sites,
     for (int j=0; j < num_mask; j++)
         (*ind_masks)[maskind[j]].merge_tracks(mask);
 
-    unsigned int last_pos=0;
-    int last_mask_pos=0;
     for (unsigned int k=0; k<mask.size(); k++) {
-        if (mask[k].start < last_mask_pos) last_pos=0;
-        for (int i=mask[k].start; i<mask[k].end; i++) {
-            while (last_pos < sites->positions.size() &&
-                   sites->positions[last_pos] < i)
-                last_pos++;
-            if (last_pos != sites->positions.size() &&
-                sites->positions[last_pos] == i) {
-                for (int j=0; j < num_mask; j++) {
-                    sites->cols[last_pos][maskind[j]] = maskchar;
-                    if (have_base_probs)
-                        sites->base_probs[last_pos][maskind[j]].set_mask();
-                }
+        int first, last;
+        sites->get_site_range(mask[k].start, mask[k].end, &first, &last);
+        for (int i=first; i<last; i++) {
+            for (int j=0; j < num_mask; j++) {
+                sites->cols[i][maskind[j]] = maskchar;
+                if (have_base_probs)
+                    sites->base_probs[i][maskind[j]].set_mask();
             }
-            last_mask_pos = i;
         }
     }
 }
@@ -1445,6 +2063,32 @@ void make_sites_from_sequences(const Sequences *sequences, Sites *sites)
 }
 
 
+void Sequences::copy(const Sequences &other)
+{
+    clear();
+    seqlen = other.seqlen;
+    for (unsigned int i=0; i<other.seqs.size(); i++) {
+        char *seq = new char [seqlen + 1];
+        memcpy(seq, other.seqs[i], seqlen);
+        seq[seqlen] = '\0';
+        seqs.push_back(seq);
+    }
+    owned = true;
+    add_memory(long(seqs.size()) * (seqlen + 1));
+    names = other.names;
+    pops = other.pops;
+    pairs = other.pairs;
+    non_singleton_snp = other.non_singleton_snp;
+    ages = other.ages;
+    real_ages = other.real_ages;
+    base_probs = other.base_probs;
+    for (unsigned int i=0; i<base_probs.size(); i++)
+        add_memory(base_probs[i].size() * sizeof(BaseProbs));
+    if (other.packed)
+        pack();
+}
+
+
 bool Sequences::get_non_singleton_snp(vector<bool> &nonsing) {
     if (seqs.size() == 0) return false;
     for (int i=0; i < seqlen; i++) {
@@ -1608,7 +2252,7 @@ void PhaseProbs::sample_phase(int *thread_path) {
     for (map<int,vector<double> >::iterator it=probs.begin(); it != probs.end();
        it++) {
         int coord = it->first;
-        vector<double> prob = it->second;
+        const vector<double> &prob = it->second;
         if (seqs->seqs[hap1][coord] != seqs->seqs[hap2][coord] ||
             (have_base_probs &&
              !seqs->base_probs[hap1][coord].is_equal(seqs->base_probs[hap2][coord]))) {
@@ -1743,6 +2387,23 @@ void Sequences::set_age(string agefile, int ntimes, const double *times) {
     fclose(infile);
 }
 
+// Set the original coordinates of each compressed site from the midpoints
+// between the original positions of neighbouring sites
+static void set_compressed_site_bounds(SitesMapping *sites_mapping)
+{
+    sites_mapping->all_sites_start.clear();
+    sites_mapping->all_sites_end.clear();
+    sites_mapping->all_sites_start.push_back(sites_mapping->old_start);
+    for (unsigned int i=0; i < sites_mapping->all_sites.size()-1; i++) {
+        int pos = ( sites_mapping->all_sites[i] +
+                    sites_mapping->all_sites[i+1] ) / 2;
+        sites_mapping->all_sites_end.push_back(pos);
+        sites_mapping->all_sites_start.push_back(pos+1);
+    }
+    sites_mapping->all_sites_end.push_back(sites_mapping->old_end);
+}
+
+
 // Compress the sites by a factor of 'compress'.
 //
 // Return true if compression is successful.
@@ -1830,17 +2491,124 @@ bool find_compress_cols(const Sites *sites, int compress,
     else
         sites_mapping->new_end = new_end;
 
-    sites_mapping->all_sites_start.clear();
-    sites_mapping->all_sites_end.clear();
-    sites_mapping->all_sites_start.push_back(sites_mapping->old_start);
-    for (unsigned int i=0; i < sites_mapping->all_sites.size()-1; i++) {
-        int pos = ( sites_mapping->all_sites[i] +
-                    sites_mapping->all_sites[i+1] ) / 2;
-        sites_mapping->all_sites_end.push_back(pos);
-        sites_mapping->all_sites_start.push_back(pos+1);
+    set_compressed_site_bounds(sites_mapping);
+    return true;
+}
+
+
+// Compress the sites with a factor chosen for each segment of the region
+// from its density of variant sites.
+//
+// The region is divided into segments of ADAPTIVE_SEGMENT_BLOCKS *
+// max_compress sites.  A segment with v unmasked variant sites is
+// compressed by compress * d * len / v, where d is the density of variant
+// sites over the unmasked sites of the region, bounded to [compress,
+// max_compress].  Segments at least as dense as the region average keep
+// the resolution of --compress-seq, while sparse and masked segments,
+// which carry little information, are compressed up to max_compress.  As
+// with find_compress_cols(), every variant column is kept and the
+// original sites of each compressed site are contiguous.
+//
+// Return true if compression is successful.
+bool find_compress_cols_adaptive(const Sites *sites, int compress,
+                                 int max_compress,
+                                 const TrackNullValue &maskmap,
+                                 SitesMapping *sites_mapping)
+{
+    const int ncols = sites->get_num_sites();
+    const int start = sites->start_coord;
+    const int seglen = ADAPTIVE_SEGMENT_BLOCKS * max_compress;
+    const int nsegs = max((sites->end_coord - start + seglen - 1) / seglen, 1);
+
+    // count unmasked sites and variant sites of each segment
+    vector<int> unmasked(nsegs, seglen), nvariants(nsegs, 0);
+    unmasked[nsegs-1] = sites->end_coord - start - (nsegs - 1) * seglen;
+    for (unsigned int i=0; i<maskmap.size(); i++) {
+        const int mask_start = max(maskmap[i].start, start);
+        const int mask_end = min(maskmap[i].end, sites->end_coord);
+        for (int pos=mask_start; pos<mask_end;) {
+            const int seg = (pos - start) / seglen;
+            const int end = min(mask_end, start + (seg + 1) * seglen);
+            unmasked[seg] -= end - pos;
+            pos = end;
+        }
     }
-    sites_mapping->all_sites_end.push_back(sites_mapping->old_end);
+    for (int i=0; i<ncols; i++)
+        nvariants[(sites->positions[i] - start) / seglen]++;
+
+    long total_unmasked = 0;
+    for (int i=0; i<nsegs; i++)
+        total_unmasked += max(unmasked[i], 0);
+    const double density = double(ncols) / max(total_unmasked, 1L);
+
+    vector<int> factors(nsegs, max_compress);
+    for (int i=0; i<nsegs; i++) {
+        if (nvariants[i] > 0 && unmasked[i] > 0) {
+            const double factor = compress * density * seglen / nvariants[i];
+            factors[i] = max(compress, min(max_compress, int(factor)));
+        }
+    }
+
+    // record old coords
+    sites_mapping->init(sites);
+    sites_mapping->all_sites.clear();
+    sites_mapping->site_compress.clear();
+    sites_mapping->old_sites.clear();
+    sites_mapping->new_sites.clear();
+
+    // lay out blocks, each with the factor of the segment it starts in
+    int blocki = 0;
+    int block_start = start;
+    int factor = factors[0];
+    for (int i=0; i<ncols; i++) {
+        int col = sites->positions[i];
+
+        // find next block with variant site
+        while (col >= block_start + factor) {
+            sites_mapping->all_sites.push_back(
+                block_start + factor - factor / 2);
+            sites_mapping->site_compress.push_back(factor);
+            block_start += factor;
+            factor = factors[min((block_start - start) / seglen, nsegs - 1)];
+            blocki++;
+        }
+
+        // record variant site
+        sites_mapping->old_sites.push_back(col);
+        sites_mapping->new_sites.push_back(blocki);
+        sites_mapping->all_sites.push_back(col);
+        sites_mapping->site_compress.push_back(factor);
+        block_start += factor;
+        factor = factors[min((block_start - start) / seglen, nsegs - 1)];
+        blocki++;
+
+        // each original site should be unique
+        const int n = sites_mapping->all_sites.size();
+        if (n > 1)
+            assert(sites_mapping->all_sites[n-1] !=
+                   sites_mapping->all_sites[n-2]);
+
+        // Check whether compression is not possible
+        if (block_start > sites->end_coord && i != (ncols-1))
+            return false;
+    }
+
+    // record non-variants at end of alignment
+    while (sites->end_coord >= block_start + factor ||
+           sites_mapping->all_sites.empty()) {
+        sites_mapping->all_sites.push_back(
+            min(block_start + factor - factor / 2, sites->end_coord - 1));
+        sites_mapping->site_compress.push_back(factor);
+        block_start += factor;
+        factor = factors[min((block_start - start) / seglen, nsegs - 1)];
+        blocki++;
+    }
+
+    // record new coords
+    sites_mapping->new_start = 0;
+    sites_mapping->new_end = blocki;
 
+    set_compressed_site_bounds(sites_mapping);
     return true;
 }
 
@@ -12,6 +12,7 @@
 #define ARGWEAVER_SEQUENCES_H
 
 // c++ includes
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <map>
@@ -20,8 +21,10 @@
 // arghmm includes
 #include "track.h"
 #include "common.h"
+#include "mem.h"
 #include "tabix.h"
 #include "seq.h"
+#include "packed_seqs.h"
 
 namespace argweaver {
 
@@ -182,11 +185,11 @@ class Sequences
 {
 public:
     explicit Sequences(int seqlen=0) :
-        seqlen(seqlen), owned(false)
+        packed(NULL), seqlen(seqlen), owned(false), mem_bytes(0)
     {}
 
     Sequences(char **_seqs, int nseqs, int seqlen) :
-        seqlen(seqlen), owned(false)
+        packed(NULL), seqlen(seqlen), owned(false), mem_bytes(0)
     {
         extend(_seqs, nseqs);
     }
@@ -194,7 +197,7 @@ public:
     // initialize from a subset of another Sequences alignment
     Sequences(const Sequences *sequences, int nseqs=-1, int _seqlen=-1,
               int offset=0) :
-        seqlen(_seqlen), owned(false)
+        packed(NULL), seqlen(_seqlen), owned(false), mem_bytes(0)
     {
         // use same nseqs and/or seqlen by default
         if (nseqs == -1)
@@ -255,6 +258,24 @@ public:
     }
 
 
+    // Builds the bit-packed copy of the alignment used for fast column
+    // queries.  Bases changed with switch_alleles() are kept in sync; other
+    // edits of seqs require calling pack() again.
+    void pack()
+    {
+        if (!packed)
+            packed = new PackedSeqs();
+        add_memory(-packed->get_memory());
+        packed->set(get_seqs(), get_num_seqs(), seqlen);
+        add_memory(packed->get_memory());
+    }
+
+    // Returns the packed alignment or NULL if pack() was not called
+    inline const PackedSeqs *get_packed() const
+    {
+        return packed;
+    }
+
     void set_owned(bool _owned)
     {
         owned = _owned;
@@ -295,6 +316,8 @@ public:
         }
         seqs.push_back(seq);
         if (bp.size() > 0) base_probs.push_back(bp);
+        add_memory((owned ? new_seqlen + 1 : 0) +
+                   bp.size() * sizeof(BaseProbs));
         names.push_back(name);
         pops.push_back(pop);
 	if (pairs.size() > 0) pairs.push_back(-1);
@@ -309,13 +332,19 @@ public:
                 delete [] seqs[i];
         }
         seqs.clear();
+        delete packed;
+        packed = NULL;
         names.clear();
         pops.clear();
         pairs.clear();
         non_singleton_snp.clear();
         base_probs.clear();
+        add_memory(-mem_bytes);
     }
 
+    // Makes this alignment a copy of another one with sequences of its own
+    void copy(const Sequences &other);
+
 
     //set pairs vector assuming that diploids are named XXXX_1 and XXXX_2
     bool set_pairs_by_name();
@@ -374,6 +403,10 @@ public:
       char tmp = seqs[seq1][coord];
       seqs[seq1][coord] = seqs[seq2][coord];
       seqs[seq2][coord] = tmp;
+      if (packed) {
+          packed->set_base(seq1, coord, seqs[seq1][coord]);
+          packed->set_base(seq2, coord, seqs[seq2][coord]);
+      }
       if (base_probs.size() > 0) {
           BaseProbs tmp = base_probs[seq1][coord];
           base_probs[seq1][coord] = base_probs[seq2][coord];
@@ -401,8 +434,17 @@ public:
     vector<vector<BaseProbs> > base_probs;
 
 protected:
+    // accounts bytes held by the alignment, see mem.h
+    void add_memory(long bytes)
+    {
+        mem_bytes += bytes;
+        add_tag_memory(MEM_SEQUENCES, bytes);
+    }
+
+    PackedSeqs *packed;
     int seqlen;
     bool owned;
+    long mem_bytes;  // bytes of owned sequences, base probs and packing
 };
 
 
@@ -425,6 +467,11 @@ class PhaseProbs
       }
    }
 
+  // sets the probabilities of the current phasing of all states at once
+  void add_site(int coord, const double *pr, int nstate) {
+      probs[coord + offset].assign(pr, pr + nstate);
+  }
+
    unsigned int size() {
      return probs.size();
    }
@@ -513,6 +560,22 @@ public:
         return names.size();
     }
 
+    // Returns the index of the first site at or after position 'pos'
+    inline int find_site(int pos) const
+    {
+        return lower_bound(positions.begin(), positions.end(), pos) -
+            positions.begin();
+    }
+
+    // Sets [*first, *last) to the indices of the sites within the
+    // positions [start, end)
+    inline void get_site_range(int start, int end, int *first,
+                               int *last) const
+    {
+        *first = find_site(start);
+        *last = max(*first, find_site(end));
+    }
+
     // note: does not consider base_probs so just returns most likely bases
     bool is_snp(int i) const {
         if (i < 0 || i >= (int)cols.size()) return false;
@@ -576,17 +639,21 @@ public:
     int compress(int pos, int round_dir=0, int start=0) const {
         const int n = all_sites.size();
         if (start < 0) start=0;
-        for (int pos2 = start; pos2<n; pos2++) {
-            if (all_sites_start[pos2] <= pos &&
-                all_sites_end[pos2] >= pos) {
-                if (round_dir == 0) return pos2;
-                if (round_dir < 0) {
-                    if (all_sites_end[pos2] == pos) return pos2;
-                    return pos2-1;
-                } else {
-                    if (all_sites_start[pos2] == pos) return pos2;
-                    return pos2+1;
-                }
+        if (start > n) start=n;
+
+        // the regions of compressed sites are sorted, so the first region
+        // ending at or after pos is the only one that can contain it
+        const int pos2 = lower_bound(all_sites_end.begin() + start,
+                                     all_sites_end.begin() + n, pos) -
+            all_sites_end.begin();
+        if (pos2 < n && all_sites_start[pos2] <= pos) {
+            if (round_dir == 0) return pos2;
+            if (round_dir < 0) {
+                if (all_sites_end[pos2] == pos) return pos2;
+                return pos2-1;
+            } else {
+                if (all_sites_start[pos2] == pos) return pos2;
+                return pos2+1;
             }
         }
         assert(0);
@@ -597,6 +664,24 @@ public:
         return all_sites[pos];
     }
 
+    // returns true if the compression factor varies along the region
+    bool is_adaptive() const {
+        return site_compress.size() > 0;
+    }
+
+    // number of original sites represented by compressed site pos under
+    // adaptive compression
+    int get_site_compress(int pos) const {
+        const int i = min(max(pos - new_start, 0),
+                          int(site_compress.size()) - 1);
+        return site_compress[i];
+    }
+
+    // average number of original sites per compressed site
+    double get_mean_compress() const {
+        return double(old_end - old_start) / max(new_end - new_start, 1);
+    }
+
     int uncompress_start(int pos) const {
         return all_sites_start[pos];
     }
@@ -683,6 +768,9 @@ public:
     vector<int> all_sites; // the original position of each site
     vector<int> all_sites_start;
     vector<int> all_sites_end;
+
+    // compression factor of each compressed site, if adaptive
+    vector<int> site_compress;
 };
 
 
@@ -700,27 +788,42 @@ void resample_align(Sequences *aln, Sequences *aln2);
 
 // sites functions
 void write_sites(FILE *stream, Sites *sites, bool write_masked=false);
+// binary copy of a sites file, which read_sites() detects and loads
+// without parsing.  Columns are stored sparsely and indexed, so regions
+// and subsets of the sequences are read without decoding the rest.
+bool write_sites_binary(FILE *stream, Sites *sites, bool write_masked=false);
 bool read_sites(FILE *infile, Sites *sites,
                 int subregion_start=-1, int subregion_end=-1, bool quiet=false);
 bool read_sites(const char *filename, Sites *sites,
                 int subregion_start=-1, int subregion_end=-1, bool quiet=false);
+// Reads only the sequences of 'names_to_keep' and the sites that vary
+// among them, as Sites::subset() would.  Binary files only decode the
+// bases of these sequences.
+bool read_sites_subset(const char *filename, Sites *sites,
+                       const set<string> &names_to_keep,
+                       int subregion_start=-1, int subregion_end=-1,
+                       bool quiet=false);
 
 bool read_vcf(FILE *infile, Sites *sites, double min_qual,
               const char *genotype_filter,
               bool parse_genotype_probs, double min_base_prob,
-              bool add_ref=false, const set<string> keep_inds=set<string>());
+              bool add_ref=false, const set<string> keep_inds=set<string>(),
+              int nthreads=1);
 bool read_vcf(const char *filename, Sites *sites, const char *region,
               double min_qual, const char *genotype_filter,
               bool parse_genotype_probs, double min_base_prob, bool add_ref=false,
-              const char *tabix_dir=NULL, const set<string> keep_inds=set<string>());
+              const char *tabix_dir=NULL, const set<string> keep_inds=set<string>(),
+              int nthreads=1);
 bool read_vcf(const string filename, Sites *sites, const string region,
               double min_qual, const string genotype_filter,
               bool parse_genotype_probs, double min_base_prob, bool add_ref=false,
-              const string tabix_dir="", set<string> keep_inds=set<string>());
+              const string tabix_dir="", set<string> keep_inds=set<string>(),
+              int nthreads=1);
 bool read_vcfs(const vector<string> filenames, Sites* sites, const string region,
                double min_qual, const string genotype_filter,
                bool parse_genotype_probs, double min_base_prob,
-               const string tabixdir, set<string> keep_inds=set<string>());
+               const string tabixdir, set<string> keep_inds=set<string>(),
+               int nthreads=1);
 void make_sequences_from_sites(const Sites *sites, Sequences *sequencess,
                                char default_char='A');
 void make_sites_from_sequences(const Sequences *sequences, Sites *sites);
@@ -737,8 +840,17 @@ void print_masked_regions(const Sequences &sequences,
 void print_masked_sites_regions(const Sites &sites, string filename);
 
 // sequence compression
+
+// number of blocks of the largest factor in a segment of adaptive
+// compression
+const int ADAPTIVE_SEGMENT_BLOCKS = 100;
+
 bool find_compress_cols(const Sites *sites, int compress,
                         SitesMapping *sites_mapping);
+bool find_compress_cols_adaptive(const Sites *sites, int compress,
+                                 int max_compress,
+                                 const TrackNullValue &maskmap,
+                                 SitesMapping *sites_mapping);
 void compress_sites(Sites *sites, const SitesMapping *sites_mapping);
 void uncompress_sites(Sites *sites, const SitesMapping *sites_mapping);
 
@@ -781,7 +893,25 @@ void compress_track(Track<T> &track, const SitesMapping *sites_mapping,
 
 
     // compress rate
-    if (is_rate) {
+    if (is_rate && sites_mapping && sites_mapping->is_adaptive()) {
+        // scale each site by its own factor, splitting regions where the
+        // factor changes
+        Track<T> track2;
+        for (unsigned int i=0; i<track.size(); i++) {
+            for (int start=track[i].start; start<track[i].end;) {
+                const int factor = sites_mapping->get_site_compress(start);
+                int end = start + 1;
+                while (end < track[i].end &&
+                       sites_mapping->get_site_compress(end) == factor)
+                    end++;
+                track2.append(track[i].chrom, start, end,
+                              track[i].value * factor);
+                start = end;
+            }
+        }
+        track.clear();
+        track.insert(track.begin(), track2.begin(), track2.end());
+    } else if (is_rate) {
         for (unsigned int i=0; i<track.size(); i++)
             track[i].value *= compress_seq;
     }
@@ -793,6 +923,14 @@ void uncompress_track(Track<T> &track, const SitesMapping *sites_mapping,
 {
     Track<T> track2;
 
+    // regions of adaptively compressed rates have a single factor
+    const bool adaptive = sites_mapping && sites_mapping->is_adaptive();
+    if (is_rate && adaptive) {
+        for (unsigned int i=0; i<track.size(); i++)
+            track[i].value /= sites_mapping->get_site_compress(
+                track[i].start);
+    }
+
     if (sites_mapping) {
         // get block lengths
         vector<int> blocks;
@@ -819,7 +957,7 @@ void uncompress_track(Track<T> &track, const SitesMapping *sites_mapping,
 
 
     // compress rate
-    if (is_rate) {
+    if (is_rate && !adaptive) {
         for (unsigned int i=0; i<track.size(); i++)
             track[i].value /= compress_seq;
     }
@@ -0,0 +1,836 @@
+
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "simd.h"
+
+#if defined(ARGWEAVER_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#   define ARGWEAVER_SIMD_X86
+#   include <immintrin.h>
+#endif
+
+
+namespace argweaver {
+
+
+//=============================================================================
+// scalar kernels
+
+static double dot_scalar(const double *x, const double *y, int n,
+                         double init)
+{
+    double sum = init;
+    for (int i=0; i<n; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+static double gather_dot_scalar(const double *w, const int *idx,
+                                const double *x, int n, double init)
+{
+    double sum = init;
+    for (int i=0; i<n; i++)
+        sum += w[i] * x[idx[i]];
+    return sum;
+}
+
+static void div_scalar(double *x, int n, double denom)
+{
+    for (int i=0; i<n; i++)
+        x[i] /= denom;
+}
+
+static double logsum_scalar(const double *vals, int n, double threshold)
+{
+    return logsum(vals, n, threshold);
+}
+
+static double exp_shift_scalar(double *vals, int n, double shift)
+{
+    double total = 0.0;
+    for (int i=0; i<n; i++) {
+        vals[i] = exp(vals[i] - shift);
+        total += vals[i];
+    }
+    return total;
+}
+
+static void exp_array_scalar(double *vals, int n);
+
+
+//=============================================================================
+// scalar exp and log approximations
+//
+// exp() is evaluated with the Cephes rational approximation
+// (relative error ~1e-16) after range reduction by ln(2).
+// log() is evaluated from the atanh series of the mantissa.
+// Arguments outside the range of the approximations fall back to libm.
+
+static const double EXP_HI = 709.0;
+static const double EXP_LO = -708.0;
+static const double EXP_LOG2E = 1.4426950408889634073599;
+static const double EXP_C1 = 6.93145751953125E-1;
+static const double EXP_C2 = 1.42860682030941723212E-6;
+static const double EXP_P0 = 1.26177193074810590878E-4;
+static const double EXP_P1 = 3.02994407707441961300E-2;
+static const double EXP_P2 = 9.99999999999999999910E-1;
+static const double EXP_Q0 = 3.00198505138664455042E-6;
+static const double EXP_Q1 = 2.52448340349684104192E-3;
+static const double EXP_Q2 = 2.27265548208155028766E-1;
+static const double EXP_Q3 = 2.00000000000000000009E0;
+
+static const double LOG_SQRT2 = 1.41421356237309504880;
+static const double LOG_LN2_HI = 6.93147180369123816490e-01;
+static const double LOG_LN2_LO = 1.90821492927058770002e-10;
+
+
+static inline double exp_fast(double x)
+{
+    if (!(x >= EXP_LO && x <= EXP_HI))
+        return exp(x);
+
+    // x = n ln(2) + r
+    const double n = floor(EXP_LOG2E * x + 0.5);
+    x -= n * EXP_C1;
+    x -= n * EXP_C2;
+
+    // exp(r) = 1 + 2 P(r^2) r / (Q(r^2) - P(r^2) r)
+    const double xx = x * x;
+    const double px = x * ((EXP_P0 * xx + EXP_P1) * xx + EXP_P2);
+    const double qx = ((EXP_Q0 * xx + EXP_Q1) * xx + EXP_Q2) * xx + EXP_Q3;
+    x = px / (qx - px);
+    x = 1.0 + x + x;
+
+    // multiply by 2^n
+    const uint64_t bits = uint64_t(int64_t(n) + 1023) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return x * scale;
+}
+
+
+static inline double log_fast(double x)
+{
+    // zero, negative, denormal, infinite and NaN arguments
+    if (!(x >= DBL_MIN && x <= DBL_MAX))
+        return log(x);
+
+    // x = m 2^e with sqrt(2)/2 < m <= sqrt(2)
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int e = int(bits >> 52) - 1023;
+    bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    if (m > LOG_SQRT2) {
+        m *= 0.5;
+        e++;
+    }
+
+    // log(m) = 2 (s + s^3/3 + s^5/5 + ...) with s = (m - 1) / (m + 1)
+    const double s = (m - 1.0) / (m + 1.0);
+    const double ss = s * s;
+    double p = 1.0 / 19.0;
+    for (int k=8; k>=0; k--)
+        p = p * ss + 1.0 / (2 * k + 1);
+
+    return e * LOG_LN2_HI + (2.0 * s * p + e * LOG_LN2_LO);
+}
+
+
+static void exp_array_scalar(double *vals, int n)
+{
+    for (int i=0; i<n; i++)
+        vals[i] = exp_fast(vals[i]);
+}
+
+
+#ifdef ARGWEAVER_SIMD_X86
+
+//=============================================================================
+// SSE2 kernels
+
+__attribute__((target("sse2")))
+static double dot_sse2(const double *x, const double *y, int n, double init)
+{
+    __m128d acc = _mm_setzero_pd();
+    int i = 0;
+    for (; i+2<=n; i+=2)
+        acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(x+i),
+                                         _mm_loadu_pd(y+i)));
+    double tmp[2];
+    _mm_storeu_pd(tmp, acc);
+    double sum = init + tmp[0] + tmp[1];
+    for (; i<n; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+__attribute__((target("sse2")))
+static double gather_dot_sse2(const double *w, const int *idx,
+                              const double *x, int n, double init)
+{
+    __m128d acc = _mm_setzero_pd();
+    int i = 0;
+    for (; i+2<=n; i+=2) {
+        __m128d xv = _mm_set_pd(x[idx[i+1]], x[idx[i]]);
+        acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(w+i), xv));
+    }
+    double tmp[2];
+    _mm_storeu_pd(tmp, acc);
+    double sum = init + tmp[0] + tmp[1];
+    for (; i<n; i++)
+        sum += w[i] * x[idx[i]];
+    return sum;
+}
+
+__attribute__((target("sse2")))
+static void div_sse2(double *x, int n, double denom)
+{
+    const __m128d d = _mm_set1_pd(denom);
+    int i = 0;
+    for (; i+2<=n; i+=2)
+        _mm_storeu_pd(x+i, _mm_div_pd(_mm_loadu_pd(x+i), d));
+    for (; i<n; i++)
+        x[i] /= denom;
+}
+
+
+//=============================================================================
+// AVX2 kernels
+
+__attribute__((target("avx2,fma")))
+static inline double hsum_avx2(__m256d v)
+{
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    __m128d hi64 = _mm_unpackhi_pd(lo, lo);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, hi64));
+}
+
+__attribute__((target("avx2,fma")))
+static double dot_avx2(const double *x, const double *y, int n, double init)
+{
+    __m256d acc = _mm256_setzero_pd();
+    int i = 0;
+    for (; i+4<=n; i+=4)
+        acc = _mm256_fmadd_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i),
+                              acc);
+    double sum = init + hsum_avx2(acc);
+    for (; i<n; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static double gather_dot_avx2(const double *w, const int *idx,
+                              const double *x, int n, double init)
+{
+    __m256d acc = _mm256_setzero_pd();
+    int i = 0;
+    for (; i+4<=n; i+=4) {
+        __m128i vi = _mm_loadu_si128((const __m128i*) (idx+i));
+        __m256d xv = _mm256_mask_i32gather_pd(
+            _mm256_setzero_pd(), x, vi,
+            _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+        acc = _mm256_fmadd_pd(_mm256_loadu_pd(w+i), xv, acc);
+    }
+    double sum = init + hsum_avx2(acc);
+    for (; i<n; i++)
+        sum += w[i] * x[idx[i]];
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static void div_avx2(double *x, int n, double denom)
+{
+    const __m256d d = _mm256_set1_pd(denom);
+    int i = 0;
+    for (; i+4<=n; i+=4)
+        _mm256_storeu_pd(x+i, _mm256_div_pd(_mm256_loadu_pd(x+i), d));
+    for (; i<n; i++)
+        x[i] /= denom;
+}
+
+
+//=============================================================================
+// AVX-512 kernels
+
+__attribute__((target("avx512f")))
+static inline double hsum_avx512(__m512d v)
+{
+    __m256d sum4 = _mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xF, v, 0),
+                                 _mm512_maskz_extractf64x4_pd(0xF, v, 1));
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4),
+                              _mm256_extractf128_pd(sum4, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2)));
+}
+
+__attribute__((target("avx512f")))
+static double dot_avx512(const double *x, const double *y, int n,
+                         double init)
+{
+    __m512d acc = _mm512_setzero_pd();
+    int i = 0;
+    for (; i+8<=n; i+=8)
+        acc = _mm512_fmadd_pd(_mm512_loadu_pd(x+i), _mm512_loadu_pd(y+i),
+                              acc);
+    double sum = init + hsum_avx512(acc);
+    for (; i<n; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static double gather_dot_avx512(const double *w, const int *idx,
+                                const double *x, int n, double init)
+{
+    __m512d acc = _mm512_setzero_pd();
+    int i = 0;
+    for (; i+8<=n; i+=8) {
+        __m256i vi = _mm256_loadu_si256((const __m256i*) (idx+i));
+        __m512d xv = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF,
+                                              vi, x, 8);
+        acc = _mm512_fmadd_pd(_mm512_loadu_pd(w+i), xv, acc);
+    }
+    double sum = init + hsum_avx512(acc);
+    for (; i<n; i++)
+        sum += w[i] * x[idx[i]];
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static void div_avx512(double *x, int n, double denom)
+{
+    const __m512d d = _mm512_set1_pd(denom);
+    int i = 0;
+    for (; i+8<=n; i+=8)
+        _mm512_storeu_pd(x+i, _mm512_div_pd(_mm512_loadu_pd(x+i), d));
+    for (; i<n; i++)
+        x[i] /= denom;
+}
+
+
+//=============================================================================
+// vector exp and logsum kernels
+//
+// exp() is evaluated with the same approximation as exp_fast().
+
+
+__attribute__((target("sse2")))
+static inline __m128d exp_sse2(__m128d x)
+{
+    x = _mm_min_pd(_mm_max_pd(x, _mm_set1_pd(EXP_LO)), _mm_set1_pd(EXP_HI));
+
+    // x = n ln(2) + r
+    __m128i ni = _mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(EXP_LOG2E)));
+    __m128d n = _mm_cvtepi32_pd(ni);
+    x = _mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(EXP_C1)));
+    x = _mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(EXP_C2)));
+
+    // exp(r) = 1 + 2 P(r^2) r / (Q(r^2) - P(r^2) r)
+    __m128d xx = _mm_mul_pd(x, x);
+    __m128d px = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(EXP_P0), xx),
+                            _mm_set1_pd(EXP_P1));
+    px = _mm_mul_pd(x, _mm_add_pd(_mm_mul_pd(px, xx), _mm_set1_pd(EXP_P2)));
+    __m128d qx = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(EXP_Q0), xx),
+                            _mm_set1_pd(EXP_Q1));
+    qx = _mm_add_pd(_mm_mul_pd(qx, xx), _mm_set1_pd(EXP_Q2));
+    qx = _mm_add_pd(_mm_mul_pd(qx, xx), _mm_set1_pd(EXP_Q3));
+    x = _mm_div_pd(px, _mm_sub_pd(qx, px));
+    x = _mm_add_pd(_mm_set1_pd(1.0), _mm_add_pd(x, x));
+
+    // multiply by 2^n
+    __m128i e = _mm_add_epi32(ni, _mm_set1_epi32(1023));
+    e = _mm_slli_epi64(_mm_unpacklo_epi32(e, _mm_setzero_si128()), 52);
+    return _mm_mul_pd(x, _mm_castsi128_pd(e));
+}
+
+__attribute__((target("sse2")))
+static double logsum_sse2(const double *vals, int n, double threshold)
+{
+    if (n < 2)
+        return logsum_scalar(vals, n, threshold);
+
+    __m128d vmax = _mm_set1_pd(vals[0]);
+    int i = 0;
+    for (; i+2<=n; i+=2)
+        vmax = _mm_max_pd(vmax, _mm_loadu_pd(vals+i));
+    double tmp[2];
+    _mm_storeu_pd(tmp, vmax);
+    double maxval = max(tmp[0], tmp[1]);
+    for (; i<n; i++)
+        if (vals[i] > maxval)
+            maxval = vals[i];
+
+    const __m128d vmaxval = _mm_set1_pd(maxval);
+    const __m128d vthreshold = _mm_set1_pd(threshold);
+    __m128d acc = _mm_setzero_pd();
+    for (i=0; i+2<=n; i+=2) {
+        __m128d d = _mm_sub_pd(_mm_loadu_pd(vals+i), vmaxval);
+        __m128d mask = _mm_cmpgt_pd(d, vthreshold);
+        acc = _mm_add_pd(acc, _mm_and_pd(mask, exp_sse2(d)));
+    }
+    _mm_storeu_pd(tmp, acc);
+    double expsum = tmp[0] + tmp[1];
+    for (; i<n; i++)
+        if (vals[i] - maxval > threshold)
+            expsum += exp(vals[i] - maxval);
+
+    return maxval + log(expsum);
+}
+
+__attribute__((target("sse2")))
+static double exp_shift_sse2(double *vals, int n, double shift)
+{
+    const __m128d vshift = _mm_set1_pd(shift);
+    __m128d acc = _mm_setzero_pd();
+    int i = 0;
+    for (; i+2<=n; i+=2) {
+        __m128d e = exp_sse2(_mm_sub_pd(_mm_loadu_pd(vals+i), vshift));
+        _mm_storeu_pd(vals+i, e);
+        acc = _mm_add_pd(acc, e);
+    }
+    double tmp[2];
+    _mm_storeu_pd(tmp, acc);
+    double total = tmp[0] + tmp[1];
+    for (; i<n; i++) {
+        vals[i] = exp(vals[i] - shift);
+        total += vals[i];
+    }
+    return total;
+}
+
+__attribute__((target("sse2")))
+static void exp_array_sse2(double *vals, int n)
+{
+    const __m128d lo = _mm_set1_pd(EXP_LO);
+    const __m128d hi = _mm_set1_pd(EXP_HI);
+    int i = 0;
+    for (; i+2<=n; i+=2) {
+        __m128d v = _mm_loadu_pd(vals+i);
+        __m128d in = _mm_and_pd(_mm_cmpge_pd(v, lo), _mm_cmple_pd(v, hi));
+        if (_mm_movemask_pd(in) != 0x3)
+            exp_array_scalar(vals+i, 2);
+        else
+            _mm_storeu_pd(vals+i, exp_sse2(v));
+    }
+    exp_array_scalar(vals+i, n-i);
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline __m256d exp_avx2(__m256d x)
+{
+    x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(EXP_LO)),
+                      _mm256_set1_pd(EXP_HI));
+
+    // x = n ln(2) + r
+    __m128i ni = _mm256_cvtpd_epi32(
+        _mm256_mul_pd(x, _mm256_set1_pd(EXP_LOG2E)));
+    __m256d n = _mm256_cvtepi32_pd(ni);
+    x = _mm256_fnmadd_pd(n, _mm256_set1_pd(EXP_C1), x);
+    x = _mm256_fnmadd_pd(n, _mm256_set1_pd(EXP_C2), x);
+
+    // exp(r) = 1 + 2 P(r^2) r / (Q(r^2) - P(r^2) r)
+    __m256d xx = _mm256_mul_pd(x, x);
+    __m256d px = _mm256_fmadd_pd(_mm256_set1_pd(EXP_P0), xx,
+                                 _mm256_set1_pd(EXP_P1));
+    px = _mm256_mul_pd(x, _mm256_fmadd_pd(px, xx, _mm256_set1_pd(EXP_P2)));
+    __m256d qx = _mm256_fmadd_pd(_mm256_set1_pd(EXP_Q0), xx,
+                                 _mm256_set1_pd(EXP_Q1));
+    qx = _mm256_fmadd_pd(qx, xx, _mm256_set1_pd(EXP_Q2));
+    qx = _mm256_fmadd_pd(qx, xx, _mm256_set1_pd(EXP_Q3));
+    x = _mm256_div_pd(px, _mm256_sub_pd(qx, px));
+    x = _mm256_add_pd(_mm256_set1_pd(1.0), _mm256_add_pd(x, x));
+
+    // multiply by 2^n
+    __m256i e = _mm256_cvtepu32_epi64(
+        _mm_add_epi32(ni, _mm_set1_epi32(1023)));
+    e = _mm256_slli_epi64(e, 52);
+    return _mm256_mul_pd(x, _mm256_castsi256_pd(e));
+}
+
+__attribute__((target("avx2,fma")))
+static double logsum_avx2(const double *vals, int n, double threshold)
+{
+    if (n < 4)
+        return logsum_scalar(vals, n, threshold);
+
+    __m256d vmax = _mm256_set1_pd(vals[0]);
+    int i = 0;
+    for (; i+4<=n; i+=4)
+        vmax = _mm256_max_pd(vmax, _mm256_loadu_pd(vals+i));
+    double tmp[4];
+    _mm256_storeu_pd(tmp, vmax);
+    double maxval = max(max(tmp[0], tmp[1]), max(tmp[2], tmp[3]));
+    for (; i<n; i++)
+        if (vals[i] > maxval)
+            maxval = vals[i];
+
+    const __m256d vmaxval = _mm256_set1_pd(maxval);
+    const __m256d vthreshold = _mm256_set1_pd(threshold);
+    __m256d acc = _mm256_setzero_pd();
+    for (i=0; i+4<=n; i+=4) {
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(vals+i), vmaxval);
+        __m256d mask = _mm256_cmp_pd(d, vthreshold, _CMP_GT_OQ);
+        acc = _mm256_add_pd(acc, _mm256_and_pd(mask, exp_avx2(d)));
+    }
+    double expsum = hsum_avx2(acc);
+    for (; i<n; i++)
+        if (vals[i] - maxval > threshold)
+            expsum += exp(vals[i] - maxval);
+
+    return maxval + log(expsum);
+}
+
+__attribute__((target("avx2,fma")))
+static double exp_shift_avx2(double *vals, int n, double shift)
+{
+    const __m256d vshift = _mm256_set1_pd(shift);
+    __m256d acc = _mm256_setzero_pd();
+    int i = 0;
+    for (; i+4<=n; i+=4) {
+        __m256d e = exp_avx2(_mm256_sub_pd(_mm256_loadu_pd(vals+i), vshift));
+        _mm256_storeu_pd(vals+i, e);
+        acc = _mm256_add_pd(acc, e);
+    }
+    double total = hsum_avx2(acc);
+    for (; i<n; i++) {
+        vals[i] = exp(vals[i] - shift);
+        total += vals[i];
+    }
+    return total;
+}
+
+__attribute__((target("avx2,fma")))
+static void exp_array_avx2(double *vals, int n)
+{
+    const __m256d lo = _mm256_set1_pd(EXP_LO);
+    const __m256d hi = _mm256_set1_pd(EXP_HI);
+    int i = 0;
+    for (; i+4<=n; i+=4) {
+        __m256d v = _mm256_loadu_pd(vals+i);
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(v, lo, _CMP_GE_OQ),
+                                   _mm256_cmp_pd(v, hi, _CMP_LE_OQ));
+        if (_mm256_movemask_pd(in) != 0xf)
+            exp_array_scalar(vals+i, 4);
+        else
+            _mm256_storeu_pd(vals+i, exp_avx2(v));
+    }
+    exp_array_scalar(vals+i, n-i);
+}
+
+
+__attribute__((target("avx512f")))
+static inline __m512d exp_avx512(__m512d x)
+{
+    x = _mm512_min_pd(_mm512_max_pd(x, _mm512_set1_pd(EXP_LO)),
+                      _mm512_set1_pd(EXP_HI));
+
+    // x = n ln(2) + r
+    __m512d n = _mm512_roundscale_pd(
+        _mm512_mul_pd(x, _mm512_set1_pd(EXP_LOG2E)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_pd(n, _mm512_set1_pd(EXP_C1), x);
+    x = _mm512_fnmadd_pd(n, _mm512_set1_pd(EXP_C2), x);
+
+    // exp(r) = 1 + 2 P(r^2) r / (Q(r^2) - P(r^2) r)
+    __m512d xx = _mm512_mul_pd(x, x);
+    __m512d px = _mm512_fmadd_pd(_mm512_set1_pd(EXP_P0), xx,
+                                 _mm512_set1_pd(EXP_P1));
+    px = _mm512_mul_pd(x, _mm512_fmadd_pd(px, xx, _mm512_set1_pd(EXP_P2)));
+    __m512d qx = _mm512_fmadd_pd(_mm512_set1_pd(EXP_Q0), xx,
+                                 _mm512_set1_pd(EXP_Q1));
+    qx = _mm512_fmadd_pd(qx, xx, _mm512_set1_pd(EXP_Q2));
+    qx = _mm512_fmadd_pd(qx, xx, _mm512_set1_pd(EXP_Q3));
+    x = _mm512_div_pd(px, _mm512_sub_pd(qx, px));
+    x = _mm512_add_pd(_mm512_set1_pd(1.0), _mm512_add_pd(x, x));
+
+    // multiply by 2^n
+    return _mm512_scalef_pd(x, n);
+}
+
+__attribute__((target("avx512f")))
+static double logsum_avx512(const double *vals, int n, double threshold)
+{
+    if (n < 8)
+        return logsum_scalar(vals, n, threshold);
+
+    __m512d vmax = _mm512_set1_pd(vals[0]);
+    int i = 0;
+    for (; i+8<=n; i+=8)
+        vmax = _mm512_max_pd(vmax, _mm512_loadu_pd(vals+i));
+    double tmp[8];
+    _mm512_storeu_pd(tmp, vmax);
+    double maxval = tmp[0];
+    for (int j=1; j<8; j++)
+        maxval = max(maxval, tmp[j]);
+    for (; i<n; i++)
+        if (vals[i] > maxval)
+            maxval = vals[i];
+
+    const __m512d vmaxval = _mm512_set1_pd(maxval);
+    const __m512d vthreshold = _mm512_set1_pd(threshold);
+    __m512d acc = _mm512_setzero_pd();
+    for (i=0; i+8<=n; i+=8) {
+        __m512d d = _mm512_sub_pd(_mm512_loadu_pd(vals+i), vmaxval);
+        __mmask8 mask = _mm512_cmp_pd_mask(d, vthreshold, _CMP_GT_OQ);
+        acc = _mm512_mask_add_pd(acc, mask, acc, exp_avx512(d));
+    }
+    double expsum = hsum_avx512(acc);
+    for (; i<n; i++)
+        if (vals[i] - maxval > threshold)
+            expsum += exp(vals[i] - maxval);
+
+    return maxval + log(expsum);
+}
+
+__attribute__((target("avx512f")))
+static double exp_shift_avx512(double *vals, int n, double shift)
+{
+    const __m512d vshift = _mm512_set1_pd(shift);
+    __m512d acc = _mm512_setzero_pd();
+    int i = 0;
+    for (; i+8<=n; i+=8) {
+        __m512d e = exp_avx512(_mm512_sub_pd(_mm512_loadu_pd(vals+i),
+                                             vshift));
+        _mm512_storeu_pd(vals+i, e);
+        acc = _mm512_add_pd(acc, e);
+    }
+    double total = hsum_avx512(acc);
+    for (; i<n; i++) {
+        vals[i] = exp(vals[i] - shift);
+        total += vals[i];
+    }
+    return total;
+}
+
+__attribute__((target("avx512f")))
+static void exp_array_avx512(double *vals, int n)
+{
+    const __m512d lo = _mm512_set1_pd(EXP_LO);
+    const __m512d hi = _mm512_set1_pd(EXP_HI);
+    int i = 0;
+    for (; i+8<=n; i+=8) {
+        __m512d v = _mm512_loadu_pd(vals+i);
+        __mmask8 in = _mm512_cmp_pd_mask(v, lo, _CMP_GE_OQ) &
+            _mm512_cmp_pd_mask(v, hi, _CMP_LE_OQ);
+        if (in != 0xff)
+            exp_array_scalar(vals+i, 8);
+        else
+            _mm512_storeu_pd(vals+i, exp_avx512(v));
+    }
+    exp_array_scalar(vals+i, n-i);
+}
+
+#endif // ARGWEAVER_SIMD_X86
+
+
+//=============================================================================
+// dispatch
+
+typedef double (*DotFunc)(const double *, const double *, int, double);
+typedef double (*GatherDotFunc)(const double *, const int *, const double *,
+                                int, double);
+typedef void (*DivFunc)(double *, int, double);
+typedef double (*LogsumFunc)(const double *, int, double);
+typedef double (*ExpShiftFunc)(double *, int, double);
+typedef void (*ExpArrayFunc)(double *, int);
+
+class SimdDispatch
+{
+public:
+    SimdDispatch()
+    {
+        max_level = SIMD_SCALAR;
+#ifdef ARGWEAVER_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            max_level = SIMD_SSE2;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            max_level = SIMD_AVX2;
+        if (__builtin_cpu_supports("avx512f"))
+            max_level = SIMD_AVX512;
+#endif
+        set(max_level);
+    }
+
+    SimdLevel set(SimdLevel want)
+    {
+        if (want > max_level)
+            want = max_level;
+        level = want;
+
+        dot = dot_scalar;
+        gather_dot = gather_dot_scalar;
+        div = div_scalar;
+        logsum = logsum_scalar;
+        exp_shift = exp_shift_scalar;
+        exp_array = exp_array_scalar;
+#ifdef ARGWEAVER_SIMD_X86
+        switch (level) {
+        case SIMD_SSE2:
+            dot = dot_sse2;
+            gather_dot = gather_dot_sse2;
+            div = div_sse2;
+            logsum = logsum_sse2;
+            exp_shift = exp_shift_sse2;
+            exp_array = exp_array_sse2;
+            break;
+        case SIMD_AVX2:
+            dot = dot_avx2;
+            gather_dot = gather_dot_avx2;
+            div = div_avx2;
+            logsum = logsum_avx2;
+            exp_shift = exp_shift_avx2;
+            exp_array = exp_array_avx2;
+            break;
+        case SIMD_AVX512:
+            dot = dot_avx512;
+            gather_dot = gather_dot_avx512;
+            div = div_avx512;
+            logsum = logsum_avx512;
+            exp_shift = exp_shift_avx512;
+            exp_array = exp_array_avx512;
+            break;
+        default:
+            break;
+        }
+#endif
+        return level;
+    }
+
+    SimdLevel max_level;
+    SimdLevel level;
+    DotFunc dot;
+    GatherDotFunc gather_dot;
+    DivFunc div;
+    LogsumFunc logsum;
+    ExpShiftFunc exp_shift;
+    ExpArrayFunc exp_array;
+};
+
+
+static SimdDispatch &get_dispatch()
+{
+    static SimdDispatch dispatch;
+    return dispatch;
+}
+
+
+SimdLevel get_simd_level()
+{
+    return get_dispatch().level;
+}
+
+SimdLevel get_max_simd_level()
+{
+    return get_dispatch().max_level;
+}
+
+SimdLevel set_simd_level(SimdLevel level)
+{
+    return get_dispatch().set(level);
+}
+
+const char *get_simd_name(SimdLevel level)
+{
+    switch (level) {
+    case SIMD_SSE2:   return "sse2";
+    case SIMD_AVX2:   return "avx2";
+    case SIMD_AVX512: return "avx512";
+    default:          return "scalar";
+    }
+}
+
+
+double simd_dot(const double *x, const double *y, int n, double init)
+{
+    return get_dispatch().dot(x, y, n, init);
+}
+
+double simd_gather_dot(const double *w, const int *idx, const double *x,
+                       int n, double init)
+{
+    return get_dispatch().gather_dot(w, idx, x, n, init);
+}
+
+void simd_div(double *x, int n, double denom)
+{
+    get_dispatch().div(x, n, denom);
+}
+
+double simd_logsum(const double *vals, int n, double threshold)
+{
+    return get_dispatch().logsum(vals, n, threshold);
+}
+
+double simd_exp_shift(double *vals, int n, double shift)
+{
+    return get_dispatch().exp_shift(vals, n, shift);
+}
+
+
+//=============================================================================
+// exp and log at a selectable accuracy
+
+static MathAccuracy g_math_accuracy = MATH_EXACT;
+
+
+MathAccuracy get_math_accuracy()
+{
+    return g_math_accuracy;
+}
+
+void set_math_accuracy(MathAccuracy accuracy)
+{
+    g_math_accuracy = accuracy;
+}
+
+const char *get_math_accuracy_name(MathAccuracy accuracy)
+{
+    switch (accuracy) {
+    case MATH_FAST: return "fast";
+    default:        return "exact";
+    }
+}
+
+
+double math_exp(double x)
+{
+    return g_math_accuracy == MATH_FAST ? exp_fast(x) : exp(x);
+}
+
+double math_log(double x)
+{
+    return g_math_accuracy == MATH_FAST ? log_fast(x) : log(x);
+}
+
+void simd_exp(double *vals, int n)
+{
+    if (g_math_accuracy == MATH_FAST) {
+        get_dispatch().exp_array(vals, n);
+    } else {
+        for (int i=0; i<n; i++)
+            vals[i] = exp(vals[i]);
+    }
+}
+
+void simd_log(double *vals, int n)
+{
+    if (g_math_accuracy == MATH_FAST) {
+        for (int i=0; i<n; i++)
+            vals[i] = log_fast(vals[i]);
+    } else {
+        for (int i=0; i<n; i++)
+            vals[i] = log(vals[i]);
+    }
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,78 @@
+//=============================================================================
+// Vectorized array kernels with runtime CPU dispatch
+//
+// When compiled with ARGWEAVER_SIMD (make SIMD=1), the kernels below pick
+// the widest instruction set supported by the running CPU (SSE2, AVX2 or
+// AVX-512).  Otherwise they are plain scalar loops that accumulate in the
+// same order as the original hand-written loops, so results are
+// bit-identical to the non-vectorized code.
+
+#ifndef ARGWEAVER_SIMD_H
+#define ARGWEAVER_SIMD_H
+
+
+namespace argweaver {
+
+
+enum SimdLevel {
+    SIMD_SCALAR=0,
+    SIMD_SSE2=1,
+    SIMD_AVX2=2,
+    SIMD_AVX512=3
+};
+
+
+// Returns the instruction set currently used by the kernels
+SimdLevel get_simd_level();
+
+// Returns the best instruction set supported by this build and CPU
+SimdLevel get_max_simd_level();
+
+// Restrict kernels to at most 'level' (useful for testing).
+// Returns the level actually selected.
+SimdLevel set_simd_level(SimdLevel level);
+
+const char *get_simd_name(SimdLevel level);
+
+
+// Returns init + sum_i x[i] * y[i]
+double simd_dot(const double *x, const double *y, int n, double init=0.0);
+
+// Returns init + sum_i w[i] * x[idx[i]]
+double simd_gather_dot(const double *w, const int *idx, const double *x,
+                       int n, double init=0.0);
+
+// Computes x[i] /= denom for all i
+void simd_div(double *x, int n, double denom);
+
+// Returns log(sum_i exp(vals[i])).  Like logsum(), terms more than
+// 'threshold' below the maximum value are ignored.
+double simd_logsum(const double *vals, int n, double threshold=-15);
+
+// Computes vals[i] = exp(vals[i] - shift) for all i and returns the sum
+double simd_exp_shift(double *vals, int n, double shift);
+
+
+// Accuracy of math_exp(), math_log(), simd_exp() and simd_log()
+enum MathAccuracy {
+    MATH_EXACT=0,  // libm exp() and log(): results do not change
+    MATH_FAST=1    // polynomial approximations within a few ulp
+};
+
+MathAccuracy get_math_accuracy();
+void set_math_accuracy(MathAccuracy accuracy);
+const char *get_math_accuracy_name(MathAccuracy accuracy);
+
+// exp(x) and log(x) evaluated at the current accuracy
+double math_exp(double x);
+double math_log(double x);
+
+// Computes vals[i] = exp(vals[i]) or vals[i] = log(vals[i]) for all i at
+// the current accuracy
+void simd_exp(double *vals, int n);
+void simd_log(double *vals, int n);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_SIMD_H
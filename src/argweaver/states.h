@@ -175,6 +175,12 @@ public:
 
     }
 
+    bool operator==(const StatesModel &other) const {
+        return ntimes == other.ntimes && internal == other.internal &&
+            minage == other.minage && start_pop == other.start_pop &&
+            pop_tree == other.pop_tree;
+    }
+
     int ntimes;
     bool internal;
     int minage;
@@ -183,6 +189,51 @@ public:
 };
 
 
+// The state spaces of the last two local trees enumerated.  Consecutive
+// blocks of the ArgHmm share the tree on either side of a switch, and
+// blocks split by the model maps share their tree, so iterating over the
+// blocks in either direction enumerates each state space once.  Trees are
+// identified by their LocalTreeSpr and must not change while cached.
+class StatesCache
+{
+public:
+    StatesCache() : last(0)
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        keys[0] = keys[1] = NULL;
+    }
+
+    // Returns the states of the tree of 'tree_spr'.  The reference stays
+    // valid until the second call after this one.
+    const States &get_coal_states(const StatesModel &states_model,
+                                  const LocalTreeSpr *tree_spr)
+    {
+        for (int i=0; i<2; i++) {
+            if (keys[i] == tree_spr && models[i] == states_model) {
+                last = i;
+                return states[i];
+            }
+        }
+
+        last = 1 - last;
+        keys[last] = tree_spr;
+        models[last] = states_model;
+        states_model.get_coal_states(tree_spr->tree, states[last]);
+        return states[last];
+    }
+
+protected:
+    const LocalTreeSpr *keys[2];
+    StatesModel models[2];
+    States states[2];
+    int last;   // entry returned last
+};
+
+
 } // namespace argweaver
 
 #endif // ARGWEAVER_STATES_H
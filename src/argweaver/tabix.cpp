@@ -1,6 +1,16 @@
+#include <assert.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <string>
+#include <stdint.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <zlib.h>
 
 #include "tabix.h"
 #include "parsing.h"
@@ -11,6 +21,727 @@ namespace argweaver {
 using namespace std;
 
 
+//=============================================================================
+// tabix indexes
+//
+// Region queries are answered in-process from the file's .tbi or .csi
+// index.  Loaded indexes are cached by filename together with a few idle
+// file handles, so repeated small queries on the same file only cost a
+// seek and the decompression of the blocks that overlap the region.  Files
+// without an index fall back on the tabix program.
+
+struct TabixChunk
+{
+    uint64_t beg;
+    uint64_t end;
+
+    bool operator<(const TabixChunk &other) const
+    {
+        return beg < other.beg;
+    }
+};
+
+
+class TabixIndex
+{
+public:
+    enum {
+        FORMAT_GENERIC = 0,
+        FORMAT_SAM = 1,
+        FORMAT_VCF = 2,
+        FORMAT_ZERO_BASED = 0x10000
+    };
+
+    // reads a .tbi or .csi file
+    bool read(const char *filename);
+
+    // returns the id of a sequence name or -1 if it is not indexed
+    int get_ref(const string &name) const
+    {
+        map<string, int>::const_iterator it = ref_lookup.find(name);
+        return it == ref_lookup.end() ? -1 : it->second;
+    }
+
+    // returns the chunks of the file that may contain records of 'ref'
+    // overlapping [beg, end)
+    void query(int ref, int64_t beg, int64_t end,
+               vector<TabixChunk> &chunks) const;
+
+    int format;
+    int col_seq;
+    int col_beg;
+    int col_end;
+    char meta;
+    int skip;
+    vector<string> names;
+
+protected:
+    struct Ref
+    {
+        map<unsigned int, vector<TabixChunk> > bins;
+        vector<uint64_t> linear;   // tbi only
+    };
+
+    bool read_header(const char *&p, const char *end);
+    bool read_refs(const char *&p, const char *end, bool csi);
+
+    int min_shift;
+    int depth;
+    vector<Ref> refs;
+    map<string, int> ref_lookup;
+};
+
+
+// Reads a little-endian value from an index buffer
+template <class T>
+static bool read_value(const char *&p, const char *end, T *value)
+{
+    if (end - p < (long) sizeof(T))
+        return false;
+    memcpy(value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+
+bool TabixIndex::read(const char *filename)
+{
+    gzFile gz = gzopen(filename, "rb");
+    if (!gz)
+        return false;
+    string data;
+    char buf[1 << 16];
+    int n;
+    while ((n = gzread(gz, buf, sizeof(buf))) > 0)
+        data.append(buf, n);
+    gzclose(gz);
+    if (n < 0)
+        return false;
+
+    const char *p = data.data();
+    const char *end = p + data.size();
+    if (data.size() < 4)
+        return false;
+
+    if (memcmp(p, "TBI\1", 4) == 0) {
+        p += 4;
+        min_shift = 14;
+        depth = 5;
+        int32_t nrefs;
+        if (!read_value(p, end, &nrefs) || !read_header(p, end))
+            return false;
+        refs.resize(nrefs);
+        return read_refs(p, end, false);
+    } else if (memcmp(p, "CSI\1", 4) == 0) {
+        p += 4;
+        int32_t shift, levels, laux, nrefs;
+        if (!read_value(p, end, &shift) || !read_value(p, end, &levels) ||
+            !read_value(p, end, &laux) || laux < 0 || end - p < laux)
+            return false;
+        min_shift = shift;
+        depth = levels;
+        const char *aux = p;
+        if (laux == 0 || !read_header(aux, p + laux))
+            return false;
+        p += laux;
+        if (!read_value(p, end, &nrefs))
+            return false;
+        refs.resize(nrefs);
+        return read_refs(p, end, true);
+    }
+    return false;
+}
+
+
+bool TabixIndex::read_header(const char *&p, const char *end)
+{
+    int32_t values[6], lnames;
+    for (int i=0; i<6; i++)
+        if (!read_value(p, end, &values[i]))
+            return false;
+    format = values[0];
+    col_seq = values[1];
+    col_beg = values[2];
+    col_end = values[3];
+    meta = values[4];
+    skip = values[5];
+    if (!read_value(p, end, &lnames) || lnames < 0 || end - p < lnames)
+        return false;
+
+    const char *names_end = p + lnames;
+    while (p < names_end) {
+        string name(p);
+        p += name.size() + 1;
+        ref_lookup[name] = names.size();
+        names.push_back(name);
+    }
+    return true;
+}
+
+
+bool TabixIndex::read_refs(const char *&p, const char *end, bool csi)
+{
+    for (unsigned int i=0; i<refs.size(); i++) {
+        int32_t nbins;
+        if (!read_value(p, end, &nbins))
+            return false;
+        for (int j=0; j<nbins; j++) {
+            uint32_t bin;
+            uint64_t loffset;
+            int32_t nchunks;
+            if (!read_value(p, end, &bin) ||
+                (csi && !read_value(p, end, &loffset)) ||
+                !read_value(p, end, &nchunks) || nchunks < 0)
+                return false;
+            vector<TabixChunk> &chunks = refs[i].bins[bin];
+            chunks.resize(nchunks);
+            for (int k=0; k<nchunks; k++) {
+                if (!read_value(p, end, &chunks[k].beg) ||
+                    !read_value(p, end, &chunks[k].end))
+                    return false;
+            }
+        }
+
+        if (!csi) {
+            int32_t nintervals;
+            if (!read_value(p, end, &nintervals) || nintervals < 0)
+                return false;
+            refs[i].linear.resize(nintervals);
+            for (int j=0; j<nintervals; j++)
+                if (!read_value(p, end, &refs[i].linear[j]))
+                    return false;
+        }
+    }
+    return true;
+}
+
+
+void TabixIndex::query(int ref, int64_t beg, int64_t end,
+                       vector<TabixChunk> &chunks) const
+{
+    chunks.clear();
+    if (ref < 0 || ref >= (int) refs.size())
+        return;
+    const Ref &r = refs[ref];
+
+    const int64_t max_end = int64_t(1) << (min_shift + 3 * depth);
+    beg = max(beg, int64_t(0));
+    end = min(end, max_end);
+    if (beg >= end)
+        return;
+
+    // records starting before the linear index offset of 'beg' all end
+    // before 'beg'
+    uint64_t min_offset = 0;
+    if (!r.linear.empty()) {
+        const int64_t i = min(beg >> min_shift, int64_t(r.linear.size() - 1));
+        min_offset = r.linear[i];
+    }
+
+    // collect chunks of all bins overlapping the region
+    int64_t offset = 0;
+    for (int level=0, shift=min_shift + 3*depth; level<=depth;
+         level++, shift-=3) {
+        const int64_t first = offset + (beg >> shift);
+        const int64_t last = offset + ((end - 1) >> shift);
+        for (int64_t bin=first; bin<=last; bin++) {
+            map<unsigned int, vector<TabixChunk> >::const_iterator it =
+                r.bins.find(bin);
+            if (it == r.bins.end())
+                continue;
+            for (unsigned int k=0; k<it->second.size(); k++)
+                if (it->second[k].end > min_offset)
+                    chunks.push_back(it->second[k]);
+        }
+        offset += int64_t(1) << (3 * level);
+    }
+
+    // merge overlapping chunks
+    sort(chunks.begin(), chunks.end());
+    unsigned int n = 0;
+    for (unsigned int i=0; i<chunks.size(); i++) {
+        if (n > 0 && chunks[i].beg <= chunks[n-1].end)
+            chunks[n-1].end = max(chunks[n-1].end, chunks[i].end);
+        else
+            chunks[n++] = chunks[i];
+    }
+    chunks.resize(n);
+    if (!chunks.empty())
+        chunks[0].beg = max(chunks[0].beg, min_offset);
+}
+
+
+//=============================================================================
+// BGZF random access
+
+class BgzfReader
+{
+public:
+    BgzfReader(FILE *file) :
+        file(file),
+        block_address(-1),
+        next_address(0),
+        offset(0)
+    {}
+
+    // moves to a virtual file offset
+    bool seek(uint64_t voffset)
+    {
+        const int64_t address = voffset >> 16;
+        if (address != block_address && !load_block(address))
+            return false;
+        offset = voffset & 0xffff;
+        return offset <= block.size();
+    }
+
+    // returns the virtual file offset of the next byte
+    uint64_t tell() const
+    {
+        if (offset >= block.size())
+            return uint64_t(next_address) << 16;
+        return (uint64_t(block_address) << 16) | offset;
+    }
+
+    // reads a line without its newline.  Returns false at end of file.
+    bool getline(string &line)
+    {
+        line.clear();
+        bool read = false;
+        while (true) {
+            while (offset >= block.size()) {
+                if (!load_block(next_address))
+                    return read;
+            }
+            const char *start = &block[offset];
+            const char *newline = (const char*)
+                memchr(start, '\n', block.size() - offset);
+            read = true;
+            if (newline) {
+                line.append(start, newline - start);
+                offset += newline - start + 1;
+                return true;
+            }
+            line.append(start, block.size() - offset);
+            offset = block.size();
+        }
+    }
+
+    FILE *file;
+
+protected:
+    bool load_block(int64_t address)
+    {
+        block.clear();
+        offset = 0;
+        block_address = address;
+        next_address = address;
+
+        unsigned char header[18];
+        if (fseeko(file, address, SEEK_SET) != 0 ||
+            fread(header, 1, sizeof(header), file) != sizeof(header))
+            return false;
+        if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 ||
+            !(header[3] & 4))
+            return false;
+
+        // find the block size in the BC extra subfield
+        const int xlen = header[10] | (header[11] << 8);
+        if (xlen < 6)
+            return false;
+        vector<unsigned char> extra(xlen);
+        memcpy(&extra[0], header + 12, 6);
+        if (xlen > 6 &&
+            fread(&extra[6], 1, xlen - 6, file) != (size_t) (xlen - 6))
+            return false;
+        int size = -1;
+        for (int i=0; i + 4 <= xlen; ) {
+            const int len = extra[i+2] | (extra[i+3] << 8);
+            if (extra[i] == 'B' && extra[i+1] == 'C' && len == 2 &&
+                i + 6 <= xlen)
+                size = (extra[i+4] | (extra[i+5] << 8)) + 1;
+            i += 4 + len;
+        }
+        const int data_size = size - 12 - xlen - 8;
+        if (data_size < 0)
+            return false;
+
+        // read the deflate stream and trailer
+        compressed.resize(data_size + 8);
+        if (fread(&compressed[0], 1, compressed.size(), file) !=
+            compressed.size())
+            return false;
+        const unsigned char *trailer = &compressed[data_size];
+        const uint32_t isize = trailer[4] | (trailer[5] << 8) |
+            (trailer[6] << 16) | (uint32_t(trailer[7]) << 24);
+
+        block.resize(isize);
+        if (isize > 0) {
+            z_stream zs;
+            zs.zalloc = Z_NULL;
+            zs.zfree = Z_NULL;
+            zs.opaque = Z_NULL;
+            zs.next_in = &compressed[0];
+            zs.avail_in = data_size;
+            if (inflateInit2(&zs, -15) != Z_OK)
+                return false;
+            zs.next_out = (Bytef*) &block[0];
+            zs.avail_out = isize;
+            const int status = inflate(&zs, Z_FINISH);
+            inflateEnd(&zs);
+            if (status != Z_STREAM_END || zs.avail_out != 0) {
+                block.clear();
+                return false;
+            }
+        }
+
+        next_address = address + size;
+        return true;
+    }
+
+    int64_t block_address;
+    int64_t next_address;
+    unsigned int offset;
+    string block;
+    vector<unsigned char> compressed;
+};
+
+
+//=============================================================================
+// index and file handle cache
+
+struct TabixFile
+{
+    TabixFile() : data_mtime(0), index_mtime(0) {}
+
+    shared_ptr<TabixIndex> index;
+    time_t data_mtime;
+    time_t index_mtime;
+    vector<FILE*> idle;   // open handles not used by any query
+};
+
+static const unsigned int MAX_IDLE_HANDLES = 4;
+static map<string, TabixFile> tabix_files;
+static mutex tabix_files_lock;
+
+
+static bool get_mtime(const string &filename, time_t *mtime)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return false;
+    *mtime = st.st_mtime;
+    return true;
+}
+
+
+// Returns the index of a file and an open handle for it, or a NULL index
+// if the file is not indexed
+static shared_ptr<TabixIndex> open_indexed(const string &filename,
+                                           FILE **handle)
+{
+    *handle = NULL;
+    time_t data_mtime, index_mtime;
+    string index_file = filename + ".tbi";
+    if (!get_mtime(filename, &data_mtime))
+        return shared_ptr<TabixIndex>();
+    if (!get_mtime(index_file, &index_mtime)) {
+        index_file = filename + ".csi";
+        if (!get_mtime(index_file, &index_mtime))
+            return shared_ptr<TabixIndex>();
+    }
+
+    lock_guard<mutex> guard(tabix_files_lock);
+    TabixFile &entry = tabix_files[filename];
+    if (!entry.index || entry.data_mtime != data_mtime ||
+        entry.index_mtime != index_mtime) {
+        // (re)load index after the files changed
+        for (unsigned int i=0; i<entry.idle.size(); i++)
+            fclose(entry.idle[i]);
+        entry.idle.clear();
+        entry.index.reset(new TabixIndex());
+        if (!entry.index->read(index_file.c_str())) {
+            printError("Error reading tabix index %s\n", index_file.c_str());
+            tabix_files.erase(filename);
+            return shared_ptr<TabixIndex>();
+        }
+        entry.data_mtime = data_mtime;
+        entry.index_mtime = index_mtime;
+    }
+
+    if (!entry.idle.empty()) {
+        *handle = entry.idle.back();
+        entry.idle.pop_back();
+    } else {
+        *handle = fopen(filename.c_str(), "rb");
+        if (!*handle)
+            return shared_ptr<TabixIndex>();
+    }
+    return entry.index;
+}
+
+
+// Returns a handle to the cache once a query is done
+static void release_handle(const string &filename,
+                           const shared_ptr<TabixIndex> &index, FILE *handle)
+{
+    lock_guard<mutex> guard(tabix_files_lock);
+    map<string, TabixFile>::iterator it = tabix_files.find(filename);
+    if (it != tabix_files.end() && it->second.index == index &&
+        it->second.idle.size() < MAX_IDLE_HANDLES) {
+        it->second.idle.push_back(handle);
+    } else {
+        fclose(handle);
+    }
+}
+
+
+//=============================================================================
+// region queries
+
+// Parses a region "chr", "chr:start" or "chr:start-end" (1-based,
+// inclusive) into a half-open, 0-based interval
+static bool parse_region(const char *region, string *chrom,
+                         int64_t *beg, int64_t *end)
+{
+    string str;
+    for (const char *c=region; *c; c++)
+        if (*c != ',')
+            str += *c;
+
+    *beg = 0;
+    *end = INT64_MAX;
+    const size_t colon = str.rfind(':');
+    if (colon == string::npos) {
+        *chrom = str;
+        return !chrom->empty();
+    }
+    *chrom = str.substr(0, colon);
+
+    long long start, stop;
+    const char *coords = str.c_str() + colon + 1;
+    const int n = sscanf(coords, "%lld-%lld", &start, &stop);
+    if (n < 1)
+        return false;
+    *beg = max(start - 1, 0LL);
+    if (n == 2)
+        *end = stop;
+    return !chrom->empty() && *beg < *end;
+}
+
+
+// Streams the header and the records of an indexed file that overlap a
+// region, in the same format as 'tabix -h'
+class TabixQuery
+{
+public:
+    TabixQuery(const string &filename, const shared_ptr<TabixIndex> &index,
+               FILE *handle, int ref, int64_t beg, int64_t end) :
+        filename(filename),
+        index(index),
+        reader(handle),
+        ref(ref),
+        beg(beg),
+        end(end),
+        in_header(true),
+        chunk(0),
+        done(false),
+        pending_offset(0),
+        lineno(0)
+    {
+        index->query(ref, beg, end, chunks);
+        if (!reader.seek(0))
+            done = true;
+    }
+
+    ~TabixQuery()
+    {
+        release_handle(filename, index, reader.file);
+    }
+
+    ssize_t read(char *buf, size_t size)
+    {
+        size_t written = 0;
+        while (written < size) {
+            if (pending_offset == pending.size()) {
+                pending_offset = 0;
+                if (!next_line()) {
+                    pending.clear();
+                    break;
+                }
+                pending += '\n';
+            }
+            const size_t n = min(size - written,
+                                 pending.size() - pending_offset);
+            memcpy(buf + written, pending.data() + pending_offset, n);
+            written += n;
+            pending_offset += n;
+        }
+        return written;
+    }
+
+protected:
+    // sets 'pending' to the next output line
+    bool next_line()
+    {
+        while (!done) {
+            if (in_header) {
+                // header lines are at the start of the file
+                if (reader.getline(pending) &&
+                    (is_meta(pending) || lineno < index->skip)) {
+                    lineno++;
+                    return true;
+                }
+                in_header = false;
+                if (!start_chunk())
+                    break;
+                continue;
+            }
+
+            if (reader.tell() >= chunks[chunk].end) {
+                chunk++;
+                if (!start_chunk())
+                    break;
+                continue;
+            }
+            if (!reader.getline(pending))
+                break;
+            if (is_meta(pending))
+                continue;
+
+            int line_ref;
+            int64_t line_beg, line_end;
+            if (!parse_line(pending, &line_ref, &line_beg, &line_end))
+                continue;
+            if (line_ref != ref || line_beg >= end) {
+                // records are sorted, so nothing else overlaps the region
+                break;
+            }
+            if (line_end > beg)
+                return true;
+        }
+        done = true;
+        return false;
+    }
+
+    bool start_chunk()
+    {
+        if (chunk >= chunks.size())
+            return false;
+        return reader.seek(chunks[chunk].beg);
+    }
+
+    bool is_meta(const string &line) const
+    {
+        return !line.empty() && line[0] == index->meta;
+    }
+
+    bool parse_line(const string &line, int *line_ref,
+                    int64_t *line_beg, int64_t *line_end) const
+    {
+        const int format = index->format & 0xffff;
+        string seq;
+        *line_beg = -1;
+        *line_end = -1;
+        int col = 1;
+        size_t start = 0;
+        while (start <= line.size()) {
+            size_t stop = line.find('\t', start);
+            if (stop == string::npos)
+                stop = line.size();
+            const char *field = line.c_str() + start;
+
+            if (col == index->col_seq) {
+                seq = line.substr(start, stop - start);
+            } else if (col == index->col_beg) {
+                *line_beg = atoll(field);
+                if (!(index->format & TabixIndex::FORMAT_ZERO_BASED))
+                    (*line_beg)--;
+            } else if (col == index->col_end && index->col_end > 0) {
+                *line_end = atoll(field);
+            } else if (format == TabixIndex::FORMAT_VCF && col == 4) {
+                // end of a VCF record is given by the length of REF
+                *line_end = *line_beg + (stop - start);
+            }
+            col++;
+            start = stop + 1;
+        }
+
+        if (*line_beg < 0)
+            return false;
+        if (*line_end <= *line_beg)
+            *line_end = *line_beg + 1;
+        *line_ref = index->get_ref(seq);
+        return true;
+    }
+
+    string filename;
+    shared_ptr<TabixIndex> index;
+    BgzfReader reader;
+    int ref;
+    int64_t beg;
+    int64_t end;
+    vector<TabixChunk> chunks;
+    bool in_header;
+    unsigned int chunk;
+    bool done;
+    string pending;
+    size_t pending_offset;
+    int lineno;
+};
+
+
+static ssize_t tabix_cookie_read(void *cookie, char *buf, size_t size)
+{
+    return ((TabixQuery*) cookie)->read(buf, size);
+}
+
+static int tabix_cookie_close(void *cookie)
+{
+    delete (TabixQuery*) cookie;
+    return 0;
+}
+
+
+// streams of indexed region queries
+static set<FILE*> tabix_queries;
+static mutex tabix_queries_lock;
+
+
+// Opens a region query through the file's index.  Sets 'indexed' to false
+// if the file has no usable index.
+static FILE *read_tabix_native(const char *filename, const char *region,
+                               bool *indexed)
+{
+    FILE *handle;
+    shared_ptr<TabixIndex> index = open_indexed(filename, &handle);
+    *indexed = bool(index);
+    if (!index)
+        return NULL;
+
+    string chrom;
+    int64_t beg, end;
+    if (!parse_region(region, &chrom, &beg, &end)) {
+        printError("Error parsing region string %s\n", region);
+        release_handle(filename, index, handle);
+        return NULL;
+    }
+
+    // an unknown sequence gives the header only
+    TabixQuery *query = new TabixQuery(filename, index, handle,
+                                       index->get_ref(chrom), beg, end);
+    cookie_io_functions_t funcs = {tabix_cookie_read, NULL, NULL,
+                                   tabix_cookie_close};
+    FILE *stream = fopencookie(query, "r", funcs);
+    if (!stream) {
+        delete query;
+    } else {
+        lock_guard<mutex> guard(tabix_queries_lock);
+        tabix_queries.insert(stream);
+    }
+    return stream;
+}
+
+
 FILE *read_tabix(const char *filename, const char *region,
                  const char *tabix_dir) {
     FILE *pipe;
@@ -19,6 +750,11 @@ FILE *read_tabix(const char *filename, const char *region,
         return read_compress(filename);
     }
 
+    bool indexed;
+    FILE *stream = read_tabix_native(filename, region, &indexed);
+    if (indexed)
+        return stream;
+
     string cmd = "tabix -h " + quote_arg(filename) + " " +  region;
     if (tabix_dir != NULL && strlen(tabix_dir) > 0)
         cmd = string(tabix_dir) + "/" + cmd;
@@ -33,7 +769,170 @@ FILE *read_tabix(const char *filename, const char *region,
 
 
 int close_tabix(FILE *stream) {
-    return pclose(stream);
+    {
+        lock_guard<mutex> guard(tabix_queries_lock);
+        if (tabix_queries.erase(stream) > 0)
+            return fclose(stream);
+    }
+    // whole file reads and tabix pipes
+    return close_compress(stream);
+}
+
+
+//=============================================================================
+// index building
+
+// Returns the smallest bin of a tabix index that contains [beg, end)
+static unsigned int region_bin(int64_t beg, int64_t end)
+{
+    end--;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+    return 0;
+}
+
+
+struct TabixIndexRef
+{
+    map<unsigned int, vector<TabixChunk> > bins;
+    vector<uint64_t> linear;
+};
+
+
+template <class T>
+static void append_value(string &data, T value)
+{
+    data.append((const char*) &value, sizeof(T));
+}
+
+
+bool write_tabix_index(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+
+    BgzfReader reader(file);
+    if (!reader.seek(0)) {
+        printError("'%s' is not bgzipped", filename);
+        fclose(file);
+        return false;
+    }
+    vector<string> names;
+    vector<TabixIndexRef> refs;
+    map<string, int> ref_lookup;
+    const uint64_t unset = UINT64_MAX;
+    bool ok = true;
+    int64_t last_beg = -1;
+    int lineno = 0;
+    string line;
+    uint64_t offset = reader.tell();
+    while (ok && reader.getline(line)) {
+        const uint64_t next = reader.tell();
+        lineno++;
+        if (line.empty() || line[0] == '#') {
+            offset = next;
+            continue;
+        }
+
+        // bed coordinates are 0-based, half-open
+        const size_t tab = line.find('\t');
+        char *p;
+        int64_t beg = -1, end = -1;
+        if (tab != string::npos) {
+            beg = strtoll(line.c_str() + tab + 1, &p, 10);
+            if (*p == '\t')
+                end = strtoll(p + 1, &p, 10);
+        }
+        if (tab == string::npos || tab == 0 || beg < 0 || end < 0) {
+            printError("bad line %d in '%s'", lineno, filename);
+            ok = false;
+            break;
+        }
+        if (end <= beg)
+            end = beg + 1;
+
+        const string chrom = line.substr(0, tab);
+        map<string, int>::iterator it = ref_lookup.find(chrom);
+        if (it == ref_lookup.end()) {
+            it = ref_lookup.insert(make_pair(chrom, (int) names.size())).first;
+            names.push_back(chrom);
+            refs.push_back(TabixIndexRef());
+            last_beg = -1;
+        } else if (it->second != (int) names.size() - 1 || beg < last_beg) {
+            printError("'%s' is not sorted at line %d", filename, lineno);
+            ok = false;
+            break;
+        }
+        last_beg = beg;
+
+        TabixIndexRef &ref = refs[it->second];
+        vector<TabixChunk> &chunks = ref.bins[region_bin(beg, end)];
+        if (!chunks.empty() && chunks.back().end == offset) {
+            chunks.back().end = next;
+        } else {
+            TabixChunk chunk = {offset, next};
+            chunks.push_back(chunk);
+        }
+        const unsigned int last_window = (end - 1) >> 14;
+        if (ref.linear.size() <= last_window)
+            ref.linear.resize(last_window + 1, unset);
+        for (unsigned int w=beg >> 14; w<=last_window; w++)
+            if (ref.linear[w] == unset)
+                ref.linear[w] = offset;
+        offset = next;
+    }
+    fclose(file);
+    if (!ok)
+        return false;
+
+    string data("TBI\1", 4);
+    append_value<int32_t>(data, names.size());
+    const int32_t header[] = {TabixIndex::FORMAT_ZERO_BASED, 1, 2, 3, '#', 0};
+    data.append((const char*) header, sizeof(header));
+    string name_data;
+    for (unsigned int i=0; i<names.size(); i++)
+        name_data.append(names[i].c_str(), names[i].size() + 1);
+    append_value<int32_t>(data, name_data.size());
+    data += name_data;
+    for (unsigned int i=0; i<refs.size(); i++) {
+        TabixIndexRef &ref = refs[i];
+        append_value<int32_t>(data, ref.bins.size());
+        for (map<unsigned int, vector<TabixChunk> >::iterator it=
+                 ref.bins.begin(); it != ref.bins.end(); ++it) {
+            append_value<uint32_t>(data, it->first);
+            append_value<int32_t>(data, it->second.size());
+            for (unsigned int k=0; k<it->second.size(); k++) {
+                append_value<uint64_t>(data, it->second[k].beg);
+                append_value<uint64_t>(data, it->second[k].end);
+            }
+        }
+
+        // windows without records start where the previous ones do
+        uint64_t last = 0;
+        for (unsigned int w=0; w<ref.linear.size(); w++) {
+            if (ref.linear[w] == unset)
+                ref.linear[w] = last;
+            last = ref.linear[w];
+        }
+        append_value<int32_t>(data, ref.linear.size());
+        data.append((const char*) ref.linear.data(),
+                    ref.linear.size() * sizeof(uint64_t));
+    }
+
+    const string index_file = string(filename) + ".tbi";
+    FILE *out = write_compress(index_file.c_str());
+    ok = out && fwrite(data.data(), 1, data.size(), out) == data.size();
+    if (out && close_compress(out) != 0)
+        ok = false;
+    if (!ok)
+        printError("error writing '%s'", index_file.c_str());
+    return ok;
 }
 
 }
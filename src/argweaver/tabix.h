@@ -14,6 +14,10 @@ FILE *read_tabix(const char *filename, const char *region,
                  const char *tabix_dir);
 int close_tabix(FILE *stream);
 
+// Writes a tabix index (filename.tbi) for a sorted, bgzipped bed file, as
+// 'tabix -p bed' does
+bool write_tabix_index(const char *filename);
+
 class TabixStream
 {
 public:
@@ -2,6 +2,7 @@
 #include "thread.h"
 #include "trans.h"
 #include "model.h"
+#include "profile.h"
 
 namespace argweaver {
 
@@ -342,6 +343,7 @@ void add_arg_thread(LocalTrees *trees, const StatesModel &states_model,
                     vector<int> &recomb_pos, vector<Spr> &recombs,
 		    const PopulationTree *pop_tree)
 {
+    PROFILE_SCOPE(PROFILE_ADD_THREAD);
     unsigned int irecomb = 0;
     int nleaves = trees->get_num_leaves();
     int nnodes = trees->nnodes;
@@ -500,6 +502,7 @@ void add_arg_thread(LocalTrees *trees, const StatesModel &states_model,
 void remove_arg_thread(LocalTrees *trees, int remove_seqid,
                        const ArgModel *model)
 {
+    PROFILE_SCOPE(PROFILE_REMOVE_THREAD);
     int nnodes = trees->nnodes;
     int nleaves = trees->get_num_leaves();
     int displace[nnodes];
@@ -832,7 +835,7 @@ void sample_arg_removal_path_forward(
             if (next_nodes[1] == -1)
                 j = 0;
             else
-                j = int(rand() < prob_switch);
+                j = int(rand_next() < prob_switch);
             path[i++] = next_nodes[j];
 
             // ensure that a removal path re-enters the local tree correctly
@@ -869,7 +872,7 @@ void sample_arg_removal_path_backward(
         if (prev_nodes[1] == -1)
             j = 0;
         else
-            j = int(rand() < prob_switch);
+            j = int(rand_next() < prob_switch);
         path[i--] = prev_nodes[j];
 
         spr2 = &it->spr;
@@ -1028,6 +1031,7 @@ void count_arg_removal_paths(const LocalTrees *trees,
 {
     const int ntrees = trees->get_num_trees();
     const int nnodes = trees->nnodes;
+    removal_paths.alloc(trees);
     double **counts = removal_paths.counts;
     RemovalPaths::next_row **backptrs = removal_paths.backptrs;
 
@@ -1142,10 +1146,18 @@ double sample_arg_removal_path_uniform(const LocalTrees *trees, int *path)
     // compute path counts table
     RemovalPaths removal_paths(trees);
     count_arg_removal_paths(trees, removal_paths);
+    return sample_arg_removal_path_uniform(removal_paths, path);
+}
+
 
+// sample a removal path uniformly from the paths counted in removal_paths
+// and return total path count
+double sample_arg_removal_path_uniform(const RemovalPaths &removal_paths,
+                                       int *path)
+{
     // convenience variables
-    const int ntrees = trees->get_num_trees();
-    const int nnodes = trees->nnodes;
+    const int ntrees = removal_paths.ntrees;
+    const int nnodes = removal_paths.nnodes;
     double **counts = removal_paths.counts;
     RemovalPaths::next_row **backptrs = removal_paths.backptrs;
 
@@ -1534,6 +1546,7 @@ void add_arg_thread_path(LocalTrees *trees, const StatesModel &states_model,
                          vector<int> &recomb_pos, vector<Spr> &recombs,
 			 const PopulationTree *pop_tree)
 {
+    PROFILE_SCOPE(PROFILE_ADD_THREAD);
     States states;
     LocalTree *last_tree = NULL;
     State last_state;
@@ -1718,6 +1731,7 @@ void remove_arg_thread_path(LocalTrees *trees, const int *removal_path,
                             int maxtime, const PopulationTree *pop_tree,
                             int *original_thread)
 {
+    PROFILE_SCOPE(PROFILE_REMOVE_THREAD);
     LocalTree *tree = NULL;
     State *original_states = NULL;
 #ifdef DEBUG
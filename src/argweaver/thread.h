@@ -52,19 +52,30 @@ void remove_arg_thread_path(LocalTrees *trees, const int *removal_path,
 // removal paths
 
 
+// Counts of the removal paths of an ARG.  counts[i][j] is the log number
+// of removal paths ending at node j of tree i, and backptrs[i][j] are the
+// nodes of tree i-1 that those paths can come from.  The tables are kept
+// when they are filled again for an ARG with as many nodes and at most as
+// many trees, so that one object can be reused across proposals.
 class RemovalPaths
 {
 public:
     RemovalPaths(const LocalTrees *trees) :
+        nnodes(0),
+        ntrees(0),
         counts(NULL),
-        backptrs(NULL)
+        backptrs(NULL),
+        max_trees(0)
     {
         alloc(trees);
     }
 
     RemovalPaths(int nnodes, int ntrees) :
+        nnodes(0),
+        ntrees(0),
         counts(NULL),
-        backptrs(NULL)
+        backptrs(NULL),
+        max_trees(0)
     {
         alloc(nnodes, ntrees);
     }
@@ -83,26 +94,41 @@ public:
 
     void alloc(int _nnodes, int _ntrees)
     {
+        if (counts && _nnodes == nnodes && _ntrees <= max_trees) {
+            ntrees = _ntrees;
+            return;
+        }
         clear();
 
         nnodes = _nnodes;
         ntrees = _ntrees;
+        max_trees = ntrees + ntrees / 4;
 
         // allocate path counts and traceback tables
-        counts = new_matrix<double>(ntrees, nnodes);
-        backptrs = new_matrix<next_row>(ntrees, nnodes);
+        counts = new_matrix<double>(max_trees, nnodes);
+        backptrs = new_matrix<next_row>(max_trees, nnodes);
     }
 
     void clear()
     {
         if (counts) {
-            delete_matrix<double>(counts, ntrees);
+            delete_matrix<double>(counts, max_trees);
             counts = NULL;
         }
         if (backptrs) {
-            delete_matrix<next_row>(backptrs, ntrees);
+            delete_matrix<next_row>(backptrs, max_trees);
             backptrs = NULL;
         }
+        max_trees = 0;
+    }
+
+    void swap(RemovalPaths &other)
+    {
+        std::swap(nnodes, other.nnodes);
+        std::swap(ntrees, other.ntrees);
+        std::swap(counts, other.counts);
+        std::swap(backptrs, other.backptrs);
+        std::swap(max_trees, other.max_trees);
     }
 
 
@@ -110,6 +136,9 @@ public:
     int ntrees;
     double **counts;
     next_row **backptrs;
+
+protected:
+    int max_trees;  // number of allocated rows
 };
 
 
@@ -123,7 +152,7 @@ void sample_arg_removal_leaf_path(const LocalTrees *trees, int node, int *path);
 void sample_arg_removal_path_recomb(
     const LocalTrees *trees, double recomb_preference, int *path);
 
-// count number of removal paths
+// count number of removal paths, sizing removal_paths for trees
 void count_arg_removal_paths(const LocalTrees *trees,
                              RemovalPaths &removal_paths);
 
@@ -132,6 +161,9 @@ double count_total_arg_removal_paths(const RemovalPaths &removal_paths);
 
 // sample a removal path uniformly from all paths and return total path count
  double sample_arg_removal_path_uniform(const LocalTrees *trees, int *path);
+ // same, from the counts of count_arg_removal_paths()
+ double sample_arg_removal_path_uniform(const RemovalPaths &removal_paths,
+                                        int *path);
 
 // return the removal path relating to a particular haplotypes ancestry
 // during the time span between time_interval and time_interval+1
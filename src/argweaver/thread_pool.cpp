@@ -0,0 +1,178 @@
+
+#include "thread_pool.h"
+
+
+namespace argweaver {
+
+// true while the calling thread runs a task of a pool
+static thread_local bool in_pool_task = false;
+
+
+ThreadPool::ThreadPool(int nthreads) :
+    nthreads(max(nthreads, 1)),
+    task(NULL),
+    ntasks(0),
+    next_task(0),
+    ndone(0),
+    batch(0),
+    stop(false)
+{
+    for (int i=1; i<this->nthreads; i++)
+        workers.push_back(thread(&ThreadPool::worker, this));
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    start_cond.notify_all();
+    for (unsigned int i=0; i<workers.size(); i++)
+        workers[i].join();
+}
+
+
+void ThreadPool::run(int ntasks, const function<void(int)> &task)
+{
+    if (ntasks <= 0)
+        return;
+
+    // a task that splits its own work runs it inline, since the pool is
+    // busy with the batch of the task
+    if (in_pool_task) {
+        for (int i=0; i<ntasks; i++)
+            task(i);
+        return;
+    }
+
+    lock_guard<mutex> run_guard(run_lock);
+    unique_lock<mutex> guard(lock);
+    this->task = &task;
+    this->ntasks = ntasks;
+    next_task = 0;
+    ndone = 0;
+    batch++;
+    start_cond.notify_all();
+
+    // the calling thread works too
+    run_tasks(guard);
+    while (ndone < ntasks)
+        done_cond.wait(guard);
+    this->task = NULL;
+}
+
+
+// claim and run tasks of the current batch until none are left
+void ThreadPool::run_tasks(unique_lock<mutex> &guard)
+{
+    while (task && next_task < ntasks) {
+        const function<void(int)> &func = *task;
+        int i = next_task++;
+        guard.unlock();
+        in_pool_task = true;
+        func(i);
+        in_pool_task = false;
+        guard.lock();
+        if (++ndone == ntasks)
+            done_cond.notify_all();
+    }
+}
+
+
+void ThreadPool::worker()
+{
+    unique_lock<mutex> guard(lock);
+    unsigned int seen = batch;
+    while (true) {
+        while (!stop && batch == seen)
+            start_cond.wait(guard);
+        if (stop)
+            return;
+        seen = batch;
+        run_tasks(guard);
+    }
+}
+
+
+TaskQueue::TaskQueue(int capacity) :
+    capacity(max(capacity, 1)),
+    busy(false),
+    stop(false)
+{}
+
+
+TaskQueue::~TaskQueue()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    cond.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+
+void TaskQueue::post(const function<void()> &task)
+{
+    unique_lock<mutex> guard(lock);
+    if (!thread_.joinable())
+        thread_ = thread(&TaskQueue::worker, this);
+    while (tasks.size() >= capacity)
+        cond.wait(guard);
+    tasks.push_back(task);
+    cond.notify_all();
+}
+
+
+void TaskQueue::wait()
+{
+    unique_lock<mutex> guard(lock);
+    while (busy || !tasks.empty())
+        cond.wait(guard);
+}
+
+
+// runs tasks until the queue is stopped and empty
+void TaskQueue::worker()
+{
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        while (!stop && tasks.empty())
+            cond.wait(guard);
+        if (tasks.empty())
+            return;
+        function<void()> task = tasks.front();
+        tasks.pop_front();
+        busy = true;
+        cond.notify_all();
+        guard.unlock();
+        task();
+        guard.lock();
+        busy = false;
+        cond.notify_all();
+    }
+}
+
+
+// Pools are never deleted, since another thread may still be running a
+// batch on a pool when a different size is asked for
+ThreadPool *get_thread_pool(int nthreads)
+{
+    static map<int, ThreadPool*> pools;
+    static mutex pool_lock;
+
+    if (nthreads <= 1)
+        return NULL;
+
+    lock_guard<mutex> guard(pool_lock);
+    ThreadPool *&pool = pools[nthreads];
+    if (!pool)
+        pool = new ThreadPool(nthreads);
+    return pool;
+}
+
+
+} // namespace argweaver
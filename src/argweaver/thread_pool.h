@@ -0,0 +1,95 @@
+//=============================================================================
+// Pool of worker threads for splitting loops across cores
+
+#ifndef ARGWEAVER_THREAD_POOL_H
+#define ARGWEAVER_THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// A fixed set of worker threads.  run() executes a batch of independent
+// tasks on the workers and the calling thread and returns once all tasks
+// are done.  Batches from different callers are run one at a time, and
+// a task that calls run() itself runs the nested tasks inline.
+class ThreadPool
+{
+public:
+    // nthreads includes the calling thread, so nthreads-1 workers are started
+    ThreadPool(int nthreads);
+    ~ThreadPool();
+
+    // calls task(i) for i in [0, ntasks)
+    void run(int ntasks, const function<void(int)> &task);
+
+    int get_num_threads() const {
+        return nthreads;
+    }
+
+protected:
+    void worker();
+    void run_tasks(unique_lock<mutex> &guard);
+
+    int nthreads;
+    vector<thread> workers;
+
+    mutex run_lock;      // held for the duration of a batch
+    mutex lock;          // protects the batch state below
+    condition_variable start_cond;
+    condition_variable done_cond;
+    const function<void(int)> *task;
+    int ntasks;
+    int next_task;
+    int ndone;
+    unsigned int batch;  // incremented for each batch
+    bool stop;
+};
+
+
+// A background thread running tasks one at a time in the order they were
+// posted.  At most 'capacity' tasks wait to run; post() blocks while the
+// queue is full, which bounds the memory held by pending tasks.
+class TaskQueue
+{
+public:
+    TaskQueue(int capacity=1);
+    ~TaskQueue();
+
+    void post(const function<void()> &task);
+
+    // waits until all posted tasks are done
+    void wait();
+
+protected:
+    void worker();
+
+    unsigned int capacity;
+    deque<function<void()> > tasks;
+    bool busy;
+    bool stop;
+    mutex lock;
+    condition_variable cond;
+    thread thread_;
+};
+
+
+// Returns a process wide pool with 'nthreads' threads, or NULL if
+// nthreads <= 1.  There is one pool for each size asked for, kept until
+// the process exits.
+ThreadPool *get_thread_pool(int nthreads);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_THREAD_POOL_H
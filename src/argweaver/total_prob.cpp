@@ -1,5 +1,9 @@
 // c++ includes
+#include <algorithm>
+#include <functional>
 #include <list>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <string.h>
 
@@ -8,6 +12,7 @@
 #include "emit.h"
 #include "local_tree.h"
 #include "sequences.h"
+#include "thread_pool.h"
 #include "trans.h"
 #include "total_prob.h"
 
@@ -16,6 +21,189 @@ using namespace std;
 namespace argweaver {
 
 
+//=============================================================================
+// splitting per-tree terms across threads
+
+// fewest trees given to one thread
+const int MIN_THREAD_TREES = 20;
+
+
+// A local tree and its block, clipped to a region
+class TreeBlock
+{
+public:
+    LocalTrees::const_iterator it;
+    int start;
+    int end;
+};
+
+
+// Lists the blocks of the trees overlapping [start_coord, end_coord)
+static void get_tree_blocks(const LocalTrees *trees,
+                            int start_coord, int end_coord,
+                            vector<TreeBlock> &blocks)
+{
+    int end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
+        int start = end;
+        end = start + it->blocklen;
+        if (end <= start_coord) continue;
+        if (start >= end_coord) break;
+        TreeBlock block;
+        block.it = it;
+        block.start = max(start, start_coord);
+        block.end = min(end, end_coord);
+        blocks.push_back(block);
+    }
+}
+
+
+// Returns the number of runs of blocks that sum_block_terms() gives to
+// threads
+static int get_num_block_chunks(int nthreads, int nblocks)
+{
+    ThreadPool *pool = get_thread_pool(nthreads);
+    return (pool ? max(1, min(pool->get_num_threads(),
+                              nblocks / MIN_THREAD_TREES)) : 1);
+}
+
+
+// Returns lnl plus the terms that block_terms(chunk, first, last, terms)
+// appends for the blocks [first, last) of run 'chunk'.  Runs of blocks are
+// given to threads, and the terms are added in block order, so the sum is
+// the same as that of a single loop over the trees for any number of
+// threads.
+static double sum_block_terms(
+    int nthreads, int nblocks,
+    const function<void(int chunk, int first, int last,
+                        vector<double> &terms)> &block_terms,
+    double lnl=0.0)
+{
+    ThreadPool *pool = get_thread_pool(nthreads);
+    const int nchunks = get_num_block_chunks(nthreads, nblocks);
+    vector<vector<double> > terms(nchunks);
+    auto run_chunk = [&](int chunk) {
+        block_terms(chunk, long(nblocks) * chunk / nchunks,
+                    long(nblocks) * (chunk + 1) / nchunks, terms[chunk]);
+    };
+    if (nchunks > 1)
+        pool->run(nchunks, run_chunk);
+    else
+        run_chunk(0);
+
+    for (int chunk=0; chunk<nchunks; chunk++)
+        for (unsigned int i=0; i<terms[chunk].size(); i++)
+            lnl += terms[chunk][i];
+    return lnl;
+}
+
+
+//=============================================================================
+// keys of cached prior terms
+
+template <class T>
+static inline void append_key(string &key, const T *values, int n)
+{
+    key.append((const char*) values, n * sizeof(T));
+}
+
+
+// Appends the parts of a model that the prior terms of one block depend
+// on, other than its local recombination rate.  Population paths are
+// given by their populations and migration rates, which are resampled in
+// place.
+static void append_prior_model_key(string &key, const ArgModel *model)
+{
+    const int ntimes = model->ntimes;
+    const int npops = model->num_pops();
+    const int npaths = model->num_pop_paths();
+    int sizes[] = {ntimes, npops, npaths, model->smc_prime};
+    append_key(key, sizes, 4);
+    append_key(key, model->times, ntimes);
+    append_key(key, model->time_steps, ntimes);
+    append_key(key, model->coal_time_steps, 2*ntimes-1);
+    for (int pop=0; pop<npops; pop++)
+        for (int i=0; i<2*ntimes-1; i++) {
+            double rate = model->coal_rate(pop, i);
+            append_key(key, &rate, 1);
+        }
+
+    const PopulationTree *pop_tree = model->pop_tree;
+    if (pop_tree) {
+        for (int path=0; path<npaths; path++)
+            for (int t=0; t<ntimes; t++) {
+                int pop = pop_tree->path_pop(path, t);
+                append_key(key, &pop, 1);
+            }
+        for (unsigned int t=0; t<pop_tree->mig_matrix.size(); t++) {
+            const MigMatrix &mig = pop_tree->mig_matrix[t];
+            append_key(key, &mig.npop, 1);
+            for (int a=0; a<mig.npop; a++)
+                for (int b=0; b<mig.npop; b++) {
+                    double rate = mig.get(a, b);
+                    append_key(key, &rate, 1);
+                }
+        }
+    }
+}
+
+
+// Returns an id of a model key, the same for equal keys.  The keys of a
+// few recent models are kept, and ids are never reused, so blocks keep a
+// short id instead of the key of their model.
+static int64_t get_prior_model_id(const string &model_key)
+{
+    const unsigned int MAX_MODELS = 8;
+    static list<pair<string, int64_t> > models;
+    static int64_t next_id = 1;
+    static mutex lock;
+
+    lock_guard<mutex> guard(lock);
+    for (list<pair<string, int64_t> >::iterator it=models.begin();
+         it != models.end(); ++it) {
+        if (it->first == model_key) {
+            models.splice(models.begin(), models, it);
+            return it->second;
+        }
+    }
+    models.push_front(make_pair(model_key, next_id++));
+    if (models.size() > MAX_MODELS)
+        models.pop_back();
+    return models.front().second;
+}
+
+
+// Returns the key of the prior terms of the block [start, end) of tree
+// 'it', which is followed by 'next_spr' unless it is last
+static void get_prior_block_key(string &key, int64_t model_id,
+                                LocalTrees::const_iterator it,
+                                int start, int end, bool last,
+                                const Spr *next_spr, double rho)
+{
+    const LocalTree *tree = it->tree;
+    key.clear();
+    append_key(key, &model_id, 1);
+    int header[] = {start, end, last, tree->nnodes, tree->root};
+    append_key(key, header, 5);
+    append_key(key, &rho, 1);
+    for (int i=0; i<tree->nnodes; i++) {
+        const LocalNode &n = tree->nodes[i];
+        int node[] = {n.parent, n.child[0], n.child[1], n.age, n.pop_path};
+        append_key(key, node, 5);
+    }
+    if (next_spr) {
+        int spr[] = {next_spr->recomb_node, next_spr->recomb_time,
+                     next_spr->coal_node, next_spr->coal_time,
+                     next_spr->pop_path};
+        append_key(key, spr, 5);
+    }
+}
+
+
+//=============================================================================
+// ARG likelihood
+
+
 double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees, int start_coord, int end_coord)
 {
@@ -31,29 +219,39 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
         return lnl += log(.25) * (end_coord - start_coord);
 
     // get sequences for trees
-    char *seqs[nseqs];
+    vector<const char*> seqs(nseqs);
     for (int j=0; j<nseqs; j++)
         seqs[j] = sequences->seqs[trees->seqids[j]];
 
-    int end = trees->start_coord;
-    int mu_idx = 0, rho_idx = 0;
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
-        int start = end;
-        end = start + it->blocklen;
-        if (end <= start_coord) continue;
-        if (start >= end_coord) break;
-        if (start < start_coord) start = start_coord;
-        if (end > end_coord) end = end_coord;
-        LocalTree *tree = it->tree;
-        ArgModel local_model;
-
-        //note: this is approximate, uses mu/rho from center of block
-        model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
-        lnl += likelihood_tree(tree, &local_model, seqs, sequences->base_probs,
-                               nseqs, start, end);
-    }
-
-    return lnl;
+    vector<TreeBlock> blocks;
+    get_tree_blocks(trees, start_coord, end_coord, blocks);
+    return sum_block_terms(model->nthreads, blocks.size(),
+                           [&](int chunk, int first, int last,
+                               vector<double> &terms) {
+        int mu_idx = 0, rho_idx = 0;
+        int order[trees->nnodes];
+        const LocalTree *last_tree = NULL;
+        for (int i=first; i<last; i++) {
+            const TreeBlock &block = blocks[i];
+            LocalTree *tree = block.it->tree;
+            ArgModel local_model;
+
+            // carry the postorder across the SPR when node names are kept
+            if (last_tree &&
+                is_spr_mapping(last_tree, block.it->spr, block.it->mapping))
+                update_postorder(tree, block.it->spr, order);
+            else
+                tree->get_postorder(order);
+            last_tree = tree;
+
+            //note: this is approximate, uses mu/rho from center of block
+            model->get_local_model((block.start+block.end)/2, local_model,
+                                   &mu_idx, &rho_idx);
+            terms.push_back(likelihood_tree(
+                tree, &local_model, seqs.data(), sequences->base_probs,
+                nseqs, block.start, block.end, order));
+        }
+    });
 }
 
 
@@ -83,81 +281,90 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
     if (trees->nnodes < 3)
         return lnl += log(.25) * (end_coord - start_coord);
 
-    bool have_base_probs = ( sequences->base_probs.size() > 0 );
-    vector<vector<BaseProbs> > base_probs;
-    if (have_base_probs) {
-        for (int j=0; j < nseqs; j++) {
-            base_probs.push_back(vector<BaseProbs>());
-        }
-    }
-
-    int end = trees->start_coord;
-    int mu_idx = 0;
-    int rho_idx = 0;
-    int mask_pos=0;
-    bool mask_sorted = maskmap_uncompressed->is_sorted();
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
-        int start = end;
-        end = start + it->blocklen;
-        if (end <= start_coord) continue;
-        if (start >= end_coord) break;
-        if (start < start_coord)
-            start = start_coord;
-        if (end > end_coord)
-            end = end_coord;
-        int blocklen = end - start;
-        LocalTree *tree = it->tree;
+    const bool have_base_probs = ( sequences->base_probs.size() > 0 );
+    const bool mask_sorted = maskmap_uncompressed->is_sorted();
+    const vector<int> &all_sites = sites_mapping->all_sites;
 
-
-        // get sequences for trees
-        char *seqs[nseqs];
-        char *matrix = new char [blocklen*nseqs];
-        for (int j=0; j<nseqs; j++)
-            seqs[j] = &matrix[j*blocklen];
+    vector<TreeBlock> blocks;
+    get_tree_blocks(trees, start_coord, end_coord, blocks);
+    return sum_block_terms(model->nthreads, blocks.size(),
+                           [&](int chunk, int first, int last,
+                               vector<double> &terms) {
+        vector<vector<BaseProbs> > base_probs;
         if (have_base_probs) {
-            for (int j=0; j < nseqs; j++) base_probs[j].clear();
+            for (int j=0; j < nseqs; j++) {
+                base_probs.push_back(vector<BaseProbs>());
+            }
         }
 
-
-        // find first site within this block
-        unsigned int i2 = 0;
-
-        // copy sites into new alignment
-        for (int i=start; i<end; i++) {
-            while (i2 < sites_mapping->all_sites.size() &&
-                   sites_mapping->all_sites[i2] < i)
-                i2++;
-            if (i2 < sites_mapping->all_sites.size() &&
-                i == sites_mapping->all_sites[i2]) {
-                // copy site
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = sequences->seqs[trees->seqids[j]][i2];
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(sequences->base_probs[trees->seqids[j]][i2]));
-                }
-            } else {
-                // copy non-variant site
-                char c=default_char;
-                if (maskmap_uncompressed->find(i, &mask_pos, mask_sorted))
-                    c='N';
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = c;
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(default_char));
-                }
+        int mu_idx = 0;
+        int rho_idx = 0;
+        int mask_pos=0;
+        int order[trees->nnodes];
+        const LocalTree *last_tree = NULL;
+        for (int b=first; b<last; b++) {
+            const int start = blocks[b].start;
+            const int end = blocks[b].end;
+            const int blocklen = end - start;
+            const LocalTrees::const_iterator it = blocks[b].it;
+            LocalTree *tree = it->tree;
+
+
+            // get sequences for trees
+            vector<char*> seqs(nseqs);
+            char *matrix = new char [blocklen*nseqs];
+            for (int j=0; j<nseqs; j++)
+                seqs[j] = &matrix[j*blocklen];
+            if (have_base_probs) {
+                for (int j=0; j < nseqs; j++) base_probs[j].clear();
             }
-        }
 
-        ArgModel local_model;
-        model->get_local_model((start+end)/2, local_model,
-                               &mu_idx, &rho_idx);
-        lnl += likelihood_tree(tree, &local_model, seqs, base_probs,
-                               nseqs, 0, end-start);
 
-        delete [] matrix;
-    }
+            // find first site within this block
+            unsigned int i2 = lower_bound(all_sites.begin(), all_sites.end(),
+                                          start) - all_sites.begin();
+
+            // copy sites into new alignment
+            for (int i=start; i<end; i++) {
+                while (i2 < all_sites.size() && all_sites[i2] < i)
+                    i2++;
+                if (i2 < all_sites.size() && i == all_sites[i2]) {
+                    // copy site
+                    for (int j=0; j<nseqs; j++) {
+                        seqs[j][i-start] = sequences->seqs[trees->seqids[j]][i2];
+                        if (have_base_probs)
+                            base_probs[j].push_back(BaseProbs(sequences->base_probs[trees->seqids[j]][i2]));
+                    }
+                } else {
+                    // copy non-variant site
+                    char c=default_char;
+                    if (maskmap_uncompressed->find(i, &mask_pos, mask_sorted))
+                        c='N';
+                    for (int j=0; j<nseqs; j++) {
+                        seqs[j][i-start] = c;
+                        if (have_base_probs)
+                            base_probs[j].push_back(BaseProbs(default_char));
+                    }
+                }
+            }
 
-    return lnl;
+            // carry the postorder across the SPR when node names are kept
+            if (last_tree && is_spr_mapping(last_tree, it->spr, it->mapping))
+                update_postorder(tree, it->spr, order);
+            else
+                tree->get_postorder(order);
+            last_tree = tree;
+
+            ArgModel local_model;
+            model->get_local_model((start+end)/2, local_model,
+                                   &mu_idx, &rho_idx);
+            terms.push_back(likelihood_tree(tree, &local_model, seqs.data(),
+                                            base_probs, nseqs, 0, end-start,
+                                            order));
+
+            delete [] matrix;
+        }
+    });
 }
 
 //=============================================================================
@@ -286,8 +493,7 @@ void calc_coal_rates_spr_self(const ArgModel *model, const LocalTree *tree,
     for (int i=0; i <= root_age*2; i++) {
         int pop = model->get_pop(pop_path, (i+1)/2);
         int nbranches = lineages.nbranches_pop[pop][i];
-        coal_rates[i] = model->coal_time_steps[i] * nbranches /
-            (2.0 * model->popsizes[pop][i]);
+        coal_rates[i] = model->coal_rate(pop, i) * nbranches;
     }
 }
 
@@ -311,8 +517,7 @@ void calc_coal_rates_spr(const ArgModel *model, const LocalTree *tree,
             coal_rates[i]=0;
             continue;
         }
-        coal_rates[i] = model->coal_time_steps[i] * nbranches /
-            (2.0 * model->popsizes[spr_pop][i]);
+        coal_rates[i] = model->coal_rate(spr_pop, i) * nbranches;
 	if (coal_rates[i] < 0) {
 	    assert(0);
 	}
@@ -496,82 +701,275 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
     if (end_coord < 0 || end_coord > trees->end_coord)
         end_coord = trees->end_coord;
 
-    int next_self_pos = ( num_invis == 0 ?
-                          trees->end_coord + 1 : invisible_recomb_pos[0] );
-    int self_idx = 0;
-    while (start_coord > next_self_pos) {
-        self_idx++;
-        if (self_idx == num_invis) {
-            next_self_pos = trees->end_coord + 1;
-            break;
-        }
-        next_self_pos = invisible_recomb_pos[self_idx];
-    }
-
     // first tree prior
         if (start_coord <= trees->start_coord)
         lnl += calc_log_tree_prior(model, trees->front().tree, lineages);
     //    printLog(LOG_MEDIUM, "tree_prior: %f\n", lnl);
 
-    int end = trees->start_coord;
-    int mu_idx = 0, rho_idx = 0;
-    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
-        int start=end;
-        end += it->blocklen;
-        if (end <= start_coord) {++it; continue;}
-        if (start >= end_coord) break;
-        if (start < start_coord)
-            start = start_coord;
-        if (end > end_coord)
-            end = end_coord;
-        int last_pos = start;
-        LocalTree *tree = it->tree;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
-        ArgModel local_model;
-        model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
-        lineages.count(tree, model->pop_tree);
+    vector<TreeBlock> blocks;
+    get_tree_blocks(trees, start_coord, end_coord, blocks);
+
+    // each run of blocks counts coalescences into arrays of its own, which
+    // are added up afterwards.  Counts are in halves, so that the totals
+    // do not depend on the number of threads.
+    const int npops = model->num_pops();
+    const int ncounts = 2 * model->ntimes - 1;
+    const int nchunks = get_num_block_chunks(model->nthreads, blocks.size());
+    vector<vector<double> > chunk_counts(
+        num_coal != NULL ? nchunks : 0,
+        vector<double>(2 * npops * ncounts, 0.0));
+
+    // the terms of each block are cached on its tree when no counts are
+    // requested, so that only the blocks that changed since the last call
+    // are computed again
+    const bool use_cache = (num_coal == NULL);
+    int64_t model_id = 0;
+    if (use_cache) {
+        string model_key;
+        append_prior_model_key(model_key, model);
+        model_id = get_prior_model_id(model_key);
+    }
 
-        // not sure what this is for but it is only used for non-SMC' calcs
-        lineages.nrecombs[tree->nodes[tree->root].age]--;
+    lnl = sum_block_terms(model->nthreads, blocks.size(),
+                          [&](int chunk, int first, int last,
+                              vector<double> &terms) {
+        if (first == last)
+            return;
+        LineageCounts lineages(model->ntimes, model->num_pops());
+        double *coal_alloc[2 * npops];
+        double **chunk_coal = NULL, **chunk_nocoal = NULL;
+        if (!chunk_counts.empty()) {
+            for (int i=0; i<2*npops; i++)
+                coal_alloc[i] = &chunk_counts[chunk][i * ncounts];
+            chunk_coal = coal_alloc;
+            chunk_nocoal = coal_alloc + npops;
+        }
+
+        // first invisible recombination within these blocks
+        int self_idx = lower_bound(invisible_recomb_pos.begin(),
+                                   invisible_recomb_pos.end(),
+                                   blocks[first].start) -
+            invisible_recomb_pos.begin();
+        int next_self_pos = ( self_idx == num_invis ?
+                              end_coord + 1 : invisible_recomb_pos[self_idx] );
+
+        int mu_idx = 0, rho_idx = 0;
+        const LocalTree *last_tree = NULL;
+        string key;
+        for (int b=first; b<last; b++) {
+            const int start = blocks[b].start;
+            const int end = blocks[b].end;
+            LocalTrees::const_iterator it = blocks[b].it;
+            int last_pos = start;
+            LocalTree *tree = it->tree;
+            ArgModel local_model;
+            model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
+
+            key.clear();
+            if (use_cache && next_self_pos >= end) {
+                const bool last_block = (end >= end_coord);
+                LocalTrees::const_iterator next = it;
+                const Spr *next_spr = last_block ? NULL : &(++next)->spr;
+                get_prior_block_key(key, model_id, it, start, end,
+                                    last_block, next_spr, local_model.rho);
+                if (it->prior_key == key) {
+                    terms.push_back(it->prior_terms[0]);
+                    if (!last_block)
+                        terms.push_back(it->prior_terms[1]);
+                    // lineages are counted again at the next computed block
+                    last_tree = NULL;
+                    continue;
+                }
+            }
+
+            double treelen = get_treelen(tree, model->times, model->ntimes, false);
+            if (last_tree && it->mapping) {
+                // undo the adjustment below and update counts across the SPR
+                lineages.nrecombs[last_tree->nodes[last_tree->root].age]++;
+                lineages.update(last_tree, tree, it->mapping, model->pop_tree);
+            } else {
+                lineages.count(tree, model->pop_tree);
+            }
+            last_tree = tree;
+
+            // not sure what this is for but it is only used for non-SMC' calcs
+            lineages.nrecombs[tree->nodes[tree->root].age]--;
+
+            // calculate probability P(blocklen | T_{i-1})
+            double recomb_rate = max(local_model.rho * treelen, local_model.rho);
+
+            while (next_self_pos < end) {
+                terms.push_back(log(recomb_rate) -
+                                recomb_rate * (next_self_pos - last_pos));
+                last_pos = next_self_pos;
+                terms.push_back(calc_log_spr_prob(
+                    &local_model, tree, invisible_recombs[self_idx],
+                    lineages, treelen, chunk_coal, chunk_nocoal, 1.0, true));
+                self_idx++;
+                if (self_idx == num_invis) {
+                    next_self_pos = end_coord + 1;
+                } else {
+                    next_self_pos = invisible_recomb_pos[self_idx];
+                }
+            }
 
-        // calculate probability P(blocklen | T_{i-1})
-        double recomb_rate = max(local_model.rho * treelen, local_model.rho);
 
-        while (next_self_pos < end) {
-            lnl += log(recomb_rate) - recomb_rate * (next_self_pos - last_pos);
-            last_pos = next_self_pos;
-            lnl += calc_log_spr_prob(&local_model, tree, invisible_recombs[self_idx],
-                                     lineages, treelen, num_coal, num_nocoal, 1.0, true);
-            self_idx++;
-            if (self_idx == num_invis) {
-                next_self_pos = end_coord + 1;
+
+            if (end < end_coord) {
+                // not last block
+                // probability of recombining after blocklen
+                terms.push_back(log(recomb_rate) - recomb_rate * (end - last_pos));
+
+                // get SPR move information
+                ++it;
+                const Spr *spr = &it->spr;
+                terms.push_back(calc_log_spr_prob(
+                    &local_model, tree, *spr, lineages, treelen,
+                    chunk_coal, chunk_nocoal, 1.0, true));
+                --it;
+
             } else {
-                next_self_pos = invisible_recomb_pos[self_idx];
+                // last block
+                // probability of not recombining after blocklen
+                terms.push_back(- recomb_rate * (end - last_pos));
+            }
+
+            if (!key.empty()) {
+                const int nterms = (end < end_coord ? 2 : 1);
+                for (int i=0; i<nterms; i++)
+                    it->prior_terms[i] = terms[terms.size() - nterms + i];
+                it->prior_key = key;
             }
         }
+    }, lnl);
+
+    for (unsigned int chunk=0; chunk<chunk_counts.size(); chunk++) {
+        for (int pop=0; pop<npops; pop++) {
+            for (int i=0; i<ncounts; i++) {
+                num_coal[pop][i] += chunk_counts[chunk][pop * ncounts + i];
+                num_nocoal[pop][i] +=
+                    chunk_counts[chunk][(npops + pop) * ncounts + i];
+            }
+        }
+    }
+    return lnl;
+}
 
+//=============================================================================
+// ARG prior as a function of population sizes
 
+// Returns the branches that an SPR may coalesce with in half interval i,
+// as counted by calc_coal_rates_spr() for a model of one population
+static int get_spr_nbranches(const ArgModel *model, const LineageCounts &lineages,
+                             int broken_age, int i)
+{
+    const int nbranches = lineages.nbranches_pop[0][i]
+        - int((!model->smc_prime) && i/2 < broken_age);
+    return max(nbranches, 0);
+}
 
-        if (end < end_coord) {
-            // not last block
-            // probability of recombining after blocklen
-	    lnl += log(recomb_rate) - recomb_rate * (end - last_pos);
 
-            // get SPR move information
-            ++it;
-            const Spr *spr = &it->spr;
-            lnl += calc_log_spr_prob(&local_model, tree, *spr, lineages, treelen,
-                                     num_coal, num_nocoal, 1.0, true);
+void ArgPriorStats::count(const ArgModel *model, const LocalTrees *trees)
+{
+    assert(model->pop_tree == NULL);
+    const int ntimes = model->ntimes;
+    fixed = 0.0;
+    first_a.assign(ntimes - 1, 0);
+    first_b.assign(ntimes - 1, 0);
+    nocoal.assign(2 * ntimes - 1, 0.0);
+    coals.clear();
+
+    // the first tree prior only depends on its lineage counts
+    LineageCounts lineages(ntimes, model->num_pops());
+    lineages.count(trees->front().tree, model->pop_tree);
+    for (int i=0; i<ntimes-1; i++) {
+        first_a[i] = (lineages.ncoals_pop[0][i] +
+                      lineages.nbranches_pop[0][2*i]) / 2;
+        first_b[i] = lineages.nbranches_pop[0][2*i];
+    }
 
+    // the terms of each SPR without coalescence rates are its probability
+    // less the terms with them
+    int end = trees->start_coord;
+    int mu_idx = 0, rho_idx = 0;
+    const LocalTree *last_tree = NULL;
+    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end();) {
+        const int start = end;
+        end += it->blocklen;
+        LocalTree *tree = it->tree;
+        double treelen = get_treelen(tree, model->times, ntimes, false);
+        ArgModel local_model;
+        model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
+        if (last_tree && it->mapping) {
+            lineages.nrecombs[last_tree->nodes[last_tree->root].age]++;
+            lineages.update(last_tree, tree, it->mapping, model->pop_tree);
         } else {
-            // last block
-            // probability of not recombining after blocklen
-            lnl += - recomb_rate * (end - last_pos);
-            ++it;
+            lineages.count(tree, model->pop_tree);
+        }
+        last_tree = tree;
+        lineages.nrecombs[tree->nodes[tree->root].age]--;
+
+        double recomb_rate = max(local_model.rho * treelen, local_model.rho);
+        if (end >= trees->end_coord) {
+            fixed -= recomb_rate * (end - start);
+            break;
+        }
+        fixed += log(recomb_rate) - recomb_rate * (end - start);
+
+        ++it;
+        const Spr &spr = it->spr;
+        double lnl = calc_log_spr_prob(&local_model, tree, spr, lineages,
+                                       treelen, NULL, NULL, 1.0, true);
+        const int k = spr.recomb_time;
+        const int j = spr.coal_time;
+        const int broken_age =
+            tree->nodes[tree->nodes[spr.recomb_node].parent].age;
+        for (int m=2*k; m<2*j-1; m++) {
+            const int nbranches = get_spr_nbranches(model, lineages,
+                                                    broken_age, m);
+            nocoal[m] += nbranches;
+            lnl += model->coal_rate(0, m) * nbranches;
+        }
+        if (j < ntimes - 2) {
+            const int n1 = get_spr_nbranches(model, lineages, broken_age,
+                                             2*j);
+            const int n2 = (j > k ? get_spr_nbranches(model, lineages,
+                                                      broken_age, 2*j-1) : 0);
+            coals[make_tuple(j, n1, n2)]++;
+            lnl -= log(1.0 - exp(- model->coal_rate(0, 2*j) * n1 -
+                                 (n2 > 0 ? model->coal_rate(0, 2*j-1) * n2
+                                  : 0.0)));
         }
+        fixed += lnl;
+    }
+}
+
+
+double ArgPriorStats::prior(const ArgModel *model) const
+{
+    double lnl = fixed;
+    for (unsigned int i=0; i<first_a.size(); i++) {
+        double t = model->coal_time_steps[2*i];
+        if (i > 0) t += model->coal_time_steps[2*i-1];
+        lnl += log_prob_coal_counts(first_a[i], first_b[i], t,
+                                    2.0 * model->popsizes[0][2*i]);
+    }
+    // the rate of the last half interval is infinite, and never passed
+    for (unsigned int m=0; m<nocoal.size(); m++)
+        if (nocoal[m] > 0)
+            lnl -= model->coal_rate(0, m) * nocoal[m];
+    for (map<tuple<int, int, int>, int>::const_iterator it=coals.begin();
+         it != coals.end(); ++it) {
+        const int j = get<0>(it->first);
+        const int n1 = get<1>(it->first);
+        const int n2 = get<2>(it->first);
+        lnl += it->second * log(1.0 - exp(
+            - model->coal_rate(0, 2*j) * n1 -
+            (n2 > 0 ? model->coal_rate(0, 2*j-1) * n2 : 0.0)));
     }
     return lnl;
- }
+}
+
 
 double calc_arg_prior_recomb_integrate(const ArgModel *model,
                                        const LocalTrees *trees,
@@ -601,6 +999,7 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
 
     int rho_idx = 0;
     int end = trees->start_coord;
+    const LocalTree *last_tree = NULL;
     for (LocalTrees::const_iterator it=trees->begin(); it != trees->end(); ) {
         int start = end;
         end += it->blocklen;
@@ -613,7 +1012,14 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
         int blocklen = end - start;
         LocalTree *tree = it->tree;
         double treelen = get_treelen(tree, model->times, model->ntimes, false);
-        lineages.count(tree, model->pop_tree);
+        if (last_tree && it->mapping) {
+            // undo the adjustment below and update counts across the SPR
+            lineages.nrecombs[last_tree->nodes[last_tree->root].age]++;
+            lineages.update(last_tree, tree, it->mapping, model->pop_tree);
+        } else {
+            lineages.count(tree, model->pop_tree);
+        }
+        last_tree = tree;
         const int root_age = tree->nodes[tree->root].age;
         lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
 
@@ -1,6 +1,10 @@
 #ifndef ARGWEAVER_TOTAL_PROB_H
 #define ARGWEAVER_TOTAL_PROB_H
 
+#include <map>
+#include <tuple>
+#include <vector>
+
 #include "local_tree.h"
 #include "model.h"
 
@@ -49,6 +53,35 @@ double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees);
 
 
+// The prior of an ARG of one population, with its terms grouped by the
+// coalescence rates they depend on.  Once counted, the prior can be
+// evaluated for other population sizes without visiting the trees again,
+// as for the proposals of resample_popsizes_mh().
+class ArgPriorStats
+{
+public:
+    ArgPriorStats() : fixed(0.0) {}
+
+    // Counts the terms of calc_arg_prior(model, trees).  The model must
+    // not have a population tree.
+    void count(const ArgModel *model, const LocalTrees *trees);
+
+    // Returns calc_arg_prior(model, trees) for the population sizes of
+    // 'model', up to rounding
+    double prior(const ArgModel *model) const;
+
+protected:
+    double fixed;                // terms without population sizes
+    vector<int> first_a;         // lineages of the first tree at each time
+    vector<int> first_b;         // and at the end of its interval
+    vector<double> nocoal;       // branches passed by SPRs, by half interval
+
+    // number of SPRs coalescing in time j with n1 branches in half
+    // interval 2j and n2 in 2j-1, keyed by (j, n1, n2)
+    map<tuple<int, int, int>, int> coals;
+};
+
+
 
 } // namespace argweaver
 
@@ -3,6 +3,7 @@
 
 // c++ includes
 #include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -153,6 +154,37 @@ public:
         return -1;
     }
 
+    // Returns index of region containing position pos in a sorted track
+    // without overlaps, or -1 if there is none.  The regions at 'hint' and
+    // after it are tried before a binary search, so that lookups of
+    // increasing positions take O(1) each.
+    int index_sorted(int pos, int hint=-1) const {
+        const int n = Track<T>::size();
+        for (int i=max(hint, 0); i<hint+2 && i<n; i++) {
+            const RegionValue<T> &region = Track<T>::at(i);
+            if (region.start <= pos && pos < region.end)
+                return i;
+        }
+
+        // last region starting at or before pos
+        typename Track<T>::const_iterator it = upper_bound(
+            Track<T>::begin(), Track<T>::end(), pos,
+            [](int pos, const RegionValue<T> &region) {
+                return pos < region.start; });
+        if (it == Track<T>::begin() || (--it)->end <= pos)
+            return -1;
+        return it - Track<T>::begin();
+    }
+
+    // Returns value of region containing position in a sorted track
+    // without overlaps, as find() does in O(log n).  If start_idx is not
+    // NULL, it is used as a hint and updated to the index of the region.
+    T find_sorted(int pos, const T &default_value, int *start_idx=NULL) const {
+        int i = index_sorted(pos, start_idx == NULL ? -1 : *start_idx);
+        if (start_idx != NULL) *start_idx = max(i, 0);
+        return i == -1 ? default_value : Track<T>::at(i).value;
+    }
+
     // Adds one region to the track
     void append(string chrom, int start, int end, T value) {
         this->push_back(RegionValue<T>(chrom, start, end, value));
@@ -1,6 +1,8 @@
 //=============================================================================
 // transitions
 
+#include <memory>
+
 #include "matrices.h"
 #include "total_prob.h"
 #include "thread.h"
@@ -15,7 +17,7 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
     npaths = model->num_pop_paths();
     smc_prime = model->smc_prime;
     pop_tree = model->pop_tree;
-    int data_len=0;
+    data_len=0;
     if (smc_prime) {
         data_len = npaths * ntimes + 2 * ntimes;
     } else {
@@ -85,6 +87,64 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
     assert(idx == data_len);
 }
 
+static void copy_multiarray(MultiArray *dest, const MultiArray *src)
+{
+    assert(dest->matSize == src->matSize);
+    std::copy(src->mat, src->mat + src->matSize, dest->mat);
+}
+
+
+void TransMatrix::copy(const TransMatrix &other)
+{
+    assert(nstates == other.nstates && smc_prime == other.smc_prime &&
+           data_len == other.data_len && npaths == other.npaths);
+    internal = other.internal;
+    minage = other.minage;
+    std::copy(other.data_alloc, other.data_alloc + data_len, data_alloc);
+
+    copy_multiarray(C1_prime, other.C1_prime);
+    copy_multiarray(Q1_prime, other.Q1_prime);
+    if (smc_prime) {
+        MultiArray *const arrays[] = {
+            B0_prime, B1_prime, B2_prime, C0_prime, Q0_prime, E0_prime,
+            E1_prime, E2_prime, F0_prime, F1_prime, F2_prime, G0_prime,
+            G1_prime, G2_prime, L0_prime, L1_prime, L2_prime, K0_prime,
+            K1_prime, K2_prime, RK0_prime, RK2_prime};
+        const MultiArray *const other_arrays[] = {
+            other.B0_prime, other.B1_prime, other.B2_prime, other.C0_prime,
+            other.Q0_prime, other.E0_prime, other.E1_prime, other.E2_prime,
+            other.F0_prime, other.F1_prime, other.F2_prime, other.G0_prime,
+            other.G1_prime, other.G2_prime, other.L0_prime, other.L1_prime,
+            other.L2_prime, other.K0_prime, other.K1_prime, other.K2_prime,
+            other.RK0_prime, other.RK2_prime};
+        for (unsigned int i=0; i<sizeof(arrays) / sizeof(arrays[0]); i++)
+            copy_multiarray(arrays[i], other_arrays[i]);
+    }
+
+    if (smc_prime)
+        std::copy(other.self_recomb, other.self_recomb + nstates,
+                  self_recomb);
+}
+
+
+long TransMatrix::get_memory() const
+{
+    long size = sizeof(TransMatrix) + data_len * sizeof(double) +
+        (C1_prime->matSize + Q1_prime->matSize) * sizeof(double);
+    if (smc_prime) {
+        const MultiArray *const arrays[] = {
+            B0_prime, B1_prime, B2_prime, C0_prime, Q0_prime, E0_prime,
+            E1_prime, E2_prime, F0_prime, F1_prime, F2_prime, G0_prime,
+            G1_prime, G2_prime, L0_prime, L1_prime, L2_prime, K0_prime,
+            K1_prime, K2_prime, RK0_prime, RK2_prime};
+        for (unsigned int i=0; i<sizeof(arrays) / sizeof(arrays[0]); i++)
+            size += arrays[i]->matSize * sizeof(double);
+        size += nstates * sizeof(double);
+    }
+    return size;
+}
+
+
 void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
                                   const LineageCounts *lineages,
                                   MultiArray *coal_rates,
@@ -97,8 +157,7 @@ void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
             for (int i=0; i < 2*model->ntimes - 1; i++) {
                 int pop = model->get_pop(path, (i+1)/2);
                 int nbranch = lineages->nbranches_pop[pop][i];
-                coal_rates_noprime->set(model->coal_time_steps[i] *
-                                        nbranch / (2.0 * model->popsizes[pop][i]),
+                coal_rates_noprime->set(model->coal_rate(pop, i) * nbranch,
                                         path, i);
                 coal_rates_noprime->set(1.0, path, 2 * model->ntimes - 1);
             }
@@ -110,8 +169,7 @@ void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
                     int pop2 = model->get_pop(path2, (i+1)/2);
                     int nbranch = lineages->nbranches_pop[pop][i];
                     if (pop == pop2) nbranch++;
-                    coal_rates->set(model->coal_time_steps[i] *
-                                    nbranch / (2.0 * model->popsizes[pop][i]),
+                    coal_rates->set(model->coal_rate(pop, i) * nbranch,
                                     path, path2, i);
                 }
                 coal_rates->set(1.0, path, path2, 2*model->ntimes - 1);
@@ -130,8 +188,7 @@ void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
                     else if (i < minage*2) nbranch--;  //same pop
                     if (nbranch < 0) nbranch = 0;
                     //                assert(nbranch >= 0);
-                    coal_rates->set(model->coal_time_steps[i] *
-                                    nbranch / (2.0 * model->popsizes[pop][i]),
+                    coal_rates->set(model->coal_rate(pop, i) * nbranch,
                                     path, path2, i);
                 }
                 coal_rates->set(1.0, path, path2, 2 * model->ntimes - 1);
@@ -147,7 +204,7 @@ double TransMatrix::get_k_term(int d, int path_d, int a, int path_a) const {
     double val = K2_prime->get(path_d, path_a, a-1)
         + K1_prime->get(path_d, path_a, a);
     if (d == a) return val;
-    return val + (exp(-C1_prime->get(path_d, path_a, 2*a-1)
+    return val + (math_exp(-C1_prime->get(path_d, path_a, 2*a-1)
                       +C0_prime->get(path_d, 2*a-1))
                   * (K0_prime->get(path_d, d)
                      -K0_prime->get(path_d, a)));
@@ -197,17 +254,17 @@ double TransMatrix::get_rk_term(int d, int path_d, int a, int path_a) const {
     if (d < a) return rv;
     double k1 = (K1_prime->get(path_d, path_a, a) +
                  K2_prime->get(path_d, path_a, a-1));
-    rv = logadd(rv, B1_prime->get(path_d, path_a, a) + log(k1));
+    rv = logadd(rv, B1_prime->get(path_d, path_a, a) + math_log(k1));
     if (d == a) return rv;
     double logf = C0_prime->get(path_d, 2*a-1) - C1_prime->get(path_d, path_a, 2*a-1);
-    double f = exp(logf);
+    double f = math_exp(logf);
     rv = logadd(rv,logsub(RK0_prime->get(path_d, d),
                           RK0_prime->get(path_d, a)));
     double val = k1/f - K0_prime->get(path_d, a);
     double bval = logsub(B0_prime->get(path_d, d), B0_prime->get(path_d, a));
     if (val < 0)
-        rv = logsub(rv, bval + log(-val));
-    else rv = logadd(rv, bval + log(val));
+        rv = logsub(rv, bval + math_log(-val));
+    else rv = logadd(rv, bval + math_log(val));
     return rv;
 }
 
@@ -228,14 +285,14 @@ double TransMatrix::selfRecombDiffTimeProb(int min_k, int max_k,
                           get_b_term(min_k-1, path_d, a, path_a));  // this is in log sapce
     double rkstar = logsub(get_rk_term(max_k, path_d, a, path_a),
                            get_rk_term(min_k-1, path_d,a,path_a));  // also log space
-    double val1 = log(kstar) + bstar;
+    double val1 = math_log(kstar) + bstar;
     double val2 = rkstar;
     if (fabs(val1 - val2)/fabs(val1) < 1.0e-8) {
         count++;
         //        printf("val1=%e val2=%e diff=%e count=%i total=%i\n", val1, val2, fabs(val1-val2)/fabs(val1), count, total_count);
         return INFINITY;
     }
-    return logsub(log(kstar)+bstar, rkstar);
+    return logsub(math_log(kstar)+bstar, rkstar);
 }
 
 
@@ -259,13 +316,20 @@ inline double TransMatrix::self_recomb_prob(int a, int path_a,
     //    use state_time : 1 = branch_start, 2=branch_start+1, ...,
     //        1 + branch_end -branch_start = branch_end,
     //        2 + branch_end - branch_start for > branch_end
-    static MultiArray branchProbs(5, npaths, ntimes, ntimes, npaths, ntimes);
-    if (path_a == -1 && path_d == -1)
-        branchProbs.set_all(-1.0);
+    // memo of the matrix being computed, one per thread, sized for the
+    // model of the matrix when it is reset
+    static thread_local unique_ptr<MultiArray> branchProbs;
+    if (path_a == -1 && path_d == -1) {
+        if (!branchProbs || branchProbs->dimSize[0] != npaths ||
+            branchProbs->dimSize[1] != ntimes)
+            branchProbs.reset(new MultiArray(5, npaths, ntimes, ntimes,
+                                             npaths, ntimes));
+        branchProbs->set_all(-1.0);
+    }
     int age_idx = ( a > max_d ? max_d - min_d + 2 :
                     ( a < min_d ? 0 :
                       a - min_d + 1 ));
-    double rv = branchProbs.get(path_d, min_d, max_d, path_a, age_idx);
+    double rv = branchProbs->get(path_d, min_d, max_d, path_a, age_idx);
     if (rv >= 0) return rv;
 
     double term1 = get_l_term(max_d, path_d, a, path_a)
@@ -276,8 +340,8 @@ inline double TransMatrix::self_recomb_prob(int a, int path_a,
         return self_recomb_prob_slow_sum(a, path_a,
                                          min_d, max_d, path_d);
     }
-    rv = term1 + exp(term2);
-    branchProbs.set(rv, path_d, min_d, max_d, path_a, age_idx);
+    rv = term1 + math_exp(term2);
+    branchProbs->set(rv, path_d, min_d, max_d, path_a, age_idx);
 
     if (0) {
         double slow_prob = self_recomb_prob_slow_sum(a, path_a,
@@ -357,7 +421,7 @@ double TransMatrix::self_recomb_prob_slow(int a, int path_a,
         } else {
             eterm = E2_prime->get(path_d, path_a, d);
         }
-        prob = exp(bterm + cterm + log(pathprob * eterm));
+        prob = math_exp(bterm + cterm + math_log(pathprob * eterm));
         assert(!isnan(prob));
     }
     double term2;
@@ -578,7 +642,7 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
             // add wrapped branch
             treelen2 += times[b] - root_age;
         }
-        norecombs[b] = exp(-max(rho * treelen2, rho));
+        norecombs[b] = math_exp(-max(rho * treelen2, rho));
         D[b] = (treelen2 == 0 ? 0.0 : (1.0 - norecombs[b]) / treelen2);
     }
 
@@ -594,11 +658,11 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
                 F0_prime->set(1.0/(double)ncoal, path, b);
             } else {
                 E0_prime->set(ncoal == 0 ? 0.0 :
-                              (1.0 - exp(-Q0_prime->get(path, 2*b)
+                              (1.0 - math_exp(-Q0_prime->get(path, 2*b)
                                          -Q0_prime->get(path, 2*b-1)))
                               / (double)ncoal, path, b);
                 F0_prime->set(ncoal == 0 ? 0.0 :
-                              (1.0 - exp(-Q0_prime->get(path, 2*b)))
+                              (1.0 - math_exp(-Q0_prime->get(path, 2*b)))
                               / (double)ncoal, path, b);
             }
 
@@ -626,7 +690,7 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
             if (total_blen_b > 0.0) {
                 double weight = total_blen_b / (double)nrecomb;
                 lval = C0_prime->get(path, 2*b-1) +
-                    log(weight / curr_path_prob);
+                    math_log(weight / curr_path_prob);
                 B0_prime->logAddVal(lval, path, b);
                 L0_prime->addVal(weight * F0_prime->get(path, b), path, b);
             }
@@ -641,7 +705,7 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
             RK0_prime->set(b == 0 ? -INFINITY :
                            RK0_prime->get(path, b-1),
                            path, b);
-            RK0_prime->logAddVal(lval + log(K0_prime->get(path, b)),
+            RK0_prime->logAddVal(lval + math_log(K0_prime->get(path, b)),
                                  path, b);
             for (int path2=0; path2 < num_paths; path2++) {
                 if (! have_pop_path[path2]) continue;
@@ -659,18 +723,18 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
                     F2_prime->set(1.0/(double)ncoal2, path, path2, b);
                 } else {
                     E1_prime->set(ncoal1 == 0 ? 0.0 :
-                                  ( 1.0 - exp(-Q1_prime->get(path, path2, 2*b-1)
+                                  ( 1.0 - math_exp(-Q1_prime->get(path, path2, 2*b-1)
                                               -Q0_prime->get(path, 2*b)))
                                   / ((double)ncoal1), path, path2, b);
                     E2_prime->set(ncoal2 == 0 ? 0.0 :
-                                  ( 1.0 - exp(-Q1_prime->get(path, path2, 2*b-1)
+                                  ( 1.0 - math_exp(-Q1_prime->get(path, path2, 2*b-1)
                                               -Q1_prime->get(path, path2, 2*b)))
                                   / ((double)ncoal2), path, path2, b);
                     F1_prime->set(ncoal1 == 0 ? 0.0 :
-                                  ( 1.0 - exp(-Q0_prime->get(path, 2*b) ))
+                                  ( 1.0 - math_exp(-Q0_prime->get(path, 2*b) ))
                                   / ((double)ncoal1), path, path2, b);
                     F2_prime->set(ncoal2 == 0 ? 0.0 :
-                                  ( 1.0 - exp(-Q1_prime->get(path, path2, 2*b)))
+                                  ( 1.0 - math_exp(-Q1_prime->get(path, path2, 2*b)))
                                   / ((double)ncoal2), path, path2, b);
                 }
                 int nrecomb1 = ncoals_pop[pop][b];
@@ -707,7 +771,7 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
                 // branch coalesces at time b and not to consecutive intervals
                 // of times
                 B1_prime->set(blen1 == 0.0 ? -INFINITY :
-                              log(blen1 / (double)nrecomb1 / curr_path_prob)
+                              math_log(blen1 / (double)nrecomb1 / curr_path_prob)
                               + C1_prime->get(path, path2, 2*b-1),
                               path, path2, b);
                 L1_prime->set(blen1 == 0.0 ? 0 : blen1 / (double)nrecomb1
@@ -721,7 +785,7 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
                               path, path2, b);
                 double lnval = -INFINITY;
                 if (blen2 > 0) {
-                    lnval =  log( blen2 / (double)nrecomb2 / curr_path_prob) +
+                    lnval =  math_log( blen2 / (double)nrecomb2 / curr_path_prob) +
                         C1_prime->get(path, path2, 2*b-1);
                     B2_prime->logAddVal(lnval, path, path2, b);
                     L2_prime->addVal(blen2 / (double)nrecomb2 *
@@ -733,7 +797,7 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
                 G2_prime->set(blen2 == 0.0 ? 0 : blen2 / (double)nrecomb2,
                               path, path2, b);
 
-                double tmp_pr = exp(-C1_prime->get(path, path2, 2*b - 2))
+                double tmp_pr = math_exp(-C1_prime->get(path, path2, 2*b - 2))
                     * curr_path_prob;
                 K1_prime->set(E1_prime->get(path, path2, b)
                               * tmp_pr,
@@ -748,7 +812,7 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
                 RK2_prime->set(b == 0 ? -INFINITY :
                                RK2_prime->get(path, path2, b-1),
                                path, path2, b);
-                RK2_prime->logAddVal(lnval + log(K2_prime->get(path, path2, b)),
+                RK2_prime->logAddVal(lnval + math_log(K2_prime->get(path, path2, b)),
                                   path, path2, b);
             }
         }
@@ -848,8 +912,8 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
             // add basal branch
             treelen2_b = treelen2 + time_steps[root_age_index];
         }
-        norecombs[b] = exp(-max(rho * treelen2, rho));
-        D[b] = (1.0 - exp( -rho * treelen2)) / treelen2_b;
+        norecombs[b] = math_exp(-max(rho * treelen2, rho));
+        D[b] = (1.0 - math_exp( -rho * treelen2)) / treelen2_b;
     }
 
     for (int path=0; path < num_paths; path++) {
@@ -868,7 +932,7 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
             }
             for (int path2=0; path2 < num_paths; path2++) {
                 if (! have_pop_path[path2]) continue;
-                double term = C1_prime->get(path, path2, 2*b-1) + log(
+                double term = C1_prime->get(path, path2, 2*b-1) + math_log(
                     time_steps[b] * (nbranch + 1.0) /
                     (nrecomb + 1.0) / curr_path_prob);
                 if (b == 0)
@@ -878,22 +942,22 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
                         logadd(lnB[path][path2][b-1], term);
                 lnE2[path][path2][b] = -C1_prime->get(path, path2, 2*b-2) +
                     (b < ntimes - 2 ?
-                     log(1 - exp(-Q1_prime->get(path, path2, 2*b)
+                     math_log(1 - math_exp(-Q1_prime->get(path, path2, 2*b)
                                  -Q1_prime->get(path, path2, 2*b-1))) : 0.0);
                 assert(!isnan(exp(2.0*lnE2[path][path2][b])));
                 lnNegG1[path][path2][b] =
                     C1_prime->get(path, path2, 2*b-1) +
-                    log( - time_steps[b] / curr_path_prob * (
+                    math_log( - time_steps[b] / curr_path_prob * (
                         (nbranch / (nrecomb + 1.0 + int(b < root_age_index)))
                         - (nbranch + 1.0) / (nrecomb + 1.0)));
             }
             G2[path][b] = (b<ntimes-2 ?
-                           1.0 - exp(-Q1_prime->get(path, path, 2*b))
+                           1.0 - math_exp(-Q1_prime->get(path, path, 2*b))
                            : 1.0) *
                 time_steps[b] *
                 (nbranch + 1.0) / (nrecomb + 1.0) / curr_path_prob;
             G3[path][b] = (b<ntimes-2 ?
-                           1.0 - exp(-Q1_prime->get(path, path, 2*b))
+                           1.0 - math_exp(-Q1_prime->get(path, path, 2*b))
                            : 1.0) *
                 time_steps[b] *
                 (nbranch / (nrecomb + 1.0 + int(b < root_age_index)) /
@@ -927,6 +991,298 @@ void get_transition_probs(const LocalTree *tree, const ArgModel *model,
             transprob[i][j] = matrix->get_log(tree, states, i, j);
 }
 
+//=============================================================================
+// transition matrix cache
+
+
+template <class T>
+static inline void append_key(string &key, const T *values, int n)
+{
+    key.append((const char*) values, n * sizeof(T));
+}
+
+
+static void append_tree_key(string &key, const LocalTree *tree)
+{
+    int header[] = {tree->nnodes, tree->root};
+    append_key(key, header, 2);
+    for (int i=0; i<tree->nnodes; i++) {
+        const LocalNode &n = tree->nodes[i];
+        int node[] = {n.parent, n.child[0], n.child[1], n.age, n.pop_path};
+        append_key(key, node, 5);
+    }
+}
+
+
+static void append_states_key(string &key, const States &states)
+{
+    int nstates = states.size();
+    append_key(key, &nstates, 1);
+    for (int i=0; i<nstates; i++) {
+        int state[] = {states[i].node, states[i].time, states[i].pop_path};
+        append_key(key, state, 3);
+    }
+}
+
+
+static void append_lineages_key(string &key, const LineageCounts *lineages,
+                                int ntimes, int npops)
+{
+    append_key(key, lineages->nbranches, ntimes);
+    append_key(key, lineages->nrecombs, ntimes);
+    for (int pop=0; pop<npops; pop++) {
+        append_key(key, lineages->ncoals_pop[pop], ntimes);
+        append_key(key, lineages->nbranches_pop[pop], 2*ntimes);
+    }
+}
+
+
+static void append_model_key(string &key, const ArgModel *model)
+{
+    const int ntimes = model->ntimes;
+    const int npops = model->num_pops();
+    const int npaths = model->num_pop_paths();
+
+    int sizes[] = {ntimes, npops, npaths};
+    append_key(key, sizes, 3);
+    append_key(key, &model->rho, 1);
+    append_key(key, model->times, ntimes);
+    append_key(key, model->coal_time_steps, 2*ntimes-1);
+    for (int pop=0; pop<npops; pop++)
+        append_key(key, model->popsizes[pop], 2*ntimes-1);
+    for (int path=0; path<npaths; path++) {
+        for (int b=0; b<ntimes-1; b++) {
+            double prob = model->path_prob(path, 0, b);
+            append_key(key, &prob, 1);
+        }
+    }
+}
+
+
+void TransMatrixCache::calc_transition_probs(
+    TransMatrix *matrix, const LocalTree *tree, const ArgModel *model,
+    const States &states, const LineageCounts *lineages,
+    bool internal, int minage)
+{
+    const int ntimes = model->ntimes;
+    const int npops = model->num_pops();
+
+    // build key from all inputs of the calculation
+    string key;
+    int flags[] = {model->smc_prime, internal, minage, matrix->nstates};
+    append_key(key, flags, sizeof(flags) / sizeof(int));
+    append_tree_key(key, tree);
+    append_states_key(key, states);
+    append_lineages_key(key, lineages, ntimes, npops);
+    append_model_key(key, model);
+
+    unordered_map<string, Entry>::iterator it = entries.find(key);
+    if (it != entries.end()) {
+        hits++;
+        matrix->copy(*it->second.matrix);
+        order.splice(order.begin(), order, it->second.order);
+        return;
+    }
+
+    misses++;
+    matrix->calc_transition_probs(tree, model, states, lineages,
+                                  internal, minage);
+    if (max_entries <= 0)
+        return;
+
+    // drop least recently used entry
+    if (int(entries.size()) >= max_entries) {
+        unordered_map<string, Entry>::iterator last =
+            entries.find(order.back());
+        delete last->second.matrix;
+        entries.erase(last);
+        order.pop_back();
+    }
+
+    Entry entry;
+    entry.matrix = new TransMatrix(model, matrix->nstates);
+    entry.matrix->copy(*matrix);
+    order.push_front(key);
+    entry.order = order.begin();
+    entries[key] = entry;
+}
+
+
+void TransMatrixCache::clear()
+{
+    for (unordered_map<string, Entry>::iterator it=entries.begin();
+         it != entries.end(); ++it)
+        delete it->second.matrix;
+    entries.clear();
+    order.clear();
+}
+
+
+void TransMatrixCache::log_stats(int level)
+{
+    printLog(level, "transmat cache: %d hits, %d misses (%d entries)\n",
+             hits, misses, size());
+    hits = 0;
+    misses = 0;
+}
+
+
+TransMatrixCache &get_trans_matrix_cache()
+{
+    static thread_local TransMatrixCache cache;
+    return cache;
+}
+
+
+//=============================================================================
+// sparse switch transition matrix
+
+
+void TransMatrixSwitchSparse::set(const TransMatrixSwitch *matrix)
+{
+    nstates1 = max(matrix->nstates1, 1);
+    nstates2 = max(matrix->nstates2, 1);
+    const int *determ = matrix->determ;
+    const int *recombsrc = matrix->recombsrc;
+    const int *recoalsrc = matrix->recoalsrc;
+
+    // each pass visits transitions in the order of arghmm_forward_switch()
+    // pass 0 counts entries per destination, pass 1 fills them in
+    vector<int> next;
+    for (int pass=0; pass<2; pass++) {
+        if (pass == 0) {
+            offsets.assign(nstates2 + 1, 0);
+        } else {
+            for (int k=0; k<nstates2; k++)
+                offsets[k+1] += offsets[k];
+            next.assign(offsets.begin(), offsets.end() - 1);
+            sources.resize(offsets[nstates2]);
+            probs.resize(offsets[nstates2]);
+        }
+
+        // deterministic transitions
+        for (int j=0; j<nstates1; j++) {
+            int k = determ[j];
+            if (k == -1 || recombsrc[j] >= 0 || recoalsrc[j] >= 0)
+                continue;
+            if (pass == 0) {
+                offsets[k+1]++;
+            } else {
+                sources[next[k]] = j;
+                probs[next[k]++] = matrix->determprob[j];
+            }
+        }
+
+        // recombination and recoalescing transitions
+        for (int type=0; type<2; type++) {
+            const int *src = (type == 0 ? recombsrc : recoalsrc);
+            for (int j=0; j<nstates1; j++) {
+                if (src[j] < 0)
+                    continue;
+                for (int k=0; k<nstates2; k++) {
+                    double val = matrix->get(j, k);
+                    if (!(val > 0))
+                        continue;
+                    if (pass == 0) {
+                        offsets[k+1]++;
+                    } else {
+                        sources[next[k]] = j;
+                        probs[next[k]++] = val;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+//=============================================================================
+// switch transition matrix cache
+
+
+void TransMatrixSwitchCache::calc_transition_probs_switch(
+    TransMatrixSwitch *matrix,
+    const LocalTree *tree, const LocalTree *last_tree,
+    const Spr &spr, const int *mapping,
+    const States &states1, const States &states2,
+    const ArgModel *model, const LineageCounts *lineages, bool internal)
+{
+    // build key from all inputs of the calculation
+    string key;
+    int flags[] = {model->smc_prime, internal, matrix->nstates1,
+                   matrix->nstates2, matrix->npaths};
+    append_key(key, flags, sizeof(flags) / sizeof(int));
+    int spr_key[] = {spr.recomb_node, spr.recomb_time,
+                     spr.coal_node, spr.coal_time, spr.pop_path};
+    append_key(key, spr_key, 5);
+    append_key(key, mapping, last_tree->nnodes);
+    append_tree_key(key, last_tree);
+    append_tree_key(key, tree);
+    append_states_key(key, states1);
+    append_states_key(key, states2);
+    append_lineages_key(key, lineages, model->ntimes, model->num_pops());
+    append_model_key(key, model);
+
+    unordered_map<string, Entry>::iterator it = entries.find(key);
+    if (it != entries.end()) {
+        hits++;
+        matrix->copy(*it->second.matrix);
+        order.splice(order.begin(), order, it->second.order);
+        return;
+    }
+
+    misses++;
+    argweaver::calc_transition_probs_switch(
+        tree, last_tree, spr, mapping, states1, states2, model, lineages,
+        matrix, internal);
+    if (max_entries <= 0)
+        return;
+
+    // drop least recently used entry
+    if (int(entries.size()) >= max_entries) {
+        unordered_map<string, Entry>::iterator last =
+            entries.find(order.back());
+        delete last->second.matrix;
+        entries.erase(last);
+        order.pop_back();
+    }
+
+    Entry entry;
+    entry.matrix = new TransMatrixSwitch(matrix->nstates1, matrix->nstates2,
+                                         matrix->npaths);
+    entry.matrix->copy(*matrix);
+    order.push_front(key);
+    entry.order = order.begin();
+    entries[key] = entry;
+}
+
+
+void TransMatrixSwitchCache::clear()
+{
+    for (unordered_map<string, Entry>::iterator it=entries.begin();
+         it != entries.end(); ++it)
+        delete it->second.matrix;
+    entries.clear();
+    order.clear();
+}
+
+
+void TransMatrixSwitchCache::log_stats(int level)
+{
+    printLog(level, "switch cache: %d hits, %d misses (%d entries)\n",
+             hits, misses, size());
+    hits = 0;
+    misses = 0;
+}
+
+
+TransMatrixSwitchCache &get_trans_matrix_switch_cache()
+{
+    static thread_local TransMatrixSwitchCache cache;
+    return cache;
+}
+
+
 void calc_transition_probs(const LocalTree *tree, const ArgModel *model,
                            const States &states, const LineageCounts *lineages, TransMatrix *matrix,
                            bool internal, int minage) {
@@ -1414,7 +1770,7 @@ double calc_recomb(
             int(k == a && k >= minage)  - int(k >= max(root_age, a));
         p = nbranches_k * model->time_steps[k] /
             (nrecombs_k * last_treelen_b) *
-            (1.0 - exp(-max(model->rho * last_treelen, model->rho)));
+            (1.0 - math_exp(-max(model->rho * last_treelen, model->rho)));
         if (nrecombs_k <= 0 || nbranches_k <= 0) {
             printError("counts %d %d %e\n",
                        nrecombs_k, nbranches_k, p);
@@ -1455,8 +1811,7 @@ void calc_recoal_sums(const ArgModel *model, const LineageCounts *lineages,
             int((!model->smc_prime) &&
                 m/2<recomb_parent_age &&
                 spr_pop == recomb_node_pop);
-        sum += (model->coal_time_steps[m] * nbranches_m
-		/ (2.0 * model->popsizes[spr_pop][m]));
+        sum += model->coal_rate(spr_pop, m) * nbranches_m;
     }
     *sums = sum;
 
@@ -1468,7 +1823,7 @@ void calc_recoal_sums(const ArgModel *model, const LineageCounts *lineages,
                 int spr_pop = model->get_pop(spr.pop_path, (m+1)/2);
                 int this_pop = model->get_pop(path, (m+1)/2);
                 if (spr_pop == this_pop)
-                    sum += model->coal_time_steps[m] / (2.0 * model->popsizes[spr_pop][m]);
+                    sum += model->coal_rate(spr_pop, m);
             }
             sums2[path][m+1] = sum;
         }
@@ -1545,13 +1900,11 @@ double calc_recoal(
                 + int(j-1 < a && a_pop == coal_pop && j-1 >= minage);
             if (over)
                 b1 = 1;
-            Z = model->coal_time_steps[2*j-1] *  b1 /
-                (2.0 * model->popsizes[coal_pop][2*j-1]);
+            Z = model->coal_rate(coal_pop, 2*j-1) * b1;
         }
 
-        p *= 1.0 - exp(- model->coal_time_steps[2*j] * nbranches_j /
-                       (2.0 * model->popsizes[coal_pop][2*j])
-                       - Z);
+        p *= 1.0 - math_exp(- model->coal_rate(coal_pop, 2*j) * nbranches_j
+                            - Z);
     }
     return p;
 }
@@ -1601,10 +1954,9 @@ double calc_recomb_recoal(
             + int(m/2 < a && spr_pop == a_pop && m/2 >= minage);
         /*        printf("%i %i %i\n", m, lineages->nbranches_pop[spr_pop][m],
                   nbranches_m);*/
-        sum += model->coal_time_steps[m] * nbranches_m /
-            (2.0 * model->popsizes[spr_pop][m]);
+        sum += model->coal_rate(spr_pop, m) * nbranches_m;
     }
-    p *= exp(-sum);
+    p *= math_exp(-sum);
 
     p *= calc_recoal(last_tree, model, lineages, spr, state1,
                      recomb_parent_age, recomb_parent_path, internal);
@@ -1809,7 +2161,7 @@ void calc_transition_probs_switch(
                 transmat_switch->determprob[i] =
                     calc_recomb(last_tree, model, lineages, spr, states1[i],
                                 last_treelen, internal) *
-                    exp(-sums
+                    math_exp(-sums
                         -sums2[states1[i].pop_path][
                            max(min(2*spr.coal_time-1, 2*states1[i].time),
                                    2*spr.recomb_time)]) *
@@ -2107,8 +2459,7 @@ double calc_state_priors(const ArgModel *model,
     int pop=model->get_pop(pop_path, minage);
     for (int m=2*minage; m<2*b-1; m++) {
         if (m%2==1) pop = model->get_pop(pop_path, (m+1)/2);
-        sum += model->coal_time_steps[m] * nbranches_pop[pop][m]
-            / (2.0 * model->popsizes[pop][m]);
+        sum += model->coal_rate(pop, m) * nbranches_pop[pop][m];
     }
     pop = model->get_pop(pop_path, b);
     double p = exp(-sum) / ncoals_pop[pop][b];
@@ -2117,12 +2468,9 @@ double calc_state_priors(const ArgModel *model,
     if (b < model->ntimes - 2) {
         double Z = 0.0;
         if (b>minage)
-            Z = model->coal_time_steps[2*b-1] *
-                nbranches_pop[pop][2*b-1]/
-                ( 2.0 * model->popsizes[pop][2*b-1] );
-        p *= 1.0 - exp(- (model->coal_time_steps[2*b] *
-                          nbranches_pop[pop][2*b])/
-                       (2.0 * model->popsizes[pop][2*b]) - Z);
+            Z = model->coal_rate(pop, 2*b-1) * nbranches_pop[pop][2*b-1];
+        p *= 1.0 - exp(- model->coal_rate(pop, 2*b) * nbranches_pop[pop][2*b]
+                       - Z);
     } else {
         // b = ntimes -1, guaranteed coalescence
     }
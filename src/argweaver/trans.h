@@ -9,6 +9,11 @@
 #include "model.h"
 #include "states.h"
 #include "MultiArray.h"
+#include "simd.h"
+
+#include <list>
+#include <string>
+#include <unordered_map>
 
 namespace argweaver {
 
@@ -79,6 +84,12 @@ public:
     // and initialize paths_equal matrix
     void initialize(const ArgModel *model, int nstates);
 
+    // copy the terms of a matrix with the same model and number of states
+    void copy(const TransMatrix &other);
+
+    // approximate number of bytes used
+    long get_memory() const;
+
     // Probability of transition from state i to state j.
     inline double get(
         const LocalTree *tree, const States &states, int i, int j) const
@@ -127,25 +138,25 @@ public:
         double term1 = D[a] * E[path_b][b] * path_prob[path_b][b];
         double minage_term = 0.0;
         if (minage > 0) {
-            minage_term = exp(lnE2[path_b][path_b][b] +
+            minage_term = math_exp(lnE2[path_b][path_b][b] +
                               lnB[path_b][path_b][minage-1]);
         }
         if (p < a && p < b) {
-            prob = term1 * (exp(lnE2[path_b][path_b][b] +
+            prob = term1 * (math_exp(lnE2[path_b][path_b][b] +
                                 lnB[path_b][path_b][p])
                             - minage_term);
         } else if (a <= p && a < b) {
-            prob = term1 * (exp(lnE2[path_b][path_b][b] +
+            prob = term1 * (math_exp(lnE2[path_b][path_b][b] +
                                 lnB[path_b][path_b][a]) -
-                            exp(lnE2[path_b][path_b][b] +
+                            math_exp(lnE2[path_b][path_b][b] +
                                 lnNegG1[path_b][path_b][a])
                             - minage_term);
         } else if (a == b) {
-            prob = term1 * ((b > 0 ? exp(lnE2[path_b][path_b][b] +
+            prob = term1 * ((b > 0 ? math_exp(lnE2[path_b][path_b][b] +
                                          lnB[path_b][path_b][b-1]) : 0.0) +
                             G3[path_b][b] - minage_term);
         } else { // b < a
-            prob = term1 * ((b > 0 ? exp(lnE2[path_b][path_b][b] +
+            prob = term1 * ((b > 0 ? math_exp(lnE2[path_b][path_b][b] +
                                          lnB[path_b][path_b][b-1]) : 0.0)
                             + G2[path_b][b] - minage_term);
         }
@@ -186,21 +197,21 @@ public:
         term1 = D[a] * E[path_c][b] * path_prob[path_c][b];
         minage_term = 0.0;
         if (c > 0)
-            minage_term = exp(lnE2[path_c][path_b][b]
+            minage_term = math_exp(lnE2[path_c][path_b][b]
                               + lnB[path_c][path_b][c-1]);
 
         if (a < b) {
-            prob += term1 * (exp(lnE2[path_c][path_b][b] +
+            prob += term1 * (math_exp(lnE2[path_c][path_b][b] +
                                  lnB[path_c][path_b][a]) -
-                             exp(lnE2[path_c][path_b][b] +
+                             math_exp(lnE2[path_c][path_b][b] +
                                  lnNegG1[path_c][path_b][a])
                              - minage_term);
         } else if (a == b) {
-            prob += term1 * ((b > 0 ? exp(lnE2[path_c][path_b][b] +
+            prob += term1 * ((b > 0 ? math_exp(lnE2[path_c][path_b][b] +
                                           lnB[path_c][path_b][b-1]) : 0.0) +
                              G3[path_c][b] - minage_term);
         } else { // b < a
-            prob += term1 * ((b > 0 ? exp(lnE2[path_c][path_b][b] +
+            prob += term1 * ((b > 0 ? math_exp(lnE2[path_c][path_b][b] +
                                           lnB[path_c][path_b][b-1]) : 0.0)
                              + G2[path_c][b] - minage_term);
         }
@@ -209,17 +220,17 @@ public:
         return prob;
     } else {  //smc prime calculations
         double term1=0, term2=0, minage_term=-INFINITY;
-        term1 = log(D[a]*path_prob[path_b][b]);
+        term1 = math_log(D[a]*path_prob[path_b][b]);
         if (a < b) {
-            term1 += log(E0_prime->get(path_b, b))
+            term1 += math_log(E0_prime->get(path_b, b))
                 -C0_prime->get(path_b, 2*b-2)
                 + C0_prime->get(path_b, 2*a-1)
                 - C1_prime->get(path_b, path_a, 2*a-1);
         } else if (a == b) {
-            term1 += log(E1_prime->get(path_b, path_a, b))
+            term1 += math_log(E1_prime->get(path_b, path_a, b))
                 - C1_prime->get(path_b, path_a, 2*b-2);
         } else {
-            term1 += log(E2_prime->get(path_b, path_a, b))
+            term1 += math_log(E2_prime->get(path_b, path_a, b))
                 -C1_prime->get(path_b, path_a, 2*b-2);
         }
         int k_max = b-1;
@@ -251,7 +262,7 @@ public:
         if (b_term == -INFINITY) {
             assert(minage_term == -INFINITY);
             prob = term2;
-        } else prob = exp(term1 + logsub(b_term, minage_term)) + term2;
+        } else prob = math_exp(term1 + logsub(b_term, minage_term)) + term2;
         assert(prob >=0 && prob <= 1);
 
         if (!same_node) return prob;  // must be recombination on threaded branch
@@ -301,7 +312,7 @@ public:
                     if (minp < b)
                         p2 += (K2_prime->get(path_b, path_a, b-1)
                                - K2_prime->get(path_b, path_a, minp-1));
-                    prob += D[a]*exp(val)*p2;
+                    prob += D[a]*math_exp(val)*p2;
                 }
             }
         } else if (a > b) {
@@ -324,7 +335,7 @@ public:
     inline double get_log(
         const LocalTree *tree, const States &states, int i, int j) const
     {
-        return log(get(tree, states, i, j));
+        return math_log(get(tree, states, i, j));
     }
     void assert_transmat(const LocalTree *tree,
                          const ArgModel *model,
@@ -347,6 +358,7 @@ public:
     int ntimes;
     int nstates;
     int npaths;
+    int data_len;   // length of data_alloc
     bool internal;  // If true, this matrix is for threading an internal branch.
     int minage;     // Minimum age of a state we can consider (due to threading
                     // an internal branch).
@@ -418,6 +430,64 @@ public:
 };
 
 
+// Cache of transition matrices for recently seen local trees.
+//
+// Entries are keyed on everything TransMatrix::calc_transition_probs()
+// reads: the tree, states and lineage counts, and the model parameters
+// that can change between blocks (rho and population sizes).  A block
+// whose partial tree was already seen, e.g. by the forward algorithm
+// before the traceback, copies the cached terms instead of computing them.
+// The least recently used entry is dropped once the cache is full.
+class TransMatrixCache
+{
+public:
+    TransMatrixCache(int max_entries=MAX_ENTRIES) :
+        max_entries(max_entries),
+        hits(0),
+        misses(0)
+    {}
+
+    ~TransMatrixCache()
+    {
+        clear();
+    }
+
+    // Same as matrix->calc_transition_probs(), but reuses cached terms
+    void calc_transition_probs(TransMatrix *matrix, const LocalTree *tree,
+                               const ArgModel *model, const States &states,
+                               const LineageCounts *lineages,
+                               bool internal=false, int minage=0);
+
+    void clear();
+
+    // log and reset the hit and miss counters
+    void log_stats(int level);
+
+    int size() const {
+        return entries.size();
+    }
+
+    enum { MAX_ENTRIES = 1000 };
+
+    int max_entries;
+    int hits;
+    int misses;
+
+protected:
+    struct Entry {
+        TransMatrix *matrix;
+        list<string>::iterator order;
+    };
+
+    unordered_map<string, Entry> entries;
+    list<string> order;  // keys from most to least recently used
+};
+
+
+// Returns the transition matrix cache of the calling thread
+TransMatrixCache &get_trans_matrix_cache();
+
+
 // A compressed representation of the switch transition matrix.
 //
 // This transition matrix is used in the chromosome threading HMM to go between
@@ -489,6 +559,29 @@ public:
             recombrow[i] = recoalrow[i] = 0.0;
     }
 
+    // copy probabilities from a matrix of the same dimensions
+    void copy(const TransMatrixSwitch &other)
+    {
+        assert(nstates1 == other.nstates1 && nstates2 == other.nstates2 &&
+               npaths == other.npaths);
+        const int n1 = max(nstates1, 1);
+        const int n2 = max(nstates2, 1) * npaths;
+        std::copy(other.determ, other.determ + n1, determ);
+        std::copy(other.determprob, other.determprob + n1, determprob);
+        std::copy(other.recombsrc, other.recombsrc + n1, recombsrc);
+        std::copy(other.recoalsrc, other.recoalsrc + n1, recoalsrc);
+        std::copy(other.recoalrow, other.recoalrow + n2, recoalrow);
+        std::copy(other.recombrow, other.recombrow + n2, recombrow);
+    }
+
+    // approximate number of bytes used
+    long get_memory() const
+    {
+        return sizeof(TransMatrixSwitch) + max(nstates1, 1) *
+            (3 * sizeof(int) + sizeof(double)) +
+            2 * max(nstates2, 1) * npaths * sizeof(double);
+    }
+
     inline void set(int i, int j, double val) {
         if (recombsrc[i] >= 0) {
             recombrow[recombsrc[i] * nstates2 + j] = val;
@@ -522,6 +615,42 @@ public:
 
 
 
+// A sparse copy of a switch transition matrix.
+//
+// Nonzero transitions are stored by destination state (compressed columns),
+// so that one column of the forward algorithm is a gathered dot product per
+// destination state, i.e. O(nnz) instead of a scan over every source row.
+// Within a destination, entries are ordered as arghmm_forward_switch() adds
+// them (deterministic, recombination then recoalescence sources).
+class TransMatrixSwitchSparse
+{
+public:
+    TransMatrixSwitchSparse() :
+        nstates1(0),
+        nstates2(0)
+    {}
+
+    explicit TransMatrixSwitchSparse(const TransMatrixSwitch *matrix)
+    {
+        set(matrix);
+    }
+
+    // rebuild from a dense switch matrix
+    void set(const TransMatrixSwitch *matrix);
+
+    // number of nonzero transitions
+    int nnz() const {
+        return sources.size();
+    }
+
+    int nstates1;   // at least 1, as in arghmm_forward_switch()
+    int nstates2;
+    vector<int> offsets;    // entries of state k are offsets[k]..offsets[k+1]
+    vector<int> sources;    // source state of each entry
+    vector<double> probs;   // transition probability of each entry
+};
+
+
 //=============================================================================
 
 /*void calc_transition_probs(const LocalTree *tree, const ArgModel *model,
@@ -565,6 +694,66 @@ void calc_transition_probs_switch_internal2(
     TransMatrixSwitch *transmat_switch);
 
 
+// Caches switch transition matrices across calls.
+//
+// When a chromosome is removed and re-threaded, most blocks of the local
+// trees keep the same partial tree and SPR, so their switch matrices are
+// unchanged from the previous iteration.  Matrices are keyed on every input
+// of calc_transition_probs_switch(), so only blocks that changed are
+// recomputed.
+class TransMatrixSwitchCache
+{
+public:
+    TransMatrixSwitchCache(int max_entries=MAX_ENTRIES) :
+        max_entries(max_entries),
+        hits(0),
+        misses(0)
+    {}
+
+    ~TransMatrixSwitchCache()
+    {
+        clear();
+    }
+
+    // Same as calc_transition_probs_switch(), but reuses cached matrices
+    void calc_transition_probs_switch(
+        TransMatrixSwitch *matrix,
+        const LocalTree *tree, const LocalTree *last_tree,
+        const Spr &spr, const int *mapping,
+        const States &states1, const States &states2,
+        const ArgModel *model, const LineageCounts *lineages,
+        bool internal=false);
+
+    void clear();
+
+    // log and reset the hit and miss counters
+    void log_stats(int level);
+
+    int size() const {
+        return entries.size();
+    }
+
+    enum { MAX_ENTRIES = 1000 };
+
+    int max_entries;
+    int hits;
+    int misses;
+
+protected:
+    struct Entry {
+        TransMatrixSwitch *matrix;
+        list<string>::iterator order;
+    };
+
+    unordered_map<string, Entry> entries;
+    list<string> order;  // keys from most to least recently used
+};
+
+
+// Returns the switch transition matrix cache of the calling thread
+TransMatrixSwitchCache &get_trans_matrix_switch_cache();
+
+
 double calc_state_priors(const ArgModel *model,
     int time, int pop_path,
     int **nbranches_pop, int **ncoals_pop,
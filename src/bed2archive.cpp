@@ -0,0 +1,62 @@
+#include "getopt.h"
+#include <stdio.h>
+
+// argweaver includes
+#include "argweaver/arg_archive.h"
+#include "argweaver/compress.h"
+#include "argweaver/logging.h"
+
+using namespace argweaver;
+
+
+void print_usage() {
+    printf("bed2archive: This program converts a bed file of sampled ARGs\n"
+           "  (as made by smc2bed and sort-bed) into an ARG archive.  The\n"
+           "  archive indexes the trees of each MCMC sample by coordinate,\n"
+           "  so that arg-summarize can read the trees of one sample or of\n"
+           "  a few samples (--sample, --burnin) without reading those of\n"
+           "  the other samples.\n\n");
+    printf("Usage: ./bed2archive [OPTIONS] <bed-file> <archive-file>\n"
+           "  bed-file can be gzipped, or '-' for stdin\n"
+           " OPTIONS:\n"
+           " --help\n"
+           "   Print this message\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    int opt_idx;
+    struct option long_opts[] = {
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "h", long_opts, &opt_idx))
+           != -1) {
+        switch (c) {
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    Logger *logger = new Logger(stderr, LOG_HIGH);
+    g_logger.setChain(logger);
+
+    if (strcmp(argv[optind], "-") == 0)
+        return write_arg_archive(stdin, argv[optind+1]) ? 0 : 1;
+
+    CompressStream instream(argv[optind], "r");
+    if (instream.stream == NULL) {
+        fprintf(stderr, "Error opening %s\n", argv[optind]);
+        return 1;
+    }
+    bool ok = write_arg_archive(instream.stream, argv[optind+1]);
+    instream.close();
+    return ok ? 0 : 1;
+}
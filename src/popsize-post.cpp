@@ -18,6 +18,7 @@
 #include "argweaver/track.h"
 #include "argweaver/est_popsize.h"
 #include "argweaver/mcmcmc.h"
+#include "argweaver/thread_pool.h"
 
 
 using namespace argweaver;
@@ -142,6 +143,10 @@ public:
         config.add(new ConfigParam<int>
                    ("-x", "--randseed", "<random seed>", &randseed, 0,
                     "seed for random number generator (default=current time)"));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<# of threads>", &nthreads, 1,
+                    "number of threads used for reading ARG samples and"
+                    " counting their statistics (default=1)"));
 
         // help information
         config.add(new ConfigParamComment("Information"));
@@ -219,6 +224,7 @@ public:
     // misc
     int sample_step;
     int randseed;
+    int nthreads;
 
     // help/information
     bool quiet;
@@ -308,7 +314,7 @@ void print_stats_header(Config *config) {
 void print_stats_popsizes(Config *config, int iter, ArgModel *model) {
     fprintf(config->stats_file, "popsize_mle\t%i", iter);
     for (int i=0; i < config->model.ntimes-1; i++)
-	fprintf(config->stats_file, "\t%.1lf", model->popsizes[2*i]);
+	fprintf(config->stats_file, "\t%.1lf", model->popsizes[0][2*i]);
     fprintf(config->stats_file, "\n");
 }
 
@@ -370,6 +376,39 @@ bool read_arg(const char *arg_file, const ArgModel *model,
 
 
 
+// Reads the ARGs of the runs of sample 'rep' one at a time and adds their
+// sufficient statistics to 'data'.  Returns the number of ARGs read, which
+// stops at the first run without an ARG for the sample.
+int read_sample_stats(const Config &c, int rep, ArgModel *model,
+                      struct popsize_data *data)
+{
+    int num_read = 0;
+    for (int mpi=0; mpi==0 || mpi < c.mpi; mpi++) {
+        char file[10000];
+        if (!c.mpi)
+            snprintf(file, sizeof(file), "%s.%i.smc.gz", c.arg_dir.c_str(),
+                     rep);
+        else
+            snprintf(file, sizeof(file), "%s%i.%i.smc.gz", c.arg_dir.c_str(),
+                     mpi, rep);
+
+        // the samples of a run end at the first missing file
+        struct stat st;
+        if (stat(file, &st) != 0)
+            break;
+
+        LocalTrees trees;
+        vector<string> seqnames;
+        if (!read_arg(file, &c.model, &trees, seqnames))
+            break;
+        printLog(LOG_LOW, "read input ARG from %s\n", file);
+        popsize_sufficient_stats(data, model, &trees, num_read > 0);
+        num_read++;
+    }
+    return num_read;
+}
+
+
 //=============================================================================
 
 
@@ -408,7 +447,7 @@ int main(int argc, char **argv)
         c.model.set_log_times(c.maxtime, c.ntimes, c.delta);
     c.model.rho = c.rho;
     c.model.mu = c.mu;
-    c.model.set_popsizes(c.popsize_str, c.model.ntimes);
+    c.model.set_popsizes(c.popsize_str);
     c.model.popsize_config.pseudocount = c.pseudocount;
 
     // log original model
@@ -424,35 +463,37 @@ int main(int argc, char **argv)
     }
 
     print_stats_header(&c);
-    //    ExtendArray<struct popsize_data> suff_stats;
-    for (int rep=c.arg_start; ; rep += c.arg_step) {
-	struct popsize_data data;
-	int num_read=0;
-	for (int mpi=0; mpi==0 || mpi < c.mpi; mpi++) {
-	    char file[10000];
-	    if (!c.mpi)
-		sprintf(file, "%s.%i.smc.gz", c.arg_dir.c_str(), rep);
-	    else sprintf(file, "%s%i.%i.smc.gz", c.arg_dir.c_str(), mpi, rep);
-	    LocalTrees *trees = new LocalTrees();
-	    bool new_arg;
-	    vector<string> seqnames;
-	    new_arg = read_arg(file, &c.model, trees, seqnames);
-	    if (new_arg) {
-		printLog(LOG_LOW, "read input ARG from %s\n", file);
-		// TODO: set pseudocount to zero first? Keep that separate?
-		//	    popsize_sufficient_stats(&data, model, trees);
-		//	    suff_stats.push(&data);
-		popsize_sufficient_stats(&data, &model, trees, mpi != 0);
-	    }
-	    delete trees;
-	    if (!new_arg) break;
-	    num_read++;
-	}
-	if (num_read == 0) break;
-	if (c.mpi > 0 && num_read != c.mpi) break;
-	mle_popsize(&model, &data, c.min_events);
-	print_stats_popsizes(&c, rep, &model);
-	delete_popsize_data(&data);
+
+    // ARG samples are read in batches.  With --threads each sample of a
+    // batch is read by a different task, which adds the statistics of its
+    // runs to the sample's popsize_data one ARG at a time.  Estimates are
+    // then made in sample order, each starting from the previous one, so
+    // the output is the same as with one thread.
+    ThreadPool *pool = get_thread_pool(c.nthreads);
+    const int batch_size = pool ? 4 * c.nthreads : 1;
+    bool done = false;
+    for (int rep0=c.arg_start; !done; rep0 += batch_size * c.arg_step) {
+        vector<struct popsize_data> data(batch_size);
+        vector<int> num_read(batch_size, 0);
+        auto read_sample = [&](int k) {
+            num_read[k] = read_sample_stats(c, rep0 + k * c.arg_step,
+                                            &model, &data[k]);
+        };
+        if (pool)
+            pool->run(batch_size, read_sample);
+        else
+            read_sample(0);
+
+        for (int k=0; k<batch_size; k++) {
+            if (num_read[k] == 0 || (c.mpi > 0 && num_read[k] != c.mpi))
+                done = true;
+            if (!done) {
+                mle_popsize(&model, &data[k], c.min_events);
+                print_stats_popsizes(&c, rep0 + k * c.arg_step, &model);
+            }
+            if (num_read[k] > 0)
+                delete_popsize_data(&data[k]);
+        }
     }
 
     // get memory usage in MB
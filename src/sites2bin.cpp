@@ -0,0 +1,203 @@
+#include "getopt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <set>
+#include <string>
+
+// argweaver includes
+#include "argweaver/compress.h"
+#include "argweaver/logging.h"
+#include "argweaver/sequences.h"
+
+using namespace argweaver;
+
+
+void print_usage() {
+    printf("sites2bin: This program converts an alignment in the sites,\n"
+           "  FASTA or VCF format into a binary sites file.  Binary sites\n"
+           "  files store each site sparsely, by the sequences that differ\n"
+           "  from its most common base, and index the sites by position,\n"
+           "  so that arg-sample --sites and this program read a region or\n"
+           "  a subset of the sequences without decoding the rest.\n"
+           "  Binary sites files may be given wherever sites files are\n"
+           "  read.\n\n");
+    printf("Usage: ./sites2bin [OPTIONS] <output-file>\n"
+           "  output-file can be '-' for stdout, or end in .gz to be\n"
+           "  gzipped (gzipped files are not indexed)\n"
+           " OPTIONS:\n"
+           " --sites <file.sites>\n"
+           "   Read a sites file (text or binary, can be gzipped)\n"
+           " --fasta <file.fa>\n"
+           "   Read a FASTA alignment\n"
+           " --vcf <file.vcf.gz>\n"
+           "   Read a VCF file indexed with tabix; needs --region\n"
+           "   CHROM:START-END\n"
+           " --region START-END\n"
+           "   Keep only these coordinates (1-based).  For --vcf, the region\n"
+           "   is CHROM:START-END.\n"
+           " --subset <names.txt>\n"
+           "   Keep only the sequences (or individuals, whose haplotypes are\n"
+           "   <name>_1 and <name>_2) listed in this file, and the sites\n"
+           "   that vary among them\n"
+           " --text\n"
+           "   Write the text sites format instead\n"
+           " --threads <n>\n"
+           "   Number of threads used for parsing a VCF file\n"
+           " --help\n"
+           "   Print this message\n");
+}
+
+
+// Reads the names of a --subset file
+bool read_names(const char *filename, set<string> *names) {
+    FILE *infile = fopen(filename, "r");
+    if (infile == NULL) {
+        fprintf(stderr, "Error opening %s\n", filename);
+        return false;
+    }
+    char name[10000];
+    while (EOF != fscanf(infile, "%9999s", name))
+        names->insert(string(name));
+    fclose(infile);
+    return true;
+}
+
+
+// Writes the sites, keeping masked sites
+bool write_output(FILE *stream, Sites *sites, bool text) {
+    if (!text)
+        return write_sites_binary(stream, sites, true);
+    write_sites(stream, sites, true);
+    return !ferror(stream);
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    int opt_idx;
+    const char *sites_file = NULL, *fasta_file = NULL, *vcf_file = NULL;
+    const char *region = NULL, *subset_file = NULL;
+    bool text = false;
+    int nthreads = 1;
+    struct option long_opts[] = {
+        {"sites", 1, 0, 's'},
+        {"fasta", 1, 0, 'f'},
+        {"vcf", 1, 0, 'v'},
+        {"region", 1, 0, 'r'},
+        {"subset", 1, 0, 'i'},
+        {"text", 0, 0, 'x'},
+        {"threads", 1, 0, 't'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "s:f:r:i:h", long_opts,
+                                  &opt_idx)) != -1) {
+        switch (c) {
+        case 's':
+            sites_file = optarg;
+            break;
+        case 'f':
+            fasta_file = optarg;
+            break;
+        case 'v':
+            vcf_file = optarg;
+            break;
+        case 'r':
+            region = optarg;
+            break;
+        case 'i':
+            subset_file = optarg;
+            break;
+        case 'x':
+            text = true;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                fprintf(stderr, "--threads must be at least 1\n");
+                return 1;
+            }
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 1 ||
+        (sites_file != NULL) + (fasta_file != NULL) + (vcf_file != NULL)
+        != 1) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    const char *outfile = argv[optind];
+    Logger *logger = new Logger(stderr, LOG_HIGH);
+    g_logger.setChain(logger);
+
+    set<string> names;
+    if (subset_file != NULL && !read_names(subset_file, &names))
+        return 1;
+
+    Sites sites;
+    if (sites_file != NULL) {
+        int start = -1, end = -1;
+        if (region != NULL) {
+            const char *coords = strchr(region, ':');
+            if (2 != sscanf(coords ? coords + 1 : region, "%d-%d",
+                            &start, &end) || start < 1 || end < start) {
+                fprintf(stderr, "error parsing region %s\n", region);
+                return 1;
+            }
+            start--;  //convert to 0-based
+        }
+        if (!(subset_file != NULL ?
+              read_sites_subset(sites_file, &sites, names, start, end) :
+              read_sites(sites_file, &sites, start, end))) {
+            fprintf(stderr, "Error reading %s\n", sites_file);
+            return 1;
+        }
+    } else if (fasta_file != NULL) {
+        if (region != NULL) {
+            fprintf(stderr, "--region cannot be used with --fasta\n");
+            return 1;
+        }
+        Sequences sequences;
+        if (!read_fasta(fasta_file, &sequences)) {
+            fprintf(stderr, "Error reading %s\n", fasta_file);
+            return 1;
+        }
+        make_sites_from_sequences(&sequences, &sites);
+        if (subset_file != NULL && sites.subset(names))
+            return 1;
+    } else {
+        if (region == NULL) {
+            fprintf(stderr, "--vcf needs --region CHROM:START-END\n");
+            return 1;
+        }
+        if (!read_vcf(vcf_file, &sites, region, 0.0, "", false, 0.0,
+                      false, NULL, names, nthreads) ||
+            (subset_file != NULL && sites.subset(names))) {
+            fprintf(stderr, "Error reading %s\n", vcf_file);
+            return 1;
+        }
+    }
+
+    bool ok;
+    if (strcmp(outfile, "-") == 0) {
+        ok = write_output(stdout, &sites, text);
+    } else {
+        CompressStream out(outfile, "w");
+        if (out.stream == NULL) {
+            fprintf(stderr, "Error opening %s\n", outfile);
+            return 1;
+        }
+        ok = write_output(out.stream, &sites, text);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error writing %s\n", outfile);
+        return 1;
+    }
+    return 0;
+}
@@ -2,16 +2,23 @@
 #include <iostream>
 #include <fstream>
 #include <assert.h>
+#include <mutex>
+#include <queue>
 
 // argweaver includes
 #include "argweaver/local_tree.h"
 #include "argweaver/compress.h"
 #include "argweaver/parsing.h"
 #include "argweaver/model.h"
+#include "argweaver/tabix.h"
+#include "argweaver/thread_pool.h"
 
 //using namespace spidir;
 using namespace argweaver;
 
+// spacing of the newick trees written with --spr
+const int SPR_KEYFRAME = 100000;
+
 void print_usage() {
     printf("smc2bed: This program converts a single smc file into a\n"
            "  bed file. The bed file format is chrom,start,end,sample,tree.\n"
@@ -21,8 +28,10 @@ void print_usage() {
            "This program is intended for use combining multiple SMC files\n"
            "  from different MCMC samples; the pipeline for doing this is to\n"
            "  run smc2bed on each file, piping the results to sort-bed, then\n"
-           "  bgzip. The resulting file can be indexed using tabix.\n\n");
-    printf("Usage: ./smc2bed [OPTIONS] <smc-file>\n"
+           "  bgzip. The resulting file can be indexed using tabix.\n"
+           "  Alternatively, smc2bed can convert all files at once with\n"
+           "  --output, which writes a sorted, bgzipped and indexed file.\n\n");
+    printf("Usage: ./smc2bed [OPTIONS] <smc-file> [<smc-file> ...]\n"
            "  smc-file can be gzipped\n"
            " OPTIONS:\n"
            " --region START-END\n"
@@ -33,15 +42,33 @@ void print_usage() {
            " --log-file <file.log>\n"
            "   Log file from arg-sample run; this is used as input to read model"
            "   parameters. If not provided, smc2bed will look for log file"
-           "   in directory with smc file.\n");
+           "   in directory with smc file.\n"
+           " --spr\n"
+           "   Write most trees as the SPR from the previous tree instead of\n"
+           "   as a newick string, with a newick tree every %i bp. This\n"
+           "   makes the file smaller and faster to read with arg-summarize.\n"
+           " --output <file.bed.gz>\n"
+           "   Merge the trees of all smc files sorted by coordinate into\n"
+           "   this file, bgzipped and indexed for tabix. With several smc\n"
+           "   files, sample numbers are taken from the file names\n"
+           "   (<base>.<sample>.smc.gz), and the log file is guessed from\n"
+           "   the first one.\n"
+           " --threads <n>\n"
+           "   Number of smc files converted at once with --output\n",
+           SPR_KEYFRAME);
 }
 
 
 bool guess_log_file(char *smc_file, char *log_file) {
     int len = strlen(smc_file);
     strcpy(log_file, smc_file);
-    if (strcmp(&smc_file[len-7], ".smc.gz")==0) {
-        int pos=len-8;
+    const char *suffixes[] = {".smc.gz", ".smcb.gz", ".smcb"};
+    for (int i=0; i<3; i++) {
+        int suffix_len = strlen(suffixes[i]);
+        if (len < suffix_len ||
+            strcmp(&smc_file[len-suffix_len], suffixes[i]) != 0)
+            continue;
+        int pos=len-suffix_len-1;
         while (pos >= 0 && smc_file[pos] != '.') pos--;
         if (pos < 0) return false;
         log_file[pos]='\0';
@@ -52,21 +79,304 @@ bool guess_log_file(char *smc_file, char *log_file) {
 }
 
 
+// Returns the MCMC sample of an arg-sample output file
+// (<base>.<sample>.smc.gz) or -1 if the name has no sample number
+int guess_sample(const char *smc_file) {
+    string name = smc_file;
+    const char *suffixes[] = {".smc.gz", ".smcb.gz", ".smcb", ".smc"};
+    for (int i=0; i<4; i++) {
+        const string suffix = suffixes[i];
+        if (name.size() > suffix.size() &&
+            name.compare(name.size() - suffix.size(), suffix.size(),
+                         suffix) == 0) {
+            name.resize(name.size() - suffix.size());
+            size_t dot = name.rfind('.');
+            if (dot == string::npos || dot + 1 == name.size())
+                return -1;
+            char *end;
+            long sample = strtol(name.c_str() + dot + 1, &end, 10);
+            return *end == '\0' ? sample : -1;
+        }
+    }
+    return -1;
+}
+
+
+// Writes the trees of an smc file as bed lines
+bool smc_to_bed(const char *smc_file, int sample, const int region[2],
+                const ArgModel *model, int spr_keyframe, FILE *out) {
+    CompressStream instream(smc_file, "r");
+    if (instream.stream == NULL) {
+        fprintf(stderr, "Error opening %s\n", smc_file);
+        return false;
+    }
+    vector<string> seqnames;
+    LocalTrees *trees = new LocalTrees();
+    if (!read_local_trees(instream.stream, model->times, model->ntimes,
+                          trees, seqnames)) {
+        fprintf(stderr, "Error parsing SMC file %s\n", smc_file);
+        delete trees;
+        return false;
+    }
+    instream.close();
+    if (region[0] != -1) {
+        LocalTrees *trees2 = partition_local_trees(trees, region[0], true);
+        delete trees;
+        trees = trees2;
+    }
+    if (region[1] != -1)
+        partition_local_trees(trees, region[1], true);
+    write_local_trees_as_bed(out, trees, seqnames,
+                             model, sample, spr_keyframe);
+    delete trees;
+    return true;
+}
+
+
+// Bed lines of several smc files, kept in one temporary file until they
+// are merged.  The lines of each file are appended in chunks as they are
+// written, so that converting files in parallel only buffers a chunk per
+// file being converted.
+class BedSpill {
+public:
+    BedSpill(int nfiles) : file(tmpfile()), size(0), segments(nfiles) {}
+    ~BedSpill() {
+        if (file) fclose(file);
+    }
+
+    bool append(int index, const string &data) {
+        lock_guard<mutex> guard(lock);
+        if (fseeko(file, size, SEEK_SET) != 0 ||
+            fwrite(data.data(), 1, data.size(), file) != data.size())
+            return false;
+        segments[index].push_back(make_pair(size, data.size()));
+        size += data.size();
+        return true;
+    }
+
+    FILE *file;
+    off_t size;
+    vector<vector<pair<off_t, size_t> > > segments;  // chunks of each file
+    mutex lock;
+};
+
+
+// A stream appending the bed lines of one file to the spill
+class BedSpillWriter {
+public:
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    BedSpillWriter(BedSpill *spill, int index) :
+        spill(spill), index(index), ok(true) {}
+
+    static ssize_t write(void *cookie, const char *buf, size_t size) {
+        BedSpillWriter *writer = (BedSpillWriter*) cookie;
+        writer->buffer.append(buf, size);
+        if (writer->buffer.size() >= CHUNK_SIZE)
+            writer->flush();
+        return writer->ok ? size : -1;
+    }
+
+    static int close(void *cookie) {
+        BedSpillWriter *writer = (BedSpillWriter*) cookie;
+        writer->flush();
+        return writer->ok ? 0 : EOF;
+    }
+
+    void flush() {
+        if (!buffer.empty() && !spill->append(index, buffer))
+            ok = false;
+        buffer.clear();
+    }
+
+    BedSpill *spill;
+    int index;
+    string buffer;
+    bool ok;
+};
+
+
+// Reads back the bed lines of one file from the spill
+class BedSpillReader {
+public:
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    BedSpillReader(BedSpill *spill, int index, int sample) :
+        spill(spill), index(index), sample(sample), segment(0),
+        segment_pos(0), pos(0) {}
+
+    // reads the next bed line, skipping header lines
+    bool next() {
+        while (true) {
+            size_t newline = buffer.find('\n', pos);
+            while (newline == string::npos) {
+                buffer.erase(0, pos);
+                pos = 0;
+                if (!fill())
+                    return false;
+                newline = buffer.find('\n');
+            }
+            line.assign(buffer, pos, newline - pos + 1);
+            pos = newline + 1;
+            if (line[0] == '#')
+                continue;
+
+            const size_t tab = line.find('\t');
+            chrom.assign(line, 0, tab);
+            char *end_ptr;
+            start = strtol(line.c_str() + tab + 1, &end_ptr, 10);
+            end = strtol(end_ptr + 1, NULL, 10);
+            return true;
+        }
+    }
+
+    string line;
+    string chrom;
+    int start;
+    int end;
+
+    BedSpill *spill;
+    int index;
+    int sample;
+
+protected:
+    bool fill() {
+        const vector<pair<off_t, size_t> > &segments =
+            spill->segments[index];
+        while (segment < segments.size() &&
+               segment_pos == segments[segment].second) {
+            segment++;
+            segment_pos = 0;
+        }
+        if (segment == segments.size())
+            return false;
+
+        const size_t n = min(BUFFER_SIZE,
+                             segments[segment].second - segment_pos);
+        const size_t old_size = buffer.size();
+        buffer.resize(old_size + n);
+        if (fseeko(spill->file, segments[segment].first + segment_pos,
+                   SEEK_SET) != 0 ||
+            fread(&buffer[old_size], 1, n, spill->file) != n)
+            return false;
+        segment_pos += n;
+        return true;
+    }
+
+    unsigned int segment;
+    size_t segment_pos;
+    string buffer;
+    size_t pos;
+};
+
+
+// Orders bed lines by coordinate, then by sample, like sort-bed
+struct BedSpillLater {
+    bool operator()(const BedSpillReader *a, const BedSpillReader *b) const {
+        int cmp = a->chrom.compare(b->chrom);
+        if (cmp != 0) return cmp > 0;
+        if (a->start != b->start) return a->start > b->start;
+        if (a->end != b->end) return a->end > b->end;
+        return a->sample > b->sample;
+    }
+};
+
+
+// Converts smc files in parallel and merges their bed lines into a
+// sorted, bgzipped and indexed file
+bool smc_files_to_bed(const vector<char*> &smc_files,
+                      const vector<int> &samples, const int region[2],
+                      const ArgModel *model, int spr_keyframe,
+                      const char *outfile, int nthreads) {
+    const int nfiles = smc_files.size();
+    BedSpill spill(nfiles);
+    if (spill.file == NULL) {
+        fprintf(stderr, "Error opening temporary file\n");
+        return false;
+    }
+
+    vector<int> ok(nfiles, 0);
+    auto convert = [&](int i) {
+        BedSpillWriter *writer = new BedSpillWriter(&spill, i);
+        cookie_io_functions_t funcs = {NULL, BedSpillWriter::write, NULL,
+                                       BedSpillWriter::close};
+        FILE *out = fopencookie(writer, "w", funcs);
+        if (out) {
+            ok[i] = smc_to_bed(smc_files[i], samples[i], region, model,
+                               spr_keyframe, out);
+            if (fclose(out) != 0)
+                ok[i] = false;
+        }
+        delete writer;
+    };
+    ThreadPool *pool = get_thread_pool(nthreads);
+    if (pool)
+        pool->run(nfiles, convert);
+    else {
+        for (int i=0; i<nfiles; i++)
+            convert(i);
+    }
+    for (int i=0; i<nfiles; i++) {
+        if (!ok[i]) {
+            fprintf(stderr, "Error converting %s\n", smc_files[i]);
+            return false;
+        }
+    }
+
+    // k-way merge of the files' lines, which are sorted within each file
+    set_compress_threads(nthreads);
+    CompressStream out(outfile, "w");
+    if (out.stream == NULL) {
+        fprintf(stderr, "Error opening %s\n", outfile);
+        return false;
+    }
+    if (spr_keyframe > 0)
+        fprintf(out.stream, BED_SPR_HEADER "%d\n", spr_keyframe);
+    vector<BedSpillReader*> readers;
+    priority_queue<BedSpillReader*, vector<BedSpillReader*>,
+                   BedSpillLater> queue;
+    for (int i=0; i<nfiles; i++) {
+        readers.push_back(new BedSpillReader(&spill, i, samples[i]));
+        if (readers.back()->next())
+            queue.push(readers.back());
+    }
+    while (!queue.empty()) {
+        BedSpillReader *reader = queue.top();
+        queue.pop();
+        fputs(reader->line.c_str(), out.stream);
+        if (reader->next())
+            queue.push(reader);
+    }
+    for (int i=0; i<nfiles; i++)
+        delete readers[i];
+    out.close();
+
+    if (out.compress)
+        return write_tabix_index(outfile);
+    return true;
+}
+
+
 int main(int argc, char *argv[]) {
     char c;
     int region[2]={-1,-1};
-    LocalTrees *trees=NULL;
     char *log_file = NULL;
+    char *outfile = NULL;
     ArgModel *model;
-    int sample=0, opt_idx;
+    int sample=-1, opt_idx;
+    int spr_keyframe=0;
+    int nthreads=1;
     struct option long_opts[] = {
         {"region", 1, 0, 'r'},
         {"sample", 1, 0, 's'},
         {"log-file", 1, 0, 'l'},
+        {"spr", 0, 0, 'p'},
+        {"output", 1, 0, 'o'},
+        {"threads", 1, 0, 't'},
         {"help", 0, 0, 'h'},
         {0,0,0,0}};
-    while ((c = (char)getopt_long(argc, argv, "r:s:l:h", long_opts, &opt_idx))
-           != -1) {
+    while ((c = (char)getopt_long(argc, argv, "r:s:l:o:h", long_opts,
+                                  &opt_idx)) != -1) {
         switch (c) {
         case 'r':
             if (2 != (sscanf(optarg, "%d-%d", &region[0], &region[1]))) {
@@ -81,6 +391,19 @@ int main(int argc, char *argv[]) {
         case 'l':
             log_file = optarg;
             break;
+        case 'p':
+            spr_keyframe = SPR_KEYFRAME;
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                fprintf(stderr, "--threads must be at least 1\n");
+                return 1;
+            }
+            break;
         case 'h':
             print_usage();
             return 0;
@@ -89,10 +412,15 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
-    if (optind != argc - 1) {
+    const int nfiles = argc - optind;
+    if (nfiles < 1 || (nfiles > 1 && outfile == NULL)) {
         fprintf(stderr, "Bad arguments. Try --help\n");
         return 1;
     }
+    if (nfiles > 1 && sample != -1) {
+        fprintf(stderr, "--sample can only be used with one smc file\n");
+        return 1;
+    }
     Logger *logger = new Logger(stderr, LOG_HIGH);
     g_logger.setChain(logger);
 
@@ -109,24 +437,28 @@ int main(int argc, char *argv[]) {
         model = new ArgModel(log_file);
     }
 
-    CompressStream instream(argv[optind], "r");
-    vector<string> seqnames;
-
-    trees = new LocalTrees();
-    if (!read_local_trees(instream.stream, model->times, model->ntimes,
-                          trees, seqnames)) {
-        fprintf(stderr, "Error parsing SMC file\n");
-        return 1;
-    }
-    if (region[0] != -1) {
-        LocalTrees *trees2 = partition_local_trees(trees, region[0], true);
-        delete trees;
-        trees = trees2;
+    vector<char*> smc_files(argv + optind, argv + argc);
+    vector<int> samples;
+    for (int i=0; i<nfiles; i++) {
+        if (nfiles == 1) {
+            samples.push_back(sample == -1 ? 0 : sample);
+        } else {
+            samples.push_back(guess_sample(smc_files[i]));
+            if (samples.back() == -1) {
+                fprintf(stderr, "Could not guess sample number of %s\n",
+                        smc_files[i]);
+                return 1;
+            }
+        }
     }
-    if (region[1] != -1)
-        partition_local_trees(trees, region[1], true);
-    write_local_trees_as_bed(stdout, trees, seqnames,
-                             model, sample);
-    instream.close();
-    return 0;
+
+    bool ok;
+    if (outfile == NULL)
+        ok = smc_to_bed(smc_files[0], samples[0], region, model,
+                        spr_keyframe, stdout);
+    else
+        ok = smc_files_to_bed(smc_files, samples, region, model,
+                              spr_keyframe, outfile, nthreads);
+    delete model;
+    return ok ? 0 : 1;
 }
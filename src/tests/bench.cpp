@@ -0,0 +1,304 @@
+#include "getopt.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// argweaver includes
+#include "argweaver/common.h"
+#include "argweaver/emit.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/logging.h"
+#include "argweaver/matrices.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/sequences.h"
+#include "argweaver/states.h"
+#include "argweaver/trans.h"
+
+using namespace argweaver;
+
+
+void print_usage() {
+    printf("bench: This program times the kernels of the threading HMM on\n"
+           "  an ARG sampled from simulated sequences.  Each line of output\n"
+           "  gives, tab-separated, the kernel, the problem size (sequences,\n"
+           "  time points, populations, states and sites per call), the\n"
+           "  number of calls timed, their total time and the time per\n"
+           "  call in microseconds.\n\n");
+    printf("Usage: src/tests/bench [OPTIONS]\n"
+           " OPTIONS:\n"
+           " -n,--nseqs <n>\n"
+           "   Number of sequences in the ARG (default=10); one more is\n"
+           "   threaded through it\n"
+           " -k,--length <sites>\n"
+           "   Number of sites (default=20000)\n"
+           " --ntimes <ntimes>\n"
+           "   Number of time points (default=20)\n"
+           " --npop <npop>\n"
+           "   Number of populations (default=1).  Populations 1..npop-1\n"
+           "   split from population 0 halfway back in time\n"
+           " --blocklen <sites>\n"
+           "   Number of sites of the forward and emission blocks\n"
+           "   (default=1000)\n"
+           " --min-time <seconds>\n"
+           "   Time each kernel for at least this long (default=0.5)\n"
+           " --randseed <seed>\n"
+           "   Seed of the simulated sequences (default=1)\n"
+           " --no-header\n"
+           "   Do not write the line of column names\n"
+           " --help\n"
+           "   Print this message\n");
+}
+
+
+// results of the kernels, kept so that no call is optimized away
+double bench_sink = 0.0;
+
+
+// Calls 'kernel' until at least 'min_time' seconds have passed and writes
+// one line of results.
+template <class Kernel>
+void run_bench(const char *name, const ArgModel &model, int nseqs, int nstates,
+               int nsites, double min_time, Kernel kernel)
+{
+    long long ncalls = 0;
+    long long batch = 1;
+    Timer timer;
+    double secs = 0.0;
+    while (secs < min_time) {
+        for (long long i=0; i<batch; i++)
+            kernel();
+        ncalls += batch;
+        batch *= 2;
+        secs = timer.time();
+    }
+    printf("%s\t%d\t%d\t%d\t%d\t%d\t%lld\t%f\t%f\n", name, nseqs,
+           model.ntimes, model.num_pops(), nstates, nsites, ncalls, secs,
+           secs / ncalls * 1e6);
+    fflush(stdout);
+}
+
+
+int main(int argc, char *argv[]) {
+    int nseqs = 10;
+    int seqlen = 20000;
+    int ntimes = 20;
+    int npop = 1;
+    int blocklen = 1000;
+    double min_time = 0.5;
+    int randseed = 1;
+    bool header = true;
+
+    char c;
+    int opt_idx;
+    struct option long_opts[] = {
+        {"nseqs", 1, 0, 'n'},
+        {"length", 1, 0, 'k'},
+        {"ntimes", 1, 0, 't'},
+        {"npop", 1, 0, 'p'},
+        {"blocklen", 1, 0, 'b'},
+        {"min-time", 1, 0, 'm'},
+        {"randseed", 1, 0, 'r'},
+        {"no-header", 0, 0, 'H'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "n:k:h", long_opts, &opt_idx))
+           != -1) {
+        switch (c) {
+        case 'n': nseqs = atoi(optarg); break;
+        case 'k': seqlen = atoi(optarg); break;
+        case 't': ntimes = atoi(optarg); break;
+        case 'p': npop = atoi(optarg); break;
+        case 'b': blocklen = atoi(optarg); break;
+        case 'm': min_time = atof(optarg); break;
+        case 'r': randseed = atoi(optarg); break;
+        case 'H': header = false; break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    if (nseqs < 2 || ntimes < 2 || npop < 1 || seqlen < 1 || blocklen < 1) {
+        fprintf(stderr, "nseqs, ntimes, npop, length and blocklen must be"
+                " positive, and nseqs and ntimes at least 2\n");
+        return 1;
+    }
+    blocklen = min(blocklen, seqlen);
+    Logger *logger = new Logger(stderr, LOG_QUIET);
+    g_logger.setChain(logger);
+    srand(randseed);
+
+    // model
+    ArgModel model(ntimes, 1.6e-8, 1.8e-8);
+    model.set_log_times(200e3, ntimes);
+    if (npop > 1) {
+        char *pops = NULL;
+        size_t pops_size = 0;
+        FILE *out = open_memstream(&pops, &pops_size);
+        fprintf(out, "npop %d\n", npop);
+        for (int i=1; i<npop; i++)
+            fprintf(out, "div %f %d 0\n", model.times[ntimes / 2], i);
+        fclose(out);
+        FILE *infile = fmemopen(pops, pops_size, "r");
+        model.read_population_tree(infile);
+        fclose(infile);
+        free(pops);
+        model.pop_tree->max_migrations = 1;
+    }
+    model.set_popsizes(1e4);
+
+    // simulated sequences: rare segregating sites with random bases
+    const char *bases = "ACGT";
+    char **seqs = new char* [nseqs + 1];
+    char **names = new char* [nseqs + 1];
+    for (int j=0; j<=nseqs; j++) {
+        seqs[j] = new char [seqlen + 1];
+        names[j] = new char [16];
+        snprintf(names[j], 16, "n%d", j);
+        seqs[j][seqlen] = '\0';
+    }
+    for (int i=0; i<seqlen; i++) {
+        const char base = bases[irand(4)];
+        const bool segregating = (frand() < .02);
+        for (int j=0; j<=nseqs; j++)
+            seqs[j][i] = segregating ? bases[irand(4)] : base;
+    }
+    Sequences sequences;
+    sequences.extend(seqs, names, nseqs + 1);
+    for (int j=0; j<=nseqs; j++)
+        sequences.pops[j] = j % npop;
+    sequences.set_age();
+
+    // ARG of the first nseqs sequences, through which the last one
+    // is threaded
+    Sequences arg_seqs(&sequences, nseqs);
+    LocalTrees trees(0, seqlen);
+    sample_arg_seq(&model, &arg_seqs, &trees);
+
+    // first block and the first switch between blocks
+    const LocalTree *tree = trees.front().tree;
+    LocalTrees::const_iterator next = trees.begin();
+    ++next;
+    const LocalTree *next_tree = next != trees.end() ? next->tree : NULL;
+
+    StatesModel states_model(model.ntimes, false, 0, model.pop_tree,
+                             sequences.get_pop(nseqs));
+    States states, next_states;
+    states_model.get_coal_states(tree, states);
+    const int nstates = states.size();
+    LineageCounts lineages(model.ntimes, model.num_pops());
+    lineages.count(tree, model.pop_tree);
+
+    if (header)
+        printf("kernel\tnseqs\tntimes\tnpop\tnstates\tsites\tcalls\t"
+               "seconds\tusec_per_call\n");
+
+    // emissions
+    const int nleaves = trees.get_num_leaves();
+    char *subseqs[nleaves + 1];
+    for (int i=0; i<nleaves; i++)
+        subseqs[i] = sequences.seqs[trees.seqids[i]];
+    subseqs[nleaves] = sequences.seqs[nseqs];
+    vector<vector<BaseProbs> > base_probs;
+    double **emit = new_matrix<double>(blocklen, nstates);
+    run_bench("calc_emissions", model, nseqs, nstates, blocklen, min_time,
+              [&]() {
+            calc_emissions_external(states, tree, subseqs, base_probs,
+                                    nleaves + 1, blocklen, &model, emit,
+                                    NULL);
+            bench_sink += emit[0][0];
+        });
+
+    // transition matrix of a block
+    TransMatrix matrix(&model, nstates);
+    run_bench("calc_transition_probs", model, nseqs, nstates, 1, min_time,
+              [&]() {
+            matrix.calc_transition_probs(tree, &model, states, &lineages);
+            bench_sink += matrix.get(tree, states, 0, 0);
+        });
+
+    // forward algorithm within a block
+    double **fw = new_matrix<double>(blocklen, nstates);
+    run_bench("arghmm_forward_block", model, nseqs, nstates, blocklen,
+              min_time, [&]() {
+            for (int k=0; k<nstates; k++)
+                fw[0][k] = 1.0 / nstates;
+            arghmm_forward_block(&model, tree, blocklen, states, lineages,
+                                 &matrix, emit, fw);
+            bench_sink += fw[blocklen - 1][0];
+        });
+
+    // switch between the first two blocks
+    if (next_tree) {
+        const LocalTreeSpr &spr = *next;
+        states_model.get_coal_states(next_tree, next_states);
+        const int nstates2 = next_states.size();
+        TransMatrixSwitch matrix_switch(nstates, nstates2,
+                                        model.num_pop_paths());
+        run_bench("calc_transition_probs_switch", model, nseqs, nstates2, 1,
+                  min_time, [&]() {
+                calc_transition_probs_switch(
+                    next_tree, tree, spr.spr, spr.mapping, states,
+                    next_states, &model, &lineages, &matrix_switch);
+                bench_sink += matrix_switch.get(0, 0);
+            });
+
+        double *col2 = new double [nstates2];
+        run_bench("arghmm_forward_switch", model, nseqs, nstates2, 1,
+                  min_time, [&]() {
+                arghmm_forward_switch(fw[blocklen - 1], col2,
+                                      &matrix_switch, emit[0]);
+                bench_sink += col2[0];
+            });
+        delete [] col2;
+    }
+
+    // traceback over the whole region
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, nseqs);
+    matrix_iter.set_start_pop(sequences.get_pop(nseqs));
+    ArgHmmForwardTable forward(trees.start_coord, seqlen);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    ArgHmmMatrixIter matrix_iter2(&model, NULL, &trees, nseqs);
+    matrix_iter2.set_start_pop(sequences.get_pop(nseqs));
+    int *path = new int [seqlen];
+    run_bench("stochastic_traceback", model, nseqs, nstates, seqlen,
+              min_time, [&]() {
+            bench_sink += stochastic_traceback(&trees, &model, &matrix_iter2,
+                                               &forward, path);
+        });
+    delete [] path;
+
+    // newick trees
+    char *newick = NULL;
+    size_t newick_size = 0;
+    FILE *out = open_memstream(&newick, &newick_size);
+    write_newick_tree(out, tree, NULL, model.times, 0, true,
+                      model.pop_tree != NULL);
+    fclose(out);
+    LocalTree parsed;
+    run_bench("parse_local_tree", model, nseqs, nstates, 1, min_time,
+              [&]() {
+            if (!parse_local_tree(newick, &parsed, model.times, model.ntimes))
+                exitError("cannot parse tree %s\n", newick);
+            bench_sink += parsed.root;
+        });
+    free(newick);
+
+    delete_matrix<double>(emit, blocklen);
+    delete_matrix<double>(fw, blocklen);
+    for (int j=0; j<=nseqs; j++) {
+        delete [] seqs[j];
+        delete [] names[j];
+    }
+    delete [] seqs;
+    delete [] names;
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+// Small ARGs and alignments shared by the tests
+
+#ifndef ARGWEAVER_TEST_ARGS_H
+#define ARGWEAVER_TEST_ARGS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "argweaver/common.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sequences.h"
+
+
+namespace argweaver {
+
+
+// Parse a tree of 5 leaves whose internal nodes are at times 2, 5, 7 and
+// 12 of the model
+inline bool make_test_tree(const ArgModel &model, LocalTree *tree)
+{
+    char newick[1000];
+    const double *t = model.times;
+    snprintf(newick, sizeof(newick),
+             "((0,1)5[&&NHX:age=%f],((2,3)6[&&NHX:age=%f],4)7"
+             "[&&NHX:age=%f])8[&&NHX:age=%f]", t[2], t[5], t[7], t[12]);
+    return parse_local_tree(newick, tree, model.times, model.ntimes);
+}
+
+
+// Make a region of two local trees, the test tree and the tree after an
+// SPR, of 100 and 50 sites.
+inline void make_test_trees(const ArgModel &model, LocalTrees *trees)
+{
+    LocalTree tree, tree2;
+    make_test_tree(model, &tree);
+    const Spr spr(4, 3, 5, 4);
+    tree2.copy(tree);
+    apply_spr(&tree2, spr);
+
+    const int nnodes = tree.nnodes;
+    int ptree1[nnodes], ptree2[nnodes], ages1[nnodes], ages2[nnodes];
+    for (int i=0; i<nnodes; i++) {
+        ptree1[i] = tree.nodes[i].parent;
+        ptree2[i] = tree2.nodes[i].parent;
+        ages1[i] = tree.nodes[i].age;
+        ages2[i] = tree2.nodes[i].age;
+    }
+    int *ptrees[] = {ptree1, ptree2};
+    int *ages[] = {ages1, ages2};
+    int ispr1[] = {-1, -1, -1, -1};
+    int ispr2[] = {spr.recomb_node, spr.recomb_time,
+                   spr.coal_node, spr.coal_time};
+    int *isprs[] = {ispr1, ispr2};
+    int blocklens[] = {100, 50};
+    LocalTrees trees2(ptrees, ages, isprs, blocklens, 2, nnodes);
+    trees->copy(trees2);
+    for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it)
+        for (int i=0; i<nnodes; i++)
+            it->tree->nodes[i].pop_path = 0;
+}
+
+
+// Writes local trees of 5 leaves in the text SMC format
+inline string write_smc_text(const LocalTrees *trees, const double *times,
+                             const vector<int> &self_recomb_pos,
+                             const vector<Spr> &self_recombs)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    const char *names[] = {"a", "b", "c", "d", "e"};
+    write_local_trees(out, trees, names, times, false,
+                      self_recomb_pos, self_recombs);
+    fclose(out);
+    string text(buf, size);
+    free(buf);
+    return text;
+}
+
+
+// An alignment of random sequences with a variable site every 50 sites.
+// The same random seed gives the same alignment.
+class TestAlignment
+{
+public:
+    TestAlignment(int nseqs, int seqlen, int seed=1234) :
+        data(nseqs * seqlen),
+        seqs(nseqs)
+    {
+        const char *bases = "ACGT";
+        srand(seed);
+        for (int j=0; j<nseqs; j++) {
+            seqs[j] = &data[j * seqlen];
+            for (int i=0; i<seqlen; i++)
+                seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+        }
+        sequences = new Sequences(&seqs[0], nseqs, seqlen);
+    }
+
+    ~TestAlignment()
+    {
+        delete sequences;
+    }
+
+    vector<char> data;
+    vector<char*> seqs;
+    Sequences *sequences;
+
+private:
+    TestAlignment(const TestAlignment &);
+    TestAlignment &operator=(const TestAlignment &);
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_TEST_ARGS_H
@@ -0,0 +1,131 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/hmm.h"
+#include "argweaver/simd.h"
+
+
+namespace argweaver {
+
+
+// The vectorized logsum should agree with logsum() for every
+// instruction set supported by this build and CPU.
+TEST(HmmTest, simd_logsum)
+{
+    const int n = 37;
+    double vals[n], vals2[n];
+    srand(1234);
+    for (int i=0; i<n; i++)
+        vals[i] = frand(-30.0, 5.0);
+    const double expected = logsum(vals, n);
+
+    const SimdLevel orig = get_simd_level();
+    for (int level=SIMD_SCALAR; level<=get_max_simd_level(); level++) {
+        SCOPED_TRACE(get_simd_name(SimdLevel(level)));
+        set_simd_level(SimdLevel(level));
+
+        // all prefix lengths exercise the vector tails
+        for (int m=1; m<=n; m++)
+            EXPECT_NEAR(simd_logsum(vals, m), logsum(vals, m), 1e-12);
+
+        for (int i=0; i<n; i++)
+            vals2[i] = vals[i];
+        // logsum ignores terms far below the maximum
+        double total = simd_exp_shift(vals2, n, expected);
+        EXPECT_NEAR(total, 1.0, 1e-6);
+        for (int i=0; i<n; i++)
+            EXPECT_NEAR(vals2[i], exp(vals[i] - expected), 1e-15);
+    }
+    set_simd_level(orig);
+}
+
+
+// The fast exp and log should stay within a few ulp of libm, and the
+// exact mode should reproduce libm.
+TEST(HmmTest, math_accuracy)
+{
+    const int n = 101;
+    double x[n], y[n], z[n];
+    srand(1234);
+    for (int i=0; i<n; i++)
+        x[i] = frand(-700.0, 700.0);
+    x[0] = -800.0;
+    x[1] = 800.0;
+    x[2] = 0.0;
+
+    const SimdLevel orig = get_simd_level();
+    for (int level=SIMD_SCALAR; level<=get_max_simd_level(); level++) {
+        SCOPED_TRACE(get_simd_name(SimdLevel(level)));
+        set_simd_level(SimdLevel(level));
+
+        set_math_accuracy(MATH_FAST);
+        // out of range arguments fall back to libm
+        copy(x, x + n, y);
+        simd_exp(y, n);
+        EXPECT_EQ(y[0], 0.0);
+        EXPECT_EQ(y[1], INFINITY);
+        for (int i=2; i<n; i++) {
+            EXPECT_NEAR(y[i], exp(x[i]), 4e-16 * exp(x[i]));
+            EXPECT_NEAR(math_exp(x[i]), exp(x[i]), 4e-16 * exp(x[i]));
+        }
+
+        copy(y, y + n, z);
+        simd_log(z, n);
+        EXPECT_EQ(z[0], -INFINITY);
+        EXPECT_EQ(z[1], INFINITY);
+        for (int i=2; i<n; i++)
+            EXPECT_NEAR(z[i], log(y[i]), 4e-16 * fabs(log(y[i])));
+
+        set_math_accuracy(MATH_EXACT);
+        copy(x, x + n, y);
+        simd_exp(y, n);
+        for (int i=0; i<n; i++)
+            EXPECT_EQ(y[i], exp(x[i]));
+    }
+    EXPECT_EQ(math_log(0.0), -INFINITY);
+    set_simd_level(orig);
+}
+
+
+// The forward and backward algorithms should give the same total
+// probability.
+TEST(HmmTest, forward_backward)
+{
+    const int n = 20, nstates = 11;
+    double **trans = new_matrix<double>(nstates, nstates);
+    double **emit = new_matrix<double>(n, nstates);
+    double **fw = new_matrix<double>(n, nstates);
+    double **bw = new_matrix<double>(n, nstates);
+
+    srand(1234);
+    for (int j=0; j<nstates; j++) {
+        double total = 0.0;
+        for (int k=0; k<nstates; k++)
+            total += (trans[j][k] = frand(.1, 1.0));
+        for (int k=0; k<nstates; k++)
+            trans[j][k] = log(trans[j][k] / total);
+    }
+    for (int i=0; i<n; i++)
+        for (int k=0; k<nstates; k++)
+            emit[i][k] = log(frand(.1, 1.0));
+
+    for (int k=0; k<nstates; k++) {
+        fw[0][k] = emit[0][k] - log(nstates);
+        bw[n-1][k] = 0.0;
+    }
+    forward_alg(n, nstates, trans, emit, fw);
+    backward_alg(n, nstates, trans, emit, bw);
+
+    double tmp[nstates];
+    for (int k=0; k<nstates; k++)
+        tmp[k] = fw[0][k] + bw[0][k];
+    EXPECT_NEAR(logsum(fw[n-1], nstates), logsum(tmp, nstates), 1e-10);
+
+    delete_matrix<double>(trans, nstates);
+    delete_matrix<double>(emit, n);
+    delete_matrix<double>(fw, n);
+    delete_matrix<double>(bw, n);
+}
+
+
+}  // namespace
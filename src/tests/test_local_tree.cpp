@@ -1,6 +1,14 @@
 #include "gtest/gtest.h"
 
+#include "argweaver/coal_records.h"
+#include "argweaver/ExtendArray.h"
 #include "argweaver/local_tree.h"
+#include "argweaver/parsing.h"
+#include "argweaver/pop_model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/Tree.h"
+
+#include "test_args.h"
 
 
 namespace argweaver {
@@ -80,4 +88,570 @@ TEST(LocalTreeTest, parse_local_tree_extra_meta_data)
 }
 
 
+
+// Parse trees with several NHX comments, whitespace and malformed input.
+TEST(LocalTreeTest, parse_local_tree_nhx)
+{
+    int ntimes = 5;
+    double times[] = {0, 10, 20, 30, 40};
+    LocalTree tree;
+
+    // the first age and pop_path keys win; a key without a value hides
+    // the key after it
+    const char *newick = "(( 0,1[&&NHX:pop_path=2:pop_path=3])3"
+        "[&&NHX:age=12:age=30] , 2[&&NHX:foo:age=10])4[&&NHX:age=19.9]";
+    ASSERT_TRUE(parse_local_tree(newick, &tree, times, ntimes));
+    EXPECT_EQ(tree.nodes[1].pop_path, 2);
+    EXPECT_EQ(tree.nodes[0].pop_path, 0);
+    EXPECT_EQ(tree.nodes[3].age, 1);
+    EXPECT_EQ(tree.nodes[2].age, 0);
+    EXPECT_EQ(tree.nodes[4].age, 2);
+    EXPECT_EQ(tree.root, 4);
+
+    EXPECT_FALSE(parse_local_tree("((0,1)3,2)4[&&NHX:age=20", &tree,
+                                  times, ntimes));
+    EXPECT_FALSE(parse_local_tree("((0,1)3,2))4", &tree, times, ntimes));
+    EXPECT_FALSE(parse_local_tree("((0,x)3,2)4", &tree, times, ntimes));
+    EXPECT_FALSE(parse_local_tree("((0,1)3,2)9", &tree, times, ntimes));
+}
+
+
+// Trees written as newick should parse back unchanged.
+TEST(LocalTreeTest, parse_local_tree_round_trip)
+{
+    const int nleaves = 12, nnodes = 2 * nleaves - 1, ntimes = 20;
+    double times[ntimes];
+    for (int i=0; i<ntimes; i++)
+        times[i] = i * i * 13.5;
+
+    srand(7);
+    for (int k=0; k<50; k++) {
+        // coalesce random pairs of lineages at increasing times
+        LocalTree tree(nnodes);
+        vector<int> lineages;
+        for (int i=0; i<nleaves; i++) {
+            tree.nodes[i].age = 0;
+            tree.nodes[i].child[0] = tree.nodes[i].child[1] = -1;
+            lineages.push_back(i);
+        }
+        for (int i=nleaves; i<nnodes; i++) {
+            tree.nodes[i].age = min(ntimes - 1, (i - nleaves) / 2 + 1);
+            tree.nodes[i].pop_path = rand() % 3;
+            for (int j=0; j<2; j++) {
+                int l = rand() % lineages.size();
+                tree.nodes[i].child[j] = lineages[l];
+                tree.nodes[lineages[l]].parent = i;
+                lineages.erase(lineages.begin() + l);
+            }
+            lineages.push_back(i);
+        }
+        tree.nodes[nnodes-1].parent = -1;
+        tree.root = nnodes - 1;
+
+        char *text;
+        size_t size;
+        FILE *out = open_memstream(&text, &size);
+        write_newick_tree(out, &tree, NULL, times, 0, true, true);
+        fclose(out);
+
+        LocalTree tree2;
+        ASSERT_TRUE(parse_local_tree(text, &tree2, times, ntimes));
+        free(text);
+        ASSERT_EQ(tree.nnodes, tree2.nnodes);
+        EXPECT_EQ(tree.root, tree2.root);
+        for (int i=0; i<nnodes; i++) {
+            EXPECT_EQ(tree.nodes[i].parent, tree2.nodes[i].parent);
+            EXPECT_EQ(tree.nodes[i].age, tree2.nodes[i].age);
+            EXPECT_EQ(tree.nodes[i].pop_path, tree2.nodes[i].pop_path);
+        }
+    }
+}
+
+
+// Time lookups should find the closest time point, preferring the
+// earlier one on ties.
+TEST(LocalTreeTest, find_time)
+{
+    const int ntimes = 6;
+    const double times[] = {0, 10, 20, 20, 35, 60};
+    for (double t=-5; t<=70; t+=0.25) {
+        int closest = 0;
+        for (int i=1; i<ntimes; i++)
+            if (fabs(times[i] - t) < fabs(times[closest] - t))
+                closest = i;
+        EXPECT_EQ(closest, find_time(t, times, ntimes)) << t;
+    }
+}
+
+
+// Grow a tree and check that pooled node arrays keep their contents and
+// are recycled.
+TEST(LocalTreeTest, node_pool)
+{
+    int ptree[] = {2, 2, -1};
+    int ages[] = {0, 0, 1};
+    LocalTree *tree = new LocalTree(ptree, 3, ages);
+    EXPECT_EQ(tree->capacity, 3);
+
+    tree->ensure_capacity(10);
+    EXPECT_EQ(tree->capacity, 10);
+    EXPECT_EQ(tree->root, 2);
+    EXPECT_EQ(tree->nodes[0].parent, 2);
+    EXPECT_EQ(tree->nodes[2].child[1], 1);
+    EXPECT_EQ(tree->nodes[2].age, 1);
+
+    LocalTree tree2(*tree);
+    EXPECT_EQ(tree2.capacity, 10);
+    EXPECT_NE(tree2.nodes, tree->nodes);
+    EXPECT_EQ(tree2.nodes[1].parent, 2);
+
+    // a freed array is handed out again for the same capacity
+    LocalNode *nodes = tree->nodes;
+    delete tree;
+    LocalTree tree3(5, 10);
+    EXPECT_EQ(tree3.nodes, nodes);
+}
+
+
+// Growing an ExtendArray keeps its contents, and a freed array is reused
+// by the next array of the same capacity.
+TEST(LocalTreeTest, extend_array_pool)
+{
+    int *data;
+    {
+        spidir::ExtendArray<int> array;
+        for (int i=0; i<100; i++)
+            array.append(i);
+        EXPECT_EQ(array.get_capacity(), 128);
+        for (int i=0; i<100; i++)
+            EXPECT_EQ(array[i], i);
+        data = array.get();
+    }
+    spidir::ExtendArray<int> array2(0, 100);
+    EXPECT_EQ(array2.get(), data);
+
+    // detached arrays belong to the caller
+    delete [] array2.detach();
+}
+
+
+// Children should survive moving from the inline array to the heap, and
+// freed nodes should be reused.
+TEST(LocalTreeTest, tree_node_pool)
+{
+    spidir::Node *node = new spidir::Node();
+    spidir::Node children[3];
+    for (int i=0; i<3; i++) {
+        node->addChild(&children[i]);
+        for (int j=0; j<=i; j++)
+            EXPECT_EQ(node->children[j], &children[j]);
+    }
+    node->setChildren(2);
+    EXPECT_EQ(node->children[1], &children[1]);
+
+    delete node;
+    spidir::Node *node2 = new spidir::Node();
+    EXPECT_EQ(node2, node);
+    delete node2;
+}
+
+
+
+// Sub-path probabilities, migration counts and consistent paths of a
+// population tree should agree with walking the paths.
+TEST(LocalTreeTest, population_paths)
+{
+    const int ntimes = 8;
+    ArgModel model(ntimes, 100e3, 10000, 1e-8, 1e-8);
+    PopulationTree pop_tree(3, &model);
+    pop_tree.add_migration(3, 0, 1, 0.1);
+    pop_tree.add_migration(5, 1, 2, 0.2);
+    pop_tree.add_migration(7, 2, 0, 0.3);
+    pop_tree.add_migration(11, 1, 0, 1.0);
+    pop_tree.add_migration(11, 2, 0, 1.0);
+    pop_tree.set_up_population_paths();
+    const int npaths = pop_tree.num_pop_paths();
+    ASSERT_GT(npaths, 3);
+
+    for (int t1=0; t1<ntimes; t1++)
+    for (int t2=t1; t2<ntimes; t2++)
+    for (int p1=0; p1<3; p1++)
+    for (int p2=0; p2<3; p2++) {
+        for (int i=0; i<pop_tree.num_paths(t1, p1, t2, p2); i++) {
+            const int path = pop_tree.unique_path(t1, p1, t2, p2, i);
+            double prob = 1.0;
+            int nmig = 0;
+            for (int t=t1+1; t<=t2; t++) {
+                double p = pop_tree.mig_matrix[2*t-1].get(
+                    pop_tree.path_pop(path, t-1), pop_tree.path_pop(path, t));
+                if (p > 0 && p < 0.5)
+                    nmig++;
+                prob *= p;
+            }
+            EXPECT_EQ(prob, pop_tree.subpath_prob(t1, p1, t2, p2, i));
+            EXPECT_EQ(nmig, pop_tree.subpath_num_mig(t1, p1, t2, p2, i));
+            EXPECT_EQ(prob, pop_tree.path_prob(path, t1, t2));
+            EXPECT_EQ(nmig, pop_tree.subpath_num_mig(path, t1, t2));
+        }
+    }
+
+    // the consistent path is the first path equal to path1 from t1 to t2
+    // and to path2 from t2 to t3
+    for (int path1=0; path1<npaths; path1++)
+    for (int path2=0; path2<npaths; path2++)
+    for (int t1=0; t1<ntimes; t1++)
+    for (int t2=t1; t2<ntimes; t2++)
+    for (int t3=t2; t3<ntimes; t3++) {
+        if (pop_tree.path_pop(path1, t2) != pop_tree.path_pop(path2, t2))
+            continue;
+        int expected = -1;
+        if (path1 == path2)
+            expected = path1;
+        for (int q=0; q<npaths && expected == -1; q++)
+            if (pop_tree.paths_equal(q, path1, t1, t2) &&
+                pop_tree.paths_equal(q, path2, t2, t3))
+                expected = q;
+        EXPECT_EQ(expected, pop_tree.consistent_path(path1, path2, t1, t2, t3,
+                                                     false));
+    }
+}
+
+
+// Counting lineages without a population tree must agree with the
+// general per-population count.
+TEST(LocalTreeTest, count_lineages_single_pop)
+{
+    const int ntimes = 8;
+    ArgModel model(ntimes, 100e3, 10000, 1e-8, 1e-8);
+    PopulationTree pop_tree(1, &model);
+    pop_tree.set_up_population_paths();
+
+    int ptree[] = {4, 4, 5, 6, 5, 6, -1};
+    int ages[] = {0, 1, 0, 2, 3, 4, 5};
+    LocalTree tree(ptree, 7, ages);
+
+    int nbranches[ntimes], nrecombs[ntimes];
+    int nbranches2[ntimes], nrecombs2[ntimes];
+    int nbranches_pop[2*ntimes], ncoals_pop[ntimes];
+    int nbranches_pop2[2*ntimes], ncoals_pop2[ntimes];
+    int *nbranches_popp = nbranches_pop, *ncoals_popp = ncoals_pop;
+    int *nbranches_popp2 = nbranches_pop2, *ncoals_popp2 = ncoals_pop2;
+
+    count_lineages(&tree, ntimes, nbranches, nrecombs,
+                   &nbranches_popp, &ncoals_popp, NULL);
+    count_lineages(&tree, ntimes, nbranches2, nrecombs2,
+                   &nbranches_popp2, &ncoals_popp2, &pop_tree);
+
+    for (int i=0; i<ntimes; i++) {
+        EXPECT_EQ(nbranches[i], nbranches2[i]);
+        EXPECT_EQ(nrecombs[i], nrecombs2[i]);
+        EXPECT_EQ(ncoals_pop[i], ncoals_pop2[i]);
+    }
+    for (int i=0; i<2*ntimes; i++)
+        EXPECT_EQ(nbranches_pop[i], nbranches_pop2[i]);
+    EXPECT_EQ(nbranches[0], 2);
+    EXPECT_EQ(nbranches[4], 2);
+}
+
+
+// Statistics computed in one pass agree with the Tree methods.
+TEST(LocalTreeTest, tree_stats)
+{
+    const char *newick = "(((0:10,1:10):20,(2:5,3:5):25):30,(4:0,5:0):60)";
+    double times[] = {0, 5, 10, 30, 60, 100};
+    const int ntimes = 6;
+    spidir::Tree tree(newick, NULL);
+    spidir::TreeStats stats(&tree);
+
+    EXPECT_DOUBLE_EQ(stats.tmrca(), tree.tmrca());
+    EXPECT_DOUBLE_EQ(stats.total_branchlength(), tree.total_branchlength());
+    EXPECT_DOUBLE_EQ(stats.avg_pairwise_distance(),
+                     tree.avg_pairwise_distance());
+    EXPECT_DOUBLE_EQ(stats.tmrca_half(), tree.tmrca_half());
+    EXPECT_DOUBLE_EQ(stats.popsize(), tree.popsize());
+    EXPECT_DOUBLE_EQ(stats.num_zero_branches(), tree.num_zero_branches());
+
+    vector<double> counts = stats.coalCounts(times, ntimes);
+    vector<double> expected = tree.coalCounts(times, ntimes);
+    ASSERT_EQ(counts.size(), expected.size());
+    for (unsigned int i=0; i<counts.size(); i++)
+        EXPECT_DOUBLE_EQ(counts[i], expected[i]);
+}
+
+
+// A region of two local trees of 5 leaves, for the tests of reading and
+// writing ARGs.
+class LocalTreesTest : public ::testing::Test
+{
+protected:
+    LocalTreesTest() :
+        model(20, 200e3, 1e4, 1.6e-8, 1.8e-8)
+    {}
+
+    virtual void SetUp()
+    {
+        make_test_trees(model, &trees);
+        trees.chrom = "chr1";
+    }
+
+    ArgModel model;
+    LocalTrees trees;
+};
+
+
+// Reading the binary SMC format should give the same ARG as the text
+// format, including invisible recombinations.
+TEST_F(LocalTreesTest, binary_smc)
+{
+    trees.end_coord = 1000 + trees.length();
+    trees.start_coord = 1000;
+    vector<int> self_recomb_pos(1, 1120);
+    vector<Spr> self_recombs(1, Spr(2, 1, 2, 3));
+    const string text = write_smc_text(&trees, model.times,
+                                       self_recomb_pos, self_recombs);
+
+    FILE *file = tmpfile();
+    const char *names[] = {"a", "b", "c", "d", "e"};
+    ASSERT_TRUE(write_local_trees_binary(file, &trees, names, model.times,
+                                         model.ntimes, self_recomb_pos,
+                                         self_recombs));
+    rewind(file);
+    LocalTrees trees2;
+    vector<string> seqnames;
+    vector<int> self_recomb_pos2;
+    vector<Spr> self_recombs2;
+    ASSERT_TRUE(read_local_trees(file, model.times, model.ntimes, &trees2,
+                                 seqnames, &self_recomb_pos2,
+                                 &self_recombs2));
+    fclose(file);
+
+    EXPECT_EQ(seqnames.size(), 5u);
+    EXPECT_EQ(seqnames[4], "e");
+    EXPECT_EQ(trees2.get_num_trees(), 2);
+    ASSERT_EQ(self_recomb_pos2.size(), 1u);
+    EXPECT_EQ(self_recomb_pos2[0], 1121);
+    EXPECT_EQ(self_recombs2[0].coal_time, 3);
+
+    // positions of invisible recombinations are read back 1-based, as
+    // from the text format
+    self_recomb_pos2[0]--;
+    EXPECT_EQ(text, write_smc_text(&trees2, model.times, self_recomb_pos2,
+                                   self_recombs2));
+}
+
+
+// Writes local trees as bed file lines, returning the tree column of each
+// line
+static vector<string> write_bed_trees(const LocalTrees *trees,
+                                      const ArgModel *model, int keyframe)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    vector<string> seqnames;
+    const char *names[] = {"a", "b", "c", "d", "e"};
+    for (int i=0; i<5; i++)
+        seqnames.push_back(names[i]);
+    write_local_trees_as_bed(out, trees, seqnames, model, 0, keyframe);
+    fclose(out);
+
+    vector<string> lines, columns;
+    split(buf, "\n", lines);
+    free(buf);
+    for (unsigned int i=0; i<lines.size(); i++) {
+        if (lines[i].empty() || lines[i][0] == '#')
+            continue;
+        size_t pos = 0;
+        for (int j=0; j<4; j++)
+            pos = lines[i].find('\t', pos) + 1;
+        columns.push_back(lines[i].substr(pos));
+    }
+    return columns;
+}
+
+// Trees built from SPR records should be the same as trees read from
+// newick strings.
+TEST_F(LocalTreesTest, bed_spr_records)
+{
+    trees.start_coord = 1000;
+    trees.end_coord = 1000 + trees.length();
+
+    vector<string> newicks = write_bed_trees(&trees, &model, 0);
+    vector<string> records = write_bed_trees(&trees, &model, 100000);
+    ASSERT_EQ(newicks.size(), 2u);
+    ASSERT_EQ(records.size(), 2u);
+    EXPECT_FALSE(spidir::is_bed_spr_record(records[0].c_str()));
+    EXPECT_TRUE(spidir::is_bed_spr_record(records[1].c_str()));
+    EXPECT_LT(records[1].size(), newicks[1].size());
+
+    set<string> inds;
+    spidir::SprPruned *trees1 = NULL, *trees2 = NULL;
+    for (unsigned int i=0; i<newicks.size(); i++) {
+        if (i == 0) {
+            trees1 = new spidir::SprPruned(&newicks[i][0], inds, &model);
+            trees2 = new spidir::SprPruned(&records[i][0], inds, &model);
+        } else {
+            trees1->update(&newicks[i][0], &model);
+            trees2->update(&records[i][0], &model);
+        }
+        EXPECT_EQ(trees1->format_newick(false, true, 1),
+                  trees2->format_newick(false, true, 1));
+    }
+    delete trees1;
+    delete trees2;
+}
+
+
+// Binary coal records should read back as the same ARG as text ones.
+TEST_F(LocalTreesTest, binary_coal_records)
+{
+    Sequences seqs;
+
+    LocalTrees trees2[2];
+    for (int binary=0; binary<2; binary++) {
+        FILE *file = tmpfile();
+        if (binary)
+            write_coal_records_binary(file, &model, &trees, &seqs);
+        else
+            write_coal_records(file, &model, &trees, &seqs);
+        rewind(file);
+        vector<string> seqnames;
+        ASSERT_TRUE(read_coal_records(file, &model, &trees2[binary],
+                                      seqnames));
+        fclose(file);
+        EXPECT_EQ(seqnames.size(), 5u);
+        EXPECT_EQ(trees2[binary].get_num_trees(), 2);
+        EXPECT_EQ(trees2[binary].length(), trees.length());
+    }
+    EXPECT_EQ(write_smc_text(&trees2[0], model.times, vector<int>(),
+                             vector<Spr>()),
+              write_smc_text(&trees2[1], model.times, vector<int>(),
+                             vector<Spr>()));
+}
+
+
+// Region reads of binary coal records should return the records that
+// overlap the region, using the block index.
+TEST_F(LocalTreesTest, binary_coal_records_region)
+{
+    Sequences seqs;
+    vector<CoalRecord> records;
+    for (int i=0; i<5000; i++) {
+        CoalRecord record(i / 3 * 10, i % 9, i % 20 - 1, i % 7, i % 20, 0);
+        record.end = record.start + 1 + (i * 7919) % 400;
+        records.push_back(record);
+    }
+
+    FILE *file = tmpfile();
+    CoalRecordWriter writer(file);
+    writer.writeHeader(&model, &trees, &seqs);
+    for (unsigned int i=0; i<records.size(); i++)
+        writer.write(records[i]);
+    ASSERT_TRUE(writer.close());
+
+    const int regions[][2] = {{-1, -1}, {0, 5}, {8000, 8100}, {16600, 20000},
+                              {30000, 30010}};
+    for (int k=0; k<5; k++) {
+        rewind(file);
+        CoalRecordReader reader(file);
+        ASSERT_TRUE(reader.readHeader());
+        EXPECT_EQ(reader.times.size(), (unsigned int) model.ntimes);
+        const int start = regions[k][0], end = regions[k][1];
+        if (start != -1)
+            ASSERT_TRUE(reader.setRegion(start, end));
+
+        CoalRecord record(0, 0, 0, 0, 0);
+        unsigned int i = 0;
+        while (reader.next(&record)) {
+            while (start != -1 && !(records[i].start < end &&
+                                    records[i].end > start))
+                i++;
+            ASSERT_LT(i, records.size());
+            EXPECT_EQ(records[i].start, record.start);
+            EXPECT_EQ(records[i].end, record.end);
+            EXPECT_EQ(records[i].recomb_time, record.recomb_time);
+            EXPECT_EQ(records[i].coal_node, record.coal_node);
+            i++;
+        }
+        while (start != -1 && i < records.size() &&
+               !(records[i].start < end && records[i].end > start))
+            i++;
+        EXPECT_EQ(i, records.size()) << k;
+    }
+    fclose(file);
+}
+
+
+// A model with a high recombination rate, for the tests of ARGs sampled
+// for random sequences
+class SampledArgTest : public ::testing::Test
+{
+protected:
+    SampledArgTest() :
+        model(20, 200e3, 1e4, 1.6e-8, 1.8e-8)
+    {
+        model.rho = 1e-6;
+    }
+
+    ArgModel model;
+};
+
+
+// Splitting blocks of an ARG with null SPRs and removing them again
+// should give back the ARG.
+TEST_F(SampledArgTest, remove_null_sprs)
+{
+    TestAlignment alignment(6, 10000);
+    LocalTrees trees;
+    sample_arg_seq(&model, alignment.sequences, &trees);
+    ASSERT_GT(trees.get_num_trees(), 3);
+    LocalTrees trees2;
+    trees2.copy(trees);
+
+    // split the first block twice and every third block once
+    Spr null_spr;
+    null_spr.set_null();
+    int k = 0;
+    for (LocalTrees::iterator it=trees2.begin(); it != trees2.end(); ++k) {
+        const int nsplits = (k == 0) ? 2 : (k % 3 == 0);
+        LocalTrees::iterator next = it;
+        ++next;
+        for (int j=0; j<nsplits && it->blocklen > 1; j++) {
+            const int nnodes = it->tree->nnodes;
+            LocalTree *tree = new LocalTree();
+            tree->copy(*it->tree);
+            int *mapping = new int [nnodes];
+            for (int i=0; i<nnodes; i++)
+                mapping[i] = i;
+            const int blocklen = it->blocklen / 2;
+            trees2.trees.insert(next, LocalTreeSpr(
+                tree, null_spr, it->blocklen - blocklen, mapping));
+            it->blocklen = blocklen;
+        }
+        it = next;
+    }
+    EXPECT_GT(trees2.get_num_trees(), trees.get_num_trees());
+
+    remove_null_sprs(&trees2, model.pop_tree);
+    assert_trees(&trees2, model.pop_tree);
+    ASSERT_EQ(trees.get_num_trees(), trees2.get_num_trees());
+    LocalTrees::const_iterator it2 = trees2.begin();
+    for (LocalTrees::const_iterator it=trees.begin(); it != trees.end();
+         ++it, ++it2) {
+        const int nnodes = it->tree->nnodes;
+        EXPECT_EQ(it->blocklen, it2->blocklen);
+        EXPECT_EQ(it->spr.recomb_node, it2->spr.recomb_node);
+        EXPECT_EQ(it->spr.recomb_time, it2->spr.recomb_time);
+        EXPECT_EQ(it->spr.coal_node, it2->spr.coal_node);
+        EXPECT_EQ(it->spr.coal_time, it2->spr.coal_time);
+        ASSERT_EQ(it->mapping == NULL, it2->mapping == NULL);
+        for (int i=0; i<nnodes; i++) {
+            EXPECT_EQ(it->tree->nodes[i].parent, it2->tree->nodes[i].parent);
+            EXPECT_EQ(it->tree->nodes[i].age, it2->tree->nodes[i].age);
+            if (it->mapping)
+                EXPECT_EQ(it->mapping[i], it2->mapping[i]);
+        }
+    }
+}
+
 }  // namespace
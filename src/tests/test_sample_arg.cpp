@@ -0,0 +1,269 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/checkpoint.h"
+#include "argweaver/domains.h"
+#include "argweaver/input_bundle.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sampler.h"
+#include "argweaver/sequences.h"
+#include "argweaver/total_prob.h"
+
+#include "test_args.h"
+
+
+namespace argweaver {
+
+
+// A model with a high recombination rate, for sampling ARGs of random
+// sequences
+class SampleArgTest : public ::testing::Test
+{
+protected:
+    SampleArgTest() :
+        model(20, 200e3, 1e4, 1.6e-8, 1.8e-8)
+    {
+        model.rho = 1e-6;
+    }
+
+    ArgModel model;
+};
+
+
+// Restoring a checkpoint should bring back the ARG as laid out in
+// memory, the sampled sequences, the popsizes and the random number
+// generator.
+TEST_F(SampleArgTest, checkpoint)
+{
+    LocalTrees trees;
+    make_test_trees(model, &trees);
+    trees.chrom = "chr1";
+    const int nseqs = trees.get_num_leaves();
+    const int seqlen = trees.length();
+    vector<string> seqs_text(nseqs, string(seqlen, 'A'));
+    vector<char*> seqs_data(nseqs);
+    for (int i=0; i<nseqs; i++) {
+        seqs_text[i][i] = 'C';
+        seqs_data[i] = &seqs_text[i][0];
+    }
+    Sequences seqs(&seqs_data[0], nseqs, seqlen);
+
+    seed_rand(99);
+    model.mc3.heat = 0.5;
+    Checkpoint checkpoint;
+    make_checkpoint(&checkpoint, 42, &model, &seqs, &trees, true);
+    const char *filename = "/tmp/argweaver_test.checkpoint";
+    ASSERT_TRUE(write_checkpoint(filename, &checkpoint));
+    vector<int> draws;
+    for (int i=0; i<10; i++)
+        draws.push_back(rand());
+
+    // change the state and restore it
+    Checkpoint checkpoint2;
+    ASSERT_TRUE(read_checkpoint(filename, &checkpoint2));
+    remove(filename);
+    EXPECT_EQ(checkpoint2.iter, 42);
+    const double popsize = model.popsizes[0][3];
+    model.set_popsizes(2e4);
+    model.mc3.heat = 1.0;
+    seqs_data[0][0] = 'T';
+    LocalTrees trees2;
+    ASSERT_TRUE(restore_checkpoint(&checkpoint2, &model, &seqs, &trees2));
+
+    EXPECT_EQ(model.popsizes[0][3], popsize);
+    EXPECT_EQ(model.mc3.heat, 0.5);
+    EXPECT_EQ(seqs_data[0][0], 'C');
+    for (int i=0; i<10; i++)
+        EXPECT_EQ(rand(), draws[i]);
+
+    ASSERT_EQ(trees2.get_num_trees(), trees.get_num_trees());
+    EXPECT_EQ(trees2.chrom, "chr1");
+    EXPECT_EQ(trees2.seqids, trees.seqids);
+    for (LocalTrees::iterator it=trees.begin(), it2=trees2.begin();
+         it != trees.end(); ++it, ++it2) {
+        EXPECT_EQ(it2->blocklen, it->blocklen);
+        EXPECT_EQ(it2->spr.recomb_node, it->spr.recomb_node);
+        EXPECT_EQ(it2->spr.coal_time, it->spr.coal_time);
+        EXPECT_EQ(it2->mapping == NULL, it->mapping == NULL);
+        for (int i=0; i<trees.nnodes; i++) {
+            EXPECT_EQ(it2->tree->nodes[i].parent, it->tree->nodes[i].parent);
+            EXPECT_EQ(it2->tree->nodes[i].age, it->tree->nodes[i].age);
+            if (it->mapping)
+                EXPECT_EQ(it2->mapping[i], it->mapping[i]);
+        }
+    }
+}
+
+
+// Stitching ARGs with different trees should give valid local trees that
+// follow each ARG on its side of the stitch, and sampling in shards should
+// not depend on the number of threads.
+TEST_F(SampleArgTest, stitch_shards)
+{
+    const int nseqs = 5, seqlen = 20000, pos = 10000;
+    TestAlignment alignment(nseqs, seqlen);
+    Sequences &sequences = *alignment.sequences;
+    LocalTrees trees, trees2;
+    sample_arg_seq(&model, &sequences, &trees);
+    sample_arg_seq(&model, &sequences, &trees2);
+    const LocalTree start_tree(*trees.front().tree);
+    const LocalTree end_tree(*trees2.back().tree);
+
+    stitch_local_trees(&trees, &trees2, pos);
+    assert_trees(&trees, model.pop_tree);
+    EXPECT_EQ(0, trees.start_coord);
+    EXPECT_EQ(seqlen, trees.end_coord);
+    EXPECT_EQ(0, trees2.get_num_trees());
+    int mapping[trees.nnodes];
+    map_congruent_trees(&start_tree, &trees.seqids[0], trees.front().tree,
+                        &trees.seqids[0], mapping);
+    for (int i=0; i<trees.nnodes; i++)
+        EXPECT_NE(-1, mapping[i]);
+    map_congruent_trees(&end_tree, &trees.seqids[0], trees.back().tree,
+                        &trees.seqids[0], mapping);
+    for (int i=0; i<trees.nnodes; i++)
+        EXPECT_NE(-1, mapping[i]);
+
+    vector<int> self_recomb_pos;
+    vector<Spr> self_recombs;
+    string text[2];
+    for (int k=0; k<2; k++) {
+        model.nthreads = 1 + 2 * k;
+        LocalTrees trees3;
+        srand(4321);
+        sample_arg_seq_shards(&model, &sequences, &trees3, 6000, 1000, 2);
+        assert_trees(&trees3, model.pop_tree);
+        EXPECT_EQ(seqlen, trees3.end_coord);
+        text[k] = write_smc_text(&trees3, model.times, self_recomb_pos,
+                                 self_recombs);
+    }
+    EXPECT_EQ(text[0], text[1]);
+}
+
+
+// Blocks resampled with closed ends should join back into a valid ARG
+TEST_F(SampleArgTest, domain_blocks)
+{
+    const int nseqs = 5, seqlen = 20000, nblocks = 3;
+    TestAlignment alignment(nseqs, seqlen);
+    Sequences &sequences = *alignment.sequences;
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    for (int shift=0; shift<2; shift++) {
+        vector<int> bounds;
+        get_domain_bounds(0, seqlen, nblocks, shift, &bounds);
+        ASSERT_EQ(nblocks + 1, (int) bounds.size());
+        EXPECT_EQ(0, bounds.front());
+        EXPECT_EQ(seqlen, bounds.back());
+        for (int i=0; i<nblocks; i++)
+            EXPECT_LT(bounds[i], bounds[i+1]);
+
+        vector<LocalTrees*> blocks;
+        split_local_trees(&trees, bounds, &blocks);
+        ASSERT_EQ(nblocks - 1, (int) blocks.size());
+        EXPECT_EQ(bounds[1], trees.end_coord);
+        for (int i=0; i<nblocks-1; i++) {
+            EXPECT_EQ(bounds[i+1], blocks[i]->start_coord);
+            EXPECT_EQ(bounds[i+2], blocks[i]->end_coord);
+        }
+
+        // the ends of a block are kept unless they are open
+        LocalTrees *block = blocks[0];
+        const LocalTree start_tree(*block->front().tree);
+        const LocalTree end_tree(*block->back().tree);
+        resample_arg_regions(&model, &sequences, block, 2000, 2, 1.0,
+                             false, false);
+        resample_arg_regions(&model, &sequences, &trees, 2000, 2, 1.0,
+                             true, false);
+        assert_trees(block, model.pop_tree);
+        int mapping[block->nnodes];
+        map_congruent_trees(&start_tree, &block->seqids[0],
+                            block->front().tree, &block->seqids[0], mapping);
+        for (int i=0; i<block->nnodes; i++)
+            EXPECT_NE(-1, mapping[i]);
+        map_congruent_trees(&end_tree, &block->seqids[0],
+                            block->back().tree, &block->seqids[0], mapping);
+        for (int i=0; i<block->nnodes; i++)
+            EXPECT_NE(-1, mapping[i]);
+
+        join_local_trees(&trees, &blocks, model.pop_tree);
+        EXPECT_EQ(0, (int) blocks.size());
+        assert_trees(&trees, model.pop_tree);
+        EXPECT_EQ(0, trees.start_coord);
+        EXPECT_EQ(seqlen, trees.end_coord);
+    }
+}
+
+
+// Runs of a sampler with the same seed should give the same samples, and
+// samples should be given every sample_step iterations until the callback
+// stops the run.
+TEST_F(SampleArgTest, sampler_runs)
+{
+    const int nseqs = 4, seqlen = 4000;
+    TestAlignment alignment(nseqs, seqlen);
+    Sequences &sequences = *alignment.sequences;
+
+    InputBundle inputs;
+    inputs.seq_region.set("chr", 0, seqlen);
+    make_sites_from_sequences(&sequences, &inputs.sites);
+    inputs.sites.chrom = "chr";
+    inputs.sites.names.clear();
+    for (int j=0; j<nseqs; j++)
+        inputs.sites.names.push_back(string(1, char('a' + j)));
+    ASSERT_TRUE(find_compress_cols(&inputs.sites, 1, &inputs.sites_mapping));
+    compress_sites(&inputs.sites, &inputs.sites_mapping);
+
+    ArgSampler sampler;
+    ASSERT_TRUE(sampler.load(model, inputs));
+    EXPECT_EQ(nseqs, sampler.get_sequences().get_num_seqs());
+
+    SamplerRun run;
+    run.randseed = 5;
+    run.niters = 4;
+    run.sample_step = 2;
+    vector<int> iters[2];
+    vector<double> lks[2];
+    LocalTrees init_trees;
+    for (int k=0; k<2; k++) {
+        ASSERT_TRUE(sampler.run(run, [&](int iter, const ArgModel *model,
+                                         const Sequences *sequences,
+                                         const LocalTrees *trees) {
+                    iters[k].push_back(iter);
+                    lks[k].push_back(calc_arg_likelihood(model, sequences,
+                                                         trees));
+                    if (iter == 0 && k == 0)
+                        init_trees.copy(*trees);
+                    return true;
+                }));
+    }
+    EXPECT_EQ(vector<int>({0, 2, 4}), iters[0]);
+    EXPECT_EQ(iters[0], iters[1]);
+    EXPECT_EQ(lks[0], lks[1]);
+
+    // resample a region of a given ARG, stopping after the first sample
+    run.init_trees = &init_trees;
+    run.region_start = 1000;
+    run.region_end = 2000;
+    int nsamples = 0;
+    ASSERT_TRUE(sampler.run(run, [&](int iter, const ArgModel *model,
+                                     const Sequences *sequences,
+                                     const LocalTrees *trees) {
+                EXPECT_EQ(seqlen, trees->length());
+                EXPECT_EQ(nseqs, trees->get_num_leaves());
+                nsamples++;
+                return iter < 2;
+            }));
+    EXPECT_EQ(2, nsamples);
+
+    // regions need an initial ARG
+    run.init_trees = NULL;
+    EXPECT_FALSE(sampler.run(run, [](int, const ArgModel *,
+                                     const Sequences *, const LocalTrees *) {
+                return true;
+            }));
+}
+
+}  // namespace
@@ -0,0 +1,1721 @@
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/emit.h"
+#include "argweaver/est_popsize.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/matrices.h"
+#include "argweaver/mcmcmc.h"
+#include "argweaver/mem.h"
+#include "argweaver/model.h"
+#include "argweaver/parsing.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sequences.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/simd.h"
+#include "argweaver/states.h"
+#include "argweaver/thread_pool.h"
+#include "argweaver/thread.h"
+#include "argweaver/total_prob.h"
+#include "argweaver/trans.h"
+#include "argweaver/Tree.h"
+
+#include "test_args.h"
+
+
+namespace argweaver {
+
+
+// Setup a small external threading problem used by the tests below.
+class ForwardBlockTest : public ::testing::Test
+{
+protected:
+    ForwardBlockTest() :
+        model(20, 200e3, 1e4, 1.6e-8, 1.8e-8),
+        lineages(model.ntimes, model.num_pops())
+    {}
+
+    virtual void SetUp()
+    {
+        ASSERT_TRUE(make_test_tree(model, &tree));
+
+        get_coal_states(&tree, model.ntimes, states);
+        lineages.count(&tree, model.pop_tree);
+    }
+
+    // Run both the fast and slow forward algorithm over a block with random
+    // emissions and assert that the tables agree.
+    void check_forward_block(const TransMatrix &matrix, double tol)
+    {
+        const int nstates = states.size();
+        const int blocklen = 50;
+        double **emit = new_matrix<double>(blocklen, nstates);
+        double **fw = new_matrix<double>(blocklen, nstates);
+        double **fw2 = new_matrix<double>(blocklen, nstates);
+
+        srand(1234);
+        for (int i=0; i<blocklen; i++)
+            for (int k=0; k<nstates; k++)
+                emit[i][k] = frand(.1, 1.0);
+        for (int k=0; k<nstates; k++)
+            fw[0][k] = fw2[0][k] = 1.0 / nstates;
+
+        arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                             &matrix, emit, fw);
+        arghmm_forward_block_slow(&tree, model.ntimes, blocklen, states,
+                                  lineages, &matrix, emit, fw2);
+
+        for (int i=0; i<blocklen; i++)
+            for (int k=0; k<nstates; k++)
+                EXPECT_NEAR(fw[i][k], fw2[i][k], tol);
+
+        delete_matrix<double>(emit, blocklen);
+        delete_matrix<double>(fw, blocklen);
+        delete_matrix<double>(fw2, blocklen);
+    }
+
+    // Apply 'spr' to the tree, giving the next tree of a switch,
+    // its node mapping and its states.
+    void make_switch(const Spr &spr, LocalTree *tree2, int *mapping,
+                     States &states2)
+    {
+        tree2->copy(tree);
+        apply_spr(tree2, spr);
+        for (int i=0; i<tree.nnodes; i++)
+            mapping[i] = i;
+        mapping[tree.nodes[spr.recomb_node].parent] = -1;
+        get_coal_states(tree2, model.ntimes, states2);
+    }
+
+    // Make a region of two local trees, the tree and the tree after an
+    // SPR, of 100 and 50 sites.
+    void make_local_trees(LocalTrees *trees)
+    {
+        make_test_trees(model, trees);
+    }
+
+    ArgModel model;
+    LocalTree tree;
+    States states;
+    LineageCounts lineages;
+};
+
+
+// The compressed forward algorithm should agree with the dense one
+// for every instruction set supported by this build and CPU.
+TEST_F(ForwardBlockTest, forward_block_simd_levels)
+{
+    TransMatrix matrix(&model, states.size());
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+    const SimdLevel orig = get_simd_level();
+    for (int level=SIMD_SCALAR; level<=get_max_simd_level(); level++) {
+        SCOPED_TRACE(get_simd_name(SimdLevel(level)));
+        set_simd_level(SimdLevel(level));
+        check_forward_block(matrix, 1e-10);
+    }
+    set_simd_level(orig);
+}
+
+
+// Same check using SMC' transition probabilities.
+TEST_F(ForwardBlockTest, forward_block_smc_prime)
+{
+    model.smc_prime = true;
+    TransMatrix matrix(&model, states.size());
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+    check_forward_block(matrix, 1e-10);
+}
+
+
+// Same check for the thread of an internal branch, whose states start at
+// the age of the subtree root, and for a fully determined tree, which has
+// no states.
+TEST_F(ForwardBlockTest, forward_block_internal)
+{
+    // unspecified root above subtree 7 and main tree 5
+    char newick[1000];
+    const double *t = model.times;
+    snprintf(newick, sizeof(newick),
+             "(((2,3)6[&&NHX:age=%f],4)7[&&NHX:age=%f],(0,1)5[&&NHX:age=%f])"
+             "8[&&NHX:age=%f]", t[5], t[9], t[2], t[12]);
+    ASSERT_TRUE(parse_local_tree(newick, &tree, model.times, model.ntimes));
+    const int subtree_root = tree.nodes[tree.root].child[0];
+    ASSERT_EQ(tree.nodes[subtree_root].age, 9);
+    tree.nodes[tree.root].age = model.ntimes;
+
+    get_coal_states_internal(&tree, model.ntimes, states);
+    ASSERT_GT(states.size(), 0u);
+    for (unsigned int k=0; k<states.size(); k++)
+        EXPECT_GE(states[k].time, 9);
+    lineages.count(&tree, model.pop_tree, true);
+    TransMatrix matrix(&model, states.size());
+    matrix.calc_transition_probs(&tree, &model, states, &lineages, true);
+    check_forward_block(matrix, 1e-10);
+
+    tree.nodes[tree.root].age = 12;
+    get_coal_states_internal(&tree, model.ntimes, states);
+    ASSERT_EQ(states.size(), 0u);
+    TransMatrix matrix2(&model, 0);
+    matrix2.calc_transition_probs(&tree, &model, states, &lineages, true);
+    double **fw = new_matrix<double>(10, 1);
+    fw[0][0] = 1.0;
+    arghmm_forward_block(&model, &tree, 10, states, lineages, &matrix2,
+                         (double**) NULL, fw);
+    for (int i=0; i<10; i++)
+        EXPECT_EQ(fw[i][0], 1.0);
+    delete_matrix<double>(fw, 10);
+}
+
+
+// Traceback steps should follow the exact posterior of the previous state,
+// both for concentrated and for flat forward columns.
+TEST_F(ForwardBlockTest, sample_hmm_posterior_exact)
+{
+    const int nstates = states.size();
+    TransMatrix matrix(&model, nstates);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+    double col_data[2][nstates];
+    const double *fw[] = {col_data[0], col_data[1]};
+    int path[2];
+    srand(1234);
+    for (int flat=0; flat<2; flat++) {
+        double total = 0.0;
+        for (int j=0; j<nstates; j++) {
+            col_data[0][j] = flat ? frand(.5, 1.0) : pow(frand(), 20.0);
+            total += col_data[0][j];
+        }
+        for (int j=0; j<nstates; j++)
+            col_data[0][j] /= total;
+
+        for (int k=0; k<nstates; k+=7) {
+            double probs[nstates];
+            double norm = 0.0;
+            for (int j=0; j<nstates; j++) {
+                probs[j] = fw[0][j] * matrix.get(&tree, states, j, k);
+                norm += probs[j];
+            }
+
+            const int nsamples = 20000;
+            vector<int> counts(nstates, 0);
+            for (int n=0; n<nsamples; n++) {
+                path[1] = k;
+                sample_hmm_posterior(2, &tree, states, &matrix, fw, path);
+                counts[path[0]]++;
+            }
+            for (int j=0; j<nstates; j++)
+                EXPECT_NEAR(counts[j] / double(nsamples), probs[j] / norm,
+                            0.015);
+        }
+    }
+}
+
+
+// A cached transition matrix should equal a freshly computed one, and
+// changing a model parameter should miss the cache.
+TEST_F(ForwardBlockTest, trans_matrix_cache)
+{
+    const int nstates = states.size();
+    TransMatrixCache cache;
+    TransMatrix matrix(&model, nstates);
+    TransMatrix matrix2(&model, nstates);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+    cache.calc_transition_probs(&matrix2, &tree, &model, states, &lineages);
+    cache.calc_transition_probs(&matrix2, &tree, &model, states, &lineages);
+    EXPECT_EQ(cache.hits, 1);
+    EXPECT_EQ(cache.misses, 1);
+
+    for (int i=0; i<nstates; i++)
+        for (int j=0; j<nstates; j++)
+            EXPECT_EQ(matrix.get(&tree, states, i, j),
+                      matrix2.get(&tree, states, i, j));
+
+    model.rho *= 2.0;
+    cache.calc_transition_probs(&matrix2, &tree, &model, states, &lineages);
+    EXPECT_EQ(cache.misses, 2);
+    EXPECT_EQ(cache.size(), 2);
+}
+
+
+// A cached switch matrix should equal a freshly computed one.
+TEST_F(ForwardBlockTest, trans_matrix_switch_cache)
+{
+    const Spr spr(4, 3, 5, 4);
+    LocalTree tree2;
+    int mapping[tree.nnodes];
+    States states2;
+    make_switch(spr, &tree2, mapping, states2);
+    const int nstates1 = states.size(), nstates2 = states2.size();
+    const int npaths = model.num_pop_paths();
+
+    TransMatrixSwitchCache cache;
+    TransMatrixSwitch matrix(nstates1, nstates2, npaths);
+    TransMatrixSwitch matrix2(nstates1, nstates2, npaths);
+    calc_transition_probs_switch(&tree2, &tree, spr, mapping, states, states2,
+                                 &model, &lineages, &matrix);
+    for (int k=0; k<2; k++)
+        cache.calc_transition_probs_switch(&matrix2, &tree2, &tree, spr,
+                                           mapping, states, states2,
+                                           &model, &lineages);
+    EXPECT_EQ(cache.hits, 1);
+    EXPECT_EQ(cache.misses, 1);
+
+    for (int i=0; i<nstates1; i++)
+        for (int j=0; j<nstates2; j++)
+            EXPECT_EQ(matrix.get(i, j), matrix2.get(i, j));
+}
+
+
+// The states of the blocks of a matrix iterator should equal states
+// enumerated from scratch when iterating in either direction, as should
+// cached states of two trees and of another states model.
+TEST_F(ForwardBlockTest, states_cache)
+{
+    LocalTrees trees;
+    make_local_trees(&trees);
+    StatesModel states_model(model.ntimes);
+    States states2, last_states;
+
+    ArgHmmMatrixIter matrix_iter(&model, NULL, &trees);
+    for (int dir=0; dir<2; dir++) {
+        if (dir == 0)
+            matrix_iter.begin();
+        else
+            matrix_iter.rbegin();
+        for (; matrix_iter.more();
+             dir == 0 ? matrix_iter.next() : matrix_iter.prev()) {
+            ArgHmmMatrices &mat = matrix_iter.ref_matrices();
+            states_model.get_coal_states(matrix_iter.get_tree_spr()->tree,
+                                         states2);
+            EXPECT_TRUE(mat.states == states2);
+            EXPECT_EQ(mat.nstates2, (int) states2.size());
+            if (matrix_iter.has_switch()) {
+                states_model.get_coal_states(
+                    matrix_iter.get_last_tree_spr()->tree, last_states);
+                EXPECT_EQ(mat.nstates1, (int) last_states.size());
+            }
+        }
+    }
+
+    StatesCache cache;
+    LocalTrees::const_iterator it = trees.begin();
+    const LocalTreeSpr *tree_spr1 = &(*it++);
+    const LocalTreeSpr *tree_spr2 = &(*it);
+    const States &cached1 = cache.get_coal_states(states_model, tree_spr1);
+    const States &cached2 = cache.get_coal_states(states_model, tree_spr2);
+    EXPECT_EQ(&cached1, &cache.get_coal_states(states_model, tree_spr1));
+    states_model.get_coal_states(tree_spr2->tree, states2);
+    EXPECT_TRUE(cached2 == states2);
+
+    StatesModel internal_model(model.ntimes, true);
+    cache.get_coal_states(internal_model, tree_spr2);
+    internal_model.get_coal_states(tree_spr2->tree, states2);
+    EXPECT_TRUE(cache.get_coal_states(internal_model, tree_spr2) == states2);
+}
+
+
+// Updating lineage counts across an SPR should match counting the next
+// tree from scratch.
+TEST_F(ForwardBlockTest, update_lineages)
+{
+    const Spr sprs[] = {Spr(4, 3, 5, 4), Spr(0, 0, 8, 13), Spr(6, 6, 4, 6),
+                        Spr(5, 3, 7, 10), Spr(2, 1, 3, 2)};
+    const int ntimes = model.ntimes;
+
+    for (unsigned int s=0; s<sizeof(sprs) / sizeof(sprs[0]); s++) {
+        LocalTree tree2;
+        int mapping[tree.nnodes];
+        States states2;
+        make_switch(sprs[s], &tree2, mapping, states2);
+
+        LineageCounts lineages2(ntimes, model.num_pops());
+        LineageCounts updated(ntimes, model.num_pops());
+        lineages2.count(&tree2, model.pop_tree);
+        updated.count(&tree, model.pop_tree);
+        updated.update(&tree, &tree2, mapping, model.pop_tree);
+
+        for (int i=0; i<ntimes; i++) {
+            EXPECT_EQ(lineages2.nbranches[i], updated.nbranches[i]);
+            EXPECT_EQ(lineages2.nrecombs[i], updated.nrecombs[i]);
+            EXPECT_EQ(lineages2.ncoals_pop[0][i], updated.ncoals_pop[0][i]);
+        }
+        for (int i=0; i<2*ntimes; i++)
+            EXPECT_EQ(lineages2.nbranches_pop[0][i],
+                      updated.nbranches_pop[0][i]);
+    }
+}
+
+// A postorder repaired after an SPR should be a valid postorder of the
+// new tree.
+TEST_F(ForwardBlockTest, update_postorder)
+{
+    const Spr sprs[] = {Spr(4, 3, 5, 4), Spr(0, 0, 8, 13), Spr(6, 6, 4, 6),
+                        Spr(5, 3, 7, 10), Spr(2, 1, 3, 2)};
+
+    for (unsigned int s=0; s<sizeof(sprs) / sizeof(sprs[0]); s++) {
+        LocalTree tree2;
+        int mapping[tree.nnodes];
+        States states2;
+        make_switch(sprs[s], &tree2, mapping, states2);
+        EXPECT_TRUE(is_spr_mapping(&tree, sprs[s], mapping));
+
+        int order[tree.nnodes];
+        tree.get_postorder(order);
+        update_postorder(&tree2, sprs[s], order);
+        EXPECT_TRUE(assert_tree_postorder(&tree2, order));
+    }
+}
+
+// The sparse switch matrix should give the same forward column as the
+// dense one.
+TEST_F(ForwardBlockTest, forward_switch_sparse)
+{
+    // move leaf 4 below node 5, and leaf 0 above the root
+    const Spr sprs[] = {Spr(4, 3, 5, 4), Spr(0, 1, 8, 14)};
+    for (int s=0; s<2; s++) {
+        LocalTree tree2;
+        int mapping[tree.nnodes];
+        States states2;
+        make_switch(sprs[s], &tree2, mapping, states2);
+        const int nstates1 = states.size(), nstates2 = states2.size();
+
+        TransMatrixSwitch matrix(nstates1, nstates2, model.num_pop_paths());
+        calc_transition_probs_switch(&tree2, &tree, sprs[s], mapping,
+                                     states, states2, &model, &lineages,
+                                     &matrix);
+        TransMatrixSwitchSparse sparse(&matrix);
+
+        int nnz = 0;
+        for (int i=0; i<nstates1; i++)
+            for (int j=0; j<nstates2; j++)
+                nnz += (matrix.get(i, j) > 0);
+        EXPECT_EQ(sparse.nnz(), nnz);
+
+        double col1[nstates1], col2[nstates2], col3[nstates2];
+        double emit[nstates2];
+        srand(1234);
+        for (int i=0; i<nstates1; i++)
+            col1[i] = frand(.1, 1.0);
+        for (int j=0; j<nstates2; j++)
+            emit[j] = frand(.1, 1.0);
+        arghmm_forward_switch(col1, col2, &matrix, emit);
+        arghmm_forward_switch(col1, col3, &sparse, emit);
+        for (int j=0; j<nstates2; j++)
+            EXPECT_NEAR(col2[j], col3[j], 1e-12);
+    }
+}
+
+
+// The LRU matrix list should give the same matrices as the iterator,
+// and keep no more blocks than its memory budget allows.
+TEST_F(ForwardBlockTest, matrix_lru_list)
+{
+    LocalTrees trees;
+    make_local_trees(&trees);
+
+    ArgHmmMatrixIter matrix_iter(&model, NULL, &trees);
+    ArgHmmMatrixLruList small_list(&model, NULL, &trees);
+    ArgHmmMatrixLruList large_list(&model, NULL, &trees, -1, 10.0);
+    for (int k=0; k<2; k++) {
+        for (matrix_iter.begin(), small_list.begin(), large_list.begin();
+             matrix_iter.more();
+             matrix_iter.next(), small_list.next(), large_list.next()) {
+            ArgHmmMatrices &mat = matrix_iter.ref_matrices();
+            ArgHmmMatrices &mat2 = small_list.ref_matrices();
+            ArgHmmMatrices &mat3 = large_list.ref_matrices();
+            ASSERT_EQ(mat.nstates1, mat2.nstates1);
+            ASSERT_EQ(mat.nstates2, mat3.nstates2);
+            ASSERT_EQ(mat.transmat_switch == NULL,
+                      mat3.transmat_switch == NULL);
+            const LocalTree *block_tree = matrix_iter.get_tree_spr()->tree;
+            States block_states;
+            matrix_iter.get_coal_states(block_states);
+            for (int i=0; i<mat.nstates2; i++)
+                for (int j=0; j<mat.nstates2; j++)
+                    EXPECT_EQ(mat.transmat->get(block_tree, block_states,
+                                                i, j),
+                              mat3.transmat->get(block_tree, block_states,
+                                                 i, j));
+        }
+    }
+
+    EXPECT_EQ(small_list.get_num_stored(), 1);
+    EXPECT_EQ(small_list.misses, 4);
+    EXPECT_EQ(large_list.get_num_stored(), 2);
+    EXPECT_EQ(large_list.misses, 2);
+    EXPECT_EQ(large_list.hits, 2);
+}
+
+
+// Several paths drawn from one forward table should be valid paths, and
+// drawing a single path should match stochastic_traceback().
+TEST_F(ForwardBlockTest, traceback_paths)
+{
+    LocalTrees trees;
+    make_local_trees(&trees);
+    const int nseqs = 6, seqlen = trees.length();
+    const char *bases = "ACGT";
+    char seqdata[nseqs][seqlen];
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = seqdata[j];
+        for (int i=0; i<seqlen; i++)
+            seqdata[j][i] = (i % 10 == 0) ? bases[irand(4)] : 'A';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees);
+    ArgHmmForwardTable forward(trees.start_coord, seqlen);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+
+    const int npaths = 3;
+    int path_data[npaths][seqlen];
+    int *paths[npaths];
+    double lnls[npaths];
+    for (int k=0; k<npaths; k++)
+        paths[k] = path_data[k];
+
+    ArgHmmMatrixIter matrix_iter2(&model, NULL, &trees);
+    srand(1);
+    double lnl = stochastic_traceback(&trees, &model, &matrix_iter2,
+                                      &forward, paths[1]);
+    srand(1);
+    stochastic_traceback_paths(&trees, &model, &matrix_iter2, &forward,
+                               paths, 1, lnls);
+    EXPECT_EQ(lnl, lnls[0]);
+    for (int i=0; i<seqlen; i++)
+        EXPECT_EQ(paths[0][i], paths[1][i]);
+
+    stochastic_traceback_paths(&trees, &model, &matrix_iter2, &forward,
+                               paths, npaths, lnls);
+    States states;
+    int pos = 0;
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it) {
+        get_coal_states(it->tree, model.ntimes, states);
+        for (int i=pos; i<pos + it->blocklen; i++)
+            for (int k=0; k<npaths; k++) {
+                ASSERT_GE(paths[k][i], 0);
+                ASSERT_LT(paths[k][i], int(states.size()));
+            }
+        pos += it->blocklen;
+    }
+    for (int k=0; k<npaths; k++)
+        EXPECT_TRUE(lnls[k] > -INFINITY && lnls[k] < INFINITY);
+}
+
+
+// The C interface should give the forward table in one buffer whose rows
+// are as wide as the largest state space, and build local trees from
+// contiguous arrays.
+TEST_F(ForwardBlockTest, forward_alg_buffer)
+{
+    LocalTrees trees;
+    make_local_trees(&trees);
+    const int nseqs = 6, seqlen = trees.length();
+    const char *bases = "ACGT";
+    char seqdata[nseqs][seqlen];
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = seqdata[j];
+        for (int i=0; i<seqlen; i++)
+            seqdata[j][i] = (i % 10 == 0) ? bases[irand(4)] : 'A';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees);
+    ArgHmmForwardTable forward(trees.start_coord, seqlen);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    double **fw = forward.get_table();
+
+    int stride = 0;
+    double *buffer = arghmm_forward_alg_buffer(
+        &trees, model.times, model.ntimes, model.popsizes, model.rho,
+        model.mu, seqs, nseqs, seqlen, false, NULL, false, false, &stride);
+    States states;
+    int maxstates = 0, pos = 0;
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it) {
+        get_coal_states(it->tree, model.ntimes, states);
+        const int nstates = states.size();
+        maxstates = max(maxstates, nstates);
+        for (int i=pos; i<pos + it->blocklen; i++) {
+            for (int k=0; k<nstates; k++)
+                EXPECT_DOUBLE_EQ(fw[i][k], buffer[i * stride + k]);
+            for (int k=nstates; k<stride; k++)
+                EXPECT_EQ(0.0, buffer[i * stride + k]);
+        }
+        pos += it->blocklen;
+    }
+    EXPECT_EQ(maxstates, stride);
+    delete_double_buffer(buffer);
+
+    const int ntrees = trees.get_num_trees(), nnodes = trees.nnodes;
+    vector<int> ptrees, ages, sprs, blocklens;
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it) {
+        for (int i=0; i<nnodes; i++) {
+            ptrees.push_back(it->tree->nodes[i].parent);
+            ages.push_back(it->tree->nodes[i].age);
+        }
+        sprs.push_back(it->spr.recomb_node);
+        sprs.push_back(it->spr.recomb_time);
+        sprs.push_back(it->spr.coal_node);
+        sprs.push_back(it->spr.coal_time);
+        blocklens.push_back(it->blocklen);
+    }
+    LocalTrees *trees2 = arghmm_new_trees_buffer(
+        &ptrees[0], &ages[0], &sprs[0], &blocklens[0], ntrees, nnodes, 0);
+    ASSERT_EQ(ntrees, trees2->get_num_trees());
+    LocalTrees::iterator it2 = trees2->begin();
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end();
+         ++it, ++it2) {
+        EXPECT_EQ(it->blocklen, it2->blocklen);
+        for (int i=0; i<nnodes; i++)
+            EXPECT_EQ(it->tree->nodes[i].parent, it2->tree->nodes[i].parent);
+    }
+    delete trees2;
+}
+
+
+// Computing emissions on demand should give the same forward table as
+// using a precomputed emission matrix.
+TEST_F(ForwardBlockTest, forward_block_site_emissions)
+{
+    const int nseqs = 6, blocklen = 100;
+    const char *bases = "ACGTN";
+    char seqdata[nseqs][blocklen];
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = seqdata[j];
+        for (int i=0; i<blocklen; i++)
+            seqdata[j][i] = (i % 3 == 0) ? bases[irand(5)] : 'A';
+    }
+    vector<vector<BaseProbs> > base_probs;
+
+    TransMatrix matrix(&model, states.size());
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+    const int nstates = states.size();
+    double **emit = new_matrix<double>(blocklen, nstates);
+    double **fw = new_matrix<double>(blocklen, nstates);
+    double **fw2 = new_matrix<double>(blocklen, nstates);
+    calc_emissions_external(states, &tree, seqs, base_probs, nseqs, blocklen,
+                            &model, emit, NULL);
+    SiteEmissions site_emit(states, &tree, seqs, base_probs, nseqs, blocklen,
+                            &model, false);
+
+    for (int k=0; k<nstates; k++)
+        fw[0][k] = fw2[0][k] = 1.0 / nstates;
+    arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                         &matrix, emit, fw);
+    arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                         &matrix, &site_emit, 0, fw2);
+
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            EXPECT_EQ(fw[i][k], fw2[i][k]);
+
+    delete_matrix<double>(emit, blocklen);
+    delete_matrix<double>(fw, blocklen);
+    delete_matrix<double>(fw2, blocklen);
+}
+
+// Variant sites sharing an allele pattern should reuse the cached emissions
+// and agree with emissions computed for that site alone.
+TEST_F(ForwardBlockTest, site_emissions_patterns)
+{
+    const int nseqs = 6, blocklen = 100;
+    const char *patterns[] = {"AACCGA", "ACACAA", "TTAAAC"};
+    char seqdata[nseqs][blocklen];
+    char *seqs[nseqs];
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = seqdata[j];
+        for (int i=0; i<blocklen; i++)
+            seqdata[j][i] = (i % 2 == 0) ? patterns[i % 3][j] : 'A';
+    }
+    vector<vector<BaseProbs> > base_probs;
+
+    const int nstates = states.size();
+    SiteEmissions site_emit(states, &tree, seqs, base_probs, nseqs, blocklen,
+                            &model, false);
+    double emit[nstates], emit2[nstates];
+    for (int i=0; i<blocklen; i++) {
+        const char *site_seqs[nseqs];
+        for (int j=0; j<nseqs; j++)
+            site_seqs[j] = seqs[j] + i;
+        SiteEmissions single(states, &tree, site_seqs, base_probs, nseqs, 1,
+                             &model, false);
+        site_emit.get(i, emit);
+        single.get(0, emit2);
+        for (int k=0; k<nstates; k++)
+            EXPECT_EQ(emit[k], emit2[k]);
+    }
+    EXPECT_EQ(site_emit.get_pattern_hits(), blocklen / 2 - 3);
+}
+
+
+// Emissions split across threads should equal those of a single thread.
+TEST_F(ForwardBlockTest, threaded_emissions)
+{
+    const int nseqs = 6, blocklen = 4 * MIN_THREAD_SITES + 17;
+    const char *bases = "ACGTN";
+    vector<char> seqdata(nseqs * blocklen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * blocklen];
+        for (int i=0; i<blocklen; i++)
+            seqs[j][i] = (i % 7 == 0) ? bases[irand(5)] : 'C';
+    }
+    vector<vector<BaseProbs> > base_probs;
+
+    const int nstates = states.size();
+    double **emit = new_matrix<double>(blocklen, nstates);
+    double **emit2 = new_matrix<double>(blocklen, nstates);
+    calc_emissions_external(states, &tree, seqs, base_probs, nseqs, blocklen,
+                            &model, emit, NULL);
+    model.nthreads = 4;
+    ASSERT_TRUE(use_threaded_emissions(&model, blocklen, NULL));
+    calc_emissions_external(states, &tree, seqs, base_probs, nseqs, blocklen,
+                            &model, emit2, NULL);
+
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            ASSERT_EQ(emit[i][k], emit2[i][k]);
+
+    delete_matrix<double>(emit, blocklen);
+    delete_matrix<double>(emit2, blocklen);
+}
+
+
+// Partial likelihood tables updated from the previous variant site should
+// give the same likelihoods and emissions as tables computed afresh.
+TEST_F(ForwardBlockTest, incremental_site_tables)
+{
+    const int nseqs = 6, blocklen = 300;
+    const char *bases = "ACGTN";
+    vector<char> seqdata(nseqs * blocklen);
+    char *seqs[nseqs];
+    srand(4321);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * blocklen];
+        for (int i=0; i<blocklen; i++)
+            seqs[j][i] = (i % 3 == 0 && frand() < .3) ? bases[irand(5)] : 'A';
+    }
+    vector<vector<BaseProbs> > base_probs;
+
+    double lnl = 0.0;
+    for (int i=0; i<blocklen; i++)
+        lnl += likelihood_tree(&tree, &model, seqs, base_probs, nseqs - 1,
+                               i, i + 1);
+    EXPECT_EQ(lnl, likelihood_tree(&tree, &model, seqs, base_probs,
+                                   nseqs - 1, 0, blocklen));
+
+    const int nstates = states.size();
+    vector<double> emit(nstates), emit2(nstates);
+    SiteEmissions site_emit(states, &tree, seqs, base_probs, nseqs, blocklen,
+                            &model, false);
+    for (int i=0; i<blocklen; i++) {
+        SiteEmissions site_emit2(states, &tree, seqs, base_probs, nseqs,
+                                 blocklen, &model, false);
+        site_emit.get(i, &emit[0]);
+        site_emit2.get(i, &emit2[0]);
+        for (int k=0; k<nstates; k++)
+            ASSERT_EQ(emit[k], emit2[k]) << i;
+    }
+}
+
+
+// Emissions of heterozygous sites of an unphased pair, computed from
+// tables shared with the given phasing, should be the average of the
+// emissions of the two phasings, and the phase probabilities should be
+// the fraction given by the current one.
+TEST_F(ForwardBlockTest, phased_site_emissions)
+{
+    const int nseqs = 6, blocklen = 200;
+    const char *bases = "ACGTN";
+    vector<char> seqdata(nseqs * blocklen), flipdata(nseqs * blocklen);
+    char *seqs[nseqs], *flipped[nseqs];
+    srand(2468);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * blocklen];
+        flipped[j] = &flipdata[j * blocklen];
+        for (int i=0; i<blocklen; i++)
+            seqs[j][i] = (i % 2 == 0 && frand() < .4) ? bases[irand(5)] : 'A';
+    }
+    vector<vector<BaseProbs> > base_probs;
+
+    ArgModel model2(model);
+    model2.unphased = true;
+    Sequences sequences(seqs, nseqs, blocklen);
+    for (int j=0; j<nseqs; j++)
+        sequences.pairs.push_back(j ^ 1);
+    LocalTrees trees(0, blocklen);
+    for (int j=0; j<nseqs; j++)
+        trees.seqids.push_back(j);
+
+    // pair of two leaves of the tree and pair with the new leaf
+    const int nstates = states.size();
+    const int haps[] = {2, 4};
+    for (int h=0; h<2; h++) {
+        const int hap1 = haps[h], hap2 = hap1 + 1;
+        PhaseProbs phase_pr(hap1, hap1, &sequences, &trees, &model2);
+        ASSERT_EQ(hap2, phase_pr.treemap2);
+        phase_pr.offset = 0;
+
+        for (int j=0; j<nseqs; j++)
+            memcpy(flipped[j], seqs[j], blocklen);
+        memcpy(flipped[hap1], seqs[hap2], blocklen);
+        memcpy(flipped[hap2], seqs[hap1], blocklen);
+
+        vector<double> emit(nstates), emit1(nstates), emit2(nstates);
+        SiteEmissions site_emit(states, &tree, seqs, base_probs, nseqs,
+                                blocklen, &model2, false, &phase_pr);
+        SiteEmissions phase1(states, &tree, seqs, base_probs, nseqs,
+                             blocklen, &model, false);
+        SiteEmissions phase2(states, &tree, flipped, base_probs, nseqs,
+                             blocklen, &model, false);
+        int nhet = 0;
+        for (int i=0; i<blocklen; i++) {
+            site_emit.get(i, &emit[0]);
+            phase1.get(i, &emit1[0]);
+            phase2.get(i, &emit2[0]);
+            if (seqs[hap1][i] == seqs[hap2][i]) {
+                EXPECT_EQ(0u, phase_pr.probs.count(i));
+                for (int k=0; k<nstates; k++)
+                    ASSERT_EQ(emit1[k], emit[k]) << i;
+                continue;
+            }
+
+            nhet++;
+            ASSERT_EQ(1u, phase_pr.probs.count(i));
+            const vector<double> &probs = phase_pr.probs[i];
+            ASSERT_EQ(nstates, (int) probs.size());
+            for (int k=0; k<nstates; k++) {
+                ASSERT_EQ((emit1[k] + emit2[k]) * 0.5, emit[k]) << i;
+                ASSERT_EQ(emit1[k] / (emit1[k] + emit2[k]), probs[k]) << i;
+            }
+        }
+        EXPECT_GT(nhet, 10);
+    }
+}
+
+
+// Removal path counts kept in a reused table should equal those counted
+// afresh, and paths sampled from them should be the same.
+TEST_F(ForwardBlockTest, reused_removal_paths)
+{
+    const int nseqs = 6, seqlen = 10000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+    LocalTrees *trees2 = partition_local_trees(&trees, seqlen / 2);
+
+    // count the halves of the ARG, the one with more trees first
+    const LocalTrees *halves[2] = {&trees, trees2};
+    if (trees.get_num_trees() < trees2->get_num_trees())
+        swap(halves[0], halves[1]);
+    RemovalPaths removal_paths(halves[0]), removal_paths2(halves[0]);
+    double **counts = removal_paths.counts;
+    for (int k=0; k<2; k++) {
+        const LocalTrees *t = halves[k];
+        count_arg_removal_paths(t, removal_paths);
+        RemovalPaths fresh(t);
+        count_arg_removal_paths(t, fresh);
+        ASSERT_EQ(t->get_num_trees(), removal_paths.ntrees);
+        for (int i=0; i<fresh.ntrees; i++)
+            for (int j=0; j<fresh.nnodes; j++)
+                EXPECT_EQ(fresh.counts[i][j], removal_paths.counts[i][j]);
+        EXPECT_EQ(count_total_arg_removal_paths(t),
+                  count_total_arg_removal_paths(removal_paths));
+
+        vector<int> path(t->get_num_trees()), path2(t->get_num_trees());
+        srand(10);
+        const double npaths = sample_arg_removal_path_uniform(t, &path[0]);
+        srand(10);
+        EXPECT_EQ(npaths, sample_arg_removal_path_uniform(removal_paths,
+                                                          &path2[0]));
+        EXPECT_EQ(path, path2);
+    }
+    EXPECT_EQ(counts, removal_paths.counts);
+
+    // swapping exchanges the tables
+    removal_paths.swap(removal_paths2);
+    EXPECT_EQ(counts, removal_paths2.counts);
+    delete trees2;
+}
+
+
+// ARG likelihoods and priors split across threads should equal those of a
+// single thread, to the last bit.
+TEST_F(ForwardBlockTest, threaded_arg_probs)
+{
+    const int nseqs = 6, seqlen = 20000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+    ASSERT_GT(trees.get_num_trees(), 100);
+
+    const double like = calc_arg_likelihood(&model, &sequences, &trees);
+    const double prior = calc_arg_prior(&model, &trees);
+    const double like_region = calc_arg_likelihood(&model, &sequences, &trees,
+                                                   5000, 15000);
+    const int ncounts = 2 * model.ntimes - 1;
+    double counts[2][2][ncounts];
+    double *num_coal[2][1] = {{counts[0][0]}, {counts[1][0]}};
+    double *num_nocoal[2][1] = {{counts[0][1]}, {counts[1][1]}};
+    EXPECT_EQ(prior, calc_arg_prior(&model, &trees, num_coal[0],
+                                    num_nocoal[0]));
+    model.nthreads = 4;
+    EXPECT_EQ(like, calc_arg_likelihood(&model, &sequences, &trees));
+    EXPECT_EQ(prior, calc_arg_prior(&model, &trees));
+    EXPECT_EQ(like_region, calc_arg_likelihood(&model, &sequences, &trees,
+                                               5000, 15000));
+
+    // coalescence counts are split across threads too
+    EXPECT_EQ(prior, calc_arg_prior(&model, &trees, num_coal[1],
+                                    num_nocoal[1]));
+    for (int k=0; k<2; k++)
+        for (int i=0; i<ncounts; i++)
+            EXPECT_EQ(counts[0][k][i], counts[1][k][i]);
+}
+
+
+// The prior counted once should follow calc_arg_prior() as population
+// sizes change
+TEST_F(ForwardBlockTest, arg_prior_stats)
+{
+    const int nseqs = 6, seqlen = 20000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+
+    for (int smc_prime=0; smc_prime<2; smc_prime++) {
+        model.smc_prime = smc_prime;
+        model.set_popsizes(1e4);
+        LocalTrees trees;
+        sample_arg_seq(&model, &sequences, &trees);
+        ArgPriorStats stats;
+        stats.count(&model, &trees);
+        for (int k=0; k<3; k++) {
+            const double prior = calc_arg_prior(&model, &trees);
+            EXPECT_NEAR(prior, stats.prior(&model), 1e-8 * fabs(prior));
+            model.popsizes[0][2*k] *= 3.0;
+            model.popsizes[0][2*k+5] /= 2.0;
+            model.update_interval_tables();
+        }
+    }
+}
+
+// Counts added from the same ARG twice should be twice those of one
+// reading, and each SPR should coalesce once.
+TEST_F(ForwardBlockTest, popsize_sufficient_stats)
+{
+    const int nseqs = 6, seqlen = 20000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+    model.set_popsizes(1e4);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    struct popsize_data data, data2;
+    popsize_sufficient_stats(&data, &model, &trees);
+    popsize_sufficient_stats(&data2, &model, &trees);
+    popsize_sufficient_stats(&data2, &model, &trees, true);
+    ASSERT_EQ(data.arr_size, data2.arr_size);
+    for (int i=0; i<data.arr_size; i++)
+        EXPECT_EQ(2.0 * data.arr_alloc[i], data2.arr_alloc[i]);
+
+    double ncoal = 0.0;
+    for (int i=0; i<model.ntimes; i++)
+        ncoal += data.coal_totals[i];
+    EXPECT_EQ(double(trees.get_num_trees() - 1), ncoal);
+
+    mle_popsize(&model, &data);
+    for (int i=0; i<model.ntimes-1; i++)
+        EXPECT_GT(model.popsizes[0][2*i], 0.0);
+    delete_popsize_data(&data);
+    delete_popsize_data(&data2);
+}
+
+
+// The prior of an ARG whose blocks have cached terms should be the prior
+// computed from scratch, after the trees or the model change.
+TEST_F(ForwardBlockTest, cached_arg_prior)
+{
+    const int nseqs = 6, seqlen = 20000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    for (int k=0; k<3; k++) {
+        model.nthreads = 1 + 3 * (k % 2);
+        const double prior = calc_arg_prior(&model, &trees);
+        EXPECT_EQ(prior, calc_arg_prior(&model, &trees));
+        LocalTrees trees2;
+        trees2.copy(trees);
+        EXPECT_EQ(prior, calc_arg_prior(&model, &trees2));
+
+        if (k == 0) {
+            resample_arg_region(&model, &sequences, &trees, 5000, 8000, 2);
+        } else {
+            model.popsizes[0][3] *= 2.0;
+            model.update_interval_tables();
+        }
+    }
+}
+
+// Cached prior terms of a model with populations should be dropped when
+// its migration rates are resampled in place
+TEST(ArgPriorTest, cached_prior_migration)
+{
+    ArgModel model(20, 1.6e-8, 1.8e-8);
+    model.set_log_times(200e3, 20);
+    const char *pops = "npop 2\n"
+        "div 50000 1 0\n"
+        "mig 5000 1 0 0.05\n"
+        "mig 20000 0 1 0.05\n";
+    FILE *infile = fmemopen((void*) pops, strlen(pops), "r");
+    model.read_population_tree(infile);
+    fclose(infile);
+    model.pop_tree->max_migrations = 1;
+    model.set_popsizes(1e4);
+
+    const int nseqs = 6, seqlen = 20000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+    const double prior = calc_arg_prior(&model, &trees);
+
+    // double the migration rates as resample_migrates() changes them
+    PopulationTree *pop_tree = model.pop_tree;
+    for (unsigned int t=0; t<pop_tree->mig_matrix.size(); t++) {
+        MigMatrix &mig = pop_tree->mig_matrix[t];
+        for (int a=0; a<mig.npop; a++) {
+            for (int b=0; b<mig.npop; b++) {
+                const double rate = mig.get(a, b);
+                if (a != b && rate > 0.0 && rate < 0.5) {
+                    mig.set(a, b, 2.0 * rate);
+                    mig.set(a, a, mig.get(a, a) - rate);
+                }
+            }
+        }
+    }
+    pop_tree->update_population_probs();
+
+    const double prior2 = calc_arg_prior(&model, &trees);
+    EXPECT_NE(prior, prior2);
+    LocalTrees trees2;
+    trees2.copy(trees);
+    EXPECT_EQ(prior2, calc_arg_prior(&model, &trees2));
+}
+
+
+// Sliding windows resampled in parallel should give valid local trees over
+// the same region, whatever the scheduling of the windows.
+TEST_F(ForwardBlockTest, parallel_windows)
+{
+    const int nseqs = 5, seqlen = 20000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    model.nthreads = 4;
+    model.parallel_windows = true;
+    vector<int> self_recomb_pos;
+    vector<Spr> self_recombs;
+    string text[2];
+    for (int k=0; k<2; k++) {
+        LocalTrees trees2;
+        trees2.copy(trees);
+        srand(4321);
+        resample_arg_regions(&model, &sequences, &trees2, 2000, 2);
+        assert_trees(&trees2, model.pop_tree);
+        EXPECT_EQ(trees.start_coord, trees2.start_coord);
+        EXPECT_EQ(trees.end_coord, trees2.end_coord);
+        text[k] = write_smc_text(&trees2, model.times, self_recomb_pos,
+                                 self_recombs);
+    }
+    EXPECT_EQ(text[0], text[1]);
+}
+
+
+// Forward passes should add their blocks and states to the counts of the
+// calling thread, also when run on the threads of parallel windows.
+// Pruning a column should drop only the states below the threshold,
+// never its largest state, and renormalize the rest.
+TEST(PruneForwardTest, prune_column)
+{
+    double col[] = {0.5, 0.3, 0.001, 0.0, 0.199};
+    long long npruned = 0;
+    const double dropped = prune_forward_column(col, 5, 0.01, &npruned);
+    EXPECT_EQ(1, npruned);
+    EXPECT_NEAR(0.001, dropped, 1e-12);
+    EXPECT_EQ(0.0, col[2]);
+    EXPECT_EQ(0.0, col[3]);
+    EXPECT_NEAR(1.0, col[0] + col[1] + col[4], 1e-12);
+    EXPECT_NEAR(0.5 / 0.999, col[0], 1e-12);
+
+    // a threshold above every state keeps the largest one
+    double col2[] = {0.2, 0.5, 0.3};
+    npruned = 0;
+    prune_forward_column(col2, 3, 0.9, &npruned);
+    EXPECT_EQ(2, npruned);
+    EXPECT_DOUBLE_EQ(1.0, col2[1]);
+}
+
+
+// The pruned forward algorithm should stay close to the exact one and
+// count the states it drops.
+TEST_F(ForwardBlockTest, forward_block_prune)
+{
+    const int nstates = states.size();
+    const int blocklen = 50;
+    TransMatrix matrix(&model, nstates);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+    double **emit = new_matrix<double>(blocklen, nstates);
+    double **fw = new_matrix<double>(blocklen, nstates);
+    double **fw2 = new_matrix<double>(blocklen, nstates);
+
+    // emissions favouring the states of one branch
+    srand(1234);
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            emit[i][k] = (states[k].node == 2 ? 1.0 : 1e-3) * frand(.5, 1.0);
+    for (int k=0; k<nstates; k++)
+        fw[0][k] = fw2[0][k] = 1.0 / nstates;
+
+    arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                         &matrix, emit, fw);
+
+    ForwardStats stats;
+    ForwardStats *prev = set_thread_forward_stats(&stats);
+    model.fw_prune = 1e-6;
+    arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                         &matrix, emit, fw2);
+    model.fw_prune = 0.0;
+    set_thread_forward_stats(prev);
+
+    EXPECT_GT(stats.npruned, 0);
+    EXPECT_GT(stats.pruned_mass, 0.0);
+    for (int i=0; i<blocklen; i++) {
+        double total = 0.0, total2 = 0.0;
+        for (int k=0; k<nstates; k++) {
+            total += fw[i][k];
+            total2 += fw2[i][k];
+        }
+        for (int k=0; k<nstates; k++)
+            EXPECT_NEAR(fw[i][k] / total, fw2[i][k] / total2, 1e-4);
+    }
+
+    delete_matrix<double>(emit, blocklen);
+    delete_matrix<double>(fw, blocklen);
+    delete_matrix<double>(fw2, blocklen);
+}
+
+
+TEST_F(ForwardBlockTest, forward_stats)
+{
+    const int nseqs = 5, seqlen = 20000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    ForwardStats stats;
+    ForwardStats *prev = set_thread_forward_stats(&stats);
+    EXPECT_TRUE(prev == NULL);
+    EXPECT_EQ(&stats, &get_forward_stats());
+    resample_arg_mcmc(&model, &sequences, &trees);
+    const long long nblocks = stats.nblocks;
+    EXPECT_GT(nblocks, 0);
+    EXPECT_GE(stats.nstates, nblocks);
+
+    // each block is counted once by states and by length, and each switch
+    // with states to switch from by its deterministic fraction
+    long long nstates_hist = 0, nblocks_hist = 0, ndeterm_hist = 0;
+    for (int i=0; i<StateHistograms::NBINS; i++) {
+        nstates_hist += stats.hist.states[i];
+        nblocks_hist += stats.hist.blocklens[i];
+    }
+    for (int i=0; i<StateHistograms::NFRAC_BINS; i++)
+        ndeterm_hist += stats.hist.determ[i];
+    EXPECT_EQ(nblocks, nstates_hist);
+    EXPECT_EQ(nblocks, nblocks_hist);
+    EXPECT_GT(stats.hist.nswitches, 0);
+    EXPECT_LT(stats.hist.nswitches, nblocks);
+    EXPECT_GT(ndeterm_hist, 0);
+    EXPECT_LE(ndeterm_hist, stats.hist.nswitches);
+
+    model.nthreads = 4;
+    model.parallel_windows = true;
+    resample_arg_regions(&model, &sequences, &trees, 2000, 1);
+    EXPECT_GT(stats.nblocks, nblocks);
+    set_thread_forward_stats(prev);
+
+    stats.clear();
+    EXPECT_EQ(0, stats.nblocks);
+    EXPECT_EQ(0, stats.hist.nswitches);
+    EXPECT_GT(get_memory_usage(), 0);
+}
+
+
+// Sizes should be counted in bins of doubling width.
+TEST(StateHistogramsTest, bins)
+{
+    EXPECT_EQ(0, StateHistograms::get_bin(0));
+    EXPECT_EQ(1, StateHistograms::get_bin(1));
+    EXPECT_EQ(2, StateHistograms::get_bin(2));
+    EXPECT_EQ(2, StateHistograms::get_bin(3));
+    EXPECT_EQ(3, StateHistograms::get_bin(4));
+    EXPECT_EQ(11, StateHistograms::get_bin(1500));
+    EXPECT_EQ(StateHistograms::NBINS - 1,
+              StateHistograms::get_bin(1LL << 40));
+    for (int size=0; size<100; size++) {
+        const int bin = StateHistograms::get_bin(size);
+        EXPECT_LE(StateHistograms::get_bin_start(bin), size);
+        EXPECT_LT(size, StateHistograms::get_bin_end(bin));
+    }
+
+    StateHistograms hist, hist2;
+    hist.add_block(30, 1000);
+    hist2.add_block(30, 5);
+    hist.add(hist2);
+    EXPECT_EQ(2, hist.states[StateHistograms::get_bin(30)]);
+    EXPECT_EQ(1, hist.blocklens[StateHistograms::get_bin(1000)]);
+    EXPECT_EQ(1, hist.blocklens[StateHistograms::get_bin(5)]);
+}
+
+
+// Forward tables, block matrices and local trees should account their
+// memory while allocated and give it back when freed.
+TEST_F(ForwardBlockTest, tag_memory)
+{
+    const long forward_mem = get_tag_memory(MEM_FORWARD);
+    const long matrices_mem = get_tag_memory(MEM_MATRICES);
+    const long emissions_mem = get_tag_memory(MEM_EMISSIONS);
+    const long trees_mem = get_tag_memory(MEM_TREES);
+    {
+        LocalTrees trees;
+        make_local_trees(&trees);
+        EXPECT_GT(get_tag_memory(MEM_TREES), trees_mem);
+
+        const int nseqs = 6, seqlen = trees.length();
+        vector<char> seqdata(nseqs * (seqlen + 1), 'A');
+        char *seqs[nseqs];
+        for (int j=0; j<nseqs; j++)
+            seqs[j] = &seqdata[j * (seqlen + 1)];
+        Sequences sequences(seqs, nseqs, seqlen);
+
+        ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees);
+        matrix_iter.begin();
+        ArgHmmMatrices &mat = matrix_iter.ref_matrices();
+        EXPECT_EQ(get_tag_memory(MEM_MATRICES) - matrices_mem,
+                  mat.get_matrix_memory());
+        EXPECT_EQ(get_tag_memory(MEM_EMISSIONS) - emissions_mem,
+                  mat.get_emit_memory());
+
+        ArgHmmForwardTable forward(0, seqlen);
+        forward.new_block(0, 100, states.size());
+        EXPECT_EQ(get_tag_memory(MEM_FORWARD) - forward_mem,
+                  long(seqlen * sizeof(double*) +
+                       100 * states.size() * sizeof(double)));
+        EXPECT_GE(get_tag_max_memory(MEM_FORWARD),
+                  get_tag_memory(MEM_FORWARD));
+    }
+    EXPECT_EQ(forward_mem, get_tag_memory(MEM_FORWARD));
+    EXPECT_EQ(matrices_mem, get_tag_memory(MEM_MATRICES));
+    EXPECT_EQ(emissions_mem, get_tag_memory(MEM_EMISSIONS));
+    EXPECT_EQ(trees_mem, get_tag_memory(MEM_TREES));
+}
+
+
+// Multiple-try steps should give valid local trees that do not depend on
+// the number of threads the tries are drawn on.
+TEST_F(ForwardBlockTest, multiple_try_mcmc)
+{
+    const int nseqs = 5, seqlen = 20000;
+    const char *bases = "ACGT";
+    vector<char> seqdata(nseqs * seqlen);
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = &seqdata[j * seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 50 == 0) ? bases[irand(4)] : 'C';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    model.rho = 1e-6;
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    vector<int> self_recomb_pos;
+    vector<Spr> self_recombs;
+    string text[2];
+    for (int k=0; k<2; k++) {
+        model.nthreads = 1 + 3 * k;
+        LocalTrees trees2;
+        trees2.copy(trees);
+        srand(4321);
+        for (int i=0; i<3; i++) {
+            resample_arg_mcmc(&model, &sequences, &trees2, 3);
+            assert_trees(&trees2, model.pop_tree);
+        }
+        resample_arg_climb(&model, &sequences, &trees2, .9, 3);
+        assert_trees(&trees2, model.pop_tree);
+        EXPECT_EQ(trees.start_coord, trees2.start_coord);
+        EXPECT_EQ(trees.end_coord, trees2.end_coord);
+        text[k] = write_smc_text(&trees2, model.times, self_recomb_pos,
+                                 self_recombs);
+    }
+    EXPECT_EQ(text[0], text[1]);
+}
+
+
+// Merging map regions of similar rates should keep the total rates and
+// bound the difference of each rate to its merged rate.
+TEST(ModelTest, merge_map_regions)
+{
+    ArgModel model(20, 1.5e-8, 2.5e-8), model2(20, 1.5e-8, 2.5e-8);
+    const double recomb_rates[] = {1.0e-8, 1.05e-8, 1.02e-8, 2.0e-8,
+                                   2.01e-8, 0.0, 0.0, 1.0e-8};
+    const int nregions = sizeof(recomb_rates) / sizeof(recomb_rates[0]);
+    double total = 0.0;
+    for (int i=0; i<nregions; i++) {
+        model.recombmap.append("chr", i * 100, (i + 1) * 100,
+                               recomb_rates[i]);
+        total += recomb_rates[i] * 100;
+    }
+    model2.recombmap = model.recombmap;
+    ASSERT_TRUE(model.setup_maps("chr", 0, nregions * 100));
+    ASSERT_TRUE(model2.setup_maps("chr", 0, nregions * 100, 0.1));
+
+    EXPECT_EQ(nregions, (int) model.recombmap.size());
+    ASSERT_EQ(4, (int) model2.recombmap.size());
+    ASSERT_EQ(4, (int) model2.mutmap.size());
+    double total2 = 0.0;
+    for (unsigned int i=0; i<model2.recombmap.size(); i++) {
+        total2 += model2.recombmap[i].value * model2.recombmap[i].length();
+        EXPECT_EQ(model2.recombmap[i].start, model2.mutmap[i].start);
+        EXPECT_EQ(model2.recombmap[i].end, model2.mutmap[i].end);
+        EXPECT_DOUBLE_EQ(2.5e-8, model2.mutmap[i].value);
+    }
+    EXPECT_NEAR(total, total2, 1e-12 * total);
+    EXPECT_EQ(300, model2.recombmap[0].end);
+    EXPECT_NEAR(1.0233e-8, model2.recombmap[0].value, 1e-12);
+    for (int pos=0; pos<nregions * 100; pos++)
+        EXPECT_NEAR(model.get_local_rho(pos), model2.get_local_rho(pos),
+                    0.1 * model.get_local_rho(pos));
+}
+
+
+// Collapsing a run of sites should give the same last column as stepping
+// through it, and the traceback should sample sites inside the run from
+// their posterior.
+TEST(TransMatrixPowersTest, forward_traceback)
+{
+    const int nstates = 3, len = 13, mid = 5, nsamples = 20000;
+    double base_data[nstates][nstates] = {
+        {.90, .05, .05}, {.10, .80, .10}, {.02, .08, .90}};
+    const double emit[nstates] = {.3, .2, .25};
+    double **base = new_matrix<double>(nstates, nstates);
+    for (int j=0; j<nstates; j++)
+        for (int k=0; k<nstates; k++)
+            base[j][k] = base_data[j][k] * emit[k];
+
+    // step through the run directly
+    double **fw = new_matrix<double>(len+1, nstates);
+    double **fw2 = new_matrix<double>(len+1, nstates);
+    fw[0][0] = fw2[0][0] = .5;
+    fw[0][1] = fw2[0][1] = .3;
+    fw[0][2] = fw2[0][2] = .2;
+    for (int i=1; i<=len; i++) {
+        double norm = 0.0;
+        for (int k=0; k<nstates; k++) {
+            fw2[i][k] = 0.0;
+            for (int j=0; j<nstates; j++)
+                fw2[i][k] += fw2[i-1][j] * base[j][k];
+            norm += fw2[i][k];
+        }
+        for (int k=0; k<nstates; k++)
+            fw2[i][k] /= norm;
+    }
+
+    TransMatrixPowers powers(nstates, base);
+    powers.forward(fw, 1, len+1);
+    for (int k=0; k<nstates; k++)
+        EXPECT_NEAR(fw[len][k], fw2[len][k], 1e-12);
+
+    // posterior of the middle site given path[len] = 0
+    double backward[nstates];
+    for (int k=0; k<nstates; k++)
+        backward[k] = (k == 0);
+    for (int i=len; i>mid; i--) {
+        double col[nstates];
+        for (int j=0; j<nstates; j++) {
+            col[j] = 0.0;
+            for (int k=0; k<nstates; k++)
+                col[j] += base[j][k] * backward[k];
+        }
+        for (int j=0; j<nstates; j++)
+            backward[j] = col[j];
+    }
+    double post[nstates], total = 0.0;
+    for (int j=0; j<nstates; j++)
+        total += post[j] = fw2[mid][j] * backward[j];
+
+    srand(1234);
+    int counts[nstates] = {0, 0, 0};
+    int path[len+1];
+    for (int n=0; n<nsamples; n++) {
+        path[len] = 0;
+        powers.traceback(fw, 1, len+1, path);
+        counts[path[mid]]++;
+    }
+    for (int j=0; j<nstates; j++)
+        EXPECT_NEAR(counts[j] / double(nsamples), post[j] / total, .015);
+
+    delete_matrix<double>(base, nstates);
+    delete_matrix<double>(fw, len+1);
+    delete_matrix<double>(fw2, len+1);
+}
+
+
+// A checkpointed table should start a new segment once 'interval' bases
+// have been computed and keep the last column of the previous segment.
+TEST(ForwardTableTest, checkpoint_segments)
+{
+    const int nstates = 3;
+    ArgHmmForwardTableCheckpoint forward(100, 50, 20);
+    double **fw = forward.get_table();
+
+    for (int start=100; start<150; start+=10) {
+        forward.new_block(start, start+10, nstates);
+        for (int i=start; i<start+10; i++)
+            for (int k=0; k<nstates; k++)
+                fw[i][k] = i + k;
+        forward.end_block(start, start+10);
+    }
+
+    EXPECT_EQ(forward.get_num_segments(), 3);
+    EXPECT_EQ(forward.get_segment_start(100), 100);
+    EXPECT_EQ(forward.get_segment_start(119), 100);
+    EXPECT_EQ(forward.get_segment_start(120), 120);
+    EXPECT_EQ(forward.get_segment_start(149), 140);
+
+    // checkpoint columns and the last segment are kept
+    for (int k=0; k<nstates; k++) {
+        EXPECT_EQ(fw[119][k], 119 + k);
+        EXPECT_EQ(fw[139][k], 139 + k);
+        EXPECT_EQ(fw[149][k], 149 + k);
+    }
+}
+
+
+// Threading with a checkpointed forward table should keep the columns of
+// the full table and, with the same random seed, sample the same path.
+TEST(ForwardTableTest, checkpoint_traceback)
+{
+    ArgModel model(20, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.rho = 1e-6;
+    const int nseqs = 6, seqlen = 5000, interval = 300;
+    TestAlignment alignment(nseqs, seqlen);
+    Sequences *sequences = alignment.sequences;
+    LocalTrees trees;
+    sample_arg_seq(&model, sequences, &trees);
+    remove_arg_thread(&trees, nseqs - 1, &model);
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    // states of each column
+    vector<int> nstates;
+    States states;
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it) {
+        get_coal_states(it->tree, model.ntimes, states);
+        nstates.insert(nstates.end(), it->blocklen, states.size());
+    }
+
+    ArgHmmMatrixIter matrix_iter(&model, sequences, &trees);
+    ArgHmmForwardTable forward(trees.start_coord, seqlen);
+    arghmm_forward_alg(&trees, &model, sequences, &matrix_iter, &forward);
+    ArgHmmMatrixIter checkpoint_iter(&model, sequences, &trees);
+    ArgHmmForwardTableCheckpoint checkpoint(trees.start_coord, seqlen,
+                                            interval);
+    arghmm_forward_alg(&trees, &model, sequences, &checkpoint_iter,
+                       &checkpoint);
+    ASSERT_GT(checkpoint.get_num_segments(), 2);
+
+    // the checkpoint columns and the last segment are kept
+    double **fw = forward.get_table();
+    double **fw2 = checkpoint.get_table();
+    const int last_start = checkpoint.get_segment_start(seqlen - 1);
+    for (int i=0; i<seqlen; i++) {
+        if (i < last_start && checkpoint.get_segment_start(i + 1) != i + 1)
+            continue;
+        for (int k=0; k<nstates[i]; k++)
+            EXPECT_EQ(fw[i][k], fw2[i][k]);
+    }
+
+    int path[seqlen], path2[seqlen];
+    ArgHmmMatrixIter matrix_iter2(&model, NULL, &trees);
+    srand(1);
+    const double lnl = stochastic_traceback(&trees, &model, &matrix_iter2,
+                                            &forward, path);
+    ArgHmmMatrixIter matrix_iter3(&model, NULL, &trees);
+    srand(1);
+    const double lnl2 = stochastic_traceback_checkpoint(
+        &trees, &model, &matrix_iter3, &checkpoint_iter, &checkpoint, path2);
+    EXPECT_EQ(lnl, lnl2);
+    for (int i=0; i<seqlen; i++)
+        EXPECT_EQ(path[i], path2[i]);
+
+    // the traceback recomputes the first segment last
+    int first_end = 1;
+    while (checkpoint.get_segment_start(first_end) != first_end)
+        first_end++;
+    for (int i=0; i<first_end; i++)
+        for (int k=0; k<nstates[i]; k++)
+            EXPECT_EQ(fw[i][k], fw2[i][k]);
+}
+
+
+// Columns of a single precision table should round trip to within float
+// precision, even when they are far below the float range.
+TEST(ForwardTableTest, float_table)
+{
+    const int nstates = 4;
+    ArgHmmForwardTableFloat forward(0, 30);
+    double **fw = forward.get_table();
+
+    for (int start=0; start<30; start+=10) {
+        forward.new_block(start, start+10, nstates);
+        for (int i=start; i<start+10; i++)
+            for (int k=0; k<nstates; k++)
+                fw[i][k] = (k + 1) * 1e-300;
+        forward.end_block(start, start+10);
+    }
+
+    forward.load_block(9, 30);
+    for (int i=9; i<30; i++)
+        for (int k=0; k<nstates; k++)
+            EXPECT_NEAR(fw[i][k] / 1e-300, k + 1, 1e-6);
+}
+
+
+// After the first table, a pooled table should reuse the same storage.
+TEST(ForwardTableTest, pool_reuse)
+{
+    ForwardTablePool pool;
+    const int nstates = 100, blocklen = 1000;
+    double *first = NULL;
+
+    for (int iter=0; iter<3; iter++) {
+        ArgHmmForwardTable forward(0, 10*blocklen, &pool);
+        double **fw = forward.get_table();
+        for (int start=0; start<10*blocklen; start+=blocklen)
+            forward.new_block(start, start+blocklen, nstates);
+        if (iter == 1)
+            first = fw[0];
+        else if (iter == 2)
+            EXPECT_EQ(fw[0], first);
+        EXPECT_TRUE(pool.capacity() >= size_t(10*blocklen*nstates));
+    }
+    EXPECT_EQ(pool.capacity(), size_t(10*blocklen*nstates));
+}
+
+
+
+// a pool stays valid while a pool of another size is asked for, and
+// each size gets a pool of its own
+TEST(ThreadPoolTest, pool_sizes)
+{
+    EXPECT_TRUE(get_thread_pool(1) == NULL);
+    ThreadPool *pool2 = get_thread_pool(2);
+    ASSERT_TRUE(pool2 != NULL);
+    EXPECT_EQ(pool2->get_num_threads(), 2);
+
+    vector<int> counts(4, 0);
+    pool2->run(4, [&](int i) {
+            ThreadPool *pool3 = get_thread_pool(3);
+            EXPECT_EQ(pool3->get_num_threads(), 3);
+            counts[i]++;
+        });
+    EXPECT_EQ(counts, vector<int>(4, 1));
+    EXPECT_EQ(get_thread_pool(2), pool2);
+    EXPECT_EQ(get_thread_pool(3)->get_num_threads(), 3);
+}
+
+
+// threads with generators of their own draw the same numbers for the same
+// seed, and streams only depend on the generator they are drawn from
+TEST(Mc3Test, thread_rand)
+{
+    RandState rand;
+    rand.seed(7);
+    vector<int> expected;
+    for (int i=0; i<100; i++) {
+        expected.push_back(rand.next());
+        EXPECT_LE(0, expected.back());
+        EXPECT_GE(RAND_MAX, expected.back());
+    }
+
+    vector<int> drawn[2];
+    vector<thread> threads;
+    for (int j=0; j<2; j++) {
+        threads.push_back(thread([&drawn, j]() {
+                    RandState state;
+                    state.seed(7);
+                    set_thread_rand(&state);
+                    for (int i=0; i<50; i++)
+                        drawn[j].push_back(rand_next());
+                    string saved = get_rand_state();
+                    for (int i=50; i<100; i++)
+                        drawn[j].push_back(rand_next());
+                    set_rand_state(saved);
+                    for (int i=50; i<100; i++)
+                        EXPECT_EQ(rand_next(), drawn[j][i]);
+                    set_thread_rand(NULL);
+                }));
+    }
+    for (int j=0; j<2; j++) {
+        threads[j].join();
+        EXPECT_EQ(drawn[j], expected);
+    }
+
+    vector<RandState> streams[2];
+    for (int k=0; k<2; k++) {
+        seed_rand(7);
+        make_rand_streams(3, &streams[k]);
+    }
+    for (int i=0; i<3; i++) {
+        const int value = streams[0][i].next();
+        EXPECT_EQ(value, streams[1][i].next());
+        for (int i2=0; i2<i; i2++)
+            EXPECT_NE(value, streams[0][i2].next());
+    }
+}
+
+
+// all chains see the same swaps and the heats stay a permutation
+TEST(Mc3Test, thread_swaps)
+{
+    const int nchains = 4, nswaps = 200;
+    Mc3Threads mc3_threads(nchains, 1);
+    vector<vector<int> > swaps(nchains);
+    vector<int> groups(nchains);
+
+    vector<thread> threads;
+    for (int j=0; j<nchains; j++) {
+        threads.push_back(thread([&, j]() {
+                    Mc3Config mc3(j, 0.1);
+                    mc3.max_group = nchains - 1;
+                    for (int i=0; i<nswaps; i++) {
+                        int swap[2];
+                        double swapstats[4];
+                        mc3_threads.choose_swap(swap);
+                        EXPECT_NE(swap[0], swap[1]);
+                        // cold chains have the most probable ARGs
+                        bool accept = mc3_threads.decide_swap(
+                            mc3, swap, -100.0 * (mc3.group + 1), swapstats);
+                        swaps[j].push_back(swap[0] * nchains + swap[1]);
+                        swaps[j].push_back(accept);
+                        if (accept && (mc3.group == swap[0] ||
+                                       mc3.group == swap[1])) {
+                            mc3.group = swap[mc3.group == swap[1] ? 0 : 1];
+                            mc3.heat = 1.0 - mc3.heat_interval * mc3.group;
+                        }
+                        mc3_threads.barrier();
+                    }
+                    groups[j] = mc3.group;
+                }));
+    }
+    for (int j=0; j<nchains; j++)
+        threads[j].join();
+
+    for (int j=1; j<nchains; j++)
+        EXPECT_EQ(swaps[j], swaps[0]);
+    sort(groups.begin(), groups.end());
+    for (int j=0; j<nchains; j++)
+        EXPECT_EQ(groups[j], j);
+}
+
+}  // namespace
@@ -0,0 +1,990 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/arg_archive.h"
+#include "argweaver/compress.h"
+#include "argweaver/emit.h"
+#include "argweaver/input_bundle.h"
+#include "argweaver/mem.h"
+#include "argweaver/parsing.h"
+#include "argweaver/profile.h"
+#include "argweaver/query_server.h"
+#include "argweaver/IntervalIterator.h"
+#include "argweaver/sequences.h"
+#include "argweaver/tabix.h"
+#include "argweaver/track.h"
+
+#include "test_args.h"
+
+
+namespace argweaver {
+
+
+// Lookups in a sorted track should agree with a linear scan, with or
+// without a hint, including positions in gaps and outside the track.
+TEST(TrackTest, index_sorted)
+{
+    Track<double> track;
+    srand(1234);
+    int start = 100;
+    for (int i=0; i<500; i++) {
+        const int end = start + 1 + rand() % 20;
+        track.append("chr", start, end, i);
+        start = end + (i % 7 == 0 ? 5 : 0);
+    }
+
+    int hint = 0;
+    for (int pos=0; pos<track.end_coord() + 10; pos++) {
+        const int index = track.index(pos);
+        EXPECT_EQ(index, track.index_sorted(pos));
+        EXPECT_EQ(index, track.index_sorted(pos, hint));
+        EXPECT_EQ(index, track.index_sorted(pos, rand() % track.size()));
+        EXPECT_EQ(track.find(pos, -1.0), track.find_sorted(pos, -1.0, &hint));
+        EXPECT_EQ(max(index, 0), hint);
+    }
+
+    Track<double> empty;
+    EXPECT_EQ(-1, empty.index_sorted(5, 0));
+    EXPECT_EQ(2.0, empty.find_sorted(5, 2.0));
+}
+
+
+// Site lookups by position should agree with a linear scan, and so should
+// compressing coordinates with a sites mapping.
+TEST(SequencesTest, sites_position_index)
+{
+    const int nseqs = 2, seqlen = 1000;
+    char *names[] = {(char*) "a", (char*) "b"};
+    Sites sites("chr", 0, seqlen);
+    for (int i=0; i<nseqs; i++)
+        sites.names.push_back(names[i]);
+    for (int pos=3; pos<seqlen; pos+=17) {
+        char col[] = "AC";
+        sites.append(pos, col, true);
+    }
+
+    for (int pos=0; pos<=seqlen; pos++) {
+        int site = 0;
+        while (site < sites.get_num_sites() && sites.positions[site] < pos)
+            site++;
+        EXPECT_EQ(site, sites.find_site(pos));
+    }
+    int first, last;
+    sites.get_site_range(20, 54, &first, &last);
+    EXPECT_EQ(1, first);
+    EXPECT_EQ(3, last);
+    sites.get_site_range(54, 20, &first, &last);
+    EXPECT_EQ(first, last);
+
+    SitesMapping mapping;
+    ASSERT_TRUE(find_compress_cols(&sites, 10, &mapping));
+    const int n = mapping.all_sites.size();
+    for (int pos=0; pos<seqlen; pos++) {
+        int pos2 = 0;
+        while (!(mapping.all_sites_start[pos2] <= pos &&
+                 mapping.all_sites_end[pos2] >= pos))
+            pos2++;
+        ASSERT_LT(pos2, n);
+        EXPECT_EQ(pos2, mapping.compress(pos));
+        EXPECT_EQ(pos2, mapping.compress(pos, 0, pos2));
+    }
+}
+
+
+// Adaptive compression should keep every variant site, compress dense
+// segments by --compress-seq and sparse or masked ones by the largest
+// factor, and scale rate maps by the factor of each site.
+TEST(SequencesTest, adaptive_compress_cols)
+{
+    const int seqlen = 60000, compress = 5, max_compress = 50;
+    Sites sites("chr", 0, seqlen);
+    sites.names.push_back("a");
+    sites.names.push_back("b");
+    for (int pos=3; pos<seqlen; pos += (pos < 20000 ? 37 : 4001))
+        sites.append(pos, (char*) "AC", true);
+    TrackNullValue maskmap;
+    maskmap.push_back(RegionNullValue("chr", 40000, 60000, ' '));
+
+    SitesMapping mapping;
+    ASSERT_TRUE(find_compress_cols_adaptive(&sites, compress, max_compress,
+                                            maskmap, &mapping));
+    const int n = mapping.new_end;
+    ASSERT_TRUE(mapping.is_adaptive());
+    ASSERT_EQ(n, (int) mapping.all_sites.size());
+    ASSERT_EQ(n, (int) mapping.site_compress.size());
+    EXPECT_EQ(0, mapping.all_sites_start[0]);
+    EXPECT_EQ(seqlen, mapping.all_sites_end[n-1]);
+    for (int i=1; i<n; i++)
+        EXPECT_EQ(mapping.all_sites_end[i-1] + 1, mapping.all_sites_start[i]);
+    for (int i=0; i<sites.get_num_sites(); i++)
+        EXPECT_EQ(sites.positions[i],
+                  mapping.all_sites[mapping.new_sites[i]]);
+    EXPECT_EQ(compress, mapping.get_site_compress(mapping.compress(10000)));
+    EXPECT_EQ(max_compress,
+              mapping.get_site_compress(mapping.compress(50000)));
+    EXPECT_LT(n, seqlen / compress / 2);
+
+    // rates should be scaled site by site and restored when uncompressed
+    const double rate = 1e-8;
+    Track<double> map;
+    map.append("chr", 0, seqlen, rate);
+    compress_track(map, &mapping, compress, true);
+    double total = 0.0;
+    for (unsigned int i=0; i<map.size(); i++) {
+        EXPECT_EQ(rate * mapping.get_site_compress(map[i].start),
+                  map[i].value);
+        total += map[i].value * map[i].length();
+    }
+    EXPECT_NEAR(rate * seqlen, total, rate * max_compress);
+    uncompress_track(map, &mapping, compress, true);
+    EXPECT_EQ(0, map[0].start);
+    EXPECT_EQ(seqlen, map[map.size()-1].end);
+    for (unsigned int i=0; i<map.size(); i++)
+        EXPECT_NEAR(rate, map[i].value, 1e-22);
+}
+
+
+// Files written with the default zip command should read back unchanged,
+// both through the library and with gunzip, for any number of threads.
+TEST(SequencesTest, compress_round_trip)
+{
+    const char *filename = "/tmp/argweaver_test_compress.gz";
+    string text;
+    for (int i=0; i<50000; i++) {
+        char line[100];
+        snprintf(line, sizeof(line), "line %d\t%d\n", i, (i * 7919) % 1013);
+        text += line;
+    }
+
+    for (int nthreads=1; nthreads<=3; nthreads++) {
+        set_compress_threads(nthreads);
+        FILE *out = write_compress(filename);
+        ASSERT_TRUE(out != NULL);
+        EXPECT_EQ(fwrite(text.data(), 1, text.size(), out), text.size());
+        EXPECT_EQ(close_compress(out), 0);
+
+        FILE *in = read_compress(filename);
+        ASSERT_TRUE(in != NULL);
+        string text2;
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+            text2.append(buf, n);
+        EXPECT_EQ(close_compress(in), 0);
+        EXPECT_TRUE(text == text2);
+
+        string cmd = string("gunzip -t ") + filename;
+        EXPECT_EQ(system(cmd.c_str()), 0);
+    }
+    set_compress_threads(1);
+    remove(filename);
+}
+
+
+// The test ARG, for the site queries of packed alignments
+class PackedSeqsTest : public ::testing::Test
+{
+protected:
+    PackedSeqsTest() :
+        model(20, 200e3, 1e4, 1.6e-8, 1.8e-8)
+    {}
+
+    virtual void SetUp()
+    {
+        ASSERT_TRUE(make_test_tree(model, &tree));
+        make_test_trees(model, &trees);
+    }
+
+    ArgModel model;
+    LocalTree tree;
+    LocalTrees trees;
+};
+
+
+// Column queries of the packed alignment should agree with the character
+// alignment, also when the trees only use some of the sequences.
+TEST_F(PackedSeqsTest, packed_seqs)
+{
+    const int nleaves = trees.get_num_leaves();
+    const int seqids[] = {5, 3, 0, 4, 1};
+    for (int i=0; i<nleaves; i++)
+        trees.seqids[i] = seqids[i];
+
+    const int nseqs = 6, seqlen = trees.length();
+    const char *bases = "ACGTN";
+    char seqdata[nseqs][seqlen+1];
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = seqdata[j];
+        for (int i=0; i<seqlen; i++)
+            seqdata[j][i] = (i % 2 == 0) ? bases[irand(5)] :
+                (i % 7 == 0) ? 'N' : 'C';
+        seqdata[j][seqlen] = '\0';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    int noncompat = count_noncompat(&trees, &sequences);
+    int noncompat2 = count_noncompat(&trees, &sequences, 20, 120);
+    sequences.pack();
+    EXPECT_EQ(noncompat, count_noncompat(&trees, &sequences));
+    EXPECT_EQ(noncompat2, count_noncompat(&trees, &sequences, 20, 120));
+
+    const PackedSeqs *packed = sequences.get_packed();
+    uint64_t rows[packed->get_num_words()];
+    packed->get_rows(seqids, nleaves, rows);
+    const char *leaf_seqs[nleaves];
+    for (int i=0; i<nleaves; i++)
+        leaf_seqs[i] = seqs[seqids[i]];
+    for (int i=0; i<seqlen; i++) {
+        for (int j=0; j<nseqs; j++)
+            EXPECT_EQ(seqs[j][i], packed->get_base(j, i));
+
+        bool invariant = true;
+        for (int j=1; j<nleaves; j++)
+            invariant = invariant && leaf_seqs[j][i] == leaf_seqs[0][i];
+        EXPECT_EQ(invariant, packed->is_invariant_site(i, rows));
+
+        int counts[4] = {0, 0, 0, 0};
+        for (int j=0; j<nleaves; j++)
+            if (leaf_seqs[j][i] != 'N')
+                counts[dna2int[(int) leaf_seqs[j][i]]]++;
+        int nalleles = 0;
+        for (int a=0; a<4; a++)
+            nalleles += int(counts[a] > 0);
+        EXPECT_EQ(nalleles, packed->count_alleles(i, rows));
+
+        char ancestral[tree.nnodes], ancestral2[tree.nnodes];
+        parsimony_ancestral_set(&tree, leaf_seqs, i, NULL, 0, ancestral);
+        parsimony_ancestral_set(&tree, packed, seqids, i, NULL, 0,
+                                ancestral2);
+        for (int j=0; j<tree.nnodes; j++)
+            EXPECT_EQ(ancestral[j], ancestral2[j]);
+    }
+}
+
+
+// Counting non-compatible biallelic sites by comparing their splits to the
+// clades of the trees should agree with parsimony.
+TEST_F(PackedSeqsTest, packed_noncompat_splits)
+{
+    const int nseqs = trees.get_num_leaves(), seqlen = trees.length();
+    char seqdata[nseqs][seqlen+1];
+    char *seqs[nseqs];
+    srand(1234);
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = seqdata[j];
+        for (int i=0; i<seqlen; i++)
+            seqdata[j][i] = (i % 10 == 0) ? 'N' : (irand(2) ? 'G' : 'T');
+        seqdata[j][seqlen] = '\0';
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+    int noncompat = count_noncompat(&trees, &sequences);
+    EXPECT_GT(noncompat, 0);
+    sequences.pack();
+    EXPECT_EQ(noncompat, count_noncompat(&trees, &sequences));
+}
+
+
+// Reads a whole stream into a string
+static string read_stream(FILE *stream)
+{
+    string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+        text.append(buf, n);
+    return text;
+}
+
+
+// Writes 'text' as a BGZF file with a tabix index that lists all records
+// of each sequence as one chunk of the root bin.  The text must fit in a
+// single block, so virtual offsets are offsets into the text.  'preset' is
+// the format, sequence, begin and end columns of the index header.
+static void write_tabix_file(const char *filename, const string &text,
+                             const vector<string> &chroms,
+                             const int32_t preset[4])
+{
+    ASSERT_LT(text.size(), 0xff00u);
+    FILE *out = write_compress(filename);
+    ASSERT_TRUE(out != NULL);
+    fwrite(text.data(), 1, text.size(), out);
+    close_compress(out);
+
+    string names;
+    for (unsigned int i=0; i<chroms.size(); i++)
+        names.append(chroms[i].c_str(), chroms[i].size() + 1);
+    string index = "TBI\1";
+    const int32_t header[] = {(int32_t) chroms.size(), preset[0], preset[1],
+                              preset[2], preset[3], '#', 0,
+                              (int32_t) names.size()};
+    index.append((const char*) header, sizeof(header));
+    index.append(names);
+    for (unsigned int i=0; i<chroms.size(); i++) {
+        size_t next = (i + 1 < chroms.size() ?
+                       text.find("\n" + chroms[i+1] + "\t") + 1 :
+                       text.size());
+        const int32_t nbins = 1, nchunks = 1, nintervals = 0;
+        const uint32_t bin = 0;
+        const uint64_t chunk[2] = {text.find("\n" + chroms[i] + "\t") + 1,
+                                   next};
+        index.append((const char*) &nbins, 4);
+        index.append((const char*) &bin, 4);
+        index.append((const char*) &nchunks, 4);
+        index.append((const char*) chunk, sizeof(chunk));
+        index.append((const char*) &nintervals, 4);
+    }
+    out = write_compress((string(filename) + ".tbi").c_str());
+    ASSERT_TRUE(out != NULL);
+    fwrite(index.data(), 1, index.size(), out);
+    close_compress(out);
+}
+
+
+// Region queries should use the tabix index in-process and return the
+// header followed by the overlapping records.
+TEST(SequencesTest, tabix_region_query)
+{
+    const char *filename = "/tmp/argweaver_test_tabix.bed.gz";
+    const string index_file = string(filename) + ".tbi";
+    const string text =
+        "#header\n"
+        "chr1\t0\t10\ta\n"
+        "chr1\t5\t20\tb\n"
+        "chr1\t30\t40\tc\n"
+        "chr2\t0\t100\td\n";
+    // bed preset: 0-based, columns 1-3
+    const int32_t preset[] = {0x10000, 1, 2, 3};
+    write_tabix_file(filename, text, {"chr1", "chr2"}, preset);
+
+    const char *regions[] = {"chr1:12-35", "chr2", "chr1:41-50", "chr3:1-10"};
+    const char *expected[] = {
+        "#header\nchr1\t5\t20\tb\nchr1\t30\t40\tc\n",
+        "#header\nchr2\t0\t100\td\n",
+        "#header\n",
+        "#header\n"};
+    for (int k=0; k<2; k++) {
+        // the second pass reuses the cached index and file handles
+        for (int i=0; i<4; i++) {
+            TabixStream stream(filename, regions[i]);
+            ASSERT_TRUE(stream.stream != NULL);
+            EXPECT_EQ(read_stream(stream.stream), expected[i]) << regions[i];
+        }
+    }
+
+    TabixStream whole(filename, NULL);
+    ASSERT_TRUE(whole.stream != NULL);
+    EXPECT_EQ(read_stream(whole.stream), text);
+    whole.close();
+
+    remove(index_file.c_str());
+    remove(filename);
+}
+
+
+// An index written in-process should answer the same region queries as
+// one written by tabix, across BGZF blocks.
+TEST(SequencesTest, write_tabix_index)
+{
+    const char *filename = "/tmp/argweaver_test_tabix_index.bed.gz";
+    const string index_file = string(filename) + ".tbi";
+    string text = "#header\n";
+    for (int i=0; i<20000; i++) {
+        char line[100];
+        snprintf(line, sizeof(line), "chr1\t%d\t%d\t%d\n",
+                 i * 10, i * 10 + 25, i);
+        text += line;
+    }
+    text += "chr2\t0\t100\td\n";
+
+    FILE *out = write_compress(filename);
+    ASSERT_TRUE(out != NULL);
+    fputs(text.c_str(), out);
+    close_compress(out);
+    ASSERT_TRUE(write_tabix_index(filename));
+
+    TabixStream stream(filename, "chr1:150001-150030");
+    ASSERT_TRUE(stream.stream != NULL);
+    EXPECT_EQ(read_stream(stream.stream),
+              "#header\n"
+              "chr1\t149980\t150005\t14998\n"
+              "chr1\t149990\t150015\t14999\n"
+              "chr1\t150000\t150025\t15000\n"
+              "chr1\t150010\t150035\t15001\n"
+              "chr1\t150020\t150045\t15002\n");
+    stream.close();
+
+    TabixStream chr2(filename, "chr2");
+    ASSERT_TRUE(chr2.stream != NULL);
+    EXPECT_EQ(read_stream(chr2.stream), "#header\nchr2\t0\t100\td\n");
+    chr2.close();
+
+    // unsorted files cannot be indexed
+    out = write_compress(filename);
+    fputs("chr1\t50\t60\ta\nchr1\t10\t20\tb\n", out);
+    close_compress(out);
+    EXPECT_FALSE(write_tabix_index(filename));
+
+    remove(index_file.c_str());
+    remove(filename);
+}
+
+
+// Sites files should read the same from a mapped file, a stream and the
+// binary format, and subregions should select the same sites.
+TEST(SequencesTest, sites_binary_round_trip)
+{
+    const char *text_file = "/tmp/argweaver_test.sites";
+    const char *binary_file = "/tmp/argweaver_test.sites.bin";
+    FILE *out = fopen(text_file, "w");
+    ASSERT_TRUE(out != NULL);
+    fprintf(out, "#NAMES\ta\tb\tc\n#REGION\tchr\t1\t1000\r\n");
+    for (int pos=5; pos<1000; pos+=11)
+        fprintf(out, "%d\t%s\n", pos, (pos % 3 ? "ACa" : "NnG"));
+    fclose(out);
+
+    Sites sites;
+    ASSERT_TRUE(read_sites(text_file, &sites));
+    EXPECT_EQ("chr", sites.chrom);
+    EXPECT_EQ(0, sites.start_coord);
+    EXPECT_EQ(1000, sites.end_coord);
+    ASSERT_EQ(3, sites.get_num_seqs());
+    EXPECT_EQ("c", sites.names[2]);
+    EXPECT_EQ(91, sites.get_num_sites());
+    EXPECT_EQ(string("ACA"), sites.cols[0]);
+
+    Sites sites2;
+    FILE *in = fopen(text_file, "r");
+    ASSERT_TRUE(in != NULL);
+    ASSERT_TRUE(read_sites(in, &sites2));
+    fclose(in);
+    EXPECT_EQ(sites.positions, sites2.positions);
+
+    out = fopen(binary_file, "w");
+    ASSERT_TRUE(out != NULL);
+    EXPECT_TRUE(write_sites_binary(out, &sites, true));
+    fclose(out);
+
+    Sites sites3;
+    ASSERT_TRUE(read_sites(binary_file, &sites3));
+    EXPECT_EQ(sites.chrom, sites3.chrom);
+    EXPECT_EQ(sites.names, sites3.names);
+    EXPECT_EQ(sites.start_coord, sites3.start_coord);
+    EXPECT_EQ(sites.end_coord, sites3.end_coord);
+    ASSERT_EQ(sites.positions, sites3.positions);
+    for (int i=0; i<sites.get_num_sites(); i++)
+        EXPECT_EQ(string(sites.cols[i]), string(sites3.cols[i]));
+
+    Sites sub, sub2;
+    ASSERT_TRUE(read_sites(text_file, &sub, 100, 200));
+    ASSERT_TRUE(read_sites(binary_file, &sub2, 100, 200));
+    EXPECT_EQ(100, sub2.start_coord);
+    EXPECT_EQ(200, sub2.end_coord);
+    EXPECT_EQ(sub.positions, sub2.positions);
+    EXPECT_EQ(9, sub2.get_num_sites());
+
+    remove(text_file);
+    remove(binary_file);
+}
+
+
+// Reading a subset of the sequences of a binary sites file, whose columns
+// are stored sparsely, should give the sites of Sites::subset().
+TEST(SequencesTest, sites_binary_subset)
+{
+    const char *text_file = "/tmp/argweaver_test_subset.sites";
+    const char *binary_file = "/tmp/argweaver_test_subset.sites.bin";
+    const int nseqs = 40;
+    FILE *out = fopen(text_file, "w");
+    ASSERT_TRUE(out != NULL);
+    fprintf(out, "NAMES");
+    for (int i=0; i<nseqs; i++)
+        fprintf(out, "\tind%d_%d", i / 2, i % 2 + 1);
+    fprintf(out, "\nREGION\tchr\t1\t5000\n");
+    srand(7);
+    for (int pos=3; pos<5000; pos+=13) {
+        // rare variants are stored sparsely, common ones densely
+        char col[nseqs + 1];
+        const int freq = (pos % 4 == 0) ? 2 : 20;
+        for (int i=0; i<nseqs; i++)
+            col[i] = (rand() % 40 < freq) ? 'T' : 'C';
+        col[nseqs] = '\0';
+        if (pos % 7 == 0)
+            col[rand() % nseqs] = 'N';
+        col[pos % nseqs] = 'G';
+        fprintf(out, "%d\t%s\n", pos, col);
+    }
+    fclose(out);
+
+    Sites sites;
+    ASSERT_TRUE(read_sites(text_file, &sites));
+    out = fopen(binary_file, "w");
+    ASSERT_TRUE(out != NULL);
+    EXPECT_TRUE(write_sites_binary(out, &sites, true));
+    fclose(out);
+
+    Sites all;
+    ASSERT_TRUE(read_sites(binary_file, &all));
+    ASSERT_EQ(sites.positions, all.positions);
+    for (int i=0; i<sites.get_num_sites(); i++)
+        EXPECT_EQ(string(sites.cols[i]), string(all.cols[i]));
+
+    // haplotype and individual names
+    set<string> haps, inds;
+    haps.insert("ind3_2");
+    haps.insert("ind0_1");
+    haps.insert("ind11_1");
+    inds.insert("ind5");
+    inds.insert("ind17");
+    const set<string> *subsets[] = {&haps, &inds};
+    for (int k=0; k<2; k++) {
+        Sites expected, sub, sub_text;
+        ASSERT_TRUE(read_sites(text_file, &expected, 1000, 4000));
+        ASSERT_EQ(0, expected.subset(*subsets[k]));
+        ASSERT_TRUE(read_sites_subset(binary_file, &sub, *subsets[k],
+                                      1000, 4000));
+        ASSERT_TRUE(read_sites_subset(text_file, &sub_text, *subsets[k],
+                                      1000, 4000));
+        EXPECT_EQ(expected.names, sub.names);
+        EXPECT_EQ(1000, sub.start_coord);
+        EXPECT_EQ(4000, sub.end_coord);
+        ASSERT_EQ(expected.positions, sub.positions);
+        ASSERT_EQ(expected.positions, sub_text.positions);
+        EXPECT_LT(sub.get_num_sites(), all.get_num_sites());
+        for (int i=0; i<expected.get_num_sites(); i++)
+            EXPECT_EQ(string(expected.cols[i]), string(sub.cols[i]));
+    }
+
+    Sites missing;
+    haps.insert("nobody");
+    EXPECT_FALSE(read_sites_subset(binary_file, &missing, haps));
+
+    remove(text_file);
+    remove(binary_file);
+}
+
+
+// Returns a VCF file with diploid samples named <prefix>1, <prefix>2, ...
+// that has a record at every 'step' bases
+static string make_vcf(const char *prefix, int nsamples, int nrecords,
+                       int step)
+{
+    string text = "##fileformat=VCFv4.2\n"
+        "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+    char buf[100];
+    for (int i=0; i<nsamples; i++) {
+        snprintf(buf, sizeof(buf), "\t%s%d", prefix, i + 1);
+        text += buf;
+    }
+    text += "\n";
+    for (int k=0; k<nrecords; k++) {
+        const int pos = (k + 1) * step;
+        snprintf(buf, sizeof(buf), "chr1\t%d\t.\t%c\t%s\t%d\tPASS\t.\tGT:DP",
+                 pos, "ACGT"[k % 4], (k % 7 ? "T" : "T,G"), 20 + k % 50);
+        text += buf;
+        for (int i=0; i<nsamples; i++) {
+            const int h = (k * 31 + i * 17) % 13;
+            snprintf(buf, sizeof(buf), "\t%c|%c:%d", (h % 3 ? '0' : '1'),
+                     (h % 5 ? '0' : (h == 5 ? '.' : '1')), h);
+            text += buf;
+        }
+        text += "\n";
+    }
+    return text;
+}
+
+
+static void expect_same_sites(const Sites &a, const Sites &b)
+{
+    EXPECT_EQ(a.names, b.names);
+    EXPECT_EQ(a.chrom, b.chrom);
+    EXPECT_EQ(a.start_coord, b.start_coord);
+    EXPECT_EQ(a.end_coord, b.end_coord);
+    ASSERT_EQ(a.positions, b.positions);
+    for (unsigned int i=0; i<a.positions.size(); i++)
+        EXPECT_EQ(string(a.cols[i]), string(b.cols[i])) << a.positions[i];
+}
+
+
+// VCF records parsed in parallel batches, and VCF files read in parallel,
+// should give the same sites as reading them one at a time.
+TEST(SequencesTest, read_vcf_threads)
+{
+    string text = make_vcf("s", 4, 7000, 3);
+    Sites sites[2];
+    for (int k=0; k<2; k++) {
+        FILE *in = fmemopen(&text[0], text.size(), "r");
+        ASSERT_TRUE(in != NULL);
+        ASSERT_TRUE(read_vcf(in, &sites[k], 0, "DP>10", false, 0, false,
+                             set<string>(), k == 0 ? 1 : 3));
+        fclose(in);
+    }
+    EXPECT_EQ(8u, sites[0].names.size());
+    EXPECT_EQ(7000, sites[0].get_num_sites());
+    expect_same_sites(sites[0], sites[1]);
+
+    // per-sample files with records at different positions
+    const int nfiles = 3;
+    const int steps[nfiles] = {4, 6, 10};
+    const int32_t preset[] = {2, 1, 2, 0};
+    vector<string> filenames;
+    for (int i=0; i<nfiles; i++) {
+        char filename[100], prefix[10];
+        snprintf(filename, sizeof(filename),
+                 "/tmp/argweaver_test_%d.vcf.gz", i);
+        snprintf(prefix, sizeof(prefix), "f%d_", i);
+        filenames.push_back(filename);
+        write_tabix_file(filename, make_vcf(prefix, 2, 200, steps[i]),
+                         {"chr1"}, preset);
+    }
+
+    const string region = "chr1:1-1500";
+    Sites expected;
+    ASSERT_TRUE(read_vcf(filenames[0], &expected, region, 0, "", false, 0,
+                         true));
+    for (int i=1; i<nfiles; i++) {
+        Sites file_sites;
+        ASSERT_TRUE(read_vcf(filenames[i], &file_sites, region, 0, "", false,
+                             0, true));
+        ASSERT_TRUE(expected.merge(file_sites));
+    }
+    vector<int> keep;
+    for (int i=0; i<expected.get_num_seqs(); i++)
+        if (expected.names[i] != "REF")
+            keep.push_back(i);
+    expected.subset(keep);
+    EXPECT_EQ(12, expected.get_num_seqs());
+
+    for (int nthreads=1; nthreads<=3; nthreads+=2) {
+        Sites merged;
+        ASSERT_TRUE(read_vcfs(filenames, &merged, region, 0, "", false, 0,
+                              "", set<string>(), nthreads));
+        expect_same_sites(expected, merged);
+    }
+
+    for (int i=0; i<nfiles; i++) {
+        remove(filenames[i].c_str());
+        remove((filenames[i] + ".tbi").c_str());
+    }
+}
+
+
+
+// An input bundle should read back the compressed sites, their mapping,
+// the masks and the rate maps.
+TEST(SequencesTest, input_bundle_round_trip)
+{
+    InputBundle bundle;
+    bundle.compress_seq = 10;
+    bundle.unphased = true;
+    bundle.seq_region.set("chr", 0, 10000);
+    Sites &sites = bundle.sites;
+    sites.chrom = "chr";
+    sites.start_coord = 0;
+    sites.end_coord = 10000;
+    sites.names.push_back("a");
+    sites.names.push_back("b");
+    for (int pos=7; pos<10000; pos+=113)
+        sites.append(pos, (char*) (pos % 2 ? "AC" : "NG"), true);
+    bundle.compress_max = 40;
+    ASSERT_TRUE(find_compress_cols_adaptive(&sites, bundle.compress_seq,
+                                            bundle.compress_max,
+                                            TrackNullValue(),
+                                            &bundle.sites_mapping));
+    compress_sites(&sites, &bundle.sites_mapping);
+    bundle.maskmap.push_back(RegionNullValue("chr", 100, 200, 0));
+    bundle.ind_maskmap.resize(2);
+    bundle.ind_maskmap[1].push_back(RegionNullValue("chr", 50, 60, 0));
+    bundle.recombmap.push_back(RegionValue<double>("chr", 0, 10000, 1.5e-8));
+
+    const char *filename = "/tmp/argweaver_test.bundle";
+    ASSERT_TRUE(write_input_bundle(filename, &bundle));
+    InputBundle bundle2;
+    ASSERT_TRUE(read_input_bundle(filename, &bundle2));
+    remove(filename);
+
+    EXPECT_EQ(10, bundle2.compress_seq);
+    EXPECT_EQ(40, bundle2.compress_max);
+    EXPECT_TRUE(bundle2.unphased);
+    EXPECT_EQ(10000, bundle2.seq_region.end);
+    expect_same_sites(bundle.sites, bundle2.sites);
+    const SitesMapping &m = bundle.sites_mapping, &m2 = bundle2.sites_mapping;
+    EXPECT_EQ(m.new_end, m2.new_end);
+    EXPECT_EQ(m.seqlen, m2.seqlen);
+    EXPECT_EQ(m.old_sites, m2.old_sites);
+    EXPECT_EQ(m.all_sites_start, m2.all_sites_start);
+    EXPECT_EQ(m.all_sites_end, m2.all_sites_end);
+    EXPECT_EQ(m.site_compress, m2.site_compress);
+    ASSERT_EQ(1u, bundle2.maskmap.size());
+    EXPECT_EQ(200, bundle2.maskmap[0].end);
+    ASSERT_EQ(2u, bundle2.ind_maskmap.size());
+    EXPECT_EQ(0u, bundle2.ind_maskmap[0].size());
+    EXPECT_EQ(50, bundle2.ind_maskmap[1][0].start);
+    ASSERT_EQ(1u, bundle2.recombmap.size());
+    EXPECT_EQ(1.5e-8, bundle2.recombmap[0].value);
+    EXPECT_EQ(0u, bundle2.mutmap.size());
+}
+
+// Reads all lines of a stream
+static vector<string> read_lines(FILE *stream)
+{
+    vector<string> lines;
+    char *line;
+    while ((line = fgetline(stream)) != NULL) {
+        lines.push_back(line);
+        delete [] line;
+    }
+    return lines;
+}
+
+
+// Archive queries should give the lines of a bed file for the queried
+// samples and region, in file order.
+TEST(SequencesTest, arg_archive_query)
+{
+    // three samples with lines long enough to need several blocks each
+    vector<string> lines;
+    vector<int> line_samples, line_starts;
+    lines.push_back("##spr-keyframe=1000\n");
+    const string tree(900, 'x');
+    for (int chrom=1; chrom<=2; chrom++) {
+        for (int start=0; start<50000; start+=100) {
+            for (int sample=0; sample<30; sample+=10) {
+                if (sample == 20 && start % 300 != 0)
+                    continue;
+                const int end = start + (sample == 20 ? 300 : 100);
+                char line[1000];
+                snprintf(line, sizeof(line), "chr%d\t%d\t%d\t%d\t%s\n",
+                         chrom, start, end, sample, tree.c_str());
+                lines.push_back(line);
+                line_samples.push_back(sample);
+                line_starts.push_back(chrom == 1 ? start : -1);
+            }
+        }
+    }
+
+    const char *bedfile = "/tmp/argweaver_test_archive.bed";
+    const char *filename = "/tmp/argweaver_test.arga";
+    FILE *out = fopen(bedfile, "w");
+    for (unsigned int i=0; i<lines.size(); i++)
+        fputs(lines[i].c_str(), out);
+    fclose(out);
+    FILE *in = fopen(bedfile, "r");
+    ASSERT_TRUE(write_arg_archive(in, filename));
+    fclose(in);
+    remove(bedfile);
+
+    ArgArchive archive;
+    EXPECT_FALSE(is_arg_archive(bedfile));
+    ASSERT_TRUE(is_arg_archive(filename));
+    ASSERT_TRUE(archive.open(filename));
+    ASSERT_EQ(3u, archive.get_samples().size());
+    EXPECT_EQ(20, archive.get_samples()[2]);
+    EXPECT_GT(archive.blocks[0].size(), 2u);
+
+    // whole archive
+    FILE *stream = archive.query(NULL, archive.get_samples());
+    ASSERT_TRUE(stream != NULL);
+    EXPECT_EQ(lines, read_lines(stream));
+    fclose(stream);
+
+    // a subset of samples in a region
+    vector<int> samples;
+    samples.push_back(0);
+    samples.push_back(20);
+    samples.push_back(5);
+    stream = archive.query("chr1:10001-20000", samples);
+    ASSERT_TRUE(stream != NULL);
+    vector<string> expected(1, lines[0]);
+    for (unsigned int i=1; i<lines.size(); i++) {
+        const int start = line_starts[i-1];
+        const int end = start + (line_samples[i-1] == 20 ? 300 : 100);
+        if (line_samples[i-1] != 10 && start >= 0 &&
+            start < 20000 && end > 10000)
+            expected.push_back(lines[i]);
+    }
+    EXPECT_EQ(expected, read_lines(stream));
+    fclose(stream);
+
+    // unknown sequence gives the header only
+    stream = archive.query("chrX:1-100", samples);
+    ASSERT_TRUE(stream != NULL);
+    EXPECT_EQ(vector<string>(1, lines[0]), read_lines(stream));
+    fclose(stream);
+    remove(filename);
+}
+
+// Phases started within a phase should be its children in the profile,
+// and a phase started within itself should count as one call.
+TEST(ProfileTest, nested_scopes)
+{
+    clear_profile();
+    {
+        ProfileScope forward(PROFILE_FORWARD);
+        for (int i=0; i<3; i++) {
+            ProfileScope matrices(PROFILE_MATRICES);
+            ProfileScope nested(PROFILE_MATRICES);
+        }
+    }
+    {
+        ProfileScope io(PROFILE_IO);
+    }
+
+    FILE *stream = tmpfile();
+    ASSERT_TRUE(stream != NULL);
+    write_profile(stream);
+    rewind(stream);
+    vector<string> lines;
+    char *line;
+    while ((line = fgetline(stream))) {
+        lines.push_back(line);
+        delete [] line;
+    }
+    fclose(stream);
+
+    // phases, then the memory of each subsystem
+    ASSERT_EQ(4u + 1 + MEM_NTAGS, lines.size());
+    char name[100];
+    long long ncalls;
+    double total, self;
+    EXPECT_EQ(4, sscanf(lines[1].c_str(), "%s %lld %lf %lf",
+                        name, &ncalls, &total, &self));
+    EXPECT_EQ(string("forward"), name);
+    EXPECT_EQ(1, ncalls);
+    EXPECT_EQ(0u, lines[2].find("  matrices"));
+    EXPECT_EQ(4, sscanf(lines[2].c_str(), "%s %lld %lf %lf",
+                        name, &ncalls, &total, &self));
+    EXPECT_EQ(3, ncalls);
+    EXPECT_EQ(string("io"), lines[3].substr(0, 2));
+    EXPECT_EQ(0u, lines[4].find("memory"));
+    EXPECT_EQ(0u, lines[5].find(get_memory_tag_name(MEM_FORWARD)));
+
+    // nothing is written once the profile is cleared
+    clear_profile();
+    stream = tmpfile();
+    write_profile(stream);
+    EXPECT_EQ(0, ftell(stream));
+    fclose(stream);
+}
+
+
+// The cache should drop the least recently used strings first.
+TEST(QueryServerTest, text_cache)
+{
+    TextCache cache(10);
+    cache.put("a", shared_ptr<string>(new string("1234")));
+    cache.put("b", shared_ptr<string>(new string("1234")));
+    EXPECT_EQ("1234", *cache.get("a"));
+    cache.put("c", shared_ptr<string>(new string("1234")));
+    EXPECT_TRUE(cache.get("b") == NULL);
+    EXPECT_TRUE(cache.get("a") != NULL);
+    EXPECT_TRUE(cache.get("c") != NULL);
+    EXPECT_EQ(8u, cache.size());
+
+    // replacing a string updates the size; strings that are too large
+    // are not kept
+    cache.put("a", shared_ptr<string>(new string("12")));
+    EXPECT_EQ(6u, cache.size());
+    cache.put("d", shared_ptr<string>(new string(11, 'x')));
+    EXPECT_TRUE(cache.get("d") == NULL);
+    EXPECT_EQ(6u, cache.size());
+}
+
+
+// Queries are words or JSON arrays of strings.
+TEST(QueryServerTest, parse_query_args)
+{
+    vector<string> args;
+    ASSERT_TRUE(parse_query_args(" -r chr1:1-100\t--tmrca ", &args));
+    ASSERT_EQ(3u, args.size());
+    EXPECT_EQ("chr1:1-100", args[1]);
+    EXPECT_EQ("--tmrca", args[2]);
+
+    ASSERT_TRUE(parse_query_args("[\"-s\", \"my file\", \"a\\\"b\"]",
+                                 &args));
+    ASSERT_EQ(3u, args.size());
+    EXPECT_EQ("my file", args[1]);
+    EXPECT_EQ("a\"b", args[2]);
+    ASSERT_TRUE(parse_query_args("[]", &args));
+    EXPECT_EQ(0u, args.size());
+
+    EXPECT_FALSE(parse_query_args("[\"-T\",]", &args));
+    EXPECT_FALSE(parse_query_args("[\"-T\"", &args));
+    EXPECT_FALSE(parse_query_args("[-T]", &args));
+    EXPECT_FALSE(parse_query_args("[\"-T\"] x", &args));
+}
+
+// Sketched summaries should be exact for few scores and close to the
+// exact summaries for many.
+TEST(IntervalTest, score_sketch)
+{
+    const double qs[] = {0.0, 0.025, 0.5, 0.975, 1.0};
+    const vector<double> q(qs, qs + 5);
+    ScoreSketch sketch(100);
+    vector<double> scores;
+    srand(3);
+    for (int i=0; i<100000; i++) {
+        double x = 0;
+        for (int j=0; j<4; j++)
+            x += rand() / (double) RAND_MAX;
+        scores.push_back(x);
+        sketch.add(x);
+        if (i == 99) {
+            vector<double> tmp = scores;
+            EXPECT_EQ(compute_quantiles(tmp, q), sketch.quantiles(q));
+        }
+    }
+    EXPECT_EQ(sketch.count(), 100000);
+    const double mean = compute_mean(scores);
+    EXPECT_NEAR(mean, sketch.mean(), 1e-9);
+    EXPECT_NEAR(compute_stdev(scores, mean), sketch.stdev(), 1e-9);
+
+    // compute_quantiles can average the two largest scores at q=1, so only
+    // compare inner quantiles
+    const vector<double> q2(qs + 1, qs + 4);
+    vector<double> exact = compute_quantiles(scores, q2);
+    vector<double> approx = sketch.quantiles(q2);
+    for (unsigned int i=0; i<q2.size(); i++)
+        EXPECT_NEAR(exact[i], approx[i], 0.02) << q2[i];
+}
+
+
+// Overlapping segments should give the same summaries with sketches as
+// with stored scores.
+TEST(IntervalTest, interval_iterator_sketches)
+{
+    IntervalIterator<vector<double> > exact, sketched(100);
+    for (int i=0; i<50; i++) {
+        vector<double> score(2, i);
+        score[1] = i * i;
+        exact.append("chr1", i, i + 20, score);
+        sketched.append("chr1", i, i + 20, score);
+    }
+    exact.finish();
+    sketched.finish();
+
+    const vector<double> q(1, 0.5);
+    int nintervals = 0;
+    while (true) {
+        Interval<vector<double> > a = exact.next(), b = sketched.next();
+        ASSERT_EQ(a.start, b.start);
+        ASSERT_EQ(a.end, b.end);
+        if (a.start == a.end)
+            break;
+        nintervals++;
+        ASSERT_TRUE(b.is_sketched());
+        ASSERT_EQ(a.num_score(), b.num_score());
+        ASSERT_EQ(b.get_sketches().size(), 2u);
+        for (int j=0; j<2; j++) {
+            vector<double> values;
+            for (int k=0; k<a.num_score(); k++)
+                values.push_back(a.get_score(k)[j]);
+            EXPECT_NEAR(compute_mean(values), b.get_sketches()[j].mean(),
+                        1e-9);
+            EXPECT_EQ(compute_quantiles(values, q),
+                      b.get_sketches()[j].quantiles(q));
+        }
+    }
+    EXPECT_EQ(nintervals, 69);
+}
+
+} // namespace argweaver
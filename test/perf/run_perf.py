@@ -0,0 +1,226 @@
+#!/usr/bin/env python
+"""
+End-to-end performance of arg-sample, smc2bed and arg-summarize.
+
+Each dataset is sampled with a fixed seed, its samples are merged with
+smc2bed and summarized with arg-summarize.  The time, peak memory and
+output size of each step are compared with a stored baseline:
+
+    make perf             # compare with test/perf/baseline.tsv
+    make perf-baseline    # write the baseline
+
+Datasets are examples/sim1 and a larger set simulated with bin/arg-sim,
+which is skipped if it cannot be simulated.  Times and memory are
+machine dependent; the baseline should be written on the machine used for
+comparisons.
+"""
+
+from __future__ import print_function
+
+import optparse
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+
+SAMPLE_ARGS = ("-N 10000 -r 1.6e-8 -m 1.8e-8 --ntimes 20 --maxtime 200e3 "
+               "--randseed 1 --stats-perf -q")
+
+# name, sites file, simulation arguments, arg-sample arguments
+DATASETS = [
+    ("sim1", "examples/sim1/sim1.sites", None, "-c 10 -n 100"),
+    ("large", "data/large.sites",
+     "-k 20 -L 1000000 -N 10000 -r 1.6e-8 -m 1.8e-8 --seed 1",
+     "-c 20 -n 20"),
+]
+
+# metrics compared with the size tolerance; others use the time tolerance
+SIZE_METRICS = ("smc_bytes", "bed_bytes", "summary_bytes")
+
+# times that are not regressions unless also this many seconds slower,
+# since short steps vary a lot between runs
+TIME_SLACK = 0.1
+
+
+def run_cmd(cmd, stdout=None):
+    """
+    Run a command and return its time in seconds and peak memory in MB.
+    """
+    print(cmd, file=sys.stderr)
+    start = time.time()
+    proc = subprocess.Popen(cmd, shell=True, stdout=stdout)
+    _, status, usage = os.wait4(proc.pid, 0)
+    proc.returncode = status
+    secs = time.time() - start
+    if status != 0:
+        raise Exception("command failed (%d): %s" % (status, cmd))
+    return secs, usage.ru_maxrss / 1024.0
+
+
+def read_seconds_per_iter(stats_file):
+    """
+    Return the mean time of the resampling iterations in a stats file.
+    """
+    with open(stats_file) as infile:
+        header = infile.readline().rstrip("\n").split("\t")
+        stage = header.index("stage")
+        iter_time = header.index("iter_time")
+        times = []
+        for line in infile:
+            row = line.rstrip("\n").split("\t")
+            if row[stage] == "resample" and int(row[1]) > 0:
+                times.append(float(row[iter_time]))
+    return sum(times) / len(times)
+
+
+def run_dataset(name, sites, sim_args, sample_args, outdir):
+    """
+    Run the programs on one dataset and return its metrics.
+    """
+    if os.path.exists(outdir):
+        shutil.rmtree(outdir)
+    os.makedirs(outdir)
+
+    if sim_args:
+        if not os.path.exists(sites):
+            if not os.path.exists(os.path.dirname(sites)):
+                os.makedirs(os.path.dirname(sites))
+            run_cmd("PYTHONPATH=. bin/arg-sim %s -o %s > /dev/null" %
+                    (sim_args, sites[:-len(".sites")]))
+
+    metrics = []
+    out = os.path.join(outdir, "out")
+    secs, rss = run_cmd("bin/arg-sample -s %s %s %s -o %s" %
+                        (sites, SAMPLE_ARGS, sample_args, out))
+    smc_files = sorted(os.path.join(outdir, f) for f in os.listdir(outdir)
+                       if f.endswith(".smc.gz"))
+    metrics.append(("sample_seconds", secs))
+    metrics.append(("seconds_per_iter",
+                    read_seconds_per_iter(out + ".stats")))
+    metrics.append(("sample_max_rss_mb", rss))
+    metrics.append(("smc_bytes", sum(os.path.getsize(f) for f in smc_files)))
+
+    bed = out + ".bed.gz"
+    secs, rss = run_cmd("bin/smc2bed --output %s %s > /dev/null" %
+                        (bed, " ".join(smc_files)))
+    metrics.append(("smc2bed_seconds", secs))
+    metrics.append(("smc2bed_max_rss_mb", rss))
+    metrics.append(("bed_bytes", os.path.getsize(bed)))
+
+    summary = out + ".summary.txt"
+    with open(summary, "w") as outfile:
+        secs, rss = run_cmd("bin/arg-summarize -a %s -l %s.log -T -B -R "
+                            "--mean --quantile 0.025,0.975" % (bed, out),
+                            stdout=outfile)
+    metrics.append(("summarize_seconds", secs))
+    metrics.append(("summarize_max_rss_mb", rss))
+    metrics.append(("summary_bytes", os.path.getsize(summary)))
+
+    return [(name, metric, value) for metric, value in metrics]
+
+
+def read_baseline(filename):
+    baseline = {}
+    with open(filename) as infile:
+        for line in infile:
+            if line.startswith("#"):
+                continue
+            dataset, metric, value = line.rstrip("\n").split("\t")
+            baseline[(dataset, metric)] = float(value)
+    return baseline
+
+
+def write_baseline(filename, results):
+    with open(filename, "w") as out:
+        out.write("#dataset\tmetric\tvalue\n")
+        for dataset, metric, value in results:
+            out.write("%s\t%s\t%g\n" % (dataset, metric, value))
+
+
+def compare(results, baseline, tolerance, size_tolerance):
+    """
+    Print each metric against its baseline and return the number of
+    metrics above the baseline by more than their tolerance.
+    """
+    nfail = 0
+    print("\t".join(["dataset", "metric", "baseline", "value", "ratio",
+                     "status"]))
+    for dataset, metric, value in results:
+        base = baseline.get((dataset, metric))
+        if base is None:
+            ratio = None
+            status = "new"
+        else:
+            ratio = value / base if base > 0 else float(value > 0) + 1.0
+            tol = size_tolerance if metric in SIZE_METRICS else tolerance
+            slack = TIME_SLACK if metric.endswith("seconds") else 0.0
+            if ratio > 1.0 + tol and value - base > slack:
+                status = "REGRESSED"
+                nfail += 1
+            elif ratio < 1.0 - tol:
+                status = "improved"
+            else:
+                status = "ok"
+        print("%s\t%s\t%s\t%g\t%s\t%s" % (
+            dataset, metric, "-" if base is None else "%g" % base, value,
+            "-" if ratio is None else "%.3f" % ratio, status))
+    return nfail
+
+
+def main(argv):
+    o = optparse.OptionParser(usage="%prog [OPTIONS]")
+    o.add_option("-b", "--baseline", default="test/perf/baseline.tsv",
+                 help="baseline file (default=%default)")
+    o.add_option("-w", "--write-baseline", action="store_true",
+                 help="write the results as the new baseline")
+    o.add_option("-d", "--dataset", action="append",
+                 help="run only this dataset (may be repeated)")
+    o.add_option("-t", "--tolerance", type="float", default=0.25,
+                 help="allowed relative increase of times and memory "
+                 "(default=%default)")
+    o.add_option("-s", "--size-tolerance", type="float", default=0.01,
+                 help="allowed relative increase of output sizes "
+                 "(default=%default)")
+    o.add_option("-o", "--outdir", default="test/tmp/perf",
+                 help="directory of outputs (default=%default)")
+    o.add_option("-r", "--repeat", type="int", default=1,
+                 help="run each dataset this many times and keep the "
+                 "smallest value of each metric (default=%default)")
+    conf, args = o.parse_args(argv[1:])
+    if args:
+        o.error("unexpected arguments")
+
+    results = []
+    for name, sites, sim_args, sample_args in DATASETS:
+        if conf.dataset and name not in conf.dataset:
+            continue
+        if sim_args:
+            sites = os.path.join(conf.outdir, sites)
+        try:
+            runs = [run_dataset(name, sites, sim_args, sample_args,
+                                os.path.join(conf.outdir, name))
+                    for i in range(conf.repeat)]
+            results.extend((name, metric, min(run[j][2] for run in runs))
+                           for j, (_, metric, _)
+                           in enumerate(runs[0]))
+        except Exception as e:
+            if not sim_args or os.path.exists(sites):
+                raise
+            print("skipping dataset %s: %s" % (name, e), file=sys.stderr)
+
+    if conf.write_baseline:
+        write_baseline(conf.baseline, results)
+        return 0
+
+    baseline = read_baseline(conf.baseline)
+    nfail = compare(results, baseline, conf.tolerance, conf.size_tolerance)
+    if nfail:
+        print("%d metrics regressed" % nfail, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))